@@ -5797,6 +5797,13 @@ typedef struct {
     */
    nir_instr_filter_cb avoid_instr_cb;
 
+   /* Optional filter for instructions which may be moved to the preamble at
+    * all, for backends which can only run a subset of NIR in their preamble.
+    * Instructions this returns false for, and anything depending on them,
+    * stay in the main shader.
+    */
+   nir_instr_filter_cb can_move_instr_cb;
+
    const void *cb_data;
 } nir_opt_preamble_options;
 
@@ -166,6 +166,10 @@ visit_intrinsic(nir_shader *shader, nir_intrinsic_instr *instr)
    case nir_intrinsic_load_ring_attr_amd:
    case nir_intrinsic_load_ring_attr_offset_amd:
    case nir_intrinsic_load_sample_positions_pan:
+   case nir_intrinsic_load_xfb_index_buffer_pan:
+   case nir_intrinsic_load_xfb_index_format_pan:
+   case nir_intrinsic_load_vertex_fetch_buffer_pan:
+   case nir_intrinsic_load_vertex_fetch_layout_pan:
    case nir_intrinsic_load_workgroup_num_input_vertices_amd:
    case nir_intrinsic_load_workgroup_num_input_primitives_amd:
    case nir_intrinsic_load_pipeline_stat_query_enabled_amd:
@@ -1291,6 +1291,24 @@ load("sampler_lod_parameters_pan", [1], flags=[CAN_ELIMINATE, CAN_REORDER])
 # Loads the sample position array on Bifrost, in a packed Arm-specific format
 system_value("sample_positions_pan", 1, bit_sizes=[64])
 
+# Index buffer of the draw for the Panfrost transform feedback program, which
+# fetches its own indices. The address is aligned down to 4 bytes, and the
+# format is <index size in bytes, or 0 if not indexed, byte offset of the first
+# index from the address>.
+system_value("xfb_index_buffer_pan", 1, bit_sizes=[64])
+system_value("xfb_index_format_pan", 2)
+
+# Vertex attribute BASE fetched by the Panfrost vertex shader itself, see
+# pan_lower_vertex_fetch. The address is of the attribute in the first vertex,
+# and the layout is <stride, bytes from the address to the end of the buffer>.
+system_value("vertex_fetch_buffer_pan", 1, bit_sizes=[64], indices=[BASE])
+system_value("vertex_fetch_layout_pan", 2, indices=[BASE])
+
+# Buffers of the Panfrost geometry shader emulation, see pan_lower_gs. BASE is
+# a pan_gs_buffer, selecting the vertices written by the vertex shader, or the
+# vertices and indices written by the geometry shader.
+system_value("gs_buffer_pan", 1, bit_sizes=[64], indices=[BASE])
+
 # R600 specific instrincs
 #
 # location where the tesselation data is stored in LDS
@@ -362,7 +362,9 @@ nir_opt_preamble(nir_shader *shader, const nir_opt_preamble_options *options,
 
          def_state *state = &ctx.states[def->index];
 
-         state->can_move = can_move_instr(instr, &ctx);
+         state->can_move = can_move_instr(instr, &ctx) &&
+                           (!options->can_move_instr_cb ||
+                            options->can_move_instr_cb(instr, options->cb_data));
       }
    }
 
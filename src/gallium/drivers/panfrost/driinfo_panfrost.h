@@ -0,0 +1,15 @@
+// panfrost-specific driconf options
+
+DRI_CONF_SECTION_PERFORMANCE
+   DRI_CONF_PAN_FP16_COLOR(false)
+   DRI_CONF_PAN_EXPLICIT_SYNC(false)
+   DRI_CONF_PAN_MAX_FRAMES_IN_FLIGHT(0)
+   DRI_CONF_PAN_GOFASTER(false)
+   DRI_CONF_PAN_NO_AFBC(false)
+   DRI_CONF_PAN_NO_CRC(false)
+   DRI_CONF_PAN_UNCACHED_CPU(false)
+   DRI_CONF_PAN_UNCACHED_GPU(false)
+   DRI_CONF_PAN_CACHED_POOLS(false)
+   DRI_CONF_PAN_BO_CACHE_MAX_SIZE(0)
+   DRI_CONF_PAN_CACHED_READ_THRESHOLD(4)
+DRI_CONF_SECTION_END
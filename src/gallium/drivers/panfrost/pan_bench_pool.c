@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Sub-allocation from a batch pool, as done for every descriptor. The pool
+ * is backed by the no-op kbase device and recycled every 1024 allocations,
+ * like a batch pool is at each flush. */
+
+#include "util/ralloc.h"
+
+#include "pan_bench.h"
+#include "pan_device.h"
+#include "pan_mempool.h"
+
+struct pool_bench {
+        struct panfrost_device *dev;
+        unsigned size, alignment;
+};
+
+static int64_t
+bench_pool(void *data, unsigned ops)
+{
+        struct pool_bench *b = data;
+        struct panfrost_pool pool;
+
+        panfrost_pool_init(&pool, NULL, b->dev, 0, 65536, "Benchmark pool",
+                           false, true);
+
+        for (unsigned i = 0; i < ops; ++i) {
+                struct panfrost_ptr ptr =
+                        pan_pool_alloc_aligned(&pool.base, b->size, b->alignment);
+
+                pan_bench_consume(ptr.gpu);
+
+                if ((i & 1023) == 1023) {
+                        panfrost_pool_cleanup(&pool);
+                        panfrost_pool_init(&pool, NULL, b->dev, 0, 65536,
+                                           "Benchmark pool", false, true);
+                }
+        }
+
+        panfrost_pool_cleanup(&pool);
+        return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+        void *memctx = ralloc_context(NULL);
+        struct panfrost_device *dev = rzalloc(memctx, struct panfrost_device);
+
+        panfrost_open_device(memctx, -1, dev);
+
+        if (!dev->model) {
+                printf("pool: no-op device unavailable, skipping\n");
+                ralloc_free(memctx);
+                return 0;
+        }
+
+        struct pool_bench benches[] = {
+                { dev, 32, 32 },
+                { dev, 64, 64 },
+                { dev, 256, 64 },
+                { dev, 4096, 4096 },
+        };
+
+        for (unsigned i = 0; i < ARRAY_SIZE(benches); ++i) {
+                char name[64];
+                snprintf(name, sizeof(name), "pan_pool_alloc_aligned %u/%u",
+                         benches[i].size, benches[i].alignment);
+
+                pan_bench_run(name, bench_pool, &benches[i], 0);
+        }
+
+        panfrost_close_device(dev);
+        ralloc_free(memctx);
+        return 0;
+}
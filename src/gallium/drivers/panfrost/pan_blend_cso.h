@@ -29,6 +29,7 @@
 #define __PAN_BLEND_CSO_H
 
 #include "pan_blend.h"
+#include "pan_format.h"
 #include "util/hash_table.h"
 #include "nir.h"
 
@@ -52,8 +53,37 @@ struct panfrost_blend_state {
 
         /* info.load presented as a bitfield for draw call hot paths */
         unsigned load_dest_mask : PIPE_MAX_COLOR_BUFS;
+
+        /* Number of times blend shaders were emitted for this state */
+        unsigned shader_uses;
 };
 
+/* On Valhall, a blend state that needed blend shaders this many times is
+ * considered stable, and is folded into the fragment shader instead. Fused
+ * variants are keyed on the blend state, so cap them per shader. */
+#define PAN_BLEND_FUSE_USES 16
+#define PAN_MAX_FUSED_BLEND_VARIANTS 4
+
+/* Whether the fragment shader variant depends on the blend state on Valhall */
+
+static inline bool
+panfrost_blend_keys_fs(const struct panfrost_blend_state *so)
+{
+        return so && (so->base.logicop_enable ||
+                      so->shader_uses >= PAN_BLEND_FUSE_USES);
+}
+
+/* On Valhall, logic ops on render targets of these formats are lowered into
+ * the fragment shader, and the blend unit only stores the result */
+
+static inline bool
+panfrost_logicop_in_shader(enum pipe_format format)
+{
+        return panfrost_blendable_formats_v7[format].internal &&
+               !util_format_is_float(format) &&
+               !util_format_is_srgb(format);
+}
+
 mali_ptr
 panfrost_get_blend(struct panfrost_batch *batch, unsigned rt, struct panfrost_bo **bo, unsigned *shader_offset);
 
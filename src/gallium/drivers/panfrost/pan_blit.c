@@ -29,7 +29,13 @@
 
 #include "pan_context.h"
 #include "pan_util.h"
+#include "pan_tracepoints.h"
 #include "util/format/u_format.h"
+#include "util/u_inlines.h"
+#include "util/u_memory.h"
+#include "util/u_surface.h"
+#include "util/u_transfer.h"
+#include "compiler/nir/nir_builder.h"
 
 void
 panfrost_blitter_save(struct panfrost_context *ctx, bool render_cond)
@@ -67,6 +73,86 @@ panfrost_blitter_save(struct panfrost_context *ctx, bool render_cond)
 
 }
 
+/* Resolving the colour buffer a queued batch renders to needs no blit: the
+ * batch averages the samples of its tile buffer into the destination on
+ * writeback. Invalidating the multisampled buffer afterwards then spares it
+ * from being written out at all, see panfrost_discard_resolved_rsrc. */
+
+static bool
+panfrost_blit_resolve_on_tile(struct panfrost_context *ctx,
+                              const struct pipe_blit_info *info)
+{
+        struct pipe_resource *src = info->src.resource;
+        struct pipe_resource *dst = info->dst.resource;
+        const struct pipe_box *sbox = &info->src.box;
+        const struct pipe_box *dbox = &info->dst.box;
+
+        if (src->nr_samples <= 1 || dst->nr_samples > 1 ||
+            !(dst->bind & PIPE_BIND_RENDER_TARGET) ||
+            info->mask != PIPE_MASK_RGBA || info->sample0_only ||
+            info->scissor_enable || info->num_window_rectangles ||
+            info->alpha_blend || info->src.format != info->dst.format ||
+            util_format_is_pure_integer(info->dst.format))
+                return false;
+
+        if (sbox->x || sbox->y || dbox->x || dbox->y ||
+            sbox->width != dbox->width || sbox->height != dbox->height ||
+            sbox->depth != 1 || dbox->depth != 1)
+                return false;
+
+        struct panfrost_batch *batch =
+                panfrost_resource_writer(ctx, pan_resource(src));
+
+        if (!batch || batch->key.width != sbox->width ||
+            batch->key.height != sbox->height)
+                return false;
+
+        for (unsigned i = 0; i < batch->key.nr_cbufs; ++i) {
+                struct pipe_surface *surf = batch->key.cbufs[i];
+
+                if (!surf || surf->texture != src ||
+                    surf->format != info->src.format ||
+                    surf->u.tex.level != info->src.level ||
+                    surf->u.tex.first_layer != sbox->z ||
+                    surf->u.tex.last_layer != sbox->z)
+                        continue;
+
+                struct panfrost_resource *rsrc = pan_resource(dst);
+
+                if (rsrc->pending_clear.valid)
+                        return false;
+
+                struct pipe_surface tmpl = {
+                        .format = info->dst.format,
+                        .u.tex = {
+                                .level = info->dst.level,
+                                .first_layer = dbox->z,
+                                .last_layer = dbox->z,
+                        },
+                };
+
+                struct pipe_surface *rsurf =
+                        ctx->base.create_surface(&ctx->base, dst, &tmpl);
+
+                if (!rsurf)
+                        return false;
+
+                bool ok = false;
+
+                /* Legalizing the destination may flush the batch */
+                pan_resource_unpack_afbc(ctx, rsrc, "Resolving to packed AFBC");
+                pan_legalize_afbc_format(ctx, rsrc, info->dst.format);
+
+                if (panfrost_resource_writer(ctx, pan_resource(src)) == batch)
+                        ok = panfrost_batch_add_resolve(batch, i, rsurf);
+
+                pipe_surface_reference(&rsurf, NULL);
+                return ok;
+        }
+
+        return false;
+}
+
 void
 panfrost_blit(struct pipe_context *pipe,
               const struct pipe_blit_info *info)
@@ -77,9 +163,1509 @@ panfrost_blit(struct pipe_context *pipe,
             !panfrost_render_condition_check(ctx))
                 return;
 
+        if (panfrost_blit_resolve_on_tile(ctx, info))
+                return;
+
         if (!util_blitter_is_blit_supported(ctx->blitter, info))
                 unreachable("Unsupported blit\n");
 
         panfrost_blitter_save(ctx, info->render_condition_enable);
+
+        /* Conversions label their blits themselves */
+        bool label = !ctx->blitter_trace.op;
+
+        if (label)
+                ctx->blitter_trace.op = "blit";
+
         util_blitter_blit(ctx->blitter, info);
+
+        if (label)
+                ctx->blitter_trace.op = NULL;
+}
+
+/* Every u_blitter operation ends up drawing rectangles, wrap them in
+ * tracepoints so the blits and quad clears show up in GPU traces, labelled
+ * by ctx->blitter_trace */
+void
+panfrost_blitter_draw_rectangle(struct blitter_context *blitter,
+                                void *vertex_elements_cso,
+                                blitter_get_vs_func get_vs,
+                                int x1, int y1, int x2, int y2,
+                                float depth, unsigned num_instances,
+                                enum blitter_attrib_type type,
+                                const union blitter_attrib *attrib)
+{
+        struct panfrost_context *ctx = pan_context(blitter->pipe);
+        struct panfrost_batch *batch = panfrost_get_batch_for_fbo(ctx);
+        const char *op = ctx->blitter_trace.op;
+        const char *detail = ctx->blitter_trace.detail;
+
+        trace_start_blitter(&batch->trace, batch, op ? op : "blitter",
+                            detail ? detail : "", x2 - x1, y2 - y1);
+
+        util_blitter_draw_rectangle(blitter, vertex_elements_cso, get_vs,
+                                    x1, y1, x2, y2, depth, num_instances,
+                                    type, attrib);
+
+        /* The draw may have needed a fresh batch */
+        batch = panfrost_get_batch_for_fbo(ctx);
+        trace_end_blitter(&batch->trace, batch);
+}
+
+/* CPU reads of AFBC resources need the mapped box in a linear staging
+ * resource. Instead of a fragment blit, which needs a framebuffer batch
+ * covering the staging resource, fetch the texels with a compute shader and
+ * store them through an image. The texture unit does the decompression, and
+ * only the superblocks under the box are read. */
+
+static void *
+panfrost_afbc_unpack_create(struct panfrost_context *ctx,
+                            enum pan_afbc_unpack_type type)
+{
+        struct pipe_context *pctx = &ctx->base;
+        const nir_shader_compiler_options *options =
+                pctx->screen->get_compiler_options(pctx->screen,
+                                                   PIPE_SHADER_IR_NIR,
+                                                   PIPE_SHADER_COMPUTE);
+
+        static const nir_alu_type types[] = {
+                [PAN_AFBC_UNPACK_FLOAT] = nir_type_float32,
+                [PAN_AFBC_UNPACK_SINT] = nir_type_int32,
+                [PAN_AFBC_UNPACK_UINT] = nir_type_uint32,
+        };
+
+        nir_builder b =
+                nir_builder_init_simple_shader(MESA_SHADER_COMPUTE, options,
+                                               "afbc_unpack");
+
+        b.shader->info.workgroup_size[0] = 8;
+        b.shader->info.workgroup_size[1] = 8;
+        b.shader->info.workgroup_size[2] = 1;
+        b.shader->info.num_ubos = 1;
+        b.shader->info.num_textures = 1;
+        b.shader->info.num_images = 1;
+        BITSET_SET(b.shader->info.textures_used, 0);
+        BITSET_SET(b.shader->info.textures_used_by_txf, 0);
+        BITSET_SET(b.shader->info.images_used, 0);
+
+        /* Parameters: origin of the box in the source (x, y, layer), then
+         * its width and height */
+        nir_ssa_def *params =
+                nir_load_ubo(&b, 4, 32, nir_imm_int(&b, 0), nir_imm_int(&b, 0),
+                             .align_mul = 16, .align_offset = 0,
+                             .range_base = 0, .range = 32);
+        nir_ssa_def *size =
+                nir_load_ubo(&b, 2, 32, nir_imm_int(&b, 0), nir_imm_int(&b, 16),
+                             .align_mul = 16, .align_offset = 0,
+                             .range_base = 0, .range = 32);
+
+        nir_ssa_def *id = nir_load_global_invocation_id(&b, 32);
+        nir_ssa_def *in_box =
+                nir_ball(&b, nir_ult(&b, nir_channels(&b, id, 0x3), size));
+
+        nir_push_if(&b, in_box);
+        {
+                nir_ssa_def *coord =
+                        nir_iadd(&b, id, nir_channels(&b, params, 0x7));
+
+                nir_tex_instr *tex = nir_tex_instr_create(b.shader, 2);
+                tex->op = nir_texop_txf;
+                tex->dest_type = types[type];
+                tex->texture_index = 0;
+                tex->sampler_index = 0;
+                tex->is_array = true;
+                tex->sampler_dim = GLSL_SAMPLER_DIM_2D;
+
+                tex->src[0].src_type = nir_tex_src_coord;
+                tex->src[0].src = nir_src_for_ssa(coord);
+                tex->coord_components = 3;
+
+                tex->src[1].src_type = nir_tex_src_lod;
+                tex->src[1].src = nir_src_for_ssa(nir_imm_int(&b, 0));
+                nir_ssa_dest_init(&tex->instr, &tex->dest, 4, 32, NULL);
+                nir_builder_instr_insert(&b, &tex->instr);
+
+                nir_image_store(&b, nir_imm_int(&b, 0), nir_pad_vec4(&b, id),
+                                nir_ssa_undef(&b, 1, 32), &tex->dest.ssa,
+                                nir_imm_int(&b, 0),
+                                .image_dim = GLSL_SAMPLER_DIM_2D,
+                                .image_array = true,
+                                .src_type = types[type],
+                                .access = ACCESS_NON_READABLE);
+        }
+        nir_pop_if(&b, NULL);
+
+        struct pipe_compute_state cso = {
+                .ir_type = PIPE_SHADER_IR_NIR,
+                .prog = b.shader,
+        };
+
+        return pctx->create_compute_state(pctx, &cso);
+}
+
+/* Unpacks the box of an AFBC level into level 0 of a linear staging resource
+ * with the same format. Returns false if the format cannot be written as an
+ * image, in which case the caller should fall back on a blit. */
+
+bool
+panfrost_afbc_unpack(struct panfrost_context *ctx,
+                     struct panfrost_resource *rsrc, unsigned level,
+                     const struct pipe_box *box,
+                     struct panfrost_resource *staging)
+{
+        struct pipe_context *pctx = &ctx->base;
+        struct pipe_screen *pscreen = pctx->screen;
+        enum pipe_format format = rsrc->base.format;
+        enum pipe_texture_target target = rsrc->base.target;
+
+        if (target != PIPE_TEXTURE_2D && target != PIPE_TEXTURE_2D_ARRAY &&
+            target != PIPE_TEXTURE_CUBE && target != PIPE_TEXTURE_CUBE_ARRAY)
+                return false;
+
+        if (rsrc->base.nr_samples > 1 || util_format_is_depth_or_stencil(format) ||
+            staging->base.format != format ||
+            !pscreen->is_format_supported(pscreen, format, PIPE_TEXTURE_2D, 0, 0,
+                                          PIPE_BIND_SHADER_IMAGE))
+                return false;
+
+        enum pan_afbc_unpack_type type =
+                util_format_is_pure_sint(format) ? PAN_AFBC_UNPACK_SINT :
+                util_format_is_pure_uint(format) ? PAN_AFBC_UNPACK_UINT :
+                PAN_AFBC_UNPACK_FLOAT;
+
+        if (!ctx->afbc_unpack[type])
+                ctx->afbc_unpack[type] = panfrost_afbc_unpack_create(ctx, type);
+
+        struct pipe_sampler_view view_tmpl = {
+                .format = format,
+                .target = PIPE_TEXTURE_2D_ARRAY,
+                .u.tex.first_level = level,
+                .u.tex.last_level = level,
+                .u.tex.first_layer = 0,
+                .u.tex.last_layer = util_num_layers(&rsrc->base, level) - 1,
+                .swizzle_r = PIPE_SWIZZLE_X,
+                .swizzle_g = PIPE_SWIZZLE_Y,
+                .swizzle_b = PIPE_SWIZZLE_Z,
+                .swizzle_a = PIPE_SWIZZLE_W,
+        };
+
+        struct pipe_sampler_view *view =
+                pctx->create_sampler_view(pctx, &rsrc->base, &view_tmpl);
+
+        struct pipe_image_view image = {
+                .resource = &staging->base,
+                .format = format,
+                .access = PIPE_IMAGE_ACCESS_WRITE,
+                .shader_access = PIPE_IMAGE_ACCESS_WRITE,
+                .u.tex.level = 0,
+                .u.tex.first_layer = 0,
+                .u.tex.last_layer = box->depth - 1,
+        };
+
+        uint32_t params[8] = {
+                box->x, box->y, box->z, 0,
+                box->width, box->height, 0, 0,
+        };
+
+        struct pipe_constant_buffer cb = {
+                .buffer_size = sizeof(params),
+                .user_buffer = params,
+        };
+
+        /* Save the compute state we are about to clobber */
+        void *saved_cs = ctx->uncompiled[PIPE_SHADER_COMPUTE];
+        struct pipe_sampler_view *saved_view = NULL;
+        struct pipe_image_view saved_image = { 0 };
+        struct pipe_constant_buffer saved_cb = { 0 };
+        bool saved_cb_enabled =
+                ctx->constant_buffer[PIPE_SHADER_COMPUTE].enabled_mask & BITFIELD_BIT(0);
+
+        pipe_sampler_view_reference(&saved_view,
+                        (struct pipe_sampler_view *) ctx->sampler_views[PIPE_SHADER_COMPUTE][0]);
+        util_copy_image_view(&saved_image, &ctx->images[PIPE_SHADER_COMPUTE][0]);
+        util_copy_constant_buffer(&saved_cb,
+                        &ctx->constant_buffer[PIPE_SHADER_COMPUTE].cb[0], false);
+
+        pctx->bind_compute_state(pctx, ctx->afbc_unpack[type]);
+        pctx->set_sampler_views(pctx, PIPE_SHADER_COMPUTE, 0, 1, 0, false, &view);
+        pctx->set_shader_images(pctx, PIPE_SHADER_COMPUTE, 0, 1, 0, &image);
+        pctx->set_constant_buffer(pctx, PIPE_SHADER_COMPUTE, 0, false, &cb);
+
+        struct pipe_grid_info grid = {
+                .block = { 8, 8, 1 },
+                .grid = {
+                        DIV_ROUND_UP(box->width, 8),
+                        DIV_ROUND_UP(box->height, 8),
+                        box->depth,
+                },
+        };
+
+        pctx->launch_grid(pctx, &grid);
+
+        /* Restore the state */
+        pctx->bind_compute_state(pctx, saved_cs);
+        pctx->set_sampler_views(pctx, PIPE_SHADER_COMPUTE, 0, 1, 0, false,
+                                &saved_view);
+        pctx->set_shader_images(pctx, PIPE_SHADER_COMPUTE, 0, 1, 0,
+                                saved_image.resource ? &saved_image : NULL);
+        pctx->set_constant_buffer(pctx, PIPE_SHADER_COMPUTE, 0, true,
+                                  saved_cb_enabled ? &saved_cb : NULL);
+
+        pipe_sampler_view_reference(&saved_view, NULL);
+        pipe_resource_reference(&saved_image.resource, NULL);
+        pipe_sampler_view_reference(&view, NULL);
+
+        return true;
+}
+
+/* Packed AFBC. The GPU places the body of each superblock at a fixed
+ * worst-case offset, so mostly solid or well-compressed images leave most of
+ * the body unused. Packing runs two compute passes over the superblocks of a
+ * resource which is no longer rendered to: the first reads each header and
+ * writes the actual size of the body, the CPU turns sizes into offsets, and
+ * the second copies headers and bodies to a tightly packed BO. */
+
+#define PAN_AFBC_PACK_ALIGN 16
+
+struct pan_afbc_block_info {
+        uint32_t offset;
+        uint32_t size;
+};
+
+/* Loads one 32-bit parameter dword from the user UBO */
+static nir_ssa_def *
+load_param(nir_builder *b, unsigned dword)
+{
+        return nir_load_ubo(b, 1, 32, nir_imm_int(b, 0),
+                            nir_imm_int(b, dword * 4),
+                            .align_mul = 4, .align_offset = 0,
+                            .range_base = 0, .range = ~0);
+}
+
+static nir_ssa_def *
+load_param_addr(nir_builder *b, unsigned dword)
+{
+        return nir_pack_64_2x32_split(b, load_param(b, dword),
+                                      load_param(b, dword + 1));
+}
+
+static nir_ssa_def *
+address_offset(nir_builder *b, nir_ssa_def *base, nir_ssa_def *offset)
+{
+        return nir_iadd(b, base, nir_u2u64(b, offset));
+}
+
+/* Size of the body of a superblock in bytes given its header. A sub-block
+ * size of 1 means an uncompressed sub-block, and a zero sized first sub-block
+ * means the whole superblock is a solid colour stored in the header. */
+static nir_ssa_def *
+get_superblock_size(nir_builder *b, nir_ssa_def *hdr,
+                    nir_ssa_def *uncompressed_size)
+{
+        nir_ssa_def *size = nir_imm_int(b, 0);
+        nir_ssa_def *solid = NULL;
+
+        for (unsigned i = 0; i < 16; ++i) {
+                unsigned bit = 32 + (i * 6);
+                unsigned start = bit / 32, end = (bit + 5) / 32;
+                nir_ssa_def *sz;
+
+                if (start != end) {
+                        sz = nir_ior(b, nir_ushr_imm(b, nir_channel(b, hdr, start), bit % 32),
+                                     nir_ishl_imm(b, nir_channel(b, hdr, end), 32 - (bit % 32)));
+                        sz = nir_iand_imm(b, sz, 0x3f);
+                } else {
+                        sz = nir_ubfe_imm(b, nir_channel(b, hdr, start), bit % 32, 6);
+                }
+
+                if (i == 0)
+                        solid = nir_ieq_imm(b, sz, 0);
+
+                sz = nir_bcsel(b, nir_ieq_imm(b, sz, 1), uncompressed_size, sz);
+                size = nir_iadd(b, size, sz);
+        }
+
+        size = nir_iand_imm(b, nir_iadd_imm(b, size, PAN_AFBC_PACK_ALIGN - 1),
+                            ~(PAN_AFBC_PACK_ALIGN - 1));
+
+        return nir_bcsel(b, solid, nir_imm_int(b, 0), size);
+}
+
+static nir_builder
+panfrost_afbc_pack_builder(struct panfrost_context *ctx, const char *name)
+{
+        struct pipe_screen *pscreen = ctx->base.screen;
+        const nir_shader_compiler_options *options =
+                pscreen->get_compiler_options(pscreen, PIPE_SHADER_IR_NIR,
+                                              PIPE_SHADER_COMPUTE);
+
+        nir_builder b =
+                nir_builder_init_simple_shader(MESA_SHADER_COMPUTE, options,
+                                               "%s", name);
+
+        b.shader->info.workgroup_size[0] = 64;
+        b.shader->info.workgroup_size[1] = 1;
+        b.shader->info.workgroup_size[2] = 1;
+        b.shader->info.num_ubos = 1;
+
+        return b;
+}
+
+static void *
+panfrost_afbc_pack_finish(struct panfrost_context *ctx, nir_builder *b)
+{
+        struct pipe_compute_state cso = {
+                .ir_type = PIPE_SHADER_IR_NIR,
+                .prog = b->shader,
+        };
+
+        return ctx->base.create_compute_state(&ctx->base, &cso);
+}
+
+/* Parameters: header address, info array address, superblock count and
+ * uncompressed sub-block size */
+static void *
+panfrost_afbc_size_create(struct panfrost_context *ctx)
+{
+        nir_builder b = panfrost_afbc_pack_builder(ctx, "afbc_size");
+        nir_ssa_def *idx = nir_channel(&b, nir_load_global_invocation_id(&b, 32), 0);
+
+        nir_push_if(&b, nir_ult(&b, idx, load_param(&b, 4)));
+        {
+                nir_ssa_def *hdr =
+                        nir_load_global(&b, address_offset(&b, load_param_addr(&b, 0),
+                                                           nir_imul_imm(&b, idx, 16)),
+                                        16, 4, 32);
+                nir_ssa_def *size = get_superblock_size(&b, hdr, load_param(&b, 5));
+                nir_ssa_def *info =
+                        address_offset(&b, load_param_addr(&b, 2),
+                                       nir_imul_imm(&b, idx, sizeof(struct pan_afbc_block_info)));
+
+                nir_store_global(&b, nir_iadd_imm(&b, info, 4), 4, size, 0x1);
+        }
+        nir_pop_if(&b, NULL);
+
+        return panfrost_afbc_pack_finish(ctx, &b);
+}
+
+/* Parameters: source header address, destination header address, info
+ * array address, superblock count and header size of the destination */
+static void *
+panfrost_afbc_pack_create(struct panfrost_context *ctx)
+{
+        nir_builder b = panfrost_afbc_pack_builder(ctx, "afbc_pack");
+        nir_ssa_def *idx = nir_channel(&b, nir_load_global_invocation_id(&b, 32), 0);
+
+        nir_push_if(&b, nir_ult(&b, idx, load_param(&b, 6)));
+        {
+                nir_ssa_def *src = load_param_addr(&b, 0);
+                nir_ssa_def *dst = load_param_addr(&b, 2);
+                nir_ssa_def *hdr_offset = nir_imul_imm(&b, idx, 16);
+                nir_ssa_def *hdr =
+                        nir_load_global(&b, address_offset(&b, src, hdr_offset),
+                                        16, 4, 32);
+                nir_ssa_def *info =
+                        nir_load_global(&b, address_offset(&b, load_param_addr(&b, 4),
+                                                           nir_imul_imm(&b, idx, sizeof(struct pan_afbc_block_info))),
+                                        8, 2, 32);
+                nir_ssa_def *size = nir_channel(&b, info, 1);
+                nir_ssa_def *new_offset =
+                        nir_iadd(&b, load_param(&b, 7), nir_channel(&b, info, 0));
+
+                nir_variable *hdr_var =
+                        nir_local_variable_create(b.impl, glsl_uvec4_type(), "hdr");
+                nir_store_var(&b, hdr_var, hdr, 0xf);
+
+                /* Solid colour superblocks keep their header as is */
+                nir_push_if(&b, nir_ine_imm(&b, size, 0));
+                {
+                        nir_ssa_def *from =
+                                address_offset(&b, src, nir_channel(&b, hdr, 0));
+                        nir_ssa_def *to = address_offset(&b, dst, new_offset);
+
+                        nir_variable *i =
+                                nir_local_variable_create(b.impl, glsl_uint_type(), "i");
+                        nir_store_var(&b, i, nir_imm_int(&b, 0), 0x1);
+
+                        nir_push_loop(&b);
+                        {
+                                nir_ssa_def *off = nir_load_var(&b, i);
+
+                                nir_push_if(&b, nir_uge(&b, off, size));
+                                nir_jump(&b, nir_jump_break);
+                                nir_pop_if(&b, NULL);
+
+                                nir_ssa_def *data =
+                                        nir_load_global(&b, address_offset(&b, from, off),
+                                                        16, 4, 32);
+                                nir_store_global(&b, address_offset(&b, to, off),
+                                                 16, data, 0xf);
+
+                                nir_store_var(&b, i, nir_iadd_imm(&b, off, 16), 0x1);
+                        }
+                        nir_pop_loop(&b, NULL);
+
+                        nir_store_var(&b, hdr_var,
+                                      nir_vector_insert_imm(&b, hdr, new_offset, 0),
+                                      0xf);
+                }
+                nir_pop_if(&b, NULL);
+
+                nir_store_global(&b, address_offset(&b, dst, hdr_offset), 16,
+                                 nir_load_var(&b, hdr_var), 0xf);
+        }
+        nir_pop_if(&b, NULL);
+
+        return panfrost_afbc_pack_finish(ctx, &b);
+}
+
+/* Runs a 1D AFBC pack kernel over the superblocks, saving and restoring the
+ * compute state it clobbers, and waits for the result */
+static void
+panfrost_afbc_pack_dispatch(struct panfrost_context *ctx, void *cs,
+                            const uint32_t *params, unsigned params_size,
+                            unsigned nr_blocks)
+{
+        struct pipe_context *pctx = &ctx->base;
+        struct pipe_screen *pscreen = pctx->screen;
+
+        void *saved_cs = ctx->uncompiled[PIPE_SHADER_COMPUTE];
+        struct pipe_constant_buffer saved_cb = { 0 };
+        bool saved_cb_enabled =
+                ctx->constant_buffer[PIPE_SHADER_COMPUTE].enabled_mask & BITFIELD_BIT(0);
+
+        util_copy_constant_buffer(&saved_cb,
+                        &ctx->constant_buffer[PIPE_SHADER_COMPUTE].cb[0], false);
+
+        struct pipe_constant_buffer cb = {
+                .buffer_size = params_size,
+                .user_buffer = params,
+        };
+
+        pctx->bind_compute_state(pctx, cs);
+        pctx->set_constant_buffer(pctx, PIPE_SHADER_COMPUTE, 0, false, &cb);
+
+        struct pipe_grid_info grid = {
+                .block = { 64, 1, 1 },
+                .grid = { DIV_ROUND_UP(nr_blocks, 64), 1, 1 },
+        };
+
+        pctx->launch_grid(pctx, &grid);
+
+        pctx->bind_compute_state(pctx, saved_cs);
+        pctx->set_constant_buffer(pctx, PIPE_SHADER_COMPUTE, 0, true,
+                                  saved_cb_enabled ? &saved_cb : NULL);
+
+        /* The kernels access memory through raw addresses, which the batch
+         * does not track, so wait for everything */
+        struct pipe_fence_handle *fence = NULL;
+        pctx->flush(pctx, &fence, 0);
+        pscreen->fence_finish(pscreen, NULL, fence, PIPE_TIMEOUT_INFINITE);
+        pscreen->fence_reference(pscreen, &fence, NULL);
+}
+
+/* Packs the AFBC body of a single-level, single-layer resource into a new,
+ * smaller BO. Returns false if packing is not possible or saves too little
+ * memory to be worth it, leaving the resource unchanged. */
+
+bool
+panfrost_afbc_pack(struct panfrost_context *ctx,
+                   struct panfrost_resource *rsrc)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct pan_image_layout *layout = &rsrc->image.layout;
+        struct pan_image_slice_layout *slice = &layout->slices[0];
+        struct panfrost_bo *src = rsrc->image.data.bo;
+
+        assert(drm_is_afbc(layout->modifier));
+
+        /* Tiled headers are not in raster order, keep the code simple. CRCs
+         * would have to move with the body. */
+        if ((layout->modifier & AFBC_FORMAT_MOD_TILED) || layout->crc)
+                return false;
+
+        struct pan_block_size sb = panfrost_afbc_superblock_size(layout->modifier);
+        unsigned nr_blocks = (slice->row_stride / AFBC_HEADER_BYTES_PER_TILE) *
+                             DIV_ROUND_UP(rsrc->base.height0, sb.height);
+        unsigned uncompressed_size =
+                16 * util_format_get_blocksize(layout->format);
+
+        if (!ctx->afbc_pack.size_cs) {
+                ctx->afbc_pack.size_cs = panfrost_afbc_size_create(ctx);
+                ctx->afbc_pack.pack_cs = panfrost_afbc_pack_create(ctx);
+        }
+
+        struct panfrost_bo *info_bo =
+                panfrost_bo_create(dev, nr_blocks * sizeof(struct pan_afbc_block_info),
+                                   PAN_BO_CACHEABLE, "AFBC pack metadata");
+
+        if (!info_bo)
+                return false;
+
+        mali_ptr src_hdr = src->ptr.gpu + slice->offset;
+
+        uint32_t size_params[] = {
+                src_hdr, src_hdr >> 32,
+                info_bo->ptr.gpu, info_bo->ptr.gpu >> 32,
+                nr_blocks, uncompressed_size,
+        };
+
+        panfrost_afbc_pack_dispatch(ctx, ctx->afbc_pack.size_cs, size_params,
+                                    sizeof(size_params), nr_blocks);
+
+        panfrost_bo_mem_invalidate(info_bo, 0, info_bo->size);
+
+        struct pan_afbc_block_info *info = info_bo->ptr.cpu;
+        uint32_t body_size = 0;
+
+        for (unsigned i = 0; i < nr_blocks; ++i) {
+                info[i].offset = body_size;
+                body_size += info[i].size;
+        }
+
+        size_t header_size = slice->afbc.header_size;
+        size_t packed_size = header_size + body_size;
+
+        /* Not worth a copy and a new BO */
+        if (packed_size > (src->size * 3) / 4) {
+                panfrost_bo_unreference(info_bo);
+                return false;
+        }
+
+        panfrost_bo_mem_clean(info_bo, 0, info_bo->size);
+
+        struct panfrost_bo *dst =
+                panfrost_bo_create(dev, packed_size,
+                                   src->flags & ~PAN_BO_DELAY_MMAP,
+                                   "Packed AFBC");
+
+        if (!dst) {
+                panfrost_bo_unreference(info_bo);
+                return false;
+        }
+
+        panfrost_bo_set_category(dst, PAN_MEM_RESOURCE);
+
+        uint32_t pack_params[] = {
+                src_hdr, src_hdr >> 32,
+                dst->ptr.gpu, dst->ptr.gpu >> 32,
+                info_bo->ptr.gpu, info_bo->ptr.gpu >> 32,
+                nr_blocks, header_size,
+        };
+
+        panfrost_afbc_pack_dispatch(ctx, ctx->afbc_pack.pack_cs, pack_params,
+                                    sizeof(pack_params), nr_blocks);
+
+        panfrost_bo_unreference(info_bo);
+
+        perf_debug_ctx(ctx, "Packed AFBC from %zu to %zu bytes",
+                       (size_t) src->size, packed_size);
+
+        panfrost_resource_swap_bo(ctx, rsrc, dst);
+
+        slice->afbc.body_size = body_size;
+        slice->size = packed_size;
+        layout->data_size = packed_size;
+        rsrc->afbc_packed = true;
+
+        ctx->stats.afbc_packs++;
+        return true;
+}
+
+/* Mipmap generation with a compute shader computing several levels per
+ * dispatch, in the spirit of AMD's single pass downsampler. Each 8x8
+ * workgroup samples the source level bilinearly to get an 8x8 tile of the
+ * first level, then halves it in shared memory for the next levels, down to
+ * a single texel. util_gen_mipmap would instead need a render pass, with its
+ * preload and writeback, per level. */
+
+#define PAN_MIPMAP_WG_SIZE 8
+#define PAN_MIPMAP_LEVELS_PER_PASS 4
+
+/* Ping-pong buffers of one vec4 per invocation, so a level can be written
+ * while the previous one is being read by other invocations */
+#define PAN_MIPMAP_SHARED_SIZE \
+        (2 * PAN_MIPMAP_WG_SIZE * PAN_MIPMAP_WG_SIZE * 16)
+
+static nir_ssa_def *
+mipmap_shared_offset(nir_builder *b, unsigned buffer, nir_ssa_def *x,
+                     nir_ssa_def *y)
+{
+        unsigned base = buffer * PAN_MIPMAP_WG_SIZE * PAN_MIPMAP_WG_SIZE * 16;
+        nir_ssa_def *idx = nir_iadd(b, nir_imul_imm(b, y, PAN_MIPMAP_WG_SIZE), x);
+
+        return nir_iadd_imm(b, nir_imul_imm(b, idx, 16), base);
+}
+
+static void
+mipmap_store_level(nir_builder *b, unsigned level, nir_ssa_def *pos,
+                   nir_ssa_def *layer, nir_ssa_def *value)
+{
+        nir_ssa_def *size = nir_vec2(b, load_param(b, 4 + (level * 2)),
+                                     load_param(b, 5 + (level * 2)));
+        nir_ssa_def *in_level =
+                nir_iand(b, nir_ult(b, nir_imm_int(b, level), load_param(b, 0)),
+                         nir_ball(b, nir_ult(b, pos, size)));
+
+        nir_push_if(b, in_level);
+        {
+                nir_ssa_def *coord =
+                        nir_vec4(b, nir_channel(b, pos, 0), nir_channel(b, pos, 1),
+                                 layer, nir_ssa_undef(b, 1, 32));
+
+                nir_image_store(b, nir_imm_int(b, level), coord,
+                                nir_ssa_undef(b, 1, 32), value,
+                                nir_imm_int(b, 0),
+                                .image_dim = GLSL_SAMPLER_DIM_2D,
+                                .image_array = true,
+                                .src_type = nir_type_float32,
+                                .access = ACCESS_NON_READABLE);
+        }
+        nir_pop_if(b, NULL);
+}
+
+/* Parameters: number of levels to write, then the width and height of each
+ * level written, starting at dword 4 */
+static void *
+panfrost_mipmap_create(struct panfrost_context *ctx)
+{
+        struct pipe_context *pctx = &ctx->base;
+        const nir_shader_compiler_options *options =
+                pctx->screen->get_compiler_options(pctx->screen,
+                                                   PIPE_SHADER_IR_NIR,
+                                                   PIPE_SHADER_COMPUTE);
+
+        nir_builder b =
+                nir_builder_init_simple_shader(MESA_SHADER_COMPUTE, options,
+                                               "mipmap");
+
+        b.shader->info.workgroup_size[0] = PAN_MIPMAP_WG_SIZE;
+        b.shader->info.workgroup_size[1] = PAN_MIPMAP_WG_SIZE;
+        b.shader->info.workgroup_size[2] = 1;
+        b.shader->info.shared_size = PAN_MIPMAP_SHARED_SIZE;
+        b.shader->info.num_ubos = 1;
+        b.shader->info.num_textures = 1;
+        b.shader->info.num_images = PAN_MIPMAP_LEVELS_PER_PASS;
+        BITSET_SET(b.shader->info.textures_used, 0);
+        BITSET_SET(b.shader->info.samplers_used, 0);
+        BITSET_SET_RANGE(b.shader->info.images_used, 0,
+                         PAN_MIPMAP_LEVELS_PER_PASS - 1);
+
+        nir_ssa_def *wg_id = nir_load_workgroup_id(&b, 32);
+        nir_ssa_def *local = nir_channels(&b, nir_load_local_invocation_id(&b), 0x3);
+        nir_ssa_def *layer = nir_channel(&b, wg_id, 2);
+        nir_ssa_def *pos =
+                nir_iadd(&b, nir_imul_imm(&b, nir_channels(&b, wg_id, 0x3),
+                                          PAN_MIPMAP_WG_SIZE),
+                         local);
+
+        /* First level: a bilinear sample at the centre of the destination
+         * texel averages the 2x2 source texels, like util_gen_mipmap */
+        nir_ssa_def *size = nir_vec2(&b, load_param(&b, 4), load_param(&b, 5));
+        nir_ssa_def *uv =
+                nir_fdiv(&b, nir_fadd_imm(&b, nir_u2f32(&b, pos), 0.5),
+                         nir_u2f32(&b, size));
+
+        nir_tex_instr *tex = nir_tex_instr_create(b.shader, 2);
+        tex->op = nir_texop_txl;
+        tex->dest_type = nir_type_float32;
+        tex->texture_index = 0;
+        tex->sampler_index = 0;
+        tex->is_array = true;
+        tex->sampler_dim = GLSL_SAMPLER_DIM_2D;
+
+        tex->src[0].src_type = nir_tex_src_coord;
+        tex->src[0].src = nir_src_for_ssa(nir_vec3(&b, nir_channel(&b, uv, 0),
+                                                   nir_channel(&b, uv, 1),
+                                                   nir_u2f32(&b, layer)));
+        tex->coord_components = 3;
+
+        tex->src[1].src_type = nir_tex_src_lod;
+        tex->src[1].src = nir_src_for_ssa(nir_imm_float(&b, 0.0));
+        nir_ssa_dest_init(&tex->instr, &tex->dest, 4, 32, NULL);
+        nir_builder_instr_insert(&b, &tex->instr);
+
+        mipmap_store_level(&b, 0, pos, layer, &tex->dest.ssa);
+        nir_store_shared(&b, &tex->dest.ssa,
+                         mipmap_shared_offset(&b, 0, nir_channel(&b, local, 0),
+                                              nir_channel(&b, local, 1)),
+                         .align_mul = 16, .write_mask = 0xf);
+
+        /* Following levels: each remaining invocation averages 2x2 texels of
+         * the previous level. Texels past the edge of an odd-sized level
+         * hold clamped samples, so they don't darken the edges. */
+        for (unsigned level = 1; level < PAN_MIPMAP_LEVELS_PER_PASS; ++level) {
+                unsigned tile = PAN_MIPMAP_WG_SIZE >> level;
+                unsigned src = (level - 1) & 1, dst = level & 1;
+
+                nir_scoped_barrier(&b, .execution_scope = NIR_SCOPE_WORKGROUP,
+                                   .memory_scope = NIR_SCOPE_WORKGROUP,
+                                   .memory_semantics = NIR_MEMORY_ACQ_REL,
+                                   .memory_modes = nir_var_mem_shared);
+
+                nir_push_if(&b, nir_ball(&b, nir_ult(&b, local, nir_imm_ivec2(&b, tile, tile))));
+                {
+                        nir_ssa_def *x = nir_ishl_imm(&b, nir_channel(&b, local, 0), 1);
+                        nir_ssa_def *y = nir_ishl_imm(&b, nir_channel(&b, local, 1), 1);
+                        nir_ssa_def *sum = NULL;
+
+                        for (unsigned i = 0; i < 4; ++i) {
+                                nir_ssa_def *texel =
+                                        nir_load_shared(&b, 4, 32,
+                                                        mipmap_shared_offset(&b, src,
+                                                                             nir_iadd_imm(&b, x, i & 1),
+                                                                             nir_iadd_imm(&b, y, i >> 1)),
+                                                        .align_mul = 16);
+
+                                sum = sum ? nir_fadd(&b, sum, texel) : texel;
+                        }
+
+                        nir_ssa_def *value = nir_fmul_imm(&b, sum, 0.25);
+                        nir_ssa_def *level_pos =
+                                nir_iadd(&b, nir_imul_imm(&b, nir_channels(&b, wg_id, 0x3), tile),
+                                         local);
+
+                        mipmap_store_level(&b, level, level_pos, layer, value);
+                        nir_store_shared(&b, value,
+                                         mipmap_shared_offset(&b, dst,
+                                                              nir_channel(&b, local, 0),
+                                                              nir_channel(&b, local, 1)),
+                                         .align_mul = 16, .write_mask = 0xf);
+                }
+                nir_pop_if(&b, NULL);
+        }
+
+        struct pipe_compute_state cso = {
+                .ir_type = PIPE_SHADER_IR_NIR,
+                .prog = b.shader,
+                .static_shared_mem = PAN_MIPMAP_SHARED_SIZE,
+        };
+
+        return pctx->create_compute_state(pctx, &cso);
+}
+
+/* Generates the levels of a colour resource with the compute shader, up to
+ * PAN_MIPMAP_LEVELS_PER_PASS levels per dispatch. Returns false without
+ * doing anything if the format or layout is not handled, in which case the
+ * caller should fall back on blits. */
+
+bool
+panfrost_compute_mipmap(struct panfrost_context *ctx,
+                        struct panfrost_resource *rsrc,
+                        enum pipe_format format,
+                        unsigned base_level, unsigned last_level,
+                        unsigned first_layer, unsigned last_layer)
+{
+        struct pipe_context *pctx = &ctx->base;
+        struct pipe_screen *pscreen = pctx->screen;
+        enum pipe_texture_target target = rsrc->base.target;
+
+        if (target != PIPE_TEXTURE_2D && target != PIPE_TEXTURE_2D_ARRAY &&
+            target != PIPE_TEXTURE_CUBE && target != PIPE_TEXTURE_CUBE_ARRAY)
+                return false;
+
+        /* Binding AFBC as an image would convert it for good, keep AFBC
+         * resources on the render path which can write them */
+        if (drm_is_afbc(rsrc->image.layout.modifier))
+                return false;
+
+        /* Only formats which can be filtered and stored as floats */
+        if (rsrc->base.nr_samples > 1 || util_format_is_depth_or_stencil(format) ||
+            util_format_is_pure_integer(format) || util_format_is_srgb(format) ||
+            util_format_is_compressed(format) ||
+            !pscreen->is_format_supported(pscreen, format, PIPE_TEXTURE_2D, 0, 0,
+                                          PIPE_BIND_SAMPLER_VIEW |
+                                          PIPE_BIND_SHADER_IMAGE))
+                return false;
+
+        if (!ctx->mipmap.cs) {
+                struct pipe_sampler_state sampler = {
+                        .wrap_s = PIPE_TEX_WRAP_CLAMP_TO_EDGE,
+                        .wrap_t = PIPE_TEX_WRAP_CLAMP_TO_EDGE,
+                        .wrap_r = PIPE_TEX_WRAP_CLAMP_TO_EDGE,
+                        .min_img_filter = PIPE_TEX_FILTER_LINEAR,
+                        .mag_img_filter = PIPE_TEX_FILTER_LINEAR,
+                        .min_mip_filter = PIPE_TEX_MIPFILTER_NONE,
+                };
+
+                ctx->mipmap.cs = panfrost_mipmap_create(ctx);
+                ctx->mipmap.sampler = pctx->create_sampler_state(pctx, &sampler);
+        }
+
+        /* Save the compute state we are about to clobber */
+        void *saved_cs = ctx->uncompiled[PIPE_SHADER_COMPUTE];
+        void *saved_sampler = ctx->samplers[PIPE_SHADER_COMPUTE][0];
+        struct pipe_sampler_view *saved_view = NULL;
+        struct pipe_image_view saved_images[PAN_MIPMAP_LEVELS_PER_PASS] = { 0 };
+        struct pipe_constant_buffer saved_cb = { 0 };
+        bool saved_cb_enabled =
+                ctx->constant_buffer[PIPE_SHADER_COMPUTE].enabled_mask & BITFIELD_BIT(0);
+        uint32_t saved_image_mask = ctx->image_mask[PIPE_SHADER_COMPUTE];
+
+        pipe_sampler_view_reference(&saved_view,
+                        (struct pipe_sampler_view *) ctx->sampler_views[PIPE_SHADER_COMPUTE][0]);
+        util_copy_constant_buffer(&saved_cb,
+                        &ctx->constant_buffer[PIPE_SHADER_COMPUTE].cb[0], false);
+
+        for (unsigned i = 0; i < PAN_MIPMAP_LEVELS_PER_PASS; ++i)
+                util_copy_image_view(&saved_images[i], &ctx->images[PIPE_SHADER_COMPUTE][i]);
+
+        pctx->bind_compute_state(pctx, ctx->mipmap.cs);
+        pctx->bind_sampler_states(pctx, PIPE_SHADER_COMPUTE, 0, 1,
+                                  &ctx->mipmap.sampler);
+
+        for (unsigned src = base_level; src < last_level;
+             src += PAN_MIPMAP_LEVELS_PER_PASS) {
+                unsigned nr_levels =
+                        MIN2(last_level - src, PAN_MIPMAP_LEVELS_PER_PASS);
+
+                struct pipe_sampler_view view_tmpl = {
+                        .format = format,
+                        .target = PIPE_TEXTURE_2D_ARRAY,
+                        .u.tex.first_level = src,
+                        .u.tex.last_level = src,
+                        .u.tex.first_layer = first_layer,
+                        .u.tex.last_layer = last_layer,
+                        .swizzle_r = PIPE_SWIZZLE_X,
+                        .swizzle_g = PIPE_SWIZZLE_Y,
+                        .swizzle_b = PIPE_SWIZZLE_Z,
+                        .swizzle_a = PIPE_SWIZZLE_W,
+                };
+
+                struct pipe_sampler_view *view =
+                        pctx->create_sampler_view(pctx, &rsrc->base, &view_tmpl);
+
+                struct pipe_image_view images[PAN_MIPMAP_LEVELS_PER_PASS];
+                uint32_t params[4 + (2 * PAN_MIPMAP_LEVELS_PER_PASS)] = {
+                        nr_levels,
+                };
+
+                for (unsigned i = 0; i < nr_levels; ++i) {
+                        unsigned level = src + 1 + i;
+
+                        images[i] = (struct pipe_image_view) {
+                                .resource = &rsrc->base,
+                                .format = format,
+                                .access = PIPE_IMAGE_ACCESS_WRITE,
+                                .shader_access = PIPE_IMAGE_ACCESS_WRITE,
+                                .u.tex.level = level,
+                                .u.tex.first_layer = first_layer,
+                                .u.tex.last_layer = last_layer,
+                        };
+
+                        params[4 + (i * 2)] = u_minify(rsrc->base.width0, level);
+                        params[5 + (i * 2)] = u_minify(rsrc->base.height0, level);
+                }
+
+                struct pipe_constant_buffer cb = {
+                        .buffer_size = sizeof(params),
+                        .user_buffer = params,
+                };
+
+                pctx->set_sampler_views(pctx, PIPE_SHADER_COMPUTE, 0, 1, 0,
+                                        false, &view);
+                pctx->set_shader_images(pctx, PIPE_SHADER_COMPUTE, 0, nr_levels,
+                                        PAN_MIPMAP_LEVELS_PER_PASS - nr_levels,
+                                        images);
+                pctx->set_constant_buffer(pctx, PIPE_SHADER_COMPUTE, 0, false, &cb);
+
+                struct pipe_grid_info grid = {
+                        .block = { PAN_MIPMAP_WG_SIZE, PAN_MIPMAP_WG_SIZE, 1 },
+                        .grid = {
+                                DIV_ROUND_UP(params[4], PAN_MIPMAP_WG_SIZE),
+                                DIV_ROUND_UP(params[5], PAN_MIPMAP_WG_SIZE),
+                                last_layer - first_layer + 1,
+                        },
+                };
+
+                pctx->launch_grid(pctx, &grid);
+                pipe_sampler_view_reference(&view, NULL);
+        }
+
+        /* Restore the state */
+        pctx->bind_compute_state(pctx, saved_cs);
+        pctx->bind_sampler_states(pctx, PIPE_SHADER_COMPUTE, 0, 1, &saved_sampler);
+        pctx->set_sampler_views(pctx, PIPE_SHADER_COMPUTE, 0, 1, 0, false,
+                                &saved_view);
+        pctx->set_constant_buffer(pctx, PIPE_SHADER_COMPUTE, 0, true,
+                                  saved_cb_enabled ? &saved_cb : NULL);
+
+        for (unsigned i = 0; i < PAN_MIPMAP_LEVELS_PER_PASS; ++i) {
+                bool bound = saved_image_mask & BITFIELD_BIT(i);
+
+                pctx->set_shader_images(pctx, PIPE_SHADER_COMPUTE, i, 1, 0,
+                                        bound ? &saved_images[i] : NULL);
+                pipe_resource_reference(&saved_images[i].resource, NULL);
+        }
+
+        pipe_sampler_view_reference(&saved_view, NULL);
+        return true;
+}
+
+/* Index translation. Valhall does not draw quads, quad strips or polygons,
+ * so these are drawn as triangle lists. u_primconvert builds the list on the
+ * CPU, mapping the index buffer and so waiting for any GPU write to it. For
+ * index buffers in GPU memory, the list is built by a compute shader instead
+ * and kept with the resource, keyed on the range, primitive type and
+ * provoking vertex, until the source range is written. Primitive restart
+ * has to be processed in order, so draws using it stay on the CPU. */
+
+/* Below this many indices, a source the CPU can read without waiting is
+ * translated on the CPU, as the dispatch splits the render pass */
+#define PAN_INDEX_TRANSLATE_MIN_COUNT 1024
+
+static int
+panfrost_index_translate_type(enum pipe_prim_type mode)
+{
+        switch (mode) {
+        case PIPE_PRIM_QUADS:
+                return PAN_INDEX_TRANSLATE_QUADS;
+        case PIPE_PRIM_QUAD_STRIP:
+                return PAN_INDEX_TRANSLATE_QUAD_STRIP;
+        case PIPE_PRIM_POLYGON:
+                return PAN_INDEX_TRANSLATE_POLYGON;
+        default:
+                return -1;
+        }
+}
+
+static unsigned
+panfrost_index_translate_prims(enum pan_index_translate_type type,
+                               unsigned count)
+{
+        switch (type) {
+        case PAN_INDEX_TRANSLATE_QUADS:
+                return (count / 4) * 2;
+        case PAN_INDEX_TRANSLATE_QUAD_STRIP:
+                return count >= 4 ? ((count - 2) / 2) * 2 : 0;
+        case PAN_INDEX_TRANSLATE_POLYGON:
+                return count >= 3 ? count - 2 : 0;
+        default:
+                unreachable("Invalid translation");
+        }
+}
+
+/* Loads index i of the source range from SSBO 0, a word at a time so any
+ * index size works. Parameters: first index, index size and index mask. */
+static nir_ssa_def *
+index_translate_load(nir_builder *b, nir_ssa_def *i)
+{
+        nir_ssa_def *offset =
+                nir_imul(b, nir_iadd(b, load_param(b, 0), i), load_param(b, 1));
+        nir_ssa_def *word =
+                nir_load_ssbo(b, 1, 32, nir_imm_int(b, 0),
+                              nir_iand_imm(b, offset, ~3),
+                              .align_mul = 4, .align_offset = 0);
+        nir_ssa_def *shift = nir_ishl_imm(b, nir_iand_imm(b, offset, 3), 3);
+
+        return nir_iand(b, nir_ushr(b, word, shift), load_param(b, 2));
+}
+
+/* Writes one triangle per invocation to SSBO 1, matching the vertex order of
+ * u_indices so flat shading picks the same vertex. Parameters: as for
+ * index_translate_load, then the number of triangles. */
+static void *
+panfrost_index_translate_create(struct panfrost_context *ctx,
+                                enum pan_index_translate_type type,
+                                bool first)
+{
+        /* The two triangles of each quad, by provoking vertex */
+        static const struct {
+                unsigned stride;
+                uint8_t tris[2][2][3];
+        } quads[] = {
+                [PAN_INDEX_TRANSLATE_QUADS] = {
+                        4, { { { 0, 1, 3 }, { 1, 2, 3 } },
+                             { { 0, 1, 2 }, { 0, 2, 3 } } },
+                },
+                [PAN_INDEX_TRANSLATE_QUAD_STRIP] = {
+                        2, { { { 2, 0, 3 }, { 0, 1, 3 } },
+                             { { 0, 1, 3 }, { 0, 3, 2 } } },
+                },
+        };
+
+        struct pipe_context *pctx = &ctx->base;
+        const nir_shader_compiler_options *options =
+                pctx->screen->get_compiler_options(pctx->screen,
+                                                   PIPE_SHADER_IR_NIR,
+                                                   PIPE_SHADER_COMPUTE);
+
+        nir_builder b =
+                nir_builder_init_simple_shader(MESA_SHADER_COMPUTE, options,
+                                               "index_translate");
+
+        b.shader->info.workgroup_size[0] = 64;
+        b.shader->info.workgroup_size[1] = 1;
+        b.shader->info.workgroup_size[2] = 1;
+        b.shader->info.num_ubos = 1;
+        b.shader->info.num_ssbos = 2;
+
+        nir_ssa_def *prim = nir_channel(&b, nir_load_global_invocation_id(&b, 32), 0);
+
+        nir_push_if(&b, nir_ult(&b, prim, load_param(&b, 3)));
+        {
+                nir_ssa_def *v[3];
+
+                if (type == PAN_INDEX_TRANSLATE_POLYGON) {
+                        nir_ssa_def *fan = nir_imm_int(&b, 0);
+                        nir_ssa_def *next = nir_iadd_imm(&b, prim, 1);
+                        nir_ssa_def *last = nir_iadd_imm(&b, prim, 2);
+
+                        v[0] = first ? fan : next;
+                        v[1] = first ? next : last;
+                        v[2] = first ? last : fan;
+                } else {
+                        nir_ssa_def *base =
+                                nir_imul_imm(&b, nir_ushr_imm(&b, prim, 1),
+                                             quads[type].stride);
+                        nir_ssa_def *odd = nir_ine_imm(&b, nir_iand_imm(&b, prim, 1), 0);
+
+                        for (unsigned i = 0; i < 3; ++i) {
+                                nir_ssa_def *offset =
+                                        nir_bcsel(&b, odd,
+                                                  nir_imm_int(&b, quads[type].tris[first][1][i]),
+                                                  nir_imm_int(&b, quads[type].tris[first][0][i]));
+
+                                v[i] = nir_iadd(&b, base, offset);
+                        }
+                }
+
+                for (unsigned i = 0; i < 3; ++i)
+                        v[i] = index_translate_load(&b, v[i]);
+
+                nir_store_ssbo(&b, nir_vec(&b, v, 3), nir_imm_int(&b, 1),
+                               nir_imul_imm(&b, prim, 12),
+                               .write_mask = 0x7, .align_mul = 4,
+                               .align_offset = 0);
+        }
+        nir_pop_if(&b, NULL);
+
+        struct pipe_compute_state cso = {
+                .ir_type = PIPE_SHADER_IR_NIR,
+                .prog = b.shader,
+        };
+
+        return pctx->create_compute_state(pctx, &cso);
+}
+
+/* Runs a 1D kernel reading SSBO 0 and writing SSBO 1, each bound to a range
+ * of a buffer, saving and restoring the compute state it clobbers. Unlike
+ * the AFBC kernels, the buffers are tracked by the batch, so nothing waits
+ * for the result. */
+static void
+panfrost_buffer_kernel_dispatch(struct panfrost_context *ctx, void *cs,
+                                struct pipe_resource *src,
+                                unsigned src_offset, unsigned src_size,
+                                struct pipe_resource *dst,
+                                unsigned dst_offset, unsigned dst_size,
+                                const uint32_t *params, unsigned params_size,
+                                unsigned nr_threads)
+{
+        struct pipe_context *pctx = &ctx->base;
+
+        /* Save the compute state we are about to clobber */
+        void *saved_cs = ctx->uncompiled[PIPE_SHADER_COMPUTE];
+        struct pipe_shader_buffer saved_ssbos[2] = { 0 };
+        struct pipe_constant_buffer saved_cb = { 0 };
+        bool saved_cb_enabled =
+                ctx->constant_buffer[PIPE_SHADER_COMPUTE].enabled_mask & BITFIELD_BIT(0);
+        uint32_t saved_ssbo_mask = ctx->ssbo_mask[PIPE_SHADER_COMPUTE];
+        uint32_t saved_writable = ctx->ssbo_writable[PIPE_SHADER_COMPUTE];
+
+        util_copy_constant_buffer(&saved_cb,
+                        &ctx->constant_buffer[PIPE_SHADER_COMPUTE].cb[0], false);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(saved_ssbos); ++i)
+                util_copy_shader_buffer(&saved_ssbos[i], &ctx->ssbo[PIPE_SHADER_COMPUTE][i]);
+
+        /* The source is only read, so the batch orders after its writers
+         * without dropping what is cached about it */
+        struct pipe_shader_buffer ssbos[2] = {
+                { .buffer = src, .buffer_offset = src_offset, .buffer_size = src_size },
+                { .buffer = dst, .buffer_offset = dst_offset, .buffer_size = dst_size },
+        };
+
+        struct pipe_constant_buffer cb = {
+                .buffer_size = params_size,
+                .user_buffer = params,
+        };
+
+        pctx->bind_compute_state(pctx, cs);
+        pctx->set_shader_buffers(pctx, PIPE_SHADER_COMPUTE, 0, 2, ssbos,
+                                 BITFIELD_BIT(1));
+        pctx->set_constant_buffer(pctx, PIPE_SHADER_COMPUTE, 0, false, &cb);
+
+        struct pipe_grid_info grid = {
+                .block = { 64, 1, 1 },
+                .grid = { DIV_ROUND_UP(nr_threads, 64), 1, 1 },
+        };
+
+        pctx->launch_grid(pctx, &grid);
+
+        /* Restore the state */
+        pctx->bind_compute_state(pctx, saved_cs);
+        pctx->set_constant_buffer(pctx, PIPE_SHADER_COMPUTE, 0, true,
+                                  saved_cb_enabled ? &saved_cb : NULL);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(saved_ssbos); ++i) {
+                bool bound = saved_ssbo_mask & BITFIELD_BIT(i);
+
+                pctx->set_shader_buffers(pctx, PIPE_SHADER_COMPUTE, i, 1,
+                                         bound ? &saved_ssbos[i] : NULL,
+                                         (saved_writable >> i) & 1);
+                pipe_resource_reference(&saved_ssbos[i].buffer, NULL);
+        }
+}
+
+/* Returns 32-bit triangle list indices for an indexed draw of a primitive
+ * type the hardware lacks, translating them on the GPU if they are not
+ * cached yet, or NULL if the draw should be translated on the CPU. The
+ * buffer is owned by the index buffer, and valid until it is written. */
+
+struct pipe_resource *
+panfrost_translate_indices(struct panfrost_context *ctx,
+                           const struct pipe_draw_info *info,
+                           const struct pipe_draw_start_count_bias *draw,
+                           unsigned *out_count)
+{
+        int type = panfrost_index_translate_type(info->mode);
+
+        if (type < 0 || !info->index_size || info->has_user_indices ||
+            info->primitive_restart)
+                return NULL;
+
+        struct panfrost_resource *rsrc = pan_resource(info->index.resource);
+        struct pipe_rasterizer_state *rast = (void *) ctx->rasterizer;
+        bool first = rast->flatshade_first;
+        unsigned nr_prims = panfrost_index_translate_prims(type, draw->count);
+
+        if (!nr_prims)
+                return NULL;
+
+        struct panfrost_index_derivatives *derivs = rsrc->index_derivs;
+
+        if (derivs) {
+                for (unsigned i = 0; i < PAN_INDEX_DERIVATIVES; ++i) {
+                        struct panfrost_index_derivative *e = &derivs->entries[i];
+
+                        if (e->buffer && e->start == draw->start &&
+                            e->count == draw->count &&
+                            e->index_size == info->index_size &&
+                            e->mode == info->mode &&
+                            e->flatshade_first == first) {
+                                *out_count = e->out_count;
+                                return e->buffer;
+                        }
+                }
+        }
+
+        if (draw->count < PAN_INDEX_TRANSLATE_MIN_COUNT &&
+            !panfrost_resource_writer(ctx, rsrc) &&
+            panfrost_bo_wait(rsrc->image.data.bo, 0, false))
+                return NULL;
+
+        if (!derivs) {
+                derivs = rsrc->index_derivs =
+                        CALLOC_STRUCT(panfrost_index_derivatives);
+
+                if (!derivs)
+                        return NULL;
+        }
+
+        struct pipe_resource *buffer =
+                pipe_buffer_create(ctx->base.screen,
+                                   PIPE_BIND_INDEX_BUFFER | PIPE_BIND_SHADER_BUFFER,
+                                   PIPE_USAGE_DEFAULT, nr_prims * 3 * 4);
+
+        if (!buffer)
+                return NULL;
+
+        if (!ctx->index_translate[type][first])
+                ctx->index_translate[type][first] =
+                        panfrost_index_translate_create(ctx, type, first);
+
+        uint32_t params[] = {
+                draw->start,
+                info->index_size,
+                BITFIELD_MASK(info->index_size * 8),
+                nr_prims,
+        };
+
+        perf_debug_ctx(ctx, "Translating %u indices on the GPU", draw->count);
+
+        panfrost_buffer_kernel_dispatch(ctx, ctx->index_translate[type][first],
+                                        &rsrc->base, 0, rsrc->base.width0,
+                                        buffer, 0, buffer->width0,
+                                        params, sizeof(params), nr_prims);
+
+        struct panfrost_index_derivative *e = &derivs->entries[derivs->victim];
+        derivs->victim = (derivs->victim + 1) % PAN_INDEX_DERIVATIVES;
+
+        pipe_resource_reference(&e->buffer, NULL);
+
+        *e = (struct panfrost_index_derivative) {
+                .buffer = buffer,
+                .out_count = nr_prims * 3,
+                .start = draw->start,
+                .count = draw->count,
+                .index_size = info->index_size,
+                .mode = info->mode,
+                .flatshade_first = first,
+        };
+
+        *out_count = e->out_count;
+        return buffer;
+}
+
+/* Drops the translations reading any of the given bytes of the source */
+
+void
+panfrost_index_derivatives_invalidate(struct panfrost_resource *rsrc,
+                                      unsigned offset, unsigned size)
+{
+        struct panfrost_index_derivatives *derivs = rsrc->index_derivs;
+
+        if (!derivs)
+                return;
+
+        for (unsigned i = 0; i < PAN_INDEX_DERIVATIVES; ++i) {
+                struct panfrost_index_derivative *e = &derivs->entries[i];
+                unsigned start = e->start * e->index_size;
+                unsigned end = (e->start + e->count) * e->index_size;
+
+                if (e->buffer && start < offset + size && offset < end)
+                        pipe_resource_reference(&e->buffer, NULL);
+        }
+}
+
+void
+panfrost_index_derivatives_clear(struct panfrost_resource *rsrc)
+{
+        struct panfrost_index_derivatives *derivs = rsrc->index_derivs;
+
+        if (!derivs)
+                return;
+
+        for (unsigned i = 0; i < PAN_INDEX_DERIVATIVES; ++i)
+                pipe_resource_reference(&derivs->entries[i].buffer, NULL);
+}
+
+/* Buffer copies run as compute kernels instead of mapping both buffers, which
+ * would wait for the GPU to finish writing the source and using the
+ * destination. Each invocation copies a vec4 if the offsets and size allow,
+ * a word otherwise. Unaligned copies stay on the CPU. */
+
+/* Below this many bytes, copies between idle buffers are done on the CPU, as
+ * the dispatch splits the render pass */
+#define PAN_BUFFER_COPY_MIN_SIZE (64 * 1024)
+
+/* Parameters: number of units to copy */
+static void *
+panfrost_buffer_copy_create(struct panfrost_context *ctx, bool vec4)
+{
+        struct pipe_context *pctx = &ctx->base;
+        const nir_shader_compiler_options *options =
+                pctx->screen->get_compiler_options(pctx->screen,
+                                                   PIPE_SHADER_IR_NIR,
+                                                   PIPE_SHADER_COMPUTE);
+
+        nir_builder b =
+                nir_builder_init_simple_shader(MESA_SHADER_COMPUTE, options,
+                                               "buffer_copy_%s",
+                                               vec4 ? "vec4" : "word");
+
+        b.shader->info.workgroup_size[0] = 64;
+        b.shader->info.workgroup_size[1] = 1;
+        b.shader->info.workgroup_size[2] = 1;
+        b.shader->info.num_ubos = 1;
+        b.shader->info.num_ssbos = 2;
+
+        unsigned comps = vec4 ? 4 : 1;
+        nir_ssa_def *idx = nir_channel(&b, nir_load_global_invocation_id(&b, 32), 0);
+
+        nir_push_if(&b, nir_ult(&b, idx, load_param(&b, 0)));
+        {
+                nir_ssa_def *offset = nir_imul_imm(&b, idx, comps * 4);
+                nir_ssa_def *data =
+                        nir_load_ssbo(&b, comps, 32, nir_imm_int(&b, 0), offset,
+                                      .align_mul = comps * 4, .align_offset = 0);
+
+                nir_store_ssbo(&b, data, nir_imm_int(&b, 1), offset,
+                               .write_mask = BITFIELD_MASK(comps),
+                               .align_mul = comps * 4, .align_offset = 0);
+        }
+        nir_pop_if(&b, NULL);
+
+        struct pipe_compute_state cso = {
+                .ir_type = PIPE_SHADER_IR_NIR,
+                .prog = b.shader,
+        };
+
+        return pctx->create_compute_state(pctx, &cso);
+}
+
+static bool
+panfrost_buffer_busy(struct panfrost_context *ctx,
+                     struct panfrost_resource *rsrc, bool wait_readers)
+{
+        return panfrost_resource_writer(ctx, rsrc) ||
+               !panfrost_bo_wait(rsrc->image.data.bo, 0, wait_readers);
+}
+
+static bool
+panfrost_copy_buffer_gpu(struct panfrost_context *ctx,
+                         struct pipe_resource *dst, unsigned dstx,
+                         struct pipe_resource *src,
+                         const struct pipe_box *src_box)
+{
+        unsigned srcx = src_box->x, size = src_box->width;
+
+        if ((srcx | dstx | size) & 3)
+                return false;
+
+        /* Copies within a buffer may overlap, and the invocations run in no
+         * particular order */
+        if (src == dst && srcx < dstx + size && dstx < srcx + size)
+                return false;
+
+        if (size < PAN_BUFFER_COPY_MIN_SIZE &&
+            !panfrost_buffer_busy(ctx, pan_resource(src), false) &&
+            !panfrost_buffer_busy(ctx, pan_resource(dst), true))
+                return false;
+
+        bool vec4 = !((srcx | dstx | size) & 15);
+        unsigned unit = vec4 ? 16 : 4;
+
+        if (!ctx->buffer_copy[vec4])
+                ctx->buffer_copy[vec4] = panfrost_buffer_copy_create(ctx, vec4);
+
+        uint32_t params[] = { size / unit };
+
+        perf_debug_ctx(ctx, "Copying %u bytes of buffer on the GPU", size);
+
+        panfrost_buffer_kernel_dispatch(ctx, ctx->buffer_copy[vec4],
+                                        src, srcx, size, dst, dstx, size,
+                                        params, sizeof(params), size / unit);
+        return true;
+}
+
+/* Parameters: number of units to fill, then the 16-byte pattern */
+static void *
+panfrost_buffer_fill_create(struct panfrost_context *ctx, bool vec4)
+{
+        struct pipe_context *pctx = &ctx->base;
+        const nir_shader_compiler_options *options =
+                pctx->screen->get_compiler_options(pctx->screen,
+                                                   PIPE_SHADER_IR_NIR,
+                                                   PIPE_SHADER_COMPUTE);
+
+        nir_builder b =
+                nir_builder_init_simple_shader(MESA_SHADER_COMPUTE, options,
+                                               "buffer_fill_%s",
+                                               vec4 ? "vec4" : "word");
+
+        b.shader->info.workgroup_size[0] = 64;
+        b.shader->info.workgroup_size[1] = 1;
+        b.shader->info.workgroup_size[2] = 1;
+        b.shader->info.num_ubos = 1;
+        b.shader->info.num_ssbos = 2;
+
+        unsigned comps = vec4 ? 4 : 1;
+        nir_ssa_def *idx = nir_channel(&b, nir_load_global_invocation_id(&b, 32), 0);
+
+        nir_push_if(&b, nir_ult(&b, idx, load_param(&b, 0)));
+        {
+                nir_ssa_def *pattern[4];
+
+                for (unsigned i = 0; i < comps; ++i)
+                        pattern[i] = load_param(&b, 1 + i);
+
+                nir_store_ssbo(&b, nir_vec(&b, pattern, comps), nir_imm_int(&b, 1),
+                               nir_imul_imm(&b, idx, comps * 4),
+                               .write_mask = BITFIELD_MASK(comps),
+                               .align_mul = comps * 4, .align_offset = 0);
+        }
+        nir_pop_if(&b, NULL);
+
+        struct pipe_compute_state cso = {
+                .ir_type = PIPE_SHADER_IR_NIR,
+                .prog = b.shader,
+        };
+
+        return pctx->create_compute_state(pctx, &cso);
+}
+
+/* Buffer clears are filled by a compute kernel, a vec4 of the pattern
+ * replicated to 16 bytes per invocation if the range allows, a word
+ * otherwise. 12-byte patterns, unaligned ranges and small clears of idle
+ * buffers are filled on the CPU. */
+
+void
+panfrost_clear_buffer(struct pipe_context *pctx,
+                      struct pipe_resource *res,
+                      unsigned offset, unsigned size,
+                      const void *clear_value, int clear_value_size)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+        uint32_t params[5];
+        bool vec4 = !((offset | size) & 15);
+
+        if (!util_is_power_of_two_nonzero(clear_value_size) ||
+            (offset | size) & 3 || (!vec4 && clear_value_size > 4) ||
+            (size < PAN_BUFFER_COPY_MIN_SIZE &&
+             !panfrost_buffer_busy(ctx, pan_resource(res), true))) {
+                u_default_clear_buffer(pctx, res, offset, size, clear_value,
+                                       clear_value_size);
+                return;
+        }
+
+        for (unsigned i = 0; i < 16; i += clear_value_size)
+                memcpy((uint8_t *) &params[1] + i, clear_value, clear_value_size);
+
+        unsigned unit = vec4 ? 16 : 4;
+        params[0] = size / unit;
+
+        if (!ctx->buffer_fill[vec4])
+                ctx->buffer_fill[vec4] = panfrost_buffer_fill_create(ctx, vec4);
+
+        perf_debug_ctx(ctx, "Clearing %u bytes of buffer on the GPU", size);
+
+        /* The kernel reads no source, bind the destination twice */
+        panfrost_buffer_kernel_dispatch(ctx, ctx->buffer_fill[vec4],
+                                        res, offset, size, res, offset, size,
+                                        params, sizeof(params), size / unit);
+}
+
+/* Buffers are copied by compute kernels, textures by u_blitter draws where
+ * the destination format is renderable, so neither is mapped. Everything
+ * else, such as compressed formats, is copied on the CPU. */
+
+void
+panfrost_resource_copy_region(struct pipe_context *pctx,
+                              struct pipe_resource *dst,
+                              unsigned dst_level,
+                              unsigned dstx, unsigned dsty, unsigned dstz,
+                              struct pipe_resource *src,
+                              unsigned src_level,
+                              const struct pipe_box *src_box)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+
+        if (dst->target == PIPE_BUFFER && src->target == PIPE_BUFFER) {
+                if (panfrost_copy_buffer_gpu(ctx, dst, dstx, src, src_box))
+                        return;
+        } else if (dst->target != PIPE_BUFFER && src->target != PIPE_BUFFER &&
+                   util_blitter_is_copy_supported(ctx->blitter, dst, src)) {
+                panfrost_blitter_save(ctx, false);
+
+                ctx->blitter_trace.op = "copy region";
+                util_blitter_copy_texture(ctx->blitter, dst, dst_level,
+                                          dstx, dsty, dstz, src, src_level,
+                                          src_box);
+                ctx->blitter_trace.op = NULL;
+                return;
+        }
+
+        util_resource_copy_region(pctx, dst, dst_level, dstx, dsty, dstz,
+                                  src, src_level, src_box);
 }
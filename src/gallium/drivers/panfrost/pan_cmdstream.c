@@ -30,8 +30,11 @@
 #include "util/u_vbuf.h"
 #include "util/u_helpers.h"
 #include "util/u_draw.h"
+#include "util/u_prim_restart.h"
 #include "util/u_memory.h"
+#include "util/os_time.h"
 #include "util/u_viewport.h"
+#include "util/indices/u_primconvert.h"
 #include "pipe/p_defines.h"
 #include "pipe/p_state.h"
 #include "gallium/auxiliary/util/u_blend.h"
@@ -49,6 +52,7 @@
 #include "pan_indirect_draw.h"
 #include "pan_indirect_dispatch.h"
 #include "pan_blitter.h"
+#include "pan_tracepoints.h"
 
 #define PAN_GPU_INDIRECTS (PAN_ARCH == 7)
 
@@ -59,6 +63,12 @@ struct panfrost_rasterizer {
         /* Partially packed RSD words */
         struct mali_multisample_misc_packed multisample;
         struct mali_stencil_mask_misc_packed stencil_misc;
+
+        /* Words 5 and 6 of the RSD, the depth bias */
+        uint32_t depth_units, depth_factor;
+#else
+        /* Partially packed depth/stencil descriptor */
+        struct mali_depth_stencil_packed depth;
 #endif
 };
 
@@ -68,13 +78,13 @@ struct panfrost_zsa_state {
         /* Is any depth, stencil, or alpha testing enabled? */
         bool enabled;
 
-        /* Does the depth and stencil tests always pass? This ignores write
+        /* Does the depth or stencil test always pass? This ignores write
          * masks, we are only interested in whether pixels may be killed.
          */
-        bool zs_always_passes;
+        bool depth_always_passes, stencil_always_passes;
 
         /* Are depth or stencil writes possible? */
-        bool writes_zs;
+        bool writes_depth, writes_stencil;
 
 #if PAN_ARCH <= 7
         /* Prepacked words from the RSD */
@@ -106,6 +116,9 @@ struct panfrost_sampler_view {
          * shader images on Valhall.
          */
         struct panfrost_pool *pool;
+
+        /* The descriptor, when allocated from the context's heap */
+        struct panfrost_desc desc;
 };
 
 struct panfrost_vertex_state {
@@ -117,6 +130,10 @@ struct panfrost_vertex_state {
          * except for stride, which must be ORed in at draw time
          */
         struct mali_attribute_packed attributes[PIPE_MAX_ATTRIBS];
+
+        /* Alignment in bytes the attribute hardware needs for the address and
+         * stride of each element, see panfrost_update_vertex_fetch */
+        uint8_t component_size[PIPE_MAX_ATTRIBS];
 #else
         /* buffers corresponds to attribute buffer, element_buffers corresponds
          * to an index in buffers for each vertex element */
@@ -464,6 +481,40 @@ panfrost_emit_blend(struct panfrost_batch *batch, void *rts, mali_ptr *blend_sha
 }
 #endif
 
+/*
+ * Depth/stencil state of a draw as seen by early-ZS. Tests and writes of an
+ * aspect the framebuffer doesn't have are no-ops, so a depth-only target
+ * with stencil enabled or a draw without any ZS buffer doesn't force late
+ * updates or strong early tests on the shader.
+ */
+static inline struct pan_earlyzs_state
+panfrost_get_earlyzs(struct panfrost_context *ctx,
+                     struct panfrost_compiled_shader *fs, bool has_oq)
+{
+        struct panfrost_zsa_state *zsa = ctx->depth_stencil;
+        struct pipe_surface *zsbuf = ctx->pipe_framebuffer.zsbuf;
+        bool has_depth = false, has_stencil = false;
+
+        if (zsbuf) {
+                const struct util_format_description *desc =
+                        util_format_description(zsbuf->format);
+
+                has_depth = util_format_has_depth(desc);
+                has_stencil = util_format_has_stencil(desc);
+        }
+
+        bool writes_zs = (has_depth && zsa->writes_depth) ||
+                         (has_stencil && zsa->writes_stencil);
+
+        bool zs_always_passes =
+                (!has_depth || zsa->depth_always_passes) &&
+                (!has_stencil || zsa->stencil_always_passes);
+
+        return pan_earlyzs_get(fs->earlyzs, writes_zs || has_oq,
+                               ctx->blend->base.alpha_to_coverage,
+                               zs_always_passes);
+}
+
 static inline bool
 pan_allow_forward_pixel_to_kill(struct panfrost_context *ctx, struct panfrost_compiled_shader *fs)
 {
@@ -547,11 +598,7 @@ panfrost_prepare_fs_state(struct panfrost_context *ctx,
                 if (panfrost_fs_required(fs, so, &ctx->pipe_framebuffer, zsa)) {
 #if PAN_ARCH >= 6
                         struct pan_earlyzs_state earlyzs =
-                               pan_earlyzs_get(fs->earlyzs,
-                                               ctx->depth_stencil->writes_zs ||
-                                               has_oq,
-                                               ctx->blend->base.alpha_to_coverage,
-                                               ctx->depth_stencil->zs_always_passes);
+                                panfrost_get_earlyzs(ctx, fs, has_oq);
 
                         cfg.properties.pixel_kill_operation = earlyzs.kill;
                         cfg.properties.zs_update_operation = earlyzs.update;
@@ -642,8 +689,6 @@ panfrost_prepare_fs_state(struct panfrost_context *ctx,
 #endif
 
                 cfg.stencil_mask_misc.alpha_to_coverage = alpha_to_coverage;
-                cfg.depth_units = rast->offset_units * 2.0f;
-                cfg.depth_factor = rast->offset_scale;
 
                 bool back_enab = zsa->base.stencil[1].enabled;
                 cfg.stencil_front.reference_value = ctx->stencil_ref.ref_value[0];
@@ -701,6 +746,10 @@ panfrost_emit_frag_shader(struct panfrost_context *ctx,
         rsd.opaque[10] |= zsa->stencil_front.opaque[0];
         rsd.opaque[11] |= zsa->stencil_back.opaque[0];
 
+        /* Word 5, 6 Depth bias */
+        rsd.opaque[5] |= rast->depth_units;
+        rsd.opaque[6] |= rast->depth_factor;
+
         memcpy(fragmeta, &rsd, sizeof(rsd));
 }
 
@@ -774,7 +823,9 @@ panfrost_emit_viewport(struct panfrost_batch *batch)
         if (maxx == 0 || maxy == 0)
                 maxx = maxy = minx = miny = 1;
 
-        panfrost_batch_union_scissor(batch, minx, miny, maxx, maxy);
+        batch->viewport_bounds = (struct pipe_scissor_state) {
+                .minx = minx, .miny = miny, .maxx = maxx, .maxy = maxy,
+        };
         batch->scissor_culls_everything = (minx >= maxx || miny >= maxy);
 
         /* [minx, maxx) and [miny, maxy) are exclusive ranges in the hardware */
@@ -845,22 +896,10 @@ panfrost_emit_depth_stencil(struct panfrost_batch *batch)
 
                 cfg.stencil_from_shader = fs->info.fs.writes_stencil;
                 cfg.depth_source = pan_depth_source(&fs->info);
-
-                cfg.depth_bias_enable = rast->base.offset_tri;
-                cfg.depth_units = rast->base.offset_units * 2.0f;
-                cfg.depth_factor = rast->base.offset_scale;
-                cfg.depth_bias_clamp = rast->base.offset_clamp;
-
-                if (rast->base.depth_clip_near && rast->base.depth_clip_far) {
-                        cfg.depth_clamp_mode = MALI_DEPTH_CLAMP_MODE_0_1;
-                        cfg.depth_cull_enable = true;
-                } else {
-                        cfg.depth_clamp_mode = MALI_DEPTH_CLAMP_MODE_BOUNDS;
-                        cfg.depth_cull_enable = false;
-                }
         }
 
         pan_merge(dynamic, zsa->desc, DEPTH_STENCIL);
+        pan_merge(dynamic, rast->depth, DEPTH_STENCIL);
         memcpy(T.cpu, &dynamic, pan_size(DEPTH_STENCIL));
 
         return T.gpu;
@@ -935,24 +974,22 @@ panfrost_emit_vertex_data(struct panfrost_batch *batch)
 {
         struct panfrost_context *ctx = batch->ctx;
         struct panfrost_vertex_state *vtx = ctx->vertex;
-        struct panfrost_ptr T = pan_pool_alloc_desc_array(&batch->pool.base,
-                                                          vtx->num_elements,
-                                                          ATTRIBUTE);
-        struct mali_attribute_packed *attributes = T.cpu;
+        struct mali_attribute_packed attributes[PIPE_MAX_ATTRIBS];
 
         for (unsigned i = 0; i < vtx->num_elements; ++i) {
-                struct mali_attribute_packed packed;
                 unsigned vbi = vtx->pipe[i].vertex_buffer_index;
 
-                pan_pack(&packed, ATTRIBUTE, cfg) {
+                attributes[i] = vtx->attributes[i];
+
+                pan_pack_words(&attributes[i], ATTRIBUTE,
+                               MALI_ATTRIBUTE_STRIDE_WORDS, cfg) {
                         cfg.stride = ctx->vertex_buffers[vbi].stride;
                 }
-
-                pan_merge(packed, vtx->attributes[i], ATTRIBUTE);
-                attributes[i] = packed;
         }
 
-        return T.gpu;
+        return panfrost_upload_desc_table(batch, PIPE_SHADER_VERTEX, attributes,
+                                          vtx->num_elements * pan_size(ATTRIBUTE),
+                                          pan_alignment(ATTRIBUTE));
 }
 
 /*
@@ -1196,16 +1233,50 @@ panfrost_upload_ssbo_sysval(struct panfrost_batch *batch,
         struct panfrost_resource *rsrc = pan_resource(sb.buffer);
         struct panfrost_bo *bo = rsrc->image.data.bo;
 
-        panfrost_batch_write_rsrc(batch, rsrc, st);
+        if (ctx->ssbo_writable[st] & BITFIELD_BIT(ssbo_id)) {
+                panfrost_batch_write_rsrc(batch, rsrc, st);
 
-        util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
-                        sb.buffer_offset, sb.buffer_size);
+                util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
+                                sb.buffer_offset, sb.buffer_size);
+        } else {
+                panfrost_batch_read_rsrc(batch, rsrc, st);
+        }
 
         /* Upload address and size as sysval */
         uniform->du[0] = bo->ptr.gpu + sb.buffer_offset;
         uniform->u[2] = sb.buffer_size;
 }
 
+#if PAN_ARCH >= 9
+static void
+panfrost_upload_vertex_fetch_sysval(struct panfrost_batch *batch,
+                                    unsigned attr,
+                                    struct sysval_uniform *uniform)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        const struct pipe_vertex_element *el = &ctx->vertex->pipe[attr];
+        const struct pipe_vertex_buffer *vb =
+                &ctx->vertex_buffers[el->vertex_buffer_index];
+        struct panfrost_resource *rsrc = pan_resource(vb->buffer.resource);
+        unsigned offset = vb->buffer_offset + el->src_offset;
+        unsigned size = util_format_get_blocksize(el->src_format);
+        unsigned available = 0;
+
+        panfrost_batch_read_rsrc(batch, rsrc, PIPE_SHADER_VERTEX);
+
+        /* If not even the first vertex fits, point at the start of the buffer
+         * so the clamped loads stay within it, the shader then reads zero */
+        if (offset + size <= rsrc->base.width0)
+                available = rsrc->base.width0 - offset;
+        else
+                offset = 0;
+
+        uniform->du[0] = rsrc->image.data.bo->ptr.gpu + offset;
+        uniform->u[2] = vb->stride;
+        uniform->u[3] = available;
+}
+#endif
+
 static void
 panfrost_upload_sampler_sysval(struct panfrost_batch *batch,
                                enum pipe_shader_type st,
@@ -1313,7 +1384,8 @@ static void
 panfrost_upload_sysvals(struct panfrost_batch *batch,
                         const struct panfrost_ptr *ptr,
                         struct panfrost_compiled_shader *ss,
-                        enum pipe_shader_type st)
+                        enum pipe_shader_type st,
+                        const uint32_t *preamble)
 {
         struct sysval_uniform *uniforms = ptr->cpu;
 
@@ -1374,6 +1446,25 @@ panfrost_upload_sysvals(struct panfrost_batch *batch,
                         uniforms[i].u[0] = batch->ctx->vertex_count;
                         break;
 
+#if PAN_ARCH >= 9
+                case PAN_SYSVAL_VERTEX_FETCH:
+                        panfrost_upload_vertex_fetch_sysval(batch,
+                                                            PAN_SYSVAL_ID(sysval),
+                                                            &uniforms[i]);
+                        break;
+#endif
+
+                case PAN_SYSVAL_XFB_INDICES:
+                        uniforms[i].du[0] = batch->ctx->xfb_indices & ~3ull;
+                        uniforms[i].u[2] = batch->ctx->xfb_index_size;
+                        uniforms[i].u[3] = batch->ctx->xfb_indices & 3;
+                        break;
+
+                case PAN_SYSVAL_GS:
+                        uniforms[i].du[0] =
+                                batch->ctx->gs_buffers[PAN_SYSVAL_ID(sysval)];
+                        break;
+
                 case PAN_SYSVAL_NUM_WORK_GROUPS:
                         for (unsigned j = 0; j < 3; j++) {
                                 batch->num_wg_sysval[j] =
@@ -1429,6 +1520,11 @@ panfrost_upload_sysvals(struct panfrost_batch *batch,
                 case PAN_SYSVAL_DRAWID:
                         uniforms[i].u[0] = batch->ctx->drawid;
                         break;
+                case PAN_SYSVAL_PREAMBLE:
+                        memcpy(uniforms[i].u,
+                               preamble + (PAN_SYSVAL_ID(sysval) * 4),
+                               sizeof(uniforms[i].u));
+                        break;
                 default:
                         assert(0);
                 }
@@ -1455,6 +1551,50 @@ panfrost_map_constant_buffer_cpu(struct panfrost_context *ctx,
                 unreachable("No constant buffer");
 }
 
+struct panfrost_preamble_ubos {
+        struct panfrost_context *ctx;
+        struct panfrost_constant_buffer *buf;
+        const void *mapped[PIPE_MAX_CONSTANT_BUFFERS];
+};
+
+static uint32_t
+panfrost_preamble_load_ubo(void *data, unsigned ubo, unsigned offset)
+{
+        struct panfrost_preamble_ubos *ubos = data;
+        struct panfrost_constant_buffer *buf = ubos->buf;
+        uint32_t word = 0;
+
+        if (ubo >= PIPE_MAX_CONSTANT_BUFFERS ||
+            !(buf->enabled_mask & BITFIELD_BIT(ubo)) ||
+            (uint64_t) offset + 4 > buf->cb[ubo].buffer_size)
+                return 0;
+
+        if (!ubos->mapped[ubo]) {
+                ubos->mapped[ubo] =
+                        panfrost_map_constant_buffer_cpu(ubos->ctx, buf, ubo);
+        }
+
+        memcpy(&word, (const uint8_t *) ubos->mapped[ubo] + offset, 4);
+        return word;
+}
+
+/* Runs the uniform computation the compiler hoisted out of the shader, for
+ * the PAN_SYSVAL_PREAMBLE sysvals */
+static void
+panfrost_eval_preamble(struct panfrost_context *ctx,
+                       struct panfrost_compiled_shader *ss,
+                       enum pipe_shader_type stage,
+                       uint32_t *words)
+{
+        struct panfrost_preamble_ubos ubos = {
+                .ctx = ctx,
+                .buf = &ctx->constant_buffer[stage],
+        };
+
+        pan_preamble_eval(&ss->info.preamble, panfrost_preamble_load_ubo,
+                          &ubos, words);
+}
+
 /* Emit a single UBO record. On Valhall, UBOs are dumb buffers and are
  * implemented with buffer descriptors in the resource table, sized in terms of
  * bytes. On Bifrost and older, UBOs have special uniform buffer data
@@ -1484,6 +1624,55 @@ panfrost_emit_ubo(void *base, unsigned index, mali_ptr address, size_t size)
 #endif
 }
 
+/* Indirect draws and dispatches patch some sysvals in place, so those can't
+ * be shared with other draws */
+static bool
+panfrost_sysvals_patched(struct panfrost_compiled_shader *ss)
+{
+        for (unsigned i = 0; i < ss->info.sysvals.sysval_count; ++i) {
+                switch (PAN_SYSVAL_TYPE(ss->info.sysvals.sysvals[i])) {
+                case PAN_SYSVAL_NUM_WORK_GROUPS:
+                case PAN_SYSVAL_VERTEX_INSTANCE_OFFSETS:
+                        return true;
+                default:
+                        break;
+                }
+        }
+
+        return false;
+}
+
+/* Uploads uniform data to the batch pool, unless the last upload remembered
+ * by the shadow has exactly the same contents */
+static mali_ptr
+panfrost_upload_uniforms(struct panfrost_batch *batch,
+                         struct panfrost_upload_shadow *shadow,
+                         const void *data, unsigned size, unsigned alignment)
+{
+        if (shadow->gpu && shadow->size == size &&
+            !memcmp(shadow->data, data, size))
+                return shadow->gpu;
+
+        struct panfrost_ptr T =
+                pan_pool_alloc_aligned(&batch->pool.base, size, alignment);
+
+        memcpy(T.cpu, data, size);
+
+        if (size <= sizeof(shadow->data)) {
+                memcpy(shadow->data, data, size);
+                shadow->size = size;
+                shadow->gpu = T.gpu;
+        }
+
+        return T.gpu;
+}
+
+#if PAN_ARCH >= 9
+#define PAN_UBO_DESC BUFFER
+#else
+#define PAN_UBO_DESC UNIFORM_BUFFER
+#endif
+
 static mali_ptr
 panfrost_emit_const_buf(struct panfrost_batch *batch,
                         enum pipe_shader_type stage,
@@ -1498,37 +1687,53 @@ panfrost_emit_const_buf(struct panfrost_batch *batch,
         if (!ss)
                 return 0;
 
-        /* Allocate room for the sysval and the uniforms */
+        /* Most draws of a batch see the same uniforms as the draw before, so
+         * everything is packed on the CPU first and only uploaded if it
+         * differs from the last upload for the stage */
+        struct panfrost_stage_uploads *uploads = NULL;
+
+        if (!panfrost_sysvals_patched(ss)) {
+                if (!batch->uploads[stage])
+                        batch->uploads[stage] = calloc(1, sizeof(*uploads));
+
+                uploads = batch->uploads[stage];
+        }
+
+        /* Write sysvals to a shadow buffer to make pushing cheaper */
         size_t sys_size = sizeof(float) * 4 * ss->info.sysvals.sysval_count;
-        struct panfrost_ptr transfer =
-                pan_pool_alloc_aligned(&batch->pool.base, sys_size, 16);
-        void *sys_cpu = malloc(sys_size);
+        struct sysval_uniform sys_cpu[MAX_SYSVAL_COUNT];
+        struct panfrost_ptr sys_shadow = { .cpu = sys_cpu };
+        struct panfrost_ptr transfer = { 0 };
 
-        /* Write to a shadow buffer to make pushing cheaper */
-        struct panfrost_ptr sys_shadow = {
-                .cpu = sys_cpu,
-                .gpu = transfer.gpu,
-        };
+        if (!uploads) {
+                transfer = pan_pool_alloc_aligned(&batch->pool.base, sys_size, 16);
+                sys_shadow.gpu = transfer.gpu;
+        }
+
+        uint32_t preamble[PAN_MAX_PREAMBLE_WORDS] = { 0 };
+
+        if (ss->info.preamble.nr_instrs)
+                panfrost_eval_preamble(ctx, ss, stage, preamble);
 
         /* Upload sysvals requested by the shader */
-        panfrost_upload_sysvals(batch, &sys_shadow, ss, stage);
-        memcpy(transfer.cpu, sys_cpu, sys_size);
+        panfrost_upload_sysvals(batch, &sys_shadow, ss, stage, preamble);
+
+        if (uploads) {
+                transfer.gpu = panfrost_upload_uniforms(batch, &uploads->sysvals,
+                                                        sys_cpu, sys_size, 16);
+        } else {
+                memcpy(transfer.cpu, sys_cpu, sys_size);
+        }
 
         /* Next up, attach UBOs. UBO count includes gaps but no sysval UBO */
         struct panfrost_compiled_shader *shader = ctx->prog[stage];
         unsigned ubo_count = shader->info.ubo_count - (sys_size ? 1 : 0);
         unsigned sysval_ubo = sys_size ? ubo_count : ~0;
-        struct panfrost_ptr ubos = { 0 };
+        unsigned ubos_size = (ubo_count + 1) * pan_size(PAN_UBO_DESC);
+        uint8_t ubos_cpu[(PIPE_MAX_CONSTANT_BUFFERS + 1) * pan_size(PAN_UBO_DESC)];
 
-#if PAN_ARCH >= 9
-        ubos = pan_pool_alloc_desc_array(&batch->pool.base,
-                                         ubo_count + 1,
-                                         BUFFER);
-#else
-        ubos = pan_pool_alloc_desc_array(&batch->pool.base,
-                                         ubo_count + 1,
-                                         UNIFORM_BUFFER);
-#endif
+        /* Gaps are zeroed so identical bindings compare equal */
+        memset(ubos_cpu, 0, ubos_size);
 
         if (buffer_count)
                 *buffer_count = ubo_count + (sys_size ? 1 : 0);
@@ -1536,7 +1741,7 @@ panfrost_emit_const_buf(struct panfrost_batch *batch,
         /* Upload sysval as a final UBO */
 
         if (sys_size)
-                panfrost_emit_ubo(ubos.cpu, ubo_count, transfer.gpu, sys_size);
+                panfrost_emit_ubo(ubos_cpu, ubo_count, transfer.gpu, sys_size);
 
         /* The rest are honest-to-goodness UBOs */
 
@@ -1549,29 +1754,59 @@ panfrost_emit_const_buf(struct panfrost_batch *batch,
                                         stage, buf, ubo);
                 }
 
-                panfrost_emit_ubo(ubos.cpu, ubo, address, usz);
+                panfrost_emit_ubo(ubos_cpu, ubo, address, usz);
+        }
+
+        mali_ptr ubos;
+
+        if (uploads) {
+                ubos = panfrost_upload_uniforms(batch, &uploads->ubos, ubos_cpu,
+                                                ubos_size,
+                                                pan_alignment(PAN_UBO_DESC));
+        } else {
+                ubos = pan_pool_upload_aligned(&batch->pool.base, ubos_cpu,
+                                               ubos_size,
+                                               pan_alignment(PAN_UBO_DESC));
         }
 
         if (pushed_words)
                 *pushed_words = ss->info.push.count;
 
-        if (ss->info.push.count == 0) {
-                free(sys_cpu);
-                return ubos.gpu;
-        }
+        if (ss->info.push.count == 0)
+                return ubos;
 
-        /* Copy push constants required by the shader */
-        struct panfrost_ptr push_transfer =
-                pan_pool_alloc_aligned(&batch->pool.base,
-                                       ss->info.push.count * 4, 16);
+        /* Copy push constants required by the shader. The address is only
+         * needed up front if sysvals get patched. */
+        uint32_t push_words[PAN_MAX_PUSH];
+        struct panfrost_ptr push_transfer = { .cpu = push_words };
+
+        if (!uploads) {
+                push_transfer =
+                        pan_pool_alloc_aligned(&batch->pool.base,
+                                               ss->info.push.count * 4, 16);
+        }
 
         uint32_t *push_cpu = (uint32_t *) push_transfer.cpu;
-        *push_constants = push_transfer.gpu;
 
-        for (unsigned i = 0; i < ss->info.push.count; ++i) {
+        for (unsigned i = 0; i < ss->info.push.count; ) {
                 struct panfrost_ubo_word src = ss->info.push.words[i];
+                unsigned nr_words = 1;
+
+                if (src.ubo == PAN_UBO_CONSTANTS) {
+                        push_cpu[i] = ss->info.push.constants[i];
+                        ++i;
+                        continue;
+                }
 
-                if (src.ubo == sysval_ubo) {
+                if (src.ubo != sysval_ubo) {
+                        /* The compiler pushes ranges in order, so copy runs
+                         * of consecutive words at once */
+                        while (i + nr_words < ss->info.push.count &&
+                               ss->info.push.words[i + nr_words].ubo == src.ubo &&
+                               ss->info.push.words[i + nr_words].offset ==
+                               src.offset + (4 * nr_words))
+                                ++nr_words;
+                } else {
                         unsigned sysval_idx = src.offset / 16;
                         unsigned sysval_comp = (src.offset % 16) / 4;
                         unsigned sysval_type = PAN_SYSVAL_TYPE(ss->info.sysvals.sysvals[sysval_idx]);
@@ -1613,13 +1848,21 @@ panfrost_emit_const_buf(struct panfrost_batch *batch,
                 const void *mapped_ubo = (src.ubo == sysval_ubo) ? sys_cpu :
                         panfrost_map_constant_buffer_cpu(ctx, buf, src.ubo);
 
-                /* TODO: Is there any benefit to combining ranges */
-                memcpy(push_cpu + i, (uint8_t *) mapped_ubo + src.offset, 4);
+                memcpy(push_cpu + i, (uint8_t *) mapped_ubo + src.offset,
+                       4 * nr_words);
+                i += nr_words;
         }
 
-        free(sys_cpu);
+        if (uploads) {
+                *push_constants =
+                        panfrost_upload_uniforms(batch, &uploads->push,
+                                                 push_words,
+                                                 ss->info.push.count * 4, 16);
+        } else {
+                *push_constants = push_transfer.gpu;
+        }
 
-        return ubos.gpu;
+        return ubos;
 }
 
 /*
@@ -1628,21 +1871,25 @@ panfrost_emit_const_buf(struct panfrost_batch *batch,
  * shader core, setting to the (rounded) total number of tasks avoids any
  * throttling. Smaller values save memory at the expense of possible throttling.
  *
- * With indirect dispatch, we don't know at launch-time how many tasks will be
- * needed, so we use a conservative value that's unlikely to cause slowdown in
- * practice without wasting too much memory.
+ * A core never runs more workgroups at once than its threads allow given the
+ * register usage of the shader, so that bounds the count without throttling.
+ * It also sizes indirect dispatches, whose grid isn't known at launch-time.
  */
 static unsigned
-panfrost_choose_wls_instance_count(const struct pipe_grid_info *grid)
+panfrost_choose_wls_instance_count(struct panfrost_device *dev,
+                                   const struct panfrost_compiled_shader *ss,
+                                   const struct pipe_grid_info *grid)
 {
-        if (grid->indirect) {
-                /* May need tuning in the future, conservative guess */
-                return 128;
-        } else {
-                return util_next_power_of_two(grid->grid[0]) *
-                       util_next_power_of_two(grid->grid[1]) *
-                       util_next_power_of_two(grid->grid[2]);
-        }
+        unsigned max_threads =
+                panfrost_compute_max_thread_count(dev, ss->info.work_reg_count);
+        unsigned threads_per_wg =
+                grid->block[0] * grid->block[1] * grid->block[2];
+        struct pan_compute_dim dim = {
+                grid->grid[0], grid->grid[1], grid->grid[2]
+        };
+
+        return pan_wls_instances_for_occupancy(grid->indirect ? NULL : &dim,
+                                               max_threads, threads_per_wg);
 }
 
 static mali_ptr
@@ -1658,7 +1905,7 @@ panfrost_emit_shared_memory(struct panfrost_batch *batch,
         struct pan_tls_info info = {
                 .tls.size = ss->info.tls_size,
                 .wls.size = ss->info.wls_size + grid->variable_shared_mem,
-                .wls.instances = panfrost_choose_wls_instance_count(grid),
+                .wls.instances = panfrost_choose_wls_instance_count(dev, ss, grid),
         };
 
         if (ss->info.tls_size) {
@@ -1775,9 +2022,27 @@ panfrost_create_sampler_view_bo(struct panfrost_sampler_view *so,
                 (PAN_ARCH <= 5 ? pan_size(TEXTURE) : 0) +
                 GENX(panfrost_estimate_texture_payload_size)(&iview);
 
-        struct panfrost_pool *pool = so->pool ?: &ctx->descs;
-        struct panfrost_ptr payload = pan_pool_alloc_aligned(&pool->base, size, 64);
-        so->state = panfrost_pool_take_ref(&ctx->descs, payload.gpu);
+        struct panfrost_ptr payload;
+
+#if PAN_ARCH >= 10
+        /* Views can be created and destroyed at a high rate, so long lived
+         * ones are recycled through the heap rather than holding on to
+         * pool BOs */
+        if (!so->pool)
+                so->desc = panfrost_desc_heap_alloc(&ctx->desc_heap, size);
+#endif
+
+        if (so->desc.bo) {
+                payload.cpu = so->desc.cpu;
+                payload.gpu = so->desc.gpu;
+                so->state.bo = so->desc.bo;
+                so->state.gpu = so->desc.gpu;
+        } else {
+                struct panfrost_pool *pool = so->pool ?: &ctx->descs;
+
+                payload = pan_pool_alloc_aligned(&pool->base, size, 64);
+                so->state = panfrost_pool_take_ref(pool, payload.gpu);
+        }
 
         void *tex = (PAN_ARCH >= 6) ? &so->bifrost_descriptor : payload.cpu;
 
@@ -1789,6 +2054,19 @@ panfrost_create_sampler_view_bo(struct panfrost_sampler_view *so,
         GENX(panfrost_new_texture)(device, &iview, tex, &payload);
 }
 
+static void
+panfrost_release_sampler_view_bo(struct panfrost_context *ctx,
+                                 struct panfrost_sampler_view *view)
+{
+        if (view->desc.bo)
+                panfrost_desc_heap_free(&ctx->desc_heap, &view->desc);
+        else
+                panfrost_bo_unreference(view->state.bo);
+
+        view->desc = (struct panfrost_desc) { 0 };
+        view->state.bo = NULL;
+}
+
 static void
 panfrost_update_sampler_view(struct panfrost_sampler_view *view,
                              struct pipe_context *pctx)
@@ -1796,7 +2074,7 @@ panfrost_update_sampler_view(struct panfrost_sampler_view *view,
         struct panfrost_resource *rsrc = pan_resource(view->base.texture);
         if (view->texture_bo != rsrc->image.data.bo->ptr.gpu ||
             view->modifier != rsrc->image.layout.modifier) {
-                panfrost_bo_unreference(view->state.bo);
+                panfrost_release_sampler_view_bo(pan_context(pctx), view);
                 panfrost_create_sampler_view_bo(view, pctx, &rsrc->base);
         }
 }
@@ -1811,12 +2089,7 @@ panfrost_emit_texture_descriptors(struct panfrost_batch *batch,
                 return 0;
 
 #if PAN_ARCH >= 6
-        struct panfrost_ptr T =
-                pan_pool_alloc_desc_array(&batch->pool.base,
-                                          ctx->sampler_view_count[stage],
-                                          TEXTURE);
-        struct mali_texture_packed *out =
-                (struct mali_texture_packed *) T.cpu;
+        struct mali_texture_packed out[PIPE_MAX_SHADER_SAMPLER_VIEWS];
 
         for (int i = 0; i < ctx->sampler_view_count[stage]; ++i) {
                 struct panfrost_sampler_view *view = ctx->sampler_views[stage][i];
@@ -1833,10 +2106,14 @@ panfrost_emit_texture_descriptors(struct panfrost_batch *batch,
                 out[i] = view->bifrost_descriptor;
 
                 panfrost_batch_read_rsrc(batch, rsrc, stage);
+                panfrost_resource_note_sample(rsrc, batch->seqnum);
                 panfrost_batch_add_bo(batch, view->state.bo, stage);
         }
 
-        return T.gpu;
+        return panfrost_upload_desc_table(batch, stage, out,
+                                          ctx->sampler_view_count[stage] *
+                                          pan_size(TEXTURE),
+                                          pan_alignment(TEXTURE));
 #else
         uint64_t trampolines[PIPE_MAX_SHADER_SAMPLER_VIEWS];
 
@@ -1849,6 +2126,8 @@ panfrost_emit_texture_descriptors(struct panfrost_batch *batch,
                 }
 
                 panfrost_update_sampler_view(view, &ctx->base);
+                panfrost_resource_note_sample(pan_resource(view->base.texture),
+                                              batch->seqnum);
 
                 trampolines[i] = panfrost_get_tex_desc(batch, stage, view);
         }
@@ -1869,11 +2148,7 @@ panfrost_emit_sampler_descriptors(struct panfrost_batch *batch,
         if (!ctx->sampler_count[stage])
                 return 0;
 
-        struct panfrost_ptr T =
-                pan_pool_alloc_desc_array(&batch->pool.base,
-                                          ctx->sampler_count[stage],
-                                          SAMPLER);
-        struct mali_sampler_packed *out = (struct mali_sampler_packed *) T.cpu;
+        struct mali_sampler_packed out[PIPE_MAX_SAMPLERS];
 
         for (unsigned i = 0; i < ctx->sampler_count[stage]; ++i) {
                 struct panfrost_sampler_state *st = ctx->samplers[stage][i];
@@ -1881,7 +2156,10 @@ panfrost_emit_sampler_descriptors(struct panfrost_batch *batch,
                 out[i] = st ? st->hw : (struct mali_sampler_packed){0};
         }
 
-        return T.gpu;
+        return panfrost_upload_desc_table(batch, stage, out,
+                                          ctx->sampler_count[stage] *
+                                          pan_size(SAMPLER),
+                                          pan_alignment(SAMPLER));
 }
 
 #if PAN_ARCH <= 7
@@ -1948,6 +2226,7 @@ emit_image_bufs(struct panfrost_batch *batch, enum pipe_shader_type shader,
                 bool is_buffer = rsrc->base.target == PIPE_BUFFER;
 
                 unsigned offset = is_buffer ? image->u.buf.offset :
+                        rsrc->image.data.offset +
                         panfrost_texture_offset(&rsrc->image.layout,
                                                 image->u.tex.level,
                                                 is_3d ? 0 : image->u.tex.first_layer,
@@ -2747,12 +3026,27 @@ emit_fbd(struct panfrost_batch *batch, const struct pan_fb_info *fb)
                 },
         };
 
+#if PAN_ARCH >= 5
+        unsigned tile_size = GENX(pan_select_tile_size)(dev, fb);
+
+        if (tile_size < 16 * 16) {
+                perf_debug(dev, "%ux%u framebuffer with %u render targets "
+                           "and %u samples uses %u pixel tiles",
+                           fb->width, fb->height, fb->rt_count,
+                           fb->nr_samples, tile_size);
+        }
+
+        /* Depth prepasses and shadow maps, which get larger tiles on v10 */
+        if (fb->zs.view.zs && tile_size > 16 * 16)
+                batch->ctx->stats.zs_only_batches++;
+#endif
+
         batch->framebuffer.gpu |=
                 GENX(pan_emit_fbd)(dev, fb, &tls, &batch->tiler_ctx,
                                    batch->framebuffer.cpu);
 }
 
-/* Mark a surface as written */
+/* Mark the area of a surface covered by the batch as written */
 
 static void
 panfrost_initialize_surface(struct panfrost_batch *batch,
@@ -2760,7 +3054,9 @@ panfrost_initialize_surface(struct panfrost_batch *batch,
 {
         if (surf) {
                 struct panfrost_resource *rsrc = pan_resource(surf->texture);
-                BITSET_SET(rsrc->valid.data, surf->u.tex.level);
+                panfrost_resource_set_valid_region(rsrc, surf->u.tex.level,
+                                                   batch->minx, batch->miny,
+                                                   batch->maxx, batch->maxy);
         }
 }
 
@@ -2775,8 +3071,10 @@ emit_fragment_job(struct panfrost_batch *batch, const struct pan_fb_info *pfb)
 
         struct pipe_framebuffer_state *fb = &batch->key;
 
-        for (unsigned i = 0; i < fb->nr_cbufs; ++i)
+        for (unsigned i = 0; i < fb->nr_cbufs; ++i) {
                 panfrost_initialize_surface(batch, fb->cbufs[i]);
+                panfrost_initialize_surface(batch, batch->resolve_surfs[i]);
+        }
 
         panfrost_initialize_surface(batch, fb->zsbuf);
 
@@ -2846,34 +3144,214 @@ panfrost_import_dmabuf_fence(int dmabuf, int fence)
         return true;
 }
 
-static uint64_t *
-panfrost_cs_ring_allocate_instrs(struct panfrost_cs *cs, unsigned count)
+static pan_command_stream
+panfrost_batch_create_cs(struct panfrost_batch *batch, unsigned count)
+{
+        struct panfrost_ptr cs = pan_pool_alloc_aligned(&batch->pool.base, count * 8, 64);
+
+        return (pan_command_stream) {
+                .ptr = cs.cpu,
+                .begin = cs.cpu,
+                .end = cs.cpu + count,
+                .gpu = cs.gpu,
+        };
+}
+
+static void
+panfrost_cs_ring_reset(struct panfrost_context *ctx, struct panfrost_cs *cs)
+{
+        pan_command_stream *c = &cs->cs;
+
+        cs->offset = 0;
+        cs->ring_peak = 0;
+        cs->ring_shrink = false;
+
+        c->ptr = cs->bo->ptr.cpu;
+        c->begin = cs->bo->ptr.cpu;
+        c->end = cs->bo->ptr.cpu + cs->base.size;
+        c->gpu = cs->bo->ptr.gpu;
+
+        // eight instructions == 64 bytes
+        pan_pack_ins(c, CS_RESOURCES, cfg) { cfg.mask = cs->hw_resources; }
+        pan_pack_ins(c, CS_SLOT, cfg) { cfg.index = 2; }
+        pan_emit_cs_48(c, 0x48, ctx->kbase_ctx->tiler_heaps[0].va);
+        pan_pack_ins(c, CS_HEAPCTX, cfg) { cfg.address = 0x48; }
+        for (unsigned i = 0; i < 4; ++i)
+                pan_pack_ins(c, CS_NOP, _);
+}
+
+/* Wait for the GPU to read up to the ring offset target, returns false if
+ * it doesn't make progress */
+static bool
+panfrost_cs_ring_wait(struct panfrost_device *dev, struct panfrost_cs *cs,
+                      uint64_t target)
+{
+        /* The same timeout as used for detecting hung batches */
+        int64_t end = os_time_get_nano() + 1000000000LL;
+
+        while (dev->mali.cs_extract(&dev->mali, &cs->base) < target) {
+                if (os_time_get_nano() > end) {
+                        fprintf(stderr, "CSI %i: timed out waiting for "
+                                "ring space\n", cs->base.csi);
+                        return false;
+                }
+
+                os_time_sleep(100);
+        }
+
+        return true;
+}
+
+static void
+panfrost_cs_ring_resize(struct panfrost_context *ctx, struct panfrost_cs *cs,
+                        unsigned size)
 {
-        pan_command_stream c = cs->cs;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        struct panfrost_bo *bo =
+                panfrost_bo_create(dev, size, 0, "Command stream");
+
+        if (!dev->mali.cs_resize(&dev->mali, &cs->base, bo->ptr.gpu, size))
+                mesa_loge("failed to bind resized CS ring");
 
-        if (c.ptr + count > c.end) {
-                assert(c.ptr <= c.end);
-                assert(c.begin + count <= c.ptr);
+        panfrost_bo_unreference(cs->bo);
+        cs->bo = bo;
 
-                /* Instructions are in a ring buffer, simply NOP out the end
-                 * and start back from the start. Possibly, doing a TAILCALL
-                 * straight to the start could also work. */
-                memset(c.ptr, 0, (c.end - c.ptr) * 8);
-                c.ptr = c.begin;
+        /* Nothing emitted to the ring is pending, so only the prologue
+         * needs to be copied over. It is submitted along with the next
+         * batch. */
+        panfrost_cs_ring_reset(ctx, cs);
+}
+
+/* Call the commands in w from the ring of cs. The ring is only written once
+ * the GPU has read past the space being reused, instead of relying on the
+ * ring being a lot larger than the work in flight. */
+static void
+panfrost_cs_ring_call(struct panfrost_context *ctx, struct panfrost_cs *cs,
+                      pan_command_stream w)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        pan_command_stream *c = &cs->cs;
 
+        if (c->ptr == c->end) {
+                c->ptr = c->begin;
                 cs->offset += cs->base.size;
-                cs->cs = c;
+                p_atomic_inc(&ctx->stats.cs_ring_wraps);
+
+                /* Shrink the ring if at most a quarter was used during
+                 * the last lap */
+                cs->ring_shrink = cs->base.size > PAN_CS_RING_MIN_SIZE &&
+                        cs->ring_peak * 4 <= cs->base.size;
+                cs->ring_peak = 0;
+        }
+
+        /* Everything emitted to the ring has been submitted by now. If
+         * the queue is gone after a fault, nothing is reading the ring. */
+        uint64_t insert = cs->offset + (c->ptr - c->begin) * 8;
+        uint64_t extract = cs->base.user_io ?
+                dev->mali.cs_extract(&dev->mali, &cs->base) : insert;
+        bool full = insert + PAN_CS_RING_CALL_SIZE - extract > cs->base.size;
+
+        if (full && cs->base.size < PAN_CS_RING_MAX_SIZE) {
+                /* Moving the queue to a larger ring requires it to be idle,
+                 * but then we would have had to wait anyway */
+                if (panfrost_cs_ring_wait(dev, cs, insert))
+                        panfrost_cs_ring_resize(ctx, cs, cs->base.size * 2);
+        } else if (full) {
+                panfrost_cs_ring_wait(dev, cs, insert + PAN_CS_RING_CALL_SIZE -
+                                      cs->base.size);
+        } else if (cs->ring_shrink && cs->base.user_io && extract == insert) {
+                panfrost_cs_ring_resize(ctx, cs, cs->base.size / 2);
+        }
+
+        /* The ring might have been resized, so read the offsets again */
+        insert = cs->offset + (c->ptr - c->begin) * 8;
+        if (cs->base.user_io)
+                extract = dev->mali.cs_extract(&dev->mali, &cs->base);
+        extract = MIN2(extract, insert);
+        cs->ring_peak = MAX2(cs->ring_peak,
+                             insert + PAN_CS_RING_CALL_SIZE - extract);
+
+        ASSERTED uint64_t *start = c->ptr;
+
+        pan_emit_cs_48(c, 0x48, w.gpu);
+        pan_emit_cs_32(c, 0x4a, (w.ptr - w.begin) * 8);
+        pan_pack_ins(c, CS_CALL, cfg) { cfg.address = 0x48; cfg.length = 0x4a; }
+        pan_pack_ins(c, CS_NOP, _);
+
+        assert((c->ptr - start) * 8 == PAN_CS_RING_CALL_SIZE);
+        assert(c->ptr <= c->end);
+}
+
+/* Commands for a single submission to a CSF queue. The caller can emit some
+ * setup of its own before passing it to emit_csf_queue. */
+static pan_command_stream
+panfrost_batch_create_queue_cs(struct panfrost_batch *batch,
+                               struct util_dynarray *deps)
+{
+        /* Note the multiplication: pan_emit_cs_64 might be split, so four
+         * instructions are needed for waiting on each dependency. Storing a
+         * timestamp takes two, plus a wait after the last ones, and tracing
+         * the batch stores two more. */
+        return panfrost_batch_create_cs(batch, 149 +
+                util_dynarray_num_elements(deps, struct panfrost_usage) * 4 +
+                util_dynarray_num_elements(&batch->timestamps,
+                                           struct panfrost_timestamp) * 2 + 1);
+}
+
+/* Store the timestamps taken at the start or the end of the batch. Those at
+ * the end wait for all of the work of the queue to finish first. */
+static void
+emit_csf_timestamps(struct panfrost_batch *batch, pan_command_stream *c,
+                    bool end)
+{
+        bool stored = false;
+
+        util_dynarray_foreach(&batch->timestamps, struct panfrost_timestamp, t) {
+                if (t->end != end)
+                        continue;
+
+                pan_emit_cs_48(c, 0x42, t->bo->ptr.gpu + t->offset);
+                pan_pack_ins(c, CS_STORE_STATE, cfg) {
+                        cfg.wait_mask = end ? 0xff : 0;
+                        cfg.state = MALI_CS_STATE_TIMESTAMP;
+                        cfg.address = 0x42;
+                }
+
+                stored = true;
+        }
+
+        /* Make sure the stores land before the queue signals completion */
+        if (stored && end)
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 0xff; }
+}
+
+/* Store the start or end time of the batch on the queue to its trace slot,
+ * see panfrost_batch_trace_csf */
+static void
+emit_csf_trace(struct panfrost_batch *batch, pan_command_stream *c,
+               enum panfrost_perfetto_queue queue, bool end)
+{
+        if (!batch->trace_ts)
+                return;
+
+        pan_emit_cs_48(c, 0x42, batch->trace_ts +
+                       (queue * 2 + end) * sizeof(uint64_t));
+        pan_pack_ins(c, CS_STORE_STATE, cfg) {
+                cfg.wait_mask = end ? 0xff : 0;
+                cfg.state = MALI_CS_STATE_TIMESTAMP;
+                cfg.address = 0x42;
         }
 
-        /* TODO: Check against the extract offset */
-        return c.ptr + count;
+        if (end)
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 0xff; }
 }
 
 // TODO: Rewrite this!
 static void
 emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
-               pan_command_stream s, struct util_dynarray *deps,
-               bool first, bool last)
+               pan_command_stream w, pan_command_stream s,
+               struct util_dynarray *deps, bool first, bool last)
 {
         struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
 
@@ -2881,11 +3359,14 @@ emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
 
         bool fragment = (cs->hw_resources & 2);
         bool vertex = (cs->hw_resources & 12); /* TILER | IDVS */
+        bool compute = !fragment && !vertex;
 
-        uint64_t *limit = panfrost_cs_ring_allocate_instrs(cs,
-                128 + util_dynarray_num_elements(deps, struct panfrost_usage) * 4);
+        enum panfrost_perfetto_queue queue =
+                compute ? PAN_PERFETTO_QUEUE_COMPUTE :
+                fragment ? PAN_PERFETTO_QUEUE_FRAGMENT :
+                PAN_PERFETTO_QUEUE_VERTEX;
 
-        pan_command_stream *c = &cs->cs;
+        pan_command_stream *c = &w;
 
         /* First, do some waiting at the start of the job */
 
@@ -2895,48 +3376,71 @@ emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
         // TODO: What does this need to be?
         pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 0xff; }
 
-        /* For the first job in the batch, wait on dependencies */
-        // TODO: Usually the vertex job shouldn't have to wait for dmabufs!
-        if (first) {
-                mali_ptr seqnum_ptr_base = dev->mali.event_mem.gpu;
-
-                util_dynarray_foreach(deps, struct panfrost_usage, u) {
-                        /* Note the multiplication in the call to
-                         * cs_ring_allocate_instrs. pan_emit_cs_64 might be
-                         * split, so the total is four instructions. */
-                        pan_emit_cs_48(c, 0x42, seqnum_ptr_base +
-                                       u->queue * PAN_EVENT_SIZE);
-                        pan_emit_cs_64(c, 0x40, u->seqnum);
-                        pan_pack_ins(c, CS_EVWAIT_64, cfg) {
-                                cfg.no_error = true;
-                                cfg.condition = MALI_WAIT_CONDITION_HIGHER;
-                                cfg.value = 0x40;
-                                cfg.addr = 0x42;
-                        }
+        /* Wait on the dependencies of the stage run by this queue. For the
+         * fragment queue of a batch with vertex work, this is on top of the
+         * wait for the vertex job below. */
+        mali_ptr seqnum_ptr_base = dev->mali.event_mem.gpu;
+
+        util_dynarray_foreach(deps, struct panfrost_usage, u) {
+                /* See panfrost_batch_create_queue_cs for the size */
+                pan_emit_cs_48(c, 0x42, seqnum_ptr_base +
+                               u->queue * PAN_EVENT_SIZE);
+                pan_emit_cs_64(c, 0x40, u->seqnum);
+                pan_pack_ins(c, CS_EVWAIT_64, cfg) {
+                        cfg.no_error = true;
+                        cfg.condition = MALI_WAIT_CONDITION_HIGHER;
+                        cfg.value = 0x40;
+                        cfg.addr = 0x42;
                 }
+        }
 
-                uint64_t kcpu_seqnum = ++cs->kcpu_seqnum;
+        /* Only wait for the implicit fences of dma-bufs accessed by this
+         * stage, so that e.g. vertex work can run before a sampled buffer
+         * is ready */
+        uint32_t stage = fragment ? PAN_BO_ACCESS_FRAGMENT :
+                PAN_BO_ACCESS_VERTEX_TILER;
+        bool imported = false;
 
-                util_dynarray_foreach(&batch->dmabufs, int, fd) {
-                        int fence = panfrost_export_dmabuf_fence(*fd);
+        util_dynarray_foreach(&batch->dmabufs, struct panfrost_dmabuf, d) {
+                if (!(d->access & stage))
+                        continue;
 
-                        /* TODO: poll on the dma-buf? */
-                        if (fence == -1)
-                                continue;
+                int fence = panfrost_export_dmabuf_fence(d->fd);
 
-                        // TODO: What if we reach the limit for number of KCPU
-                        // commands in a queue? It's pretty low (256)
-                        dev->mali.kcpu_fence_import(&dev->mali, cs->base.ctx,
-                                                    fence);
+                /* TODO: poll on the dma-buf? */
+                if (fence == -1)
+                        continue;
 
-                        close(fence);
-                }
+                // TODO: What if we reach the limit for number of KCPU
+                // commands in a queue? It's pretty low (256)
+                dev->mali.kcpu_fence_import(&dev->mali, cs->base.ctx,
+                                            fence);
+                p_atomic_inc(&batch->ctx->stats.kcpu_commands);
 
-                bool ret = dev->mali.kcpu_cqs_set(&dev->mali, cs->base.ctx,
-                                  cs->kcpu_event_ptr, kcpu_seqnum + 1);
+                close(fence);
+                imported = true;
+        }
 
-                if (ret) {
-                        /* If we don't set no_error, kbase might decide to
+        /* Wait for fences from fence_server_sync before anything in the
+         * batch runs */
+        if (first && batch->in_sync_fd >= 0) {
+                dev->mali.kcpu_fence_import(&dev->mali, cs->base.ctx,
+                                            batch->in_sync_fd);
+                p_atomic_inc(&batch->ctx->stats.kcpu_commands);
+                close(batch->in_sync_fd);
+                batch->in_sync_fd = -1;
+                imported = true;
+        }
+
+        if (imported) {
+                uint64_t kcpu_seqnum = ++cs->kcpu_seqnum;
+
+                bool ret = dev->mali.kcpu_cqs_set(&dev->mali, cs->base.ctx,
+                                  cs->kcpu_event_ptr, kcpu_seqnum + 1);
+                p_atomic_inc(&batch->ctx->stats.kcpu_commands);
+
+                if (ret) {
+                        /* If we don't set no_error, kbase might decide to
                          * pass on errors from waiting for fences. */
                         pan_emit_cs_48(c, 0x42, cs->kcpu_event_ptr);
                         pan_emit_cs_64(c, 0x40, kcpu_seqnum);
@@ -2961,42 +3465,37 @@ emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
         if (vertex) {
                 pan_pack_ins(c, CS_SLOT, cfg) { cfg.index = 3; }
                 pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 3; }
-                pan_pack_ins(c, CS_HEAPINC, cfg) {
-                        cfg.type = MALI_HEAP_STATISTIC_V_T_START;
+                if (batch->tiler_heap_held) {
+                        pan_pack_ins(c, CS_HEAPINC, cfg) {
+                                cfg.type = MALI_HEAP_STATISTIC_V_T_START;
+                        }
                 }
         } else if (fragment) {
                 pan_pack_ins(c, CS_SLOT, cfg) { cfg.index = 4; }
                 pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 4; }
+        } else if (compute) {
+                /* Use the same slot as compute on the vertex queue, which is
+                 * covered by the scoreboard mask of the final EVSTR */
+                pan_pack_ins(c, CS_SLOT, cfg) { cfg.index = 3; }
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 3; }
         }
 
-        // copying to the main buffer can make debugging easier.
-        // TODO: This needs to be more reliable.
-#if 0
-        unsigned length = (s.ptr - s.begin) * 8;
-        unsigned clamped = MIN2(length, cs->bo->ptr.cpu + cs->bo->size - (void *)c->ptr);
-        memcpy(c->ptr, s->begin, clamped);
-        c->ptr += clamped / 8;
+        if (first)
+                emit_csf_timestamps(batch, c, false);
 
-        if (clamped != length) {
-                unsigned rest = length - clamped;
-                c->ptr = cs->bo->ptr.cpu;
-                memcpy(c->ptr, s->begin, rest);
-                c->ptr += rest / 8;
-
-                cs->offset += cs->bo->size;
-        }
-#else
+        emit_csf_trace(batch, c, queue, false);
 
         pan_emit_cs_48(c, 0x48, s.gpu);
         pan_emit_cs_32(c, 0x4a, (s.ptr - s.begin) * 8);
         pan_pack_ins(c, CS_CALL, cfg) { cfg.address = 0x48; cfg.length = 0x4a; }
-#endif
 
         if (vertex) {
                 pan_pack_ins(c, CS_FLUSH_TILER, _) { }
                 pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 3; }
-                pan_pack_ins(c, CS_HEAPINC, cfg) {
-                        cfg.type = MALI_HEAP_STATISTIC_V_T_END;
+                if (batch->tiler_heap_held) {
+                        pan_pack_ins(c, CS_HEAPINC, cfg) {
+                                cfg.type = MALI_HEAP_STATISTIC_V_T_END;
+                        }
                 }
         }
 
@@ -3004,7 +3503,7 @@ emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
                 /* Skip the next operation if the batch doesn't use a tiler
                  * heap (i.e. it's just a blit) */
                 pan_emit_cs_ins(c, 22, 0x560030000001); /* b.ne w56, skip 1 */
-                pan_emit_cs_ins(c, 22, 0x570020000007); /* b.eq w57, skip 7 */
+                pan_emit_cs_ins(c, 22, 0x570020000009); /* b.eq w57, skip 9 */
 
                 pan_pack_ins(c, CS_LDR, cfg) {
                         cfg.offset = 4 * 10; /* Heap Start */
@@ -3020,6 +3519,16 @@ emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
                 }
                 pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = (1 << 0) | (1 << 3); }
 
+                /* Record the range for panfrost_tiler_heap_update */
+                pan_emit_cs_48(c, 0x42, batch->ctx->tiler_heap_stats->ptr.gpu +
+                               batch->tiler_heap * 16);
+                pan_pack_ins(c, CS_STR, cfg) {
+                        cfg.offset = 0;
+                        cfg.register_mask = 0xf;
+                        cfg.addr = 0x42;
+                        cfg.register_base = 0x4a;
+                }
+
                 pan_pack_ins(c, CS_HEAPCLEAR, cfg) {
                         cfg.start = 0x4a;
                         cfg.end = 0x4c;
@@ -3065,7 +3574,11 @@ emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
                 //pan_emit_cs_ins(c, 0x24, 0x540000000233ULL);
         }
 
+        emit_csf_trace(batch, c, queue, true);
+
         if (last) {
+                emit_csf_timestamps(batch, c, true);
+
                 uint64_t kcpu_seqnum = ++cs->kcpu_seqnum;
 
                 pan_emit_cs_64(c, 0x40, kcpu_seqnum + 1);
@@ -3081,10 +3594,11 @@ emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
                                         cs->kcpu_event_ptr, kcpu_seqnum);
 
                 int fence = dev->mali.kcpu_fence_export(&dev->mali, cs->base.ctx);
+                p_atomic_add(&batch->ctx->stats.kcpu_commands, 2);
 
                 if (fence != -1) {
-                        util_dynarray_foreach(&batch->dmabufs, int, fd) {
-                                panfrost_import_dmabuf_fence(*fd, fence);
+                        util_dynarray_foreach(&batch->dmabufs, struct panfrost_dmabuf, d) {
+                                panfrost_import_dmabuf_fence(d->fd, fence);
                         }
                 }
 
@@ -3105,14 +3619,16 @@ emit_csf_queue(struct panfrost_batch *batch, struct panfrost_cs *cs,
         while ((uintptr_t)c->ptr & 63)
                 pan_emit_cs_ins(c, 0, 0);
 
-        assert(c->ptr <= limit);
+        assert(c->ptr <= c->end);
+
+        panfrost_cs_ring_call(batch->ctx, cs, w);
 }
 
 static void
 emit_csf_toplevel(struct panfrost_batch *batch)
 {
-        pan_command_stream *cv = &batch->ctx->kbase_cs_vertex.cs;
-        pan_command_stream *cf = &batch->ctx->kbase_cs_fragment.cs;
+        struct panfrost_cs *vertex_cs = batch->compute ?
+                &batch->ctx->kbase_cs_compute : &batch->ctx->kbase_cs_vertex;
 
         pan_command_stream v = batch->cs_vertex;
         pan_command_stream f = batch->cs_fragment;
@@ -3126,21 +3642,39 @@ emit_csf_toplevel(struct panfrost_batch *batch)
         bool vert = (v.ptr != v.begin);
         bool frag = (f.ptr != f.begin);
 
+        /* Batches which don't tile leave the heap context alone, as the
+         * heaps of other batches can be recreated at any time */
+        bool heap = batch->tiler_heap_held;
+        mali_ptr heap_va =
+                batch->ctx->kbase_ctx->tiler_heaps[batch->tiler_heap].va;
+
         // TODO: Clean up control-flow?
 
         if (vert) {
-                pan_emit_cs_48(cv, 0x48, batch->ctx->kbase_ctx->tiler_heap_va);
-                pan_pack_ins(cv, CS_HEAPCTX, cfg) { cfg.address = 0x48; }
+                pan_command_stream wv =
+                        panfrost_batch_create_queue_cs(batch, &batch->vert_deps);
+                pan_command_stream *cv = &wv;
+
+                if (heap && !batch->compute) {
+                        pan_emit_cs_48(cv, 0x48, heap_va);
+                        pan_pack_ins(cv, CS_HEAPCTX, cfg) { cfg.address = 0x48; }
+                }
 
-                emit_csf_queue(batch, &batch->ctx->kbase_cs_vertex, v,
+                emit_csf_queue(batch, vertex_cs, wv, v,
                                &batch->vert_deps, true, !frag);
         }
 
         if (!frag)
                 return;
 
-        pan_emit_cs_48(cf, 0x48, batch->ctx->kbase_ctx->tiler_heap_va);
-        pan_pack_ins(cf, CS_HEAPCTX, cfg) { cfg.address = 0x48; }
+        pan_command_stream wf =
+                panfrost_batch_create_queue_cs(batch, &batch->frag_deps);
+        pan_command_stream *cf = &wf;
+
+        if (heap) {
+                pan_emit_cs_48(cf, 0x48, heap_va);
+                pan_pack_ins(cf, CS_HEAPCTX, cfg) { cfg.address = 0x48; }
+        }
 
         uint64_t vertex_seqnum = batch->ctx->kbase_cs_vertex.seqnum;
         // TODO: this assumes SAME_VA
@@ -3156,7 +3690,7 @@ emit_csf_toplevel(struct panfrost_batch *batch)
         assert(vert || batch->tiler_ctx.bifrost == 0);
         pan_emit_cs_48(cf, 0x56, batch->tiler_ctx.bifrost);
 
-        emit_csf_queue(batch, &batch->ctx->kbase_cs_fragment, f,
+        emit_csf_queue(batch, &batch->ctx->kbase_cs_fragment, wf, f,
                        &batch->frag_deps, !vert, true);
 }
 
@@ -3164,23 +3698,10 @@ static void
 init_cs(struct panfrost_context *ctx, struct panfrost_cs *cs)
 {
         struct panfrost_device *dev = pan_device(ctx->base.screen);
-        pan_command_stream *c = &cs->cs;
 
         cs->seqnum = 0;
 
-        cs->offset = 0;
-        c->ptr = cs->bo->ptr.cpu;
-        c->begin = cs->bo->ptr.cpu;
-        c->end = cs->bo->ptr.cpu + cs->base.size;
-        c->gpu = cs->bo->ptr.gpu;
-
-        // eight instructions == 64 bytes
-        pan_pack_ins(c, CS_RESOURCES, cfg) { cfg.mask = cs->hw_resources; }
-        pan_pack_ins(c, CS_SLOT, cfg) { cfg.index = 2; }
-        pan_emit_cs_48(c, 0x48, ctx->kbase_ctx->tiler_heap_va);
-        pan_pack_ins(c, CS_HEAPCTX, cfg) { cfg.address = 0x48; }
-        for (unsigned i = 0; i < 4; ++i)
-                pan_pack_ins(c, CS_NOP, _);
+        panfrost_cs_ring_reset(ctx, cs);
 
         dev->mali.cs_submit(&dev->mali, &cs->base, 64, NULL, 0);
         //dev->mali.cs_wait(&dev->mali, &cs->base, 64);
@@ -3226,7 +3747,8 @@ panfrost_statistics_record(
         if (!ctx->active_queries)
                 return;
 
-        uint32_t prims = u_prims_for_vertices(info->mode, draw->count);
+        uint64_t prims = (uint64_t) u_prims_for_vertices(info->mode, draw->count) *
+                         info->instance_count;
         ctx->prims_generated += prims;
 
         if (!ctx->streamout.num_targets)
@@ -3237,10 +3759,12 @@ panfrost_statistics_record(
 }
 
 static void
-panfrost_update_streamout_offsets(struct panfrost_context *ctx)
+panfrost_update_streamout_offsets(struct panfrost_context *ctx,
+                                  unsigned vertex_count)
 {
         unsigned count = u_stream_outputs_for_vertices(ctx->active_prim,
-                                                       ctx->vertex_count);
+                                                       vertex_count) *
+                         ctx->instance_count;
 
         for (unsigned i = 0; i < ctx->streamout.num_targets; ++i) {
                 if (!ctx->streamout.targets[i])
@@ -3366,15 +3890,21 @@ panfrost_update_shader_state(struct panfrost_batch *batch,
         bool frag = (st == PIPE_SHADER_FRAGMENT);
         unsigned dirty_3d = ctx->dirty;
         unsigned dirty = ctx->dirty_shader[st];
+        uint64_t start = panfrost_profile_begin(ctx->profile);
+        uint64_t t;
 
         if (dirty & PAN_DIRTY_STAGE_TEXTURE) {
+                t = panfrost_profile_begin(ctx->profile);
                 batch->textures[st] =
                         panfrost_emit_texture_descriptors(batch, st);
+                panfrost_profile_end(ctx->profile, PAN_PROFILE_EMIT_TEXTURES, t);
         }
 
         if (dirty & PAN_DIRTY_STAGE_SAMPLER) {
+                t = panfrost_profile_begin(ctx->profile);
                 batch->samplers[st] =
                         panfrost_emit_sampler_descriptors(batch, st);
+                panfrost_profile_end(ctx->profile, PAN_PROFILE_EMIT_SAMPLERS, t);
         }
 
         /* On Bifrost and older, the fragment shader descriptor is fused
@@ -3383,7 +3913,9 @@ panfrost_update_shader_state(struct panfrost_batch *batch,
          * standalone and is emitted here.
          */
         if ((dirty & PAN_DIRTY_STAGE_SHADER) && !((PAN_ARCH <= 7) && frag)) {
+                t = panfrost_profile_begin(ctx->profile);
                 batch->rsd[st] = panfrost_emit_compute_shader_meta(batch, st);
+                panfrost_profile_end(ctx->profile, PAN_PROFILE_EMIT_SHADER_META, t);
         }
 
 #if PAN_ARCH >= 9
@@ -3392,8 +3924,10 @@ panfrost_update_shader_state(struct panfrost_batch *batch,
 #endif
 
         if ((dirty & ss->dirty_shader) || (dirty_3d & ss->dirty_3d)) {
+                t = panfrost_profile_begin(ctx->profile);
                 batch->uniform_buffers[st] = panfrost_emit_const_buf(batch, st,
                                 NULL, &batch->push_uniforms[st], NULL);
+                panfrost_profile_end(ctx->profile, PAN_PROFILE_EMIT_CONST_BUF, t);
         }
 
 #if PAN_ARCH <= 7
@@ -3404,7 +3938,9 @@ panfrost_update_shader_state(struct panfrost_batch *batch,
         if (frag && ((dirty & PAN_DIRTY_STAGE_SHADER) ||
                      (dirty_3d & FRAGMENT_RSD_DIRTY_MASK))) {
 
+                t = panfrost_profile_begin(ctx->profile);
                 batch->rsd[st] = panfrost_emit_frag_shader_meta(batch);
+                panfrost_profile_end(ctx->profile, PAN_PROFILE_EMIT_SHADER_META, t);
         }
 
         if (frag && (dirty & PAN_DIRTY_STAGE_IMAGE)) {
@@ -3412,6 +3948,9 @@ panfrost_update_shader_state(struct panfrost_batch *batch,
                                 &batch->attrib_bufs[st], st);
         }
 #endif
+
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_UPDATE_SHADER_STATE,
+                             start);
 }
 
 static inline void
@@ -3419,16 +3958,23 @@ panfrost_update_state_3d(struct panfrost_batch *batch)
 {
         struct panfrost_context *ctx = batch->ctx;
         unsigned dirty = ctx->dirty;
+        uint64_t start = panfrost_profile_begin(ctx->profile);
 
         if (dirty & PAN_DIRTY_TLS_SIZE)
                 panfrost_batch_adjust_stack_size(batch);
 
-        if (dirty & PAN_DIRTY_BLEND)
+        bool fs_dirty =
+                ctx->dirty_shader[PIPE_SHADER_FRAGMENT] & PAN_DIRTY_STAGE_SHADER;
+
+        if ((dirty & PAN_DIRTY_BLEND) || fs_dirty)
                 panfrost_set_batch_masks_blend(batch);
 
         if (dirty & PAN_DIRTY_ZS)
                 panfrost_set_batch_masks_zs(batch);
 
+        if (fs_dirty)
+                panfrost_set_batch_masks_fs(batch);
+
 #if PAN_ARCH >= 9
         if ((dirty & (PAN_DIRTY_ZS | PAN_DIRTY_RASTERIZER)) ||
             (ctx->dirty_shader[PIPE_SHADER_FRAGMENT] & PAN_DIRTY_STAGE_SHADER))
@@ -3438,13 +3984,19 @@ panfrost_update_state_3d(struct panfrost_batch *batch)
                 batch->blend = panfrost_emit_blend_valhall(batch);
 
         if (dirty & PAN_DIRTY_VERTEX) {
+                uint64_t t = panfrost_profile_begin(ctx->profile);
+
                 batch->attribs[PIPE_SHADER_VERTEX] =
                         panfrost_emit_vertex_data(batch);
 
                 batch->attrib_bufs[PIPE_SHADER_VERTEX] =
                         panfrost_emit_vertex_buffers(batch);
+
+                panfrost_profile_end(ctx->profile, PAN_PROFILE_EMIT_VERTEX_DATA, t);
         }
 #endif
+
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_UPDATE_STATE_3D, start);
 }
 
 #if PAN_ARCH >= 6
@@ -3455,20 +4007,26 @@ panfrost_get_tiler_heap_desc(struct panfrost_batch *batch)
 {
         struct panfrost_context *ctx = batch->ctx;
         struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct kbase_context *kctx = ctx->kbase_ctx;
+
+        unsigned idx = panfrost_batch_get_tiler_heap(batch);
 
-        if (ctx->tiler_heap_desc)
-                return ctx->tiler_heap_desc->ptr.gpu;
+        if (ctx->tiler_heap_desc[idx])
+                return ctx->tiler_heap_desc[idx]->ptr.gpu;
 
-        ctx->tiler_heap_desc = panfrost_bo_create(dev, 4096, 0, "Tiler heap descriptor");
+        struct panfrost_bo *bo =
+                panfrost_bo_create(dev, 4096, 0, "Tiler heap descriptor");
+        panfrost_bo_set_category(bo, PAN_MEM_HEAP);
 
-        pan_pack(ctx->tiler_heap_desc->ptr.cpu, TILER_HEAP, heap) {
-                heap.size = ctx->kbase_ctx->tiler_heap_chunk_size;
-                heap.base = ctx->kbase_ctx->tiler_heap_header;
+        pan_pack(bo->ptr.cpu, TILER_HEAP, heap) {
+                heap.size = kctx->tiler_heap_chunk_size;
+                heap.base = kctx->tiler_heaps[idx].header;
                 heap.bottom = heap.base + 64;
                 heap.top = heap.base + heap.size;
         }
 
-        return ctx->tiler_heap_desc->ptr.gpu;
+        ctx->tiler_heap_desc[idx] = bo;
+        return bo->ptr.gpu;
 }
 #else
 static mali_ptr
@@ -3501,18 +4059,15 @@ panfrost_batch_get_bifrost_tiler(struct panfrost_batch *batch, unsigned vertex_c
         mali_ptr scratch = 0;
 
 #if PAN_ARCH >= 10
-        // TODO: Dynamically size?
-        unsigned scratch_bits = 16;
-
-        /* Allocate scratch space for vertex positions / point sizes */
-        // TODO: Should this be shared?
-        struct panfrost_ptr sc =
-                pan_pool_alloc_aligned(&batch->pool.base, 1 << scratch_bits, 4096);
+        /* Scratch space for vertex positions / point sizes, shared with
+         * other batches of the context */
+        struct panfrost_tiler_scratch *sc =
+                panfrost_batch_get_tiler_scratch(batch);
 
         /* I think the scratch size is passed in the low bits of the
          * pointer... but trying to go above 16 gives a CS_INHERIT_FAULT.
          */
-        scratch = sc.gpu + scratch_bits;
+        scratch = sc->bo->ptr.gpu + sc->bits;
 #endif
 
         struct panfrost_ptr t =
@@ -3521,7 +4076,8 @@ panfrost_batch_get_bifrost_tiler(struct panfrost_batch *batch, unsigned vertex_c
         GENX(pan_emit_tiler_ctx)(dev, batch->key.width, batch->key.height,
                                  util_framebuffer_get_num_samples(&batch->key),
                                  pan_tristate_get(batch->first_provoking_vertex),
-                                 heap, scratch, t.cpu);
+                                 heap, scratch,
+                                 panfrost_batch_hierarchy_mask(batch), t.cpu);
 
         batch->tiler_ctx.bifrost = t.gpu;
         return batch->tiler_ctx.bifrost;
@@ -3769,10 +4325,7 @@ panfrost_emit_draw(void *out,
                         bool has_oq = ctx->occlusion_query && ctx->active_queries;
 
                         struct pan_earlyzs_state earlyzs =
-                               pan_earlyzs_get(fs->earlyzs,
-                                               ctx->depth_stencil->writes_zs || has_oq,
-                                               ctx->blend->base.alpha_to_coverage,
-                                               ctx->depth_stencil->zs_always_passes);
+                                panfrost_get_earlyzs(ctx, fs, has_oq);
 
                         cfg.pixel_kill_operation = earlyzs.kill;
                         cfg.zs_update_operation = earlyzs.update;
@@ -3899,13 +4452,21 @@ panfrost_emit_malloc_vertex(struct panfrost_batch *batch,
 
         pan_section_pack_cs_v10(job, &batch->cs_vertex, MALLOC_VERTEX_JOB, ALLOCATION, cfg) {
                 if (secondary_shader) {
-                        unsigned v = vs->info.varyings.output_count;
-                        unsigned f = fs->info.varyings.input_count;
-                        unsigned slots = MAX2(v, f);
-                        slots += util_bitcount(fs->key.fs.fixed_varying_mask);
-                        unsigned size = slots * 16;
+                        uint32_t fixed = fs->key.fs.fixed_varying_mask;
+                        uint64_t slots = vs->varying_mask | fs->varying_mask;
+
+                        /* Reserve up to the last general varying either
+                         * shader accesses, rather than the worst case */
+                        unsigned size =
+                                pan_varying_general_offset(fixed,
+                                                           fs->key.fs.fp16_varying_mask,
+                                                           util_last_bit64(slots >> VARYING_SLOT_VAR0));
+
+                        /* Special varyings the vertex shader doesn't write
+                         * alias the first slot after the written ones */
+                        if (slots & BITFIELD64_MASK(VARYING_SLOT_VAR0) & ~(uint64_t) fixed)
+                                size = MAX2(size, 16 * (util_bitcount(fixed) + 1));
 
-                        /* Assumes 16 byte slots. We could do better. */
 #if PAN_ARCH < 10
                         cfg.vertex_packet_stride = size + 16;
 #endif
@@ -4011,7 +4572,7 @@ static void
 panfrost_launch_xfb(struct panfrost_batch *batch,
                     const struct pipe_draw_info *info,
                     mali_ptr attribs, mali_ptr attrib_bufs,
-                    unsigned count)
+                    mali_ptr indices, unsigned count)
 {
         struct panfrost_context *ctx = batch->ctx;
 
@@ -4022,8 +4583,7 @@ panfrost_launch_xfb(struct panfrost_batch *batch,
         if (batch->ctx->streamout.num_targets == 0)
                 return;
 
-        /* TODO: XFB with index buffers */
-        //assert(info->index_size == 0);
+        /* TODO: XFB with index buffers before v10 */
         u_trim_pipe_prim(info->mode, &count);
 
         if (count == 0)
@@ -4033,17 +4593,26 @@ panfrost_launch_xfb(struct panfrost_batch *batch,
 
         struct panfrost_uncompiled_shader *vs_uncompiled = ctx->uncompiled[PIPE_SHADER_VERTEX];
         struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+        struct panfrost_compiled_shader *xfb =
+                panfrost_get_xfb_variant(ctx, vs_uncompiled);
 
-        vs_uncompiled->xfb->stream_output = vs->stream_output;
+        xfb->stream_output = vs->stream_output;
 
         mali_ptr saved_rsd = batch->rsd[PIPE_SHADER_VERTEX];
         mali_ptr saved_ubo = batch->uniform_buffers[PIPE_SHADER_VERTEX];
         mali_ptr saved_push = batch->push_uniforms[PIPE_SHADER_VERTEX];
 
         ctx->uncompiled[PIPE_SHADER_VERTEX] = NULL; /* should not be read */
-        ctx->prog[PIPE_SHADER_VERTEX] = vs_uncompiled->xfb;
+        ctx->prog[PIPE_SHADER_VERTEX] = xfb;
         batch->rsd[PIPE_SHADER_VERTEX] = panfrost_emit_compute_shader_meta(batch, PIPE_SHADER_VERTEX);
 
+        /* Outputs of each instance are packed after the previous one's, the
+         * vertex count of indexed draws covers the index bias instead */
+        unsigned saved_vertex_count = ctx->vertex_count;
+        ctx->vertex_count = count;
+        ctx->xfb_indices = info->index_size ? indices : 0;
+        ctx->xfb_index_size = info->index_size;
+
 #if PAN_ARCH >= 9
         pan_section_pack_cs_v10(t.cpu, &batch->cs_vertex, COMPUTE_JOB, PAYLOAD, cfg) {
                 cfg.workgroup_size_x = 1;
@@ -4104,25 +4673,13 @@ panfrost_launch_xfb(struct panfrost_batch *batch,
 
         ctx->uncompiled[PIPE_SHADER_VERTEX] = vs_uncompiled;
         ctx->prog[PIPE_SHADER_VERTEX] = vs;
+        ctx->vertex_count = saved_vertex_count;
         batch->rsd[PIPE_SHADER_VERTEX] = saved_rsd;
         batch->uniform_buffers[PIPE_SHADER_VERTEX] = saved_ubo;
         batch->push_uniforms[PIPE_SHADER_VERTEX] = saved_push;
 }
 
 #if PAN_ARCH >= 10
-static pan_command_stream
-panfrost_batch_create_cs(struct panfrost_batch *batch, unsigned count)
-{
-        struct panfrost_ptr cs = pan_pool_alloc_aligned(&batch->pool.base, count * 8, 64);
-
-        return (pan_command_stream) {
-                .ptr = cs.cpu,
-                .begin = cs.cpu,
-                .end = cs.cpu + count,
-                .gpu = cs.gpu,
-        };
-}
-
 static uint64_t *
 panfrost_cs_vertex_allocate_instrs(struct panfrost_batch *batch, unsigned count)
 {
@@ -4133,8 +4690,14 @@ panfrost_cs_vertex_allocate_instrs(struct panfrost_batch *batch, unsigned count)
 
         if (v.ptr + count > v.end) {
                 batch->cs_vertex = panfrost_batch_create_cs(batch, MAX2(count, 1 << 13));
+                batch->cs_vertex.shadow = v.shadow;
+
+                /* The size will be filled in later, so the move must not be
+                 * skipped. Registers survive the tail call, so only forget
+                 * the ones used for it. */
+                v.shadow = NULL;
+                pan_cs_shadow_invalidate(batch->cs_vertex.shadow, 0x5c, 3);
 
-                /* The size will be filled in later. */
                 uint32_t *last_size = (uint32_t *)v.ptr;
                 pan_emit_cs_32(&v, 0x5e, 0);
 
@@ -4155,192 +4718,1017 @@ panfrost_cs_vertex_allocate_instrs(struct panfrost_batch *batch, unsigned count)
 
         return batch->cs_vertex.ptr + count;
 }
-#endif
 
+/* u_trace timestamps. Once the fragment job has been emitted, end-of-pipe
+ * timestamps go after it, as it waits for the tiler work of the batch.
+ * Before that, they only cover the work queued on the vertex (or compute)
+ * queue so far, the fragment work of a batch all happens at the end. */
 static void
-panfrost_direct_draw(struct panfrost_batch *batch,
-                     const struct pipe_draw_info *info,
-                     unsigned drawid_offset,
-                     const struct pipe_draw_start_count_bias *draw)
+emit_timestamp(struct panfrost_batch *batch, mali_ptr address,
+               bool end_of_pipe)
 {
-        if (!draw->count || !info->instance_count)
-                return;
+        pan_command_stream *c;
 
-        struct panfrost_context *ctx = batch->ctx;
+        if (end_of_pipe && batch->cs_fragment.ptr != batch->cs_fragment.begin) {
+                c = &batch->cs_fragment;
+        } else {
+                panfrost_cs_vertex_allocate_instrs(batch, 4);
+                c = &batch->cs_vertex;
+        }
 
-#if PAN_ARCH >= 10
-        /* TODO: We don't need quite so much space */
-        uint64_t *limit = panfrost_cs_vertex_allocate_instrs(batch, 64);
-#endif
+        pan_emit_cs_48(c, 0x42, address);
+        pan_pack_ins(c, CS_STORE_STATE, cfg) {
+                cfg.wait_mask = end_of_pipe ? 0xff : 0;
+                cfg.state = MALI_CS_STATE_TIMESTAMP;
+                cfg.address = 0x42;
+        }
 
-        /* If we change whether we're drawing points, or whether point sprites
-         * are enabled (specified in the rasterizer), we may need to rebind
-         * shaders accordingly. This implicitly covers the case of rebinding
-         * framebuffers, because all dirty flags are set there.
-         */
-        if ((ctx->dirty & PAN_DIRTY_RASTERIZER) ||
-            ((ctx->active_prim == PIPE_PRIM_POINTS) ^
-             (info->mode       == PIPE_PRIM_POINTS))) {
+        if (end_of_pipe)
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 0xff; }
 
-                ctx->active_prim = info->mode;
-                panfrost_update_shader_variant(ctx, PIPE_SHADER_FRAGMENT);
-        }
+        assert(c->ptr <= c->end);
+}
+#endif
 
-        /* Take into account a negative bias */
-        ctx->indirect_draw = false;
-        ctx->vertex_count = draw->count + (info->index_size ? abs(draw->index_bias) : 0);
-        ctx->instance_count = info->instance_count;
-        ctx->base_vertex = info->index_size ? draw->index_bias : 0;
-        ctx->base_instance = info->start_instance;
-        ctx->active_prim = info->mode;
-        ctx->drawid = drawid_offset;
+/* Draws with few vertices, such as cursors and small overlays, can be bounded
+ * on the CPU when the vertex shader passes pre-transformed positions through
+ * from an attribute, and the vertices can be read without synchronizing.
+ * The bounds are conservative, and fall back to the viewport otherwise. */
 
-        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+#define PAN_DRAW_BOUNDS_MAX_VERTICES 64
 
-        bool idvs = vs->info.vs.idvs;
-        bool secondary_shader = vs->info.vs.secondary_enable;
+static bool
+panfrost_scan_index_bounds(const struct pipe_draw_info *info,
+                           const struct pipe_draw_start_count_bias *draw,
+                           unsigned *min_index, unsigned *max_index)
+{
+        const uint8_t *indices;
 
-        UNUSED struct panfrost_ptr tiler, vertex;
+        if (draw->count > 3 * PAN_DRAW_BOUNDS_MAX_VERTICES)
+                return false;
 
-#if PAN_ARCH >= 9
-        tiler = pan_pool_alloc_desc_cs_v10(&batch->pool.base, MALLOC_VERTEX_JOB);
-#else /* PAN_ARCH < 9 */
-        if (idvs) {
-#if PAN_ARCH >= 6
-                tiler = pan_pool_alloc_desc(&batch->pool.base, INDEXED_VERTEX_JOB);
-#endif
-                unreachable("IDVS is unsupported on Midgard");
+        if (info->has_user_indices) {
+                indices = info->index.user;
         } else {
-                vertex = pan_pool_alloc_desc_cs_v10(&batch->pool.base, COMPUTE_JOB);
-                tiler = pan_pool_alloc_desc_cs_v10(&batch->pool.base, TILER_JOB);
+                struct panfrost_resource *rsrc = pan_resource(info->index.resource);
+
+                /* Nothing else reads the index buffer on the CPU, so don't
+                 * start for the bounds */
+                if (PAN_ARCH >= 9)
+                        return false;
+
+                if (!rsrc->image.data.bo->ptr.cpu || rsrc->track.nr_writers)
+                        return false;
+
+                indices = rsrc->image.data.bo->ptr.cpu;
         }
-#endif /* PAN_ARCH */
 
-        unsigned vertex_count = ctx->vertex_count;
+        indices += draw->start * info->index_size;
 
-        unsigned min_index = 0, max_index = 0;
-        mali_ptr indices = 0;
+        unsigned min = ~0, max = 0;
 
-        if (info->index_size && PAN_ARCH >= 9) {
-                indices = panfrost_get_index_buffer(batch, info, draw);
-        } else if (info->index_size) {
-                indices = panfrost_get_index_buffer_bounded(batch, info, draw,
-                                                            &min_index,
-                                                            &max_index);
+        for (unsigned i = 0; i < draw->count; ++i) {
+                unsigned idx;
 
-                /* Use the corresponding values */
-                vertex_count = max_index - min_index + 1;
-                ctx->offset_start = min_index + draw->index_bias;
-        } else {
-                ctx->offset_start = draw->start;
+                switch (info->index_size) {
+                case 1: idx = indices[i]; break;
+                case 2: idx = ((const uint16_t *) indices)[i]; break;
+                default: idx = ((const uint32_t *) indices)[i]; break;
+                }
+
+                if (info->primitive_restart && idx == info->restart_index)
+                        continue;
+
+                min = MIN2(min, idx);
+                max = MAX2(max, idx);
         }
 
-        if (info->instance_count > 1) {
-                unsigned count = vertex_count;
+        if (min > max)
+                return false;
 
-                /* Index-Driven Vertex Shading requires different instances to
-                 * have different cache lines for position results. Each vertex
-                 * position is 16 bytes and the Mali cache line is 64 bytes, so
-                 * the instance count must be aligned to 4 vertices.
-                 */
-                if (idvs)
-                        count = ALIGN_POT(count, 4);
+        if (!info->has_user_indices) {
+                panfrost_minmax_cache_add(pan_resource(info->index.resource)->index_cache,
+                                          info->index_size,
+                                          draw->start, draw->count,
+                                          info->primitive_restart,
+                                          info->restart_index, min, max);
+        }
 
-                ctx->padded_count = panfrost_padded_vertex_count(count);
-        } else
-                ctx->padded_count = vertex_count;
+        *min_index = min;
+        *max_index = max;
+        return true;
+}
 
-        panfrost_statistics_record(ctx, info, draw);
+static bool
+panfrost_draw_bounds(struct panfrost_batch *batch,
+                     const struct pipe_draw_info *info,
+                     const struct pipe_draw_start_count_bias *draw,
+                     struct pipe_scissor_state *bounds)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_uncompiled_shader *vs = ctx->uncompiled[PIPE_SHADER_VERTEX];
+        const struct pipe_rasterizer_state *rast = &ctx->rasterizer->base;
+        const struct pipe_viewport_state *vp = &ctx->pipe_viewport;
+        struct panfrost_vertex_state *vtx = ctx->vertex;
 
-#if PAN_ARCH <= 7
-        struct mali_invocation_packed invocation;
-        if (info->instance_count > 1) {
-                panfrost_pack_work_groups_compute(&invocation,
-                                                  1, vertex_count, info->instance_count,
-                                                  1, 1, 1, true, false);
+        if (!vs->position.valid || vs->position.attrib >= vtx->num_elements)
+                return false;
+
+        unsigned start, count;
+
+        if (info->index_size) {
+                unsigned min_index, max_index;
+
+                if (!panfrost_get_index_bounds_cached(info, draw, &min_index, &max_index) &&
+                    !panfrost_scan_index_bounds(info, draw, &min_index, &max_index))
+                        return false;
+
+                start = min_index + draw->index_bias;
+                count = max_index - min_index + 1;
         } else {
-                pan_pack(&invocation, INVOCATION, cfg) {
-                        cfg.invocations = MALI_POSITIVE(vertex_count);
-                        cfg.size_y_shift = 0;
-                        cfg.size_z_shift = 0;
-                        cfg.workgroups_x_shift = 0;
-                        cfg.workgroups_y_shift = 0;
-                        cfg.workgroups_z_shift = 32;
-                        cfg.thread_group_split = MALI_SPLIT_MIN_EFFICIENT;
-                }
+                start = draw->start;
+                count = draw->count;
         }
 
-        /* Emit all sort of descriptors. */
-        mali_ptr varyings = 0, vs_vary = 0, fs_vary = 0, pos = 0, psiz = 0;
+        if (count > PAN_DRAW_BOUNDS_MAX_VERTICES)
+                return false;
 
-        panfrost_emit_varying_descriptor(batch,
-                                         ctx->padded_count *
-                                         ctx->instance_count,
-                                         &vs_vary, &fs_vary, &varyings,
-                                         NULL, &pos, &psiz,
-                                         info->mode == PIPE_PRIM_POINTS);
+        const struct pipe_vertex_element *el = &vtx->pipe[vs->position.attrib];
+        unsigned vbi = el->vertex_buffer_index;
+        const struct pipe_vertex_buffer *vb = &ctx->vertex_buffers[vbi];
 
-        mali_ptr attribs, attrib_bufs;
-        attribs = panfrost_emit_vertex_data(batch, &attrib_bufs);
-#endif /* PAN_ARCH <= 7 */
+        if (el->instance_divisor || !(ctx->vb_mask & BITFIELD_BIT(vbi)) ||
+            vb->is_user_buffer)
+                return false;
 
-        panfrost_update_state_3d(batch);
-        panfrost_update_shader_state(batch, PIPE_SHADER_VERTEX);
-        panfrost_update_shader_state(batch, PIPE_SHADER_FRAGMENT);
-        panfrost_clean_state_3d(ctx);
+        const struct util_format_description *desc =
+                util_format_description(el->src_format);
 
-        if (ctx->uncompiled[PIPE_SHADER_VERTEX]->xfb) {
-#if PAN_ARCH >= 9
-                mali_ptr attribs = 0, attrib_bufs = 0;
-#endif
-                panfrost_launch_xfb(batch, info, attribs, attrib_bufs, draw->count);
-        }
+        if (desc->layout != UTIL_FORMAT_LAYOUT_PLAIN ||
+            desc->channel[0].type != UTIL_FORMAT_TYPE_FLOAT ||
+            desc->channel[0].size != 32 || desc->block.bits != 32 * desc->nr_channels)
+                return false;
 
-        /* Increment transform feedback offsets */
-        panfrost_update_streamout_offsets(ctx);
+        struct panfrost_resource *rsrc = pan_resource(vb->buffer.resource);
+        struct panfrost_bo *bo = rsrc->image.data.bo;
 
-        /* Any side effects must be handled by the XFB shader, so we only need
-         * to run vertex shaders if we need rasterization.
-         */
-        if (panfrost_batch_skip_rasterization(batch))
-                return;
+        /* Don't wait for the GPU or fault in a mapping for this */
+        if (!bo->ptr.cpu || rsrc->track.nr_writers)
+                return false;
 
-#if PAN_ARCH >= 9
-        assert(idvs && "Memory allocated IDVS required on Valhall");
+        uint64_t offset = (uint64_t) vb->buffer_offset + el->src_offset +
+                          (uint64_t) start * vb->stride;
+        uint64_t end = offset + ((uint64_t) (count - 1) * vb->stride) +
+                       (desc->nr_channels * 4);
 
-        panfrost_emit_malloc_vertex(batch, info, draw, indices, secondary_shader, tiler.cpu);
+        if (end > rsrc->base.width0)
+                return false;
 
-#if PAN_ARCH >= 10
-        pan_pack_ins(&batch->cs_vertex, IDVS_LAUNCH, _);
-        /* TODO: Find a better way to specify that there were jobs */
-        batch->scoreboard.first_job = 1;
-        batch->scoreboard.first_tiler = NULL + 1;
+        float minx = INFINITY, miny = INFINITY;
+        float maxx = -INFINITY, maxy = -INFINITY;
 
-        /* Make sure we didn't use more CS instructions than we allocated
-         * space for */
-        assert(batch->cs_vertex.ptr <= limit);
+        for (unsigned v = 0; v < count; ++v) {
+                float attr[4] = { 0.0, 0.0, 0.0, 1.0 };
+                float pos[4];
 
-#else /* PAN_ARCH < 10 */
-        panfrost_add_job(&batch->pool.base, &batch->scoreboard,
-                         MALI_JOB_TYPE_MALLOC_VERTEX, false, false, 0,
-                         0, &tiler, false);
-#endif
-#else /* PAN_ARCH < 9 */
+                memcpy(attr, bo->ptr.cpu + offset + (v * vb->stride),
+                       desc->nr_channels * 4);
 
-        /* Fire off the draw itself */
-        panfrost_draw_emit_tiler(batch, info, draw, &invocation, indices,
-                                 fs_vary, varyings, pos, psiz, secondary_shader,
-                                 tiler.cpu);
-        if (idvs) {
-#if PAN_ARCH >= 6
-                panfrost_draw_emit_vertex_section(batch,
-                                  vs_vary, varyings,
-                                  attribs, attrib_bufs,
-                                  pan_section_ptr(tiler.cpu, INDEXED_VERTEX_JOB, VERTEX_DRAW));
+                for (unsigned c = 0; c < 4; ++c) {
+                        int comp = vs->position.comp[c];
 
-                panfrost_add_job(&batch->pool.base, &batch->scoreboard,
-                                 MALI_JOB_TYPE_INDEXED_VERTEX, false, false,
-                                 0, 0, &tiler, false);
+                        pos[c] = (comp >= 0) ? attr[comp] : vs->position.constant[c];
+                }
+
+                /* Vertices behind the eye need clipping, which this doesn't
+                 * model */
+                if (!(pos[3] > 0.0))
+                        return false;
+
+                float x = CLAMP(pos[0] / pos[3], -1.0, 1.0);
+                float y = CLAMP(pos[1] / pos[3], -1.0, 1.0);
+
+                if (isnan(x) || isnan(y))
+                        return false;
+
+                x = vp->translate[0] + (vp->scale[0] * x);
+                y = vp->translate[1] + (vp->scale[1] * y);
+
+                minx = MIN2(minx, x);
+                miny = MIN2(miny, y);
+                maxx = MAX2(maxx, x);
+                maxy = MAX2(maxy, y);
+        }
+
+        /* Pad for wide points and lines, also covering polygon modes, and
+         * for rounding */
+        float pad = 1.0 + (MAX2(rast->line_width, rast->point_size) / 2.0);
+
+        minx = MAX2(floorf(minx - pad), 0.0);
+        miny = MAX2(floorf(miny - pad), 0.0);
+        maxx = MAX2(ceilf(maxx + pad), 0.0);
+        maxy = MAX2(ceilf(maxy + pad), 0.0);
+
+        bounds->minx = MAX2(bounds->minx, (unsigned) MIN2(minx, UINT16_MAX));
+        bounds->miny = MAX2(bounds->miny, (unsigned) MIN2(miny, UINT16_MAX));
+        bounds->maxx = MIN2(bounds->maxx, (unsigned) MIN2(maxx, UINT16_MAX));
+        bounds->maxy = MIN2(bounds->maxy, (unsigned) MIN2(maxy, UINT16_MAX));
+
+        return bounds->minx < bounds->maxx && bounds->miny < bounds->maxy;
+}
+
+#if PAN_ARCH >= 6
+/* Sample the size of the primitives of a draw, assuming they share its
+ * bounds evenly, to choose the tiler hierarchy levels of the next batch on
+ * the render target. Instances are counted as more primitives over the same
+ * bounds, which only errs towards finer levels. */
+static void
+panfrost_sample_primitive_size(struct panfrost_batch *batch,
+                               const struct pipe_draw_info *info,
+                               const struct pipe_draw_start_count_bias *draw,
+                               const struct pipe_scissor_state *bounds)
+{
+        unsigned prims = u_decomposed_prims_for_vertices(info->mode, draw->count) *
+                         info->instance_count;
+
+        if (!prims || bounds->minx >= bounds->maxx || bounds->miny >= bounds->maxy)
+                return;
+
+        unsigned area = (bounds->maxx - bounds->minx) *
+                        (bounds->maxy - bounds->miny);
+
+        batch->level_prims[panfrost_hierarchy_level_for_area(area / prims)] += prims;
+}
+#endif
+
+static void
+panfrost_union_draw_bounds(struct panfrost_batch *batch,
+                           const struct pipe_draw_info *info,
+                           const struct pipe_draw_start_count_bias *draw)
+{
+        struct pipe_scissor_state bounds = batch->viewport_bounds;
+
+        if (!draw || !panfrost_draw_bounds(batch, info, draw, &bounds))
+                bounds = batch->viewport_bounds;
+
+#if PAN_ARCH >= 6
+        if (draw)
+                panfrost_sample_primitive_size(batch, info, draw, &bounds);
+#endif
+
+        panfrost_batch_union_scissor(batch, bounds.minx, bounds.miny,
+                                     bounds.maxx, bounds.maxy);
+}
+
+#if PAN_ARCH >= 10
+/* PRIMITIVE.index_count, followed by COUNT.count */
+#define PAN_CS_REG_INDEX_COUNT 0x21
+
+/* PRIMITIVE.base_vertex_offset */
+#define PAN_CS_REG_BASE_VERTEX_OFFSET 0x24
+
+/* Scratch registers for reading occlusion queries, unused by the queue rings.
+ * The result register also holds the render condition, launches being
+ * skipped while it is non-zero. */
+#define PAN_CS_REG_QUERY_ADDR 0x44
+#define PAN_CS_REG_QUERY_VALUE 0x46
+#define PAN_CS_REG_QUERY_RESULT 0x58
+#define PAN_CS_REG_QUERY_DST 0x5a
+
+/* Conditional draws can be recorded unconditionally, with the command stream
+ * checking the occlusion query result in memory. That is only worth it while
+ * the result isn't known yet, and impossible if the draw would go in the batch
+ * writing it, in which case NULL is returned and the condition is checked on
+ * the CPU. */
+static struct panfrost_query *
+panfrost_render_condition_query(struct panfrost_context *ctx)
+{
+        struct panfrost_query *query = ctx->cond_query;
+
+        if (!query || !query->rsrc)
+                return NULL;
+
+        switch (query->type) {
+        case PIPE_QUERY_OCCLUSION_COUNTER:
+        case PIPE_QUERY_OCCLUSION_PREDICATE:
+        case PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE:
+                break;
+        default:
+                return NULL;
+        }
+
+        /* Transform feedback is done by compute jobs, which aren't skipped */
+        if (ctx->streamout.num_targets)
+                return NULL;
+
+        struct panfrost_resource *rsrc = pan_resource(query->rsrc);
+        struct panfrost_batch *writer = panfrost_resource_writer(ctx, rsrc);
+
+        if (writer)
+                return (writer == panfrost_get_batch_for_fbo(ctx)) ?
+                        NULL : query;
+
+        return panfrost_bo_wait(rsrc->image.data.bo, 0, false) ? NULL : query;
+}
+
+/* Loads count 64-bit counters from PAN_CS_REG_QUERY_ADDR, and moves value to
+ * PAN_CS_REG_QUERY_RESULT as soon as a 32-bit half of one is non-zero. Takes
+ * 6 instructions per counter. */
+static void
+panfrost_emit_query_any_passed(pan_command_stream *c, unsigned count,
+                               uint32_t value)
+{
+        for (unsigned i = 0; i < count; ++i) {
+                pan_pack_ins(c, CS_LDR, cfg) {
+                        cfg.offset = i * 8;
+                        cfg.register_mask = 0x3;
+                        cfg.addr = PAN_CS_REG_QUERY_ADDR;
+                        cfg.register_base = PAN_CS_REG_QUERY_VALUE;
+                }
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 0; }
+
+                for (unsigned j = 0; j < 2; ++j) {
+                        pan_pack_ins(c, CS_BRANCH, cfg) {
+                                cfg.offset = 1;
+                                cfg.condition = MALI_BRANCH_CONDITION_EQUAL;
+                                cfg.value = PAN_CS_REG_QUERY_VALUE + j;
+                        }
+                        pan_emit_cs_32(c, PAN_CS_REG_QUERY_RESULT, value);
+                }
+        }
+
+        /* The shadow recorded the last move, which may have been skipped */
+        pan_cs_shadow_invalidate(c->shadow, PAN_CS_REG_QUERY_RESULT, 1);
+}
+
+/* Sets the skip flag in PAN_CS_REG_QUERY_RESULT from the counters of the
+ * query, once the batch writing them is done */
+static void
+panfrost_emit_render_condition(struct panfrost_batch *batch,
+                               struct panfrost_query *query, bool condition)
+{
+        struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
+        struct panfrost_resource *rsrc = pan_resource(query->rsrc);
+        pan_command_stream *c = &batch->cs_vertex;
+
+        /* Predicates only have the first counter written, see
+         * panfrost_get_query_result */
+        unsigned counters = (query->type == PIPE_QUERY_OCCLUSION_COUNTER) ?
+                dev->core_id_range : 1;
+
+        UNUSED uint64_t *limit =
+                panfrost_cs_vertex_allocate_instrs(batch, 2 + counters * 6);
+
+        panfrost_batch_read_rsrc(batch, rsrc, PIPE_SHADER_VERTEX);
+
+        /* Start as if no samples passed */
+        pan_emit_cs_48(c, PAN_CS_REG_QUERY_ADDR, rsrc->image.data.bo->ptr.gpu);
+        pan_emit_cs_32(c, PAN_CS_REG_QUERY_RESULT, !condition);
+        panfrost_emit_query_any_passed(c, counters, condition);
+
+        assert(c->ptr <= limit);
+}
+
+/* Copies for get_query_result_resource. Predicates are evaluated like render
+ * conditions, and counters are summed by atomically adding each of them to
+ * the zeroed destination. A 32-bit destination gets the low half of the sum
+ * rather than a clamped value. */
+static void
+emit_occlusion_result(struct panfrost_batch *batch, mali_ptr counters,
+                      unsigned count, bool predicate, bool is64, mali_ptr dst)
+{
+        pan_command_stream *c = &batch->cs_vertex;
+
+        UNUSED uint64_t *limit =
+                panfrost_cs_vertex_allocate_instrs(batch, 5 + count * 6);
+
+        pan_emit_cs_48(c, PAN_CS_REG_QUERY_ADDR, counters);
+        pan_emit_cs_48(c, PAN_CS_REG_QUERY_DST, dst);
+
+        /* The move clears the upper register of the pair */
+        pan_emit_cs_48(c, PAN_CS_REG_QUERY_RESULT, !count);
+
+        if (predicate)
+                panfrost_emit_query_any_passed(c, count, 1);
+
+        pan_pack_ins(c, CS_STR, cfg) {
+                cfg.offset = 0;
+                cfg.register_mask = is64 ? 0x3 : 0x1;
+                cfg.addr = PAN_CS_REG_QUERY_DST;
+                cfg.register_base = PAN_CS_REG_QUERY_RESULT;
+        }
+        pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 0; }
+
+        for (unsigned i = 0; !predicate && i < count; ++i) {
+                pan_pack_ins(c, CS_LDR, cfg) {
+                        cfg.offset = i * 8;
+                        cfg.register_mask = 0x3;
+                        cfg.addr = PAN_CS_REG_QUERY_ADDR;
+                        cfg.register_base = PAN_CS_REG_QUERY_VALUE;
+                }
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 0; }
+
+                if (is64) {
+                        pan_pack_ins(c, CS_EVADD_64, cfg) {
+                                cfg.no_irq = true;
+                                cfg.value = PAN_CS_REG_QUERY_VALUE;
+                                cfg.addr = PAN_CS_REG_QUERY_DST;
+                        }
+                } else {
+                        pan_pack_ins(c, CS_EVADD, cfg) {
+                                cfg.no_irq = true;
+                                cfg.value = PAN_CS_REG_QUERY_VALUE;
+                                cfg.addr = PAN_CS_REG_QUERY_DST;
+                        }
+                }
+        }
+
+        /* TODO: Find a better way to specify that there were jobs */
+        batch->scoreboard.first_job = 1;
+
+        assert(c->ptr <= limit);
+}
+
+/* Launches the IDVS job set up in the registers. With a render condition, the
+ * launch alone is branched over, which leaves all registers alone, so the
+ * branch doesn't need to forget the shadowed register values. */
+static void
+panfrost_launch_idvs(struct panfrost_batch *batch)
+{
+        pan_command_stream *c = &batch->cs_vertex;
+
+        if (batch->render_cond) {
+                struct pan_cs_shadow *shadow = c->shadow;
+
+                c->shadow = NULL;
+                pan_pack_ins(c, CS_BRANCH, cfg) {
+                        cfg.offset = 1;
+                        cfg.condition = MALI_BRANCH_CONDITION_NOT_EQUAL;
+                        cfg.value = PAN_CS_REG_QUERY_RESULT;
+                }
+                c->shadow = shadow;
+        }
+
+        pan_pack_ins(c, IDVS_LAUNCH, _);
+}
+
+/* Whether a draw may reuse everything the last draw of the batch left in the
+ * CS registers, setting only its own parameters before launching. That needs
+ * the last launch to still be the last instruction, nothing but the draw
+ * parameters to have changed since, and shaders which don't read them. */
+static bool
+panfrost_can_relaunch(struct panfrost_batch *batch,
+                      const struct pipe_draw_info *info)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        uint64_t *launch = batch->last_draw.launch;
+
+        if (!launch || batch->cs_vertex.ptr != launch + 1 ||
+            info->mode != batch->last_draw.mode)
+                return false;
+
+        if ((ctx->dirty & ~(PAN_DIRTY_PARAMS | PAN_DIRTY_DRAWID)) ||
+            ctx->dirty_shader[PIPE_SHADER_VERTEX] ||
+            ctx->dirty_shader[PIPE_SHADER_FRAGMENT])
+                return false;
+
+        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+        struct panfrost_compiled_shader *fs = ctx->prog[PIPE_SHADER_FRAGMENT];
+        unsigned params = PAN_DIRTY_PARAMS | PAN_DIRTY_DRAWID;
+
+        if ((vs->dirty_3d & params) || (fs && (fs->dirty_3d & params)) ||
+            ctx->uncompiled[PIPE_SHADER_VERTEX]->xfb ||
+            ctx->streamout.num_targets)
+                return false;
+
+        return !panfrost_batch_skip_rasterization(batch);
+}
+
+/* Bookkeeping normally done by panfrost_direct_draw */
+static void
+panfrost_relaunch_record(struct panfrost_batch *batch,
+                         const struct pipe_draw_info *info,
+                         unsigned drawid_offset,
+                         const struct pipe_draw_start_count_bias *draw)
+{
+        struct panfrost_context *ctx = batch->ctx;
+
+        ctx->indirect_draw = false;
+        ctx->vertex_count = draw->count + (info->index_size ? abs(draw->index_bias) : 0);
+        ctx->instance_count = info->instance_count;
+        ctx->base_vertex = info->index_size ? draw->index_bias : 0;
+        ctx->base_instance = info->start_instance;
+        if (!info->index_size)
+                ctx->offset_start = draw->start;
+        ctx->drawid = drawid_offset;
+
+        batch->tiler_scratch_traffic +=
+                (uint64_t)draw->count * info->instance_count * 16;
+
+        panfrost_statistics_record(ctx, info, draw);
+        panfrost_union_draw_bounds(batch, info, draw);
+        panfrost_clean_state_3d(ctx);
+}
+
+/* UI toolkits like to issue runs of small non-indexed draws with identical
+ * state, each continuing where the previous one stopped. The previous IDVS
+ * job can then be relaunched with a larger vertex count instead. */
+static bool
+panfrost_merge_draw(struct panfrost_batch *batch,
+                    const struct pipe_draw_info *info,
+                    unsigned drawid_offset,
+                    const struct pipe_draw_start_count_bias *draw)
+{
+        uint64_t *launch = batch->last_draw.launch;
+
+        /* A launch can't be moved in or out from under a render condition */
+        if (batch->render_cond || batch->last_draw.render_cond)
+                return false;
+
+        if (info->index_size || info->instance_count != 1 ||
+            draw->start != batch->last_draw.start + batch->last_draw.count)
+                return false;
+
+        /* Only lists can be concatenated, and only when the last draw left no
+         * incomplete primitive behind */
+        unsigned prim_verts;
+
+        switch (info->mode) {
+        case PIPE_PRIM_POINTS:
+                prim_verts = 1;
+                break;
+        case PIPE_PRIM_LINES:
+                prim_verts = 2;
+                break;
+        case PIPE_PRIM_TRIANGLES:
+                prim_verts = 3;
+                break;
+        default:
+                return false;
+        }
+
+        if (batch->last_draw.count % prim_verts)
+                return false;
+
+        /* One more instruction than before, and a tail call after it */
+        if (!panfrost_can_relaunch(batch, info) ||
+            launch + 2 + 3 > batch->cs_vertex.end)
+                return false;
+
+        batch->last_draw.count += draw->count;
+
+        batch->cs_vertex.ptr = launch;
+        pan_emit_cs_32(&batch->cs_vertex, PAN_CS_REG_INDEX_COUNT,
+                       batch->last_draw.count);
+        pan_pack_ins(&batch->cs_vertex, IDVS_LAUNCH, _);
+        batch->last_draw.launch = batch->cs_vertex.ptr - 1;
+
+        panfrost_relaunch_record(batch, info, drawid_offset, draw);
+        return true;
+}
+
+/* Later draws of a multi-draw share all state with the first, so only the
+ * vertex range and indices need to be set before launching again */
+static bool
+panfrost_relaunch_draw(struct panfrost_batch *batch,
+                       const struct pipe_draw_info *info,
+                       unsigned drawid_offset,
+                       const struct pipe_draw_start_count_bias *draw)
+{
+        struct panfrost_context *ctx = batch->ctx;
+
+        if (panfrost_merge_draw(batch, info, drawid_offset, draw))
+                return true;
+
+        if (!panfrost_can_relaunch(batch, info))
+                return false;
+
+        UNUSED uint64_t *limit = panfrost_cs_vertex_allocate_instrs(batch, 16);
+
+        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+        struct panfrost_compiled_shader *fs = ctx->prog[PIPE_SHADER_FRAGMENT];
+        bool secondary_shader = vs->info.vs.secondary_enable &&
+                panfrost_fs_required(fs, ctx->blend, &ctx->pipe_framebuffer,
+                                     ctx->depth_stencil);
+
+        mali_ptr indices = info->index_size ?
+                panfrost_get_index_buffer(batch, info, draw) : 0;
+
+        /* Unchanged fields are skipped by the register shadow */
+        panfrost_emit_primitive(batch, info, draw, 0, secondary_shader, NULL);
+
+        pan_section_pack_cs_v10(NULL, &batch->cs_vertex, MALLOC_VERTEX_JOB, INDICES, cfg) {
+                cfg.address = indices;
+                cfg.size = draw->count * info->index_size;
+        }
+
+        panfrost_launch_idvs(batch);
+
+        batch->last_draw.launch = batch->cs_vertex.ptr - 1;
+        batch->last_draw.start = draw->start;
+        batch->last_draw.count = draw->count;
+        batch->last_draw.render_cond = batch->render_cond;
+        assert(batch->cs_vertex.ptr <= limit);
+
+        panfrost_relaunch_record(batch, info, drawid_offset, draw);
+        return true;
+}
+#endif
+
+#if PAN_ARCH >= 10
+/* Scratch registers for GPU indirect draws, unused by the queue rings */
+#define PAN_CS_REG_INDIRECT_ADDR 0x50
+#define PAN_CS_REG_INDIRECT_COUNT 0x52
+
+/* b.eq w<reg>, skip <count> */
+static void
+pan_emit_cs_skip_if_zero(pan_command_stream *c, unsigned reg, unsigned count)
+{
+        pan_pack_ins(c, CS_BRANCH, cfg) {
+                cfg.offset = count;
+                cfg.condition = MALI_BRANCH_CONDITION_EQUAL;
+                cfg.value = reg;
+        }
+}
+
+/* The command stream can load the draw parameters itself, but only as they
+ * are: draws which need them scaled (indices) or on the CPU (sysvals,
+ * transform feedback, queries) are still emulated */
+static bool
+panfrost_csf_indirect_supported(struct panfrost_context *ctx,
+                                const struct pipe_draw_info *info,
+                                const struct pipe_draw_indirect_info *indirect)
+{
+        if (!indirect || !indirect->buffer || info->index_size ||
+            indirect->count_from_stream_output)
+                return false;
+
+        if (ctx->streamout.num_targets || ctx->active_queries ||
+            ctx->uncompiled[PIPE_SHADER_VERTEX]->xfb ||
+            ctx->uncompiled[PIPE_SHADER_GEOMETRY])
+                return false;
+
+        unsigned params = PAN_DIRTY_PARAMS;
+
+        /* The draw ID is only known on the CPU for the first draw */
+        if (indirect->draw_count > 1 || indirect->indirect_draw_count)
+                params |= PAN_DIRTY_DRAWID;
+
+        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+        struct panfrost_compiled_shader *fs = ctx->prog[PIPE_SHADER_FRAGMENT];
+
+        return !(vs->dirty_3d & params) && !(fs && (fs->dirty_3d & params));
+}
+
+/*
+ * Non-indexed indirect draws on CSF. All state is emitted once as for a
+ * direct draw, then each draw loads its vertex count, instance count and
+ * first vertex from the indirect buffer into the primitive registers right
+ * before its IDVS launch. Draws past the count from the count buffer are
+ * skipped by branching over them.
+ */
+static void
+panfrost_csf_indirect_draw(struct panfrost_batch *batch,
+                           const struct pipe_draw_info *info,
+                           unsigned drawid_offset,
+                           const struct pipe_draw_indirect_info *indirect)
+{
+        struct panfrost_context *ctx = batch->ctx;
+
+        batch->last_draw.launch = NULL;
+
+        if (!indirect->draw_count)
+                return;
+
+        UNUSED uint64_t *limit = panfrost_cs_vertex_allocate_instrs(batch, 64);
+
+        if ((ctx->dirty & PAN_DIRTY_RASTERIZER) ||
+            ((ctx->active_prim == PIPE_PRIM_POINTS) ^
+             (info->mode       == PIPE_PRIM_POINTS))) {
+
+                ctx->active_prim = info->mode;
+                panfrost_update_shader_variant(ctx, PIPE_SHADER_FRAGMENT);
+        }
+
+        /* The counts are only known on the GPU */
+        ctx->active_prim = info->mode;
+        ctx->drawid = drawid_offset;
+        ctx->indirect_draw = true;
+        ctx->instance_count = ctx->vertex_count = ctx->padded_count = 0;
+        ctx->offset_start = 0;
+        ctx->base_vertex = 0;
+        ctx->base_instance = 0;
+
+        panfrost_update_state_3d(batch);
+        panfrost_update_shader_state(batch, PIPE_SHADER_VERTEX);
+        panfrost_update_shader_state(batch, PIPE_SHADER_FRAGMENT);
+        panfrost_clean_state_3d(ctx);
+
+        if (panfrost_batch_skip_rasterization(batch))
+                return;
+
+        panfrost_union_draw_bounds(batch, info, NULL);
+
+        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+        struct panfrost_ptr tiler =
+                pan_pool_alloc_desc_cs_v10(&batch->pool.base, MALLOC_VERTEX_JOB);
+        struct pipe_draw_start_count_bias draw = { 0 };
+
+        panfrost_emit_malloc_vertex(batch, info, &draw, 0,
+                                    vs->info.vs.secondary_enable, tiler.cpu);
+
+        struct panfrost_resource *draw_buf = pan_resource(indirect->buffer);
+        mali_ptr params = draw_buf->image.data.bo->ptr.gpu + indirect->offset;
+        pan_command_stream *c = &batch->cs_vertex;
+
+        panfrost_batch_read_rsrc(batch, draw_buf, PIPE_SHADER_VERTEX);
+
+        if (indirect->indirect_draw_count) {
+                struct panfrost_resource *count_buf =
+                        pan_resource(indirect->indirect_draw_count);
+
+                panfrost_batch_read_rsrc(batch, count_buf, PIPE_SHADER_VERTEX);
+
+                pan_emit_cs_48(c, PAN_CS_REG_INDIRECT_ADDR,
+                               count_buf->image.data.bo->ptr.gpu +
+                               indirect->indirect_draw_count_offset);
+                pan_pack_ins(c, CS_LDR, cfg) {
+                        cfg.offset = 0;
+                        cfg.register_mask = 0x1;
+                        cfg.addr = PAN_CS_REG_INDIRECT_ADDR;
+                        cfg.register_base = PAN_CS_REG_INDIRECT_COUNT;
+                }
+
+                /* In case the decrement below works on the register pair */
+                pan_emit_cs_32(c, PAN_CS_REG_INDIRECT_COUNT + 1, 0);
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 0; }
+        }
+
+        assert(c->ptr <= limit);
+
+        /* The draw count from the buffer is clamped to draw_count by only
+         * emitting that many draws */
+        for (unsigned i = 0; i < indirect->draw_count; ++i) {
+                limit = panfrost_cs_vertex_allocate_instrs(batch, 8);
+
+                if (indirect->indirect_draw_count) {
+                        pan_emit_cs_skip_if_zero(c, PAN_CS_REG_INDIRECT_COUNT,
+                                                 6 + batch->render_cond);
+                        pan_pack_ins(c, CS_ADD_IMM, cfg) {
+                                cfg.value = -1;
+                                cfg.src = PAN_CS_REG_INDIRECT_COUNT;
+                                cfg.dest = PAN_CS_REG_INDIRECT_COUNT;
+                        }
+                }
+
+                /* { count, instance count, first, base instance }. The
+                 * address must be moved even if unchanged, as the move may
+                 * be skipped over. */
+                pan_cs_shadow_invalidate(c->shadow, PAN_CS_REG_INDIRECT_ADDR, 2);
+                pan_emit_cs_48(c, PAN_CS_REG_INDIRECT_ADDR,
+                               params + i * indirect->stride);
+                pan_pack_ins(c, CS_LDR, cfg) {
+                        cfg.offset = 0;
+                        cfg.register_mask = 0x3;
+                        cfg.addr = PAN_CS_REG_INDIRECT_ADDR;
+                        cfg.register_base = PAN_CS_REG_INDEX_COUNT;
+                }
+                pan_pack_ins(c, CS_LDR, cfg) {
+                        cfg.offset = 8;
+                        cfg.register_mask = 0x1;
+                        cfg.addr = PAN_CS_REG_INDIRECT_ADDR;
+                        cfg.register_base = PAN_CS_REG_BASE_VERTEX_OFFSET;
+                }
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 0; }
+                panfrost_launch_idvs(batch);
+
+                assert(c->ptr <= limit);
+        }
+
+        /* Nothing can be known about the registers written in the skipped
+         * blocks */
+        pan_cs_shadow_invalidate(c->shadow, 0, 256);
+
+        /* TODO: Find a better way to specify that there were jobs */
+        batch->scoreboard.first_job = 1;
+        batch->scoreboard.first_tiler = NULL + 1;
+}
+#endif
+
+static void
+panfrost_direct_draw(struct panfrost_batch *batch,
+                     const struct pipe_draw_info *info,
+                     unsigned drawid_offset,
+                     const struct pipe_draw_start_count_bias *draw)
+{
+        if (!draw->count || !info->instance_count)
+                return;
+
+        struct panfrost_context *ctx = batch->ctx;
+
+#if PAN_ARCH >= 10
+        if (panfrost_merge_draw(batch, info, drawid_offset, draw))
+                return;
+
+        /* TODO: We don't need quite so much space */
+        uint64_t *limit = panfrost_cs_vertex_allocate_instrs(batch, 64);
+#endif
+
+        /* If we change whether we're drawing points, or whether point sprites
+         * are enabled (specified in the rasterizer), we may need to rebind
+         * shaders accordingly. This implicitly covers the case of rebinding
+         * framebuffers, because all dirty flags are set there.
+         */
+        if ((ctx->dirty & PAN_DIRTY_RASTERIZER) ||
+            ((ctx->active_prim == PIPE_PRIM_POINTS) ^
+             (info->mode       == PIPE_PRIM_POINTS))) {
+
+                ctx->active_prim = info->mode;
+                panfrost_update_shader_variant(ctx, PIPE_SHADER_FRAGMENT);
+        }
+
+        /* Take into account a negative bias */
+        ctx->indirect_draw = false;
+        ctx->vertex_count = draw->count + (info->index_size ? abs(draw->index_bias) : 0);
+        ctx->instance_count = info->instance_count;
+        ctx->base_vertex = info->index_size ? draw->index_bias : 0;
+        ctx->base_instance = info->start_instance;
+        ctx->active_prim = info->mode;
+        ctx->drawid = drawid_offset;
+
+#if PAN_ARCH >= 10
+        /* IDVS writes a vec4 position to the tiler scratch for each vertex
+         * shaded, used for sizing the scratch */
+        batch->tiler_scratch_traffic +=
+                (uint64_t)draw->count * info->instance_count * 16;
+#endif
+
+        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+
+        bool idvs = vs->info.vs.idvs;
+        bool secondary_shader = vs->info.vs.secondary_enable;
+
+        UNUSED struct panfrost_ptr tiler, vertex;
+
+#if PAN_ARCH >= 9
+        tiler = pan_pool_alloc_desc_cs_v10(&batch->pool.base, MALLOC_VERTEX_JOB);
+#else /* PAN_ARCH < 9 */
+        if (idvs) {
+#if PAN_ARCH >= 6
+                tiler = pan_pool_alloc_desc(&batch->pool.base, INDEXED_VERTEX_JOB);
+#endif
+                unreachable("IDVS is unsupported on Midgard");
+        } else {
+                vertex = pan_pool_alloc_desc_cs_v10(&batch->pool.base, COMPUTE_JOB);
+                tiler = pan_pool_alloc_desc_cs_v10(&batch->pool.base, TILER_JOB);
+        }
+#endif /* PAN_ARCH */
+
+        unsigned vertex_count = ctx->vertex_count;
+
+        unsigned min_index = 0, max_index = 0;
+        mali_ptr indices = 0;
+
+        if (info->index_size && PAN_ARCH >= 9) {
+                /* Draws of the vertices emitted by a geometry shader use the
+                 * indices it wrote, see panfrost_draw_gs */
+                if (!info->has_user_indices && !info->index.resource)
+                        indices = ctx->gs_buffers[PAN_GS_BUFFER_INDICES];
+                else
+                        indices = panfrost_get_index_buffer(batch, info, draw);
+        } else if (info->index_size) {
+                indices = panfrost_get_index_buffer_bounded(batch, info, draw,
+                                                            &min_index,
+                                                            &max_index);
+
+                /* Use the corresponding values */
+                vertex_count = max_index - min_index + 1;
+                ctx->offset_start = min_index + draw->index_bias;
+        } else {
+                ctx->offset_start = draw->start;
+        }
+
+        if (info->instance_count > 1) {
+                unsigned count = vertex_count;
+
+                /* Index-Driven Vertex Shading requires different instances to
+                 * have different cache lines for position results. Each vertex
+                 * position is 16 bytes and the Mali cache line is 64 bytes, so
+                 * the instance count must be aligned to 4 vertices.
+                 */
+                if (idvs)
+                        count = ALIGN_POT(count, 4);
+
+                ctx->padded_count = panfrost_padded_vertex_count(count);
+        } else
+                ctx->padded_count = vertex_count;
+
+        panfrost_statistics_record(ctx, info, draw);
+
+#if PAN_ARCH <= 7
+        struct mali_invocation_packed invocation;
+        if (info->instance_count > 1) {
+                panfrost_pack_work_groups_compute(&invocation,
+                                                  1, vertex_count, info->instance_count,
+                                                  1, 1, 1, true, false);
+        } else {
+                pan_pack(&invocation, INVOCATION, cfg) {
+                        cfg.invocations = MALI_POSITIVE(vertex_count);
+                        cfg.size_y_shift = 0;
+                        cfg.size_z_shift = 0;
+                        cfg.workgroups_x_shift = 0;
+                        cfg.workgroups_y_shift = 0;
+                        cfg.workgroups_z_shift = 32;
+                        cfg.thread_group_split = MALI_SPLIT_MIN_EFFICIENT;
+                }
+        }
+
+        /* Emit all sort of descriptors. */
+        mali_ptr varyings = 0, vs_vary = 0, fs_vary = 0, pos = 0, psiz = 0;
+        uint64_t t = panfrost_profile_begin(ctx->profile);
+
+        panfrost_emit_varying_descriptor(batch,
+                                         ctx->padded_count *
+                                         ctx->instance_count,
+                                         &vs_vary, &fs_vary, &varyings,
+                                         NULL, &pos, &psiz,
+                                         info->mode == PIPE_PRIM_POINTS);
+
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_EMIT_VARYINGS, t);
+        t = panfrost_profile_begin(ctx->profile);
+
+        mali_ptr attribs, attrib_bufs;
+        attribs = panfrost_emit_vertex_data(batch, &attrib_bufs);
+
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_EMIT_VERTEX_DATA, t);
+#endif /* PAN_ARCH <= 7 */
+
+        panfrost_update_state_3d(batch);
+        panfrost_update_shader_state(batch, PIPE_SHADER_VERTEX);
+        panfrost_update_shader_state(batch, PIPE_SHADER_FRAGMENT);
+        panfrost_clean_state_3d(ctx);
+
+        if (ctx->uncompiled[PIPE_SHADER_VERTEX]->xfb) {
+#if PAN_ARCH >= 9
+                mali_ptr attribs = 0, attrib_bufs = 0;
+#endif
+                panfrost_launch_xfb(batch, info, attribs, attrib_bufs,
+                                    indices, draw->count);
+        }
+
+        /* Increment transform feedback offsets */
+        panfrost_update_streamout_offsets(ctx, draw->count);
+
+        /* Any side effects must be handled by the XFB shader, so we only need
+         * to run vertex shaders if we need rasterization.
+         */
+        if (panfrost_batch_skip_rasterization(batch))
+                return;
+
+        panfrost_union_draw_bounds(batch, info, draw);
+
+#if PAN_ARCH >= 9
+        assert(idvs && "Memory allocated IDVS required on Valhall");
+
+        panfrost_emit_malloc_vertex(batch, info, draw, indices, secondary_shader, tiler.cpu);
+
+#if PAN_ARCH >= 10
+        panfrost_launch_idvs(batch);
+
+        batch->last_draw.launch = batch->cs_vertex.ptr - 1;
+        batch->last_draw.mode = info->mode;
+        batch->last_draw.start = draw->start;
+        batch->last_draw.count = draw->count;
+        batch->last_draw.render_cond = batch->render_cond;
+        /* TODO: Find a better way to specify that there were jobs */
+        batch->scoreboard.first_job = 1;
+        batch->scoreboard.first_tiler = NULL + 1;
+
+        /* Make sure we didn't use more CS instructions than we allocated
+         * space for */
+        assert(batch->cs_vertex.ptr <= limit);
+
+#else /* PAN_ARCH < 10 */
+        panfrost_add_job(&batch->pool.base, &batch->scoreboard,
+                         MALI_JOB_TYPE_MALLOC_VERTEX, false, false, 0,
+                         0, &tiler, false);
+#endif
+#else /* PAN_ARCH < 9 */
+
+        /* Fire off the draw itself */
+        panfrost_draw_emit_tiler(batch, info, draw, &invocation, indices,
+                                 fs_vary, varyings, pos, psiz, secondary_shader,
+                                 tiler.cpu);
+        if (idvs) {
+#if PAN_ARCH >= 6
+                panfrost_draw_emit_vertex_section(batch,
+                                  vs_vary, varyings,
+                                  attribs, attrib_bufs,
+                                  pan_section_ptr(tiler.cpu, INDEXED_VERTEX_JOB, VERTEX_DRAW));
+
+                panfrost_add_job(&batch->pool.base, &batch->scoreboard,
+                                 MALI_JOB_TYPE_INDEXED_VERTEX, false, false,
+                                 0, 0, &tiler, false);
 #endif /* PAN_ARCH < 6 */
         } else {
                 panfrost_draw_emit_vertex(batch, info, &invocation,
@@ -4350,6 +5738,174 @@ panfrost_direct_draw(struct panfrost_batch *batch,
 #endif
 }
 
+#if PAN_ARCH >= 10
+/* Runs the program bound to a stage as a compute job with single-thread
+ * workgroups, and waits for it since the next job reads what it wrote */
+static void
+panfrost_launch_gs_pass(struct panfrost_batch *batch,
+                        enum pipe_shader_type stage,
+                        unsigned x, unsigned y, unsigned z)
+{
+        UNUSED struct panfrost_ptr t =
+                pan_pool_alloc_desc_cs_v10(&batch->pool.base, COMPUTE_JOB);
+
+        pan_section_pack_cs_v10(t.cpu, &batch->cs_vertex, COMPUTE_JOB, PAYLOAD, cfg) {
+                cfg.workgroup_size_x = 1;
+                cfg.workgroup_size_y = 1;
+                cfg.workgroup_size_z = 1;
+
+                cfg.workgroup_count_x = x;
+                cfg.workgroup_count_y = y;
+                cfg.workgroup_count_z = z;
+
+                panfrost_emit_shader(batch, &cfg.compute, stage,
+                                     batch->rsd[stage], batch->tls.gpu);
+
+                /* Neither pass uses barriers or shared memory */
+                cfg.allow_merging_workgroups = true;
+        }
+
+        pan_pack_ins(&batch->cs_vertex, COMPUTE_LAUNCH, cfg) { }
+        pan_pack_ins(&batch->cs_vertex, CS_WAIT, cfg) { cfg.slots = 1 << 2; }
+
+        batch->scoreboard.first_job = 1;
+}
+
+/*
+ * Geometry shaders are emulated with two compute passes before the draw, see
+ * pan_lower_gs. A variant of the vertex shader writes the vertices of the
+ * draw to memory, then the geometry shader runs once per input primitive,
+ * instance and invocation, writing the vertices it emits and an index buffer
+ * joining them into strips. The draw itself is an indexed draw of those
+ * vertices, using primitive restart, with a vertex shader loading them.
+ */
+static void
+panfrost_draw_gs(struct panfrost_batch *batch,
+                 const struct pipe_draw_info *info,
+                 unsigned drawid_offset,
+                 const struct pipe_draw_start_count_bias *draw)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_uncompiled_shader *gs =
+                ctx->uncompiled[PIPE_SHADER_GEOMETRY];
+        const struct shader_info *gs_info = &gs->nir->info;
+        unsigned count = draw->count;
+
+        u_trim_pipe_prim(info->mode, &count);
+
+        if (!count || !info->instance_count)
+                return;
+
+        /* TODO: The vertex order of triangle strips with adjacency */
+        if (info->mode == PIPE_PRIM_TRIANGLE_STRIP_ADJACENCY) {
+                perf_debug_ctx(ctx, "Triangle strips with adjacency are not "
+                               "supported with geometry shaders");
+                return;
+        }
+
+        perf_debug_ctx(ctx, "Emulating geometry shader");
+
+        panfrost_update_gs_variant(ctx, info->mode);
+
+        uint64_t inputs = gs_info->inputs_read;
+        uint64_t outputs = gs_info->outputs_written;
+        unsigned prims = u_decomposed_prims_for_vertices(info->mode, count);
+        unsigned invocations = MAX2(gs_info->gs.invocations, 1);
+        unsigned threads = prims * info->instance_count * invocations;
+        unsigned index_count = threads * pan_gs_indices_per_invocation(gs->nir);
+
+        if (!threads || !index_count || !outputs)
+                return;
+
+        ctx->gs_buffers[PAN_GS_BUFFER_INPUTS] = inputs ?
+                pan_pool_alloc_aligned(&batch->pool.base,
+                                       (size_t)count * info->instance_count *
+                                       pan_gs_vertex_stride(inputs), 16).gpu : 0;
+
+        ctx->gs_buffers[PAN_GS_BUFFER_VERTICES] =
+                pan_pool_alloc_aligned(&batch->pool.base,
+                                       (size_t)threads * gs_info->gs.vertices_out *
+                                       pan_gs_vertex_stride(outputs), 16).gpu;
+
+        ctx->gs_buffers[PAN_GS_BUFFER_INDICES] =
+                pan_pool_alloc_aligned(&batch->pool.base,
+                                       (size_t)index_count * 4, 4).gpu;
+
+        /* Parameters of the draw, as seen by the first two passes */
+        ctx->indirect_draw = false;
+        ctx->vertex_count = count;
+        ctx->instance_count = info->instance_count;
+        ctx->base_vertex = info->index_size ? draw->index_bias : 0;
+        ctx->base_instance = info->start_instance;
+        ctx->offset_start = info->index_size ? 0 : draw->start;
+        ctx->drawid = drawid_offset;
+        ctx->xfb_indices = info->index_size ?
+                           panfrost_get_index_buffer(batch, info, draw) : 0;
+        ctx->xfb_index_size = info->index_size;
+
+        panfrost_update_state_3d(batch);
+        panfrost_update_shader_state(batch, PIPE_SHADER_VERTEX);
+        ctx->dirty_shader[PIPE_SHADER_GEOMETRY] = ~0;
+        panfrost_update_shader_state(batch, PIPE_SHADER_GEOMETRY);
+
+        struct panfrost_uncompiled_shader *vs_uncompiled =
+                ctx->uncompiled[PIPE_SHADER_VERTEX];
+        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+        mali_ptr saved_rsd = batch->rsd[PIPE_SHADER_VERTEX];
+
+        if (inputs) {
+                ctx->prog[PIPE_SHADER_VERTEX] =
+                        panfrost_get_gs_vs_variant(ctx, vs_uncompiled, inputs);
+                ctx->uncompiled[PIPE_SHADER_VERTEX] = NULL; /* should not be read */
+                batch->rsd[PIPE_SHADER_VERTEX] =
+                        panfrost_emit_compute_shader_meta(batch, PIPE_SHADER_VERTEX);
+
+                panfrost_launch_gs_pass(batch, PIPE_SHADER_VERTEX,
+                                        count, info->instance_count, 1);
+
+                ctx->uncompiled[PIPE_SHADER_VERTEX] = vs_uncompiled;
+                ctx->prog[PIPE_SHADER_VERTEX] = vs;
+                batch->rsd[PIPE_SHADER_VERTEX] = saved_rsd;
+        }
+
+        panfrost_launch_gs_pass(batch, PIPE_SHADER_GEOMETRY,
+                                prims, info->instance_count, invocations);
+
+        /* Draw the emitted vertices with the passthrough vertex shader */
+        ctx->uncompiled[PIPE_SHADER_VERTEX] = gs->gs_vs;
+        panfrost_update_shader_variant(ctx, PIPE_SHADER_VERTEX);
+        ctx->dirty_shader[PIPE_SHADER_VERTEX] = ~0;
+        ctx->dirty |= PAN_DIRTY_PARAMS | PAN_DIRTY_TLS_SIZE;
+
+        enum shader_prim out_prim = gs_info->gs.output_primitive;
+
+        struct pipe_draw_info out_info = {
+                .mode = out_prim == SHADER_PRIM_POINTS ? PIPE_PRIM_POINTS :
+                        out_prim == SHADER_PRIM_LINE_STRIP ? PIPE_PRIM_LINE_STRIP :
+                        PIPE_PRIM_TRIANGLE_STRIP,
+                .index_size = 4,
+                .instance_count = 1,
+                .primitive_restart = true,
+                .restart_index = ~0,
+        };
+
+        struct pipe_draw_start_count_bias out_draw = {
+                .count = index_count,
+        };
+
+        batch->last_draw.launch = NULL;
+        panfrost_direct_draw(batch, &out_info, drawid_offset, &out_draw);
+
+        /* Restore the vertex shader of the application */
+        ctx->uncompiled[PIPE_SHADER_VERTEX] = vs_uncompiled;
+        ctx->prog[PIPE_SHADER_VERTEX] = vs;
+        ctx->dirty_shader[PIPE_SHADER_VERTEX] = ~0;
+        ctx->dirty |= PAN_DIRTY_TLS_SIZE;
+
+        batch->last_draw.launch = NULL;
+}
+#endif
+
 #if PAN_GPU_INDIRECTS
 static void
 panfrost_indirect_draw(struct panfrost_batch *batch,
@@ -4422,6 +5978,8 @@ panfrost_indirect_draw(struct panfrost_batch *batch,
         panfrost_update_shader_state(batch, PIPE_SHADER_FRAGMENT);
         panfrost_clean_state_3d(ctx);
 
+        panfrost_union_draw_bounds(batch, info, NULL);
+
         bool point_coord_replace = (info->mode == PIPE_PRIM_POINTS);
 
         panfrost_emit_varying_descriptor(batch, 0,
@@ -4540,23 +6098,154 @@ panfrost_compatible_batch_state(struct panfrost_batch *batch,
 }
 
 static void
-panfrost_draw_vbo(struct pipe_context *pipe,
-                  const struct pipe_draw_info *info,
-                  unsigned drawid_offset,
-                  const struct pipe_draw_indirect_info *indirect,
-                  const struct pipe_draw_start_count_bias *draws,
-                  unsigned num_draws)
+panfrost_draw_vbo_impl(struct pipe_context *pipe,
+                       const struct pipe_draw_info *info,
+                       unsigned drawid_offset,
+                       const struct pipe_draw_indirect_info *indirect,
+                       const struct pipe_draw_start_count_bias *draws,
+                       unsigned num_draws);
+
+#if PAN_ARCH >= 10
+/* Quads, quad strips and polygons are drawn as triangle lists, translated by
+ * the GPU when the indices are in a buffer, see panfrost_translate_indices,
+ * or by u_primconvert otherwise */
+static void
+panfrost_draw_as_triangles(struct pipe_context *pipe,
+                           const struct pipe_draw_info *info,
+                           unsigned drawid_offset,
+                           const struct pipe_draw_indirect_info *indirect,
+                           const struct pipe_draw_start_count_bias *draws,
+                           unsigned num_draws)
+{
+        struct panfrost_context *ctx = pan_context(pipe);
+        unsigned drawid = drawid_offset;
+
+        util_primconvert_save_flatshade_first(ctx->primconvert,
+                                              ctx->rasterizer->base.flatshade_first);
+
+        if (indirect && indirect->buffer) {
+                util_primconvert_draw_vbo(ctx->primconvert, info, drawid_offset,
+                                          indirect, draws, num_draws);
+                return;
+        }
+
+        for (unsigned i = 0; i < num_draws; i++) {
+                unsigned count = 0;
+                struct pipe_resource *indices =
+                        panfrost_translate_indices(ctx, info, &draws[i], &count);
+
+                if (indices) {
+                        struct pipe_draw_info tri_info = *info;
+                        struct pipe_draw_start_count_bias tri_draw = {
+                                .count = count,
+                                .index_bias = draws[i].index_bias,
+                        };
+
+                        tri_info.mode = PIPE_PRIM_TRIANGLES;
+                        tri_info.index_size = 4;
+                        tri_info.index.resource = indices;
+                        tri_info.increment_draw_id = false;
+
+                        panfrost_draw_vbo_impl(pipe, &tri_info, drawid, NULL,
+                                               &tri_draw, 1);
+                } else {
+                        util_primconvert_draw_vbo(ctx->primconvert, info, drawid,
+                                                  NULL, &draws[i], 1);
+                }
+
+                if (info->increment_draw_id)
+                        drawid++;
+        }
+}
+#endif
+
+#if PAN_ARCH >= 9
+/*
+ * The attribute hardware needs the address and stride of an element to be
+ * aligned to its components for the data conversion to work. Rather than
+ * translate misaligned vertex buffers on the CPU, the vertex shader is keyed
+ * to fetch those elements itself, see pan_lower_vertex_fetch.
+ */
+static void
+panfrost_update_vertex_fetch(struct panfrost_context *ctx)
+{
+        struct panfrost_vertex_state *vtx = ctx->vertex;
+        struct pan_vertex_fetch fetch = { 0 };
+
+        for (unsigned i = 0; vtx && i < vtx->num_elements; ++i) {
+                const struct pipe_vertex_element *el = &vtx->pipe[i];
+                const struct pipe_vertex_buffer *vb =
+                        &ctx->vertex_buffers[el->vertex_buffer_index];
+                unsigned offset = vb->buffer_offset + el->src_offset;
+
+                if (!vb->buffer.resource ||
+                    ((offset | vb->stride) % vtx->component_size[i]) == 0)
+                        continue;
+
+                fetch.mask |= BITFIELD_BIT(i);
+                fetch.formats[i] = el->src_format;
+                fetch.divisors[i] = el->instance_divisor;
+        }
+
+        if (memcmp(&fetch, &ctx->vertex_fetch, sizeof(fetch)) == 0)
+                return;
+
+        if (fetch.mask)
+                perf_debug_ctx(ctx, "Fetching misaligned vertex attributes in the shader");
+
+        ctx->vertex_fetch = fetch;
+        panfrost_update_vs_for_fetch(ctx);
+}
+#endif
+
+static void
+panfrost_draw_vbo_impl(struct pipe_context *pipe,
+                       const struct pipe_draw_info *info,
+                       unsigned drawid_offset,
+                       const struct pipe_draw_indirect_info *indirect,
+                       const struct pipe_draw_start_count_bias *draws,
+                       unsigned num_draws)
 {
         struct panfrost_context *ctx = pan_context(pipe);
         struct panfrost_device *dev = pan_device(pipe->screen);
+        struct panfrost_query *cond_query = NULL;
+
+#if PAN_ARCH >= 10
+        if (unlikely(info->mode >= PIPE_PRIM_QUADS &&
+                     info->mode <= PIPE_PRIM_POLYGON)) {
+                panfrost_draw_as_triangles(pipe, info, drawid_offset, indirect,
+                                           draws, num_draws);
+                return;
+        }
+
+        cond_query = panfrost_render_condition_query(ctx);
+
+        /* The geometry shader reads the vertices of each input primitive
+         * by position in the draw, so restarts are split out on the CPU */
+        if (unlikely(ctx->uncompiled[PIPE_SHADER_GEOMETRY] &&
+                     info->index_size && info->primitive_restart &&
+                     !indirect)) {
+                util_draw_vbo_without_prim_restart(pipe, info, drawid_offset,
+                                                   indirect, &draws[0]);
+                return;
+        }
+#endif
 
-        if (!panfrost_render_condition_check(ctx))
+        if (!cond_query && !panfrost_render_condition_check(ctx))
                 return;
 
         ctx->draw_calls++;
 
+        panfrost_flush_bound_pending_clears(ctx);
+
         /* Emulate indirect draws unless we're using the experimental path */
-        if ((!(dev->debug & PAN_DBG_INDIRECT) || !PAN_GPU_INDIRECTS) && indirect && indirect->buffer) {
+        bool csf_indirect = false;
+#if PAN_ARCH >= 10
+        csf_indirect = panfrost_csf_indirect_supported(ctx, info, indirect);
+#endif
+
+        if ((!(dev->debug & PAN_DBG_INDIRECT) || !PAN_GPU_INDIRECTS) &&
+            indirect && indirect->buffer && !csf_indirect) {
                 assert(num_draws == 1);
                 util_draw_indirect(pipe, info, indirect);
                 perf_debug(dev, "Emulating indirect draw on the CPU");
@@ -4574,6 +6263,12 @@ panfrost_draw_vbo(struct pipe_context *pipe,
 
         bool points = (info->mode == PIPE_PRIM_POINTS);
 
+        /* With a geometry shader, the rasterized primitives are its own */
+        if (ctx->uncompiled[PIPE_SHADER_GEOMETRY]) {
+                points = ctx->uncompiled[PIPE_SHADER_GEOMETRY]->nir->info.gs.output_primitive ==
+                         SHADER_PRIM_POINTS;
+        }
+
         if (unlikely(!panfrost_compatible_batch_state(batch, points))) {
                 batch = panfrost_get_fresh_batch_for_fbo(ctx, "State change");
 
@@ -4581,6 +6276,17 @@ panfrost_draw_vbo(struct pipe_context *pipe,
                 assert(succ && "must be able to set state for a fresh batch");
         }
 
+#if PAN_ARCH >= 9
+        if (ctx->dirty & PAN_DIRTY_VERTEX)
+                panfrost_update_vertex_fetch(ctx);
+#endif
+
+        /* Pick up fused blending variants, see panfrost_build_key */
+        if (unlikely(ctx->fs_blend_rekey)) {
+                ctx->fs_blend_rekey = false;
+                panfrost_update_fs_for_blend(ctx);
+        }
+
         /* panfrost_batch_skip_rasterization reads
          * batch->scissor_culls_everything, which is set by
          * panfrost_emit_viewport, so call that first.
@@ -4595,8 +6301,24 @@ panfrost_draw_vbo(struct pipe_context *pipe,
         /* Conservatively assume draw parameters always change */
         ctx->dirty |= PAN_DIRTY_PARAMS | PAN_DIRTY_DRAWID;
 
+#if PAN_ARCH >= 10
+        batch->render_cond = (cond_query != NULL);
+
+        if (cond_query)
+                panfrost_emit_render_condition(batch, cond_query, ctx->cond_cond);
+#endif
+
         if (indirect) {
                 assert(num_draws == 1);
+
+#if PAN_ARCH >= 10
+                if (csf_indirect) {
+                        panfrost_csf_indirect_draw(batch, info, drawid_offset,
+                                                   indirect);
+                        return;
+                }
+#endif
+
                 assert(PAN_GPU_INDIRECTS);
 
 #if PAN_GPU_INDIRECTS
@@ -4621,7 +6343,22 @@ panfrost_draw_vbo(struct pipe_context *pipe,
         unsigned drawid = drawid_offset;
 
         for (unsigned i = 0; i < num_draws; i++) {
-                panfrost_direct_draw(batch, &tmp_info, drawid, &draws[i]);
+                trace_draw(&batch->trace, batch, tmp_info.mode,
+                           draws[i].count, tmp_info.instance_count);
+
+#if PAN_ARCH >= 10
+                /* Geometry shaders run their passes for every draw. Otherwise,
+                 * state is validated and emitted once, by the first draw
+                 * which actually launches a job */
+                if (ctx->uncompiled[PIPE_SHADER_GEOMETRY])
+                        panfrost_draw_gs(batch, &tmp_info, drawid, &draws[i]);
+                else if (i == 0 || !draws[i].count ||
+                         !panfrost_relaunch_draw(batch, &tmp_info, drawid, &draws[i]))
+#endif
+                        panfrost_direct_draw(batch, &tmp_info, drawid, &draws[i]);
+
+                /* Each draw has its own parameters */
+                ctx->dirty |= PAN_DIRTY_PARAMS;
 
                 if (tmp_info.increment_draw_id) {
                         ctx->dirty |= PAN_DIRTY_DRAWID;
@@ -4631,23 +6368,95 @@ panfrost_draw_vbo(struct pipe_context *pipe,
 
 }
 
+static void
+panfrost_draw_vbo(struct pipe_context *pipe,
+                  const struct pipe_draw_info *info,
+                  unsigned drawid_offset,
+                  const struct pipe_draw_indirect_info *indirect,
+                  const struct pipe_draw_start_count_bias *draws,
+                  unsigned num_draws)
+{
+        struct panfrost_context *ctx = pan_context(pipe);
+        uint64_t start = panfrost_profile_begin(ctx->profile);
+
+        panfrost_draw_vbo_impl(pipe, info, drawid_offset, indirect, draws,
+                               num_draws);
+
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_DRAW_VBO, start);
+}
+
 /* Launch grid is the compute equivalent of draw_vbo, so in this routine, we
  * construct the COMPUTE job and some of its payload.
  */
 
+#if PAN_ARCH >= 10
+/*
+ * Indirect dispatch on v10. Instead of a helper job patching the job
+ * descriptor, the command stream loads the workgroup counts from the
+ * indirect buffer straight into the registers of the compute payload, and
+ * stores them to the num_work_groups sysvals from the same registers. The
+ * payload was packed with counts of 1, which the load overwrites.
+ */
 static void
-panfrost_launch_grid(struct pipe_context *pipe,
-                const struct pipe_grid_info *info)
+panfrost_emit_indirect_dispatch(struct panfrost_batch *batch,
+                                const struct pipe_grid_info *info)
+{
+        pan_command_stream *c = &batch->cs_vertex;
+        struct panfrost_resource *rsrc = pan_resource(info->indirect);
+
+        panfrost_batch_read_rsrc(batch, rsrc, PIPE_SHADER_COMPUTE);
+
+        /* Workgroup count X/Y/Z live in w37-w39 */
+        pan_emit_cs_48(c, 0x42, rsrc->image.data.bo->ptr.gpu +
+                       info->indirect_offset);
+        pan_pack_ins(c, CS_LDR, cfg) {
+                cfg.offset = 0;
+                cfg.register_mask = 0x7;
+                cfg.addr = 0x42;
+                cfg.register_base = 0x25;
+        }
+        pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 0; }
+
+        bool stored = false;
+
+        for (unsigned i = 0; i < 3; ++i) {
+                if (!batch->num_wg_sysval[i])
+                        continue;
+
+                pan_emit_cs_48(c, 0x42, batch->num_wg_sysval[i]);
+                pan_pack_ins(c, CS_STR, cfg) {
+                        cfg.offset = 0;
+                        cfg.register_mask = 0x1;
+                        cfg.addr = 0x42;
+                        cfg.register_base = 0x25 + i;
+                }
+
+                stored = true;
+        }
+
+        /* The shader reads the sysvals back from memory */
+        if (stored)
+                pan_pack_ins(c, CS_WAIT, cfg) { cfg.slots = 1 << 0; }
+}
+#endif
+
+static void
+panfrost_launch_grid_impl(struct pipe_context *pipe,
+                          const struct pipe_grid_info *info)
 {
         struct panfrost_context *ctx = pan_context(pipe);
 
+        panfrost_flush_bound_pending_clears(ctx);
+
         /* XXX - shouldn't be necessary with working memory barriers. Affected
          * test: KHR-GLES31.core.compute_shader.pipeline-post-xfb */
         panfrost_flush_all_batches(ctx, "Launch grid pre-barrier");
 
         struct panfrost_batch *batch = panfrost_get_batch_for_fbo(ctx);
 
-        if (info->indirect && !PAN_GPU_INDIRECTS) {
+        /* v10 loads the workgroup counts from the command stream, see
+         * panfrost_emit_indirect_dispatch */
+        if (info->indirect && !PAN_GPU_INDIRECTS && PAN_ARCH < 10) {
                 struct pipe_transfer *transfer;
                 uint32_t *params = pipe_buffer_map_range(pipe, info->indirect,
                                 info->indirect_offset,
@@ -4663,13 +6472,16 @@ panfrost_launch_grid(struct pipe_context *pipe,
                 pipe_buffer_unmap(pipe, transfer);
 
                 if (params[0] && params[1] && params[2])
-                        panfrost_launch_grid(pipe, &direct);
+                        panfrost_launch_grid_impl(pipe, &direct);
 
                 return;
         }
 
         ctx->compute_grid = info;
 
+        trace_start_compute(&batch->trace, batch, info->grid[0],
+                            info->grid[1], info->grid[2]);
+
         UNUSED struct panfrost_ptr t =
                 pan_pool_alloc_desc_cs_v10(&batch->pool.base, COMPUTE_JOB);
 
@@ -4709,8 +6521,24 @@ panfrost_launch_grid(struct pipe_context *pipe,
                 cfg.samplers = batch->samplers[PIPE_SHADER_COMPUTE];
         }
 #else
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
         struct panfrost_compiled_shader *cs = ctx->prog[PIPE_SHADER_COMPUTE];
 
+        /* Size tasks to what a core can run at once. The grid of indirect
+         * dispatches is unknown, keep the conservative defaults there. */
+        unsigned task_axis = MALI_TASK_AXIS_Z;
+        unsigned task_increment = PAN_ARCH >= 10 ? 512 : 1;
+
+        if (!info->indirect) {
+                unsigned max_threads =
+                        panfrost_compute_max_thread_count(dev, cs->info.work_reg_count);
+
+                pan_compute_task_split(info->grid, max_threads,
+                                       info->block[0] * info->block[1] *
+                                       info->block[2],
+                                       &task_axis, &task_increment);
+        }
+
         pan_section_pack_cs_v10(t.cpu, &batch->cs_vertex, COMPUTE_JOB, PAYLOAD, cfg) {
                 cfg.workgroup_size_x = info->block[0];
                 cfg.workgroup_size_y = info->block[1];
@@ -4735,8 +6563,8 @@ panfrost_launch_grid(struct pipe_context *pipe,
                         (info->variable_shared_mem == 0);
 
 #if PAN_ARCH < 10
-                cfg.task_increment = 1;
-                cfg.task_axis = MALI_TASK_AXIS_Z;
+                cfg.task_increment = task_increment;
+                cfg.task_axis = task_axis;
 #endif
         }
 #endif
@@ -4762,19 +6590,42 @@ panfrost_launch_grid(struct pipe_context *pipe,
 #endif
 
 #if PAN_ARCH >= 10
+        if (info->indirect)
+                panfrost_emit_indirect_dispatch(batch, info);
+
         pan_pack_ins(&batch->cs_vertex, COMPUTE_LAUNCH, cfg) {
-                /* TODO: Change this as needed */
-                cfg.unk_1 = 512;
+                /* Task increment and axis */
+                cfg.unk_1 = task_increment;
+                cfg.unk_2 = task_axis;
         }
         batch->scoreboard.first_job = 1;
+
+        /* The barriers around launch_grid leave the batch holding nothing
+         * but this dispatch, so it can go to the compute queue and overlap
+         * with vertex and fragment work from other batches */
+        batch->compute = true;
 #else
         panfrost_add_job(&batch->pool.base, &batch->scoreboard,
                          MALI_JOB_TYPE_COMPUTE, true, false,
                          indirect_dep, 0, &t, false);
 #endif
+        trace_end_compute(&batch->trace, batch);
+
         panfrost_flush_all_batches(ctx, "Launch grid post-barrier");
 }
 
+static void
+panfrost_launch_grid(struct pipe_context *pipe,
+                     const struct pipe_grid_info *info)
+{
+        struct panfrost_context *ctx = pan_context(pipe);
+        uint64_t start = panfrost_profile_begin(ctx->profile);
+
+        panfrost_launch_grid_impl(pipe, info);
+
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_LAUNCH_GRID, start);
+}
+
 static void *
 panfrost_create_rasterizer_state(
         struct pipe_context *pctx,
@@ -4800,6 +6651,24 @@ panfrost_create_rasterizer_state(
                 cfg.back_facing_depth_bias = cso->offset_tri;
                 cfg.single_sampled_lines = !cso->multisample;
         }
+
+        so->depth_units = fui(cso->offset_units * 2.0f);
+        so->depth_factor = fui(cso->offset_scale);
+#else
+        pan_pack(&so->depth, DEPTH_STENCIL, cfg) {
+                cfg.depth_bias_enable = cso->offset_tri;
+                cfg.depth_units = cso->offset_units * 2.0f;
+                cfg.depth_factor = cso->offset_scale;
+                cfg.depth_bias_clamp = cso->offset_clamp;
+
+                if (cso->depth_clip_near && cso->depth_clip_far) {
+                        cfg.depth_clamp_mode = MALI_DEPTH_CLAMP_MODE_0_1;
+                        cfg.depth_cull_enable = true;
+                } else {
+                        cfg.depth_clamp_mode = MALI_DEPTH_CLAMP_MODE_BOUNDS;
+                        cfg.depth_cull_enable = false;
+                }
+        }
 #endif
 
         return so;
@@ -4862,8 +6731,20 @@ panfrost_create_vertex_elements_state(
         memcpy(so->pipe, elements, sizeof(*elements) * num_elements);
 
 #if PAN_ARCH >= 9
-        for (unsigned i = 0; i < num_elements; ++i)
+        for (unsigned i = 0; i < num_elements; ++i) {
+                const struct util_format_description *desc =
+                        util_format_description(elements[i].src_format);
+                unsigned size = desc->block.bits / 8;
+                bool packed = false;
+
+                for (unsigned c = 0; c < desc->nr_channels; ++c) {
+                        packed |= desc->channel[c].size != desc->channel[0].size ||
+                                  desc->channel[c].size % 8 != 0;
+                }
+
+                so->component_size[i] = packed ? size : size / desc->nr_channels;
                 panfrost_pack_attribute(dev, elements[i], &so->attributes[i]);
+        }
 #else
         /* Assign attribute buffers corresponding to the vertex buffers, keyed
          * for a particular divisor since that's how instancing works on Mali */
@@ -4919,11 +6800,8 @@ pan_pipe_to_stencil(const struct pipe_stencil_state *in,
 #endif
 
 static bool
-pipe_zs_always_passes(const struct pipe_depth_stencil_alpha_state *zsa)
+pipe_stencil_always_passes(const struct pipe_depth_stencil_alpha_state *zsa)
 {
-        if (zsa->depth_enabled && zsa->depth_func != PIPE_FUNC_ALWAYS)
-                return false;
-
         if (zsa->stencil[0].enabled && zsa->stencil[0].func != PIPE_FUNC_ALWAYS)
                 return false;
 
@@ -4999,8 +6877,14 @@ panfrost_create_depth_stencil_state(struct pipe_context *pipe,
         so->enabled = zsa->stencil[0].enabled ||
                 (zsa->depth_enabled && zsa->depth_func != PIPE_FUNC_ALWAYS);
 
-        so->zs_always_passes = pipe_zs_always_passes(zsa);
-        so->writes_zs = util_writes_depth_stencil(zsa);
+        so->depth_always_passes = !zsa->depth_enabled ||
+                                  zsa->depth_func == PIPE_FUNC_ALWAYS;
+        so->stencil_always_passes = pipe_stencil_always_passes(zsa);
+
+        so->writes_depth = zsa->depth_enabled && zsa->depth_writemask &&
+                           zsa->depth_func != PIPE_FUNC_NEVER;
+        so->writes_stencil = util_writes_stencil(&zsa->stencil[0]) ||
+                             util_writes_stencil(&zsa->stencil[1]);
 
         /* TODO: Bounds test should be easy */
         assert(!zsa->depth_bounds_test);
@@ -5008,16 +6892,18 @@ panfrost_create_depth_stencil_state(struct pipe_context *pipe,
         return so;
 }
 
+/* The threaded context creates views from the application thread, so this
+ * mustn't touch the context. The AFBC format is legalized when the view is
+ * bound, and the descriptor is created on first use by
+ * panfrost_update_sampler_view, which sees no texture_bo yet. */
+
 static struct pipe_sampler_view *
 panfrost_create_sampler_view(
         struct pipe_context *pctx,
         struct pipe_resource *texture,
         const struct pipe_sampler_view *template)
 {
-        struct panfrost_context *ctx = pan_context(pctx);
-        struct panfrost_sampler_view *so = rzalloc(pctx, struct panfrost_sampler_view);
-
-        pan_legalize_afbc_format(ctx, pan_resource(texture), template->format);
+        struct panfrost_sampler_view *so = rzalloc(NULL, struct panfrost_sampler_view);
 
         pipe_reference(NULL, &texture->reference);
 
@@ -5026,8 +6912,6 @@ panfrost_create_sampler_view(
         so->base.reference.count = 1;
         so->base.context = pctx;
 
-        panfrost_create_sampler_view_bo(so, pctx, texture);
-
         return (struct pipe_sampler_view *) so;
 }
 
@@ -5051,6 +6935,12 @@ panfrost_init_logicop_blend_state(struct panfrost_blend_state *so)
 
                 so->pan.rts[c].equation = equation;
 
+                /* On Valhall, the fragment shader applies the logic op for
+                 * most formats (see panfrost_logicop_in_shader), leaving a
+                 * masked store for fixed-function */
+                if (PAN_ARCH >= 9)
+                        so->equation[c] = pan_pack_blend(equation);
+
                 so->load_dest_mask |= BITFIELD_BIT(c);
         }
 }
@@ -5143,6 +7033,16 @@ panfrost_create_blend_state(struct pipe_context *pipe,
 
                 so->pan.rts[c].equation = equation;
 
+                /* On Valhall, the fragment shader may blend instead of a
+                 * blend shader, leaving a masked store for fixed-function */
+                if (PAN_ARCH >= 9 && !so->info[c].fixed_function) {
+                        struct pan_blend_equation replace = {
+                                .color_mask = equation.color_mask,
+                        };
+
+                        so->equation[c] = pan_pack_blend(replace);
+                }
+
                 /* Bifrost needs to know if any render target loads its
                  * destination in the hot draw path, so precompute this */
                 if (so->info[c].load_dest)
@@ -5295,6 +7195,15 @@ preload(struct panfrost_batch *batch, struct pan_fb_info *fb)
 static void
 init_batch(struct panfrost_batch *batch)
 {
+#if PAN_ARCH >= 5
+        /* Multisampled colour buffers may be resolved on-tile, each through
+         * an extra render target descriptor */
+        unsigned rt_descs = MAX2(batch->key.nr_cbufs, 1);
+
+        if (util_framebuffer_get_num_samples(&batch->key) > 1)
+                rt_descs = MIN2(rt_descs * 2, 8);
+#endif
+
         /* Reserve the framebuffer and local storage descriptors */
         batch->framebuffer =
 #if PAN_ARCH == 4
@@ -5303,7 +7212,7 @@ init_batch(struct panfrost_batch *batch)
                 pan_pool_alloc_desc_aggregate(&batch->pool.base,
                                               PAN_DESC(FRAMEBUFFER),
                                               PAN_DESC(ZS_CRC_EXTENSION),
-                                              PAN_DESC_ARRAY(MAX2(batch->key.nr_cbufs, 1), RENDER_TARGET));
+                                              PAN_DESC_ARRAY(rt_descs, RENDER_TARGET));
 
                 batch->framebuffer.gpu |= MALI_FBD_TAG_IS_MFBD;
 #endif
@@ -5318,6 +7227,10 @@ init_batch(struct panfrost_batch *batch)
 #if PAN_ARCH >= 10
         batch->cs_vertex = panfrost_batch_create_cs(batch, 1 << 13);
         batch->cs_fragment = panfrost_batch_create_cs(batch, 1 << 9);
+
+        /* Nothing is known about the registers on entry */
+        memset(&batch->cs_vertex_shadow, 0, sizeof(batch->cs_vertex_shadow));
+        batch->cs_vertex.shadow = &batch->cs_vertex_shadow;
 #endif
 }
 
@@ -5329,7 +7242,7 @@ panfrost_sampler_view_destroy(
         struct panfrost_sampler_view *view = (struct panfrost_sampler_view *) pview;
 
         pipe_resource_reference(&pview->texture, NULL);
-        panfrost_bo_unreference(view->state.bo);
+        panfrost_release_sampler_view_bo(pan_context(pctx), view);
         ralloc_free(view);
 }
 
@@ -5436,6 +7349,8 @@ GENX(panfrost_cmdstream_screen_init)(struct panfrost_screen *screen)
 #if PAN_ARCH >= 10
         screen->vtbl.emit_csf_toplevel = emit_csf_toplevel;
         screen->vtbl.init_cs = init_cs;
+        screen->vtbl.emit_timestamp = emit_timestamp;
+        screen->vtbl.emit_occlusion_result = emit_occlusion_result;
 #endif
 
         GENX(pan_blitter_init)(dev, &screen->blitter.bin_pool.base,
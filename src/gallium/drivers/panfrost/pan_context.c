@@ -45,13 +45,17 @@
 #include "util/format/u_format.h"
 #include "util/u_prim.h"
 #include "util/u_prim_restart.h"
+#include "util/indices/u_primconvert.h"
 #include "util/u_surface.h"
 #include "util/u_math.h"
+#include "util/u_debug.h"
 #include "util/u_debug_cb.h"
+#include "util/os_time.h"
 
 #include "pan_fence.h"
 #include "pan_screen.h"
 #include "pan_util.h"
+#include "pan_tracepoints.h"
 #include "decode.h"
 #include "util/pan_lower_framebuffer.h"
 #include "compiler/nir/nir_serialize.h"
@@ -72,6 +76,7 @@ panfrost_clear(
 
         /* At the start of the batch, we can clear for free */
         if (!batch->scoreboard.first_job) {
+                trace_clear(&batch->trace, batch, buffers);
                 panfrost_batch_clear(batch, buffers, color, depth, stencil);
                 return;
         }
@@ -80,12 +85,14 @@ panfrost_clear(
         panfrost_blitter_save(ctx, false /* render condition */);
 
         perf_debug_ctx(ctx, "Clearing with quad");
+        ctx->blitter_trace.op = "clear";
         util_blitter_clear(ctx->blitter,
                            ctx->pipe_framebuffer.width,
                            ctx->pipe_framebuffer.height,
                            util_framebuffer_get_num_layers(&ctx->pipe_framebuffer),
                            buffers, color, depth, stencil,
                            util_framebuffer_get_num_samples(&ctx->pipe_framebuffer) > 1);
+        ctx->blitter_trace.op = NULL;
 }
 
 bool
@@ -97,6 +104,94 @@ panfrost_writes_point_size(struct panfrost_context *ctx)
         return vs->info.vs.writes_point_size && ctx->active_prim == PIPE_PRIM_POINTS;
 }
 
+/* With PAN_CAPTURE_FILE set, the first context on CSF writes the command
+ * streams of PAN_CAPTURE_FRAME_COUNT frames from PAN_CAPTURE_FRAME on to the
+ * file, for benchmarking with panfrost_replay or decoding offline with
+ * panfrost_capture_decode.
+ *
+ * To trace long runs, PAN_CAPTURE_FRAME_INTERVAL only captures every Nth frame
+ * from the first, and PAN_CAPTURE_REASON only the batches whose flush reason
+ * contains the string. Other submissions are left out, so such captures are
+ * for decoding rather than replaying. */
+
+static void
+panfrost_capture_sample(struct panfrost_context *ctx)
+{
+        unsigned frame = ctx->capture.frame;
+
+        ctx->capture.active = frame >= ctx->capture.first &&
+                (frame - ctx->capture.first) % ctx->capture.interval == 0;
+}
+
+static void
+panfrost_capture_init(struct panfrost_context *ctx)
+{
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
+        const char *path = debug_get_option("PAN_CAPTURE_FILE", NULL);
+
+        if (!path || p_atomic_cmpxchg(&screen->capture_claimed, 0, 1))
+                return;
+
+        uint32_t hw_resources[PAN_CAPTURE_QUEUES] = {
+                ctx->kbase_cs_vertex.hw_resources,
+                ctx->kbase_cs_fragment.hw_resources,
+                ctx->kbase_cs_compute.hw_resources,
+        };
+
+        ctx->capture.file = pan_capture_create(&screen->dev, path,
+                                               hw_resources);
+        ctx->capture.first = debug_get_num_option("PAN_CAPTURE_FRAME", 0);
+        ctx->capture.count = MAX2(debug_get_num_option("PAN_CAPTURE_FRAME_COUNT", 1), 1);
+        ctx->capture.interval = MAX2(debug_get_num_option("PAN_CAPTURE_FRAME_INTERVAL", 1), 1);
+        ctx->capture.reason = debug_get_option("PAN_CAPTURE_REASON", NULL);
+
+        panfrost_capture_sample(ctx);
+}
+
+static void
+panfrost_capture_end_frame(struct panfrost_context *ctx)
+{
+        /* Batches still queued for submission belong to this frame */
+        panfrost_flush_submit_queue(ctx);
+
+        bool active = ctx->capture.active;
+
+        ctx->capture.frame++;
+        panfrost_capture_sample(ctx);
+
+        if (!active)
+                return;
+
+        pan_capture_end_frame(ctx->capture.file);
+
+        if (++ctx->capture.captured == ctx->capture.count) {
+                pan_capture_destroy(ctx->capture.file);
+                ctx->capture.file = NULL;
+        }
+}
+
+/* Waits at the end of a frame until at most max_frames_in_flight frames of
+ * the context are queued on the GPU, including this one. Queuing fewer
+ * frames lowers the latency between input and display, at the cost of
+ * idling the GPU while the CPU prepares the next frame. */
+
+static void
+panfrost_throttle_frame(struct panfrost_context *ctx,
+                        struct pipe_fence_handle *fence)
+{
+        struct pipe_screen *pscreen = ctx->base.screen;
+        unsigned max = pan_screen(pscreen)->max_frames_in_flight;
+
+        /* The slot holds the fence of the frame max frames ago */
+        struct pipe_fence_handle **oldest =
+                &ctx->throttle.fences[ctx->throttle.frame++ % max];
+
+        if (*oldest)
+                pscreen->fence_finish(pscreen, NULL, *oldest, PIPE_TIMEOUT_INFINITE);
+
+        pscreen->fence_reference(pscreen, oldest, fence);
+}
+
 /* The entire frame is in memory -- send it off to the kernel! */
 
 void
@@ -109,23 +204,77 @@ panfrost_flush(
         struct panfrost_device *dev = pan_device(pipe->screen);
 
 
+        /* Other contexts and the window system may access our render
+         * targets after a flush */
+        panfrost_flush_pending_clears(ctx);
+
         /* Submit all pending jobs */
         panfrost_flush_all_batches(ctx, NULL);
 
-        if (fence) {
+        if (fence && (flags & TC_FLUSH_ASYNC)) {
+                /* Created up front by panfrost_fence_create_unflushed */
+                panfrost_fence_populate(ctx, *fence);
+        } else if (fence) {
                 struct pipe_fence_handle *f = panfrost_fence_create(ctx);
                 pipe->screen->fence_reference(pipe->screen, fence, NULL);
                 *fence = f;
         }
 
+        if ((flags & PIPE_FLUSH_END_OF_FRAME) &&
+            pan_screen(pipe->screen)->max_frames_in_flight) {
+                struct pipe_fence_handle *f = fence ? *fence :
+                        panfrost_fence_create(ctx);
+
+                if (f)
+                        panfrost_throttle_frame(ctx, f);
+
+                if (f && !fence)
+                        pipe->screen->fence_reference(pipe->screen, &f, NULL);
+        }
+
         if (dev->debug & PAN_DBG_TRACE)
                 pandecode_next_frame();
+
+        if (ctx->utrace.pctx)
+                u_trace_context_process(&ctx->utrace,
+                                        !!(flags & PIPE_FLUSH_END_OF_FRAME));
+
+        if (ctx->profile && (flags & PIPE_FLUSH_END_OF_FRAME))
+                panfrost_profile_end_frame(ctx->profile);
+
+        if (ctx->capture.file && (flags & PIPE_FLUSH_END_OF_FRAME))
+                panfrost_capture_end_frame(ctx);
+
+        if (flags & PIPE_FLUSH_END_OF_FRAME) {
+                struct panfrost_device *dev = pan_device(pipe->screen);
+                uint32_t pressure = p_atomic_read(&dev->mem.pressure);
+
+                panfrost_scratch_pool_trim(&ctx->tls_pool);
+                panfrost_scratch_pool_trim(&ctx->wls_pool);
+
+                /* Another allocation went over the budget since the last
+                 * frame, give back what is only kept around for reuse */
+                if (pressure != ctx->mem_pressure) {
+                        panfrost_scratch_pool_cleanup(&ctx->tls_pool);
+                        panfrost_scratch_pool_cleanup(&ctx->wls_pool);
+                        panfrost_slab_cache_cleanup(&ctx->slab_cache);
+                        panfrost_staging_ring_cleanup(&ctx->staging);
+                        ctx->mem_pressure = pressure;
+                }
+        }
 }
 
 static void
 panfrost_texture_barrier(struct pipe_context *pipe, unsigned flags)
 {
         struct panfrost_context *ctx = pan_context(pipe);
+
+        /* Framebuffer fetch reads the tile buffer, which is coherent with
+         * the earlier draws to the same pixel, so only sampling from a
+         * render target needs its contents in memory */
+        if (!(flags & PIPE_TEXTURE_BARRIER_SAMPLER))
+                return;
+
         panfrost_flush_all_batches(ctx, "Texture barrier");
 }
 
@@ -148,8 +297,18 @@ static void
 panfrost_bind_blend_state(struct pipe_context *pipe, void *cso)
 {
         struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_device *dev = pan_device(pipe->screen);
+        struct panfrost_blend_state *old = ctx->blend;
+        struct panfrost_blend_state *blend = cso;
+
         ctx->blend = cso;
         ctx->dirty |= PAN_DIRTY_BLEND;
+
+        /* Logic ops and stable blend states are keyed in the fragment shader
+         * on Valhall */
+        if (dev->arch >= 9 &&
+            (panfrost_blend_keys_fs(old) || panfrost_blend_keys_fs(blend)))
+                panfrost_update_fs_for_blend(ctx);
 }
 
 static void
@@ -175,6 +334,14 @@ panfrost_get_blend(struct panfrost_batch *batch, unsigned rti, struct panfrost_b
         struct pipe_surface *surf = batch->key.cbufs[rti];
         enum pipe_format fmt = surf->format;
 
+        struct panfrost_compiled_shader *ss = ctx->prog[PIPE_SHADER_FRAGMENT];
+
+        /* On Valhall, the fragment shader may have applied the logic op or
+         * blend equation for this format already (see panfrost_build_key),
+         * so we only need to store the result */
+        if (dev->arch >= 9 && ss && ss->key.fs.rt_formats[rti] == fmt)
+                return 0;
+
         /* Use fixed-function if the equation permits, the format is blendable,
          * and no more than one unique constant is accessed */
         if (info.fixed_function && panfrost_blendable_formats_v7[fmt].internal &&
@@ -212,7 +379,10 @@ panfrost_get_blend(struct panfrost_batch *batch, unsigned rti, struct panfrost_b
                                 PIPE_SHADER_FRAGMENT, "Blend shader");
         }
 
-        struct panfrost_compiled_shader *ss = ctx->prog[PIPE_SHADER_FRAGMENT];
+        /* Once the blend state looks stable, try fusing it into the fragment
+         * shader at the next draw */
+        if (dev->arch >= 9 && ++blend->shader_uses == PAN_BLEND_FUSE_USES)
+                ctx->fs_blend_rekey = true;
 
         /* Default for Midgard */
         nir_alu_type col0_type = nir_type_float32;
@@ -287,14 +457,7 @@ panfrost_set_shader_images(
                         continue;
                 }
 
-                struct panfrost_resource *rsrc = pan_resource(image->resource);
-
-                /* Images don't work with AFBC, since they require pixel-level granularity */
-                if (drm_is_afbc(rsrc->image.layout.modifier)) {
-                        pan_resource_modifier_convert(ctx, rsrc,
-                                        DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED,
-                                        "Shader image");
-                }
+                pan_legalize_afbc_image(ctx, image);
 
                 util_copy_image_view(&ctx->images[shader][start_slot+i], image);
         }
@@ -402,9 +565,22 @@ panfrost_set_sampler_views(
                 struct pipe_sampler_view *view = views ? views[i] : NULL;
                 unsigned p = i + start_slot;
 
-                if (view)
+                if (view) {
                         new_nr = p + 1;
 
+                        /* Before the view's descriptor gets emitted, see if
+                         * a demoted texture should regain its layout, and
+                         * make sure AFBC can be read as the view's format */
+                        if (view->texture->target != PIPE_BUFFER) {
+                                struct panfrost_resource *rsrc = pan_resource(view->texture);
+
+                                pan_resource_maybe_promote(ctx, rsrc);
+                                pan_resource_maybe_recompress(ctx, rsrc);
+                                pan_resource_maybe_pack(ctx, rsrc);
+                                pan_legalize_afbc_format(ctx, rsrc, view->format);
+                        }
+                }
+
                 if (take_ownership) {
                         pipe_sampler_view_reference((struct pipe_sampler_view **)&ctx->sampler_views[shader][p],
                                                     NULL);
@@ -451,6 +627,11 @@ panfrost_set_shader_buffers(
         util_set_shader_buffers_mask(ctx->ssbo[shader], &ctx->ssbo_mask[shader],
                         buffers, start, count);
 
+        /* Read-only buffers are tracked as reads, so they neither serialise
+         * batches nor drop what is cached about their contents */
+        ctx->ssbo_writable[shader] &= ~BITFIELD_RANGE(start, count);
+        ctx->ssbo_writable[shader] |= writable_bitmask << start;
+
         ctx->dirty_shader[shader] |= PAN_DIRTY_STAGE_SSBO;
 }
 
@@ -460,6 +641,28 @@ panfrost_set_framebuffer_state(struct pipe_context *pctx,
 {
         struct panfrost_context *ctx = pan_context(pctx);
 
+        /* Packed AFBC bodies have no room to render into, and AFBC must be
+         * compatible with the surface format. Surfaces are created from the
+         * application thread with the threaded context, so this is checked
+         * here rather than in panfrost_create_surface. */
+        for (unsigned i = 0; i < fb->nr_cbufs; ++i) {
+                struct pipe_surface *surf = fb->cbufs[i];
+
+                if (surf) {
+                        pan_resource_unpack_afbc(ctx, pan_resource(surf->texture),
+                                                 "Rendering to packed AFBC");
+                        pan_legalize_afbc_format(ctx, pan_resource(surf->texture),
+                                                 surf->format);
+                }
+        }
+
+        if (fb->zsbuf) {
+                pan_resource_unpack_afbc(ctx, pan_resource(fb->zsbuf->texture),
+                                         "Rendering to packed AFBC");
+                pan_legalize_afbc_format(ctx, pan_resource(fb->zsbuf->texture),
+                                         fb->zsbuf->format);
+        }
+
         util_copy_framebuffer_state(&ctx->pipe_framebuffer, fb);
         ctx->batch = NULL;
 
@@ -571,32 +774,108 @@ panfrost_destroy(struct pipe_context *pipe)
         struct panfrost_context *panfrost = pan_context(pipe);
         struct panfrost_device *dev = pan_device(pipe->screen);
 
+        /* Like unflushed batches, deferred clears are dropped */
+        util_dynarray_foreach(&panfrost->pending_clears, struct pipe_resource *, prsrc) {
+                pan_resource(*prsrc)->pending_clear.valid = false;
+                pipe_resource_reference(prsrc, NULL);
+        }
+
+        if (util_queue_is_initialized(&panfrost->submit.queue)) {
+                util_queue_finish(&panfrost->submit.queue);
+                util_queue_destroy(&panfrost->submit.queue);
+        }
+
+        pan_capture_destroy(panfrost->capture.file);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(panfrost->throttle.fences); ++i)
+                pipe->screen->fence_reference(pipe->screen, &panfrost->throttle.fences[i], NULL);
+
+        panfrost_scratch_pool_cleanup(&panfrost->tls_pool);
+        panfrost_scratch_pool_cleanup(&panfrost->wls_pool);
+        panfrost_slab_cache_cleanup(&panfrost->slab_cache);
+        panfrost_staging_ring_cleanup(&panfrost->staging);
+
         if (dev->kbase && dev->mali.context_create) {
-                dev->mali.cs_term(&dev->mali, &panfrost->kbase_cs_vertex.base);
-                dev->mali.cs_term(&dev->mali, &panfrost->kbase_cs_fragment.base);
+                dev->mali.cs_free(&dev->mali, &panfrost->kbase_cs_vertex.base);
+                dev->mali.cs_free(&dev->mali, &panfrost->kbase_cs_fragment.base);
+                dev->mali.cs_free(&dev->mali, &panfrost->kbase_cs_compute.base);
 
                 dev->mali.context_destroy(&dev->mali, panfrost->kbase_ctx);
 
                 panfrost_bo_unreference(panfrost->kbase_cs_vertex.bo);
                 panfrost_bo_unreference(panfrost->kbase_cs_fragment.bo);
+                panfrost_bo_unreference(panfrost->kbase_cs_compute.bo);
+        }
+
+        for (unsigned i = 0; i < ARRAY_SIZE(panfrost->tiler_heap_desc); ++i) {
+                if (panfrost->tiler_heap_desc[i])
+                        panfrost_bo_unreference(panfrost->tiler_heap_desc[i]);
         }
 
-        if (panfrost->tiler_heap_desc)
-                panfrost_bo_unreference(panfrost->tiler_heap_desc);
+        util_dynarray_foreach(&panfrost->tiler_scratch,
+                              struct panfrost_tiler_scratch, s)
+                panfrost_bo_unreference(s->bo);
+
+        if (panfrost->tiler_heap_stats)
+                panfrost_bo_unreference(panfrost->tiler_heap_stats);
+
+        if (panfrost->trace.bo)
+                panfrost_bo_unreference(panfrost->trace.bo);
+
+        if (panfrost->utrace.pctx)
+                u_trace_context_fini(&panfrost->utrace);
 
         _mesa_hash_table_destroy(panfrost->writers, NULL);
+        panfrost_desc_tables_cleanup(panfrost);
 
         if (panfrost->blitter)
                 util_blitter_destroy(panfrost->blitter);
 
+        for (unsigned i = 0; i < ARRAY_SIZE(panfrost->afbc_unpack); ++i) {
+                if (panfrost->afbc_unpack[i])
+                        pipe->delete_compute_state(pipe, panfrost->afbc_unpack[i]);
+        }
+
+        if (panfrost->afbc_pack.size_cs) {
+                pipe->delete_compute_state(pipe, panfrost->afbc_pack.size_cs);
+                pipe->delete_compute_state(pipe, panfrost->afbc_pack.pack_cs);
+        }
+
+        if (panfrost->mipmap.cs) {
+                pipe->delete_compute_state(pipe, panfrost->mipmap.cs);
+                pipe->delete_sampler_state(pipe, panfrost->mipmap.sampler);
+        }
+
+        for (unsigned i = 0; i < PAN_INDEX_TRANSLATE_TYPES; ++i) {
+                for (unsigned j = 0; j < 2; ++j) {
+                        if (panfrost->index_translate[i][j])
+                                pipe->delete_compute_state(pipe, panfrost->index_translate[i][j]);
+                }
+        }
+
+        for (unsigned i = 0; i < ARRAY_SIZE(panfrost->buffer_copy); ++i) {
+                if (panfrost->buffer_copy[i])
+                        pipe->delete_compute_state(pipe, panfrost->buffer_copy[i]);
+
+                if (panfrost->buffer_fill[i])
+                        pipe->delete_compute_state(pipe, panfrost->buffer_fill[i]);
+        }
+
+        if (panfrost->primconvert)
+                util_primconvert_destroy(panfrost->primconvert);
+
         util_unreference_framebuffer_state(&panfrost->pipe_framebuffer);
         u_upload_destroy(pipe->stream_uploader);
 
         panfrost_pool_cleanup(&panfrost->descs);
-        panfrost_pool_cleanup(&panfrost->shaders);
+        panfrost_desc_heap_cleanup(&panfrost->desc_heap);
+        panfrost_pool_cleanup(&panfrost->cso_descs.pool);
+        simple_mtx_destroy(&panfrost->cso_descs.lock);
 
         if (dev->kbase) {
                 dev->mali.syncobj_destroy(&dev->mali, panfrost->syncobj_kbase);
+                if (panfrost->in_sync_fd != -1)
+                        close(panfrost->in_sync_fd);
         } else {
                 drmSyncobjDestroy(dev->fd, panfrost->in_sync_obj);
                 if (panfrost->in_sync_fd != -1)
@@ -612,7 +891,7 @@ panfrost_create_query(struct pipe_context *pipe,
                       unsigned type,
                       unsigned index)
 {
-        struct panfrost_query *q = rzalloc(pipe, struct panfrost_query);
+        struct panfrost_query *q = rzalloc(NULL, struct panfrost_query);
 
         q->type = type;
         q->index = index;
@@ -631,6 +910,101 @@ panfrost_destroy_query(struct pipe_context *pipe, struct pipe_query *q)
         ralloc_free(q);
 }
 
+/* Reads the software counter behind a driver query, which are all counting
+ * up so the result is the difference between the end and the start. The
+ * device counters cover every context. */
+static bool
+panfrost_query_counter(struct panfrost_context *ctx, unsigned type,
+                       uint64_t *value)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        switch (type) {
+        case PAN_QUERY_FLUSHES:
+                *value = ctx->stats.flushes;
+                break;
+        case PAN_QUERY_FLUSHES_EXPLICIT:
+                *value = ctx->stats.explicit_flushes;
+                break;
+        case PAN_QUERY_FLUSHES_RESOURCE:
+                *value = ctx->stats.resource_flushes;
+                break;
+        case PAN_QUERY_FLUSHES_BATCH_SLOTS:
+                *value = ctx->stats.slot_flushes;
+                break;
+        case PAN_QUERY_FLUSHES_SPLIT:
+                *value = ctx->stats.split_flushes;
+                break;
+        case PAN_QUERY_BO_ALLOCS:
+                *value = p_atomic_read(&dev->stats.bo_allocs);
+                break;
+        case PAN_QUERY_BO_FREES:
+                *value = p_atomic_read(&dev->stats.bo_frees);
+                break;
+        case PAN_QUERY_BO_CACHE_HITS:
+                *value = p_atomic_read(&dev->stats.bo_cache_hits);
+                break;
+        case PAN_QUERY_BO_CACHE_MISSES:
+                *value = p_atomic_read(&dev->stats.bo_cache_misses);
+                break;
+        case PAN_QUERY_SHADER_COMPILES:
+                *value = p_atomic_read(&dev->stats.shader_compiles);
+                break;
+        case PAN_QUERY_STAGING_BLITS:
+                *value = ctx->stats.staging_blits;
+                break;
+        case PAN_QUERY_MODIFIER_CONVERSIONS:
+                *value = ctx->stats.modifier_conversions;
+                break;
+        case PAN_QUERY_AFBC_PACKS:
+                *value = ctx->stats.afbc_packs;
+                break;
+        case PAN_QUERY_AFBC_IMAGE_LOADS:
+                *value = ctx->stats.afbc_image_loads;
+                break;
+        case PAN_QUERY_AFBC_IMAGE_DECOMPRESSIONS:
+                *value = ctx->stats.afbc_image_decompressions;
+                break;
+        case PAN_QUERY_AFBC_IMAGE_RECOMPRESSIONS:
+                *value = ctx->stats.afbc_image_recompressions;
+                break;
+        case PAN_QUERY_CS_RING_WRAPS:
+                *value = p_atomic_read(&ctx->stats.cs_ring_wraps);
+                break;
+        case PAN_QUERY_KCPU_COMMANDS:
+                *value = p_atomic_read(&ctx->stats.kcpu_commands);
+                break;
+        case PAN_QUERY_UPLOADED_BYTES:
+                *value = ctx->stats.uploaded_bytes;
+                break;
+        case PAN_QUERY_ZS_ONLY_BATCHES:
+                *value = ctx->stats.zs_only_batches;
+                break;
+        case PAN_QUERY_MEMORY_EVICTIONS:
+                *value = p_atomic_read(&dev->stats.mem_evictions);
+                break;
+        default:
+                return false;
+        }
+
+        return true;
+}
+
+/* Timer queries hold the start and end timestamps, zero until stored */
+static void
+panfrost_timer_query_reset(struct panfrost_context *ctx,
+                           struct panfrost_query *query)
+{
+        uint64_t zeroes[2] = { 0 };
+
+        if (!query->rsrc) {
+                query->rsrc = pipe_buffer_create(ctx->base.screen,
+                                PIPE_BIND_QUERY_BUFFER, 0, sizeof(zeroes));
+        }
+
+        pipe_buffer_write(&ctx->base, query->rsrc, 0, sizeof(zeroes), zeroes);
+}
+
 static bool
 panfrost_begin_query(struct pipe_context *pipe, struct pipe_query *q)
 {
@@ -675,8 +1049,25 @@ panfrost_begin_query(struct pipe_context *pipe, struct pipe_query *q)
                 query->start = ctx->draw_calls;
                 break;
 
+        case PAN_QUERY_CRC_ELIMINATED_TILES:
+                ctx->crc_stats.active++;
+                query->start = ctx->crc_stats.eliminated;
+                query->start_total = ctx->crc_stats.tiles;
+                break;
+
+        /* Stored by the command stream before the current batch starts */
+        case PIPE_QUERY_TIME_ELAPSED:
+                if (!panfrost_has_gpu_timestamps(dev))
+                        break;
+
+                panfrost_timer_query_reset(ctx, query);
+                panfrost_batch_add_timestamp(panfrost_get_batch_for_fbo(ctx),
+                                             pan_resource(query->rsrc),
+                                             0, false);
+                break;
+
         default:
-                /* TODO: timestamp queries, etc? */
+                panfrost_query_counter(ctx, query->type, &query->start);
                 break;
         }
 
@@ -687,6 +1078,7 @@ static bool
 panfrost_end_query(struct pipe_context *pipe, struct pipe_query *q)
 {
         struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
         struct panfrost_query *query = (struct panfrost_query *) q;
 
         switch (query->type) {
@@ -705,6 +1097,49 @@ panfrost_end_query(struct pipe_context *pipe, struct pipe_query *q)
         case PAN_QUERY_DRAW_CALLS:
                 query->end = ctx->draw_calls;
                 break;
+        case PAN_QUERY_TILER_HEAP_PEAK:
+                query->end = ctx->tiler_heap_peak;
+                break;
+        case PAN_QUERY_LARGE_PAGE_MEMORY:
+                query->end = p_atomic_read(&pan_device(pipe->screen)->large_page_size);
+                break;
+        case PAN_QUERY_MEMORY_RESOURCES:
+        case PAN_QUERY_MEMORY_POOLS:
+        case PAN_QUERY_MEMORY_HEAPS:
+        case PAN_QUERY_MEMORY_SCRATCH:
+        case PAN_QUERY_MEMORY_BO_CACHE:
+                query->end = p_atomic_read(&dev->mem.size[PAN_MEM_RESOURCE +
+                                query->type - PAN_QUERY_MEMORY_RESOURCES]);
+                break;
+        case PAN_QUERY_MEMORY_OTHER:
+                query->end = p_atomic_read(&dev->mem.size[PAN_MEM_OTHER]);
+                break;
+        case PAN_QUERY_CRC_ELIMINATED_TILES:
+                /* Count the batches queued while the query was active */
+                panfrost_flush_all_batches(ctx, "CRC statistics query");
+                assert(ctx->crc_stats.active);
+                ctx->crc_stats.active--;
+                query->end = ctx->crc_stats.eliminated;
+                query->end_total = ctx->crc_stats.tiles;
+                break;
+
+        /* Stored once all the work of the current batch is done */
+        case PIPE_QUERY_TIMESTAMP:
+        case PIPE_QUERY_TIME_ELAPSED:
+                if (!panfrost_has_gpu_timestamps(dev))
+                        break;
+
+                if (query->type == PIPE_QUERY_TIMESTAMP)
+                        panfrost_timer_query_reset(ctx, query);
+
+                panfrost_batch_add_timestamp(panfrost_get_batch_for_fbo(ctx),
+                                             pan_resource(query->rsrc),
+                                             sizeof(uint64_t), true);
+                break;
+
+        default:
+                panfrost_query_counter(ctx, query->type, &query->end);
+                break;
         }
 
         return true;
@@ -725,8 +1160,15 @@ panfrost_get_query_result(struct pipe_context *pipe,
         case PIPE_QUERY_OCCLUSION_COUNTER:
         case PIPE_QUERY_OCCLUSION_PREDICATE:
         case PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE:
-                panfrost_flush_writer(ctx, rsrc, "Occlusion query");
-                panfrost_bo_wait(rsrc->image.data.bo, INT64_MAX, false);
+                /* Only the batch writing the results has to be submitted.
+                 * Once the threaded context flushed, it already was, and
+                 * this may be called from the application thread. */
+                if (!query->threaded.flushed)
+                        panfrost_flush_writer(ctx, rsrc, "Occlusion query");
+
+                if (!panfrost_bo_wait(rsrc->image.data.bo,
+                                      wait ? INT64_MAX : 0, false))
+                        return false;
 
                 /* Read back the query results */
                 uint64_t *result = (uint64_t *) rsrc->image.data.bo->ptr.cpu;
@@ -746,24 +1188,169 @@ panfrost_get_query_result(struct pipe_context *pipe,
 
                 break;
 
+        /* Counted on the CPU as draws are recorded, so the result is final
+         * as soon as the query ends, without waiting for the GPU */
         case PIPE_QUERY_PRIMITIVES_GENERATED:
         case PIPE_QUERY_PRIMITIVES_EMITTED:
-                panfrost_flush_all_batches(ctx, "Primitive count query");
+        case PAN_QUERY_DRAW_CALLS:
                 vresult->u64 = query->end - query->start;
                 break;
 
-        case PAN_QUERY_DRAW_CALLS:
-                vresult->u64 = query->end - query->start;
+        /* Usage is only sampled when heaps are reused, so this lags a few
+         * batches behind */
+        case PAN_QUERY_TILER_HEAP_PEAK:
+                vresult->u64 = query->end;
+                break;
+
+        /* Whether the kernel actually used 2 MiB pages for these depends on
+         * its configuration and on memory fragmentation */
+        case PAN_QUERY_LARGE_PAGE_MEMORY:
+                vresult->u64 = query->end;
+                break;
+
+        /* Sampled when the query ends, like the above */
+        case PAN_QUERY_MEMORY_RESOURCES:
+        case PAN_QUERY_MEMORY_POOLS:
+        case PAN_QUERY_MEMORY_HEAPS:
+        case PAN_QUERY_MEMORY_SCRATCH:
+        case PAN_QUERY_MEMORY_BO_CACHE:
+        case PAN_QUERY_MEMORY_OTHER:
+                vresult->u64 = query->end;
+                break;
+
+        case PAN_QUERY_CRC_ELIMINATED_TILES: {
+                uint64_t total = query->end_total - query->start_total;
+
+                vresult->u64 = total ?
+                        (query->end - query->start) * 100 / total : 0;
+                break;
+        }
+
+        case PIPE_QUERY_TIMESTAMP:
+        case PIPE_QUERY_TIME_ELAPSED: {
+                if (!query->rsrc) {
+                        vresult->u64 = 0;
+                        break;
+                }
+
+                if (!query->threaded.flushed)
+                        panfrost_flush_writer(ctx, rsrc, "Timer query");
+
+                if (!panfrost_bo_wait(rsrc->image.data.bo,
+                                      wait ? INT64_MAX : 0, false))
+                        return false;
+
+                uint64_t *ts = (uint64_t *) rsrc->image.data.bo->ptr.cpu;
+
+                if (query->type == PIPE_QUERY_TIMESTAMP) {
+                        vresult->u64 = panfrost_timestamp_to_ns(dev, ts[1]);
+                } else {
+                        /* A start taken on the CPU for a batch without GPU
+                         * work can come after the end */
+                        vresult->u64 = ts[1] > ts[0] ?
+                                panfrost_timestamp_to_ns(dev, ts[1] - ts[0]) : 0;
+                }
+
                 break;
+        }
 
         default:
-                /* TODO: more queries */
+                /* Software counters, see panfrost_query_counter */
+                vresult->u64 = query->end - query->start;
                 break;
         }
 
         return true;
 }
 
+/* Occlusion results are copied by the command stream where it can, so that
+ * the results of many queries can be gathered in a buffer and waited for
+ * together. Anything else is read back, waiting as requested, and written
+ * from the CPU. */
+static void
+panfrost_get_query_result_resource(struct pipe_context *pipe,
+                                   struct pipe_query *q,
+                                   enum pipe_query_flags flags,
+                                   enum pipe_query_value_type result_type,
+                                   int index,
+                                   struct pipe_resource *resource,
+                                   unsigned offset)
+{
+        struct panfrost_context *ctx = pan_context(pipe);
+        struct panfrost_screen *screen = pan_screen(pipe->screen);
+        struct panfrost_device *dev = pan_device(pipe->screen);
+        struct panfrost_query *query = (struct panfrost_query *) q;
+        struct panfrost_resource *rsrc = pan_resource(resource);
+        unsigned size = (result_type >= PIPE_QUERY_TYPE_I64) ? 8 : 4;
+        bool predicate = false;
+
+        switch (query->type) {
+        case PIPE_QUERY_OCCLUSION_PREDICATE:
+        case PIPE_QUERY_OCCLUSION_PREDICATE_CONSERVATIVE:
+                predicate = true;
+                FALLTHROUGH;
+        case PIPE_QUERY_OCCLUSION_COUNTER: {
+                /* The counters are atomically added to the destination */
+                if (!query->rsrc || !screen->vtbl.emit_occlusion_result ||
+                    offset % size)
+                        break;
+
+                struct panfrost_resource *src = pan_resource(query->rsrc);
+
+                /* The vertex work of a batch runs before its fragment job,
+                 * so the copy can't be in the batch writing the counters */
+                panfrost_flush_writer(ctx, src, "Query result copy");
+
+                struct panfrost_batch *batch = panfrost_get_batch_for_fbo(ctx);
+                unsigned count = predicate ? 1 : dev->core_id_range;
+
+                panfrost_batch_read_rsrc(batch, src, PIPE_SHADER_VERTEX);
+                panfrost_batch_write_rsrc(batch, rsrc, PIPE_SHADER_VERTEX);
+
+                screen->vtbl.emit_occlusion_result(batch,
+                                src->image.data.bo->ptr.gpu,
+                                index < 0 ? 0 : count, predicate, size == 8,
+                                rsrc->image.data.bo->ptr.gpu + offset);
+
+                util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
+                               offset, offset + size);
+                return;
+        }
+        default:
+                break;
+        }
+
+        union pipe_query_result result = { 0 };
+        bool ready = panfrost_get_query_result(pipe, q, flags & PIPE_QUERY_WAIT,
+                                               &result);
+        uint64_t value;
+
+        /* Without a result, the buffer is left alone */
+        if (index < 0)
+                value = ready;
+        else if (!ready)
+                return;
+        else
+                value = predicate ? result.b : result.u64;
+
+        switch (result_type) {
+        case PIPE_QUERY_TYPE_I32:
+                value = MIN2(value, INT32_MAX);
+                break;
+        case PIPE_QUERY_TYPE_U32:
+                value = MIN2(value, UINT32_MAX);
+                break;
+        case PIPE_QUERY_TYPE_I64:
+                value = MIN2(value, INT64_MAX);
+                break;
+        default:
+                break;
+        }
+
+        /* Little-endian, so the low half is written for 32-bit results */
+        pipe_buffer_write(pipe, resource, offset, size, &value);
+}
+
 bool
 panfrost_render_condition_check(struct panfrost_context *ctx)
 {
@@ -780,7 +1367,7 @@ panfrost_render_condition_check(struct panfrost_context *ctx)
         struct pipe_query *pq = (struct pipe_query *)ctx->cond_query;
 
         if (panfrost_get_query_result(&ctx->base, pq, wait, &res))
-                return res.u64 != ctx->cond_cond;
+                return (res.u64 != 0) != ctx->cond_cond;
 
 	return true;
 }
@@ -793,7 +1380,7 @@ panfrost_create_stream_output_target(struct pipe_context *pctx,
 {
         struct pipe_stream_output_target *target;
 
-        target = &rzalloc(pctx, struct panfrost_streamout_target)->base;
+        target = &rzalloc(NULL, struct panfrost_streamout_target)->base;
 
         if (!target)
                 return NULL;
@@ -877,9 +1464,17 @@ panfrost_set_global_binding(struct pipe_context *pctx,
 static void
 panfrost_memory_barrier(struct pipe_context *pctx, unsigned flags)
 {
-        /* TODO: Be smart and only flush the minimum needed, maybe emitting a
-         * cache flush job if that would help */
-        panfrost_flush_all_batches(pan_context(pctx), "Memory barrier");
+        struct panfrost_context *ctx = pan_context(pctx);
+
+        /* Writes by the GPU have to reach mapped buffers */
+        if (flags & PIPE_BARRIER_MAPPED_BUFFER) {
+                panfrost_flush_all_batches(ctx, "Memory barrier");
+                return;
+        }
+
+        /* Otherwise it is enough for later work to go to new batches, which
+         * the resource dependencies order after the current ones */
+        panfrost_close_all_batches(ctx);
 }
 
 static void
@@ -890,6 +1485,56 @@ panfrost_create_fence_fd(struct pipe_context *pctx,
         *pfence = panfrost_fence_from_fd(pan_context(pctx), fd, type);
 }
 
+/* Fences of other contexts on the same device, e.g. from texture uploads on
+ * a shared-context loader thread, only point into the event slots of their
+ * queues. Rather than going through a KCPU sync file, wait for those points
+ * from the command stream of the next batch, like for BO usages. Returns
+ * false when that is not possible, for imported fences or points which are
+ * not submitted yet. */
+static bool
+panfrost_fence_server_sync_csf(struct panfrost_context *ctx,
+                               struct pipe_fence_handle *f)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        kbase k = &dev->mali;
+
+        unsigned slots[8];
+        uint64_t seqnums[8];
+
+        if (!ctx->kbase_ctx || f->fd != -1 || !f->kbase)
+                return false;
+
+        unsigned count = k->syncobj_get_points(k, f->kbase, slots, seqnums,
+                                               ARRAY_SIZE(slots));
+
+        if (count > ARRAY_SIZE(slots))
+                return false;
+
+        pthread_mutex_lock(&k->queue_lock);
+
+        for (unsigned i = 0; i < count; ++i) {
+                if (slots[i] >= k->event_slot_usage ||
+                    kbase_event_slot(k, slots[i])->last_submit <= seqnums[i]) {
+                        pthread_mutex_unlock(&k->queue_lock);
+                        return false;
+                }
+        }
+
+        pthread_mutex_unlock(&k->queue_lock);
+
+        for (unsigned i = 0; i < count; ++i) {
+                struct panfrost_usage u = {
+                        .queue = slots[i],
+                        .write = true,
+                        .seqnum = seqnums[i],
+                };
+
+                util_dynarray_append(&ctx->in_deps, struct panfrost_usage, u);
+        }
+
+        return true;
+}
+
 static void
 panfrost_fence_server_sync(struct pipe_context *pctx,
                            struct pipe_fence_handle *f)
@@ -898,8 +1543,26 @@ panfrost_fence_server_sync(struct pipe_context *pctx,
         struct panfrost_context *ctx = pan_context(pctx);
         int fd = -1, ret;
 
-        ret = drmSyncobjExportSyncFile(dev->fd, f->syncobj, &fd);
-        assert(!ret);
+        /* Fences of the threaded context are filled in by a flush, which
+         * ran before if it was in this context */
+        util_queue_fence_wait(&f->ready);
+
+        if (dev->kbase && panfrost_fence_server_sync_csf(ctx, f))
+                return;
+
+        if (dev->kbase) {
+                fd = pctx->screen->fence_get_fd(pctx->screen, f);
+
+                /* Without a sync file, the best we can do is a CPU wait */
+                if (fd == -1) {
+                        pctx->screen->fence_finish(pctx->screen, NULL, f,
+                                                   PIPE_TIMEOUT_INFINITE);
+                        return;
+                }
+        } else {
+                ret = drmSyncobjExportSyncFile(dev->fd, f->syncobj, &fd);
+                assert(!ret);
+        }
 
         sync_accumulate("panfrost", &ctx->in_sync_fd, fd);
         close(fd);
@@ -927,6 +1590,104 @@ panfrost_cs_create(struct panfrost_context *ctx, unsigned size, unsigned mask)
         return c;
 }
 
+/* u_trace timestamps are stored by the command streams of the batches, see
+ * the emit_timestamp hook */
+
+static void *
+panfrost_utrace_create_ts_buffer(struct u_trace_context *utctx, uint32_t size)
+{
+        struct pipe_context *pctx = utctx->pctx;
+        struct panfrost_device *dev = pan_device(pctx->screen);
+
+        return panfrost_bo_create(dev, size, 0, "u_trace timestamps");
+}
+
+static void
+panfrost_utrace_delete_ts_buffer(struct u_trace_context *utctx, void *timestamps)
+{
+        panfrost_bo_unreference(timestamps);
+}
+
+static void
+panfrost_utrace_record_ts(struct u_trace *ut, void *cs, void *timestamps,
+                          unsigned idx, bool end_of_pipe)
+{
+        struct panfrost_batch *batch = cs;
+        struct panfrost_bo *bo = timestamps;
+        struct panfrost_screen *screen = pan_screen(batch->ctx->base.screen);
+
+        screen->vtbl.emit_timestamp(batch, bo->ptr.gpu + idx * sizeof(uint64_t),
+                                    end_of_pipe);
+}
+
+static uint64_t
+panfrost_utrace_read_ts(struct u_trace_context *utctx, void *timestamps,
+                        unsigned idx, void *flush_data)
+{
+        struct pipe_context *pctx = utctx->pctx;
+        struct panfrost_device *dev = pan_device(pctx->screen);
+        struct panfrost_trace_flush *flush = flush_data;
+        struct panfrost_bo *bo = timestamps;
+
+        /* Timestamps are read in order, so only wait for the first one. The
+         * submit thread may not even have submitted the batch yet, so poll
+         * the queue events instead of waiting on a sync object. */
+        if (idx == 0) {
+                int64_t deadline = os_time_get_nano() + 1000000000LL;
+
+                for (unsigned i = 0; i < flush->nr_queues; ++i) {
+                        while (p_atomic_read(flush->queues[i].event) <=
+                               flush->queues[i].seqnum) {
+                                if (os_time_get_nano() > deadline)
+                                        return U_TRACE_NO_TIMESTAMP;
+
+                                os_time_sleep(100);
+                        }
+                }
+        }
+
+        uint64_t *ts = bo->ptr.cpu;
+        return panfrost_timestamp_to_ns(dev, ts[idx]);
+}
+
+static void
+panfrost_utrace_delete_flush_data(struct u_trace_context *utctx,
+                                  void *flush_data)
+{
+        free(flush_data);
+}
+
+#ifdef HAVE_PERFETTO
+struct panfrost_perfetto_state *
+panfrost_perfetto_get_state(struct pipe_context *pctx)
+{
+        return &pan_context(pctx)->perfetto;
+}
+#endif
+
+/* Queue group priority and shader cores of a new context. Low priority
+ * contexts, such as background compute clients, can be confined to the
+ * cores in PAN_LOW_PRIORITY_CORE_MASK, leaving the others to the rest. */
+
+static enum kbase_context_priority
+panfrost_context_priority(unsigned flags, uint64_t *core_mask)
+{
+        *core_mask = ~0ULL;
+
+        if (flags & PIPE_CONTEXT_HIGH_PRIORITY)
+                return KBASE_CONTEXT_PRIORITY_HIGH;
+
+        if (!(flags & PIPE_CONTEXT_LOW_PRIORITY))
+                return KBASE_CONTEXT_PRIORITY_MEDIUM;
+
+        uint64_t mask = debug_get_num_option("PAN_LOW_PRIORITY_CORE_MASK", 0);
+
+        if (mask)
+                *core_mask = mask;
+
+        return KBASE_CONTEXT_PRIORITY_LOW;
+}
+
 struct pipe_context *
 panfrost_create_context(struct pipe_screen *screen, void *priv, unsigned flags)
 {
@@ -986,6 +1747,7 @@ panfrost_create_context(struct pipe_screen *screen, void *priv, unsigned flags)
         gallium->begin_query = panfrost_begin_query;
         gallium->end_query = panfrost_end_query;
         gallium->get_query_result = panfrost_get_query_result;
+        gallium->get_query_result_resource = panfrost_get_query_result_resource;
 
         gallium->create_stream_output_target = panfrost_create_stream_output_target;
         gallium->stream_output_target_destroy = panfrost_stream_output_target_destroy;
@@ -1009,23 +1771,89 @@ panfrost_create_context(struct pipe_screen *screen, void *priv, unsigned flags)
 
         panfrost_pool_init(&ctx->descs, ctx, dev,
                         0, 4096, "Descriptors", true, false);
-
-        panfrost_pool_init(&ctx->shaders, ctx, dev,
-                        PAN_BO_EXECUTE, 4096, "Shaders", true, false);
+        panfrost_desc_heap_init(&ctx->desc_heap, dev);
+        panfrost_pool_init(&ctx->cso_descs.pool, NULL, dev,
+                        0, 4096, "CSO descriptors", false, false);
+        simple_mtx_init(&ctx->cso_descs.lock, mtx_plain);
 
         ctx->blitter = util_blitter_create(gallium);
+        ctx->blitter->draw_rectangle = panfrost_blitter_draw_rectangle;
+
+        /* Valhall draws quads, quad strips and polygons as triangle lists */
+        if (dev->arch >= 10) {
+                uint32_t native = BITFIELD_MASK(PIPE_PRIM_POLYGON + 1) &
+                        ~(BITFIELD_BIT(PIPE_PRIM_QUADS) |
+                          BITFIELD_BIT(PIPE_PRIM_QUAD_STRIP) |
+                          BITFIELD_BIT(PIPE_PRIM_POLYGON));
+
+                ctx->primconvert = util_primconvert_create_config(gallium,
+                        &(struct primconvert_config) {
+                                .primtypes_mask = native,
+                                .restart_primtypes_mask = native,
+                        });
+        }
 
         ctx->writers = _mesa_hash_table_create(gallium, _mesa_hash_pointer,
                                                         _mesa_key_pointer_equal);
 
+        static uint32_t track_gen;
+        ctx->track_gen = p_atomic_inc_return(&track_gen);
+
+        panfrost_desc_tables_init(ctx);
+
+        util_dynarray_init(&ctx->pending_clears, ctx);
+
         assert(ctx->blitter);
 
-        if (dev->kbase && dev->mali.context_create)
-                ctx->kbase_ctx = dev->mali.context_create(&dev->mali);
+        if (dev->kbase && dev->mali.context_create) {
+                uint64_t core_mask;
+                enum kbase_context_priority priority =
+                        panfrost_context_priority(flags, &core_mask);
+
+                ctx->kbase_ctx = dev->mali.context_create(&dev->mali, priority,
+                                                          core_mask);
+
+                if (dev->mali.csg_slots &&
+                    dev->mali.group_count > dev->mali.csg_slots) {
+                        perf_debug(dev, "%u queue groups for %u CSG slots, "
+                                   "groups will be evicted to run the others, "
+                                   "consider PAN_SHARED_CSG",
+                                   dev->mali.group_count, dev->mali.csg_slots);
+                }
+        }
 
         if (dev->arch >= 10) {
-                ctx->kbase_cs_vertex = panfrost_cs_create(ctx, 65536, 13);
-                ctx->kbase_cs_fragment = panfrost_cs_create(ctx, 65536, 2);
+                ctx->kbase_cs_vertex = panfrost_cs_create(ctx, PAN_CS_RING_MIN_SIZE, 13);
+                ctx->kbase_cs_fragment = panfrost_cs_create(ctx, PAN_CS_RING_MIN_SIZE, 2);
+                ctx->kbase_cs_compute = panfrost_cs_create(ctx, PAN_CS_RING_MIN_SIZE, 1);
+
+                util_dynarray_init(&ctx->tiler_scratch, ctx);
+                ctx->tiler_scratch_bits = PAN_TILER_SCRATCH_MIN_BITS;
+
+                ctx->tiler_heap_stats =
+                        panfrost_bo_create(dev, 4096, 0, "Tiler heap statistics");
+
+                if (dev->debug & PAN_DBG_ASYNC) {
+                        util_queue_init(&ctx->submit.queue, "pan_submit", 8, 1,
+                                        0, NULL);
+                }
+
+                panfrost_capture_init(ctx);
+        }
+
+        pan_gpu_tracepoint_config_variable();
+
+        if (dev->debug & PAN_DBG_PROFILE)
+                ctx->profile = panfrost_profile_create(ctx);
+
+        /* Timestamps need the CSF instructions and the timer frequency */
+        if (panfrost_has_gpu_timestamps(dev)) {
+                u_trace_context_init(&ctx->utrace, gallium,
+                                     panfrost_utrace_create_ts_buffer,
+                                     panfrost_utrace_delete_ts_buffer,
+                                     panfrost_utrace_record_ts,
+                                     panfrost_utrace_read_ts,
+                                     panfrost_utrace_delete_flush_data);
         }
 
         /* Prepare for render! */
@@ -1042,6 +1870,8 @@ panfrost_create_context(struct pipe_screen *screen, void *priv, unsigned flags)
         if (dev->kbase) {
                 ctx->syncobj_kbase = dev->mali.syncobj_create(&dev->mali);
                 ctx->in_sync_fd = -1;
+                util_dynarray_init(&ctx->in_deps, ctx);
+                util_dynarray_init(&ctx->kbase_atoms.atoms, ctx);
         } else {
                 ret = drmSyncobjCreate(dev->fd, DRM_SYNCOBJ_CREATE_SIGNALED, &ctx->syncobj);
                 assert(!ret && ctx->syncobj);
@@ -1052,5 +1882,14 @@ panfrost_create_context(struct pipe_screen *screen, void *priv, unsigned flags)
                 assert(!ret);
         }
 
-        return gallium;
+        /* Validation, descriptor emission and command stream building move to
+         * a driver thread, unless GALLIUM_THREAD=0 or on single core systems */
+        return threaded_context_create(gallium,
+                                       &pan_screen(screen)->transfer_pool,
+                                       panfrost_replace_buffer_storage,
+                                       &(struct threaded_context_options) {
+                                               .create_fence = panfrost_fence_create_unflushed,
+                                               .unsynchronized_create_fence_fd = true,
+                                       },
+                                       NULL);
 }
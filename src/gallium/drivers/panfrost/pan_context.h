@@ -34,6 +34,9 @@
 #include "pan_encoder.h"
 #include "pan_texture.h"
 #include "pan_earlyzs.h"
+#include "pan_perfetto.h"
+#include "pan_capture.h"
+#include "pan_profile.h"
 
 #include "pipe/p_compiler.h"
 #include "util/detect.h"
@@ -45,6 +48,8 @@
 #include "util/u_blitter.h"
 #include "util/hash_table.h"
 #include "util/simple_mtx.h"
+#include "util/u_queue.h"
+#include "util/perf/u_trace.h"
 
 #include "midgard/midgard_compile.h"
 #include "compiler/shader_enums.h"
@@ -84,12 +89,31 @@ enum pan_dirty_shader {
         PAN_DIRTY_STAGE_SSBO     = BITFIELD_BIT(5),
 };
 
+/* Variants of the AFBC unpack shader, by base type of the image format */
+enum pan_afbc_unpack_type {
+        PAN_AFBC_UNPACK_FLOAT,
+        PAN_AFBC_UNPACK_SINT,
+        PAN_AFBC_UNPACK_UINT,
+        PAN_AFBC_UNPACK_TYPES,
+};
+
+/* Primitive types drawn as triangle lists, see panfrost_translate_indices */
+enum pan_index_translate_type {
+        PAN_INDEX_TRANSLATE_QUADS,
+        PAN_INDEX_TRANSLATE_QUAD_STRIP,
+        PAN_INDEX_TRANSLATE_POLYGON,
+        PAN_INDEX_TRANSLATE_TYPES,
+};
+
 struct panfrost_constant_buffer {
         struct pipe_constant_buffer cb[PIPE_MAX_CONSTANT_BUFFERS];
         uint32_t enabled_mask;
 };
 
 struct panfrost_query {
+        /* Must be first for the threaded context */
+        struct threaded_query threaded;
+
         /* Passthrough from Gallium */
         unsigned type;
         unsigned index;
@@ -98,6 +122,10 @@ struct panfrost_query {
         struct {
                 uint64_t start;
                 uint64_t end;
+
+                /* Denominator for ratio queries */
+                uint64_t start_total;
+                uint64_t end_total;
         };
 
         /* Memory for the GPU to writeback the value of the query */
@@ -118,6 +146,33 @@ struct panfrost_streamout {
 };
 
 // TODO: This struct is a mess
+/* CSF ring buffers only hold a fixed-size call to the per-batch commands
+ * for each submission, so they start small. A ring is grown when the GPU
+ * falls too far behind, and shrunk again once it is lightly used. */
+#define PAN_CS_RING_MIN_SIZE 4096
+#define PAN_CS_RING_MAX_SIZE (1 << 20)
+
+/* Each submission takes a CS_CALL padded to four instructions in the ring.
+ * Ring sizes are a multiple of this, so that a call never straddles the end
+ * of the ring and wrapping around doesn't need any padding. */
+#define PAN_CS_RING_CALL_SIZE 32
+
+/* Limits for resizing tiler heaps from the usage seen, in chunks */
+#define PAN_TILER_HEAP_MAX_INITIAL_CHUNKS 32
+#define PAN_TILER_HEAP_MAX_CHUNKS 400
+
+/* Frames after which the scratch BOs of a context are released if no batch
+ * asked for scratch memory, see panfrost_scratch_pool_trim */
+#define PAN_SCRATCH_IDLE_FRAMES 60
+
+/* Upper bound of the pan_max_frames_in_flight driconf option */
+#define PAN_MAX_FRAMES_IN_FLIGHT 8
+
+/* Batches whose timing can be in flight for Perfetto at once. Each takes a
+ * start and end timestamp for each CSF queue in the trace BO. */
+#define PAN_TRACE_SLOTS 64
+#define PAN_TRACE_SLOT_SIZE (PAN_PERFETTO_QUEUE_COUNT * 2 * sizeof(uint64_t))
+
 struct panfrost_cs {
         struct kbase_cs base;
         struct panfrost_bo *bo;
@@ -128,6 +183,11 @@ struct panfrost_cs {
         uint64_t kcpu_seqnum;
         uint64_t offset;
         unsigned hw_resources;
+
+        /* Most bytes of the ring in use at once during the current lap */
+        unsigned ring_peak;
+        /* Set when the last lap left most of the ring unused */
+        bool ring_shrink;
 };
 
 struct panfrost_context {
@@ -140,27 +200,58 @@ struct panfrost_context {
         /* Per shader stage dirty state */
         enum pan_dirty_shader dirty_shader[PIPE_SHADER_TYPES];
 
-        /* Unowned pools, so manage yourself. */
-        struct panfrost_pool descs, shaders;
+        /* Unowned pool, so manage yourself. Shader binaries are in the
+         * screen's shader binary store instead, shared by all contexts. */
+        struct panfrost_pool descs;
+
+        /* Texture payloads of sampler views on CSF, which are recycled as
+         * views are destroyed */
+        struct panfrost_desc_heap desc_heap;
+
+        /* Descriptors of the shaders compiled as their CSO is created, which
+         * the threaded context does from the application thread while the
+         * driver thread allocates from descs. The driver creates its internal
+         * CSOs from the driver thread, hence the lock. Unowned as well. */
+        struct {
+                simple_mtx_t lock;
+                struct panfrost_pool pool;
+        } cso_descs;
 
         /* Sync obj used to keep track of in-flight jobs. */
         uint32_t syncobj;
         struct kbase_syncobj *syncobj_kbase;
 
-        /* Set of 32 batches. When the set is full, the LRU entry (the batch
-         * with the smallest seqnum) is flushed to free a slot.
+        /* On job manager kbase, atoms queued while defer_atoms is non-zero,
+         * so that the batches of a flush go through a single ioctl */
+        struct kbase_atom_queue kbase_atoms;
+        unsigned defer_atoms;
+
+        /* Set of batches, doubled from PAN_MIN_BATCHES up to
+         * PAN_MAX_BATCHES slots as more framebuffers are rendered to at
+         * once. When the set is full, the LRU entry (the batch with the
+         * smallest seqnum) is flushed to free a slot. Batches are allocated
+         * separately, so they don't move as it grows.
          */
         struct {
                 uint64_t seqnum;
-                struct panfrost_batch slots[PAN_MAX_BATCHES];
+                struct panfrost_batch **slots;
+                unsigned count;
 
                 /** Set of active batches for faster traversal */
-                BITSET_DECLARE(active, PAN_MAX_BATCHES);
+                BITSET_WORD *active;
         } batches;
 
-        /* Map from resources to panfrost_batches */
+        /* Map from resources to panfrost_batches, for resources without a
+         * tracking slot for this context */
         struct hash_table *writers;
 
+        /* Unique nonzero tag of the context in the tracking slots of
+         * resources, see panfrost_resource_track */
+        uint32_t track_gen;
+
+        /* Descriptor arrays uploaded to descs, by content */
+        struct hash_table *desc_tables;
+
         /* Bound job batch */
         struct panfrost_batch *batch;
 
@@ -176,6 +267,27 @@ struct panfrost_context {
         uint64_t draw_calls;
         struct panfrost_query *occlusion_query;
 
+        /* Software counters for the driver queries. The ones for the CSF
+         * queues are updated from the submit thread with PAN_DBG_ASYNC, so
+         * those are atomic. */
+        struct {
+                uint64_t flushes;
+                uint64_t explicit_flushes;
+                uint64_t resource_flushes;
+                uint64_t slot_flushes;
+                uint64_t split_flushes;
+                uint64_t staging_blits;
+                uint64_t modifier_conversions;
+                uint64_t afbc_packs;
+                uint64_t afbc_image_loads;
+                uint64_t afbc_image_decompressions;
+                uint64_t afbc_image_recompressions;
+                uint64_t zs_only_batches;
+                uint64_t uploaded_bytes;
+                uint64_t cs_ring_wraps;
+                uint64_t kcpu_commands;
+        } stats;
+
         bool indirect_draw;
         unsigned drawid;
         unsigned vertex_count;
@@ -188,6 +300,25 @@ struct panfrost_context {
         mali_ptr base_instance_sysval_ptr;
         enum pipe_prim_type active_prim;
 
+        /* First index of the draw for the transform feedback program, and
+         * the index size, or zero if the draw isn't indexed */
+        mali_ptr xfb_indices;
+        unsigned xfb_index_size;
+
+        /* Buffers of the geometry shader emulation for the draw, indexed by
+         * pan_gs_buffer, see panfrost_draw_gs */
+        mali_ptr gs_buffers[PAN_GS_BUFFER_COUNT];
+
+        /* On Valhall, set when the fragment shader should be rekeyed at the
+         * next draw, since a fused blending variant was requested or is
+         * still compiling */
+        bool fs_blend_rekey;
+
+        /* On Valhall, vertex elements the attribute hardware can't fetch for
+         * the bound vertex buffers, which the vertex shader is keyed to fetch
+         * itself */
+        struct pan_vertex_fetch vertex_fetch;
+
         /* If instancing is enabled, vertex count padded for instance; if
          * it is disabled, just equal to plain vertex count */
         unsigned padded_count;
@@ -204,6 +335,7 @@ struct panfrost_context {
 
         struct pipe_shader_buffer ssbo[PIPE_SHADER_TYPES][PIPE_MAX_SHADER_BUFFERS];
         uint32_t ssbo_mask[PIPE_SHADER_TYPES];
+        uint32_t ssbo_writable[PIPE_SHADER_TYPES];
 
         struct pipe_image_view images[PIPE_SHADER_TYPES][PIPE_MAX_SHADER_IMAGES];
         uint32_t image_mask[PIPE_SHADER_TYPES];
@@ -216,6 +348,43 @@ struct panfrost_context {
 
         struct blitter_context *blitter;
 
+        /* Labels of the next u_blitter draws in the blitter tracepoint,
+         * NULL for the defaults */
+        struct {
+                const char *op, *detail;
+        } blitter_trace;
+
+        /* Compute shaders copying AFBC images to linear ones for CPU reads,
+         * indexed by enum pan_afbc_unpack_type. Created on first use. */
+        void *afbc_unpack[PAN_AFBC_UNPACK_TYPES];
+
+        /* Compute shaders sizing and compacting AFBC bodies */
+        struct {
+                void *size_cs;
+                void *pack_cs;
+        } afbc_pack;
+
+        /* Compute shader generating mipmaps and its bilinear sampler */
+        struct {
+                void *cs;
+                void *sampler;
+        } mipmap;
+
+        /* Compute shaders translating index buffers to triangle lists, by
+         * primitive type and provoking vertex. Created on first use. */
+        void *index_translate[PAN_INDEX_TRANSLATE_TYPES][2];
+
+        /* Compute shaders copying buffers a word or a vec4 at a time, see
+         * panfrost_resource_copy_region. Created on first use. */
+        void *buffer_copy[2];
+
+        /* Compute shaders filling buffers, see panfrost_clear_buffer */
+        void *buffer_fill[2];
+
+        /* Draws of primitive types the hardware lacks which can't be
+         * translated on the GPU */
+        struct primconvert_context *primconvert;
+
         struct panfrost_blend_state *blend;
 
         /* On Valhall, does the current blend state use a blend shader for any
@@ -244,11 +413,133 @@ struct panfrost_context {
         int in_sync_fd;
         uint32_t in_sync_obj;
 
+        /* Queue points of other contexts from fence_server_sync, which the
+         * next batch waits for on the GPU (struct panfrost_usage) */
+        struct util_dynarray in_deps;
+
         struct kbase_context *kbase_ctx;
         struct panfrost_bo *event_bo;
         struct panfrost_cs kbase_cs_vertex;
         struct panfrost_cs kbase_cs_fragment;
-        struct panfrost_bo *tiler_heap_desc;
+        struct panfrost_cs kbase_cs_compute;
+        /* Descriptors of the tiler heaps of kbase_ctx, created on first
+         * use. next_tiler_heap is the heap for the next batch to draw. */
+        struct panfrost_bo *tiler_heap_desc[KBASE_MAX_TILER_HEAPS];
+        unsigned next_tiler_heap;
+
+        /* Batches not yet submitted which use each heap, and the fragment
+         * seqnum of the last submitted one. A heap can only be resized
+         * once both show it to be idle. oom is set when the kernel reported
+         * running out of heap memory since the heap was last resized. */
+        struct {
+                unsigned users;
+                uint64_t seqnum;
+                bool oom;
+        } tiler_heap_state[KBASE_MAX_TILER_HEAPS];
+
+        /* Count of tiler heap OOM events of the queue group already seen */
+        uint32_t tiler_oom_seen;
+
+        /* The heap range used by the last fragment job on each heap, as
+         * a start and end address, and the largest range seen so far */
+        struct panfrost_bo *tiler_heap_stats;
+        uint64_t tiler_heap_peak;
+
+        /* Resources which may have a pending clear, referenced */
+        struct util_dynarray pending_clears;
+
+        /* Tiles written to checksummed render targets, and how many of
+         * those kept their CRC and so were not written back. Only counted
+         * while a crc-eliminated-tiles query is active, since measuring
+         * has to wait for each batch. */
+        struct {
+                unsigned active;
+                uint64_t tiles;
+                uint64_t eliminated;
+        } crc_stats;
+
+        /* struct panfrost_tiler_scratch, and the log2 of the size to use
+         * for new entries */
+        struct util_dynarray tiler_scratch;
+        unsigned tiler_scratch_bits;
+
+        /* Latest seqnums submitted to each CSF queue that are not implied
+         * by a later point on the other queue, or zero if there is none.
+         * Fences resolve to exactly these points. */
+        struct {
+                uint64_t vertex;
+                uint64_t fragment;
+                uint64_t compute;
+        } fence_point;
+
+        /* With PAN_MESA_DEBUG=async, the queue doing the kbase side of CSF
+         * submits. The CSF queues above are only touched from its thread
+         * then. The seqnums are the last ones assigned to a batch. */
+        struct {
+                struct util_queue queue;
+                uint64_t vertex_seqnum;
+                uint64_t fragment_seqnum;
+                uint64_t compute_seqnum;
+        } submit;
+
+        /* Batches traced to the Perfetto render stage data source. Each
+         * slot of the BO holds a start and end timestamp for each queue,
+         * written by the CSF queues of the batch. pending is the mask of
+         * the queues used by the batch in the slot, or zero once it has
+         * been emitted. */
+        struct {
+                struct panfrost_bo *bo;
+                struct panfrost_perfetto_batch batches[PAN_TRACE_SLOTS];
+                uint8_t pending[PAN_TRACE_SLOTS];
+                unsigned next;
+
+                /* CPU time of the next clock sync */
+                uint64_t next_sync_ns;
+        } trace;
+
+        /* u_trace tracepoints, only initialized when the GPU can write
+         * timestamps */
+        struct u_trace_context utrace;
+
+#ifdef HAVE_PERFETTO
+        struct panfrost_perfetto_state perfetto;
+#endif
+
+        /* CPU profiling histograms, NULL unless PAN_DBG_PROFILE is set */
+        struct panfrost_profile *profile;
+
+        /* Capture of the command streams for panfrost_replay, of count
+         * frames taken every interval frames from frame first, and only of
+         * the batches whose flush reason contains reason if it is set.
+         * active is set while the current frame is captured. file is NULL
+         * when not capturing. */
+        struct {
+                struct pan_capture *file;
+                unsigned frame, first, count, interval, captured;
+                const char *reason;
+                bool active;
+        } capture;
+
+        /* Fences of the last frames, used as a ring indexed by the frame
+         * number to throttle to max_frames_in_flight */
+        struct {
+                struct pipe_fence_handle *fences[PAN_MAX_FRAMES_IN_FLIGHT];
+                unsigned frame;
+        } throttle;
+
+        /* Thread local storage and workgroup shared memory, reused by
+         * batches once idle */
+        struct panfrost_scratch_pool tls_pool, wls_pool;
+
+        /* Backing BOs of the batch pools */
+        struct panfrost_slab_cache slab_cache;
+
+        /* Backing BOs of the staging images */
+        struct panfrost_staging_ring staging;
+
+        /* Last memory pressure count of the device seen at the end of a
+         * frame, the cached BOs above are released when it changes */
+        uint32_t mem_pressure;
 };
 
 /* Corresponds to the CSO */
@@ -281,11 +572,13 @@ struct panfrost_fs_key {
         /* Number of colour buffers if gl_FragColor is written */
         unsigned nr_cbufs_for_fragcolor;
 
-        /* On Valhall, fixed_varying_mask of the linked vertex shader */
+        /* On Valhall, fixed_varying_mask and fp16_varying_mask of the linked
+         * vertex shader */
         uint32_t fixed_varying_mask;
+        uint32_t fp16_varying_mask;
 
         /* Midgard shaders that read the tilebuffer must be keyed for
-         * non-blendable formats
+         * non-blendable formats, as must Valhall shaders with logic ops
          */
         enum pipe_format rt_formats[8];
 
@@ -294,26 +587,63 @@ struct panfrost_fs_key {
 
         /* User clip plane lowering */
         uint8_t clip_plane_enable;
+
+        /* Render targets written at half precision, if enabled in driconf */
+        uint8_t fp16_rt_mask;
+
+        /* On Valhall, logic ops are lowered into the fragment shader for
+         * render targets with a format in rt_formats, instead of running a
+         * blend shader */
+        bool logicop_enable;
+        uint8_t logicop_func;
+
+        /* On Valhall, render targets of a stable blend state whose blend
+         * equation is lowered into the fragment shader, with their format in
+         * rt_formats */
+        uint8_t blend_in_shader;
+        struct pan_blend_equation blend[8];
 };
 
 struct panfrost_shader_key {
         union {
-                /* Vertex shaders do not use shader keys. However, we have a
-                 * special "transform feedback" vertex program derived from a
-                 * vertex shader. If vs_is_xfb is set on a vertex shader, this
-                 * is a transform feedback shader, else it is a regular
-                 * (unkeyed) vertex shader.
-                 */
-                bool vs_is_xfb;
+                struct {
+                        /* Set on the special "transform feedback" vertex
+                         * program derived from a vertex shader */
+                        bool is_xfb;
+
+                        /* Attributes fetched by the shader instead of the
+                         * attribute hardware, see pan_lower_vertex_fetch */
+                        struct pan_vertex_fetch fetch;
+
+                        /* Set on the program feeding an emulated geometry
+                         * shader, to the varying slots it reads */
+                        uint64_t gs_inputs;
+                } vs;
+
+                /* Geometry shaders are keyed for the primitive type of the
+                 * draw, see pan_lower_gs */
+                struct {
+                        uint8_t topology;
+                } gs;
 
                 /* Fragment shaders use regular shader keys */
                 struct panfrost_fs_key fs;
         };
 };
 
+/* A shader binary uploaded to the screen's shader binary store, shared by the
+ * variants of every context with the same code */
+struct panfrost_shader_bin {
+        unsigned char sha1[20];
+        struct panfrost_pool_ref ref;
+        unsigned refcnt;
+};
+
 struct panfrost_compiled_shader {
-        /* Respectively, shader binary and Renderer State Descriptor */
+        /* Respectively, shader binary and Renderer State Descriptor. The
+         * binary is borrowed from shared_bin, which owns the reference. */
         struct panfrost_pool_ref bin, state;
+        struct panfrost_shader_bin *shared_bin;
 
         /* For fragment shaders, a prepared (but not uploaded RSD) */
         uint32_t partial_rsd[RSD_WORDS];
@@ -325,6 +655,10 @@ struct panfrost_compiled_shader {
         /* Linked varyings, for non-separable programs */
         struct pan_linkage linkage;
 
+        /* For vertex and fragment shaders on Valhall, slots (gl_varying_slot)
+         * of the varying buffer written or read respectively */
+        uint64_t varying_mask;
+
         struct pipe_stream_output_info stream_output;
         uint64_t so_mask;
 
@@ -342,7 +676,8 @@ struct panfrost_uncompiled_shader {
          */
         const nir_shader *nir;
 
-        /* A SHA1 of the serialized NIR for the disk cache. */
+        /* A SHA1 of the serialized NIR for the disk cache. Only computed if
+         * the screen has a disk cache. */
         unsigned char nir_sha1[20];
 
         /* Stream output information */
@@ -354,16 +689,63 @@ struct panfrost_uncompiled_shader {
         /* Array of panfrost_compiled_shader */
         struct util_dynarray variants;
 
+        /* Array of variants still being compiled on the screen's shader
+         * queue, as pointers to panfrost_shader_job */
+        struct util_dynarray pending;
+
         /* Compiled transform feedback program, if one is required */
         struct panfrost_compiled_shader *xfb;
 
+        /* Transform feedback programs which also fetch some vertex
+         * attributes, as pointers to panfrost_compiled_shader. Protected by
+         * the lock. */
+        struct util_dynarray xfb_variants;
+
+        /* Programs feeding the bound geometry shader, as pointers to
+         * panfrost_compiled_shader. Protected by the lock. */
+        struct util_dynarray gs_vs_variants;
+
+        /* On geometry shaders, the vertex shader loading the vertices they
+         * emit for rasterization, see pan_gs_passthrough_vs */
+        struct panfrost_uncompiled_shader *gs_vs;
+
         /* On vertex shaders, bit mask of special desktop-only varyings to link
          * with the fragment shader. Used on Valhall to implement separable
          * shaders for desktop GL.
          */
         uint32_t fixed_varying_mask;
+
+        /* On vertex shaders, bit mask of general varyings (bit i for
+         * VARYING_SLOT_VAR0 + i) stored at half precision. Used on Valhall to
+         * halve the varying buffer footprint of mediump varyings.
+         */
+        uint32_t fp16_varying_mask;
+
+        /* On vertex shaders copying a vertex attribute to gl_Position, where
+         * the x, y and w components come from: a component of the attribute
+         * at driver location attrib, or a constant if comp is negative. Lets
+         * draws of pre-transformed vertices be bounded on the CPU.
+         */
+        struct {
+                bool valid;
+                unsigned attrib;
+                int8_t comp[4];
+                float constant[4];
+        } position;
+
+        /* Number of fused blending variants compiled or queued, capped to
+         * PAN_MAX_FUSED_BLEND_VARIANTS */
+        unsigned nr_fused_variants;
+
+        /* Keys of the variants used by this shader, in this run or a previous
+         * one, as recorded in the disk cache. Array of panfrost_shader_key */
+        struct util_dynarray used_keys;
 };
 
+/* Maximum number of variant keys recorded per shader in the disk cache, and
+ * prefetched when the shader is created again */
+#define PAN_MAX_RECORDED_VARIANTS 16
+
 /* The binary artefacts of compiling a shader. This differs from
  * panfrost_compiled_shader, which adds extra metadata beyond compiling but
  * throws away information not needed after the initial compile.
@@ -390,6 +772,16 @@ panfrost_disk_cache_retrieve(struct disk_cache *cache,
                              const struct panfrost_shader_key *key,
                              struct panfrost_shader_binary *binary);
 
+void
+panfrost_disk_cache_store_keys(struct disk_cache *cache,
+                               const struct panfrost_uncompiled_shader *uncompiled,
+                               const struct util_dynarray *keys);
+
+void
+panfrost_disk_cache_retrieve_keys(struct disk_cache *cache,
+                                  const struct panfrost_uncompiled_shader *uncompiled,
+                                  struct util_dynarray *keys);
+
 void
 panfrost_disk_cache_init(struct panfrost_screen *screen);
 
@@ -446,9 +838,40 @@ void
 panfrost_update_shader_variant(struct panfrost_context *ctx,
                                enum pipe_shader_type type);
 
+void
+panfrost_update_fs_for_blend(struct panfrost_context *ctx);
+
+void
+panfrost_update_vs_for_fetch(struct panfrost_context *ctx);
+
+struct panfrost_compiled_shader *
+panfrost_get_xfb_variant(struct panfrost_context *ctx,
+                         struct panfrost_uncompiled_shader *uncompiled);
+
+struct panfrost_compiled_shader *
+panfrost_get_gs_vs_variant(struct panfrost_context *ctx,
+                           struct panfrost_uncompiled_shader *uncompiled,
+                           uint64_t gs_inputs);
+
+void
+panfrost_update_gs_variant(struct panfrost_context *ctx,
+                           enum pipe_prim_type topology);
+
 void
 panfrost_analyze_sysvals(struct panfrost_compiled_shader *ss);
 
+void
+panfrost_desc_tables_init(struct panfrost_context *ctx);
+
+void
+panfrost_desc_tables_cleanup(struct panfrost_context *ctx);
+
+mali_ptr
+panfrost_upload_desc_table(struct panfrost_batch *batch,
+                           enum pipe_shader_type stage,
+                           const void *data, unsigned size,
+                           unsigned alignment);
+
 mali_ptr
 panfrost_get_index_buffer(struct panfrost_batch *batch,
                           const struct pipe_draw_info *info,
@@ -460,6 +883,11 @@ panfrost_get_index_buffer_bounded(struct panfrost_batch *batch,
                                   const struct pipe_draw_start_count_bias *draw,
                                   unsigned *min_index, unsigned *max_index);
 
+bool
+panfrost_get_index_bounds_cached(const struct pipe_draw_info *info,
+                                 const struct pipe_draw_start_count_bias *draw,
+                                 unsigned *min_index, unsigned *max_index);
+
 /* Instancing */
 
 mali_ptr
@@ -468,6 +896,21 @@ panfrost_vertex_buffer_address(struct panfrost_context *ctx, unsigned i);
 void
 panfrost_shader_context_init(struct pipe_context *pctx);
 
+void
+panfrost_blitter_draw_rectangle(struct blitter_context *blitter,
+                                void *vertex_elements_cso,
+                                blitter_get_vs_func get_vs,
+                                int x1, int y1, int x2, int y2,
+                                float depth, unsigned num_instances,
+                                enum blitter_attrib_type type,
+                                const union blitter_attrib *attrib);
+
+void
+panfrost_shader_screen_init(struct panfrost_screen *screen);
+
+void
+panfrost_shader_screen_destroy(struct panfrost_screen *screen);
+
 static inline void
 panfrost_dirty_state_all(struct panfrost_context *ctx)
 {
@@ -494,6 +937,9 @@ panfrost_set_batch_masks_blend(struct panfrost_batch *batch);
 void
 panfrost_set_batch_masks_zs(struct panfrost_batch *batch);
 
+void
+panfrost_set_batch_masks_fs(struct panfrost_batch *batch);
+
 void
 panfrost_track_image_access(struct panfrost_batch *batch,
                             enum pipe_shader_type stage,
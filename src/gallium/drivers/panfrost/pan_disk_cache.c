@@ -88,13 +88,16 @@ panfrost_disk_cache_store(struct disk_cache *cache,
 
         /* We write the following data to the cache blob:
          *
-         * 1. Size of program binary
-         * 2. Program binary
-         * 3. Shader info
+         * 1. Program binary
+         * 2. Shader info
+         * 3. Size of program binary
+         *
+         * The binary comes first so that a retrieved blob can be used as the
+         * binary as is, without copying it out.
          */
-        blob_write_uint32(&blob, binary->binary.size);
         blob_write_bytes(&blob, binary->binary.data, binary->binary.size);
         blob_write_bytes(&blob, &binary->info, sizeof(binary->info));
+        blob_write_uint32(&blob, binary->binary.size);
 
         disk_cache_put(cache, cache_key, blob.data, blob.size, NULL);
         blob_finish(&blob);
@@ -132,25 +135,127 @@ panfrost_disk_cache_retrieve(struct disk_cache *cache,
         if (!buffer)
                 return false;
 
-        struct blob_reader blob;
-        blob_reader_init(&blob, buffer, size);
+        size_t trailer = sizeof(binary->info) + sizeof(uint32_t);
+        uint32_t binary_size;
 
-        util_dynarray_init(&binary->binary, NULL);
+        if (size < trailer)
+                goto fail;
 
-        uint32_t binary_size = blob_read_uint32(&blob);
-        void *ptr = util_dynarray_resize_bytes(&binary->binary, binary_size, 1);
+        memcpy(&binary_size, (uint8_t *) buffer + size - sizeof(uint32_t),
+               sizeof(uint32_t));
 
-        blob_copy_bytes(&blob, ptr, binary_size);
-        blob_copy_bytes(&blob, &binary->info, sizeof(binary->info));
+        if (binary_size != size - trailer)
+                goto fail;
 
-        free(buffer);
+        memcpy(&binary->info, (uint8_t *) buffer + binary_size,
+               sizeof(binary->info));
+
+        /* Hand the whole blob over as the binary, which is at its start. The
+         * trailer is just slack at the end of the array. */
+        binary->binary = (struct util_dynarray) {
+                .data = buffer,
+                .size = binary_size,
+                .capacity = size,
+        };
 
         return true;
+
+fail:
+        free(buffer);
+        return false;
 #else
         return false;
 #endif
 }
 
+/**
+ * Compute the disk cache key of the list of variant keys used by a shader.
+ * This only depends on the NIR, tagged so it can't collide with a variant.
+ */
+static void
+panfrost_disk_cache_compute_keys_key(struct disk_cache *cache,
+                                     const struct panfrost_uncompiled_shader *uncompiled,
+                                     cache_key cache_key)
+{
+        static const char tag[] = "variant keys";
+        uint8_t data[sizeof(uncompiled->nir_sha1) + sizeof(tag)];
+
+        memcpy(data, uncompiled->nir_sha1, sizeof(uncompiled->nir_sha1));
+        memcpy(data + sizeof(uncompiled->nir_sha1), tag, sizeof(tag));
+
+        disk_cache_compute_key(cache, data, sizeof(data), cache_key);
+}
+
+/**
+ * Record the keys of the variants used by a shader, so they can be prefetched
+ * when the same shader is created in a later run. Replaces any previous list.
+ */
+void
+panfrost_disk_cache_store_keys(struct disk_cache *cache,
+                               const struct panfrost_uncompiled_shader *uncompiled,
+                               const struct util_dynarray *keys)
+{
+#ifdef ENABLE_SHADER_CACHE
+        if (!cache)
+                return;
+
+        cache_key cache_key;
+        panfrost_disk_cache_compute_keys_key(cache, uncompiled, cache_key);
+
+        struct blob blob;
+        blob_init(&blob);
+
+        /* Number of keys, then the keys */
+        blob_write_uint32(&blob, util_dynarray_num_elements(keys,
+                                        struct panfrost_shader_key));
+        blob_write_bytes(&blob, keys->data, keys->size);
+
+        disk_cache_put(cache, cache_key, blob.data, blob.size, NULL);
+        blob_finish(&blob);
+#endif
+}
+
+/**
+ * Append the variant keys recorded for a shader to the given array of
+ * panfrost_shader_key, if there are any.
+ */
+void
+panfrost_disk_cache_retrieve_keys(struct disk_cache *cache,
+                                  const struct panfrost_uncompiled_shader *uncompiled,
+                                  struct util_dynarray *keys)
+{
+#ifdef ENABLE_SHADER_CACHE
+        if (!cache)
+                return;
+
+        cache_key cache_key;
+        panfrost_disk_cache_compute_keys_key(cache, uncompiled, cache_key);
+
+        size_t size;
+        void *buffer = disk_cache_get(cache, cache_key, &size);
+
+        if (!buffer)
+                return;
+
+        struct blob_reader blob;
+        blob_reader_init(&blob, buffer, size);
+
+        uint32_t count = blob_read_uint32(&blob);
+        size_t bytes = count * sizeof(struct panfrost_shader_key);
+
+        /* Ignore truncated or oversized lists rather than trusting them */
+        if (!blob.overrun && count <= PAN_MAX_RECORDED_VARIANTS &&
+            (size_t) (blob.end - blob.current) == bytes) {
+                void *ptr = util_dynarray_grow_bytes(keys, count,
+                                        sizeof(struct panfrost_shader_key));
+
+                blob_copy_bytes(&blob, ptr, bytes);
+        }
+
+        free(buffer);
+#endif
+}
+
 /**
  * Initialize the on-disk shader cache.
  */
@@ -30,8 +30,24 @@
 #include "pan_fence.h"
 #include "pan_screen.h"
 
+#include "util/libsync.h"
+#include "util/os_file.h"
 #include "util/os_time.h"
 #include "util/u_inlines.h"
+#include "util/u_threaded_context.h"
+
+static struct pipe_fence_handle *
+panfrost_fence_alloc(void)
+{
+        struct pipe_fence_handle *f = calloc(1, sizeof(*f));
+        if (!f)
+                return NULL;
+
+        f->fd = -1;
+        util_queue_fence_init(&f->ready);
+        pipe_reference_init(&f->reference, 1);
+        return f;
+}
 
 void
 panfrost_fence_reference(struct pipe_screen *pscreen,
@@ -42,35 +58,69 @@ panfrost_fence_reference(struct pipe_screen *pscreen,
         struct pipe_fence_handle *old = *ptr;
 
         if (pipe_reference(&old->reference, &fence->reference)) {
-                if (dev->kbase)
+                /* Unflushed fences have nothing to destroy */
+                if (dev->kbase && old->kbase)
                         dev->mali.syncobj_destroy(&dev->mali, old->kbase);
-                else
+                else if (!dev->kbase && old->syncobj)
                         drmSyncobjDestroy(dev->fd, old->syncobj);
+                if (old->fd != -1)
+                        close(old->fd);
+                tc_unflushed_batch_token_reference(&old->tc_token, NULL);
+                util_queue_fence_destroy(&old->ready);
                 free(old);
         }
 
         *ptr = fence;
 }
 
-bool
-panfrost_fence_finish(struct pipe_screen *pscreen,
-                      struct pipe_context *ctx,
-                      struct pipe_fence_handle *fence,
-                      uint64_t timeout)
+static bool
+panfrost_fence_wait(struct pipe_screen *pscreen,
+                    struct pipe_context *ctx,
+                    struct pipe_fence_handle *fence,
+                    uint64_t timeout)
 {
         struct panfrost_device *dev = pan_device(pscreen);
         int ret;
 
-        if (fence->signaled)
-                return true;
-
         uint64_t abs_timeout = os_time_get_absolute_timeout(timeout);
+
+        if (!util_queue_fence_is_signalled(&fence->ready)) {
+                /* Only the creating context can flush the batch */
+                if (ctx && fence->tc_token)
+                        threaded_context_flush(ctx, fence->tc_token, !timeout);
+
+                if (!timeout)
+                        return false;
+
+                if (abs_timeout == OS_TIMEOUT_INFINITE) {
+                        util_queue_fence_wait(&fence->ready);
+                } else {
+                        if (!util_queue_fence_wait_timeout(&fence->ready,
+                                                           abs_timeout))
+                                return false;
+
+                        uint64_t now = os_time_get_nano();
+                        timeout = abs_timeout > now ? abs_timeout - now : 0;
+                }
+        }
+
         if (abs_timeout == OS_TIMEOUT_INFINITE)
                 abs_timeout = INT64_MAX;
 
+        if (fence->fd != -1) {
+                int timeout_ms = (timeout == PIPE_TIMEOUT_INFINITE) ? -1 :
+                        MIN2(DIV_ROUND_UP(timeout, 1000000), INT32_MAX);
+
+                fence->signaled = (sync_wait(fence->fd, timeout_ms) == 0);
+                return fence->signaled;
+        }
+
         if (dev->kbase) {
-                /* TODO: Use the timeout */
-                bool ret = dev->mali.syncobj_wait(&dev->mali, fence->kbase);
+                /* kbase waits take a relative timeout */
+                int64_t timeout_ns = MIN2(timeout, INT64_MAX);
+
+                bool ret = dev->mali.syncobj_wait(&dev->mali, fence->kbase,
+                                                  timeout_ns);
                 fence->signaled = ret;
                 return ret;
         }
@@ -84,6 +134,24 @@ panfrost_fence_finish(struct pipe_screen *pscreen,
         return fence->signaled;
 }
 
+bool
+panfrost_fence_finish(struct pipe_screen *pscreen,
+                      struct pipe_context *ctx,
+                      struct pipe_fence_handle *fence,
+                      uint64_t timeout)
+{
+        if (fence->signaled)
+                return true;
+
+        if (!panfrost_fence_wait(pscreen, ctx, fence, timeout))
+                return false;
+
+        /* The application may now read what the GPU wrote through coherent
+         * mappings, which the CPU caches could hold stale copies of */
+        panfrost_resource_invalidate_coherent(pan_screen(pscreen));
+        return true;
+}
+
 int
 panfrost_fence_get_fd(struct pipe_screen *screen,
                       struct pipe_fence_handle *f)
@@ -91,9 +159,31 @@ panfrost_fence_get_fd(struct pipe_screen *screen,
         struct panfrost_device *dev = pan_device(screen);
         int fd = -1;
 
-        /* TODO: Export a sync file using KCPU */
-        if (dev->kbase)
+        util_queue_fence_wait(&f->ready);
+
+        if (f->fd != -1)
+                return os_dupfd_cloexec(f->fd);
+
+        if (dev->kbase) {
+                struct panfrost_screen *pscreen = pan_screen(screen);
+
+                /* Sync files can only be created by KCPU queues on CSF */
+                if (!dev->mali.kcpu_syncobj_export)
+                        return fd;
+
+                simple_mtx_lock(&pscreen->kcpu.lock);
+
+                if (!pscreen->kcpu.ctx)
+                        pscreen->kcpu.ctx = dev->mali.kcpu_context_create(&dev->mali);
+
+                if (pscreen->kcpu.ctx)
+                        fd = dev->mali.kcpu_syncobj_export(&dev->mali,
+                                                           pscreen->kcpu.ctx,
+                                                           f->kbase);
+
+                simple_mtx_unlock(&pscreen->kcpu.lock);
                 return fd;
+        }
 
         drmSyncobjExportSyncFile(dev->fd, f->syncobj, &fd);
         return fd;
@@ -106,14 +196,25 @@ panfrost_fence_from_fd(struct panfrost_context *ctx, int fd,
         struct panfrost_device *dev = pan_device(ctx->base.screen);
         int ret;
 
-        /* TODO: Implement this for kbase */
-        if (dev->kbase)
-                return NULL;
-
-        struct pipe_fence_handle *f = calloc(1, sizeof(*f));
+        struct pipe_fence_handle *f = panfrost_fence_alloc();
         if (!f)
                 return NULL;
 
+        /* kbase has no syncobjs, keep the sync file around instead. Server
+         * waits import it into a KCPU queue, CPU waits poll it. */
+        if (dev->kbase) {
+                if (type != PIPE_FD_TYPE_NATIVE_SYNC)
+                        goto err_free_fence;
+
+                f->fd = os_dupfd_cloexec(fd);
+                if (f->fd == -1)
+                        goto err_free_fence;
+
+                /* Empty, so always signalled */
+                f->kbase = dev->mali.syncobj_create(&dev->mali);
+                return f;
+        }
+
         if (type == PIPE_FD_TYPE_NATIVE_SYNC) {
                 ret = drmSyncobjCreate(dev->fd, 0, &f->syncobj);
                 if (ret) {
@@ -135,8 +236,6 @@ panfrost_fence_from_fd(struct panfrost_context *ctx, int fd,
                 }
         }
 
-        pipe_reference_init(&f->reference, 1);
-
         return f;
 
 err_destroy_syncobj:
@@ -146,6 +245,37 @@ err_free_fence:
         return NULL;
 }
 
+/* On CSF, resolve a fence to the exact queue points of the work submitted
+ * so far, rather than copying the context-wide syncobj */
+static struct kbase_syncobj *
+panfrost_fence_create_csf(struct panfrost_context *ctx)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        kbase k = &dev->mali;
+
+        struct kbase_syncobj *o = k->syncobj_create(k);
+
+        if (ctx->fence_point.vertex) {
+                k->syncobj_add_point(k, o,
+                                     ctx->kbase_cs_vertex.base.event_mem_offset,
+                                     ctx->fence_point.vertex);
+        }
+
+        if (ctx->fence_point.fragment) {
+                k->syncobj_add_point(k, o,
+                                     ctx->kbase_cs_fragment.base.event_mem_offset,
+                                     ctx->fence_point.fragment);
+        }
+
+        if (ctx->fence_point.compute) {
+                k->syncobj_add_point(k, o,
+                                     ctx->kbase_cs_compute.base.event_mem_offset,
+                                     ctx->fence_point.compute);
+        }
+
+        return o;
+}
+
 struct pipe_fence_handle *
 panfrost_fence_create(struct panfrost_context *ctx)
 {
@@ -153,12 +283,17 @@ panfrost_fence_create(struct panfrost_context *ctx)
         int fd = -1, ret;
 
         if (dev->kbase) {
-                struct pipe_fence_handle *f = calloc(1, sizeof(*f));
+                struct pipe_fence_handle *f = panfrost_fence_alloc();
                 if (!f)
                         return NULL;
 
-                f->kbase = dev->mali.syncobj_dup(&dev->mali, ctx->syncobj_kbase);
-                pipe_reference_init(&f->reference, 1);
+                if (ctx->kbase_ctx) {
+                        f->kbase = panfrost_fence_create_csf(ctx);
+                } else {
+                        f->kbase = dev->mali.syncobj_dup(&dev->mali,
+                                                         ctx->syncobj_kbase);
+                }
+
                 return f;
         }
 
@@ -180,3 +315,41 @@ panfrost_fence_create(struct panfrost_context *ctx)
 
         return f;
 }
+
+/* Called by the threaded context from the application thread, so this
+ * mustn't touch the context. The flush taking the fence fills it in with
+ * panfrost_fence_populate. */
+
+struct pipe_fence_handle *
+panfrost_fence_create_unflushed(struct pipe_context *pctx,
+                                struct tc_unflushed_batch_token *token)
+{
+        struct pipe_fence_handle *f = panfrost_fence_alloc();
+        if (!f)
+                return NULL;
+
+        util_queue_fence_reset(&f->ready);
+        tc_unflushed_batch_token_reference(&f->tc_token, token);
+        return f;
+}
+
+void
+panfrost_fence_populate(struct panfrost_context *ctx,
+                        struct pipe_fence_handle *fence)
+{
+        struct pipe_fence_handle *f = panfrost_fence_create(ctx);
+
+        if (f) {
+                fence->syncobj = f->syncobj;
+                fence->kbase = f->kbase;
+                fence->fd = f->fd;
+
+                util_queue_fence_destroy(&f->ready);
+                free(f);
+        } else {
+                /* Nothing to wait on, rather than waiting forever */
+                fence->signaled = true;
+        }
+
+        util_queue_fence_signal(&fence->ready);
+}
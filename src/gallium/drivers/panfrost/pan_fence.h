@@ -26,14 +26,25 @@
  */
 
 #include "pipe/p_state.h"
+#include "util/u_queue.h"
 
 struct panfrost_context;
+struct tc_unflushed_batch_token;
 
 struct pipe_fence_handle {
         struct pipe_reference reference;
         uint32_t syncobj;
         struct kbase_syncobj *kbase;
+        /* Sync file imported on kbase, or -1 */
+        int fd;
         bool signaled;
+
+        /* The threaded context creates fences before the flush filling them
+         * in has run on the driver thread, which signals ready once it did.
+         * Until then, waits in the creating context flush the batch of the
+         * token first. */
+        struct tc_unflushed_batch_token *tc_token;
+        struct util_queue_fence ready;
 };
 
 void
@@ -57,3 +68,11 @@ panfrost_fence_from_fd(struct panfrost_context *ctx, int fd,
 
 struct pipe_fence_handle *
 panfrost_fence_create(struct panfrost_context *ctx);
+
+struct pipe_fence_handle *
+panfrost_fence_create_unflushed(struct pipe_context *pctx,
+                                struct tc_unflushed_batch_token *token);
+
+void
+panfrost_fence_populate(struct panfrost_context *ctx,
+                        struct pipe_fence_handle *fence);
@@ -69,9 +69,15 @@ panfrost_analyze_sysvals(struct panfrost_compiled_shader *ss)
                         dirty |= PAN_DIRTY_DRAWID;
                         break;
 
+                case PAN_SYSVAL_VERTEX_FETCH:
+                        dirty |= PAN_DIRTY_VERTEX;
+                        break;
+
                 case PAN_SYSVAL_SAMPLE_POSITIONS:
                 case PAN_SYSVAL_MULTISAMPLED:
                 case PAN_SYSVAL_RT_CONVERSION:
+                case PAN_SYSVAL_XFB_INDICES:
+                case PAN_SYSVAL_GS:
                         /* Nothing beyond the batch itself */
                         break;
                 default:
@@ -114,6 +120,32 @@ panfrost_get_index_buffer(struct panfrost_batch *batch,
         }
 }
 
+/* Gets the bounds on the indices used by a draw if these are known without
+ * reading the index buffer, either from the state tracker or from the cache */
+
+bool
+panfrost_get_index_bounds_cached(const struct pipe_draw_info *info,
+                                 const struct pipe_draw_start_count_bias *draw,
+                                 unsigned *min_index, unsigned *max_index)
+{
+        if (info->index_bounds_valid) {
+                *min_index = info->min_index;
+                *max_index = info->max_index;
+                return true;
+        } else if (!info->has_user_indices) {
+                struct panfrost_resource *rsrc = pan_resource(info->index.resource);
+
+                return panfrost_minmax_cache_get(rsrc->index_cache,
+                                                 info->index_size,
+                                                 draw->start, draw->count,
+                                                 info->primitive_restart,
+                                                 info->restart_index,
+                                                 min_index, max_index);
+        }
+
+        return false;
+}
+
 /* Gets a GPU address for the associated index buffer. Only gauranteed to be
  * good for the duration of the draw (transient), could last longer. Also get
  * the bounds on the index buffer for the range accessed by the draw. We do
@@ -128,28 +160,17 @@ panfrost_get_index_buffer_bounded(struct panfrost_batch *batch,
 {
         struct panfrost_resource *rsrc = pan_resource(info->index.resource);
         struct panfrost_context *ctx = batch->ctx;
-        bool needs_indices = true;
-
-        if (info->index_bounds_valid) {
-                *min_index = info->min_index;
-                *max_index = info->max_index;
-                needs_indices = false;
-        } else if (!info->has_user_indices) {
-                /* Check the cache */
-                needs_indices = !panfrost_minmax_cache_get(rsrc->index_cache,
-                                                           draw->start,
-                                                           draw->count,
-                                                           min_index,
-                                                           max_index);
-        }
 
-        if (needs_indices) {
+        if (!panfrost_get_index_bounds_cached(info, draw, min_index, max_index)) {
                 /* Fallback */
                 u_vbuf_get_minmax_index(&ctx->base, info, draw, min_index, max_index);
 
                 if (!info->has_user_indices)
                         panfrost_minmax_cache_add(rsrc->index_cache,
+                                                  info->index_size,
                                                   draw->start, draw->count,
+                                                  info->primitive_restart,
+                                                  info->restart_index,
                                                   *min_index, *max_index);
         }
 
@@ -202,19 +223,49 @@ panfrost_draw_target(struct panfrost_batch *batch, unsigned target)
  * Draw time helper to set batch->{read, draws, resolve} based on current blend
  * and depth-stencil state. To be called when blend or depth/stencil dirty state
  * respectively changes.
+ *
+ * On Bifrost and newer, render targets the fragment shader doesn't write keep
+ * their contents, so they are not drawn, and needn't take tile buffer space
+ * when no other draw of the batch writes them. The blend mask is therefore
+ * updated when the fragment shader changes too.
  */
 void
 panfrost_set_batch_masks_blend(struct panfrost_batch *batch)
 {
         struct panfrost_context *ctx = batch->ctx;
         struct panfrost_blend_state *blend = ctx->blend;
+        struct panfrost_compiled_shader *fs = ctx->prog[PIPE_SHADER_FRAGMENT];
+        unsigned written = fs ? fs->info.fs.outputs_written : 0;
+
+        /* Midgard writes out every render target */
+        if (pan_device(ctx->base.screen)->arch <= 5)
+                written = ~0;
 
         for (unsigned i = 0; i < batch->key.nr_cbufs; ++i) {
-                if (blend->info[i].enabled && batch->key.cbufs[i])
+                if (blend->info[i].enabled && batch->key.cbufs[i] &&
+                    (written & BITFIELD_BIT(i)))
                         panfrost_draw_target(batch, PIPE_CLEAR_COLOR0 << i);
         }
 }
 
+/* Framebuffer fetch reads the tile buffer, so render targets the fragment
+ * shader reads have to be preloaded wherever they hold data, even if the
+ * draw doesn't write them. To be called when the fragment shader changes. */
+void
+panfrost_set_batch_masks_fs(struct panfrost_batch *batch)
+{
+        struct panfrost_compiled_shader *fs =
+                batch->ctx->prog[PIPE_SHADER_FRAGMENT];
+
+        if (!fs)
+                return;
+
+        u_foreach_bit(i, fs->info.fs.outputs_read) {
+                if (i < batch->key.nr_cbufs && batch->key.cbufs[i])
+                        batch->read |= PIPE_CLEAR_COLOR0 << i;
+        }
+}
+
 void
 panfrost_set_batch_masks_zs(struct panfrost_batch *batch)
 {
@@ -244,11 +295,18 @@ panfrost_track_image_access(struct panfrost_batch *batch,
         struct panfrost_resource *rsrc = pan_resource(image->resource);
 
         if (image->shader_access & PIPE_IMAGE_ACCESS_WRITE) {
+                /* Decompressed when bound, see pan_legalize_afbc_image */
+                assert(!drm_is_afbc(rsrc->image.layout.modifier));
+
                 panfrost_batch_write_rsrc(batch, rsrc, stage);
+                rsrc->access.samples_since_image_write = 0;
 
                 bool is_buffer = rsrc->base.target == PIPE_BUFFER;
                 unsigned level = is_buffer ? 0 : image->u.tex.level;
-                BITSET_SET(rsrc->valid.data, level);
+                panfrost_resource_set_valid(rsrc, level);
+
+                /* Image stores bypass the tile writeback updating CRCs */
+                rsrc->valid.crc = false;
 
                 if (is_buffer) {
                         util_range_add(&rsrc->base, &rsrc->valid_buffer_range,
@@ -259,3 +317,109 @@ panfrost_track_image_access(struct panfrost_batch *batch,
         }
 }
 
+
+/* Descriptor arrays are cached by content in the context's descriptor pool,
+ * so bindings which don't change are uploaded once and then shared by every
+ * draw and batch using them. The key points into the entry's own copy of the
+ * descriptors. */
+
+struct panfrost_desc_table_key {
+        const void *data;
+        unsigned size;
+};
+
+struct panfrost_desc_table {
+        struct panfrost_desc_table_key key;
+        struct panfrost_pool_ref ref;
+        uint8_t data[];
+};
+
+/* Once this many tables are cached, start over rather than growing forever */
+#define PAN_MAX_DESC_TABLES 1024
+
+static uint32_t
+panfrost_desc_table_hash(const void *key)
+{
+        const struct panfrost_desc_table_key *k = key;
+
+        return _mesa_hash_data(k->data, k->size);
+}
+
+static bool
+panfrost_desc_table_equal(const void *a, const void *b)
+{
+        const struct panfrost_desc_table_key *ka = a, *kb = b;
+
+        return ka->size == kb->size && !memcmp(ka->data, kb->data, ka->size);
+}
+
+void
+panfrost_desc_tables_init(struct panfrost_context *ctx)
+{
+        ctx->desc_tables = _mesa_hash_table_create(ctx, panfrost_desc_table_hash,
+                                                   panfrost_desc_table_equal);
+}
+
+static void
+panfrost_desc_table_free(struct hash_entry *entry)
+{
+        struct panfrost_desc_table *table = entry->data;
+
+        panfrost_bo_unreference(table->ref.bo);
+        free(table);
+}
+
+/* Batches keep the BOs of the tables they use, so dropping the cache doesn't
+ * free anything still in flight */
+void
+panfrost_desc_tables_cleanup(struct panfrost_context *ctx)
+{
+        _mesa_hash_table_destroy(ctx->desc_tables, panfrost_desc_table_free);
+        ctx->desc_tables = NULL;
+}
+
+/*
+ * Gets a GPU address holding a copy of the size bytes of descriptors at data,
+ * valid for the whole batch, uploading them only if no identical array has
+ * been uploaded before.
+ */
+mali_ptr
+panfrost_upload_desc_table(struct panfrost_batch *batch,
+                           enum pipe_shader_type stage,
+                           const void *data, unsigned size,
+                           unsigned alignment)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_desc_table_key key = { .data = data, .size = size };
+        uint32_t hash = panfrost_desc_table_hash(&key);
+
+        struct hash_entry *entry =
+                _mesa_hash_table_search_pre_hashed(ctx->desc_tables, hash, &key);
+
+        if (!entry) {
+                if (ctx->desc_tables->entries >= PAN_MAX_DESC_TABLES)
+                        _mesa_hash_table_clear(ctx->desc_tables,
+                                               panfrost_desc_table_free);
+
+                struct panfrost_desc_table *table =
+                        malloc(sizeof(*table) + size);
+                struct panfrost_ptr T =
+                        pan_pool_alloc_aligned(&ctx->descs.base, size, alignment);
+
+                memcpy(table->data, data, size);
+                memcpy(T.cpu, data, size);
+
+                table->key.data = table->data;
+                table->key.size = size;
+                table->ref = panfrost_pool_take_ref(&ctx->descs, T.gpu);
+
+                entry = _mesa_hash_table_insert_pre_hashed(ctx->desc_tables,
+                                                           hash, &table->key,
+                                                           table);
+        }
+
+        struct panfrost_desc_table *table = entry->data;
+
+        panfrost_batch_add_bo(batch, table->ref.bo, stage);
+        return table->ref.gpu;
+}
@@ -32,22 +32,27 @@
 #include "pan_bo.h"
 #include "pan_context.h"
 #include "util/hash_table.h"
+#include "util/libsync.h"
 #include "util/ralloc.h"
 #include "util/format/u_format.h"
 #include "util/u_pack_color.h"
 #include "util/rounding.h"
 #include "util/u_framebuffer.h"
 #include "pan_util.h"
+#include "pan_tracepoints.h"
 #include "decode.h"
 
 #define foreach_batch(ctx, idx) \
-        BITSET_FOREACH_SET(idx, ctx->batches.active, PAN_MAX_BATCHES)
+        BITSET_FOREACH_SET(idx, ctx->batches.active, ctx->batches.count)
 
-static unsigned
-panfrost_batch_idx(struct panfrost_batch *batch)
-{
-        return batch - batch->ctx->batches.slots;
-}
+/* Bounds of the size of batch pool BOs, and how many BOs of submitted
+ * batches are kept for reuse */
+#define PAN_BATCH_POOL_MIN_SIZE (16 * 1024)
+#define PAN_BATCH_POOL_MAX_SIZE (2 * 1024 * 1024)
+#define PAN_SLAB_CACHE_SIZE 16
+
+static struct panfrost_bo *
+panfrost_slab_cache_get(struct panfrost_context *ctx, size_t size);
 
 /* Adds the BO backing surface to a batch if the surface is non-null */
 
@@ -82,23 +87,51 @@ panfrost_batch_init(struct panfrost_context *ctx,
         batch->resources =_mesa_set_create(NULL, _mesa_hash_pointer,
                                           _mesa_key_pointer_equal);
 
-        for (unsigned i = 0; i < PAN_USAGE_COUNT; ++i)
-                util_dynarray_init(&batch->resource_bos[i], NULL);
-
         util_dynarray_init(&batch->vert_deps, NULL);
         util_dynarray_init(&batch->frag_deps, NULL);
+        util_dynarray_init(&batch->deps, NULL);
 
         util_dynarray_init(&batch->dmabufs, NULL);
+        util_dynarray_init(&batch->timestamps, NULL);
+
+        batch->in_sync_fd = -1;
 
         /* Preallocate the main pool, since every batch has at least one job
          * structure so it will be used */
-        panfrost_pool_init(&batch->pool, NULL, dev, 0, 65536, "Batch pool", true, true);
+        unsigned pool_flags = 0;
+
+        /* Cleaning the whole BO would touch the guard pages of overflow
+         * checking */
+        if (dev->cached_pools && !(dev->debug & PAN_DBG_OVERFLOW))
+                pool_flags |= PAN_BO_CACHEABLE;
+
+        /* Size the first BO for what batches allocated recently, with some
+         * headroom, growing from there if the batch needs more */
+        uint64_t avg = ctx->slab_cache.avg_allocated;
+        size_t slab_size = CLAMP(util_next_power_of_two64(avg + avg / 4),
+                                 PAN_BATCH_POOL_MIN_SIZE,
+                                 PAN_BATCH_POOL_MAX_SIZE);
+
+        /* Guard pages are set up for every allocation when checking for
+         * overflows, so don't recycle those BOs */
+        struct panfrost_bo *slab = NULL;
+
+        if (dev->arch >= 10 && !(dev->debug & PAN_DBG_OVERFLOW))
+                slab = panfrost_slab_cache_get(ctx, slab_size);
+
+        panfrost_pool_init(&batch->pool, NULL, dev, pool_flags, slab_size,
+                           "Batch pool", !slab, true);
+        batch->pool.max_slab_size = PAN_BATCH_POOL_MAX_SIZE;
+
+        if (slab)
+                panfrost_pool_adopt(&batch->pool, slab);
 
         /* Don't preallocate the invisible pool, since not every batch will use
          * the pre-allocation, particularly if the varyings are larger than the
          * preallocation and a reallocation is needed after anyway. */
         panfrost_pool_init(&batch->invisible_pool, NULL, dev,
                         PAN_BO_INVISIBLE, 65536, "Varyings", false, true);
+        batch->invisible_pool.max_slab_size = PAN_BATCH_POOL_MAX_SIZE;
 
         for (unsigned i = 0; i < batch->key.nr_cbufs; ++i)
                 panfrost_batch_add_surface(batch, batch->key.cbufs[i]);
@@ -109,59 +142,162 @@ panfrost_batch_init(struct panfrost_context *ctx,
                 batch->needs_sync = true;
 
         screen->vtbl.init_batch(batch);
+
+        u_trace_init(&batch->trace, &ctx->utrace);
+        trace_start_batch(&batch->trace, batch, batch->seqnum,
+                          batch->key.width, batch->key.height,
+                          batch->key.nr_cbufs);
 }
 
 /*
  * Safe helpers for manipulating batch->resources follow. In addition to
  * wrapping the underlying set operations, these update the required
  * bookkeeping for resource tracking and reference counting.
+ *
+ * Which batches of a context use a resource, and which one writes it, is
+ * kept in a tracking slot of the resource, so the checks done for every
+ * bound resource on every draw don't hash. Resources used by more contexts
+ * at once than there are slots fall back to batch->resources and
+ * ctx->writers. A context only claims a slot while no context is using the
+ * fallback for the resource, so each context uses one or the other.
  */
+
+static struct panfrost_resource_track *
+panfrost_resource_get_track(struct panfrost_context *ctx,
+                            struct panfrost_resource *rsrc, bool claim)
+{
+        for (unsigned i = 0; i < PAN_RESOURCE_TRACK_SLOTS; ++i) {
+                if (p_atomic_read(&rsrc->track.ctx[i].gen) == ctx->track_gen)
+                        return &rsrc->track.ctx[i];
+        }
+
+        if (!claim || p_atomic_read(&rsrc->track.nr_spilled))
+                return NULL;
+
+        for (unsigned i = 0; i < PAN_RESOURCE_TRACK_SLOTS; ++i) {
+                struct panfrost_resource_track *t = &rsrc->track.ctx[i];
+
+                if (p_atomic_cmpxchg(&t->gen, 0, ctx->track_gen) == 0) {
+                        t->nr_users = 0;
+                        BITSET_ZERO(t->users);
+                        t->writer = NULL;
+                        return t;
+                }
+        }
+
+        return NULL;
+}
+
 static bool
 panfrost_batch_uses_resource(struct panfrost_batch *batch,
                              struct panfrost_resource *rsrc)
 {
+        struct panfrost_resource_track *t =
+                panfrost_resource_get_track(batch->ctx, rsrc, false);
+
+        if (t)
+                return BITSET_TEST(t->users, batch->idx);
+
+        if (!p_atomic_read(&rsrc->track.nr_spilled))
+                return false;
+
         return _mesa_set_search(batch->resources, rsrc) != NULL;
 }
 
+struct panfrost_batch *
+panfrost_resource_writer(struct panfrost_context *ctx,
+                         struct panfrost_resource *rsrc)
+{
+        struct panfrost_resource_track *t =
+                panfrost_resource_get_track(ctx, rsrc, false);
+
+        if (t)
+                return t->writer;
+
+        if (!p_atomic_read(&rsrc->track.nr_spilled))
+                return NULL;
+
+        struct hash_entry *entry = _mesa_hash_table_search(ctx->writers, rsrc);
+        return entry ? entry->data : NULL;
+}
+
+static void
+panfrost_resource_set_writer(struct panfrost_context *ctx,
+                             struct panfrost_resource *rsrc,
+                             struct panfrost_batch *batch)
+{
+        struct panfrost_resource_track *t =
+                panfrost_resource_get_track(ctx, rsrc, false);
+
+        if (t)
+                t->writer = batch;
+        else
+                _mesa_hash_table_insert(ctx->writers, rsrc, batch);
+}
+
 static void
 panfrost_batch_add_resource(struct panfrost_batch *batch,
                             struct panfrost_resource *rsrc)
 {
-        struct panfrost_context *ctx = batch->ctx;
-        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct panfrost_resource_track *t =
+                panfrost_resource_get_track(batch->ctx, rsrc, true);
+
+        /* Nothing to do if we already have the resource */
+        if (t && BITSET_TEST(t->users, batch->idx))
+                return;
 
         bool found = false;
         _mesa_set_search_or_add(batch->resources, rsrc, &found);
 
-        /* Nothing to do if we already have the resource */
         if (found)
                 return;
 
+        if (t) {
+                BITSET_SET(t->users, batch->idx);
+                t->nr_users++;
+        } else {
+                p_atomic_inc(&rsrc->track.nr_spilled);
+        }
+
         /* Cache number of batches accessing a resource */
         rsrc->track.nr_users++;
 
         /* Reference the resource on the batch */
         pipe_reference(NULL, &rsrc->base.reference);
-
-        if (rsrc->scanout) {
-                if (dev->has_dmabuf_fence) {
-                        int fd = rsrc->image.data.bo->dmabuf_fd;
-                        util_dynarray_append(&batch->dmabufs, int, fd);
-                } else {
-                        perf_debug_ctx(ctx, "Forcing sync on batch");
-                        batch->needs_sync = true;
-                }
-        }
 }
 
 static void
 panfrost_batch_remove_resource_internal(struct panfrost_context *ctx,
+                                        struct panfrost_batch *batch,
                                         struct panfrost_resource *rsrc)
 {
-        struct hash_entry *writer = _mesa_hash_table_search(ctx->writers, rsrc);
-        if (writer) {
-                _mesa_hash_table_remove(ctx->writers, writer);
-                rsrc->track.nr_writers--;
+        struct panfrost_resource_track *t =
+                panfrost_resource_get_track(ctx, rsrc, false);
+
+        if (t) {
+                /* A later batch may have taken over as the writer */
+                if (t->writer == batch) {
+                        t->writer = NULL;
+                        rsrc->track.nr_writers--;
+                }
+
+                BITSET_CLEAR(t->users, batch->idx);
+
+                /* Free the slot once the context is done with the resource */
+                if (!--t->nr_users) {
+                        assert(!t->writer);
+                        p_atomic_set(&t->gen, 0);
+                }
+        } else {
+                struct hash_entry *writer =
+                        _mesa_hash_table_search(ctx->writers, rsrc);
+
+                if (writer && writer->data == batch) {
+                        _mesa_hash_table_remove(ctx->writers, writer);
+                        rsrc->track.nr_writers--;
+                }
+
+                p_atomic_dec(&rsrc->track.nr_spilled);
         }
 
         rsrc->track.nr_users--;
@@ -176,7 +312,7 @@ panfrost_batch_remove_resource_if_present(struct panfrost_context *ctx,
         struct set_entry *ent = _mesa_set_search(batch->resources, rsrc);
 
         if (ent != NULL) {
-                panfrost_batch_remove_resource_internal(ctx, rsrc);
+                panfrost_batch_remove_resource_internal(ctx, batch, rsrc);
                 _mesa_set_remove(batch->resources, ent);
         }
 }
@@ -188,28 +324,22 @@ panfrost_batch_destroy_resources(struct panfrost_context *ctx,
         set_foreach(batch->resources, entry) {
                 struct panfrost_resource *rsrc = (void *) entry->key;
 
-                panfrost_batch_remove_resource_internal(ctx, rsrc);
+                panfrost_batch_remove_resource_internal(ctx, batch, rsrc);
         }
 
         _mesa_set_destroy(batch->resources, NULL);
 }
 
+/* Releases the memory and BO references owned by a batch. Batches handed to
+ * the submit queue are released there, once their BO usage is recorded. */
+
 static void
-panfrost_batch_cleanup(struct panfrost_context *ctx, struct panfrost_batch *batch)
+panfrost_batch_release(struct panfrost_device *dev, struct panfrost_batch *batch)
 {
-        struct panfrost_device *dev = pan_device(ctx->base.screen);
-
         /* Make sure we keep handling events, to free old BOs */
         if (dev->kbase)
                 kbase_ensure_handle_events(&dev->mali);
 
-        assert(batch->seqnum);
-
-        if (ctx->batch == batch)
-                ctx->batch = NULL;
-
-        unsigned batch_idx = panfrost_batch_idx(batch);
-
         pan_bo_access *flags = util_dynarray_begin(&batch->bos);
         unsigned end_bo = util_dynarray_num_elements(&batch->bos, pan_bo_access);
 
@@ -222,1010 +352,2964 @@ panfrost_batch_cleanup(struct panfrost_context *ctx, struct panfrost_batch *batc
         }
 
         util_dynarray_fini(&batch->dmabufs);
+        util_dynarray_fini(&batch->timestamps);
 
         util_dynarray_fini(&batch->vert_deps);
         util_dynarray_fini(&batch->frag_deps);
 
-        for (unsigned i = 0; i < PAN_USAGE_COUNT; ++i)
-                util_dynarray_fini(&batch->resource_bos[i]);
+        free(batch->resource_bos.entries);
 
-        panfrost_batch_destroy_resources(ctx, batch);
         panfrost_pool_cleanup(&batch->pool);
         panfrost_pool_cleanup(&batch->invisible_pool);
 
-        util_unreference_framebuffer_state(&batch->key);
-
         util_dynarray_fini(&batch->bos);
 
-        memset(batch, 0, sizeof(*batch));
-        BITSET_CLEAR(ctx->batches.active, batch_idx);
+        if (batch->in_sync_fd >= 0)
+                close(batch->in_sync_fd);
 }
 
-static void
-panfrost_batch_submit(struct panfrost_context *ctx,
-                      struct panfrost_batch *batch);
+/* Whether the job of a CSF queue with the given seqnum has completed, where
+ * zero is always done */
+static bool
+panfrost_cs_done(struct panfrost_context *ctx, struct panfrost_cs *cs,
+                 uint64_t seqnum)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
 
-static struct panfrost_batch *
-panfrost_get_batch(struct panfrost_context *ctx,
-                   const struct pipe_framebuffer_state *key)
+        /* The CS writes its seqnum plus one here once a job is done. It is
+         * read without the queue lock, as the value only ever increases. */
+        uint64_t *event = dev->mali.event_mem.cpu +
+                cs->base.event_mem_offset * PAN_EVENT_SIZE;
+
+        return !seqnum || p_atomic_read(event) > seqnum;
+}
+
+static bool
+panfrost_fragment_done(struct panfrost_context *ctx, uint64_t seqnum)
 {
-        struct panfrost_batch *batch = NULL;
+        return panfrost_cs_done(ctx, &ctx->kbase_cs_fragment, seqnum);
+}
 
-        for (unsigned i = 0; i < PAN_MAX_BATCHES; i++) {
-                if (ctx->batches.slots[i].seqnum &&
-                    util_framebuffer_state_equal(&ctx->batches.slots[i].key, key)) {
-                        /* We found a match, increase the seqnum for the LRU
-                         * eviction logic.
-                         */
-                        ctx->batches.slots[i].seqnum = ++ctx->batches.seqnum;
-                        return &ctx->batches.slots[i];
-                }
+/* Moves descriptors freed from the heap since the last submit to the retired
+ * list, and returns retired ones to the free lists once the GPU is done with
+ * them. Called as a batch is submitted, after its queue points are known.
+ *
+ * Any batch which exists may refer to a freed entry, and batch seqnums are
+ * bumped whenever a batch is reused, so entries are stamped only at a
+ * submit which leaves no other batch pending, as the final flush of every
+ * frame does. */
+
+static void
+panfrost_desc_heap_retire(struct panfrost_context *ctx,
+                          struct panfrost_batch *batch)
+{
+        struct panfrost_desc_heap *heap = &ctx->desc_heap;
+
+        simple_mtx_lock(&heap->lock);
 
-                if (!batch || batch->seqnum > ctx->batches.slots[i].seqnum)
-                        batch = &ctx->batches.slots[i];
+        util_dynarray_foreach(&heap->freed, struct panfrost_desc, desc) {
+                struct panfrost_desc_retired entry = { .desc = *desc };
+
+                util_dynarray_append(&heap->retired,
+                                     struct panfrost_desc_retired, entry);
         }
 
-        assert(batch);
+        util_dynarray_clear(&heap->freed);
+        simple_mtx_unlock(&heap->lock);
 
-        /* The selected slot is used, we need to flush the batch */
-        if (batch->seqnum)
-                panfrost_batch_submit(ctx, batch);
+        if (!heap->retired.size)
+                return;
 
-        panfrost_batch_init(ctx, key, batch);
+        bool others = false;
+        unsigned i;
 
-        unsigned batch_idx = panfrost_batch_idx(batch);
-        BITSET_SET(ctx->batches.active, batch_idx);
+        foreach_batch(ctx, i) {
+                if (ctx->batches.slots[i] != batch)
+                        others = true;
+        }
 
-        return batch;
-}
+        unsigned kept = 0;
+        struct panfrost_desc_retired *entries = heap->retired.data;
+        unsigned count = util_dynarray_num_elements(&heap->retired,
+                                                    struct panfrost_desc_retired);
 
-/* Get the job corresponding to the FBO we're currently rendering into */
+        for (unsigned j = 0; j < count; ++j) {
+                struct panfrost_desc_retired *entry = &entries[j];
 
-struct panfrost_batch *
-panfrost_get_batch_for_fbo(struct panfrost_context *ctx)
-{
-        /* If we already began rendering, use that */
+                if (!entry->stamped && !others) {
+                        entry->vertex_seqnum = ctx->submit.vertex_seqnum;
+                        entry->fragment_seqnum = ctx->submit.fragment_seqnum;
+                        entry->compute_seqnum = ctx->submit.compute_seqnum;
+                        entry->stamped = true;
+                }
 
-        if (ctx->batch) {
-                assert(util_framebuffer_state_equal(&ctx->batch->key,
-                                                    &ctx->pipe_framebuffer));
-                return ctx->batch;
-        }
+                if (entry->stamped &&
+                    panfrost_cs_done(ctx, &ctx->kbase_cs_vertex,
+                                     entry->vertex_seqnum) &&
+                    panfrost_fragment_done(ctx, entry->fragment_seqnum) &&
+                    panfrost_cs_done(ctx, &ctx->kbase_cs_compute,
+                                     entry->compute_seqnum)) {
+                        panfrost_desc_heap_recycle(heap, entry);
+                        continue;
+                }
 
-        /* If not, look up the job */
-        struct panfrost_batch *batch = panfrost_get_batch(ctx,
-                                                          &ctx->pipe_framebuffer);
+                entries[kept++] = *entry;
+        }
 
-        /* Set this job as the current FBO job. Will be reset when updating the
-         * FB state and when submitting or releasing a job.
-         */
-        ctx->batch = batch;
-        panfrost_dirty_state_all(ctx);
-        return batch;
+        heap->retired.size = kept * sizeof(struct panfrost_desc_retired);
 }
 
-struct panfrost_batch *
-panfrost_get_fresh_batch_for_fbo(struct panfrost_context *ctx, const char *reason)
+/* Returns an idle BO of at least the given size kept from a submitted batch,
+ * or NULL if there is none. A BO is idle once the batch which used it has
+ * been released and its queue points have passed. */
+
+static struct panfrost_bo *
+panfrost_slab_cache_get(struct panfrost_context *ctx, size_t size)
 {
-        struct panfrost_batch *batch;
+        struct panfrost_slab_cache *cache = &ctx->slab_cache;
 
-        batch = panfrost_get_batch(ctx, &ctx->pipe_framebuffer);
-        panfrost_dirty_state_all(ctx);
+        util_dynarray_foreach(&cache->slabs, struct panfrost_slab, slab) {
+                if (slab->bo->size < size ||
+                    p_atomic_read(&slab->bo->refcnt) != 1)
+                        continue;
 
-        /* We only need to submit and get a fresh batch if there is no
-         * draw/clear queued. Otherwise we may reuse the batch. */
+                if (!panfrost_cs_done(ctx, &ctx->kbase_cs_vertex,
+                                      slab->vertex_seqnum) ||
+                    !panfrost_cs_done(ctx, &ctx->kbase_cs_fragment,
+                                      slab->fragment_seqnum) ||
+                    !panfrost_cs_done(ctx, &ctx->kbase_cs_compute,
+                                      slab->compute_seqnum))
+                        continue;
 
-        if (batch->scoreboard.first_job) {
-                perf_debug_ctx(ctx, "Flushing the current FBO due to: %s", reason);
-                panfrost_batch_submit(ctx, batch);
-                batch = panfrost_get_batch(ctx, &ctx->pipe_framebuffer);
+                struct panfrost_bo *bo = slab->bo;
+                unsigned idx = slab - (struct panfrost_slab *)cache->slabs.data;
+                unsigned count = util_dynarray_num_elements(&cache->slabs,
+                                                            struct panfrost_slab);
+
+                memmove(slab, slab + 1,
+                        (count - idx - 1) * sizeof(struct panfrost_slab));
+                cache->slabs.size -= sizeof(struct panfrost_slab);
+
+                return bo;
         }
 
-        ctx->batch = batch;
-        return batch;
+        return NULL;
 }
 
+/* Keeps the pool BOs of a batch being submitted for later batches, dropping
+ * the oldest ones beyond PAN_SLAB_CACHE_SIZE. Called once the queue points
+ * of the batch are known. Oversized BOs of single large allocations are left
+ * to the BO cache. */
+
 static void
-panfrost_batch_update_access(struct panfrost_batch *batch,
-                             struct panfrost_resource *rsrc, bool writes)
+panfrost_slab_cache_put(struct panfrost_context *ctx,
+                        struct panfrost_batch *batch)
 {
-        struct panfrost_context *ctx = batch->ctx;
-        uint32_t batch_idx = panfrost_batch_idx(batch);
-        struct hash_entry *entry = _mesa_hash_table_search(ctx->writers, rsrc);
-        struct panfrost_batch *writer = entry ? entry->data : NULL;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct panfrost_slab_cache *cache = &ctx->slab_cache;
 
-        panfrost_batch_add_resource(batch, rsrc);
+        if (dev->debug & PAN_DBG_OVERFLOW)
+                return;
 
-        /* Flush users if required */
-        if (writes || ((writer != NULL) && (writer != batch))) {
-                unsigned i;
-                foreach_batch(ctx, i) {
-                        struct panfrost_batch *batch = &ctx->batches.slots[i];
+        util_dynarray_foreach(&batch->pool.bos, struct panfrost_bo *, bo) {
+                if ((*bo)->size > PAN_BATCH_POOL_MAX_SIZE)
+                        continue;
 
-                        /* Skip the entry if this our batch. */
-                        if (i == batch_idx)
-                                continue;
+                if (util_dynarray_num_elements(&cache->slabs,
+                                               struct panfrost_slab) ==
+                    PAN_SLAB_CACHE_SIZE) {
+                        struct panfrost_slab *oldest = cache->slabs.data;
 
-                        /* Submit if it's a user */
-                        if (panfrost_batch_uses_resource(batch, rsrc))
-                                panfrost_batch_submit(ctx, batch);
+                        panfrost_bo_unreference(oldest->bo);
+                        memmove(oldest, oldest + 1,
+                                (PAN_SLAB_CACHE_SIZE - 1) *
+                                sizeof(struct panfrost_slab));
+                        cache->slabs.size -= sizeof(struct panfrost_slab);
                 }
-        }
 
-        if (writes && (writer != batch)) {
-                _mesa_hash_table_insert(ctx->writers, rsrc, batch);
-                rsrc->track.nr_writers++;
+                panfrost_bo_reference(*bo);
+
+                struct panfrost_slab slab = {
+                        .bo = *bo,
+                        .vertex_seqnum = batch->vertex_seqnum,
+                        .fragment_seqnum = batch->fragment_seqnum,
+                        .compute_seqnum = batch->compute_seqnum,
+                };
+
+                util_dynarray_append(&cache->slabs, struct panfrost_slab, slab);
         }
 }
 
-static pan_bo_access *
-panfrost_batch_get_bo_access(struct panfrost_batch *batch, unsigned handle)
+void
+panfrost_slab_cache_cleanup(struct panfrost_slab_cache *cache)
 {
-        unsigned size = util_dynarray_num_elements(&batch->bos, pan_bo_access);
+        util_dynarray_foreach(&cache->slabs, struct panfrost_slab, slab)
+                panfrost_bo_unreference(slab->bo);
 
-        if (handle >= size) {
-                unsigned grow = handle + 1 - size;
+        util_dynarray_fini(&cache->slabs);
+}
 
-                memset(util_dynarray_grow(&batch->bos, pan_bo_access, grow),
-                       0, grow * sizeof(pan_bo_access));
+struct panfrost_tiler_scratch *
+panfrost_batch_get_tiler_scratch(struct panfrost_batch *batch)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        if (batch->tiler_scratch)
+                return util_dynarray_element(&ctx->tiler_scratch,
+                                             struct panfrost_tiler_scratch,
+                                             batch->tiler_scratch - 1);
+
+        struct panfrost_tiler_scratch *scratch = NULL;
+
+        util_dynarray_foreach(&ctx->tiler_scratch,
+                              struct panfrost_tiler_scratch, s) {
+                if (s->seqnum == UINT64_MAX || !panfrost_fragment_done(ctx, s->seqnum))
+                        continue;
+
+                scratch = s;
+                break;
         }
 
-        return util_dynarray_element(&batch->bos, pan_bo_access, handle);
+        if (!scratch) {
+                scratch = util_dynarray_grow(&ctx->tiler_scratch,
+                                             struct panfrost_tiler_scratch, 1);
+                *scratch = (struct panfrost_tiler_scratch) { 0 };
+        }
+
+        /* Replace scratch which is smaller than what recent batches
+         * needed */
+        if (scratch->bo && scratch->bits < ctx->tiler_scratch_bits) {
+                panfrost_bo_unreference(scratch->bo);
+                scratch->bo = NULL;
+        }
+
+        if (!scratch->bo) {
+                scratch->bits = ctx->tiler_scratch_bits;
+                scratch->bo = panfrost_bo_create(dev, 1 << scratch->bits, 0,
+                                                 "Tiler scratch");
+                panfrost_bo_set_category(scratch->bo, PAN_MEM_HEAP);
+        }
+
+        scratch->seqnum = UINT64_MAX;
+
+        batch->tiler_scratch = 1 +
+                (scratch - (struct panfrost_tiler_scratch *)
+                 util_dynarray_begin(&ctx->tiler_scratch));
+
+        return scratch;
 }
 
 static void
-panfrost_batch_add_bo_old(struct panfrost_batch *batch,
-                struct panfrost_bo *bo, uint32_t flags)
+panfrost_batch_put_tiler_scratch(struct panfrost_context *ctx,
+                                 struct panfrost_batch *batch)
 {
-        if (!bo)
+        if (!batch->tiler_scratch)
                 return;
 
-        pan_bo_access *entry =
-                panfrost_batch_get_bo_access(batch, bo->gem_handle);
-        pan_bo_access old_flags = *entry;
+        struct panfrost_tiler_scratch *scratch =
+                util_dynarray_element(&ctx->tiler_scratch,
+                                      struct panfrost_tiler_scratch,
+                                      batch->tiler_scratch - 1);
 
-        if (!old_flags) {
-                batch->num_bos++;
-                panfrost_bo_reference(bo);
-        }
+        /* The fragment job waits for the vertex job, so the scratch is
+         * free once it completes. Batches which were never submitted have
+         * no fragment seqnum, and release the scratch right away. */
+        scratch->seqnum = batch->fragment_seqnum;
 
-        if (old_flags == flags)
-                return;
+        /* Grow the scratch for later batches if this one overflowed it */
+        if (batch->tiler_scratch_traffic > (1ull << scratch->bits)) {
+                unsigned bits = util_logbase2_ceil64(batch->tiler_scratch_traffic);
 
-        flags |= old_flags;
-        *entry = flags;
+                ctx->tiler_scratch_bits =
+                        CLAMP(bits, ctx->tiler_scratch_bits,
+                              PAN_TILER_SCRATCH_MAX_BITS);
+        }
 }
 
-static uint32_t
-panfrost_access_for_stage(enum pipe_shader_type stage)
+/* Update the heap statistics from the last use of an idle tiler heap, and
+ * resize the heap if it was too small or mostly unused, or if the kernel ran
+ * out of memory growing it */
+static void
+panfrost_tiler_heap_update(struct panfrost_context *ctx, unsigned idx)
 {
-        return (stage == PIPE_SHADER_FRAGMENT) ?
-                PAN_BO_ACCESS_FRAGMENT : PAN_BO_ACCESS_VERTEX_TILER;
-}
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct kbase_context *kctx = ctx->kbase_ctx;
 
-void
-panfrost_batch_add_bo(struct panfrost_batch *batch,
-                struct panfrost_bo *bo, enum pipe_shader_type stage)
-{
-        panfrost_batch_add_bo_old(batch, bo, PAN_BO_ACCESS_READ |
-                        panfrost_access_for_stage(stage));
-}
+        if (idx >= kctx->num_tiler_heaps || !ctx->tiler_heap_stats)
+                return;
 
-void
-panfrost_batch_read_rsrc(struct panfrost_batch *batch,
-                         struct panfrost_resource *rsrc,
-                         enum pipe_shader_type stage)
-{
-        uint32_t access = PAN_BO_ACCESS_READ |
-                panfrost_access_for_stage(stage);
+        uint64_t *stats = ctx->tiler_heap_stats->ptr.cpu + idx * 16;
+        uint64_t start = stats[0], end = stats[1];
+        bool oom = ctx->tiler_heap_state[idx].oom;
 
-        enum panfrost_usage_type type = (stage == MESA_SHADER_FRAGMENT) ?
-                PAN_USAGE_READ_FRAGMENT : PAN_USAGE_READ_VERTEX;
+        /* Nothing was recorded since the last update */
+        if (end <= start && !oom)
+                return;
 
-        util_dynarray_append(&batch->resource_bos[type], struct panfrost_bo *,
-                             rsrc->image.data.bo);
+        stats[0] = stats[1] = 0;
+        ctx->tiler_heap_state[idx].oom = false;
 
-        panfrost_batch_add_bo_old(batch, rsrc->image.data.bo, access);
+        struct kbase_tiler_heap *heap = &kctx->tiler_heaps[idx];
+        uint64_t chunk = kctx->tiler_heap_chunk_size;
 
-        if (rsrc->separate_stencil)
-                panfrost_batch_add_bo_old(batch, rsrc->separate_stencil->image.data.bo, access);
+        /* Chunks are not necessarily contiguous, so this is only an
+         * estimate. Heaps which ran out of memory were entirely used. */
+        uint64_t used = (end > start) ? MIN2(end - start, heap->max_chunks * chunk) : 0;
 
-        panfrost_batch_update_access(batch, rsrc, false);
-}
+        if (oom)
+                used = heap->max_chunks * chunk;
 
-void
-panfrost_batch_write_rsrc(struct panfrost_batch *batch,
-                         struct panfrost_resource *rsrc,
-                         enum pipe_shader_type stage)
-{
-        uint32_t access = PAN_BO_ACCESS_WRITE |
-                panfrost_access_for_stage(stage);
+        ctx->tiler_heap_peak = MAX2(ctx->tiler_heap_peak, used);
 
-        enum panfrost_usage_type type = (stage == MESA_SHADER_FRAGMENT) ?
-                PAN_USAGE_WRITE_FRAGMENT : PAN_USAGE_WRITE_VERTEX;
+        unsigned initial = CLAMP(DIV_ROUND_UP(used, chunk) + 1, 1,
+                                 PAN_TILER_HEAP_MAX_INITIAL_CHUNKS);
+        unsigned max = heap->max_chunks;
 
-        util_dynarray_append(&batch->resource_bos[type], struct panfrost_bo *,
-                             rsrc->image.data.bo);
+        if (used * 4 > max * chunk * 3)
+                max = MIN2(max * 2, PAN_TILER_HEAP_MAX_CHUNKS);
 
-        panfrost_batch_add_bo_old(batch, rsrc->image.data.bo, access);
+        /* Grow straight away to avoid running out of memory in the next
+         * frames, but as recreating the heap isn't free, only shrink it
+         * once it is less than half used */
+        bool grow = initial > heap->initial_chunks || max > heap->max_chunks;
+        bool shrink = initial * 2 < heap->initial_chunks;
 
-        if (rsrc->separate_stencil)
-                panfrost_batch_add_bo_old(batch, rsrc->separate_stencil->image.data.bo, access);
+        if (!grow && !shrink)
+                return;
 
-        panfrost_batch_update_access(batch, rsrc, true);
+        if (grow)
+                initial = MAX2(initial, heap->initial_chunks);
+
+        perf_debug_ctx(ctx, "Resizing tiler heap %u for %"PRIu64" KiB: "
+                       "%u -> %u chunks", idx, used / 1024, initial, max);
+
+        dev->mali.tiler_heap_recreate(&dev->mali, kctx, idx, initial, max);
+
+        /* Even on failure the heap was replaced, so the descriptor has to
+         * be recreated */
+        if (ctx->tiler_heap_desc[idx]) {
+                panfrost_bo_unreference(ctx->tiler_heap_desc[idx]);
+                ctx->tiler_heap_desc[idx] = NULL;
+        }
 }
 
-void
-panfrost_resource_swap_bo(struct panfrost_context *ctx,
-                          struct panfrost_resource *rsrc,
-                          struct panfrost_bo *newbo)
+unsigned
+panfrost_batch_get_tiler_heap(struct panfrost_batch *batch)
 {
-        /* Likewise, any batch reading this resource is reading the old BO, and
-         * after swapping will not be reading this resource.
-         */
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct kbase_context *kctx = ctx->kbase_ctx;
+
+        if (batch->tiler_heap_held)
+                return batch->tiler_heap;
+
+        /* The kernel doesn't say which heap ran out, nor which context of
+         * a shared queue group, so grow them all */
+        uint32_t oom = p_atomic_read(&dev->mali.tiler_oom[kctx->csg_handle]);
+
+        if (oom != ctx->tiler_oom_seen) {
+                ctx->tiler_oom_seen = oom;
+
+                for (unsigned i = 0; i < kctx->num_tiler_heaps; ++i)
+                        ctx->tiler_heap_state[i].oom = true;
+        }
+
+        /* Use the heaps in turn, so that the vertex work of this batch
+         * doesn't have to wait for the fragment work of the last one */
+        unsigned idx = ctx->next_tiler_heap;
+        ctx->next_tiler_heap = (idx + 1) % MAX2(kctx->num_tiler_heaps, 1);
+
+        if (!ctx->tiler_heap_state[idx].users &&
+            panfrost_fragment_done(ctx, ctx->tiler_heap_state[idx].seqnum))
+                panfrost_tiler_heap_update(ctx, idx);
+
+        ctx->tiler_heap_state[idx].users++;
+
+        batch->tiler_heap = idx;
+        batch->tiler_heap_held = true;
+        return idx;
+}
+
+static void
+panfrost_batch_cleanup(struct panfrost_context *ctx, struct panfrost_batch *batch,
+                       bool release)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        assert(batch->seqnum);
+
+        if (ctx->batch == batch)
+                ctx->batch = NULL;
+
+        unsigned batch_idx = batch->idx;
+
+        if (release)
+                panfrost_batch_release(dev, batch);
+
+        panfrost_batch_destroy_resources(ctx, batch);
+        panfrost_batch_put_tiler_scratch(ctx, batch);
+
+        if (batch->tiler_heap_held)
+                ctx->tiler_heap_state[batch->tiler_heap].users--;
+
+        util_unreference_framebuffer_state(&batch->key);
+        free(batch->tile_mask.data);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(batch->resolve_surfs); ++i)
+                pipe_surface_reference(&batch->resolve_surfs[i], NULL);
+
+        for (unsigned i = 0; i < ARRAY_SIZE(batch->uploads); ++i)
+                free(batch->uploads[i]);
+
+        /* Flushed tracepoints belong to the context now, this only drops
+         * those of batches which were never submitted. The copy handed to
+         * the submit queue does not own them. */
+        u_trace_fini(&batch->trace);
+
+        /* Dependencies are submitted first, so only dropped batches have any
+         * left */
+        util_dynarray_fini(&batch->deps);
+
+        memset(batch, 0, sizeof(*batch));
+        batch->idx = batch_idx;
+        BITSET_CLEAR(ctx->batches.active, batch_idx);
+
         unsigned i;
         foreach_batch(ctx, i) {
-                struct panfrost_batch *batch = &ctx->batches.slots[i];
+                struct util_dynarray *deps = &ctx->batches.slots[i]->deps;
 
-                panfrost_batch_remove_resource_if_present(ctx, batch, rsrc);
+                util_dynarray_delete_unordered(deps, struct panfrost_batch *,
+                                               batch);
         }
+}
 
-        /* Swap the pointers, dropping a reference to the old BO which is no
-         * long referenced from the resource
-         */
-        panfrost_bo_unreference(rsrc->image.data.bo);
-        rsrc->image.data.bo = newbo;
+static bool
+panfrost_batch_submit(struct panfrost_context *ctx,
+                      struct panfrost_batch *batch, const char *reason);
+
+static void
+panfrost_batch_update_hierarchy_mask(struct panfrost_batch *batch);
+
+/* Doubles the number of batch slots, returning the first new one. The
+ * batches are allocated one by one so that they don't move. */
+
+static struct panfrost_batch *
+panfrost_grow_batches(struct panfrost_context *ctx)
+{
+        unsigned old_count = ctx->batches.count;
+        unsigned count = MAX2(old_count * 2, PAN_MIN_BATCHES);
+
+        ctx->batches.slots = reralloc(ctx, ctx->batches.slots,
+                                      struct panfrost_batch *, count);
+        ctx->batches.active = rerzalloc(ctx, ctx->batches.active, BITSET_WORD,
+                                        BITSET_WORDS(old_count),
+                                        BITSET_WORDS(count));
+
+        for (unsigned i = old_count; i < count; ++i) {
+                ctx->batches.slots[i] = rzalloc(ctx, struct panfrost_batch);
+                ctx->batches.slots[i]->idx = i;
+        }
+
+        ctx->batches.count = count;
+        return ctx->batches.slots[old_count];
 }
 
-struct panfrost_bo *
-panfrost_batch_create_bo(struct panfrost_batch *batch, size_t size,
-                         uint32_t create_flags, enum pipe_shader_type stage,
-                         const char *label)
+static struct panfrost_batch *
+panfrost_get_batch(struct panfrost_context *ctx,
+                   const struct pipe_framebuffer_state *key)
 {
-        struct panfrost_bo *bo;
+        struct panfrost_batch *batch = NULL;
 
-        bo = panfrost_bo_create(pan_device(batch->ctx->base.screen), size,
-                                create_flags, label);
-        panfrost_batch_add_bo(batch, bo, stage);
+        for (unsigned i = 0; i < ctx->batches.count; i++) {
+                struct panfrost_batch *slot = ctx->batches.slots[i];
 
-        /* panfrost_batch_add_bo() has retained a reference and
-         * panfrost_bo_create() initialize the refcnt to 1, so let's
-         * unreference the BO here so it gets released when the batch is
-         * destroyed (unless it's retained by someone else in the meantime).
+                if (slot->seqnum && !slot->closed &&
+                    util_framebuffer_state_equal(&slot->key, key)) {
+                        /* We found a match, increase the seqnum for the LRU
+                         * eviction logic.
+                         */
+                        slot->seqnum = ++ctx->batches.seqnum;
+                        return slot;
+                }
+
+                if (!batch || batch->seqnum > slot->seqnum)
+                        batch = slot;
+        }
+
+        /* Make room rather than flushing while the table may grow */
+        if ((!batch || batch->seqnum) && ctx->batches.count < PAN_MAX_BATCHES)
+                batch = panfrost_grow_batches(ctx);
+
+        /* The selected slot is used, we need to flush the batch */
+        if (batch->seqnum &&
+            panfrost_batch_submit(ctx, batch, "Out of batch slots"))
+                ctx->stats.slot_flushes++;
+
+        panfrost_batch_init(ctx, key, batch);
+        BITSET_SET(ctx->batches.active, batch->idx);
+
+        return batch;
+}
+
+/* Get the job corresponding to the FBO we're currently rendering into */
+
+struct panfrost_batch *
+panfrost_get_batch_for_fbo(struct panfrost_context *ctx)
+{
+        /* If we already began rendering, use that */
+
+        if (ctx->batch) {
+                assert(util_framebuffer_state_equal(&ctx->batch->key,
+                                                    &ctx->pipe_framebuffer));
+                return ctx->batch;
+        }
+
+        /* If not, look up the job */
+        struct panfrost_batch *batch = panfrost_get_batch(ctx,
+                                                          &ctx->pipe_framebuffer);
+
+        /* Set this job as the current FBO job. Will be reset when updating the
+         * FB state and when submitting or releasing a job.
          */
-        panfrost_bo_unreference(bo);
-        return bo;
+        ctx->batch = batch;
+        panfrost_dirty_state_all(ctx);
+        return batch;
 }
 
-struct panfrost_bo *
-panfrost_batch_get_scratchpad(struct panfrost_batch *batch,
-                unsigned size_per_thread,
-                unsigned thread_tls_alloc,
-                unsigned core_id_range)
+struct panfrost_batch *
+panfrost_get_fresh_batch_for_fbo(struct panfrost_context *ctx, const char *reason)
 {
-        unsigned size = panfrost_get_total_stack_size(size_per_thread,
-                        thread_tls_alloc,
-                        core_id_range);
+        struct panfrost_batch *batch;
 
-        if (batch->scratchpad) {
-                assert(batch->scratchpad->size >= size);
-        } else {
-                batch->scratchpad = panfrost_batch_create_bo(batch, size,
-                                             PAN_BO_INVISIBLE,
-                                             PIPE_SHADER_VERTEX,
-                                             "Thread local storage");
+        batch = panfrost_get_batch(ctx, &ctx->pipe_framebuffer);
+        panfrost_dirty_state_all(ctx);
 
-                panfrost_batch_add_bo(batch, batch->scratchpad,
-                                PIPE_SHADER_FRAGMENT);
+        /* We only need to submit and get a fresh batch if there is no
+         * draw/clear queued. Otherwise we may reuse the batch. */
+
+        if (batch->scoreboard.first_job) {
+                perf_debug_ctx(ctx, "Flushing the current FBO due to: %s", reason);
+                if (panfrost_batch_submit(ctx, batch, reason))
+                        ctx->stats.split_flushes++;
+                batch = panfrost_get_batch(ctx, &ctx->pipe_framebuffer);
         }
 
-        return batch->scratchpad;
+        ctx->batch = batch;
+        return batch;
 }
 
-struct panfrost_bo *
-panfrost_batch_get_shared_memory(struct panfrost_batch *batch,
-                unsigned size,
-                unsigned workgroup_count)
+/* Whether dep has to be submitted before batch, directly or not */
+
+static bool
+panfrost_batch_depends_on(struct panfrost_batch *batch,
+                          struct panfrost_batch *dep)
 {
-        if (batch->shared_memory) {
-                assert(batch->shared_memory->size >= size);
-        } else {
-                batch->shared_memory = panfrost_batch_create_bo(batch, size,
-                                             PAN_BO_INVISIBLE,
-                                             PIPE_SHADER_VERTEX,
-                                             "Workgroup shared memory");
+        util_dynarray_foreach(&batch->deps, struct panfrost_batch *, b) {
+                if (*b == dep || panfrost_batch_depends_on(*b, dep))
+                        return true;
         }
 
-        return batch->shared_memory;
+        return false;
+}
+
+static bool
+panfrost_batch_has_dep(struct panfrost_batch *batch,
+                       struct panfrost_batch *dep)
+{
+        util_dynarray_foreach(&batch->deps, struct panfrost_batch *, b) {
+                if (*b == dep)
+                        return true;
+        }
+
+        return false;
 }
 
+/* Orders batch after dep. Both stay queued: submitting batch submits dep
+ * first, and the BO dependencies of the CSF queues order them on the GPU.
+ * dep is closed, so it never records work which would have to come after
+ * batch. Batches only take dependencies while recording, so none can depend
+ * on batch yet and there is no cycle. */
+
 static void
-panfrost_batch_to_fb_info(struct panfrost_batch *batch,
-                          struct pan_fb_info *fb,
-                          struct pan_image_view *rts,
-                          struct pan_image_view *zs,
-                          struct pan_image_view *s,
-                          bool reserve)
+panfrost_batch_add_dep(struct panfrost_batch *batch,
+                       struct panfrost_batch *dep)
 {
-        memset(fb, 0, sizeof(*fb));
-        memset(rts, 0, sizeof(*rts) * 8);
-        memset(zs, 0, sizeof(*zs));
-        memset(s, 0, sizeof(*s));
+        struct panfrost_context *ctx = batch->ctx;
 
-        fb->width = batch->key.width;
-        fb->height = batch->key.height;
-        fb->extent.minx = batch->minx;
-        fb->extent.miny = batch->miny;
-        fb->extent.maxx = batch->maxx - 1;
-        fb->extent.maxy = batch->maxy - 1;
-        fb->nr_samples = util_framebuffer_get_num_samples(&batch->key);
-        fb->rt_count = batch->key.nr_cbufs;
-        fb->sprite_coord_origin = pan_tristate_get(batch->sprite_coord_origin);
-        fb->first_provoking_vertex = pan_tristate_get(batch->first_provoking_vertex);
-        fb->cs_fragment = &batch->cs_fragment;
+        if (panfrost_batch_has_dep(batch, dep))
+                return;
+
+        assert(!panfrost_batch_depends_on(dep, batch));
+
+        util_dynarray_append(&batch->deps, struct panfrost_batch *, dep);
+        dep->closed = true;
+
+        if (ctx->batch == dep)
+                ctx->batch = NULL;
+}
+
+static bool
+panfrost_batch_has_dependents(struct panfrost_batch *batch)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        unsigned i;
+
+        foreach_batch(ctx, i) {
+                if (panfrost_batch_has_dep(ctx->batches.slots[i], batch))
+                        return true;
+        }
+
+        return false;
+}
+
+static void
+panfrost_batch_update_access(struct panfrost_batch *batch,
+                             struct panfrost_resource *rsrc, bool writes)
+{
+        struct panfrost_context *ctx = batch->ctx;
+
+        panfrost_batch_add_resource(batch, rsrc);
+
+        struct panfrost_batch *writer = panfrost_resource_writer(ctx, rsrc);
+
+        /* Writes come after every other user, reads after the writer */
+        if (writes) {
+                unsigned i;
+                foreach_batch(ctx, i) {
+                        struct panfrost_batch *other = ctx->batches.slots[i];
+
+                        if (other != batch &&
+                            panfrost_batch_uses_resource(other, rsrc))
+                                panfrost_batch_add_dep(batch, other);
+                }
+        } else if (writer && writer != batch) {
+                panfrost_batch_add_dep(batch, writer);
+        }
+
+        /* The previous writer stays queued, but submitting the new one
+         * submits it too, so only the latest is tracked */
+        if (writes && (writer != batch)) {
+                if (!writer)
+                        rsrc->track.nr_writers++;
+
+                panfrost_resource_set_writer(ctx, rsrc, batch);
+        }
+}
+
+static pan_bo_access *
+panfrost_batch_get_bo_access(struct panfrost_batch *batch, unsigned handle)
+{
+        unsigned size = util_dynarray_num_elements(&batch->bos, pan_bo_access);
+
+        if (handle >= size) {
+                unsigned grow = handle + 1 - size;
+
+                memset(util_dynarray_grow(&batch->bos, pan_bo_access, grow),
+                       0, grow * sizeof(pan_bo_access));
+        }
+
+        return util_dynarray_element(&batch->bos, pan_bo_access, handle);
+}
+
+static void
+panfrost_batch_add_bo_old(struct panfrost_batch *batch,
+                struct panfrost_bo *bo, uint32_t flags)
+{
+        if (!bo)
+                return;
+
+        pan_bo_access *entry =
+                panfrost_batch_get_bo_access(batch, bo->gem_handle);
+        pan_bo_access old_flags = *entry;
+
+        if (!old_flags) {
+                batch->num_bos++;
+                panfrost_bo_reference(bo);
+        }
+
+        if (old_flags == flags)
+                return;
+
+        flags |= old_flags;
+        *entry = flags;
+}
+
+static uint32_t
+panfrost_access_for_stage(enum pipe_shader_type stage)
+{
+        return (stage == PIPE_SHADER_FRAGMENT) ?
+                PAN_BO_ACCESS_FRAGMENT : PAN_BO_ACCESS_VERTEX_TILER;
+}
+
+void
+panfrost_batch_add_bo(struct panfrost_batch *batch,
+                struct panfrost_bo *bo, enum pipe_shader_type stage)
+{
+        panfrost_batch_add_bo_old(batch, bo, PAN_BO_ACCESS_READ |
+                        panfrost_access_for_stage(stage));
+}
+
+/* Record which stages of the batch access a shared resource, so that only
+ * those wait on its implicit fences. With explicit sync, the window system
+ * passes fences around itself and there is nothing to do. */
+
+static void
+panfrost_batch_add_dmabuf(struct panfrost_batch *batch,
+                          struct panfrost_resource *rsrc,
+                          uint32_t access)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        if (!rsrc->scanout || pan_screen(ctx->base.screen)->explicit_sync)
+                return;
+
+        if (!dev->has_dmabuf_fence) {
+                if (!batch->needs_sync) {
+                        perf_debug_ctx(ctx, "Forcing sync on batch");
+                        batch->needs_sync = true;
+                }
+                return;
+        }
+
+        int fd = rsrc->image.data.bo->dmabuf_fd;
+        access &= (PAN_BO_ACCESS_VERTEX_TILER | PAN_BO_ACCESS_FRAGMENT);
+
+        util_dynarray_foreach(&batch->dmabufs, struct panfrost_dmabuf, d) {
+                if (d->fd == fd) {
+                        d->access |= access;
+                        return;
+                }
+        }
+
+        struct panfrost_dmabuf d = {
+                .fd = fd,
+                .access = access,
+        };
+
+        util_dynarray_append(&batch->dmabufs, struct panfrost_dmabuf, d);
+}
+
+static inline unsigned
+panfrost_bo_set_hash(const struct panfrost_bo_set *set, uint32_t handle)
+{
+        /* Handles are small and dense, Fibonacci hashing spreads them */
+        return (handle * 2654435761u) & (set->capacity - 1);
+}
+
+static void
+panfrost_bo_set_insert(struct panfrost_bo_set *set, struct panfrost_bo *bo,
+                       uint32_t usage)
+{
+        unsigned i = panfrost_bo_set_hash(set, bo->gem_handle);
+
+        while (set->entries[i].bo) {
+                if (set->entries[i].bo->gem_handle == bo->gem_handle) {
+                        set->entries[i].usage |= usage;
+                        return;
+                }
+
+                i = (i + 1) & (set->capacity - 1);
+        }
+
+        set->entries[i].bo = bo;
+        set->entries[i].usage = usage;
+        ++set->count;
+}
+
+static void
+panfrost_bo_set_add(struct panfrost_bo_set *set, struct panfrost_bo *bo,
+                    enum panfrost_usage_type type)
+{
+        /* Keep the load factor under 3/4 */
+        if ((set->count + 1) * 4 > set->capacity * 3) {
+                struct panfrost_bo_set old = *set;
+
+                set->capacity = MAX2(old.capacity * 2, 64);
+                set->entries = calloc(set->capacity, sizeof(*set->entries));
+                set->count = 0;
+
+                for (unsigned i = 0; i < old.capacity; ++i) {
+                        if (old.entries[i].bo)
+                                panfrost_bo_set_insert(set, old.entries[i].bo,
+                                                       old.entries[i].usage);
+                }
+
+                free(old.entries);
+        }
+
+        panfrost_bo_set_insert(set, bo, BITFIELD_BIT(type));
+}
+
+void
+panfrost_batch_read_rsrc(struct panfrost_batch *batch,
+                         struct panfrost_resource *rsrc,
+                         enum pipe_shader_type stage)
+{
+        uint32_t access = PAN_BO_ACCESS_READ |
+                panfrost_access_for_stage(stage);
+
+        enum panfrost_usage_type type = (stage == MESA_SHADER_FRAGMENT) ?
+                PAN_USAGE_READ_FRAGMENT : PAN_USAGE_READ_VERTEX;
+
+        panfrost_bo_set_add(&batch->resource_bos, rsrc->image.data.bo, type);
+
+        panfrost_batch_add_bo_old(batch, rsrc->image.data.bo, access);
+
+        if (rsrc->separate_stencil)
+                panfrost_batch_add_bo_old(batch, rsrc->separate_stencil->image.data.bo, access);
+
+        panfrost_batch_update_access(batch, rsrc, false);
+        panfrost_batch_add_dmabuf(batch, rsrc, access);
+}
+
+void
+panfrost_batch_write_rsrc(struct panfrost_batch *batch,
+                         struct panfrost_resource *rsrc,
+                         enum pipe_shader_type stage)
+{
+        uint32_t access = PAN_BO_ACCESS_WRITE |
+                panfrost_access_for_stage(stage);
+
+        enum panfrost_usage_type type = (stage == MESA_SHADER_FRAGMENT) ?
+                PAN_USAGE_WRITE_FRAGMENT : PAN_USAGE_WRITE_VERTEX;
+
+        panfrost_bo_set_add(&batch->resource_bos, rsrc->image.data.bo, type);
+
+        panfrost_batch_add_bo_old(batch, rsrc->image.data.bo, access);
+
+        if (rsrc->separate_stencil)
+                panfrost_batch_add_bo_old(batch, rsrc->separate_stencil->image.data.bo, access);
+
+        panfrost_batch_update_access(batch, rsrc, true);
+        panfrost_batch_add_dmabuf(batch, rsrc, access);
+
+        rsrc->access.samples_since_write = 0;
+
+        /* Whatever the GPU writes, cached index bounds and translated
+         * indices can't be trusted */
+        panfrost_minmax_cache_clear(rsrc->index_cache);
+        panfrost_index_derivatives_clear(rsrc);
+}
+
+/* Timestamps are stored by whichever queue of the batch runs first or last,
+ * so the write is tracked for both */
+void
+panfrost_batch_add_timestamp(struct panfrost_batch *batch,
+                             struct panfrost_resource *rsrc,
+                             unsigned offset, bool end)
+{
+        panfrost_batch_write_rsrc(batch, rsrc, PIPE_SHADER_VERTEX);
+        panfrost_batch_write_rsrc(batch, rsrc, PIPE_SHADER_FRAGMENT);
+
+        struct panfrost_timestamp t = {
+                .bo = rsrc->image.data.bo,
+                .offset = offset,
+                .end = end,
+        };
+
+        util_dynarray_append(&batch->timestamps, struct panfrost_timestamp, t);
+}
+
+/* Batches without GPU work are never submitted, so their timestamps are taken
+ * on the CPU instead. Earlier work has been submitted by then, but may not have
+ * finished yet. */
+static void
+panfrost_batch_write_timestamps_cpu(struct panfrost_batch *batch)
+{
+        struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
+        uint64_t now = 0;
+
+        if (!util_dynarray_num_elements(&batch->timestamps, struct panfrost_timestamp))
+                return;
+
+        if (dev->kbase && dev->mali.read_timestamp)
+                dev->mali.read_timestamp(&dev->mali, &now);
+
+        util_dynarray_foreach(&batch->timestamps, struct panfrost_timestamp, t) {
+                panfrost_bo_mmap(t->bo);
+                memcpy(t->bo->ptr.cpu + t->offset, &now, sizeof(now));
+        }
+}
+
+void
+panfrost_resource_swap_bo(struct panfrost_context *ctx,
+                          struct panfrost_resource *rsrc,
+                          struct panfrost_bo *newbo)
+{
+        /* Likewise, any batch reading this resource is reading the old BO, and
+         * after swapping will not be reading this resource.
+         */
+        unsigned i;
+        foreach_batch(ctx, i) {
+                struct panfrost_batch *batch = ctx->batches.slots[i];
+
+                panfrost_batch_remove_resource_if_present(ctx, batch, rsrc);
+        }
+
+        /* Swap the pointers, dropping a reference to the old BO which is no
+         * long referenced from the resource
+         */
+        panfrost_bo_unreference(rsrc->image.data.bo);
+        rsrc->image.data.bo = newbo;
+}
+
+struct panfrost_bo *
+panfrost_batch_create_bo(struct panfrost_batch *batch, size_t size,
+                         uint32_t create_flags, enum pipe_shader_type stage,
+                         const char *label)
+{
+        struct panfrost_bo *bo;
+
+        bo = panfrost_bo_create(pan_device(batch->ctx->base.screen), size,
+                                create_flags, label);
+        panfrost_batch_add_bo(batch, bo, stage);
+
+        /* panfrost_batch_add_bo() has retained a reference and
+         * panfrost_bo_create() initialize the refcnt to 1, so let's
+         * unreference the BO here so it gets released when the batch is
+         * destroyed (unless it's retained by someone else in the meantime).
+         */
+        panfrost_bo_unreference(bo);
+        return bo;
+}
+
+/* Returns an idle BO of the pool big enough for every size asked for so
+ * far, allocating one if there is none. A BO is idle when no batch being
+ * recorded holds a reference and the GPU is done with it. Idle BOs that
+ * have been outgrown are released on the way. */
+
+static struct panfrost_bo *
+panfrost_scratch_pool_get(struct panfrost_batch *batch,
+                          struct panfrost_scratch_pool *pool,
+                          size_t size, const char *label)
+{
+        struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
+        struct panfrost_bo **bos = util_dynarray_begin(&pool->bos);
+        unsigned count = util_dynarray_num_elements(&pool->bos,
+                                                    struct panfrost_bo *);
+        struct panfrost_bo *found = NULL;
+        unsigned kept = 0;
+
+        pool->size = MAX2(pool->size, util_next_power_of_two64(size));
+        pool->idle_frames = 0;
+
+        for (unsigned i = 0; i < count; ++i) {
+                struct panfrost_bo *bo = bos[i];
+                bool idle = p_atomic_read(&bo->refcnt) == 1 &&
+                            panfrost_bo_wait(bo, 0, true);
+
+                if (idle && bo->size < pool->size) {
+                        panfrost_bo_unreference(bo);
+                        continue;
+                }
+
+                if (idle && !found)
+                        found = bo;
+
+                bos[kept++] = bo;
+        }
+
+        pool->bos.size = kept * sizeof(struct panfrost_bo *);
+
+        if (!found) {
+                found = panfrost_bo_create(dev, pool->size, PAN_BO_INVISIBLE,
+                                           label);
+                panfrost_bo_set_category(found, PAN_MEM_SCRATCH);
+                util_dynarray_append(&pool->bos, struct panfrost_bo *, found);
+        }
+
+        return found;
+}
+
+/* Called at the end of each frame, releases the BOs of a pool no batch
+ * asked for in a while. Batches still using them keep their reference. */
+
+void
+panfrost_scratch_pool_trim(struct panfrost_scratch_pool *pool)
+{
+        if (++pool->idle_frames < PAN_SCRATCH_IDLE_FRAMES)
+                return;
+
+        panfrost_scratch_pool_cleanup(pool);
+}
+
+void
+panfrost_scratch_pool_cleanup(struct panfrost_scratch_pool *pool)
+{
+        util_dynarray_foreach(&pool->bos, struct panfrost_bo *, bo)
+                panfrost_bo_unreference(*bo);
+
+        util_dynarray_fini(&pool->bos);
+        pool->size = 0;
+        pool->idle_frames = 0;
+}
+
+struct panfrost_bo *
+panfrost_batch_get_scratchpad(struct panfrost_batch *batch,
+                unsigned size_per_thread,
+                unsigned thread_tls_alloc,
+                unsigned core_id_range)
+{
+        unsigned size = panfrost_get_total_stack_size(size_per_thread,
+                        thread_tls_alloc,
+                        core_id_range);
+
+        if (batch->scratchpad) {
+                assert(batch->scratchpad->size >= size);
+        } else {
+                batch->scratchpad =
+                        panfrost_scratch_pool_get(batch, &batch->ctx->tls_pool,
+                                                  size, "Thread local storage");
+
+                panfrost_batch_add_bo(batch, batch->scratchpad,
+                                PIPE_SHADER_VERTEX);
+                panfrost_batch_add_bo(batch, batch->scratchpad,
+                                PIPE_SHADER_FRAGMENT);
+        }
+
+        return batch->scratchpad;
+}
+
+struct panfrost_bo *
+panfrost_batch_get_shared_memory(struct panfrost_batch *batch,
+                unsigned size,
+                unsigned workgroup_count)
+{
+        if (batch->shared_memory) {
+                assert(batch->shared_memory->size >= size);
+        } else {
+                batch->shared_memory =
+                        panfrost_scratch_pool_get(batch, &batch->ctx->wls_pool,
+                                                  size, "Workgroup shared memory");
+
+                panfrost_batch_add_bo(batch, batch->shared_memory,
+                                PIPE_SHADER_VERTEX);
+        }
+
+        return batch->shared_memory;
+}
+
+/* Whether the area covered by the batch holds data worth preloading. Slices
+ * only partially rendered to are left undefined elsewhere, so a batch falling
+ * entirely outside of what was rendered can skip the preload */
+
+static bool
+panfrost_batch_region_valid(struct panfrost_batch *batch,
+                            struct panfrost_resource *rsrc,
+                            unsigned level)
+{
+        return panfrost_resource_region_valid(rsrc, level,
+                                              batch->minx, batch->miny,
+                                              batch->maxx, batch->maxy);
+}
+
+static void
+panfrost_batch_to_fb_info(struct panfrost_batch *batch,
+                          struct pan_fb_info *fb,
+                          struct pan_image_view *rts,
+                          struct pan_image_view *resolves,
+                          struct pan_image_view *zs,
+                          struct pan_image_view *s,
+                          bool reserve)
+{
+        memset(fb, 0, sizeof(*fb));
+        memset(rts, 0, sizeof(*rts) * 8);
+        memset(resolves, 0, sizeof(*resolves) * 8);
+        memset(zs, 0, sizeof(*zs));
+        memset(s, 0, sizeof(*s));
+
+        fb->width = batch->key.width;
+        fb->height = batch->key.height;
+        fb->extent.minx = batch->minx;
+        fb->extent.miny = batch->miny;
+        fb->extent.maxx = batch->maxx - 1;
+        fb->extent.maxy = batch->maxy - 1;
+        fb->nr_samples = util_framebuffer_get_num_samples(&batch->key);
+        fb->rt_count = batch->key.nr_cbufs;
+        fb->sprite_coord_origin = pan_tristate_get(batch->sprite_coord_origin);
+        fb->first_provoking_vertex = pan_tristate_get(batch->first_provoking_vertex);
+        fb->cs_fragment = &batch->cs_fragment;
+
+        static const unsigned char id_swz[] = {
+                PIPE_SWIZZLE_X, PIPE_SWIZZLE_Y, PIPE_SWIZZLE_Z, PIPE_SWIZZLE_W,
+        };
+
+        struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
+
+        for (unsigned i = 0; i < fb->rt_count; i++) {
+                struct pipe_surface *surf = batch->key.cbufs[i];
+                unsigned mask = PIPE_CLEAR_COLOR0 << i;
+
+                /* Render targets the batch neither clears, draws nor reads
+                 * keep their contents in memory, and leave their tile buffer
+                 * space to the others for larger tiles. Midgard writes all
+                 * render targets out, see panfrost_set_batch_masks_blend. */
+                if (!surf || (dev->arch >= 6 && !reserve &&
+                              !((batch->clear | batch->draws | batch->read) & mask)))
+                        continue;
+
+                struct panfrost_resource *prsrc = pan_resource(surf->texture);
+
+                if (batch->clear & mask) {
+                        fb->rts[i].clear = true;
+                        memcpy(fb->rts[i].clear_value, batch->clear_color[i],
+                               sizeof((fb->rts[i].clear_value)));
+                }
+
+                fb->rts[i].discard = !reserve && !(batch->resolve & mask);
+
+                rts[i].format = surf->format;
+                rts[i].dim = MALI_TEXTURE_DIMENSION_2D;
+                rts[i].last_level = rts[i].first_level = surf->u.tex.level;
+                rts[i].first_layer = surf->u.tex.first_layer;
+                rts[i].last_layer = surf->u.tex.last_layer;
+                rts[i].image = &prsrc->image;
+                rts[i].nr_samples = surf->nr_samples ? : MAX2(surf->texture->nr_samples, 1);
+                memcpy(rts[i].swizzle, id_swz, sizeof(rts[i].swizzle));
+                fb->rts[i].crc_valid = &prsrc->valid.crc;
+                fb->rts[i].view = &rts[i];
+
+                /* Preload if the RT is read or updated where it holds data */
+                if (!(batch->clear & mask) &&
+                    ((batch->read | batch->draws) & mask) &&
+                    panfrost_batch_region_valid(batch, prsrc,
+                                                fb->rts[i].view->first_level))
+                        fb->rts[i].preload = true;
+
+                struct pipe_surface *rsurf = batch->resolve_surfs[i];
+
+                if (rsurf) {
+                        struct panfrost_resource *rrsrc =
+                                pan_resource(rsurf->texture);
+
+                        resolves[i] = rts[i];
+                        resolves[i].first_level = rsurf->u.tex.level;
+                        resolves[i].last_level = rsurf->u.tex.level;
+                        resolves[i].first_layer = rsurf->u.tex.first_layer;
+                        resolves[i].last_layer = rsurf->u.tex.last_layer;
+                        resolves[i].image = &rrsrc->image;
+                        fb->rts[i].resolve = &resolves[i];
+
+                        /* Resolve targets don't take part in transaction
+                         * elimination */
+                        rrsrc->valid.crc = false;
+                }
+        }
+
+        const struct pan_image_view *s_view = NULL, *z_view = NULL;
+        struct panfrost_resource *z_rsrc = NULL, *s_rsrc = NULL;
+
+        if (batch->key.zsbuf) {
+                struct pipe_surface *surf = batch->key.zsbuf;
+                z_rsrc = pan_resource(surf->texture);
+
+                zs->format = surf->format == PIPE_FORMAT_Z32_FLOAT_S8X24_UINT ?
+                             PIPE_FORMAT_Z32_FLOAT : surf->format;
+                zs->dim = MALI_TEXTURE_DIMENSION_2D;
+                zs->last_level = zs->first_level = surf->u.tex.level;
+                zs->first_layer = surf->u.tex.first_layer;
+                zs->last_layer = surf->u.tex.last_layer;
+                zs->image = &z_rsrc->image;
+                zs->nr_samples = surf->nr_samples ? : MAX2(surf->texture->nr_samples, 1);
+                memcpy(zs->swizzle, id_swz, sizeof(zs->swizzle));
+                fb->zs.view.zs = zs;
+                z_view = zs;
+                if (util_format_is_depth_and_stencil(zs->format)) {
+                        s_view = zs;
+                        s_rsrc = z_rsrc;
+                }
+
+                if (z_rsrc->separate_stencil) {
+                        s_rsrc = z_rsrc->separate_stencil;
+                        s->format = PIPE_FORMAT_S8_UINT;
+                        s->dim = MALI_TEXTURE_DIMENSION_2D;
+                        s->last_level = s->first_level = surf->u.tex.level;
+                        s->first_layer = surf->u.tex.first_layer;
+                        s->last_layer = surf->u.tex.last_layer;
+                        s->image = &s_rsrc->image;
+                        s->nr_samples = surf->nr_samples ? : MAX2(surf->texture->nr_samples, 1);
+                        memcpy(s->swizzle, id_swz, sizeof(s->swizzle));
+                        fb->zs.view.s = s;
+                        s_view = s;
+                }
+        }
+
+        if (batch->clear & PIPE_CLEAR_DEPTH) {
+                fb->zs.clear.z = true;
+                fb->zs.clear_value.depth = batch->clear_depth;
+        }
+
+        if (batch->clear & PIPE_CLEAR_STENCIL) {
+                fb->zs.clear.s = true;
+                fb->zs.clear_value.stencil = batch->clear_stencil;
+        }
+
+        fb->zs.discard.z = !reserve && !(batch->resolve & PIPE_CLEAR_DEPTH);
+        fb->zs.discard.s = !reserve && !(batch->resolve & PIPE_CLEAR_STENCIL);
+
+        if (!fb->zs.clear.z && z_rsrc &&
+            ((batch->read & PIPE_CLEAR_DEPTH) ||
+             ((batch->draws & PIPE_CLEAR_DEPTH) &&
+              panfrost_batch_region_valid(batch, z_rsrc, z_view->first_level))))
+                fb->zs.preload.z = true;
+
+        if (!fb->zs.clear.s && s_rsrc &&
+            ((batch->read & PIPE_CLEAR_STENCIL) ||
+             ((batch->draws & PIPE_CLEAR_STENCIL) &&
+              panfrost_batch_region_valid(batch, s_rsrc, s_view->first_level))))
+                fb->zs.preload.s = true;
+
+        /* Preserve both component if we have a combined ZS view and
+         * one component needs to be preserved.
+         */
+        if (z_view && s_view == z_view && fb->zs.discard.z != fb->zs.discard.s) {
+                bool valid = panfrost_batch_region_valid(batch, z_rsrc,
+                                                         z_view->first_level);
+
+                fb->zs.discard.z = false;
+                fb->zs.discard.s = false;
+                fb->zs.preload.z = !fb->zs.clear.z && valid;
+                fb->zs.preload.s = !fb->zs.clear.s && valid;
+        }
+}
+
+static int
+panfrost_batch_submit_kbase(struct panfrost_device *dev,
+                            struct drm_panfrost_submit *submit,
+                            const uint8_t *bo_access,
+                            struct kbase_atom_queue *queue,
+                            struct kbase_syncobj *syncobj)
+{
+        dev->mali.handle_events(&dev->mali);
+
+        int atom = dev->mali.submit(&dev->mali, queue,
+                                    submit->jc,
+                                    submit->requirements,
+                                    syncobj,
+                                    (int32_t *)(uintptr_t) submit->bo_handles,
+                                    bo_access,
+                                    submit->bo_handle_count);
+
+        if (atom == -1) {
+                errno = EINVAL;
+                return -1;
+        }
+
+        return 0;
+}
+
+/* On job manager kbase, the atoms of a batch, and of the batches flushed
+ * with it, are queued and submitted with a single ioctl. Not when tracing,
+ * which waits for each atom. */
+static bool
+panfrost_queue_atoms(struct panfrost_context *ctx)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        return dev->kbase && dev->arch < 10 &&
+               !(dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC));
+}
+
+static int
+panfrost_submit_atoms(struct panfrost_context *ctx)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        if (ctx->defer_atoms || !ctx->kbase_atoms.atoms.size)
+                return 0;
+
+        /* The atoms of several batches may use the tiler heap, see
+         * panfrost_batch_submit_jobs */
+        pthread_mutex_lock(&dev->submit_lock);
+        bool ok = dev->mali.submit_queue(&dev->mali, &ctx->kbase_atoms);
+        pthread_mutex_unlock(&dev->submit_lock);
+
+        return ok ? 0 : EINVAL;
+}
+
+static int
+panfrost_batch_submit_ioctl(struct panfrost_batch *batch,
+                            mali_ptr first_job_desc,
+                            uint32_t reqs,
+                            uint32_t in_sync,
+                            uint32_t out_sync)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct pipe_context *gallium = (struct pipe_context *) ctx;
+        struct panfrost_device *dev = pan_device(gallium->screen);
+        struct drm_panfrost_submit submit = {0,};
+        uint32_t in_syncs[2];
+        uint32_t *bo_handles;
+        uint8_t *bo_access = NULL;
+        int ret;
+
+        /* If we trace, we always need a syncobj, so make one of our own if we
+         * weren't given one to use. Remember that we did so, so we can free it
+         * after we're done but preventing double-frees if we were given a
+         * syncobj */
+
+        if (!out_sync && dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
+                out_sync = ctx->syncobj;
+
+        submit.out_sync = out_sync;
+        submit.jc = first_job_desc;
+        submit.requirements = reqs;
+
+        if (in_sync)
+                in_syncs[submit.in_sync_count++] = in_sync;
+
+        /* There is no way to pass a sync file to kbase job submission, so
+         * wait for it on the CPU */
+        if (dev->kbase && ctx->in_sync_fd >= 0) {
+                sync_wait(ctx->in_sync_fd, -1);
+                close(ctx->in_sync_fd);
+                ctx->in_sync_fd = -1;
+        }
+
+        if (ctx->in_sync_fd >= 0) {
+                ret = drmSyncobjImportSyncFile(dev->fd, ctx->in_sync_obj,
+                                               ctx->in_sync_fd);
+                assert(!ret);
+
+                in_syncs[submit.in_sync_count++] = ctx->in_sync_obj;
+                close(ctx->in_sync_fd);
+                ctx->in_sync_fd = -1;
+        }
+
+        if (submit.in_sync_count)
+                submit.in_syncs = (uintptr_t)in_syncs;
+
+        unsigned max_handles = panfrost_pool_num_bos(&batch->pool) +
+                               panfrost_pool_num_bos(&batch->invisible_pool) +
+                               batch->num_bos + 2;
+
+        bo_handles = calloc(max_handles, sizeof(*bo_handles));
+        assert(bo_handles);
+
+        /* kbase tracks reads and writes of each BO, so that atoms only wait
+         * for the atoms they conflict with. Pool BOs are private to the
+         * batch, so they might as well be writes. */
+        if (dev->kbase) {
+                bo_access = malloc(max_handles);
+                assert(bo_access);
+                memset(bo_access, KBASE_ACCESS_READ | KBASE_ACCESS_WRITE,
+                       max_handles);
+        }
+
+        pan_bo_access *flags = util_dynarray_begin(&batch->bos);
+        unsigned end_bo = util_dynarray_num_elements(&batch->bos, pan_bo_access);
+
+        for (int i = 0; i < end_bo; ++i) {
+                if (!flags[i])
+                        continue;
+
+                assert(submit.bo_handle_count < batch->num_bos);
+
+                if (bo_access) {
+                        bo_access[submit.bo_handle_count] =
+                                ((flags[i] & PAN_BO_ACCESS_READ) ? KBASE_ACCESS_READ : 0) |
+                                ((flags[i] & PAN_BO_ACCESS_WRITE) ? KBASE_ACCESS_WRITE : 0);
+                }
+
+                bo_handles[submit.bo_handle_count++] = i;
+
+                /* Update the BO access flags so that panfrost_bo_wait() knows
+                 * about all pending accesses.
+                 * We only keep the READ/WRITE info since this is all the BO
+                 * wait logic cares about.
+                 * We also preserve existing flags as this batch might not
+                 * be the first one to access the BO.
+                 */
+                struct panfrost_bo *bo = pan_lookup_bo_existing(dev, i);
+
+                bo->gpu_access |= flags[i] & (PAN_BO_ACCESS_RW);
+        }
+
+        panfrost_pool_get_bo_handles(&batch->pool, bo_handles + submit.bo_handle_count);
+        submit.bo_handle_count += panfrost_pool_num_bos(&batch->pool);
+        panfrost_pool_get_bo_handles(&batch->invisible_pool, bo_handles + submit.bo_handle_count);
+        submit.bo_handle_count += panfrost_pool_num_bos(&batch->invisible_pool);
+
+        /* Add the tiler heap to the list of accessed BOs if the batch has at
+         * least one tiler job. Tiler heap is written by tiler jobs and read
+         * by fragment jobs (the polygon list is coming from this heap).
+         */
+        if (batch->scoreboard.first_tiler)
+                bo_handles[submit.bo_handle_count++] = dev->tiler_heap->gem_handle;
+
+        /* Always used on Bifrost, occassionally used on Midgard */
+        if (bo_access)
+                bo_access[submit.bo_handle_count] = KBASE_ACCESS_READ;
+
+        bo_handles[submit.bo_handle_count++] = dev->sample_positions->gem_handle;
+
+        submit.bo_handles = (u64) (uintptr_t) bo_handles;
+        if (ctx->is_noop)
+                ret = 0;
+        else if (dev->kbase)
+                ret = panfrost_batch_submit_kbase(dev, &submit, bo_access,
+                                                  panfrost_queue_atoms(ctx) ?
+                                                  &ctx->kbase_atoms : NULL,
+                                                  ctx->syncobj_kbase);
+        else
+                ret = drmIoctl(dev->fd, DRM_IOCTL_PANFROST_SUBMIT, &submit);
+        free(bo_handles);
+        free(bo_access);
+
+        if (ret)
+                return errno;
+
+        /* Trace the job if we're doing that */
+        if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC)) {
+                /* Wait so we can get errors reported back */
+                if (dev->kbase)
+                        dev->mali.syncobj_wait(&dev->mali, ctx->syncobj_kbase,
+                                               INT64_MAX);
+                else
+                        drmSyncobjWait(dev->fd, &out_sync, 1,
+                                       INT64_MAX, 0, NULL);
+
+                if (dev->debug & PAN_DBG_TRACE)
+                        pandecode_jc(submit.jc, dev->gpu_id);
+
+                if (dev->debug & PAN_DBG_DUMP)
+                        pandecode_dump_mappings();
+
+                /* Jobs won't be complete if blackhole rendering, that's ok */
+                if (!ctx->is_noop && dev->debug & PAN_DBG_SYNC)
+                        pandecode_abort_on_fault(submit.jc, dev->gpu_id);
+        }
+
+        return 0;
+}
+
+static bool
+panfrost_has_fragment_job(struct panfrost_batch *batch)
+{
+        return batch->scoreboard.first_tiler || batch->clear;
+}
+
+/* Submit both vertex/tiler and fragment jobs for a batch, possibly with an
+ * outsync corresponding to the later of the two (since there will be an
+ * implicit dep between them) */
+
+static int
+panfrost_batch_submit_jobs(struct panfrost_batch *batch,
+                           const struct pan_fb_info *fb,
+                           uint32_t in_sync, uint32_t out_sync)
+{
+        struct pipe_screen *pscreen = batch->ctx->base.screen;
+        struct panfrost_screen *screen = pan_screen(pscreen);
+        struct panfrost_device *dev = pan_device(pscreen);
+        bool has_draws = batch->scoreboard.first_job;
+        bool has_tiler = batch->scoreboard.first_tiler;
+        bool has_frag = panfrost_has_fragment_job(batch);
+        bool queue = panfrost_queue_atoms(batch->ctx);
+        int ret = 0;
+
+        /* Take the submit lock to make sure no tiler jobs from other context
+         * are inserted between our tiler and fragment jobs, failing to do that
+         * might result in tiler heap corruption. Queued atoms are submitted
+         * with the lock held instead.
+         */
+        if (has_tiler && !queue)
+                pthread_mutex_lock(&dev->submit_lock);
+
+        if (has_draws) {
+                ret = panfrost_batch_submit_ioctl(batch, batch->scoreboard.first_job,
+                                                  0, in_sync, has_frag ? 0 : out_sync);
+
+                if (ret)
+                        goto done;
+        }
+
+        if (has_frag) {
+                mali_ptr fragjob = screen->vtbl.emit_fragment_job(batch, fb);
+                ret = panfrost_batch_submit_ioctl(batch, fragjob,
+                                                  PANFROST_JD_REQ_FS, 0,
+                                                  out_sync);
+                if (ret)
+                        goto done;
+        }
+
+done:
+        if (has_tiler && !queue)
+                pthread_mutex_unlock(&dev->submit_lock);
+
+        return ret;
+}
+
+/* Instructions of the stream called from a hung queue's ring to print */
+#define PAN_HANG_MAX_INSTRS 64
+
+/* BOs of a hung batch to list */
+#define PAN_HANG_MAX_BOS 32
+
+/* Find the live BO mapping a GPU address, for decoding what a queue was
+ * executing when it hung */
+static struct panfrost_bo *
+panfrost_hang_lookup_va(struct panfrost_device *dev, mali_ptr va)
+{
+        kbase k = &dev->mali;
+        struct panfrost_bo *found = NULL;
+
+        pthread_mutex_lock(&k->handle_lock);
+        unsigned handles = util_dynarray_num_elements(&k->gem_handles,
+                                                      kbase_handle);
+        pthread_mutex_unlock(&k->handle_lock);
+
+        pthread_mutex_lock(&dev->bo_map_lock);
+
+        for (unsigned i = 0; i < handles; ++i) {
+                struct panfrost_bo *bo = pan_lookup_bo_existing(dev, i);
+
+                if (!bo || !bo->size || !p_atomic_read(&bo->refcnt) ||
+                    !bo->ptr.cpu)
+                        continue;
+
+                if (va >= bo->ptr.gpu && va < bo->ptr.gpu + bo->size) {
+                        found = bo;
+                        break;
+                }
+        }
+
+        pthread_mutex_unlock(&dev->bo_map_lock);
+
+        return found;
+}
+
+/* Print where a queue stopped. CS_EXTRACT points just past the last
+ * instruction the queue fetched from its ring, which for a hung queue is
+ * inside the CALL group of the stuck submission, so decode the stream that
+ * group calls. */
+static void
+panfrost_hang_report_cs(struct panfrost_device *dev,
+                        struct panfrost_context *ctx, const char *name,
+                        struct panfrost_cs *cs, uint64_t insert)
+{
+        kbase k = &dev->mali;
+
+        if (!cs->base.user_io) {
+                fprintf(stderr, "%s queue: not bound\n", name);
+                return;
+        }
+
+        uint64_t extract = k->cs_extract(k, &cs->base);
+
+        fprintf(stderr, "%s queue: extract 0x%"PRIx64" insert 0x%"PRIx64
+                "%s\n", name, extract, insert,
+                extract >= insert ? " (idle)" : "");
+
+        if (k->last_fault.valid &&
+            k->last_fault.csg_handle == ctx->kbase_ctx->csg_handle &&
+            k->last_fault.csi == cs->base.csi) {
+                fprintf(stderr, "  fault: status 0x%x (exception 0x%x) "
+                        "sideband 0x%"PRIx64"\n", k->last_fault.status,
+                        k->last_fault.status & 0xff, k->last_fault.sideband);
+        }
+
+        if (extract >= insert || !extract)
+                return;
+
+        /* Groups are aligned, as the prologue is a multiple of their size */
+        const uint64_t *ring = cs->bo->ptr.cpu;
+        unsigned group = ((extract - 1) % cs->base.size) &
+                ~(PAN_CS_RING_CALL_SIZE - 1);
+        const uint64_t *ins = ring + group / 8;
+
+        /* MOVE48 of the address, MOVE32 of the length, then the CALL */
+        if ((ins[0] >> 56) != 1 || (ins[1] >> 56) != 2 ||
+            (ins[2] >> 56) != 32) {
+                fprintf(stderr, "  stopped in the ring prologue at 0x%x\n",
+                        group);
+                return;
+        }
+
+        mali_ptr va = ins[0] & BITFIELD64_MASK(48);
+        unsigned length = ins[1] & BITFIELD64_MASK(32);
+
+        fprintf(stderr, "  stuck in call to 0x%"PRIx64" (%u instructions) "
+                "from ring offset 0x%x\n", va, length / 8, group);
+
+        if (dev->debug & PAN_DBG_TRACE) {
+                pandecode_cs(va, length, dev->gpu_id);
+                return;
+        }
+
+        struct panfrost_bo *bo = panfrost_hang_lookup_va(dev, va);
+
+        if (!bo) {
+                fprintf(stderr, "  stream is not CPU mapped\n");
+                return;
+        }
+
+        const uint64_t *stream = bo->ptr.cpu + (va - bo->ptr.gpu);
+        unsigned count = MIN3(length / 8, PAN_HANG_MAX_INSTRS,
+                              (bo->ptr.gpu + bo->size - va) / 8);
+
+        for (unsigned i = 0; i < count; ++i) {
+                fprintf(stderr, "  %04x: op %02x reg %02x imm 0x%012"PRIx64"\n",
+                        i * 8, (unsigned)(stream[i] >> 56),
+                        (unsigned)(stream[i] >> 48) & 0xff,
+                        (uint64_t)(stream[i] & BITFIELD64_MASK(48)));
+        }
+
+        if (count < length / 8)
+                fprintf(stderr, "  ...\n");
+}
+
+static void
+panfrost_hang_report_bos(struct panfrost_device *dev,
+                         struct panfrost_batch *batch)
+{
+        pan_bo_access *flags = util_dynarray_begin(&batch->bos);
+        unsigned end_bo = util_dynarray_num_elements(&batch->bos, pan_bo_access);
+        unsigned listed = 0;
+
+        fprintf(stderr, "BOs: %u, plus %u in pools\n", batch->num_bos,
+                panfrost_pool_num_bos(&batch->pool) +
+                panfrost_pool_num_bos(&batch->invisible_pool));
+
+        for (int i = 0; i < end_bo; ++i) {
+                if (!flags[i])
+                        continue;
+
+                if (listed++ == PAN_HANG_MAX_BOS) {
+                        fprintf(stderr, "  ...\n");
+                        break;
+                }
+
+                struct panfrost_bo *bo = pan_lookup_bo_existing(dev, i);
+
+                fprintf(stderr, "  0x%"PRIx64"-0x%"PRIx64" %8zu KiB "
+                        "flags 0x%x %s%s %s\n", bo->ptr.gpu,
+                        bo->ptr.gpu + bo->size, bo->size / 1024, bo->flags,
+                        (flags[i] & PAN_BO_ACCESS_READ) ? "r" : "-",
+                        (flags[i] & PAN_BO_ACCESS_WRITE) ? "w" : "-",
+                        bo->label ?: "");
+
+                /* Growable memory is only backed where the GPU faulted */
+                if (!(dev->debug & PAN_DBG_TRACE) || !bo->ptr.cpu ||
+                    (bo->flags & (PAN_BO_GROWABLE | PAN_BO_INVISIBLE)))
+                        continue;
+
+                size_t size = MIN2(bo->size, 256);
+
+                if (bo->cached)
+                        panfrost_bo_mem_invalidate(bo, 0, size);
+
+                pan_hexdump(stderr, bo->ptr.cpu, size, false);
+        }
+}
+
+/* Compact report for a batch which faulted or timed out: where each queue
+ * stopped, the descriptors the batch bound and the BOs it used. This is
+ * printed instead of dumping the whole GPU address space, so it is cheap
+ * enough to do for every hang. */
+static void
+panfrost_hang_report(struct panfrost_batch *batch, uint64_t vs_offset,
+                     uint64_t fs_offset, uint64_t cs_offset)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        mesa_loge("GPU hang in %ux%u batch", batch->key.width,
+                  batch->key.height);
+
+        panfrost_hang_report_cs(dev, ctx, "Vertex", &ctx->kbase_cs_vertex,
+                                vs_offset);
+        panfrost_hang_report_cs(dev, ctx, "Fragment", &ctx->kbase_cs_fragment,
+                                fs_offset);
+        panfrost_hang_report_cs(dev, ctx, "Compute", &ctx->kbase_cs_compute,
+                                cs_offset);
+
+        /* The fault was reported, don't attribute it to a later hang */
+        dev->mali.last_fault.valid = false;
+
+        fprintf(stderr, "Framebuffer 0x%"PRIx64" TLS 0x%"PRIx64
+                " depth/stencil 0x%"PRIx64" blend 0x%"PRIx64"\n",
+                batch->framebuffer.gpu, batch->tls.gpu,
+                batch->depth_stencil, batch->blend);
+
+        for (unsigned i = 0; i < PIPE_SHADER_TYPES; ++i) {
+                if (!batch->rsd[i])
+                        continue;
+
+                fprintf(stderr, "%s: RSD 0x%"PRIx64" textures 0x%"PRIx64
+                        " samplers 0x%"PRIx64" UBOs 0x%"PRIx64
+                        " push 0x%"PRIx64"\n",
+                        _mesa_shader_stage_to_abbrev(i), batch->rsd[i],
+                        batch->textures[i], batch->samplers[i],
+                        batch->uniform_buffers[i], batch->push_uniforms[i]);
+        }
+
+        panfrost_hang_report_bos(dev, batch);
+}
+
+static void
+reset_context(struct panfrost_context *ctx)
+{
+        struct pipe_screen *pscreen = ctx->base.screen;
+        struct panfrost_screen *screen = pan_screen(pscreen);
+        struct panfrost_device *dev = pan_device(pscreen);
+
+        /* Don't recover from the fault if PAN_MESA_DEBUG=sync is specified,
+         * to somewhat mimic behaviour with JM GPUs. TODO: Just abort? */
+        bool recover = !(dev->debug & PAN_DBG_SYNC);
+
+        mesa_loge("Context reset");
+
+        dev->mali.cs_term(&dev->mali, &ctx->kbase_cs_vertex.base);
+        dev->mali.cs_term(&dev->mali, &ctx->kbase_cs_fragment.base);
+        dev->mali.cs_term(&dev->mali, &ctx->kbase_cs_compute.base);
+
+        /* Without a queue group the queues can't be bound again, so the
+         * context is left dead, with submissions dropped */
+        if (!dev->mali.context_recreate(&dev->mali, ctx->kbase_ctx)) {
+                mesa_loge("Failed to recreate the context");
+                recover = false;
+        }
+
+        if (recover) {
+                dev->mali.cs_rebind(&dev->mali, &ctx->kbase_cs_vertex.base);
+                dev->mali.cs_rebind(&dev->mali, &ctx->kbase_cs_fragment.base);
+                dev->mali.cs_rebind(&dev->mali, &ctx->kbase_cs_compute.base);
+        } else {
+                ctx->kbase_cs_vertex.base.user_io = NULL;
+                ctx->kbase_cs_fragment.base.user_io = NULL;
+                ctx->kbase_cs_compute.base.user_io = NULL;
+        }
+
+        ctx->kbase_cs_vertex.base.last_insert = 0;
+        ctx->kbase_cs_fragment.base.last_insert = 0;
+        ctx->kbase_cs_compute.base.last_insert = 0;
+
+        /* Terminating the queues signalled everything that was pending */
+        ctx->fence_point.vertex = 0;
+        ctx->fence_point.fragment = 0;
+        ctx->fence_point.compute = 0;
+
+        util_dynarray_foreach(&ctx->tiler_scratch,
+                              struct panfrost_tiler_scratch, s) {
+                if (s->seqnum != UINT64_MAX)
+                        s->seqnum = 0;
+        }
+
+        util_dynarray_foreach(&ctx->slab_cache.slabs, struct panfrost_slab, s) {
+                s->vertex_seqnum = 0;
+                s->fragment_seqnum = 0;
+                s->compute_seqnum = 0;
+        }
+
+        screen->vtbl.init_cs(ctx, &ctx->kbase_cs_vertex);
+        screen->vtbl.init_cs(ctx, &ctx->kbase_cs_fragment);
+        screen->vtbl.init_cs(ctx, &ctx->kbase_cs_compute);
+
+        /* init_cs restarted the seqnums. With the submit queue, the
+         * application thread is waiting for this batch, so it is safe to
+         * write these from here. */
+        ctx->submit.vertex_seqnum = 0;
+        ctx->submit.fragment_seqnum = 0;
+        ctx->submit.compute_seqnum = 0;
+
+        /* The heaps were recreated, so their descriptors are stale. No
+         * batch is using them any more after terminating the queues. */
+        for (unsigned i = 0; i < ARRAY_SIZE(ctx->tiler_heap_desc); ++i) {
+                if (ctx->tiler_heap_desc[i]) {
+                        panfrost_bo_unreference(ctx->tiler_heap_desc[i]);
+                        ctx->tiler_heap_desc[i] = NULL;
+                }
+        }
+        ctx->next_tiler_heap = 0;
+
+        for (unsigned i = 0; i < ARRAY_SIZE(ctx->tiler_heap_state); ++i)
+                ctx->tiler_heap_state[i].seqnum = 0;
+}
+
+static void
+pandecode_cs_ring(struct panfrost_device *dev, struct panfrost_cs *cs,
+                  uint64_t insert)
+{
+        insert %= cs->base.size;
+        uint64_t start = cs->base.last_insert % cs->base.size;
+
+        if (insert < start) {
+                pandecode_cs(cs->base.va + start, cs->base.size - start, dev->gpu_id);
+                start = 0;
+        }
+
+        pandecode_cs(cs->base.va + start, insert - start, dev->gpu_id);
+}
+
+static struct pan_capture_ring
+panfrost_capture_ring(struct panfrost_cs *cs, uint64_t insert)
+{
+        return (struct pan_capture_ring) {
+                .cpu = cs->bo->ptr.cpu,
+                .size = cs->base.size,
+                .start = cs->base.last_insert,
+                .end = insert,
+        };
+}
+
+static bool
+panfrost_batch_captured(struct panfrost_batch *batch)
+{
+        struct panfrost_context *ctx = batch->ctx;
+
+        if (!ctx->capture.file || !ctx->capture.active)
+                return false;
+
+        return !ctx->capture.reason ||
+                (batch->flush_reason &&
+                 strstr(batch->flush_reason, ctx->capture.reason));
+}
+
+static unsigned
+panfrost_add_dep_after(struct util_dynarray *deps,
+                       struct panfrost_usage u,
+                       unsigned index)
+{
+        unsigned size = util_dynarray_num_elements(deps, struct panfrost_usage);
+
+        for (unsigned i = index; i < size; ++i) {
+                struct panfrost_usage *d =
+                        util_dynarray_element(deps, struct panfrost_usage, i);
+
+                /* TODO: Remove d if it is an invalid entry? */
+
+                if ((d->queue == u.queue) && (d->write == u.write)) {
+                        d->seqnum = MAX2(d->seqnum, u.seqnum);
+                        return i;
+
+                } else if (d->queue > u.queue) {
+                        void *p = util_dynarray_grow(deps, struct panfrost_usage, 1);
+                        assert(p);
+                        memmove(util_dynarray_element(deps, struct panfrost_usage, i + 1),
+                                util_dynarray_element(deps, struct panfrost_usage, i),
+                                (size - i) * sizeof(struct panfrost_usage));
+
+                        *util_dynarray_element(deps, struct panfrost_usage, i) = u;
+                        return i;
+                }
+        }
+
+        util_dynarray_append(deps, struct panfrost_usage, u);
+        return size;
+}
+
+static void
+panfrost_update_deps(struct util_dynarray *deps, struct panfrost_bo *bo, bool write)
+{
+        /* The slots are not sorted, so search the whole list each time */
+        for (unsigned i = 0; i < PAN_BO_USAGE_SLOTS; ++i) {
+                struct panfrost_usage u;
+
+                if (!panfrost_usage_unpack(p_atomic_read(&bo->usage_slots[i]), &u))
+                        continue;
+
+                /* read->read access does not require a dependency */
+                if (!write && !u.write)
+                        continue;
+
+                panfrost_add_dep_after(deps, u, 0);
+        }
+
+        if (!p_atomic_read(&bo->usage_overflow))
+                return;
+
+        pthread_mutex_lock(&bo->dev->bo_usage_lock);
+        util_dynarray_foreach(&bo->usage, struct panfrost_usage, u) {
+                if (!write && !u->write)
+                        continue;
+
+                panfrost_add_dep_after(deps, *u, 0);
+        }
+        pthread_mutex_unlock(&bo->dev->bo_usage_lock);
+}
+
+static inline bool
+panfrost_usage_writes(enum panfrost_usage_type usage)
+{
+        return (usage == PAN_USAGE_WRITE_VERTEX) || (usage == PAN_USAGE_WRITE_FRAGMENT);
+}
+
+static inline bool
+panfrost_usage_fragment(enum panfrost_usage_type usage)
+{
+        return (usage == PAN_USAGE_READ_FRAGMENT) || (usage == PAN_USAGE_WRITE_FRAGMENT);
+}
+
+/* Removes invalid dependencies from deps */
+static void
+panfrost_clean_deps(struct panfrost_device *dev, struct util_dynarray *deps)
+{
+        kbase k = &dev->mali;
+
+        struct panfrost_usage *rebuild = util_dynarray_begin(deps);
+        unsigned index = 0;
+
+        util_dynarray_foreach(deps, struct panfrost_usage, u) {
+                /* Usages are ordered, so we can break here */
+                if (u->queue >= k->event_slot_usage)
+                        break;
+
+                struct kbase_event_slot *slot = kbase_event_slot(k, u->queue);
+                uint64_t seqnum = u->seqnum;
+
+                /* There is a race condition, where we can depend on an
+                 * unsubmitted batch. In that cade, decrease the seqnum.
+                 * Otherwise, skip invalid dependencies. */
+                if (slot->last_submit == seqnum)
+                        --seqnum;
+                else if (slot->last_submit < seqnum)
+                        continue;
+
+                /* This usage is valid, add it to the returned list */
+                rebuild[index++] = (struct panfrost_usage) {
+                        .queue = u->queue,
+                        .write = u->write,
+                        .seqnum = seqnum,
+                };
+        }
+
+        /* No need to check the return value, it can only shrink */
+        (void)! util_dynarray_resize(deps, struct panfrost_usage, index);
+}
+
+/* The parts of a CSF submit done on the application thread, even when the
+ * rest is left to the submit queue: the fragment job still refers to the
+ * framebuffer info, and fences created straight after a flush must already
+ * resolve to the batch's queue points. */
+
+static void
+panfrost_batch_prepare_csf(struct panfrost_batch *batch,
+                           const struct pan_fb_info *fb)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
+
+        if (panfrost_has_fragment_job(batch)) {
+                screen->vtbl.emit_fragment_job(batch, fb);
+                ++ctx->submit.fragment_seqnum;
+        }
 
-        static const unsigned char id_swz[] = {
-                PIPE_SWIZZLE_X, PIPE_SWIZZLE_Y, PIPE_SWIZZLE_Z, PIPE_SWIZZLE_W,
-        };
+        if (batch->compute)
+                ++ctx->submit.compute_seqnum;
+        else
+                ++ctx->submit.vertex_seqnum;
 
-        for (unsigned i = 0; i < fb->rt_count; i++) {
-                struct pipe_surface *surf = batch->key.cbufs[i];
+        batch->vertex_seqnum = ctx->submit.vertex_seqnum;
+        batch->fragment_seqnum = ctx->submit.fragment_seqnum;
+        batch->compute_seqnum = ctx->submit.compute_seqnum;
 
-                if (!surf)
+        if (batch->tiler_heap_held)
+                ctx->tiler_heap_state[batch->tiler_heap].seqnum = batch->fragment_seqnum;
+
+        /* Wait for fences from fence_server_sync */
+        batch->in_sync_fd = ctx->in_sync_fd;
+        ctx->in_sync_fd = -1;
+
+        /* Points of other contexts are waited for by both queues, as the
+         * fence might guard anything the batch accesses */
+        util_dynarray_foreach(&ctx->in_deps, struct panfrost_usage, u) {
+                panfrost_add_dep_after(&batch->vert_deps, *u, 0);
+                panfrost_add_dep_after(&batch->frag_deps, *u, 0);
+        }
+        util_dynarray_clear(&ctx->in_deps);
+
+        /* Matches the queues emit_csf_toplevel will write to */
+        pan_command_stream v = batch->cs_vertex_last_size ?
+                batch->cs_vertex_first : batch->cs_vertex;
+
+        bool vert = (v.ptr != v.begin);
+        bool frag = (batch->cs_fragment.ptr != batch->cs_fragment.begin);
+
+        /* The fragment CS waits for the vertex CS of the same batch, which
+         * comes after all earlier vertex work, so only one point is needed
+         * for a batch which uses both queues. Compute is independent of
+         * both. */
+        if (batch->compute) {
+                assert(!frag);
+
+                if (vert)
+                        ctx->fence_point.compute = batch->compute_seqnum;
+        } else if (frag) {
+                ctx->fence_point.fragment = batch->fragment_seqnum;
+                if (vert)
+                        ctx->fence_point.vertex = 0;
+        } else if (vert) {
+                ctx->fence_point.vertex = batch->vertex_seqnum;
+        }
+}
+
+/* Emit the traced batches whose timestamps have all landed */
+static void
+panfrost_trace_collect(struct panfrost_context *ctx)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        for (unsigned i = 0; i < PAN_TRACE_SLOTS; ++i) {
+                unsigned mask = ctx->trace.pending[i];
+
+                if (!mask)
                         continue;
 
-                struct panfrost_resource *prsrc = pan_resource(surf->texture);
-                unsigned mask = PIPE_CLEAR_COLOR0 << i;
+                uint64_t *ts = ctx->trace.bo->ptr.cpu + i * PAN_TRACE_SLOT_SIZE;
+                bool done = true;
 
-                if (batch->clear & mask) {
-                        fb->rts[i].clear = true;
-                        memcpy(fb->rts[i].clear_value, batch->clear_color[i],
-                               sizeof((fb->rts[i].clear_value)));
-                }
+                u_foreach_bit(q, mask)
+                        done &= !!p_atomic_read(&ts[q * 2 + 1]);
 
-                fb->rts[i].discard = !reserve && !(batch->resolve & mask);
+                if (!done)
+                        continue;
 
-                rts[i].format = surf->format;
-                rts[i].dim = MALI_TEXTURE_DIMENSION_2D;
-                rts[i].last_level = rts[i].first_level = surf->u.tex.level;
-                rts[i].first_layer = surf->u.tex.first_layer;
-                rts[i].last_layer = surf->u.tex.last_layer;
-                rts[i].image = &prsrc->image;
-                rts[i].nr_samples = surf->nr_samples ? : MAX2(surf->texture->nr_samples, 1);
-                memcpy(rts[i].swizzle, id_swz, sizeof(rts[i].swizzle));
-                fb->rts[i].crc_valid = &prsrc->valid.crc;
-                fb->rts[i].view = &rts[i];
+                struct panfrost_perfetto_batch *b = &ctx->trace.batches[i];
 
-                /* Preload if the RT is read or updated */
-                if (!(batch->clear & mask) &&
-                    ((batch->read & mask) ||
-                     ((batch->draws & mask) &&
-                      BITSET_TEST(prsrc->valid.data, fb->rts[i].view->first_level))))
-                        fb->rts[i].preload = true;
+                u_foreach_bit(q, mask) {
+                        b->start_ns[q] = panfrost_timestamp_to_ns(dev, ts[q * 2]);
+                        b->end_ns[q] = panfrost_timestamp_to_ns(dev, ts[q * 2 + 1]);
+                }
 
+                panfrost_perfetto_emit_batch(ctx, b);
+                ctx->trace.pending[i] = 0;
         }
+}
 
-        const struct pan_image_view *s_view = NULL, *z_view = NULL;
-        struct panfrost_resource *z_rsrc = NULL, *s_rsrc = NULL;
+/* Give the batch a slot to store the start and end timestamps of each of its
+ * queues to, if the render stage data source is being traced. Finished slots
+ * are gathered here too, so tracing never waits on the GPU. */
+static void
+panfrost_batch_trace_csf(struct panfrost_batch *batch)
+{
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
 
-        if (batch->key.zsbuf) {
-                struct pipe_surface *surf = batch->key.zsbuf;
-                z_rsrc = pan_resource(surf->texture);
+        batch->trace_ts = 0;
 
-                zs->format = surf->format == PIPE_FORMAT_Z32_FLOAT_S8X24_UINT ?
-                             PIPE_FORMAT_Z32_FLOAT : surf->format;
-                zs->dim = MALI_TEXTURE_DIMENSION_2D;
-                zs->last_level = zs->first_level = surf->u.tex.level;
-                zs->first_layer = surf->u.tex.first_layer;
-                zs->last_layer = surf->u.tex.last_layer;
-                zs->image = &z_rsrc->image;
-                zs->nr_samples = surf->nr_samples ? : MAX2(surf->texture->nr_samples, 1);
-                memcpy(zs->swizzle, id_swz, sizeof(zs->swizzle));
-                fb->zs.view.zs = zs;
-                z_view = zs;
-                if (util_format_is_depth_and_stencil(zs->format)) {
-                        s_view = zs;
-                        s_rsrc = z_rsrc;
-                }
+        if (!panfrost_has_gpu_timestamps(dev) || !panfrost_perfetto_enabled())
+                return;
 
-                if (z_rsrc->separate_stencil) {
-                        s_rsrc = z_rsrc->separate_stencil;
-                        s->format = PIPE_FORMAT_S8_UINT;
-                        s->dim = MALI_TEXTURE_DIMENSION_2D;
-                        s->last_level = s->first_level = surf->u.tex.level;
-                        s->first_layer = surf->u.tex.first_layer;
-                        s->last_layer = surf->u.tex.last_layer;
-                        s->image = &s_rsrc->image;
-                        s->nr_samples = surf->nr_samples ? : MAX2(surf->texture->nr_samples, 1);
-                        memcpy(s->swizzle, id_swz, sizeof(s->swizzle));
-                        fb->zs.view.s = s;
-                        s_view = s;
-                }
+        if (!ctx->trace.bo) {
+                ctx->trace.bo = panfrost_bo_create(dev,
+                                PAN_TRACE_SLOTS * PAN_TRACE_SLOT_SIZE, 0,
+                                "Trace timestamps");
+
+                if (!ctx->trace.bo)
+                        return;
         }
 
-        if (batch->clear & PIPE_CLEAR_DEPTH) {
-                fb->zs.clear.z = true;
-                fb->zs.clear_value.depth = batch->clear_depth;
+        panfrost_trace_collect(ctx);
+
+        uint64_t now = panfrost_perfetto_now();
+        uint64_t gpu_ts;
+
+        if (now >= ctx->trace.next_sync_ns &&
+            dev->mali.read_timestamp(&dev->mali, &gpu_ts)) {
+                /* The ioctl can take a while, so read the CPU time again */
+                now = panfrost_perfetto_now();
+                panfrost_perfetto_sync_clocks(now,
+                                              panfrost_timestamp_to_ns(dev, gpu_ts));
+                ctx->trace.next_sync_ns = now + 30000000;
         }
 
-        if (batch->clear & PIPE_CLEAR_STENCIL) {
-                fb->zs.clear.s = true;
-                fb->zs.clear_value.stencil = batch->clear_stencil;
+        /* Matches the queues emit_csf_toplevel will write to */
+        pan_command_stream v = batch->cs_vertex_last_size ?
+                batch->cs_vertex_first : batch->cs_vertex;
+        unsigned mask = 0;
+
+        if (v.ptr != v.begin) {
+                mask |= BITFIELD_BIT(batch->compute ?
+                                     PAN_PERFETTO_QUEUE_COMPUTE :
+                                     PAN_PERFETTO_QUEUE_VERTEX);
         }
 
-        fb->zs.discard.z = !reserve && !(batch->resolve & PIPE_CLEAR_DEPTH);
-        fb->zs.discard.s = !reserve && !(batch->resolve & PIPE_CLEAR_STENCIL);
+        if (batch->cs_fragment.ptr != batch->cs_fragment.begin)
+                mask |= BITFIELD_BIT(PAN_PERFETTO_QUEUE_FRAGMENT);
 
-        if (!fb->zs.clear.z && z_rsrc &&
-            ((batch->read & PIPE_CLEAR_DEPTH) ||
-             ((batch->draws & PIPE_CLEAR_DEPTH) &&
-              BITSET_TEST(z_rsrc->valid.data, z_view->first_level))))
-                fb->zs.preload.z = true;
+        /* Drop the batch if the GPU is too far behind to have freed its slot */
+        unsigned slot = ctx->trace.next;
 
-        if (!fb->zs.clear.s && s_rsrc &&
-            ((batch->read & PIPE_CLEAR_STENCIL) ||
-             ((batch->draws & PIPE_CLEAR_STENCIL) &&
-              BITSET_TEST(s_rsrc->valid.data, s_view->first_level))))
-                fb->zs.preload.s = true;
+        if (!mask || ctx->trace.pending[slot])
+                return;
 
-        /* Preserve both component if we have a combined ZS view and
-         * one component needs to be preserved.
-         */
-        if (z_view && s_view == z_view && fb->zs.discard.z != fb->zs.discard.s) {
-                bool valid = BITSET_TEST(z_rsrc->valid.data, z_view->first_level);
+        ctx->trace.next = (slot + 1) % PAN_TRACE_SLOTS;
 
-                fb->zs.discard.z = false;
-                fb->zs.discard.s = false;
-                fb->zs.preload.z = !fb->zs.clear.z && valid;
-                fb->zs.preload.s = !fb->zs.clear.s && valid;
-        }
+        memset(ctx->trace.bo->ptr.cpu + slot * PAN_TRACE_SLOT_SIZE, 0,
+               PAN_TRACE_SLOT_SIZE);
+
+        ctx->trace.batches[slot] = (struct panfrost_perfetto_batch) {
+                .seqnum = batch->seqnum,
+                .reason = batch->flush_reason,
+                .submit_ns = now,
+        };
+
+        ctx->trace.pending[slot] = mask;
+        batch->trace_ts = ctx->trace.bo->ptr.gpu + slot * PAN_TRACE_SLOT_SIZE;
 }
 
-static int
-panfrost_batch_submit_kbase(struct panfrost_device *dev,
-                            struct drm_panfrost_submit *submit,
-                            struct kbase_syncobj *syncobj)
+/* End the batch tracepoint once the fragment job is in, and hand the
+ * tracepoints to the context, along with the queue points to wait for before
+ * reading their timestamps */
+static void
+panfrost_batch_utrace_flush(struct panfrost_batch *batch,
+                            const struct pan_fb_info *fb, const char *reason)
 {
-        dev->mali.handle_events(&dev->mali);
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
 
-        int atom = dev->mali.submit(&dev->mali,
-                                    submit->jc,
-                                    submit->requirements,
-                                    syncobj,
-                                    (int32_t *)(uintptr_t) submit->bo_handles,
-                                    submit->bo_handle_count);
+        if (!u_trace_enabled(&ctx->utrace))
+                return;
 
-        if (atom == -1) {
-                errno = EINVAL;
-                return -1;
+        unsigned preload = 0;
+
+        for (unsigned i = 0; i < fb->rt_count; ++i) {
+                if (fb->rts[i].preload)
+                        preload |= PIPE_CLEAR_COLOR0 << i;
         }
 
-        return 0;
+        if (fb->zs.preload.z)
+                preload |= PIPE_CLEAR_DEPTH;
+
+        if (fb->zs.preload.s)
+                preload |= PIPE_CLEAR_STENCIL;
+
+        trace_end_batch(&batch->trace, batch, reason ? reason : "",
+                        batch->draws, batch->clear, preload);
+
+        if (!u_trace_has_points(&batch->trace))
+                return;
+
+        struct panfrost_trace_flush *flush = calloc(1, sizeof(*flush));
+        pan_command_stream v = batch->cs_vertex_last_size ?
+                batch->cs_vertex_first : batch->cs_vertex;
+
+        if (v.ptr != v.begin) {
+                struct panfrost_cs *cs = batch->compute ?
+                        &ctx->kbase_cs_compute : &ctx->kbase_cs_vertex;
+                unsigned q = flush->nr_queues++;
+
+                flush->queues[q].event = dev->mali.event_mem.cpu +
+                        cs->base.event_mem_offset * PAN_EVENT_SIZE;
+                flush->queues[q].seqnum = batch->compute ?
+                        batch->compute_seqnum : batch->vertex_seqnum;
+        }
+
+        if (batch->cs_fragment.ptr != batch->cs_fragment.begin) {
+                unsigned q = flush->nr_queues++;
+
+                flush->queues[q].event = dev->mali.event_mem.cpu +
+                        ctx->kbase_cs_fragment.base.event_mem_offset * PAN_EVENT_SIZE;
+                flush->queues[q].seqnum = batch->fragment_seqnum;
+        }
+
+        u_trace_flush(&batch->trace, flush, true);
 }
 
 static int
-panfrost_batch_submit_ioctl(struct panfrost_batch *batch,
-                            mali_ptr first_job_desc,
-                            uint32_t reqs,
-                            uint32_t in_sync,
-                            uint32_t out_sync)
+panfrost_batch_submit_csf(struct panfrost_batch *batch)
 {
         struct panfrost_context *ctx = batch->ctx;
-        struct pipe_context *gallium = (struct pipe_context *) ctx;
-        struct panfrost_device *dev = pan_device(gallium->screen);
-        struct drm_panfrost_submit submit = {0,};
-        uint32_t in_syncs[2];
-        uint32_t *bo_handles;
-        int ret;
+        struct pipe_screen *pscreen = ctx->base.screen;
+        struct panfrost_screen *screen = pan_screen(pscreen);
+        struct panfrost_device *dev = pan_device(pscreen);
 
-        /* If we trace, we always need a syncobj, so make one of our own if we
-         * weren't given one to use. Remember that we did so, so we can free it
-         * after we're done but preventing double-frees if we were given a
-         * syncobj */
+        ctx->kbase_cs_vertex.seqnum = batch->vertex_seqnum;
+        ctx->kbase_cs_fragment.seqnum = batch->fragment_seqnum;
+        ctx->kbase_cs_compute.seqnum = batch->compute_seqnum;
 
-        if (!out_sync && dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
-                out_sync = ctx->syncobj;
+        /* Compute batches run their "vertex" stream on the compute queue */
+        struct panfrost_cs *vertex_cs = batch->compute ?
+                &ctx->kbase_cs_compute : &ctx->kbase_cs_vertex;
 
-        submit.out_sync = out_sync;
-        submit.jc = first_job_desc;
-        submit.requirements = reqs;
+        /* BO usage is tracked without a global lock, so batches from
+         * different contexts accessing the same BO at the same time are not
+         * ordered against each other. Like with any other driver, the
+         * application has to synchronise such accesses itself. */
+        struct panfrost_bo_set *set = &batch->resource_bos;
 
-        if (in_sync)
-                in_syncs[submit.in_sync_count++] = in_sync;
+        for (unsigned e = 0; e < set->capacity; ++e) {
+                struct panfrost_bo *bo = set->entries[e].bo;
 
-        if (ctx->in_sync_fd >= 0) {
-                ret = drmSyncobjImportSyncFile(dev->fd, ctx->in_sync_obj,
-                                               ctx->in_sync_fd);
-                assert(!ret);
+                if (!bo)
+                        continue;
 
-                in_syncs[submit.in_sync_count++] = ctx->in_sync_obj;
-                close(ctx->in_sync_fd);
-                ctx->in_sync_fd = -1;
+                u_foreach_bit(i, set->entries[e].usage) {
+                        bool write = panfrost_usage_writes(i);
+                        struct util_dynarray *deps;
+                        unsigned queue;
+                        uint64_t seqnum;
+
+                        if (panfrost_usage_fragment(i)) {
+                                deps = &batch->frag_deps;
+                                queue = ctx->kbase_cs_fragment.base.event_mem_offset;
+                                seqnum = ctx->kbase_cs_fragment.seqnum;
+                        } else {
+                                deps = &batch->vert_deps;
+                                queue = vertex_cs->base.event_mem_offset;
+                                seqnum = vertex_cs->seqnum;
+                        }
+
+                        panfrost_update_deps(deps, bo, write);
+                        struct panfrost_usage u = {
+                                .queue = queue,
+                                .write = write,
+                                .seqnum = seqnum,
+                        };
+
+                        panfrost_bo_add_usage(bo, u);
+                }
         }
 
-        if (submit.in_sync_count)
-                submit.in_syncs = (uintptr_t)in_syncs;
+        /* Only a single batch can use each tiler heap at once, but batches
+         * rotate between heaps, so this only waits for the fragment job of
+         * an older batch than the previous one */
+        struct panfrost_bo *heap = batch->tiler_heap_held ?
+                ctx->tiler_heap_desc[batch->tiler_heap] : NULL;
 
-        bo_handles = calloc(panfrost_pool_num_bos(&batch->pool) +
-                            panfrost_pool_num_bos(&batch->invisible_pool) +
-                            batch->num_bos + 2,
-                            sizeof(*bo_handles));
-        assert(bo_handles);
+        if (heap && !batch->compute) {
+                panfrost_update_deps(&batch->vert_deps, heap, true);
 
-        pan_bo_access *flags = util_dynarray_begin(&batch->bos);
-        unsigned end_bo = util_dynarray_num_elements(&batch->bos, pan_bo_access);
+                struct panfrost_usage u = {
+                        .queue = ctx->kbase_cs_fragment.base.event_mem_offset,
+                        .write = true,
+                        .seqnum = ctx->kbase_cs_fragment.seqnum,
+                };
+                panfrost_bo_add_usage(heap, u);
+        }
 
-        for (int i = 0; i < end_bo; ++i) {
-                if (!flags[i])
-                        continue;
+        /* TODO: Use atomics in kbase code to avoid lock? */
+        pthread_mutex_lock(&dev->mali.queue_lock);
 
-                assert(submit.bo_handle_count < batch->num_bos);
-                bo_handles[submit.bo_handle_count++] = i;
+        panfrost_clean_deps(dev, &batch->vert_deps);
+        panfrost_clean_deps(dev, &batch->frag_deps);
 
-                /* Update the BO access flags so that panfrost_bo_wait() knows
-                 * about all pending accesses.
-                 * We only keep the READ/WRITE info since this is all the BO
-                 * wait logic cares about.
-                 * We also preserve existing flags as this batch might not
-                 * be the first one to access the BO.
-                 */
-                struct panfrost_bo *bo = pan_lookup_bo_existing(dev, i);
+        pthread_mutex_unlock(&dev->mali.queue_lock);
 
-                bo->gpu_access |= flags[i] & (PAN_BO_ACCESS_RW);
+        screen->vtbl.emit_csf_toplevel(batch);
+
+        uint64_t vs_offset = ctx->kbase_cs_vertex.offset +
+                (void *)ctx->kbase_cs_vertex.cs.ptr - ctx->kbase_cs_vertex.bo->ptr.cpu;
+        uint64_t fs_offset = ctx->kbase_cs_fragment.offset +
+                (void *)ctx->kbase_cs_fragment.cs.ptr - ctx->kbase_cs_fragment.bo->ptr.cpu;
+        uint64_t cs_offset = ctx->kbase_cs_compute.offset +
+                (void *)ctx->kbase_cs_compute.cs.ptr - ctx->kbase_cs_compute.bo->ptr.cpu;
+
+        if (dev->debug & PAN_DBG_TRACE) {
+                pandecode_cs_ring(dev, &ctx->kbase_cs_vertex, vs_offset);
+                pandecode_cs_ring(dev, &ctx->kbase_cs_fragment, fs_offset);
+                pandecode_cs_ring(dev, &ctx->kbase_cs_compute, cs_offset);
         }
 
-        panfrost_pool_get_bo_handles(&batch->pool, bo_handles + submit.bo_handle_count);
-        submit.bo_handle_count += panfrost_pool_num_bos(&batch->pool);
-        panfrost_pool_get_bo_handles(&batch->invisible_pool, bo_handles + submit.bo_handle_count);
-        submit.bo_handle_count += panfrost_pool_num_bos(&batch->invisible_pool);
+        if (panfrost_batch_captured(batch)) {
+                /* Wait so that the next snapshot sees what the GPU wrote */
+                batch->needs_sync = true;
+
+                struct pan_capture_ring rings[PAN_CAPTURE_QUEUES] = {
+                        panfrost_capture_ring(&ctx->kbase_cs_vertex, vs_offset),
+                        panfrost_capture_ring(&ctx->kbase_cs_fragment, fs_offset),
+                        panfrost_capture_ring(&ctx->kbase_cs_compute, cs_offset),
+                };
+
+                pan_capture_snapshot(ctx->capture.file, ctx->kbase_ctx);
+                pan_capture_submit(ctx->capture.file, rings);
+        }
+
+        bool log = (dev->debug & PAN_DBG_LOG);
+
+        if (log)
+                printf("About to submit\n");
+
+        dev->mali.cs_submit(&dev->mali, &ctx->kbase_cs_vertex.base, vs_offset,
+                            ctx->syncobj_kbase, ctx->kbase_cs_vertex.seqnum);
+
+        dev->mali.cs_submit(&dev->mali, &ctx->kbase_cs_fragment.base, fs_offset,
+                            ctx->syncobj_kbase, ctx->kbase_cs_fragment.seqnum);
+
+        dev->mali.cs_submit(&dev->mali, &ctx->kbase_cs_compute.base, cs_offset,
+                            ctx->syncobj_kbase, ctx->kbase_cs_compute.seqnum);
+
+        bool reset = false;
+
+        // TODO: How will we know to reset a CS when waiting is not done?
+        if (batch->needs_sync) {
+                /* A batch taking longer than a second is assumed to have
+                 * hung */
+                int64_t timeout = 1000000000LL;
+
+                if (!dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_vertex.base, vs_offset, ctx->syncobj_kbase, timeout))
+                        reset = true;
+
+                if (!dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_fragment.base, fs_offset, ctx->syncobj_kbase, timeout))
+                        reset = true;
 
-        /* Add the tiler heap to the list of accessed BOs if the batch has at
-         * least one tiler job. Tiler heap is written by tiler jobs and read
-         * by fragment jobs (the polygon list is coming from this heap).
-         */
-        if (batch->scoreboard.first_tiler)
-                bo_handles[submit.bo_handle_count++] = dev->tiler_heap->gem_handle;
+                if (!dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_compute.base, cs_offset, ctx->syncobj_kbase, timeout))
+                        reset = true;
+        }
 
-        /* Always used on Bifrost, occassionally used on Midgard */
-        bo_handles[submit.bo_handle_count++] = dev->sample_positions->gem_handle;
+        if (dev->debug & PAN_DBG_TILER) {
+                fflush(stdout);
+                FILE *stream = popen("tiler-hex-read", "w");
 
-        submit.bo_handles = (u64) (uintptr_t) bo_handles;
-        if (ctx->is_noop)
-                ret = 0;
-        else if (dev->kbase)
-                ret = panfrost_batch_submit_kbase(dev, &submit, ctx->syncobj_kbase);
-        else
-                ret = drmIoctl(dev->fd, DRM_IOCTL_PANFROST_SUBMIT, &submit);
-        free(bo_handles);
+                /* TODO: Dump more than just the first chunk */
+                unsigned size = batch->ctx->kbase_ctx->tiler_heap_chunk_size;
+                uint64_t va = batch->ctx->kbase_ctx->tiler_heaps[batch->tiler_heap].header;
 
-        if (ret)
-                return errno;
+                fprintf(stream, "width %i\n" "height %i\n" "mask %i\n"
+                        "vaheap 0x%"PRIx64"\n" "size %i\n",
+                        batch->key.width, batch->key.height, 0xfe, va, size);
 
-        /* Trace the job if we're doing that */
-        if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC)) {
-                /* Wait so we can get errors reported back */
-                if (dev->kbase)
-                        dev->mali.syncobj_wait(&dev->mali, ctx->syncobj_kbase);
-                else
-                        drmSyncobjWait(dev->fd, &out_sync, 1,
-                                       INT64_MAX, 0, NULL);
+                void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                 MAP_SHARED, dev->mali.fd, va);
 
-                if (dev->debug & PAN_DBG_TRACE)
-                        pandecode_jc(submit.jc, dev->gpu_id);
+                pan_hexdump(stream, ptr, size, false);
+                //memset(ptr, 0, size);
+                munmap(ptr, size);
 
-                if (dev->debug & PAN_DBG_DUMP)
-                        pandecode_dump_mappings();
+                pclose(stream);
+        }
 
-                /* Jobs won't be complete if blackhole rendering, that's ok */
-                if (!ctx->is_noop && dev->debug & PAN_DBG_SYNC)
-                        pandecode_abort_on_fault(submit.jc, dev->gpu_id);
+        if (reset) {
+                panfrost_hang_report(batch, vs_offset, fs_offset, cs_offset);
+                reset_context(ctx);
         }
 
         return 0;
 }
 
-static bool
-panfrost_has_fragment_job(struct panfrost_batch *batch)
+static void
+panfrost_batch_submit_job(void *job, void *gdata, int thread_index)
 {
-        return batch->scoreboard.first_tiler || batch->clear;
+        struct panfrost_batch *batch = job;
+        struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
+
+        int ret = panfrost_batch_submit_csf(batch);
+
+        if (ret)
+                fprintf(stderr, "panfrost_batch_submit failed: %d\n", ret);
+
+        /* The BO usage is recorded now, so the references can go */
+        panfrost_batch_release(dev, batch);
+        free(batch);
 }
 
-/* Submit both vertex/tiler and fragment jobs for a batch, possibly with an
- * outsync corresponding to the later of the two (since there will be an
- * implicit dep between them) */
+/* Hand the kbase side of a submit over to the submit queue. The queued copy
+ * of the batch owns its BOs, pools and dependency lists, while resources and
+ * the framebuffer key stay with the slot, which is recycled straight away.
+ * Jobs run in order on a single thread, so dependencies are tracked in the
+ * same order as without the queue. */
 
-static int
-panfrost_batch_submit_jobs(struct panfrost_batch *batch,
-                           const struct pan_fb_info *fb,
-                           uint32_t in_sync, uint32_t out_sync)
+static void
+panfrost_batch_queue_csf(struct panfrost_batch *batch)
 {
-        struct pipe_screen *pscreen = batch->ctx->base.screen;
-        struct panfrost_screen *screen = pan_screen(pscreen);
-        struct panfrost_device *dev = pan_device(pscreen);
-        bool has_draws = batch->scoreboard.first_job;
-        bool has_tiler = batch->scoreboard.first_tiler;
-        bool has_frag = panfrost_has_fragment_job(batch);
-        int ret = 0;
+        struct panfrost_context *ctx = batch->ctx;
+        struct panfrost_batch *job = malloc(sizeof(*job));
 
-        /* Take the submit lock to make sure no tiler jobs from other context
-         * are inserted between our tiler and fragment jobs, failing to do that
-         * might result in tiler heap corruption.
-         */
-        if (has_tiler)
-                pthread_mutex_lock(&dev->submit_lock);
+        memcpy(job, batch, sizeof(*job));
 
-        if (has_draws) {
-                ret = panfrost_batch_submit_ioctl(batch, batch->scoreboard.first_job,
-                                                  0, in_sync, has_frag ? 0 : out_sync);
+        job->resources = NULL;
+        job->key.nr_cbufs = 0;
+        memset(job->key.cbufs, 0, sizeof(job->key.cbufs));
+        job->key.zsbuf = NULL;
 
-                if (ret)
-                        goto done;
+        if (!batch->needs_sync) {
+                util_queue_add_job(&ctx->submit.queue, job, NULL,
+                                   panfrost_batch_submit_job, NULL, 0);
+                return;
         }
 
-        if (has_frag) {
-                mali_ptr fragjob = screen->vtbl.emit_fragment_job(batch, fb);
-                ret = panfrost_batch_submit_ioctl(batch, fragjob,
-                                                  PANFROST_JD_REQ_FS, 0,
-                                                  out_sync);
-                if (ret)
-                        goto done;
-        }
+        /* Context resets are only done for synchronous batches, so waiting
+         * here also keeps the reset from racing with this thread. */
+        struct util_queue_fence fence;
+        util_queue_fence_init(&fence);
 
-done:
-        if (has_tiler)
-                pthread_mutex_unlock(&dev->submit_lock);
+        util_queue_add_job(&ctx->submit.queue, job, &fence,
+                           panfrost_batch_submit_job, NULL, 0);
 
-        return ret;
+        util_queue_fence_wait(&fence);
+        util_queue_fence_destroy(&fence);
 }
 
-#define BASE_MEM_MMU_DUMP_HANDLE (1 << 12)
+/* Wait for the submit queue to hand all queued batches to kbase, which is
+ * needed before checking BO usage on the CPU */
 
-static void
-mmu_dump(struct panfrost_device *dev)
+void
+panfrost_flush_submit_queue(struct panfrost_context *ctx)
 {
-        unsigned size = 16 * 1024 * 1024;
+        if (util_queue_is_initialized(&ctx->submit.queue))
+                util_queue_finish(&ctx->submit.queue);
+}
 
-        fprintf(stderr, "dumping MMU tables\n");
-        sleep(3);
+/* On v10, build a tile enable map from the regions touched by the batch,
+ * clipped to the damage extent of the first render target, so the fragment
+ * job skips preloading, shading and writing back everything else. Tiles
+ * outside the map keep their contents, so this is only possible when the
+ * batch does not clear. */
 
-        void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED,
-                         dev->mali.fd, BASE_MEM_MMU_DUMP_HANDLE);
-        if (mem == MAP_FAILED) {
-                perror("mmap(BASE_MEM_MMU_DUMP_HANDLE)");
-                return;;
-        }
+static bool
+panfrost_emit_draw_tile_map(struct panfrost_batch *batch,
+                            struct panfrost_resource *pres,
+                            struct pan_fb_info *fb)
+{
+        if (batch->clear || batch->tile_mask.full || !batch->tile_mask.data)
+                return false;
 
-        fprintf(stderr, "writing to file\n");
-        sleep(1);
+        unsigned stride = batch->tile_mask.stride;
+        unsigned size = stride * DIV_ROUND_UP(batch->key.height, 32);
+        unsigned tx_start = fb->extent.minx / 32, tx_end = fb->extent.maxx / 32;
+        unsigned ty_start = fb->extent.miny / 32, ty_end = fb->extent.maxy / 32;
 
-        char template[] = {"/tmp/mmu-dump.XXXXXX"};
-        int fd = mkstemp(template);
-        if (fd == -1) {
-                perror("mkstemp(/tmp/mmu-dump.XXXXXX)");
-                goto unmap;
-        }
+        if (pres) {
+                const struct pipe_scissor_state *damage = &pres->damage.extent;
 
-        write(fd, mem, size);
-        close(fd);
+                if (damage->minx >= damage->maxx || damage->miny >= damage->maxy)
+                        return false;
 
-unmap:
-        munmap(mem, size);
-}
+                tx_start = MAX2(tx_start, damage->minx / 32);
+                ty_start = MAX2(ty_start, damage->miny / 32);
+                tx_end = MIN2(tx_end, (damage->maxx - 1) / 32);
+                ty_end = MIN2(ty_end, (damage->maxy - 1) / 32);
+        }
 
-static void
-reset_context(struct panfrost_context *ctx)
-{
-        struct pipe_screen *pscreen = ctx->base.screen;
-        struct panfrost_screen *screen = pan_screen(pscreen);
-        struct panfrost_device *dev = pan_device(pscreen);
+        if (tx_start > tx_end || ty_start > ty_end)
+                return false;
 
-        /* Don't recover from the fault if PAN_MESA_DEBUG=sync is specified,
-         * to somewhat mimic behaviour with JM GPUs. TODO: Just abort? */
-        bool recover = !(dev->debug & PAN_DBG_SYNC);
+        unsigned region_count = (tx_end - tx_start + 1) *
+                                (ty_end - ty_start + 1);
+        unsigned enable_count = 0;
+        unsigned minx = ~0, miny = ~0, maxx = 0, maxy = 0;
 
-        mesa_loge("Context reset");
+        BITSET_WORD *map = calloc(size, 1);
+        if (!map)
+                return false;
 
-        dev->mali.cs_term(&dev->mali, &ctx->kbase_cs_vertex.base);
-        dev->mali.cs_term(&dev->mali, &ctx->kbase_cs_fragment.base);
+        for (unsigned ty = ty_start; ty <= ty_end; ty++) {
+                for (unsigned tx = tx_start; tx <= tx_end; tx++) {
+                        unsigned b = (ty * stride * 8) + tx;
 
-        dev->mali.context_recreate(&dev->mali, ctx->kbase_ctx);
+                        if (!BITSET_TEST(batch->tile_mask.data, b))
+                                continue;
 
-        //mmu_dump(dev);
+                        BITSET_SET(map, b);
+                        enable_count++;
+                        minx = MIN2(minx, tx);
+                        miny = MIN2(miny, ty);
+                        maxx = MAX2(maxx, tx);
+                        maxy = MAX2(maxy, ty);
+                }
+        }
 
-        if (recover) {
-                dev->mali.cs_rebind(&dev->mali, &ctx->kbase_cs_vertex.base);
-                dev->mali.cs_rebind(&dev->mali, &ctx->kbase_cs_fragment.base);
-        } else {
-                ctx->kbase_cs_vertex.base.user_io = NULL;
-                ctx->kbase_cs_fragment.base.user_io = NULL;
+        /* As with damage maps, don't bother when nearly every region would be
+         * processed anyway */
+        if (!enable_count || region_count - enable_count < 10) {
+                free(map);
+                return false;
         }
 
-        ctx->kbase_cs_vertex.base.last_insert = 0;
-        ctx->kbase_cs_fragment.base.last_insert = 0;
+        fb->tile_map.base = pan_pool_upload_aligned(&batch->pool.base,
+                                                    map, size, 64);
+        fb->tile_map.stride = stride;
+        free(map);
+
+        /* Also shrink the bounding box to the enabled regions */
+        fb->extent.minx = MAX2(fb->extent.minx, minx * 32);
+        fb->extent.miny = MAX2(fb->extent.miny, miny * 32);
+        fb->extent.maxx = MIN2(fb->extent.maxx, (maxx * 32) + 31);
+        fb->extent.maxy = MIN2(fb->extent.maxy, (maxy * 32) + 31);
+        return true;
+}
 
-        screen->vtbl.init_cs(ctx, &ctx->kbase_cs_vertex);
-        screen->vtbl.init_cs(ctx, &ctx->kbase_cs_fragment);
+static void
+panfrost_emit_tile_map(struct panfrost_batch *batch, struct pan_fb_info *fb)
+{
+        struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
+        struct pipe_surface *surf =
+                batch->key.nr_cbufs ? batch->key.cbufs[0] : NULL;
+        struct panfrost_resource *pres = surf ? pan_resource(surf->texture) : NULL;
 
-        /* TODO: this leaks memory */
-        ctx->tiler_heap_desc = 0;
+        if (pres && pres->damage.tile_map.enable) {
+                fb->tile_map.base =
+                        pan_pool_upload_aligned(&batch->pool.base,
+                                                pres->damage.tile_map.data,
+                                                pres->damage.tile_map.size,
+                                                64);
+                fb->tile_map.stride = pres->damage.tile_map.stride;
+        } else if (dev->arch >= 10 && panfrost_has_fragment_job(batch)) {
+                panfrost_emit_draw_tile_map(batch, pres, fb);
+        }
 }
 
-static void
-pandecode_cs_ring(struct panfrost_device *dev, struct panfrost_cs *cs,
-                  uint64_t insert)
+/* Clear-only batches of colour surfaces are not submitted. Instead the clear
+ * is kept in the resource and folded into the next batch rendering to the
+ * surface, so a render target which is cleared and then overdrawn is only
+ * written to memory once. Any other access to the resource writes the clear
+ * out first. Also write out the clears at pipe->flush, after which other
+ * contexts may access the resource. */
+
+static bool
+panfrost_pending_clear_matches(struct panfrost_resource *rsrc,
+                               struct pipe_surface *surf)
 {
-        insert %= cs->base.size;
-        uint64_t start = cs->base.last_insert % cs->base.size;
+        return rsrc->pending_clear.level == surf->u.tex.level &&
+               rsrc->pending_clear.layer == surf->u.tex.first_layer &&
+               surf->u.tex.first_layer == surf->u.tex.last_layer;
+}
 
-        if (insert < start) {
-                pandecode_cs(cs->base.va + start, cs->base.size - start, dev->gpu_id);
-                start = 0;
+/* Drop the references to resources whose clear was folded or written out */
+
+static void
+panfrost_compact_pending_clears(struct panfrost_context *ctx)
+{
+        struct pipe_resource **list = ctx->pending_clears.data;
+        unsigned count = util_dynarray_num_elements(&ctx->pending_clears,
+                                                    struct pipe_resource *);
+        unsigned kept = 0;
+
+        for (unsigned i = 0; i < count; ++i) {
+                if (pan_resource(list[i])->pending_clear.valid)
+                        list[kept++] = list[i];
+                else
+                        pipe_resource_reference(&list[i], NULL);
         }
 
-        pandecode_cs(cs->base.va + start, insert - start, dev->gpu_id);
+        ctx->pending_clears.size = kept * sizeof(struct pipe_resource *);
 }
 
-static unsigned
-panfrost_add_dep_after(struct util_dynarray *deps,
-                       struct panfrost_usage u,
-                       unsigned index)
+static bool
+panfrost_batch_defer_clears(struct panfrost_batch *batch)
 {
-        unsigned size = util_dynarray_num_elements(deps, struct panfrost_usage);
+        struct panfrost_context *ctx = batch->ctx;
 
-        for (unsigned i = index; i < size; ++i) {
-                struct panfrost_usage *d =
-                        util_dynarray_element(deps, struct panfrost_usage, i);
+        /* Dependents are recorded against the contents of the batch, so a
+         * clear they rely on has to be written out */
+        if (batch->scoreboard.first_job || batch->keep_clears ||
+            panfrost_batch_has_dependents(batch) ||
+            !(batch->clear & PIPE_CLEAR_COLOR) ||
+            (batch->clear & PIPE_CLEAR_DEPTHSTENCIL) ||
+            util_framebuffer_get_num_samples(&batch->key) > 1)
+                return false;
 
-                /* TODO: Remove d if it is an invalid entry? */
+        for (unsigned i = 0; i < batch->key.nr_cbufs; ++i) {
+                struct pipe_surface *surf = batch->key.cbufs[i];
 
-                if ((d->queue == u.queue) && (d->write == u.write)) {
-                        d->seqnum = MAX2(d->seqnum, u.seqnum);
-                        return i;
+                if (!surf || !(batch->clear & (PIPE_CLEAR_COLOR0 << i)))
+                        continue;
 
-                } else if (d->queue > u.queue) {
-                        void *p = util_dynarray_grow(deps, struct panfrost_usage, 1);
-                        assert(p);
-                        memmove(util_dynarray_element(deps, struct panfrost_usage, i + 1),
-                                util_dynarray_element(deps, struct panfrost_usage, i),
-                                (size - i) * sizeof(struct panfrost_usage));
+                struct panfrost_resource *rsrc = pan_resource(surf->texture);
 
-                        *util_dynarray_element(deps, struct panfrost_usage, i) = u;
-                        return i;
+                /* Pending clears of another subresource would have to be
+                 * written out by a batch of their own */
+                if (rsrc->base.target == PIPE_BUFFER ||
+                    (rsrc->base.bind & PAN_BIND_SHARED_MASK) ||
+                    rsrc->base.nr_samples > 1 ||
+                    surf->u.tex.first_layer != surf->u.tex.last_layer ||
+                    (rsrc->pending_clear.valid &&
+                     !panfrost_pending_clear_matches(rsrc, surf)))
+                        return false;
+        }
+
+        panfrost_compact_pending_clears(ctx);
+
+        for (unsigned i = 0; i < batch->key.nr_cbufs; ++i) {
+                struct pipe_surface *surf = batch->key.cbufs[i];
+
+                if (!surf || !(batch->clear & (PIPE_CLEAR_COLOR0 << i)))
+                        continue;
+
+                struct panfrost_resource *rsrc = pan_resource(surf->texture);
+
+                if (!rsrc->pending_clear.valid) {
+                        struct pipe_resource *ref = NULL;
+
+                        pipe_resource_reference(&ref, &rsrc->base);
+                        util_dynarray_append(&ctx->pending_clears,
+                                             struct pipe_resource *, ref);
                 }
+
+                rsrc->pending_clear.valid = true;
+                rsrc->pending_clear.format = surf->format;
+                rsrc->pending_clear.level = surf->u.tex.level;
+                rsrc->pending_clear.layer = surf->u.tex.first_layer;
+                memcpy(rsrc->pending_clear.color, batch->clear_color[i],
+                       sizeof(rsrc->pending_clear.color));
+
+                panfrost_resource_set_valid(rsrc, surf->u.tex.level);
         }
 
-        util_dynarray_append(deps, struct panfrost_usage, u);
-        return size;
+        return true;
 }
 
 static void
-panfrost_update_deps(struct util_dynarray *deps, struct panfrost_bo *bo, bool write)
+panfrost_batch_fold_clears(struct panfrost_batch *batch)
 {
-        /* Both lists should be sorted, so each dependency is at a higher
-         * index than the last */
-        unsigned index = 0;
-        util_dynarray_foreach(&bo->usage, struct panfrost_usage, u) {
-                /* read->read access does not require a dependency */
-                if (!write && !u->write)
+        for (unsigned i = 0; i < batch->key.nr_cbufs; ++i) {
+                struct pipe_surface *surf = batch->key.cbufs[i];
+                unsigned mask = PIPE_CLEAR_COLOR0 << i;
+
+                if (!surf)
                         continue;
 
-                index = panfrost_add_dep_after(deps, *u, index);
-        }
-}
+                struct panfrost_resource *rsrc = pan_resource(surf->texture);
 
-static inline bool
-panfrost_usage_writes(enum panfrost_usage_type usage)
-{
-        return (usage == PAN_USAGE_WRITE_VERTEX) || (usage == PAN_USAGE_WRITE_FRAGMENT);
-}
+                if (!rsrc->pending_clear.valid ||
+                    !panfrost_pending_clear_matches(rsrc, surf))
+                        continue;
 
-static inline bool
-panfrost_usage_fragment(enum panfrost_usage_type usage)
-{
-        return (usage == PAN_USAGE_READ_FRAGMENT) || (usage == PAN_USAGE_WRITE_FRAGMENT);
+                rsrc->pending_clear.valid = false;
+
+                /* A clear of our own supersedes it */
+                if (batch->clear & mask)
+                        continue;
+
+                /* Draws using another format were preceded by a write out
+                 * in panfrost_flush_bound_pending_clears() */
+                assert(surf->format == rsrc->pending_clear.format);
+
+                batch->clear |= mask;
+                batch->resolve |= mask;
+                memcpy(batch->clear_color[i], rsrc->pending_clear.color,
+                       sizeof(batch->clear_color[i]));
+
+                /* The clear colour has to reach every tile */
+                batch->minx = batch->miny = 0;
+                batch->maxx = batch->key.width;
+                batch->maxy = batch->key.height;
+                batch->tile_mask.full = true;
+        }
 }
 
-/* Removes invalid dependencies from deps */
-static void
-panfrost_clean_deps(struct panfrost_device *dev, struct util_dynarray *deps)
+void
+panfrost_flush_pending_clear(struct panfrost_context *ctx,
+                             struct panfrost_resource *rsrc,
+                             const char *reason)
 {
-        kbase k = &dev->mali;
+        if (!rsrc->pending_clear.valid)
+                return;
 
-        struct panfrost_usage *rebuild = util_dynarray_begin(deps);
-        unsigned index = 0;
+        /* Batches already rendering to the surface fold the clear when
+         * submitted, and have to come first anyway */
+        panfrost_flush_batches_accessing_rsrc(ctx, rsrc, reason);
 
-        util_dynarray_foreach(deps, struct panfrost_usage, u) {
-                /* Usages are ordered, so we can break here */
-                if (u->queue >= k->event_slot_usage)
-                        break;
+        if (!rsrc->pending_clear.valid)
+                return;
 
-                struct kbase_event_slot *slot = &k->event_slots[u->queue];
-                uint64_t seqnum = u->seqnum;
+        perf_debug_ctx(ctx, "Writing out deferred clear due to: %s", reason);
+        rsrc->pending_clear.valid = false;
+
+        unsigned level = rsrc->pending_clear.level;
+        struct pipe_surface tmpl = {
+                .format = rsrc->pending_clear.format,
+                .u.tex = {
+                        .level = level,
+                        .first_layer = rsrc->pending_clear.layer,
+                        .last_layer = rsrc->pending_clear.layer,
+                },
+        };
 
-                /* There is a race condition, where we can depend on an
-                 * unsubmitted batch. In that cade, decrease the seqnum.
-                 * Otherwise, skip invalid dependencies. */
-                if (slot->last_submit == seqnum)
-                        --seqnum;
-                else if (slot->last_submit < seqnum)
-                        continue;
+        struct pipe_surface *surf =
+                ctx->base.create_surface(&ctx->base, &rsrc->base, &tmpl);
 
-                /* This usage is valid, add it to the returned list */
-                rebuild[index++] = (struct panfrost_usage) {
-                        .queue = u->queue,
-                        .write = u->write,
-                        .seqnum = seqnum,
-                };
-        }
+        if (!surf)
+                return;
+
+        struct pipe_framebuffer_state key = {
+                .width = u_minify(rsrc->base.width0, level),
+                .height = u_minify(rsrc->base.height0, level),
+                .layers = 1,
+                .nr_cbufs = 1,
+                .cbufs = { surf },
+        };
 
-        /* No need to check the return value, it can only shrink */
-        (void)! util_dynarray_resize(deps, struct panfrost_usage, index);
+        struct panfrost_batch *batch = panfrost_get_batch(ctx, &key);
+
+        batch->keep_clears = true;
+        batch->clear |= PIPE_CLEAR_COLOR0;
+        batch->resolve |= PIPE_CLEAR_COLOR0;
+        memcpy(batch->clear_color[0], rsrc->pending_clear.color,
+               sizeof(batch->clear_color[0]));
+        panfrost_batch_union_scissor(batch, 0, 0, key.width, key.height);
+
+        panfrost_batch_submit(ctx, batch, "Pending clear");
+        pipe_surface_reference(&surf, NULL);
 }
 
-static int
-panfrost_batch_submit_csf(struct panfrost_batch *batch,
-                          const struct pan_fb_info *fb)
+void
+panfrost_flush_pending_clears(struct panfrost_context *ctx)
 {
-        struct panfrost_context *ctx = batch->ctx;
-        struct pipe_screen *pscreen = ctx->base.screen;
-        struct panfrost_screen *screen = pan_screen(pscreen);
-        struct panfrost_device *dev = pan_device(pscreen);
-
-        ++ctx->kbase_cs_vertex.seqnum;
+        /* Batches submitted to make room for the write outs may defer more
+         * clears, so take the list first */
+        while (util_dynarray_num_elements(&ctx->pending_clears,
+                                          struct pipe_resource *)) {
+                struct util_dynarray list = ctx->pending_clears;
+
+                util_dynarray_init(&ctx->pending_clears, list.mem_ctx);
+
+                util_dynarray_foreach(&list, struct pipe_resource *, prsrc) {
+                        panfrost_flush_pending_clear(ctx, pan_resource(*prsrc),
+                                                     "Flush");
+                        pipe_resource_reference(prsrc, NULL);
+                }
 
-        if (panfrost_has_fragment_job(batch)) {
-                screen->vtbl.emit_fragment_job(batch, fb);
-                ++ctx->kbase_cs_fragment.seqnum;
+                util_dynarray_fini(&list);
         }
+}
 
-        pthread_mutex_lock(&dev->bo_usage_lock);
-        for (unsigned i = 0; i < PAN_USAGE_COUNT; ++i) {
+/* Called before draws and dispatches, for the resources they may access
+ * other than through render targets matching the pending clear */
 
-                bool write = panfrost_usage_writes(i);
-                pan_bo_access access = write ? PAN_BO_ACCESS_RW : PAN_BO_ACCESS_READ;
-                struct util_dynarray *deps;
-                unsigned queue;
-                uint64_t seqnum;
+void
+panfrost_flush_bound_pending_clears(struct panfrost_context *ctx)
+{
+        panfrost_compact_pending_clears(ctx);
 
-                if (panfrost_usage_fragment(i)) {
-                        deps = &batch->frag_deps;
-                        queue = ctx->kbase_cs_fragment.base.event_mem_offset;
-                        seqnum = ctx->kbase_cs_fragment.seqnum;
-                } else {
-                        deps = &batch->vert_deps;
-                        queue = ctx->kbase_cs_vertex.base.event_mem_offset;
-                        seqnum = ctx->kbase_cs_vertex.seqnum;
-                }
+        if (!util_dynarray_num_elements(&ctx->pending_clears,
+                                        struct pipe_resource *))
+                return;
 
-                util_dynarray_foreach(&batch->resource_bos[i], struct panfrost_bo *, bo) {
-                        panfrost_update_deps(deps, *bo, write);
-                        struct panfrost_usage u = {
-                                .queue = queue,
-                                .write = write,
-                                .seqnum = seqnum,
-                        };
+        for (unsigned s = 0; s < PIPE_SHADER_TYPES; ++s) {
+                for (unsigned i = 0; i < ctx->sampler_view_count[s]; ++i) {
+                        struct pipe_sampler_view *view =
+                                (struct pipe_sampler_view *) ctx->sampler_views[s][i];
 
-                        panfrost_add_dep_after(&(*bo)->usage, u, 0);
-                        (*bo)->gpu_access |= access;
+                        if (view && view->texture) {
+                                panfrost_flush_pending_clear(ctx,
+                                                pan_resource(view->texture),
+                                                "Sampling");
+                        }
                 }
-        }
-        pthread_mutex_unlock(&dev->bo_usage_lock);
 
-        /* For now, only a single batch can use each tiler heap at once */
-        if (ctx->tiler_heap_desc) {
-                panfrost_update_deps(&batch->vert_deps, ctx->tiler_heap_desc, true);
+                u_foreach_bit(i, ctx->image_mask[s]) {
+                        struct pipe_resource *prsrc = ctx->images[s][i].resource;
 
-                struct panfrost_usage u = {
-                        .queue = ctx->kbase_cs_fragment.base.event_mem_offset,
-                        .write = true,
-                        .seqnum = ctx->kbase_cs_fragment.seqnum,
-                };
-                panfrost_add_dep_after(&ctx->tiler_heap_desc->usage, u, 0);
+                        if (prsrc) {
+                                panfrost_flush_pending_clear(ctx,
+                                                pan_resource(prsrc),
+                                                "Image access");
+                        }
+                }
         }
 
-        /* TODO: Use atomics in kbase code to avoid lock? */
-        pthread_mutex_lock(&dev->mali.queue_lock);
+        const struct pipe_framebuffer_state *fb = &ctx->pipe_framebuffer;
 
-        panfrost_clean_deps(dev, &batch->vert_deps);
-        panfrost_clean_deps(dev, &batch->frag_deps);
+        for (unsigned i = 0; i < fb->nr_cbufs; ++i) {
+                struct pipe_surface *surf = fb->cbufs[i];
 
-        pthread_mutex_unlock(&dev->mali.queue_lock);
+                if (!surf)
+                        continue;
 
-        screen->vtbl.emit_csf_toplevel(batch);
+                struct panfrost_resource *rsrc = pan_resource(surf->texture);
 
-        uint64_t vs_offset = ctx->kbase_cs_vertex.offset +
-                (void *)ctx->kbase_cs_vertex.cs.ptr - ctx->kbase_cs_vertex.bo->ptr.cpu;
-        uint64_t fs_offset = ctx->kbase_cs_fragment.offset +
-                (void *)ctx->kbase_cs_fragment.cs.ptr - ctx->kbase_cs_fragment.bo->ptr.cpu;
+                if (!rsrc->pending_clear.valid)
+                        continue;
 
-        if (dev->debug & PAN_DBG_TRACE) {
-                pandecode_cs_ring(dev, &ctx->kbase_cs_vertex, vs_offset);
-                pandecode_cs_ring(dev, &ctx->kbase_cs_fragment, fs_offset);
+                bool covers = surf->u.tex.level == rsrc->pending_clear.level &&
+                              surf->u.tex.first_layer <= rsrc->pending_clear.layer &&
+                              surf->u.tex.last_layer >= rsrc->pending_clear.layer;
+
+                if (covers && (!panfrost_pending_clear_matches(rsrc, surf) ||
+                               surf->format != rsrc->pending_clear.format))
+                        panfrost_flush_pending_clear(ctx, rsrc, "Render target view");
         }
+}
 
-        bool log = (dev->debug & PAN_DBG_LOG);
+/* Transaction elimination only skips tiles once a full-frame write has
+ * filled the CRC buffer, and window systems tracking damage only redraw the
+ * damaged region, so the CRCs of a partially updated surface would never
+ * become valid. When the rest of the render target holds valid data, widen
+ * the first batch of the frame to the whole surface: the preload restores
+ * the undamaged tiles, and the CRC of every tile gets written. After that,
+ * partial batches keep the CRC buffer valid and unchanged tiles are no
+ * longer written back. */
 
-        // TODO: We need better synchronisation than a single fake syncobj!
+static void
+panfrost_batch_prime_crc(struct panfrost_batch *batch)
+{
+        if (batch->key.nr_cbufs != 1 || !batch->key.cbufs[0])
+                return;
 
-        if (log)
-                printf("About to submit\n");
+        struct pipe_surface *surf = batch->key.cbufs[0];
+        struct panfrost_resource *rsrc = pan_resource(surf->texture);
+        const struct pipe_scissor_state *damage = &rsrc->damage.extent;
+
+        if (!rsrc->image.layout.crc || rsrc->valid.crc ||
+            util_framebuffer_get_num_samples(&batch->key) > 1 ||
+            !(batch->draws & PIPE_CLEAR_COLOR0) ||
+            !(batch->resolve & PIPE_CLEAR_COLOR0) ||
+            !BITSET_TEST(rsrc->valid.data, surf->u.tex.level))
+                return;
 
-        dev->mali.cs_submit(&dev->mali, &ctx->kbase_cs_vertex.base, vs_offset,
-                            ctx->syncobj_kbase, ctx->kbase_cs_vertex.seqnum);
+        /* Only surfaces with an explicit damage region are partially
+         * redrawn every frame */
+        bool full_damage = !damage->minx && !damage->miny &&
+                           damage->maxx >= batch->key.width &&
+                           damage->maxy >= batch->key.height;
 
-        dev->mali.cs_submit(&dev->mali, &ctx->kbase_cs_fragment.base, fs_offset,
-                            ctx->syncobj_kbase, ctx->kbase_cs_fragment.seqnum);
+        if (full_damage)
+                return;
 
-        bool reset = false;
+        batch->minx = batch->miny = 0;
+        batch->maxx = batch->key.width;
+        batch->maxy = batch->key.height;
+        batch->tile_mask.full = true;
+}
 
-        // TODO: How will we know to reset a CS when waiting is not done?
-        if (batch->needs_sync) {
-                if (!dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_vertex.base, vs_offset, ctx->syncobj_kbase))
-                        reset = true;
+/* The render target the fragment job reads CRCs from, and a copy of its CRC
+ * buffer taken before the batch runs */
 
-                if (!dev->mali.cs_wait(&dev->mali, &ctx->kbase_cs_fragment.base, fs_offset, ctx->syncobj_kbase))
-                        reset = true;
-        }
+struct panfrost_crc_sample {
+        struct panfrost_resource *rsrc;
+        unsigned level;
+        bool read;
+        uint8_t *before;
+};
 
-        if (dev->debug & PAN_DBG_TILER) {
-                fflush(stdout);
-                FILE *stream = popen("tiler-hex-read", "w");
+static size_t
+panfrost_crc_offset(struct panfrost_resource *rsrc, unsigned level)
+{
+        return rsrc->image.data.offset +
+               rsrc->image.layout.slices[level].crc.offset;
+}
 
-                /* TODO: Dump more than just the first chunk */
-                unsigned size = batch->ctx->kbase_ctx->tiler_heap_chunk_size;
-                uint64_t va = batch->ctx->kbase_ctx->tiler_heap_header;
+static void
+panfrost_batch_crc_stats_begin(struct panfrost_batch *batch,
+                               const struct pan_fb_info *fb,
+                               const bool *was_valid,
+                               struct panfrost_crc_sample *sample)
+{
+        memset(sample, 0, sizeof(*sample));
 
-                fprintf(stream, "width %i\n" "height %i\n" "mask %i\n"
-                        "vaheap 0x%"PRIx64"\n" "size %i\n",
-                        batch->key.width, batch->key.height, 0xfe, va, size);
+        /* pan_emit_fbd() invalidates the CRCs of every render target other
+         * than the one it selected */
+        for (unsigned i = 0; i < fb->rt_count; ++i) {
+                if (!fb->rts[i].view || !fb->rts[i].view->image->layout.crc ||
+                    !*(fb->rts[i].crc_valid))
+                        continue;
 
-                void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
-                                 MAP_SHARED, dev->mali.fd, va);
+                sample->rsrc = pan_resource(batch->key.cbufs[i]->texture);
+                sample->level = fb->rts[i].view->first_level;
+                sample->read = was_valid[i];
+                break;
+        }
 
-                pan_hexdump(stream, ptr, size, false);
-                //memset(ptr, 0, size);
-                munmap(ptr, size);
+        if (!sample->rsrc || !sample->read)
+                return;
 
-                pclose(stream);
-        }
+        struct panfrost_bo *bo = sample->rsrc->image.data.bo;
+        const struct pan_image_slice_crc *crc =
+                &sample->rsrc->image.layout.slices[sample->level].crc;
+        size_t offset = panfrost_crc_offset(sample->rsrc, sample->level);
 
-        if (reset)
-                reset_context(ctx);
+        perf_debug_ctx(batch->ctx, "Waiting for CRC buffer to measure "
+                       "transaction elimination");
 
-        return 0;
+        panfrost_flush_submit_queue(batch->ctx);
+        panfrost_bo_wait(bo, INT64_MAX, false);
+        panfrost_bo_mmap(bo);
+
+        if (!bo->ptr.cpu)
+                return;
+
+        sample->before = malloc(crc->size);
+        if (!sample->before)
+                return;
+
+        panfrost_bo_mem_invalidate(bo, offset, crc->size);
+        memcpy(sample->before, bo->ptr.cpu + offset, crc->size);
 }
 
+/* Tiles whose CRC is unchanged after the batch matched the CRC buffer, so
+ * their writeback was skipped */
+
 static void
-panfrost_emit_tile_map(struct panfrost_batch *batch, struct pan_fb_info *fb)
+panfrost_batch_crc_stats_end(struct panfrost_context *ctx,
+                             const struct pan_fb_info *fb,
+                             struct panfrost_crc_sample *sample)
 {
-        if (batch->key.nr_cbufs < 1 || !batch->key.cbufs[0])
+        if (!sample->rsrc)
                 return;
 
-        struct pipe_surface *surf = batch->key.cbufs[0];
-        struct panfrost_resource *pres = surf ? pan_resource(surf->texture) : NULL;
+        unsigned tx_start = fb->extent.minx / 16;
+        unsigned ty_start = fb->extent.miny / 16;
+        unsigned tx_end = fb->extent.maxx / 16;
+        unsigned ty_end = fb->extent.maxy / 16;
 
-        if (pres && pres->damage.tile_map.enable) {
-                fb->tile_map.base =
-                        pan_pool_upload_aligned(&batch->pool.base,
-                                                pres->damage.tile_map.data,
-                                                pres->damage.tile_map.size,
-                                                64);
-                fb->tile_map.stride = pres->damage.tile_map.stride;
+        ctx->crc_stats.tiles += (tx_end - tx_start + 1) *
+                                (ty_end - ty_start + 1);
+
+        if (!sample->before)
+                return;
+
+        struct panfrost_bo *bo = sample->rsrc->image.data.bo;
+        const struct pan_image_slice_crc *crc =
+                &sample->rsrc->image.layout.slices[sample->level].crc;
+        size_t offset = panfrost_crc_offset(sample->rsrc, sample->level);
+
+        panfrost_flush_submit_queue(ctx);
+        panfrost_bo_wait(bo, INT64_MAX, false);
+        panfrost_bo_mem_invalidate(bo, offset, crc->size);
+
+        const uint8_t *after = bo->ptr.cpu + offset;
+
+        for (unsigned ty = ty_start; ty <= ty_end; ++ty) {
+                for (unsigned tx = tx_start; tx <= tx_end; ++tx) {
+                        size_t entry = (ty * crc->stride) + (tx * 8);
+
+                        if (!memcmp(sample->before + entry, after + entry, 8))
+                                ctx->crc_stats.eliminated++;
+                }
         }
+
+        free(sample->before);
 }
 
-static void
+/* Returns whether the batch had any work to submit. A NULL reason is an
+ * explicit flush. */
+
+static bool
 panfrost_batch_submit(struct panfrost_context *ctx,
-                      struct panfrost_batch *batch)
+                      struct panfrost_batch *batch, const char *reason)
 {
         struct pipe_screen *pscreen = ctx->base.screen;
         struct panfrost_screen *screen = pan_screen(pscreen);
         struct panfrost_device *dev = pan_device(pscreen);
+        bool submitted = false;
+        bool queued = false;
         int ret;
 
+        /* Submit the batches this one depends on first. Cleaning up each
+         * one removes it from the list. Their atoms go with those of this
+         * batch. */
+        ctx->defer_atoms++;
+
+        while (util_dynarray_num_elements(&batch->deps, struct panfrost_batch *)) {
+                struct panfrost_batch *dep =
+                        *util_dynarray_top_ptr(&batch->deps, struct panfrost_batch *);
+
+                panfrost_batch_submit(ctx, dep, reason);
+        }
+
+        ctx->defer_atoms--;
+
         /* Nothing to do! */
-        if (!batch->scoreboard.first_job && !batch->clear)
+        if ((!batch->scoreboard.first_job && !batch->clear) ||
+            panfrost_batch_defer_clears(batch)) {
+                panfrost_batch_write_timestamps_cpu(batch);
                 goto out;
+        }
+
+        submitted = true;
+        ctx->stats.flushes++;
+        ctx->stats.uploaded_bytes += batch->pool.allocated;
+        ctx->slab_cache.avg_allocated =
+                (ctx->slab_cache.avg_allocated * 3 + batch->pool.allocated) / 4;
+
+        if (!reason)
+                ctx->stats.explicit_flushes++;
+
+        panfrost_batch_fold_clears(batch);
+        panfrost_batch_update_hierarchy_mask(batch);
 
         if (batch->key.zsbuf && panfrost_has_fragment_job(batch)) {
                 struct pipe_surface *surf = batch->key.zsbuf;
@@ -1248,9 +3332,19 @@ panfrost_batch_submit(struct panfrost_context *ctx,
         }
 
         struct pan_fb_info fb;
-        struct pan_image_view rts[8], zs, s;
+        struct pan_image_view rts[8], resolves[8], zs, s;
+        struct panfrost_crc_sample crc_sample = { 0 };
+        bool crc_was_valid[8] = { false };
+
+        if (panfrost_has_fragment_job(batch))
+                panfrost_batch_prime_crc(batch);
 
-        panfrost_batch_to_fb_info(batch, &fb, rts, &zs, &s, false);
+        panfrost_batch_to_fb_info(batch, &fb, rts, resolves, &zs, &s, false);
+
+        for (unsigned i = 0; i < fb.rt_count; ++i) {
+                if (fb.rts[i].view)
+                        crc_was_valid[i] = *(fb.rts[i].crc_valid);
+        }
 
         screen->vtbl.preload(batch, &fb);
         screen->vtbl.init_polygon_list(batch);
@@ -1261,18 +3355,49 @@ panfrost_batch_submit(struct panfrost_context *ctx,
         screen->vtbl.emit_tls(batch);
         panfrost_emit_tile_map(batch, &fb);
 
-        if (batch->scoreboard.first_tiler || batch->clear)
+        if (batch->scoreboard.first_tiler || batch->clear) {
                 screen->vtbl.emit_fbd(batch, &fb);
 
+                if (ctx->crc_stats.active) {
+                        panfrost_batch_crc_stats_begin(batch, &fb, crc_was_valid,
+                                                       &crc_sample);
+                }
+        }
+
+        panfrost_resource_clean_dirty(screen);
+        panfrost_pool_clean(&batch->pool);
+        panfrost_resource_clean_coherent(batch);
+
+        uint64_t start = panfrost_profile_begin(ctx->profile);
+
         /* TODO: Don't hardcode the arch number */
-        if (dev->arch < 10)
+        if (dev->arch < 10) {
                 ret = panfrost_batch_submit_jobs(batch, &fb, 0, ctx->syncobj);
-        else
-                ret = panfrost_batch_submit_csf(batch, &fb);
+        } else {
+                batch->flush_reason = reason;
+                panfrost_batch_prepare_csf(batch, &fb);
+                panfrost_desc_heap_retire(ctx, batch);
+                panfrost_slab_cache_put(ctx, batch);
+                panfrost_batch_trace_csf(batch);
+                panfrost_batch_utrace_flush(batch, &fb, reason);
+
+                if (util_queue_is_initialized(&ctx->submit.queue)) {
+                        panfrost_batch_queue_csf(batch);
+                        queued = true;
+                        ret = 0;
+                } else {
+                        ret = panfrost_batch_submit_csf(batch);
+                }
+        }
+
+        /* With the submit thread, this only covers queueing the batch */
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_BATCH_SUBMIT, start);
 
         if (ret)
                 fprintf(stderr, "panfrost_batch_submit failed: %d\n", ret);
 
+        panfrost_batch_crc_stats_end(ctx, &fb, &crc_sample);
+
         /* We must reset the damage info of our render targets here even
          * though a damage reset normally happens when the DRI layer swaps
          * buffers. That's because there can be implicit flushes the GL
@@ -1292,7 +3417,93 @@ panfrost_batch_submit(struct panfrost_context *ctx,
         }
 
 out:
-        panfrost_batch_cleanup(ctx, batch);
+        /* Also covers the atoms of the batches this one depends on, when
+         * it had nothing to submit itself */
+        if (panfrost_submit_atoms(ctx))
+                fprintf(stderr, "panfrost_batch_submit failed to submit\n");
+
+        panfrost_batch_cleanup(ctx, batch, !queued);
+        return submitted;
+}
+
+/* Stop recording into the batches without submitting them. Later work gets
+ * new batches, ordered after these by the resources they share. */
+
+void
+panfrost_close_all_batches(struct panfrost_context *ctx)
+{
+        unsigned i;
+        foreach_batch(ctx, i) {
+                struct panfrost_batch *batch = ctx->batches.slots[i];
+
+                if (batch->scoreboard.first_job)
+                        batch->closed = true;
+        }
+
+        if (ctx->batch && ctx->batch->closed)
+                ctx->batch = NULL;
+}
+
+/* Fold a resolve of colour buffer rt into the batch, writing surf from the
+ * tile buffer. Only batches nothing depends on qualify, since those
+ * dependents would otherwise run before the resolve they might read. The
+ * batch is closed, so later draws don't show up in the resolved surface. */
+
+bool
+panfrost_batch_add_resolve(struct panfrost_batch *batch, unsigned rt,
+                           struct pipe_surface *surf)
+{
+        struct panfrost_resource *rsrc = pan_resource(surf->texture);
+        unsigned mask = PIPE_CLEAR_COLOR0 << rt;
+        unsigned rt_descs = batch->key.nr_cbufs;
+
+        for (unsigned i = 0; i < batch->key.nr_cbufs; ++i) {
+                if (batch->resolve_surfs[i])
+                        rt_descs++;
+        }
+
+        if (batch->closed || batch->resolve_surfs[rt] || rt_descs >= 8 ||
+            !((batch->draws | batch->clear) & mask) ||
+            panfrost_batch_uses_resource(batch, rsrc))
+                return false;
+
+        pipe_surface_reference(&batch->resolve_surfs[rt], surf);
+        panfrost_batch_write_rsrc(batch, rsrc, PIPE_SHADER_FRAGMENT);
+
+        /* The whole surface is resolved, not just what the batch drew */
+        panfrost_batch_union_scissor(batch, 0, 0, batch->key.width,
+                                     batch->key.height);
+
+        batch->closed = true;
+
+        if (batch->ctx->batch == batch)
+                batch->ctx->batch = NULL;
+
+        return true;
+}
+
+/* The multisampled colour buffers rsrc backs needn't be written out by
+ * batches which resolve them on-tile, unless another batch reads them */
+
+void
+panfrost_discard_resolved_rsrc(struct panfrost_context *ctx,
+                               struct panfrost_resource *rsrc)
+{
+        unsigned i;
+        foreach_batch(ctx, i) {
+                struct panfrost_batch *batch = ctx->batches.slots[i];
+
+                if (panfrost_batch_has_dependents(batch))
+                        continue;
+
+                for (unsigned rt = 0; rt < batch->key.nr_cbufs; ++rt) {
+                        struct pipe_surface *surf = batch->key.cbufs[rt];
+
+                        if (batch->resolve_surfs[rt] && surf &&
+                            surf->texture == &rsrc->base)
+                                batch->resolve &= ~(PIPE_CLEAR_COLOR0 << rt);
+                }
+        }
 }
 
 /* Submit all batches */
@@ -1301,16 +3512,23 @@ void
 panfrost_flush_all_batches(struct panfrost_context *ctx, const char *reason)
 {
         struct panfrost_batch *batch = panfrost_get_batch_for_fbo(ctx);
-        panfrost_batch_submit(ctx, batch);
 
-        for (unsigned i = 0; i < PAN_MAX_BATCHES; i++) {
-                if (ctx->batches.slots[i].seqnum) {
+        ctx->defer_atoms++;
+        panfrost_batch_submit(ctx, batch, reason);
+
+        for (unsigned i = 0; i < ctx->batches.count; i++) {
+                if (ctx->batches.slots[i]->seqnum) {
                         if (reason)
                                 perf_debug_ctx(ctx, "Flushing everything due to: %s", reason);
 
-                        panfrost_batch_submit(ctx, &ctx->batches.slots[i]);
+                        panfrost_batch_submit(ctx, ctx->batches.slots[i], reason);
                 }
         }
+
+        ctx->defer_atoms--;
+
+        if (panfrost_submit_atoms(ctx))
+                fprintf(stderr, "panfrost_flush_all_batches failed to submit\n");
 }
 
 void
@@ -1318,12 +3536,15 @@ panfrost_flush_writer(struct panfrost_context *ctx,
                       struct panfrost_resource *rsrc,
                       const char *reason)
 {
-        struct hash_entry *entry = _mesa_hash_table_search(ctx->writers, rsrc);
+        struct panfrost_batch *writer = panfrost_resource_writer(ctx, rsrc);
 
-        if (entry) {
+        if (writer) {
                 perf_debug_ctx(ctx, "Flushing writer due to: %s", reason);
-                panfrost_batch_submit(ctx, entry->data);
+                if (panfrost_batch_submit(ctx, writer, reason))
+                        ctx->stats.resource_flushes++;
         }
+
+        panfrost_flush_submit_queue(ctx);
 }
 
 void
@@ -1333,14 +3554,55 @@ panfrost_flush_batches_accessing_rsrc(struct panfrost_context *ctx,
 {
         unsigned i;
         foreach_batch(ctx, i) {
-                struct panfrost_batch *batch = &ctx->batches.slots[i];
+                struct panfrost_batch *batch = ctx->batches.slots[i];
 
-                if (!panfrost_batch_uses_resource(batch, rsrc))
+                /* Skip batches submitted as dependencies of earlier ones */
+                if (!batch->seqnum || !panfrost_batch_uses_resource(batch, rsrc))
                         continue;
 
                 perf_debug_ctx(ctx, "Flushing user due to: %s", reason);
-                panfrost_batch_submit(ctx, batch);
+                if (panfrost_batch_submit(ctx, batch, reason))
+                        ctx->stats.resource_flushes++;
         }
+
+        panfrost_flush_submit_queue(ctx);
+}
+
+/* Submits the blits out of a staging resource for an upload, without waiting
+ * for them on the CPU. Anything using the destination afterwards waits for
+ * the blit on the GPU through the BO usages, or through the fence of the
+ * flush when another context samples it, so a loader thread can keep
+ * uploading while the GPU catches up. The staging ring waits for its BOs to
+ * be idle before reusing them. */
+void
+panfrost_flush_upload(struct panfrost_context *ctx,
+                      struct panfrost_resource *staging,
+                      const char *reason)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        unsigned i;
+
+        foreach_batch(ctx, i) {
+                struct panfrost_batch *batch = ctx->batches.slots[i];
+
+                if (!batch->seqnum || !panfrost_batch_uses_resource(batch, staging))
+                        continue;
+
+                /* Scanout targets keep the sync forced when there are no
+                 * dma-buf fences */
+                struct pipe_surface *surf = batch->key.nr_cbufs ?
+                        batch->key.cbufs[0] : NULL;
+                bool scanout = surf && pan_resource(surf->texture)->scanout;
+
+                if (dev->kbase && !(dev->debug & PAN_DBG_SYNC) && !scanout)
+                        batch->needs_sync = false;
+
+                perf_debug_ctx(ctx, "Flushing upload due to: %s", reason);
+                if (panfrost_batch_submit(ctx, batch, reason))
+                        ctx->stats.resource_flushes++;
+        }
+
+        panfrost_flush_submit_queue(ctx);
 }
 
 void
@@ -1366,6 +3628,30 @@ panfrost_batch_clear(struct panfrost_batch *batch,
 {
         struct panfrost_context *ctx = batch->ctx;
 
+        /* Clearing affects the entire framebuffer (by definition -- this is
+         * the Gallium clear callback, which clears the whole framebuffer. If
+         * the scissor test were enabled from the GL side, the gallium frontend
+         * would emit a quad instead and we wouldn't go down this code path) */
+
+        panfrost_batch_clear_rect(batch, buffers, color, depth, stencil, 0, 0,
+                                  ctx->pipe_framebuffer.width,
+                                  ctx->pipe_framebuffer.height);
+}
+
+/* The fragment job clears every tile it processes, so a rectangle which
+ * isn't made of whole tiles is cleared beyond its bounds. Later draws would
+ * widen the rectangle, so the caller has to keep them out of the batch. */
+
+void
+panfrost_batch_clear_rect(struct panfrost_batch *batch,
+                          unsigned buffers,
+                          const union pipe_color_union *color,
+                          double depth, unsigned stencil,
+                          unsigned minx, unsigned miny,
+                          unsigned maxx, unsigned maxy)
+{
+        struct panfrost_context *ctx = batch->ctx;
+
         if (buffers & PIPE_CLEAR_COLOR) {
                 for (unsigned i = 0; i < ctx->pipe_framebuffer.nr_cbufs; ++i) {
                         if (!(buffers & (PIPE_CLEAR_COLOR0 << i)))
@@ -1389,14 +3675,52 @@ panfrost_batch_clear(struct panfrost_batch *batch,
         batch->clear |= buffers;
         batch->resolve |= buffers;
 
-        /* Clearing affects the entire framebuffer (by definition -- this is
-         * the Gallium clear callback, which clears the whole framebuffer. If
-         * the scissor test were enabled from the GL side, the gallium frontend
-         * would emit a quad instead and we wouldn't go down this code path) */
+        panfrost_batch_union_scissor(batch, minx, miny, maxx, maxy);
+}
+
+/* Render target whose tiler hierarchy levels carry over between batches */
+
+static struct panfrost_resource *
+panfrost_batch_hierarchy_rsrc(struct panfrost_batch *batch)
+{
+        if (batch->key.nr_cbufs && batch->key.cbufs[0])
+                return pan_resource(batch->key.cbufs[0]->texture);
+
+        if (batch->key.zsbuf)
+                return pan_resource(batch->key.zsbuf->texture);
+
+        return NULL;
+}
+
+/* The tiler hierarchy levels for a batch are chosen from the size of the
+ * primitives drawn by the previous batch on the same render target, since
+ * the tiler context is emitted before the draws are known. Scenes change
+ * little from frame to frame. Returns 0 for the default levels. */
+
+unsigned
+panfrost_batch_hierarchy_mask(struct panfrost_batch *batch)
+{
+        struct panfrost_resource *rsrc = panfrost_batch_hierarchy_rsrc(batch);
+
+        return rsrc ? rsrc->hierarchy_mask : 0;
+}
+
+static void
+panfrost_batch_update_hierarchy_mask(struct panfrost_batch *batch)
+{
+        struct panfrost_device *dev = pan_device(batch->ctx->base.screen);
+        struct panfrost_resource *rsrc = panfrost_batch_hierarchy_rsrc(batch);
 
-        panfrost_batch_union_scissor(batch, 0, 0,
-                                     ctx->pipe_framebuffer.width,
-                                     ctx->pipe_framebuffer.height);
+        /* Fewer levels than the hierarchy has are kept at fixed positions */
+        if (!rsrc || dev->arch < 6 || !batch->tiler_ctx.bifrost ||
+            dev->tiler_features.max_levels < PAN_TILER_HIERARCHY_LEVELS)
+                return;
+
+        /* The smallest level stays disabled, see pan_emit_tiler_ctx */
+        rsrc->hierarchy_mask =
+                panfrost_choose_bifrost_hierarchy_mask(batch->key.width,
+                                                       batch->key.height, 1,
+                                                       batch->level_prims);
 }
 
 /* Given a new bounding rectangle (scissor), let the job cover the union of the
@@ -1411,6 +3735,38 @@ panfrost_batch_union_scissor(struct panfrost_batch *batch,
         batch->miny = MIN2(batch->miny, miny);
         batch->maxx = MAX2(batch->maxx, maxx);
         batch->maxy = MAX2(batch->maxy, maxy);
+
+        if (batch->tile_mask.full || minx >= maxx || miny >= maxy)
+                return;
+
+        unsigned width = batch->key.width, height = batch->key.height;
+
+        if (!minx && !miny && maxx >= width && maxy >= height) {
+                batch->tile_mask.full = true;
+                return;
+        }
+
+        if (!batch->tile_mask.data) {
+                batch->tile_mask.stride =
+                        ALIGN_POT(DIV_ROUND_UP(width, 32 * 8), 64);
+                batch->tile_mask.data =
+                        calloc(batch->tile_mask.stride * DIV_ROUND_UP(height, 32), 1);
+
+                if (!batch->tile_mask.data) {
+                        batch->tile_mask.full = true;
+                        return;
+                }
+        }
+
+        unsigned tx_end = (MIN2(maxx, width) - 1) / 32;
+        unsigned ty_end = (MIN2(maxy, height) - 1) / 32;
+
+        for (unsigned ty = miny / 32; ty <= ty_end; ty++) {
+                for (unsigned tx = minx / 32; tx <= tx_end; tx++) {
+                        BITSET_SET(batch->tile_mask.data,
+                                   (ty * batch->tile_mask.stride * 8) + tx);
+                }
+        }
 }
 
 /**
@@ -27,8 +27,10 @@
 #define __PAN_JOB_H__
 
 #include "util/u_dynarray.h"
+#include "util/perf/u_trace.h"
 #include "pipe/p_state.h"
 #include "pan_cs.h"
+#include "pan_encoder.h"
 #include "pan_mempool.h"
 #include "pan_resource.h"
 #include "pan_scoreboard.h"
@@ -87,9 +89,89 @@ enum panfrost_usage_type {
         PAN_USAGE_COUNT,
 };
 
+/* Open-addressed set of BOs keyed by GEM handle, with a mask of the
+ * panfrost_usage_type each BO is accessed with. A BO used by many draws is
+ * only walked once at submit. */
+struct panfrost_bo_set_entry {
+        struct panfrost_bo *bo;
+        uint32_t usage;
+};
+
+struct panfrost_bo_set {
+        struct panfrost_bo_set_entry *entries;
+        unsigned count, capacity;
+};
+
+/* A dma-buf accessed by a batch, for implicit synchronisation */
+struct panfrost_dmabuf {
+        int fd;
+
+        /* Stages accessing the dma-buf, as PAN_BO_ACCESS_VERTEX_TILER and
+         * PAN_BO_ACCESS_FRAGMENT flags */
+        uint32_t access;
+};
+
+/* Scratch BOs of a context (thread local storage or workgroup shared
+ * memory). Batches take an idle BO of the pool instead of allocating their
+ * own, so compute-heavy frames don't allocate and free large BOs for every
+ * batch. */
+struct panfrost_scratch_pool {
+        /* struct panfrost_bo *, each holding a reference for the pool */
+        struct util_dynarray bos;
+
+        /* Size of new BOs, the largest size asked for so far rounded up to
+         * a power of two */
+        size_t size;
+
+        /* Frames since a batch last asked for a BO */
+        unsigned idle_frames;
+};
+
+/* A batch pool BO kept by the context once the batch using it has been
+ * submitted, with the queue points after which the GPU is done with it */
+struct panfrost_slab {
+        struct panfrost_bo *bo;
+        uint64_t vertex_seqnum, fragment_seqnum, compute_seqnum;
+};
+
+/* Sizes and recycles the BOs of batch pools. New batches start with a BO
+ * sized from the allocations of earlier batches, and on CSF take an idle BO
+ * of a submitted batch instead of going through the BO cache. */
+struct panfrost_slab_cache {
+        /* struct panfrost_slab, oldest first, each holding a reference */
+        struct util_dynarray slabs;
+
+        /* Moving average of the bytes allocated from the pool of each
+         * submitted batch */
+        uint64_t avg_allocated;
+};
+
+/* A GPU timestamp to store into a query buffer, before any of the work of a
+ * batch starts or once all of it has finished */
+struct panfrost_timestamp {
+        struct panfrost_bo *bo;
+        unsigned offset;
+        bool end;
+};
+
 /* A panfrost_batch corresponds to a bound FBO we're rendering to,
  * collecting over multiple draws. */
 
+/* Largest upload remembered by a panfrost_upload_shadow */
+#define PAN_UPLOAD_SHADOW_SIZE 512
+
+/* The last copy of some uniform data uploaded to the batch pool, so that later
+ * draws of the batch which would upload the same bytes can point at it */
+struct panfrost_upload_shadow {
+        mali_ptr gpu;
+        unsigned size;
+        uint8_t data[PAN_UPLOAD_SHADOW_SIZE];
+};
+
+struct panfrost_stage_uploads {
+        struct panfrost_upload_shadow sysvals, push, ubos;
+};
+
 struct panfrost_batch {
         struct panfrost_context *ctx;
         struct pipe_framebuffer_state key;
@@ -97,6 +179,18 @@ struct panfrost_batch {
         /* Sequence number used to implement LRU eviction when all batch slots are used */
         uint64_t seqnum;
 
+        /* Slot in ctx->batches, kept while the slot is unused */
+        unsigned idx;
+
+        /* Batches to submit before this one, because it accesses resources
+         * they write or writes resources they access */
+        struct util_dynarray deps;
+
+        /* Set once another batch depends on this one, or at a memory
+         * barrier. Work recorded after that may have to run after the
+         * dependents, so it goes to a new batch instead. */
+        bool closed;
+
         /* Buffers cleared (PIPE_CLEAR_* bitmask) */
         unsigned clear;
 
@@ -109,6 +203,10 @@ struct panfrost_batch {
         /* Buffers needing resolve to memory */
         unsigned resolve;
 
+        /* Single-sampled surfaces the multisampled colour buffers are
+         * averaged into on-tile, by resolve blits folded into the batch */
+        struct pipe_surface *resolve_surfs[PIPE_MAX_COLOR_BUFS];
+
         /* Packed clear values, indexed by both render target as well as word.
          * Essentially, a single pixel is packed, with some padding to bring it
          * up to a 32-bit interval; that pixel is then duplicated over to fill
@@ -118,6 +216,9 @@ struct panfrost_batch {
         float clear_depth;
         unsigned clear_stencil;
 
+        /* Submit a clear-only batch instead of deferring its clears */
+        bool keep_clears;
+
         /* Amount of thread local storage required per thread */
         unsigned stack_size;
 
@@ -130,9 +231,27 @@ struct panfrost_batch {
         unsigned minx, miny;
         unsigned maxx, maxy;
 
+        /* The 32x32 regions touched by the bounding boxes, laid out like a
+         * tile enable map, so fragment jobs of batches with scattered small
+         * draws only process those regions. Not allocated or used once a
+         * bounding box covers the whole framebuffer. */
+        struct {
+                BITSET_WORD *data;
+                unsigned stride;
+                bool full;
+        } tile_mask;
+
+        /* Intersection of the viewport and scissor, which bounds each draw
+         * unless a tighter box can be found for it */
+        struct pipe_scissor_state viewport_bounds;
+
         /* Acts as a rasterizer discard */
         bool scissor_culls_everything;
 
+        /* Number of primitives drawn, by the level of the tiler hierarchy
+         * matching their size, see panfrost_hierarchy_level_for_area */
+        uint32_t level_prims[PAN_TILER_HIERARCHY_LEVELS];
+
         /* BOs referenced not in the pool */
         unsigned num_bos;
         struct util_dynarray bos;
@@ -183,6 +302,9 @@ struct panfrost_batch {
         mali_ptr uniform_buffers[PIPE_SHADER_TYPES];
         mali_ptr push_uniforms[PIPE_SHADER_TYPES];
         mali_ptr depth_stencil;
+
+        /* Allocated on first use */
+        struct panfrost_stage_uploads *uploads[PIPE_SHADER_TYPES];
         mali_ptr blend;
 
         /* Valhall: struct mali_scissor_packed */
@@ -203,26 +325,112 @@ struct panfrost_batch {
         /* Referenced resources, holds a pipe_reference. */
         struct set *resources;
 
-        struct util_dynarray resource_bos[PAN_USAGE_COUNT];
+        /* BOs of the resources accessed, for CSF dependencies */
+        struct panfrost_bo_set resource_bos;
 
         /* struct panfrost_usage */
         struct util_dynarray vert_deps;
         struct util_dynarray frag_deps;
 
-        /* Referenced dma-bufs FDs, for emitting synchronisation commands. */
+        /* struct panfrost_dmabuf, for emitting synchronisation commands. */
         struct util_dynarray dmabufs;
 
+        /* struct panfrost_timestamp, for timer queries */
+        struct util_dynarray timestamps;
+
         /* Command stream pointers for CSF Valhall. Vertex CS tracking is more
          * complicated as there may be multiple buffers. */
         pan_command_stream cs_vertex;
         uint32_t *cs_vertex_last_size;
         pan_command_stream cs_vertex_first;
 
+        /* Register values written by the vertex CS so far. The batch's
+         * vertex CS runs from start to end in a single call, so state bound
+         * by an earlier draw needs no new moves unless it changed. */
+        struct pan_cs_shadow cs_vertex_shadow;
+
         pan_command_stream cs_fragment;
 
+        /* The last draw launched on the vertex CS, which a following draw
+         * with the same state may extend instead of launching another job */
+        struct {
+                uint64_t *launch;
+                enum pipe_prim_type mode;
+                unsigned start, count;
+                bool render_cond;
+        } last_draw;
+
+        /* Whether launches are skipped by the command stream depending on
+         * the render condition, see panfrost_emit_render_condition */
+        bool render_cond;
+
+        /* Seqnums on the vertex, fragment and compute CSF queues for this
+         * batch */
+        uint64_t vertex_seqnum;
+        uint64_t fragment_seqnum;
+        uint64_t compute_seqnum;
+
+        /* Sync file to wait on before running the batch, or -1 */
+        int in_sync_fd;
+
         bool needs_sync;
+
+        /* The batch only holds work from launch_grid. On CSF, cs_vertex is
+         * then run on the compute queue instead of the vertex queue. */
+        bool compute;
+
+        /* Index of the tiler heap of the context used by the batch, valid
+         * if tiler_heap_held is set */
+        unsigned tiler_heap;
+        bool tiler_heap_held;
+
+        /* Index plus one of the entry of ctx->tiler_scratch used by the
+         * batch, or zero */
+        unsigned tiler_scratch;
+
+        /* Estimate of the bytes of vertex positions written by IDVS */
+        uint64_t tiler_scratch_traffic;
+
+        /* Why the batch was submitted, for tracing */
+        const char *flush_reason;
+
+        /* Slot of ctx->trace.bo the CSF queues store their start and end
+         * timestamps to, or zero if the batch isn't traced */
+        mali_ptr trace_ts;
+
+        /* u_trace tracepoints of the batch, with timestamps written by its
+         * command streams. Flushed to the context when submitted. */
+        struct u_trace trace;
+};
+
+/* Lets the u_trace timestamps of a submitted batch be read once the queues
+ * it used have finished it, which is when their event reaches the seqnum */
+struct panfrost_trace_flush {
+        struct {
+                uint64_t *event;
+                uint64_t seqnum;
+        } queues[2];
+
+        unsigned nr_queues;
 };
 
+/* Scratch memory for vertex positions written by IDVS on v10. Entries are
+ * shared between the batches of a context, and are recycled once the
+ * fragment job of the last batch to use them has completed. */
+struct panfrost_tiler_scratch {
+        struct panfrost_bo *bo;
+        unsigned bits;
+
+        /* Fragment seqnum of the last batch to use the scratch, or zero
+         * if it is free. UINT64_MAX while held by a batch which has not
+         * been submitted yet. */
+        uint64_t seqnum;
+};
+
+#define PAN_TILER_SCRATCH_MIN_BITS 12
+/* Sizes above this give a CS_INHERIT_FAULT */
+#define PAN_TILER_SCRATCH_MAX_BITS 16
+
 /* Functions for managing the above */
 
 struct panfrost_batch *
@@ -246,6 +454,11 @@ panfrost_batch_write_rsrc(struct panfrost_batch *batch,
                           struct panfrost_resource *rsrc,
                           enum pipe_shader_type stage);
 
+void
+panfrost_batch_add_timestamp(struct panfrost_batch *batch,
+                             struct panfrost_resource *rsrc,
+                             unsigned offset, bool end);
+
 void
 panfrost_resource_swap_bo(struct panfrost_context *ctx,
                           struct panfrost_resource *rsrc,
@@ -259,16 +472,48 @@ panfrost_batch_create_bo(struct panfrost_batch *batch, size_t size,
 void
 panfrost_flush_all_batches(struct panfrost_context *ctx, const char *reason);
 
+void
+panfrost_close_all_batches(struct panfrost_context *ctx);
+
 void
 panfrost_flush_batches_accessing_rsrc(struct panfrost_context *ctx,
                                       struct panfrost_resource *rsrc,
                                       const char *reason);
 
+void
+panfrost_flush_upload(struct panfrost_context *ctx,
+                      struct panfrost_resource *staging,
+                      const char *reason);
+
+struct panfrost_batch *
+panfrost_resource_writer(struct panfrost_context *ctx,
+                         struct panfrost_resource *rsrc);
+
 void
 panfrost_flush_writer(struct panfrost_context *ctx,
                       struct panfrost_resource *rsrc,
                       const char *reason);
 
+void
+panfrost_flush_submit_queue(struct panfrost_context *ctx);
+
+void
+panfrost_flush_pending_clear(struct panfrost_context *ctx,
+                             struct panfrost_resource *rsrc,
+                             const char *reason);
+
+void
+panfrost_flush_pending_clears(struct panfrost_context *ctx);
+
+void
+panfrost_flush_bound_pending_clears(struct panfrost_context *ctx);
+
+struct panfrost_tiler_scratch *
+panfrost_batch_get_tiler_scratch(struct panfrost_batch *batch);
+
+unsigned
+panfrost_batch_get_tiler_heap(struct panfrost_batch *batch);
+
 void
 panfrost_batch_adjust_stack_size(struct panfrost_batch *batch);
 
@@ -278,12 +523,32 @@ panfrost_batch_get_scratchpad(struct panfrost_batch *batch, unsigned size, unsig
 struct panfrost_bo *
 panfrost_batch_get_shared_memory(struct panfrost_batch *batch, unsigned size, unsigned workgroup_count);
 
+void
+panfrost_scratch_pool_trim(struct panfrost_scratch_pool *pool);
+
+void
+panfrost_scratch_pool_cleanup(struct panfrost_scratch_pool *pool);
+
+void
+panfrost_slab_cache_cleanup(struct panfrost_slab_cache *cache);
+
 void
 panfrost_batch_clear(struct panfrost_batch *batch,
                      unsigned buffers,
                      const union pipe_color_union *color,
                      double depth, unsigned stencil);
 
+void
+panfrost_batch_clear_rect(struct panfrost_batch *batch,
+                          unsigned buffers,
+                          const union pipe_color_union *color,
+                          double depth, unsigned stencil,
+                          unsigned minx, unsigned miny,
+                          unsigned maxx, unsigned maxy);
+
+unsigned
+panfrost_batch_hierarchy_mask(struct panfrost_batch *batch);
+
 void
 panfrost_batch_union_scissor(struct panfrost_batch *batch,
                              unsigned minx, unsigned miny,
@@ -292,4 +557,12 @@ panfrost_batch_union_scissor(struct panfrost_batch *batch,
 bool
 panfrost_batch_skip_rasterization(struct panfrost_batch *batch);
 
+bool
+panfrost_batch_add_resolve(struct panfrost_batch *batch, unsigned rt,
+                           struct pipe_surface *surf);
+
+void
+panfrost_discard_resolved_rsrc(struct panfrost_context *ctx,
+                               struct panfrost_resource *rsrc);
+
 #endif
@@ -54,6 +54,7 @@ panfrost_pool_alloc_backing(struct panfrost_pool *pool, size_t bo_sz)
          */
         struct panfrost_bo *bo = panfrost_bo_create(pool->base.dev, bo_sz,
                         pool->base.create_flags, pool->base.label);
+        panfrost_bo_set_category(bo, PAN_MEM_POOL);
 
         if (pool->owned)
                 util_dynarray_append(&pool->bos, struct panfrost_bo *, bo);
@@ -97,6 +98,20 @@ panfrost_pool_cleanup(struct panfrost_pool *pool)
         util_dynarray_fini(&pool->bos);
 }
 
+/* Makes an idle BO the backing of an empty owned pool, which takes over the
+ * reference. Used to recycle the BOs of earlier pools without going through
+ * the BO cache. */
+
+void
+panfrost_pool_adopt(struct panfrost_pool *pool, struct panfrost_bo *bo)
+{
+        assert(pool->owned && !pool->transient_bo);
+
+        util_dynarray_append(&pool->bos, struct panfrost_bo *, bo);
+        pool->transient_bo = bo;
+        pool->transient_offset = 0;
+}
+
 void
 panfrost_pool_get_bo_handles(struct panfrost_pool *pool, uint32_t *handles)
 {
@@ -118,6 +133,27 @@ panfrost_pool_get_bo_handles(struct panfrost_pool *pool, uint32_t *handles)
         }
 }
 
+/* Writes back the CPU caches for everything allocated from a pool using
+ * CPU-cached BOs, before the GPU reads it. Only the used part of the current
+ * BO is cleaned. */
+
+void
+panfrost_pool_clean(struct panfrost_pool *pool)
+{
+        assert(pool->owned && "pool does not track BOs in unowned mode");
+
+        util_dynarray_foreach(&pool->bos, struct panfrost_bo *, bo) {
+                if (!(*bo)->cached)
+                        continue;
+
+                size_t size = (*bo == pool->transient_bo) ?
+                        MIN2(pool->transient_offset, (*bo)->size) :
+                        (*bo)->size;
+
+                panfrost_bo_mem_clean(*bo, 0, size);
+        }
+}
+
 #define PAN_GUARD_SIZE 4096
 
 static struct panfrost_ptr
@@ -150,14 +186,23 @@ panfrost_pool_alloc_aligned(struct panfrost_pool *pool, size_t sz, unsigned alig
         }
 #endif
 
-        /* If we don't fit, allocate a new backing */
-        if (unlikely(bo == NULL || (offset + sz) >= pool->base.slab_size)) {
+        /* If we don't fit, allocate a new backing. The BO may be larger than
+         * the slab size if it was recycled or grown. */
+        if (unlikely(bo == NULL || (offset + sz) > bo->size)) {
+                /* Grow geometrically, so pools used for a lot of data
+                 * don't allocate many small BOs one after the other */
+                if (bo && pool->base.slab_size < pool->max_slab_size) {
+                        pool->base.slab_size = MIN2(pool->base.slab_size * 2,
+                                                    pool->max_slab_size);
+                }
+
                 bo = panfrost_pool_alloc_backing(pool,
                                 ALIGN_POT(MAX2(pool->base.slab_size, sz), 4096));
                 offset = 0;
         }
 
         pool->transient_offset = offset + sz;
+        pool->allocated += sz;
 
         struct panfrost_ptr ret = {
                 .cpu = bo->ptr.cpu + offset,
@@ -167,3 +212,104 @@ panfrost_pool_alloc_aligned(struct panfrost_pool *pool, size_t sz, unsigned alig
         return ret;
 }
 PAN_POOL_ALLOCATOR(struct panfrost_pool, panfrost_pool_alloc_aligned)
+
+void
+panfrost_desc_heap_init(struct panfrost_desc_heap *heap,
+                        struct panfrost_device *dev)
+{
+        memset(heap, 0, sizeof(*heap));
+        heap->dev = dev;
+        simple_mtx_init(&heap->lock, mtx_plain);
+        util_dynarray_init(&heap->bos, NULL);
+        util_dynarray_init(&heap->freed, NULL);
+        util_dynarray_init(&heap->retired, NULL);
+
+        for (unsigned i = 0; i < PAN_DESC_HEAP_ORDERS; ++i)
+                util_dynarray_init(&heap->free[i], NULL);
+}
+
+void
+panfrost_desc_heap_cleanup(struct panfrost_desc_heap *heap)
+{
+        util_dynarray_foreach(&heap->bos, struct panfrost_bo *, bo)
+                panfrost_bo_unreference(*bo);
+
+        util_dynarray_fini(&heap->bos);
+        util_dynarray_fini(&heap->freed);
+        util_dynarray_fini(&heap->retired);
+
+        for (unsigned i = 0; i < PAN_DESC_HEAP_ORDERS; ++i)
+                util_dynarray_fini(&heap->free[i]);
+
+        simple_mtx_destroy(&heap->lock);
+}
+
+struct panfrost_desc
+panfrost_desc_heap_alloc(struct panfrost_desc_heap *heap, size_t size)
+{
+        unsigned order = MAX2(util_logbase2_ceil(MAX2(size, 1)),
+                              PAN_DESC_HEAP_MIN_ORDER);
+
+        if (order > PAN_DESC_HEAP_MAX_ORDER)
+                return (struct panfrost_desc) { 0 };
+
+        struct util_dynarray *free =
+                &heap->free[order - PAN_DESC_HEAP_MIN_ORDER];
+        struct panfrost_desc desc;
+
+        simple_mtx_lock(&heap->lock);
+
+        if (free->size) {
+                desc = util_dynarray_pop(free, struct panfrost_desc);
+                simple_mtx_unlock(&heap->lock);
+                return desc;
+        }
+
+        /* Entries are naturally aligned */
+        unsigned offset = ALIGN_POT(heap->offset, 1u << order);
+
+        if (!heap->bo || offset + (1u << order) > heap->bo->size) {
+                heap->bo = panfrost_bo_create(heap->dev,
+                                              PAN_DESC_HEAP_CHUNK_SIZE, 0,
+                                              "Descriptor heap");
+                panfrost_bo_set_category(heap->bo, PAN_MEM_POOL);
+                util_dynarray_append(&heap->bos, struct panfrost_bo *,
+                                     heap->bo);
+                offset = 0;
+        }
+
+        heap->offset = offset + (1u << order);
+
+        desc = (struct panfrost_desc) {
+                .bo = heap->bo,
+                .gpu = heap->bo->ptr.gpu + offset,
+                .cpu = heap->bo->ptr.cpu + offset,
+                .order = order,
+        };
+
+        simple_mtx_unlock(&heap->lock);
+        return desc;
+}
+
+void
+panfrost_desc_heap_free(struct panfrost_desc_heap *heap,
+                        const struct panfrost_desc *desc)
+{
+        assert(desc->order);
+
+        simple_mtx_lock(&heap->lock);
+        util_dynarray_append(&heap->freed, struct panfrost_desc, *desc);
+        simple_mtx_unlock(&heap->lock);
+}
+
+void
+panfrost_desc_heap_recycle(struct panfrost_desc_heap *heap,
+                           const struct panfrost_desc_retired *entry)
+{
+        unsigned idx = entry->desc.order - PAN_DESC_HEAP_MIN_ORDER;
+
+        simple_mtx_lock(&heap->lock);
+        util_dynarray_append(&heap->free[idx], struct panfrost_desc,
+                             entry->desc);
+        simple_mtx_unlock(&heap->lock);
+}
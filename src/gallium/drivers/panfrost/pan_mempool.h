@@ -26,6 +26,7 @@
 #define __PAN_MEMPOOL_H__
 
 #include "pan_pool.h"
+#include "util/simple_mtx.h"
 
 /* Represents grow-only memory. It may be owned by the batch (OpenGL), or may
    be unowned for persistent uploads. */
@@ -43,6 +44,13 @@ struct panfrost_pool {
         /* Within the topmost transient BO, how much has been used? */
         unsigned transient_offset;
 
+        /* Total size of the allocations, for statistics */
+        uint64_t allocated;
+
+        /* If non-zero, the size of new backing BOs doubles each time the
+         * pool fills one, up to this size */
+        size_t max_slab_size;
+
         /* Mode of the pool. BO management is in the pool for owned mode, but
          * the consumed for unowned mode. */
         bool owned;
@@ -88,6 +96,9 @@ panfrost_pool_init(struct panfrost_pool *pool, void *memctx,
 void
 panfrost_pool_cleanup(struct panfrost_pool *pool);
 
+void
+panfrost_pool_adopt(struct panfrost_pool *pool, struct panfrost_bo *bo);
+
 static inline unsigned
 panfrost_pool_num_bos(struct panfrost_pool *pool)
 {
@@ -98,4 +109,83 @@ panfrost_pool_num_bos(struct panfrost_pool *pool)
 void
 panfrost_pool_get_bo_handles(struct panfrost_pool *pool, uint32_t *handles);
 
+void
+panfrost_pool_clean(struct panfrost_pool *pool);
+
+/* Heap for descriptors which live as long as an object, such as the texture
+ * payloads of sampler views. Allocations are rounded up to a power of two
+ * and served from per size free lists, carved out of large BOs, so creating
+ * and destroying objects doesn't allocate or free BOs. Freed entries may
+ * still be read by the GPU, so they are retired rather than reused, and the
+ * context returns them to the free lists once the batches which could use
+ * them have completed, see panfrost_desc_heap_retire. */
+
+#define PAN_DESC_HEAP_MIN_ORDER 6
+#define PAN_DESC_HEAP_MAX_ORDER 12
+#define PAN_DESC_HEAP_ORDERS \
+        (PAN_DESC_HEAP_MAX_ORDER - PAN_DESC_HEAP_MIN_ORDER + 1)
+#define PAN_DESC_HEAP_CHUNK_SIZE (64 * 1024)
+
+struct panfrost_desc {
+        struct panfrost_bo *bo;
+        mali_ptr gpu;
+        void *cpu;
+
+        /* log2 of the size of the entry, or zero if not from a heap */
+        unsigned order;
+};
+
+struct panfrost_desc_retired {
+        struct panfrost_desc desc;
+
+        /* Queue points after which no batch uses the entry, set once every
+         * batch which could use it has been submitted */
+        uint64_t vertex_seqnum, fragment_seqnum, compute_seqnum;
+        bool stamped;
+};
+
+struct panfrost_desc_heap {
+        struct panfrost_device *dev;
+
+        /* Entries may be freed from the application thread with the
+         * threaded context, so everything but retired is locked */
+        simple_mtx_t lock;
+
+        /* BOs entries are carved from, held until cleanup */
+        struct util_dynarray bos;
+
+        /* The unused tail of the newest BO */
+        struct panfrost_bo *bo;
+        unsigned offset;
+
+        /* struct panfrost_desc free for reuse, per order */
+        struct util_dynarray free[PAN_DESC_HEAP_ORDERS];
+
+        /* struct panfrost_desc freed since the last submit */
+        struct util_dynarray freed;
+
+        /* struct panfrost_desc_retired, touched only by the driver thread */
+        struct util_dynarray retired;
+};
+
+void
+panfrost_desc_heap_init(struct panfrost_desc_heap *heap,
+                        struct panfrost_device *dev);
+
+void
+panfrost_desc_heap_cleanup(struct panfrost_desc_heap *heap);
+
+/* Returns an entry with a NULL bo if the size is above the largest order */
+struct panfrost_desc
+panfrost_desc_heap_alloc(struct panfrost_desc_heap *heap, size_t size);
+
+void
+panfrost_desc_heap_free(struct panfrost_desc_heap *heap,
+                        const struct panfrost_desc *desc);
+
+/* Returns retired entries to the free lists */
+void
+panfrost_desc_heap_recycle(struct panfrost_desc_heap *heap,
+                           const struct panfrost_desc_retired *entry);
+
 #endif
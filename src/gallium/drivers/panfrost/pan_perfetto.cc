@@ -0,0 +1,395 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <perfetto.h>
+
+#include "util/hash_table.h"
+#include "util/macros.h"
+#include "util/perf/u_perfetto.h"
+#include "util/perf/u_trace.h"
+
+#include "pan_perfetto.h"
+#include "pan_tracepoints.h"
+
+/* u_trace events are on a queue of their own, after those of the CSF
+ * queues, with their stages after the per-queue ones */
+#define UTRACE_QUEUE_ID PAN_PERFETTO_QUEUE_COUNT
+#define UTRACE_STAGE_ID(stage) (PAN_PERFETTO_QUEUE_COUNT + (stage))
+
+static const struct {
+   const char *name;
+   const char *desc;
+} queues[] = {
+   [PAN_PERFETTO_QUEUE_VERTEX] = {"Vertex", "CSF vertex and tiler queue"},
+   [PAN_PERFETTO_QUEUE_FRAGMENT] = {"Fragment", "CSF fragment queue"},
+   [PAN_PERFETTO_QUEUE_COMPUTE] = {"Compute", "CSF compute queue"},
+   [UTRACE_QUEUE_ID] = {"Driver", "Driver tracepoints"},
+};
+
+static const struct {
+   const char *name;
+   const char *desc;
+} stages[] = {
+   [PAN_PERFETTO_QUEUE_VERTEX] = {"Vertex/tiler", "Vertex shading and tiling"},
+   [PAN_PERFETTO_QUEUE_FRAGMENT] = {"Fragment", "Fragment shading"},
+   [PAN_PERFETTO_QUEUE_COMPUTE] = {"Compute", "Compute job"},
+   [UTRACE_STAGE_ID(PAN_PERFETTO_STAGE_BATCH)] = {"Batch", "Whole batch, on all queues"},
+   [UTRACE_STAGE_ID(PAN_PERFETTO_STAGE_BLITTER)] = {"Blitter", "Blit, clear or modifier conversion"},
+   [UTRACE_STAGE_ID(PAN_PERFETTO_STAGE_COMPUTE)] = {"Dispatch", "Compute dispatch"},
+};
+
+static uint32_t gpu_clock_id;
+
+/* GPU and CPU times of the last clock snapshot. Batches that ran before the
+ * first snapshot are dropped, as perfetto can't place them. */
+static uint64_t sync_gpu_ns;
+static uint64_t sync_cpu_ns;
+
+struct PanRenderpassIncrementalState {
+   bool was_cleared = true;
+};
+
+struct PanRenderpassTraits : public perfetto::DefaultDataSourceTraits {
+   using IncrementalStateType = PanRenderpassIncrementalState;
+};
+
+class PanRenderpassDataSource : public perfetto::DataSource<PanRenderpassDataSource, PanRenderpassTraits> {
+public:
+   void OnSetup(const SetupArgs &) override
+   {
+   }
+
+   void OnStart(const StartArgs &) override
+   {
+      u_trace_perfetto_start();
+      PERFETTO_LOG("Tracing started");
+
+      /* Clock IDs below 128 are reserved, use the hash of a namespaced
+       * string for the GPU clock.
+       */
+      gpu_clock_id =
+         _mesa_hash_string("org.freedesktop.mesa.panfrost") | 0x80000000;
+   }
+
+   void OnStop(const StopArgs &) override
+   {
+      PERFETTO_LOG("Tracing stopped");
+
+      u_trace_perfetto_stop();
+
+      Trace([](PanRenderpassDataSource::TraceContext ctx) {
+         auto packet = ctx.NewTracePacket();
+         packet->Finalize();
+         ctx.Flush();
+      });
+   }
+};
+
+PERFETTO_DECLARE_DATA_SOURCE_STATIC_MEMBERS(PanRenderpassDataSource);
+PERFETTO_DEFINE_DATA_SOURCE_STATIC_MEMBERS(PanRenderpassDataSource);
+
+static void
+send_descriptors(PanRenderpassDataSource::TraceContext &ctx)
+{
+   auto packet = ctx.NewTracePacket();
+
+   packet->set_timestamp(0);
+
+   auto event = packet->set_gpu_render_stage_event();
+   event->set_gpu_id(0);
+
+   auto spec = event->set_specifications();
+
+   for (unsigned i = 0; i < ARRAY_SIZE(queues); i++) {
+      auto desc = spec->add_hw_queue();
+
+      desc->set_name(queues[i].name);
+      desc->set_description(queues[i].desc);
+   }
+
+   for (unsigned i = 0; i < ARRAY_SIZE(stages); i++) {
+      auto desc = spec->add_stage();
+
+      desc->set_name(stages[i].name);
+      desc->set_description(stages[i].desc);
+   }
+}
+
+static void
+stage_start(struct pipe_context *pctx, uint64_t ts_ns,
+            enum panfrost_perfetto_stage stage)
+{
+   panfrost_perfetto_get_state(pctx)->start_ns[stage] = ts_ns;
+}
+
+typedef std::vector<std::pair<const char *, std::string>> extra_data;
+
+static void
+stage_end(struct pipe_context *pctx, uint64_t ts_ns,
+          enum panfrost_perfetto_stage stage, const extra_data &extra)
+{
+   struct panfrost_perfetto_state *p = panfrost_perfetto_get_state(pctx);
+   uint64_t start = p->start_ns[stage];
+
+   p->start_ns[stage] = 0;
+
+   /* Drop events from before the first clock sync, or whose start was
+    * missed */
+   if (!sync_gpu_ns || !start || start < sync_gpu_ns || ts_ns < start)
+      return;
+
+   PanRenderpassDataSource::Trace([=](PanRenderpassDataSource::TraceContext tctx) {
+      if (auto state = tctx.GetIncrementalState(); state->was_cleared) {
+         send_descriptors(tctx);
+         state->was_cleared = false;
+      }
+
+      auto packet = tctx.NewTracePacket();
+
+      packet->set_timestamp(start);
+      packet->set_timestamp_clock_id(gpu_clock_id);
+
+      auto event = packet->set_gpu_render_stage_event();
+      event->set_event_id(0);
+      event->set_hw_queue_id(UTRACE_QUEUE_ID);
+      event->set_stage_id(UTRACE_STAGE_ID(stage));
+      event->set_duration(ts_ns - start);
+      event->set_context((uintptr_t)pctx);
+
+      if (stage == PAN_PERFETTO_STAGE_BATCH)
+         event->set_submission_id(p->batch.seqnum);
+
+      for (const auto &e : extra) {
+         auto data = event->add_extra_data();
+
+         data->set_name(e.first);
+         data->set_value(e.second);
+      }
+   });
+}
+
+static std::string
+hex_string(unsigned value)
+{
+   char str[16];
+
+   snprintf(str, sizeof(str), "0x%x", value);
+   return str;
+}
+
+extern "C" {
+
+/*
+ * Trace callbacks, called from u_trace once the timestamps from the GPU have
+ * been read back.
+ */
+
+void
+panfrost_start_batch(struct pipe_context *pctx, uint64_t ts_ns,
+                     const void *flush_data,
+                     const struct trace_start_batch *payload)
+{
+   struct panfrost_perfetto_state *p = panfrost_perfetto_get_state(pctx);
+
+   p->batch.seqnum = payload->seqnum;
+   p->batch.width = payload->width;
+   p->batch.height = payload->height;
+
+   stage_start(pctx, ts_ns, PAN_PERFETTO_STAGE_BATCH);
+}
+
+void
+panfrost_end_batch(struct pipe_context *pctx, uint64_t ts_ns,
+                   const void *flush_data,
+                   const struct trace_end_batch *payload)
+{
+   struct panfrost_perfetto_state *p = panfrost_perfetto_get_state(pctx);
+
+   stage_end(pctx, ts_ns, PAN_PERFETTO_STAGE_BATCH, {
+      { "reason", payload->reason },
+      { "width", std::to_string(p->batch.width) },
+      { "height", std::to_string(p->batch.height) },
+      { "draws", hex_string(payload->draws) },
+      { "clear", hex_string(payload->clear) },
+      { "preload", hex_string(payload->preload) },
+   });
+}
+
+void
+panfrost_start_blitter(struct pipe_context *pctx, uint64_t ts_ns,
+                       const void *flush_data,
+                       const struct trace_start_blitter *payload)
+{
+   struct panfrost_perfetto_state *p = panfrost_perfetto_get_state(pctx);
+
+   p->blitter.op = payload->op;
+   p->blitter.detail = payload->detail;
+   p->blitter.width = payload->width;
+   p->blitter.height = payload->height;
+
+   stage_start(pctx, ts_ns, PAN_PERFETTO_STAGE_BLITTER);
+}
+
+void
+panfrost_end_blitter(struct pipe_context *pctx, uint64_t ts_ns,
+                     const void *flush_data,
+                     const struct trace_end_blitter *payload)
+{
+   struct panfrost_perfetto_state *p = panfrost_perfetto_get_state(pctx);
+
+   stage_end(pctx, ts_ns, PAN_PERFETTO_STAGE_BLITTER, {
+      { "op", p->blitter.op },
+      { "detail", p->blitter.detail },
+      { "width", std::to_string(p->blitter.width) },
+      { "height", std::to_string(p->blitter.height) },
+   });
+}
+
+void
+panfrost_start_compute(struct pipe_context *pctx, uint64_t ts_ns,
+                       const void *flush_data,
+                       const struct trace_start_compute *payload)
+{
+   stage_start(pctx, ts_ns, PAN_PERFETTO_STAGE_COMPUTE);
+}
+
+void
+panfrost_end_compute(struct pipe_context *pctx, uint64_t ts_ns,
+                     const void *flush_data,
+                     const struct trace_end_compute *payload)
+{
+   stage_end(pctx, ts_ns, PAN_PERFETTO_STAGE_COMPUTE, {});
+}
+
+void
+panfrost_perfetto_init(void)
+{
+   util_perfetto_init();
+
+   perfetto::DataSourceDescriptor dsd;
+   dsd.set_name("gpu.renderstages.panfrost");
+   PanRenderpassDataSource::Register(dsd);
+}
+
+bool
+panfrost_perfetto_enabled(void)
+{
+   bool enabled = false;
+
+   PanRenderpassDataSource::Trace([&](PanRenderpassDataSource::TraceContext) {
+      enabled = true;
+   });
+
+   return enabled;
+}
+
+uint64_t
+panfrost_perfetto_now(void)
+{
+   return perfetto::base::GetBootTimeNs().count();
+}
+
+void
+panfrost_perfetto_sync_clocks(uint64_t cpu_ns, uint64_t gpu_ns)
+{
+   PanRenderpassDataSource::Trace([=](PanRenderpassDataSource::TraceContext tctx) {
+      auto packet = tctx.NewTracePacket();
+
+      packet->set_timestamp(cpu_ns);
+
+      auto event = packet->set_clock_snapshot();
+
+      {
+         auto clock = event->add_clocks();
+
+         clock->set_clock_id(perfetto::protos::pbzero::BUILTIN_CLOCK_BOOTTIME);
+         clock->set_timestamp(cpu_ns);
+      }
+
+      {
+         auto clock = event->add_clocks();
+
+         clock->set_clock_id(gpu_clock_id);
+         clock->set_timestamp(gpu_ns);
+      }
+
+      sync_gpu_ns = gpu_ns;
+      sync_cpu_ns = cpu_ns;
+   });
+}
+
+void
+panfrost_perfetto_emit_batch(const void *context,
+                             const struct panfrost_perfetto_batch *batch)
+{
+   if (!sync_gpu_ns)
+      return;
+
+   PanRenderpassDataSource::Trace([=](PanRenderpassDataSource::TraceContext tctx) {
+      if (auto state = tctx.GetIncrementalState(); state->was_cleared) {
+         send_descriptors(tctx);
+         state->was_cleared = false;
+      }
+
+      for (unsigned q = 0; q < PAN_PERFETTO_QUEUE_COUNT; ++q) {
+         uint64_t start = batch->start_ns[q];
+         uint64_t end = batch->end_ns[q];
+
+         if (!start || end < start || start < sync_gpu_ns)
+            continue;
+
+         auto packet = tctx.NewTracePacket();
+
+         packet->set_timestamp(start);
+         packet->set_timestamp_clock_id(gpu_clock_id);
+
+         auto event = packet->set_gpu_render_stage_event();
+         event->set_event_id(batch->seqnum);
+         event->set_hw_queue_id(q);
+         event->set_stage_id(q);
+         event->set_duration(end - start);
+         event->set_context((uintptr_t)context);
+         event->set_submission_id(batch->seqnum);
+
+         if (batch->reason) {
+            auto data = event->add_extra_data();
+
+            data->set_name("reason");
+            data->set_value(batch->reason);
+         }
+
+         /* Time from the submit ioctl to the GPU picking up the work, with
+          * the start moved to the CPU clock through the last snapshot */
+         uint64_t start_cpu = start - sync_gpu_ns + sync_cpu_ns;
+
+         if (batch->submit_ns && start_cpu >= batch->submit_ns) {
+            auto data = event->add_extra_data();
+
+            data->set_name("submit latency (ns)");
+            data->set_value(std::to_string(start_cpu - batch->submit_ns));
+         }
+      }
+   });
+}
+
+} /* extern "C" */
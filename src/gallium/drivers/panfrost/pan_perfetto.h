@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __PAN_PERFETTO_H__
+#define __PAN_PERFETTO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The CSF queues a batch can run on, each shown as a render stage track */
+enum panfrost_perfetto_queue {
+        PAN_PERFETTO_QUEUE_VERTEX,
+        PAN_PERFETTO_QUEUE_FRAGMENT,
+        PAN_PERFETTO_QUEUE_COMPUTE,
+
+        PAN_PERFETTO_QUEUE_COUNT
+};
+
+/* Stages traced with u_trace, shown on a track of their own */
+enum panfrost_perfetto_stage {
+        PAN_PERFETTO_STAGE_BATCH,
+        PAN_PERFETTO_STAGE_BLITTER,
+        PAN_PERFETTO_STAGE_COMPUTE,
+
+        PAN_PERFETTO_STAGE_COUNT
+};
+
+/* The u_trace stages of a context that have started but not ended yet, see
+ * panfrost_perfetto_get_state */
+struct panfrost_perfetto_state {
+        uint64_t start_ns[PAN_PERFETTO_STAGE_COUNT];
+
+        /* Payloads of the starts, shown with the whole stage */
+        struct {
+                uint32_t seqnum;
+                uint16_t width, height;
+        } batch;
+
+        struct {
+                const char *op, *detail;
+                uint16_t width, height;
+        } blitter;
+};
+
+struct pipe_context;
+
+/* Timing of a batch on each of the queues it used. GPU times are in
+ * nanoseconds, and zero for the queues the batch did not use. */
+struct panfrost_perfetto_batch {
+        uint64_t seqnum;
+        const char *reason;
+
+        /* CLOCK_BOOTTIME when the batch was submitted */
+        uint64_t submit_ns;
+
+        uint64_t start_ns[PAN_PERFETTO_QUEUE_COUNT];
+        uint64_t end_ns[PAN_PERFETTO_QUEUE_COUNT];
+};
+
+#ifdef HAVE_PERFETTO
+
+void panfrost_perfetto_init(void);
+
+/* Whether the render stage data source is being traced */
+bool panfrost_perfetto_enabled(void);
+
+/* CLOCK_BOOTTIME in nanoseconds, the clock Perfetto uses */
+uint64_t panfrost_perfetto_now(void);
+
+/* Record the GPU time matching the CPU time, to place GPU events */
+void panfrost_perfetto_sync_clocks(uint64_t cpu_ns, uint64_t gpu_ns);
+
+void panfrost_perfetto_emit_batch(const void *context,
+                                  const struct panfrost_perfetto_batch *batch);
+
+/* Implemented by the context, for the u_trace callbacks */
+struct panfrost_perfetto_state *
+panfrost_perfetto_get_state(struct pipe_context *pctx);
+
+#else
+
+static inline void
+panfrost_perfetto_init(void)
+{
+}
+
+static inline bool
+panfrost_perfetto_enabled(void)
+{
+        return false;
+}
+
+static inline uint64_t
+panfrost_perfetto_now(void)
+{
+        return 0;
+}
+
+static inline void
+panfrost_perfetto_sync_clocks(uint64_t cpu_ns, uint64_t gpu_ns)
+{
+}
+
+static inline void
+panfrost_perfetto_emit_batch(const void *context,
+                             const struct panfrost_perfetto_batch *batch)
+{
+}
+
+#endif /* HAVE_PERFETTO */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
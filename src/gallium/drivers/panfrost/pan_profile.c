@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util/ralloc.h"
+
+#include "pan_profile.h"
+
+static const char *panfrost_profile_names[PAN_PROFILE_COUNT] = {
+        [PAN_PROFILE_DRAW_VBO] = "draw_vbo",
+        [PAN_PROFILE_LAUNCH_GRID] = "launch_grid",
+        [PAN_PROFILE_UPDATE_STATE_3D] = "update_state_3d",
+        [PAN_PROFILE_UPDATE_SHADER_STATE] = "update_shader_state",
+        [PAN_PROFILE_EMIT_TEXTURES] = "emit_textures",
+        [PAN_PROFILE_EMIT_SAMPLERS] = "emit_samplers",
+        [PAN_PROFILE_EMIT_SHADER_META] = "emit_shader_meta",
+        [PAN_PROFILE_EMIT_CONST_BUF] = "emit_const_buf",
+        [PAN_PROFILE_EMIT_VERTEX_DATA] = "emit_vertex_data",
+        [PAN_PROFILE_EMIT_VARYINGS] = "emit_varyings",
+        [PAN_PROFILE_BATCH_SUBMIT] = "batch_submit",
+        [PAN_PROFILE_PTR_MAP] = "ptr_map",
+        [PAN_PROFILE_PTR_UNMAP] = "ptr_unmap",
+};
+
+static void
+panfrost_profile_start_frame(struct panfrost_profile *prof)
+{
+        memset(prof->sections, 0, sizeof(prof->sections));
+        prof->frame_ns = os_time_get_nano();
+        prof->frame_ticks = panfrost_profile_ticks();
+}
+
+struct panfrost_profile *
+panfrost_profile_create(void *memctx)
+{
+        struct panfrost_profile *prof =
+                rzalloc(memctx, struct panfrost_profile);
+
+        panfrost_profile_start_frame(prof);
+        return prof;
+}
+
+void
+panfrost_profile_end_frame(struct panfrost_profile *prof)
+{
+        uint64_t ns = os_time_get_nano() - prof->frame_ns;
+        uint64_t ticks = panfrost_profile_ticks() - prof->frame_ticks;
+
+        /* The frame is a long enough interval to calibrate the counter */
+        double ns_per_tick = ticks ? (double) ns / ticks : 1.0;
+
+        fprintf(stderr, "panfrost profile, frame %u: %.3f ms\n",
+                prof->frame++, ns / 1000000.0);
+
+        for (unsigned i = 0; i < PAN_PROFILE_COUNT; ++i) {
+                const struct panfrost_profile_stats *s = &prof->sections[i];
+
+                if (!s->calls)
+                        continue;
+
+                fprintf(stderr, "  %-20s %7" PRIu64 " calls %10.1f us"
+                        " %8.0f ns avg %8.0f ns max |",
+                        panfrost_profile_names[i], s->calls,
+                        s->ticks * ns_per_tick / 1000.0,
+                        s->ticks * ns_per_tick / s->calls,
+                        s->max * ns_per_tick);
+
+                /* Bucket b counts the calls below 2^b ticks */
+                for (unsigned b = 0; b < PAN_PROFILE_BUCKETS; ++b) {
+                        if (s->buckets[b]) {
+                                fprintf(stderr, " <%.0f:%u",
+                                        (1ull << b) * ns_per_tick,
+                                        s->buckets[b]);
+                        }
+                }
+
+                fprintf(stderr, "\n");
+        }
+
+        panfrost_profile_start_frame(prof);
+}
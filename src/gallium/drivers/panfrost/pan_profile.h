@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __PAN_PROFILE_H__
+#define __PAN_PROFILE_H__
+
+#include <stdint.h>
+
+#include "util/macros.h"
+#include "util/os_time.h"
+#include "util/u_math.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* CPU-side profiling of the hot paths with PAN_MESA_DEBUG=profile. Sections
+ * are timed with the CPU counter and accumulated in log2 histograms, which
+ * are printed and cleared at the end of each frame. Sections nest, so the
+ * time of a section includes the sections called from it. */
+
+enum panfrost_profile_section {
+        PAN_PROFILE_DRAW_VBO,
+        PAN_PROFILE_LAUNCH_GRID,
+        PAN_PROFILE_UPDATE_STATE_3D,
+        PAN_PROFILE_UPDATE_SHADER_STATE,
+        PAN_PROFILE_EMIT_TEXTURES,
+        PAN_PROFILE_EMIT_SAMPLERS,
+        PAN_PROFILE_EMIT_SHADER_META,
+        PAN_PROFILE_EMIT_CONST_BUF,
+        PAN_PROFILE_EMIT_VERTEX_DATA,
+        PAN_PROFILE_EMIT_VARYINGS,
+        PAN_PROFILE_BATCH_SUBMIT,
+        PAN_PROFILE_PTR_MAP,
+        PAN_PROFILE_PTR_UNMAP,
+
+        PAN_PROFILE_COUNT
+};
+
+/* Histogram buckets are powers of two of counter ticks */
+#define PAN_PROFILE_BUCKETS 32
+
+struct panfrost_profile_stats {
+        uint64_t calls;
+        uint64_t ticks;
+        uint64_t max;
+        uint32_t buckets[PAN_PROFILE_BUCKETS];
+};
+
+struct panfrost_profile {
+        struct panfrost_profile_stats sections[PAN_PROFILE_COUNT];
+
+        /* Counter and monotonic time at the start of the frame, to convert
+         * ticks to nanoseconds without knowing the counter frequency */
+        uint64_t frame_ticks;
+        uint64_t frame_ns;
+        unsigned frame;
+};
+
+static inline uint64_t
+panfrost_profile_ticks(void)
+{
+#if defined(__aarch64__)
+        uint64_t ticks;
+        __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+        return ticks;
+#elif defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return os_time_get_nano();
+#endif
+}
+
+/* Returns the counter at the start of a section, or zero when not
+ * profiling, so the disabled case costs a single branch */
+static inline uint64_t
+panfrost_profile_begin(struct panfrost_profile *prof)
+{
+        if (likely(!prof))
+                return 0;
+
+        return panfrost_profile_ticks();
+}
+
+static inline void
+panfrost_profile_end(struct panfrost_profile *prof,
+                     enum panfrost_profile_section section, uint64_t start)
+{
+        if (likely(!prof))
+                return;
+
+        uint64_t ticks = panfrost_profile_ticks() - start;
+        unsigned bucket = ticks ? MIN2(util_logbase2_64(ticks) + 1,
+                                       PAN_PROFILE_BUCKETS - 1) : 0;
+
+        struct panfrost_profile_stats *s = &prof->sections[section];
+
+        s->calls++;
+        s->ticks += ticks;
+        s->max = MAX2(s->max, ticks);
+        s->buckets[bucket]++;
+}
+
+struct panfrost_profile *panfrost_profile_create(void *memctx);
+
+/* Print the histograms of the frame and start a new one */
+void panfrost_profile_end_frame(struct panfrost_profile *prof);
+
+#endif
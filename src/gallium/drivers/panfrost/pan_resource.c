@@ -45,6 +45,8 @@
 #include "util/u_transfer_helper.h"
 #include "util/u_gen_mipmap.h"
 #include "util/u_drm.h"
+#include "util/u_cpu_detect.h"
+#include "util/streaming-load-memcpy.h"
 
 #include "pan_bo.h"
 #include "pan_context.h"
@@ -145,7 +147,11 @@ panfrost_resource_from_handle(struct pipe_screen *pscreen,
                 return NULL;
         }
 
-        struct panfrost_bo *bo = panfrost_bo_import(dev, whandle->handle);
+        /* Protected buffers can't be mapped by the CPU */
+        uint32_t flags = (templat->bind & PIPE_BIND_PROTECTED) ?
+                         PAN_BO_INVISIBLE : 0;
+
+        struct panfrost_bo *bo = panfrost_bo_import(dev, whandle->handle, flags);
         /* Sometimes an import can fail e.g. on an invalid buffer fd, out of
          * memory space to mmap it etc.
          */
@@ -156,9 +162,12 @@ panfrost_resource_from_handle(struct pipe_screen *pscreen,
 
         rsc->image.data.bo = bo;
 
+        threaded_resource_init(prsc, false);
+        rsc->threaded.is_shared = true;
+
         rsc->modifier_constant = true;
 
-        BITSET_SET(rsc->valid.data, 0);
+        panfrost_resource_set_valid(rsc, 0);
         panfrost_resource_set_damage_region(pscreen, &rsc->base, 0, NULL);
 
         if (dev->ro) {
@@ -167,7 +176,7 @@ panfrost_resource_from_handle(struct pipe_screen *pscreen,
                 /* failure is expected in some cases.. */
         }
 
-        if (rsc->scanout)
+        if (rsc->scanout && !(bo->flags & PAN_BO_INVISIBLE))
                 panfrost_bo_mmap_scanout(bo, dev->ro, rsc->scanout);
 
         return prsc;
@@ -185,6 +194,8 @@ panfrost_resource_get_handle(struct pipe_screen *pscreen,
         struct renderonly_scanout *scanout;
         struct pipe_resource *cur = pt;
 
+        ctx = threaded_context_unwrap_sync(ctx);
+
         /* Even though panfrost doesn't support multi-planar formats, we
          * can get here through GBM, which does. Walk the list of planes
          * to find the right one.
@@ -197,8 +208,22 @@ panfrost_resource_get_handle(struct pipe_screen *pscreen,
         rsrc = pan_resource(cur);
         scanout = rsrc->scanout;
 
+        /* Importers may write, and once exported the BO cannot be replaced,
+         * so packed AFBC has to be unpacked while that is still possible */
+        if (rsrc->afbc_packed) {
+                if (!ctx)
+                        return false;
+
+                pan_resource_unpack_afbc(pan_context(ctx), rsrc,
+                                         "Exporting packed AFBC");
+        }
+
+        if (ctx)
+                panfrost_flush_pending_clear(pan_context(ctx), rsrc, "Export");
+
         handle->modifier = rsrc->image.layout.modifier;
         rsrc->modifier_constant = true;
+        rsrc->threaded.is_shared = true;
 
         if (handle->type == WINSYS_HANDLE_TYPE_KMS && dev->ro) {
                 return renderonly_get_handle(scanout, handle);
@@ -232,6 +257,19 @@ panfrost_resource_get_param(struct pipe_screen *pscreen,
         struct pipe_resource *cur;
         unsigned count;
 
+        /* Planes of imported or GBM multi-planar images are chained
+         * resources, each with its own offset and stride in the dma-buf */
+        if (param != PIPE_RESOURCE_PARAM_NPLANES) {
+                for (unsigned i = 0; i < plane; ++i) {
+                        prsc = prsc->next;
+
+                        if (!prsc)
+                                return false;
+                }
+
+                rsrc = pan_resource(prsc);
+        }
+
         switch (param) {
         case PIPE_RESOURCE_PARAM_STRIDE:
                 *value = panfrost_get_legacy_stride(&rsrc->image.layout, level);
@@ -260,7 +298,8 @@ panfrost_resource_get_param(struct pipe_screen *pscreen,
 static void
 panfrost_flush_resource(struct pipe_context *pctx, struct pipe_resource *prsc)
 {
-        /* TODO */
+        panfrost_flush_pending_clear(pan_context(pctx), pan_resource(prsc),
+                                     "Resource flush");
 }
 
 static struct pipe_surface *
@@ -268,11 +307,9 @@ panfrost_create_surface(struct pipe_context *pipe,
                         struct pipe_resource *pt,
                         const struct pipe_surface *surf_tmpl)
 {
-        struct panfrost_context *ctx = pan_context(pipe);
         struct pipe_surface *ps = NULL;
 
-        pan_legalize_afbc_format(ctx, pan_resource(pt), surf_tmpl->format);
-
+        /* AFBC is legalized in panfrost_set_framebuffer_state */
         ps = CALLOC_STRUCT(pipe_surface);
 
         if (ps) {
@@ -333,7 +370,7 @@ panfrost_should_afbc(struct panfrost_device *dev,
 {
         /* AFBC resources may be rendered to, textured from, or shared across
          * processes, but may not be used as e.g buffers */
-        const unsigned valid_binding =
+        unsigned valid_binding =
                 PIPE_BIND_DEPTH_STENCIL |
                 PIPE_BIND_RENDER_TARGET |
                 PIPE_BIND_BLENDABLE |
@@ -342,6 +379,12 @@ panfrost_should_afbc(struct panfrost_device *dev,
                 PIPE_BIND_SCANOUT |
                 PIPE_BIND_SHARED;
 
+        /* Valhall loads images through the texture unit, which reads AFBC.
+         * Images are only decompressed once bound for stores, see
+         * pan_legalize_afbc_image */
+        if (dev->arch >= 9)
+                valid_binding |= PIPE_BIND_SHADER_IMAGE;
+
         if (pres->base.bind & ~valid_binding)
                 return false;
 
@@ -427,6 +470,14 @@ panfrost_should_tile(struct panfrost_device *dev,
         if (MIN2(pres->base.width0, pres->base.height0) < 2)
                 return false;
 
+        /* Textures which fit in a single tile, like lookup tables or glyphs,
+         * are cached whole while sampled, so tiling only makes uploading them
+         * slower */
+        if (pres->base.bind == PIPE_BIND_SAMPLER_VIEW &&
+            pres->base.width0 <= 16 && pres->base.height0 <= 16 &&
+            pres->base.last_level == 0)
+                return false;
+
         bool can_tile = (pres->base.target != PIPE_BUFFER)
                 && ((pres->base.bind & ~valid_binding) == 0);
 
@@ -672,6 +723,7 @@ panfrost_resource_create_with_modifier(struct pipe_screen *screen,
         pipe_reference_init(&so->base.reference, 1);
 
         util_range_init(&so->valid_buffer_range);
+        threaded_resource_init(&so->base, false);
 
         if (template->bind & PAN_BIND_SHARED_MASK) {
                 /* For compatibility with older consumers that may not be
@@ -761,7 +813,7 @@ panfrost_resource_create_with_modifier(struct pipe_screen *screen,
                         return NULL;
                 }
                 assert(handle.type == WINSYS_HANDLE_TYPE_FD);
-                so->image.data.bo = panfrost_bo_import(dev, handle.handle);
+                so->image.data.bo = panfrost_bo_import(dev, handle.handle, 0);
                 close(handle.handle);
 
                 if (!so->image.data.bo) {
@@ -774,15 +826,31 @@ panfrost_resource_create_with_modifier(struct pipe_screen *screen,
                 /* We create a BO immediately but don't bother mapping, since we don't
                  * care to map e.g. FBOs which the CPU probably won't touch */
 
-                /* For now, don't cache buffers as syncing can be slow when
-                 * too much memory is mapped. TODO: dynamically switch, or use
-                 * the STREAM_READ etc. hints? */
+                /* Buffers are mostly written by the CPU and read by the GPU,
+                 * which write-combining handles well, so only cache those
+                 * meant for readback. The others are switched to a cached BO
+                 * if they are read back often, see
+                 * panfrost_resource_make_cached().
+                 *
+                 * Buffers are mapped right away, as the threaded context maps
+                 * them unsynchronized from the application thread, where
+                 * mmapping on first use would race with the driver thread. */
                 bool buffer = (template->target == PIPE_BUFFER);
-                unsigned cache_flag = buffer ? 0 : PAN_BO_CACHEABLE;
+                bool cached = !buffer || template->usage == PIPE_USAGE_STAGING;
+                unsigned flags = (cached ? PAN_BO_CACHEABLE : 0) |
+                                 (buffer ? 0 : PAN_BO_DELAY_MMAP);
+                size_t size = so->image.layout.data_size;
+
+                /* Only buffers can be sparse, PIPE_CAP_MAX_SPARSE_* are 0 */
+                if (template->flags & PIPE_RESOURCE_FLAG_SPARSE) {
+                        assert(buffer && dev->kbase);
+                        flags = PAN_BO_SPARSE;
+                        size = ALIGN_POT(size, PAN_SPARSE_PAGE_SIZE);
+                }
 
                 so->image.data.bo =
-                        panfrost_bo_create(dev, so->image.layout.data_size,
-                                           PAN_BO_DELAY_MMAP | cache_flag, label);
+                        panfrost_bo_create(dev, size, flags, label);
+                panfrost_bo_set_category(so->image.data.bo, PAN_MEM_RESOURCE);
 
                 so->constant_stencil = true;
         }
@@ -792,7 +860,9 @@ panfrost_resource_create_with_modifier(struct pipe_screen *screen,
 
         panfrost_resource_set_damage_region(screen, &so->base, 0, NULL);
 
-        if (template->bind & PIPE_BIND_INDEX_BUFFER)
+        /* Valhall draws index straight into the vertex shader output
+         * allocation, so index bounds are never needed */
+        if ((template->bind & PIPE_BIND_INDEX_BUFFER) && dev->arch < 9)
                 so->index_cache = CALLOC_STRUCT(panfrost_minmax_cache);
 
         return (struct pipe_resource *)so;
@@ -809,7 +879,9 @@ panfrost_resource_create(struct pipe_screen *screen,
 }
 
 /* If no modifier is specified, we'll choose. Otherwise, the order of
- * preference is compressed, tiled, linear. */
+ * preference is compressed, tiled, linear. Scanout buffers first look for a
+ * modifier the display can scan out, so the window system doesn't have to
+ * fall back to composition or a linear copy. */
 
 static struct pipe_resource *
 panfrost_resource_create_with_modifiers(struct pipe_screen *screen,
@@ -817,26 +889,38 @@ panfrost_resource_create_with_modifiers(struct pipe_screen *screen,
                          const uint64_t *modifiers, int count)
 {
         struct panfrost_device *dev = pan_device(screen);
+        bool scanout = template->bind & PIPE_BIND_SCANOUT;
 
-        for (unsigned i = 0; i < PAN_MODIFIER_COUNT; ++i) {
-                uint64_t mod = pan_best_modifiers[i];
+        for (unsigned pass = scanout ? 0 : 1; pass < 2; ++pass) {
+                for (unsigned i = 0; i < PAN_MODIFIER_COUNT; ++i) {
+                        uint64_t mod = pan_best_modifiers[i];
 
-                if (drm_is_afbc(mod) && !dev->has_afbc)
-                        continue;
+                        if (mod != DRM_FORMAT_MOD_LINEAR && (dev->debug & PAN_DBG_LINEAR))
+                                continue;
 
-                if (mod != DRM_FORMAT_MOD_LINEAR && (dev->debug & PAN_DBG_LINEAR))
-                        continue;
+                        /* Skips AFBC variants the format doesn't support */
+                        if (!screen->is_dmabuf_modifier_supported(screen, mod,
+                                                                  template->format,
+                                                                  NULL))
+                                continue;
 
-                /* TODO: What if mod is an unsupported AFBC variant for this
-                 * format? */
+                        if (pass == 0 &&
+                            !panfrost_scanout_supports_modifier(pan_screen(screen),
+                                                                template->format,
+                                                                mod))
+                                continue;
 
-                if (drm_find_modifier(mod, modifiers, count)) {
-                        return panfrost_resource_create_with_modifier(screen, template, mod);
+                        if (drm_find_modifier(mod, modifiers, count)) {
+                                return panfrost_resource_create_with_modifier(screen, template, mod);
+                        }
                 }
         }
 
-        /* If we didn't find one, app specified invalid */
-        assert(count == 1 && modifiers[0] == DRM_FORMAT_MOD_INVALID);
+        /* If we didn't find one, app specified invalid or only modifiers we
+         * can't use with this format */
+        if (!drm_find_modifier(DRM_FORMAT_MOD_INVALID, modifiers, count))
+                return NULL;
+
         return panfrost_resource_create(screen, template);
 }
 
@@ -850,16 +934,103 @@ panfrost_resource_destroy(struct pipe_screen *screen,
         if (rsrc->scanout)
                 renderonly_scanout_destroy(rsrc->scanout, dev->ro);
 
+        /* User memory is kept coherent for as long as the resource lives,
+         * see panfrost_resource_from_user_memory */
+        if (rsrc->threaded.is_user_ptr) {
+                struct panfrost_screen *pscreen = pan_screen(screen);
+
+                simple_mtx_lock(&pscreen->coherent.lock);
+                util_dynarray_delete_unordered(&pscreen->coherent.rsrcs,
+                                               struct panfrost_resource *,
+                                               rsrc);
+                simple_mtx_unlock(&pscreen->coherent.lock);
+        }
+
         if (rsrc->image.data.bo)
                 panfrost_bo_unreference(rsrc->image.data.bo);
 
+        for (unsigned i = 0; i < rsrc->bo_ring.count; ++i)
+                panfrost_bo_unreference(rsrc->bo_ring.bos[i]);
+
+        panfrost_index_derivatives_clear(rsrc);
+        free(rsrc->index_derivs);
         free(rsrc->index_cache);
         free(rsrc->damage.tile_map.data);
 
         util_range_destroy(&rsrc->valid_buffer_range);
+        threaded_resource_deinit(pt);
         free(rsrc);
 }
 
+/* Clears of whole tiles need no draw: a batch which only clears, restricted
+ * to the tiles of the rectangle, clears them in its fragment job. Tiles are
+ * at most 32x32, the granularity of the tile enable map too. Rectangles
+ * cutting through tiles are drawn by u_blitter instead. */
+
+#define PAN_CLEAR_TILE_ALIGN 32
+
+static bool
+panfrost_clear_fits_tiles(const struct pipe_surface *dst,
+                          unsigned x, unsigned y,
+                          unsigned width, unsigned height)
+{
+        unsigned align = PAN_CLEAR_TILE_ALIGN;
+
+        return !(x % align) && !(y % align) &&
+               (!((x + width) % align) || x + width >= dst->width) &&
+               (!((y + height) % align) || y + height >= dst->height);
+}
+
+static void
+panfrost_clear_surface(struct panfrost_context *ctx,
+                       const struct pipe_framebuffer_state *fb,
+                       struct pipe_surface *dst, unsigned buffers,
+                       const union pipe_color_union *color,
+                       double depth, unsigned stencil,
+                       unsigned x, unsigned y,
+                       unsigned width, unsigned height,
+                       const char *reason)
+{
+        struct pipe_context *pipe = &ctx->base;
+        unsigned maxx = MIN2(x + width, fb->width);
+        unsigned maxy = MIN2(y + height, fb->height);
+        bool partial = x || y || maxx < fb->width || maxy < fb->height;
+
+        /* A clear of the rectangle would supersede a pending clear of the
+         * whole surface, see panfrost_batch_fold_clears */
+        if (partial)
+                panfrost_flush_pending_clear(ctx, pan_resource(dst->texture), reason);
+
+        struct pipe_framebuffer_state tmp = {0};
+        util_copy_framebuffer_state(&tmp, &ctx->pipe_framebuffer);
+
+        pipe->set_framebuffer_state(pipe, fb);
+
+        struct panfrost_batch *batch = panfrost_get_fresh_batch_for_fbo(ctx, reason);
+
+        /* Earlier clears would be widened to the rectangle or widen it, so
+         * they get a batch of their own */
+        if (partial && batch->clear) {
+                batch->keep_clears = true;
+                batch->closed = true;
+                ctx->batch = NULL;
+                batch = panfrost_get_batch_for_fbo(ctx);
+        }
+
+        panfrost_batch_clear_rect(batch, buffers, color, depth, stencil,
+                                  x, y, maxx, maxy);
+
+        /* Keep later draws out, see panfrost_batch_clear_rect */
+        if (partial) {
+                batch->keep_clears = true;
+                batch->closed = true;
+                ctx->batch = NULL;
+        }
+
+        pipe->set_framebuffer_state(pipe, &tmp);
+        util_unreference_framebuffer_state(&tmp);
+}
+
 static void
 panfrost_clear_render_target(struct pipe_context *pipe,
                              struct pipe_surface *dst,
@@ -870,10 +1041,18 @@ panfrost_clear_render_target(struct pipe_context *pipe,
 {
         struct panfrost_context *ctx = pan_context(pipe);
 
-        /* TODO: dstx, etc. */
+        if (render_condition_enabled && !panfrost_render_condition_check(ctx))
+                return;
+
+        if (!panfrost_clear_fits_tiles(dst, dstx, dsty, width, height)) {
+                panfrost_blitter_save(ctx, render_condition_enabled);
 
-        struct pipe_framebuffer_state tmp = {0};
-        util_copy_framebuffer_state(&tmp, &ctx->pipe_framebuffer);
+                ctx->blitter_trace.op = "clear render target";
+                util_blitter_clear_render_target(ctx->blitter, dst, color,
+                                                 dstx, dsty, width, height);
+                ctx->blitter_trace.op = NULL;
+                return;
+        }
 
         struct pipe_framebuffer_state fb = {
                 .width = dst->width,
@@ -883,13 +1062,10 @@ panfrost_clear_render_target(struct pipe_context *pipe,
                 .nr_cbufs = 1,
                 .cbufs[0] = dst,
         };
-        pipe->set_framebuffer_state(pipe, &fb);
-
-        struct panfrost_batch *batch = panfrost_get_fresh_batch_for_fbo(ctx, "Clear render target");
-        panfrost_batch_clear(batch, PIPE_CLEAR_COLOR0, color, 0, 0);
 
-        pipe->set_framebuffer_state(pipe, &tmp);
-        util_unreference_framebuffer_state(&tmp);
+        panfrost_clear_surface(ctx, &fb, dst, PIPE_CLEAR_COLOR0, color, 0, 0,
+                               dstx, dsty, width, height,
+                               "Clear render target");
 }
 
 static void
@@ -903,10 +1079,19 @@ panfrost_clear_depth_stencil(struct pipe_context *pipe,
 {
         struct panfrost_context *ctx = pan_context(pipe);
 
-        /* TODO: dstx, etc. */
+        if (render_condition_enabled && !panfrost_render_condition_check(ctx))
+                return;
 
-        struct pipe_framebuffer_state tmp = {0};
-        util_copy_framebuffer_state(&tmp, &ctx->pipe_framebuffer);
+        if (!panfrost_clear_fits_tiles(dst, dstx, dsty, width, height)) {
+                panfrost_blitter_save(ctx, render_condition_enabled);
+
+                ctx->blitter_trace.op = "clear depth/stencil";
+                util_blitter_clear_depth_stencil(ctx->blitter, dst, clear_flags,
+                                                 depth, stencil, dstx, dsty,
+                                                 width, height);
+                ctx->blitter_trace.op = NULL;
+                return;
+        }
 
         struct pipe_framebuffer_state fb = {
                 .width = dst->width,
@@ -916,22 +1101,137 @@ panfrost_clear_depth_stencil(struct pipe_context *pipe,
                 .nr_cbufs = 0,
                 .zsbuf = dst,
         };
-        pipe->set_framebuffer_state(pipe, &fb);
 
-        struct panfrost_batch *batch = panfrost_get_fresh_batch_for_fbo(ctx, "Clear depth/stencil");
-        panfrost_batch_clear(batch, clear_flags, NULL, depth, stencil);
+        panfrost_clear_surface(ctx, &fb, dst, clear_flags, NULL, depth, stencil,
+                               dstx, dsty, width, height,
+                               "Clear depth/stencil");
+}
 
-        pipe->set_framebuffer_state(pipe, &tmp);
-        util_unreference_framebuffer_state(&tmp);
+/* Whether a CPU write covers the whole of a resource, in which case it can be
+ * converted to linear in place rather than with a blit */
+
+static bool
+panfrost_entire_overwrite(const struct panfrost_resource *prsrc,
+                          const struct pipe_box *box)
+{
+        return box->x == 0 && box->y == 0 &&
+               box->width == prsrc->base.width0 &&
+               box->height == prsrc->base.height0;
+}
+
+static struct panfrost_bo *
+panfrost_staging_ring_alloc(struct panfrost_context *ctx, size_t size,
+                            unsigned *offset)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct panfrost_staging_ring *ring = &ctx->staging;
+
+        size = ALIGN_POT(size, 64);
+
+        if (size > PAN_STAGING_BO_SIZE)
+                return NULL;
+
+        if (!ring->count ||
+            ring->offset + size > ring->bos[ring->current]->size) {
+                bool found = false;
+
+                /* Oldest first, the current BO being the last resort */
+                for (unsigned i = 1; i <= ring->count; ++i) {
+                        unsigned idx = (ring->current + i) % ring->count;
+                        struct panfrost_bo *bo = ring->bos[idx];
+
+                        if (p_atomic_read(&bo->refcnt) == 1 &&
+                            panfrost_bo_wait(bo, 0, true)) {
+                                ring->current = idx;
+                                found = true;
+                                break;
+                        }
+                }
+
+                if (!found) {
+                        if (ring->count == PAN_STAGING_RING_SIZE)
+                                return NULL;
+
+                        struct panfrost_bo *bo =
+                                panfrost_bo_create(dev, PAN_STAGING_BO_SIZE,
+                                                   PAN_BO_CACHEABLE,
+                                                   "Staging ring");
+
+                        if (!bo)
+                                return NULL;
+
+                        panfrost_bo_set_category(bo, PAN_MEM_POOL);
+                        ring->current = ring->count;
+                        ring->bos[ring->count++] = bo;
+                }
+
+                ring->offset = 0;
+        }
+
+        struct panfrost_bo *bo = ring->bos[ring->current];
+
+        *offset = ring->offset;
+        ring->offset += size;
+
+        panfrost_bo_reference(bo);
+        return bo;
+}
+
+void
+panfrost_staging_ring_cleanup(struct panfrost_staging_ring *ring)
+{
+        for (unsigned i = 0; i < ring->count; ++i)
+                panfrost_bo_unreference(ring->bos[i]);
+
+        memset(ring, 0, sizeof(*ring));
+}
+
+/* Wraps a range of the staging ring as a linear resource, or returns NULL if
+ * it does not fit */
+
+static struct panfrost_resource *
+panfrost_staging_create(struct panfrost_context *ctx,
+                        const struct pipe_resource *template)
+{
+        struct pipe_screen *screen = ctx->base.screen;
+        struct panfrost_resource *so = CALLOC_STRUCT(panfrost_resource);
+
+        so->base = *template;
+        so->base.screen = screen;
+
+        pipe_reference_init(&so->base.reference, 1);
+
+        util_range_init(&so->valid_buffer_range);
+        threaded_resource_init(&so->base, false);
+
+        panfrost_resource_setup(pan_device(screen), so, DRM_FORMAT_MOD_LINEAR,
+                                template->format);
+
+        so->image.data.bo =
+                panfrost_staging_ring_alloc(ctx, so->image.layout.data_size,
+                                            &so->image.data.offset);
+
+        if (!so->image.data.bo) {
+                struct pipe_resource *p = &so->base;
+
+                pipe_resource_reference(&p, NULL);
+                return NULL;
+        }
+
+        return so;
 }
 
 /* Most of the time we can do CPU-side transfers, but sometimes we need to use
  * the 3D pipe for this. Let's wrap u_blitter to blit to/from staging textures.
- * Code adapted from freedreno */
+ * Code adapted from freedreno.
+ *
+ * Staging resources come from the staging ring unless they may outlive the
+ * transfer, see panfrost_ptr_unmap. Depth/stencil formats may need a
+ * separate stencil resource, so those always get their own. */
 
 static struct panfrost_resource *
 pan_alloc_staging(struct panfrost_context *ctx, struct panfrost_resource *rsc,
-		unsigned level, const struct pipe_box *box)
+		unsigned level, const struct pipe_box *box, bool transient)
 {
         struct pipe_context *pctx = &ctx->base;
         struct pipe_resource tmpl = rsc->base;
@@ -954,6 +1254,14 @@ pan_alloc_staging(struct panfrost_context *ctx, struct panfrost_resource *rsc,
         tmpl.bind |= PIPE_BIND_LINEAR;
         tmpl.bind &= ~PAN_BIND_SHARED_MASK;
 
+        if (transient && !util_format_is_depth_or_stencil(tmpl.format)) {
+                struct panfrost_resource *staging =
+                        panfrost_staging_create(ctx, &tmpl);
+
+                if (staging)
+                        return staging;
+        }
+
         struct pipe_resource *pstaging =
                 pctx->screen->resource_create(pctx->screen, &tmpl);
         if (!pstaging)
@@ -993,6 +1301,7 @@ pan_blit_from_staging(struct pipe_context *pctx, struct panfrost_transfer *trans
         blit.mask = util_format_get_mask(blit.src.format);
         blit.filter = PIPE_TEX_FILTER_NEAREST;
 
+        pan_context(pctx)->stats.staging_blits++;
         panfrost_blit(pctx, &blit);
 }
 
@@ -1013,9 +1322,128 @@ pan_blit_to_staging(struct pipe_context *pctx, struct panfrost_transfer *trans)
         blit.mask = util_format_get_mask(blit.dst.format);
         blit.filter = PIPE_TEX_FILTER_NEAREST;
 
+        pan_context(pctx)->stats.staging_blits++;
         panfrost_blit(pctx, &blit);
 }
 
+/* Tiled transfers touching at least this many bytes are split into bands of
+ * tile rows and spread over the screen's tiling threads. Smaller transfers are
+ * not worth the synchronization and stay on the calling thread. */
+#define PAN_TILING_THREAD_MIN_SIZE (1 << 20)
+#define PAN_TILING_MAX_THREADS 8
+
+struct panfrost_tiling_job {
+        void *linear;
+        void *tiled;
+        unsigned x, y, w, h;
+        uint32_t linear_stride;
+        uint32_t tiled_stride;
+        enum pipe_format format;
+        bool store;
+        struct util_queue_fence fence;
+};
+
+static void
+panfrost_tiling_job_execute(void *data, void *gdata, int thread_index)
+{
+        struct panfrost_tiling_job *job = data;
+
+        if (job->store) {
+                panfrost_store_tiled_image(job->tiled, job->linear,
+                                           job->x, job->y, job->w, job->h,
+                                           job->tiled_stride,
+                                           job->linear_stride, job->format);
+        } else {
+                panfrost_load_tiled_image(job->linear, job->tiled,
+                                          job->x, job->y, job->w, job->h,
+                                          job->linear_stride,
+                                          job->tiled_stride, job->format);
+        }
+}
+
+/* Copies a region between a linear staging buffer and a u-interleaved image,
+ * in either direction. Bands are aligned to rows of tiles so no two threads
+ * write the same tile, and the calling thread handles the last band itself
+ * before waiting for the others. */
+
+static void
+panfrost_access_tiled_image_threaded(struct panfrost_screen *screen,
+                                     void *linear, void *tiled,
+                                     unsigned x, unsigned y,
+                                     unsigned w, unsigned h,
+                                     uint32_t linear_stride,
+                                     uint32_t tiled_stride,
+                                     enum pipe_format format, bool store)
+{
+        unsigned block_h = util_format_get_blockheight(format);
+        unsigned tile_h = 16 * block_h;
+        unsigned first_tile = y / tile_h;
+        unsigned last_tile = DIV_ROUND_UP(y + h, tile_h);
+        unsigned tile_rows = last_tile - first_tile;
+        size_t size = (size_t) linear_stride * DIV_ROUND_UP(h, block_h);
+
+        unsigned num_jobs = 0;
+
+        if (util_queue_is_initialized(&screen->tiling_queue) &&
+            size >= PAN_TILING_THREAD_MIN_SIZE) {
+                num_jobs = MIN3(tile_rows,
+                                screen->tiling_queue.num_threads + 1,
+                                PAN_TILING_MAX_THREADS);
+        }
+
+        if (num_jobs <= 1) {
+                struct panfrost_tiling_job job = {
+                        .linear = linear, .tiled = tiled,
+                        .x = x, .y = y, .w = w, .h = h,
+                        .linear_stride = linear_stride,
+                        .tiled_stride = tiled_stride,
+                        .format = format, .store = store,
+                };
+
+                panfrost_tiling_job_execute(&job, NULL, 0);
+                return;
+        }
+
+        struct panfrost_tiling_job jobs[PAN_TILING_MAX_THREADS];
+        unsigned rows_per_job = DIV_ROUND_UP(tile_rows, num_jobs);
+        unsigned start = y;
+        unsigned n = 0;
+
+        while (start < y + h) {
+                unsigned end = MIN2((first_tile + (n + 1) * rows_per_job) * tile_h,
+                                    y + h);
+                struct panfrost_tiling_job *job = &jobs[n];
+
+                *job = (struct panfrost_tiling_job) {
+                        .linear = (uint8_t *) linear +
+                                  ((start - y) / block_h) * linear_stride,
+                        .tiled = tiled,
+                        .x = x, .y = start, .w = w, .h = end - start,
+                        .linear_stride = linear_stride,
+                        .tiled_stride = tiled_stride,
+                        .format = format, .store = store,
+                };
+
+                start = end;
+                n++;
+
+                if (start < y + h) {
+                        util_queue_fence_init(&job->fence);
+                        util_queue_add_job(&screen->tiling_queue, job,
+                                           &job->fence,
+                                           panfrost_tiling_job_execute,
+                                           NULL, 0);
+                } else {
+                        panfrost_tiling_job_execute(job, NULL, 0);
+                }
+        }
+
+        for (unsigned i = 0; i < n - 1; ++i) {
+                util_queue_fence_wait(&jobs[i].fence);
+                util_queue_fence_destroy(&jobs[i].fence);
+        }
+}
+
 static void
 panfrost_load_tiled_images(struct panfrost_transfer *transfer,
                            struct panfrost_resource *rsrc)
@@ -1041,11 +1469,12 @@ panfrost_load_tiled_images(struct panfrost_transfer *transfer,
                                rsrc->image.layout.slices[level].offset +
                                (z + ptrans->box.z) * stride;
 
-                panfrost_load_tiled_image(dst, map, ptrans->box.x,
-                                          ptrans->box.y, ptrans->box.width,
-                                          ptrans->box.height, ptrans->stride,
-                                          rsrc->image.layout.slices[level].row_stride,
-                                          rsrc->image.layout.format);
+                panfrost_access_tiled_image_threaded(pan_screen(rsrc->base.screen),
+                                dst, map, ptrans->box.x, ptrans->box.y,
+                                ptrans->box.width, ptrans->box.height,
+                                ptrans->stride,
+                                rsrc->image.layout.slices[level].row_stride,
+                                rsrc->image.layout.format, false);
         }
 }
 
@@ -1067,11 +1496,12 @@ panfrost_store_tiled_images(struct panfrost_transfer *transfer,
                                rsrc->image.layout.slices[level].offset +
                                (z + ptrans->box.z) * stride;
 
-                panfrost_store_tiled_image(map, src,
-                                ptrans->box.x, ptrans->box.y,
+                panfrost_access_tiled_image_threaded(pan_screen(rsrc->base.screen),
+                                src, map, ptrans->box.x, ptrans->box.y,
                                 ptrans->box.width, ptrans->box.height,
+                                ptrans->stride,
                                 rsrc->image.layout.slices[level].row_stride,
-                                ptrans->stride, rsrc->image.layout.format);
+                                rsrc->image.layout.format, true);
         }
 }
 
@@ -1085,116 +1515,476 @@ panfrost_box_covers_resource(const struct pipe_resource *resource,
                                                 box->depth);
 }
 
-static void *
-panfrost_ptr_map(struct pipe_context *pctx,
-                      struct pipe_resource *resource,
-                      unsigned level,
-                      unsigned usage,  /* a combination of PIPE_MAP_x */
-                      const struct pipe_box *box,
-                      struct pipe_transfer **out_transfer)
+struct panfrost_dirty_range {
+        struct panfrost_bo *bo;
+        size_t start, end;
+};
+
+/* Queues a clean of a range written by the CPU. Nothing reads it before the
+ * next submit, so the clean is left until then, when the ranges of each BO
+ * are merged and every line is cleaned once. Consecutive writes to the same
+ * BO are merged straight away. */
+
+static void
+panfrost_bo_defer_clean(struct panfrost_screen *screen,
+                        struct panfrost_bo *bo, size_t offset, size_t size)
 {
-        struct panfrost_context *ctx = pan_context(pctx);
-        struct panfrost_device *dev = pan_device(pctx->screen);
-        struct panfrost_resource *rsrc = pan_resource(resource);
-        enum pipe_format format = rsrc->image.layout.format;
-        int bytes_per_block = util_format_get_blocksize(format);
-        struct panfrost_bo *bo = rsrc->image.data.bo;
+        if (!bo->cached || !size)
+                return;
 
-        /* Can't map tiled/compressed directly */
-        if ((usage & PIPE_MAP_DIRECTLY) && rsrc->image.layout.modifier != DRM_FORMAT_MOD_LINEAR)
-                return NULL;
+        simple_mtx_lock(&screen->dirty.lock);
 
-        struct panfrost_transfer *transfer = rzalloc(pctx, struct panfrost_transfer);
-        transfer->base.level = level;
-        transfer->base.usage = usage;
-        transfer->base.box = *box;
+        struct util_dynarray *ranges = &screen->dirty.ranges;
 
-        pipe_resource_reference(&transfer->base.resource, resource);
-        *out_transfer = &transfer->base;
+        if (ranges->size) {
+                struct panfrost_dirty_range *last =
+                        util_dynarray_top_ptr(ranges, struct panfrost_dirty_range);
 
-        if (usage & PIPE_MAP_WRITE)
-                rsrc->constant_stencil = false;
+                if (last->bo == bo && offset <= last->end &&
+                    offset + size >= last->start) {
+                        last->start = MIN2(last->start, offset);
+                        last->end = MAX2(last->end, offset + size);
+                        simple_mtx_unlock(&screen->dirty.lock);
+                        return;
+                }
+        }
 
-        /* We don't have s/w routines for AFBC, so use a staging texture */
-        if (drm_is_afbc(rsrc->image.layout.modifier)) {
-                struct panfrost_resource *staging = pan_alloc_staging(ctx, rsrc, level, box);
-                assert(staging);
+        panfrost_bo_reference(bo);
 
-                panfrost_bo_mmap(staging->image.data.bo);
+        struct panfrost_dirty_range range = {
+                .bo = bo,
+                .start = offset,
+                .end = offset + size,
+        };
 
-                /* Staging resources have one LOD: level 0. Query the strides
-                 * on this LOD.
-                 */
-                transfer->base.stride = staging->image.layout.slices[0].row_stride;
-                transfer->base.layer_stride =
-                        panfrost_get_layer_stride(&staging->image.layout, 0);
+        util_dynarray_append(ranges, struct panfrost_dirty_range, range);
+        simple_mtx_unlock(&screen->dirty.lock);
+}
 
-                transfer->staging.rsrc = &staging->base;
+static int
+panfrost_dirty_range_compare(const void *a, const void *b)
+{
+        const struct panfrost_dirty_range *ra = a, *rb = b;
 
-                transfer->staging.box = *box;
-                transfer->staging.box.x = 0;
-                transfer->staging.box.y = 0;
-                transfer->staging.box.z = 0;
+        if (ra->bo != rb->bo)
+                return (uintptr_t) ra->bo < (uintptr_t) rb->bo ? -1 : 1;
 
-                assert(transfer->staging.rsrc != NULL);
+        if (ra->start != rb->start)
+                return ra->start < rb->start ? -1 : 1;
 
-                bool valid = BITSET_TEST(rsrc->valid.data, level);
+        return 0;
+}
 
-                if ((usage & PIPE_MAP_READ) && (valid || rsrc->track.nr_writers > 0)) {
-                        pan_blit_to_staging(pctx, transfer);
-                        panfrost_flush_writer(ctx, staging, "AFBC read staging blit");
-                        panfrost_bo_wait(staging->image.data.bo, INT64_MAX, false);
+/* Cleans every range queued by panfrost_bo_defer_clean, called before each
+ * submit. Whichever context submits first cleans for all of them. */
 
-                        panfrost_bo_mem_invalidate(staging->image.data.bo, 0,
-                                                   staging->image.data.bo->size);
-                }
+void
+panfrost_resource_clean_dirty(struct panfrost_screen *screen)
+{
+        simple_mtx_lock(&screen->dirty.lock);
+
+        struct util_dynarray *ranges = &screen->dirty.ranges;
+        unsigned count = util_dynarray_num_elements(ranges,
+                                                    struct panfrost_dirty_range);
 
-                return staging->image.data.bo->ptr.cpu;
+        if (!count) {
+                simple_mtx_unlock(&screen->dirty.lock);
+                return;
         }
 
-        /* If we haven't already mmaped, now's the time */
-        panfrost_bo_mmap(bo);
+        struct panfrost_dirty_range *r = ranges->data;
 
-        if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
-                pandecode_inject_mmap(bo->ptr.gpu, bo->ptr.cpu, bo->size, NULL);
+        if (count > 1)
+                qsort(r, count, sizeof(*r), panfrost_dirty_range_compare);
 
-        /* Upgrade writes to uninitialized ranges to UNSYNCHRONIZED */
-        if ((usage & PIPE_MAP_WRITE) &&
-            resource->target == PIPE_BUFFER &&
-            !util_ranges_intersect(&rsrc->valid_buffer_range, box->x, box->x + box->width)) {
+        for (unsigned i = 0; i < count;) {
+                struct panfrost_bo *bo = r[i].bo;
+                size_t start = r[i].start, end = r[i].end;
+                unsigned j = i + 1;
 
-                usage |= PIPE_MAP_UNSYNCHRONIZED;
-        }
+                for (; j < count && r[j].bo == bo; ++j) {
+                        if (r[j].start > end) {
+                                panfrost_bo_mem_clean(bo, start, end - start);
+                                start = r[j].start;
+                        }
 
-        /* Upgrade DISCARD_RANGE to WHOLE_RESOURCE if the whole resource is
-         * being mapped.
-         */
-        if ((usage & PIPE_MAP_DISCARD_RANGE) &&
-            !(usage & PIPE_MAP_UNSYNCHRONIZED) &&
-            !(resource->flags & PIPE_RESOURCE_FLAG_MAP_PERSISTENT) &&
-            panfrost_box_covers_resource(resource, box) &&
-            !(rsrc->image.data.bo->flags & PAN_BO_SHARED)) {
+                        end = MAX2(end, r[j].end);
+                }
 
-                usage |= PIPE_MAP_DISCARD_WHOLE_RESOURCE;
+                panfrost_bo_mem_clean(bo, start, end - start);
+
+                /* Each range holds a reference of its own */
+                for (; i < j; ++i)
+                        panfrost_bo_unreference(r[i].bo);
         }
 
-        bool create_new_bo = usage & PIPE_MAP_DISCARD_WHOLE_RESOURCE;
-        bool copy_resource = false;
+        util_dynarray_clear(ranges);
+        simple_mtx_unlock(&screen->dirty.lock);
+}
 
-        if (!create_new_bo &&
-            !(usage & PIPE_MAP_UNSYNCHRONIZED) &&
-            !(resource->flags & PIPE_RESOURCE_FLAG_MAP_PERSISTENT) &&
-            (usage & PIPE_MAP_WRITE) &&
-            rsrc->track.nr_users > 0 &&
-            bo->size < 16 * 1024 * 1024) {
+/* Cleans or invalidates the CPU caches for the region of a resource covered
+ * by a transfer box, one range per layer. Cleans are deferred to the next
+ * submit. */
 
-                /* When a resource to be modified is already being used by a
-                 * pending batch, it is often faster to copy the whole BO than
-                 * to flush and split the frame in two.
-                 */
+static void
+panfrost_box_mem_op(struct panfrost_resource *rsrc, unsigned level,
+                    const struct pipe_box *box, bool invalidate)
+{
+        struct panfrost_screen *screen = pan_screen(rsrc->base.screen);
+        struct panfrost_bo *bo = rsrc->image.data.bo;
+        enum pipe_format format = rsrc->image.layout.format;
 
-                panfrost_flush_writer(ctx, rsrc, "Shadow resource creation");
-                panfrost_bo_wait(bo, INT64_MAX, false);
+        if (!bo->cached)
+                return;
+
+        if (rsrc->base.target == PIPE_BUFFER) {
+                size_t bytes_per_block = util_format_get_blocksize(format);
+                size_t offset = box->x * bytes_per_block;
+                size_t size = box->width * bytes_per_block;
+
+                if (invalidate)
+                        panfrost_bo_mem_invalidate(bo, offset, size);
+                else
+                        panfrost_bo_defer_clean(screen, bo, offset, size);
+
+                return;
+        }
+
+        if (drm_is_afbc(rsrc->image.layout.modifier)) {
+                if (invalidate)
+                        panfrost_bo_mem_invalidate(bo, 0, bo->size);
+                else
+                        panfrost_bo_defer_clean(screen, bo, 0, bo->size);
+
+                return;
+        }
+
+        struct pipe_box box_blocks;
+        u_box_pixels_to_blocks(&box_blocks, box, format);
+
+        for (unsigned z = 0; z < box_blocks.depth; ++z) {
+                size_t offset, size;
+
+                panfrost_get_region_range(&rsrc->image.layout, level,
+                                          box_blocks.z + z,
+                                          box_blocks.x, box_blocks.y,
+                                          box_blocks.width, box_blocks.height,
+                                          &offset, &size);
+
+                if (invalidate)
+                        panfrost_bo_mem_invalidate(bo, offset, size);
+                else
+                        panfrost_bo_defer_clean(screen, bo, offset, size);
+        }
+}
+
+/* Moves a buffer which is repeatedly read back by the CPU to a CPU-cached BO,
+ * since reads through an uncached mapping are very slow. Called once the
+ * GPU is done writing the buffer. */
+
+static void
+panfrost_resource_make_cached(struct panfrost_context *ctx,
+                              struct panfrost_resource *rsrc)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct panfrost_bo *bo = rsrc->image.data.bo;
+
+        /* Persistent mappings would keep pointing at the old BO, and shared,
+         * sparse and user memory BOs can't be replaced */
+        if (rsrc->base.target != PIPE_BUFFER || bo->cached ||
+            (bo->flags & (PAN_BO_SHARED | PAN_BO_SPARSE | PAN_BO_USERPTR)) ||
+            (rsrc->base.flags & PIPE_RESOURCE_FLAG_MAP_PERSISTENT) ||
+            (dev->debug & PAN_DBG_UNCACHED_CPU))
+                return;
+
+        unsigned threshold = pan_screen(ctx->base.screen)->cached_read_threshold;
+
+        if (!threshold || ++rsrc->access.cpu_reads < threshold)
+                return;
+
+        struct panfrost_bo *newbo =
+                panfrost_bo_create(dev, bo->size,
+                                   (bo->flags & ~PAN_BO_DELAY_MMAP) |
+                                   PAN_BO_CACHEABLE, bo->label);
+
+        if (!newbo)
+                return;
+
+        panfrost_bo_set_category(newbo, PAN_MEM_RESOURCE);
+
+        perf_debug_ctx(ctx, "Moving a buffer read back %u times to a cached BO",
+                       rsrc->access.cpu_reads);
+
+        util_streaming_load_memcpy(newbo->ptr.cpu, bo->ptr.cpu, bo->size);
+        panfrost_bo_mem_clean(newbo, 0, newbo->size);
+
+        /* Make sure we re-emit any descriptors using this resource */
+        panfrost_dirty_state_all(ctx);
+        panfrost_resource_swap_bo(ctx, rsrc, newbo);
+}
+
+/* Persistent, coherent maps of CPU-cached buffers, which have to be kept
+ * coherent with the GPU by hand. Maps may come from the application thread
+ * of the threaded context, so the screen lock protects the bookkeeping. */
+
+static bool
+panfrost_is_coherent_map(struct panfrost_resource *rsrc, unsigned usage)
+{
+        unsigned pc = PIPE_MAP_PERSISTENT | PIPE_MAP_COHERENT;
+
+        return rsrc->base.target == PIPE_BUFFER && (usage & pc) == pc &&
+               rsrc->image.data.bo->cached;
+}
+
+static void
+panfrost_coherent_map_begin(struct panfrost_resource *rsrc,
+                            struct panfrost_transfer *transfer)
+{
+        struct panfrost_screen *screen = pan_screen(rsrc->base.screen);
+        const struct pipe_box *box = &transfer->base.box;
+
+        simple_mtx_lock(&screen->coherent.lock);
+
+        if (!rsrc->coherent.maps++) {
+                rsrc->coherent.start = box->x;
+                rsrc->coherent.end = box->x + box->width;
+                util_dynarray_append(&screen->coherent.rsrcs,
+                                     struct panfrost_resource *, rsrc);
+        } else {
+                rsrc->coherent.start = MIN2(rsrc->coherent.start, box->x);
+                rsrc->coherent.end = MAX2(rsrc->coherent.end,
+                                          box->x + box->width);
+        }
+
+        simple_mtx_unlock(&screen->coherent.lock);
+        transfer->coherent = true;
+}
+
+static void
+panfrost_coherent_map_end(struct panfrost_resource *rsrc)
+{
+        struct panfrost_screen *screen = pan_screen(rsrc->base.screen);
+
+        simple_mtx_lock(&screen->coherent.lock);
+
+        if (!--rsrc->coherent.maps) {
+                util_dynarray_delete_unordered(&screen->coherent.rsrcs,
+                                               struct panfrost_resource *,
+                                               rsrc);
+        }
+
+        simple_mtx_unlock(&screen->coherent.lock);
+}
+
+/* Writes through coherent maps are visible to the commands submitted after
+ * them, without any flush from the application */
+
+void
+panfrost_resource_clean_coherent(struct panfrost_batch *batch)
+{
+        struct panfrost_screen *screen = pan_screen(batch->ctx->base.screen);
+
+        simple_mtx_lock(&screen->coherent.lock);
+
+        util_dynarray_foreach(&screen->coherent.rsrcs,
+                              struct panfrost_resource *, prsrc) {
+                struct panfrost_resource *rsrc = *prsrc;
+
+                if (_mesa_set_search(batch->resources, rsrc)) {
+                        panfrost_bo_mem_clean(rsrc->image.data.bo,
+                                              rsrc->coherent.start,
+                                              rsrc->coherent.end -
+                                              rsrc->coherent.start);
+                }
+        }
+
+        simple_mtx_unlock(&screen->coherent.lock);
+}
+
+void
+panfrost_resource_invalidate_coherent(struct panfrost_screen *screen)
+{
+        simple_mtx_lock(&screen->coherent.lock);
+
+        util_dynarray_foreach(&screen->coherent.rsrcs,
+                              struct panfrost_resource *, prsrc) {
+                struct panfrost_resource *rsrc = *prsrc;
+
+                panfrost_bo_mem_invalidate(rsrc->image.data.bo,
+                                           rsrc->coherent.start,
+                                           rsrc->coherent.end -
+                                           rsrc->coherent.start);
+        }
+
+        simple_mtx_unlock(&screen->coherent.lock);
+}
+
+/* Buffers wrapping application memory, for CL_MEM_USE_HOST_PTR and
+ * AMD_pinned_memory. The GPU uses the memory in place, so nothing is copied
+ * in either direction. The application may write the memory at any time, so
+ * it is treated like a persistent, coherent map for its whole life. */
+
+static struct pipe_resource *
+panfrost_resource_from_user_memory(struct pipe_screen *pscreen,
+                                   const struct pipe_resource *template,
+                                   void *user_memory)
+{
+        struct panfrost_device *dev = pan_device(pscreen);
+        struct panfrost_screen *screen = pan_screen(pscreen);
+
+        /* Images would need the application to use our layout */
+        if (template->target != PIPE_BUFFER)
+                return NULL;
+
+        struct panfrost_bo *bo =
+                panfrost_bo_import_user(dev, user_memory, template->width0);
+
+        if (!bo)
+                return NULL;
+
+        struct panfrost_resource *so = CALLOC_STRUCT(panfrost_resource);
+        so->base = *template;
+        so->base.screen = pscreen;
+
+        pipe_reference_init(&so->base.reference, 1);
+
+        util_range_init(&so->valid_buffer_range);
+        threaded_resource_init(&so->base, false);
+        so->threaded.is_user_ptr = true;
+
+        panfrost_resource_setup(dev, so, DRM_FORMAT_MOD_LINEAR, template->format);
+        so->image.data.bo = bo;
+
+        util_range_add(&so->base, &so->valid_buffer_range, 0, template->width0);
+
+        simple_mtx_lock(&screen->coherent.lock);
+        so->coherent.maps = 1;
+        so->coherent.start = 0;
+        so->coherent.end = template->width0;
+        util_dynarray_append(&screen->coherent.rsrcs,
+                             struct panfrost_resource *, so);
+        simple_mtx_unlock(&screen->coherent.lock);
+
+        return &so->base;
+}
+
+/* Streaming vertex, index and uniform data is typically orphaned every
+ * frame, so those buffers recycle their old BOs rather than going through
+ * the BO cache each time */
+
+static bool
+panfrost_resource_has_bo_ring(const struct panfrost_resource *rsrc)
+{
+        return rsrc->base.target == PIPE_BUFFER &&
+               (rsrc->base.usage == PIPE_USAGE_DYNAMIC ||
+                rsrc->base.usage == PIPE_USAGE_STREAM) &&
+               (rsrc->base.bind & (PIPE_BIND_VERTEX_BUFFER |
+                                   PIPE_BIND_INDEX_BUFFER |
+                                   PIPE_BIND_CONSTANT_BUFFER));
+}
+
+static void
+panfrost_bo_ring_shift(struct panfrost_resource *rsrc)
+{
+        rsrc->bo_ring.count--;
+        memmove(&rsrc->bo_ring.bos[0], &rsrc->bo_ring.bos[1],
+                rsrc->bo_ring.count * sizeof(rsrc->bo_ring.bos[0]));
+}
+
+/* Takes the oldest BO of the ring if nothing uses it anymore. Batches which
+ * are not submitted yet hold a reference, and submitted ones are waited
+ * for. */
+
+static struct panfrost_bo *
+panfrost_bo_ring_get(struct panfrost_resource *rsrc)
+{
+        if (!rsrc->bo_ring.count)
+                return NULL;
+
+        struct panfrost_bo *bo = rsrc->bo_ring.bos[0];
+
+        if (p_atomic_read(&bo->refcnt) != 1 || !panfrost_bo_wait(bo, 0, true))
+                return NULL;
+
+        panfrost_bo_ring_shift(rsrc);
+        return bo;
+}
+
+static void
+panfrost_bo_ring_put(struct panfrost_resource *rsrc, struct panfrost_bo *bo)
+{
+        if (rsrc->bo_ring.count == PAN_BO_RING_SIZE) {
+                panfrost_bo_unreference(rsrc->bo_ring.bos[0]);
+                panfrost_bo_ring_shift(rsrc);
+        }
+
+        panfrost_bo_reference(bo);
+        rsrc->bo_ring.bos[rsrc->bo_ring.count++] = bo;
+}
+
+/* Makes a level of a non-AFBC resource ready for CPU access to a box:
+ * waits for or shadows the BO with respect to pending GPU access, then
+ * invalidates the CPU caches for the box. The resource's BO may be replaced.
+ */
+
+static void
+panfrost_ptr_map_sync(struct panfrost_context *ctx,
+                      struct panfrost_resource *rsrc,
+                      unsigned level, unsigned usage,
+                      const struct pipe_box *box)
+{
+        struct pipe_resource *resource = &rsrc->base;
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct panfrost_bo *bo = rsrc->image.data.bo;
+
+        /* The threaded context invalidates buffers itself, and maps their
+         * current BO unsynchronized from the application thread without
+         * waiting for us, so the BO must not be replaced behind its back */
+        bool may_replace = !(usage & TC_TRANSFER_MAP_NO_INVALIDATE);
+
+        if (!may_replace)
+                usage &= ~PIPE_MAP_DISCARD_WHOLE_RESOURCE;
+
+        /* Upgrade writes to uninitialized ranges to UNSYNCHRONIZED, unless
+         * the threaded context tracks the ranges instead */
+        if ((usage & PIPE_MAP_WRITE) &&
+            !(usage & TC_TRANSFER_MAP_NO_INFER_UNSYNCHRONIZED) &&
+            resource->target == PIPE_BUFFER &&
+            !util_ranges_intersect(&rsrc->valid_buffer_range, box->x, box->x + box->width)) {
+
+                usage |= PIPE_MAP_UNSYNCHRONIZED;
+        }
+
+        /* Upgrade DISCARD_RANGE to WHOLE_RESOURCE if the whole resource is
+         * being mapped.
+         */
+        if (may_replace &&
+            (usage & PIPE_MAP_DISCARD_RANGE) &&
+            !(usage & PIPE_MAP_UNSYNCHRONIZED) &&
+            !(resource->flags & PIPE_RESOURCE_FLAG_MAP_PERSISTENT) &&
+            panfrost_box_covers_resource(resource, box) &&
+            !(rsrc->image.data.bo->flags & PAN_BO_SHARED)) {
+
+                usage |= PIPE_MAP_DISCARD_WHOLE_RESOURCE;
+        }
+
+        bool create_new_bo = usage & PIPE_MAP_DISCARD_WHOLE_RESOURCE;
+        bool copy_resource = false;
+
+        if (!create_new_bo && may_replace &&
+            !(usage & PIPE_MAP_UNSYNCHRONIZED) &&
+            !(resource->flags & PIPE_RESOURCE_FLAG_MAP_PERSISTENT) &&
+            (usage & PIPE_MAP_WRITE) &&
+            rsrc->track.nr_users > 0 &&
+            bo->size < 16 * 1024 * 1024) {
+
+                /* When a resource to be modified is already being used by a
+                 * pending batch, it is often faster to copy the whole BO than
+                 * to flush and split the frame in two.
+                 */
+
+                panfrost_flush_writer(ctx, rsrc, "Shadow resource creation");
+                panfrost_bo_wait(bo, INT64_MAX, false);
 
                 create_new_bo = true;
                 copy_resource = !(usage & PIPE_MAP_DISCARD_WHOLE_RESOURCE);
@@ -1217,7 +2007,11 @@ panfrost_ptr_map(struct pipe_context *pctx,
                 /* If the BO is used by one of the pending batches or if it's
                  * not ready yet (still accessed by one of the already flushed
                  * batches), we try to allocate a new one to avoid waiting.
+                 * Flushed batches only count once the submit queue has
+                 * handed them to the kernel.
                  */
+                panfrost_flush_submit_queue(ctx);
+
                 if (rsrc->track.nr_users > 0 ||
                     !panfrost_bo_wait(bo, 0, true)) {
                         /* We want the BO to be MMAPed. */
@@ -1227,18 +2021,42 @@ panfrost_ptr_map(struct pipe_context *pctx,
                         /* When the BO has been imported/exported, we can't
                          * replace it by another one, otherwise the
                          * importer/exporter wouldn't see the change we're
-                         * doing to it.
+                         * doing to it. Sparse BOs would lose their commits,
+                         * and user memory must stay in use.
                          */
-                        if (!(bo->flags & PAN_BO_SHARED))
+                        bool fixed = bo->flags & (PAN_BO_SHARED | PAN_BO_SPARSE |
+                                                  PAN_BO_USERPTR);
+                        bool ring = panfrost_resource_has_bo_ring(rsrc) &&
+                                    !fixed;
+
+                        if (ring)
+                                newbo = panfrost_bo_ring_get(rsrc);
+
+                        if (!newbo && !fixed)
                                 newbo = panfrost_bo_create(dev, bo->size,
                                                            flags, bo->label);
 
                         if (newbo) {
+                                panfrost_bo_set_category(newbo, PAN_MEM_RESOURCE);
+
                                 if (copy_resource) {
                                         panfrost_bo_mem_invalidate(bo, 0, bo->size);
-                                        memcpy(newbo->ptr.cpu, bo->ptr.cpu, bo->size);
+
+                                        /* Reads from uncached mappings are
+                                         * much faster with streaming loads */
+                                        if (bo->cached) {
+                                                memcpy(newbo->ptr.cpu, bo->ptr.cpu,
+                                                       bo->size);
+                                        } else {
+                                                util_streaming_load_memcpy(newbo->ptr.cpu,
+                                                                           bo->ptr.cpu,
+                                                                           bo->size);
+                                        }
                                 }
 
+                                if (ring)
+                                        panfrost_bo_ring_put(rsrc, bo);
+
                                 panfrost_resource_swap_bo(ctx, rsrc, newbo);
 
                                 if (!copy_resource &&
@@ -1262,25 +2080,117 @@ panfrost_ptr_map(struct pipe_context *pctx,
                 } else if (usage & PIPE_MAP_READ) {
                         panfrost_flush_writer(ctx, rsrc, "Synchronized read");
                         panfrost_bo_wait(bo, INT64_MAX, false);
+                        panfrost_resource_make_cached(ctx, rsrc);
                 }
         } else {
                 /* No flush for writes to uninitialized */
                 cache_inval = false;
         }
 
-        /* TODO: Only the accessed region for textures */
-        if (cache_inval) {
-                size_t offset = 0;
-                size_t size = bo->size;
+        if (cache_inval)
+                panfrost_box_mem_op(rsrc, level, box, true);
+}
 
-                if (resource->target == PIPE_BUFFER) {
-                        offset = box->x * (size_t) bytes_per_block;
-                        size = box->width * (size_t) bytes_per_block;
+static void *
+panfrost_ptr_map_impl(struct pipe_context *pctx,
+                      struct pipe_resource *resource,
+                      unsigned level,
+                      unsigned usage,  /* a combination of PIPE_MAP_x */
+                      const struct pipe_box *box,
+                      struct pipe_transfer **out_transfer)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+        struct panfrost_device *dev = pan_device(pctx->screen);
+        struct panfrost_resource *rsrc = pan_resource(resource);
+        enum pipe_format format = rsrc->image.layout.format;
+        int bytes_per_block = util_format_get_blocksize(format);
+        struct panfrost_bo *bo = rsrc->image.data.bo;
+
+        /* Can't map tiled/compressed directly */
+        if ((usage & PIPE_MAP_DIRECTLY) && rsrc->image.layout.modifier != DRM_FORMAT_MOD_LINEAR)
+                return NULL;
+
+        /* Nor GPU-only imports */
+        if (bo->flags & PAN_BO_INVISIBLE)
+                return NULL;
+
+        struct panfrost_transfer *transfer = rzalloc(pctx, struct panfrost_transfer);
+        transfer->base.level = level;
+        transfer->base.usage = usage;
+        transfer->base.box = *box;
+
+        pipe_resource_reference(&transfer->base.resource, resource);
+        *out_transfer = &transfer->base;
+
+        if (usage & PIPE_MAP_DISCARD_WHOLE_RESOURCE)
+                rsrc->pending_clear.valid = false;
+        else
+                panfrost_flush_pending_clear(ctx, rsrc, "CPU access");
+
+        if (usage & PIPE_MAP_WRITE) {
+                rsrc->constant_stencil = false;
+                pan_resource_unpack_afbc(ctx, rsrc, "CPU write to packed AFBC");
+        }
+
+        /* We don't have s/w routines for AFBC, so use a staging texture */
+        if (drm_is_afbc(rsrc->image.layout.modifier)) {
+                /* A write of the whole resource may keep the staging BO,
+                 * see panfrost_ptr_unmap */
+                bool transient = !(usage & PIPE_MAP_WRITE) ||
+                                 !panfrost_entire_overwrite(rsrc, box);
+                struct panfrost_resource *staging =
+                        pan_alloc_staging(ctx, rsrc, level, box, transient);
+                assert(staging);
+
+                panfrost_bo_mmap(staging->image.data.bo);
+
+                /* Staging resources have one LOD: level 0. Query the strides
+                 * on this LOD.
+                 */
+                transfer->base.stride = staging->image.layout.slices[0].row_stride;
+                transfer->base.layer_stride =
+                        panfrost_get_layer_stride(&staging->image.layout, 0);
+
+                transfer->staging.rsrc = &staging->base;
+
+                transfer->staging.box = *box;
+                transfer->staging.box.x = 0;
+                transfer->staging.box.y = 0;
+                transfer->staging.box.z = 0;
+
+                assert(transfer->staging.rsrc != NULL);
+
+                bool valid = BITSET_TEST(rsrc->valid.data, level);
+
+                if ((usage & PIPE_MAP_READ) && (valid || rsrc->track.nr_writers > 0)) {
+                        /* Prefer a compute unpack of the box, which avoids
+                         * a fragment job and framebuffer for the staging */
+                        if (panfrost_afbc_unpack(ctx, rsrc, level, box, staging))
+                                ctx->stats.staging_blits++;
+                        else
+                                pan_blit_to_staging(pctx, transfer);
+
+                        panfrost_flush_writer(ctx, staging, "AFBC read staging blit");
+                        panfrost_bo_wait(staging->image.data.bo, INT64_MAX, false);
+
+                        panfrost_bo_mem_invalidate(staging->image.data.bo,
+                                                   staging->image.data.offset,
+                                                   staging->image.layout.data_size);
                 }
 
-                panfrost_bo_mem_invalidate(bo, offset, size);
+                return staging->image.data.bo->ptr.cpu +
+                       staging->image.data.offset;
         }
 
+        /* If we haven't already mmaped, now's the time */
+        panfrost_bo_mmap(bo);
+
+        if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
+                pandecode_inject_mmap(bo->ptr.gpu, bo->ptr.cpu, bo->size, NULL);
+
+        panfrost_ptr_map_sync(ctx, rsrc, level, usage, box);
+        bo = rsrc->image.data.bo;
+
         /* For access to compressed textures, we want the (x, y, w, h)
          * region-of-interest in blocks, not pixels. Then we compute the stride
          * between rows of blocks as the width in blocks times the width per
@@ -1305,8 +2215,6 @@ panfrost_ptr_map(struct pipe_context *pctx,
                  * caching... I don't know if this is actually possible but we
                  * should still get it right */
 
-                // TODO: Fix this for cached BOs
-
                 unsigned dpw = PIPE_MAP_DIRECTLY | PIPE_MAP_WRITE | PIPE_MAP_PERSISTENT;
 
                 if ((usage & dpw) == dpw && rsrc->index_cache)
@@ -1320,10 +2228,14 @@ panfrost_ptr_map(struct pipe_context *pctx,
                  * initialized (maybe), so be conservative */
 
                 if (usage & PIPE_MAP_WRITE) {
-                        BITSET_SET(rsrc->valid.data, level);
+                        panfrost_resource_set_valid(rsrc, level);
                         panfrost_minmax_cache_invalidate(rsrc->index_cache, &transfer->base);
+                        panfrost_index_derivatives_invalidate(rsrc, box->x, box->width);
                 }
 
+                if (panfrost_is_coherent_map(rsrc, usage))
+                        panfrost_coherent_map_begin(rsrc, transfer);
+
                 return bo->ptr.cpu
                        + rsrc->image.layout.slices[level].offset
                        + box->z * transfer->base.layer_stride
@@ -1332,6 +2244,65 @@ panfrost_ptr_map(struct pipe_context *pctx,
         }
 }
 
+/* Unsynchronized buffer maps of the threaded context are made from the
+ * application thread while the driver thread runs, so they mustn't touch the
+ * context. Buffers are linear and mapped on creation, so this is just a
+ * pointer into the BO. The unmap is queued to the driver thread, which does
+ * the bookkeeping of writes. */
+
+static void *
+panfrost_ptr_map_threaded(struct pipe_resource *resource,
+                          unsigned usage,
+                          const struct pipe_box *box,
+                          struct pipe_transfer **out_transfer)
+{
+        struct panfrost_resource *rsrc = pan_resource(resource);
+        struct panfrost_bo *bo = rsrc->image.data.bo;
+        unsigned dpw = PIPE_MAP_DIRECTLY | PIPE_MAP_WRITE | PIPE_MAP_PERSISTENT;
+
+        assert(resource->target == PIPE_BUFFER);
+
+        if ((bo->flags & PAN_BO_INVISIBLE) ||
+            ((usage & dpw) == dpw && rsrc->index_cache))
+                return NULL;
+
+        struct panfrost_transfer *transfer = rzalloc(NULL, struct panfrost_transfer);
+        transfer->base.usage = usage;
+        transfer->base.box = *box;
+
+        pipe_resource_reference(&transfer->base.resource, resource);
+        *out_transfer = &transfer->base;
+
+        panfrost_bo_mmap(bo);
+
+        if (panfrost_is_coherent_map(rsrc, usage))
+                panfrost_coherent_map_begin(rsrc, transfer);
+
+        return bo->ptr.cpu + box->x;
+}
+
+static void *
+panfrost_ptr_map(struct pipe_context *pctx,
+                 struct pipe_resource *resource,
+                 unsigned level,
+                 unsigned usage,
+                 const struct pipe_box *box,
+                 struct pipe_transfer **out_transfer)
+{
+        if (usage & TC_TRANSFER_MAP_THREADED_UNSYNC)
+                return panfrost_ptr_map_threaded(resource, usage, box,
+                                                 out_transfer);
+
+        struct panfrost_context *ctx = pan_context(pctx);
+        uint64_t start = panfrost_profile_begin(ctx->profile);
+
+        void *ptr = panfrost_ptr_map_impl(pctx, resource, level, usage, box,
+                                          out_transfer);
+
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_PTR_MAP, start);
+        return ptr;
+}
+
 void
 pan_resource_modifier_convert(struct panfrost_context *ctx,
                               struct panfrost_resource *rsrc,
@@ -1339,7 +2310,14 @@ pan_resource_modifier_convert(struct panfrost_context *ctx,
 {
         assert(!rsrc->modifier_constant);
 
-        perf_debug_ctx(ctx, "Disabling AFBC with a blit. Reason: %s", reason);
+        ctx->stats.modifier_conversions++;
+        perf_debug_ctx(ctx, "%s with a blit. Reason: %s",
+                       modifier == rsrc->image.layout.modifier ?
+                       "Reallocating" :
+                       drm_is_afbc(modifier) ? "Enabling AFBC" :
+                       drm_is_afbc(rsrc->image.layout.modifier) ?
+                       "Disabling AFBC" : "Changing layout",
+                       reason);
 
         struct pipe_resource *tmp_prsrc =
                 panfrost_resource_create_with_modifier(
@@ -1364,6 +2342,9 @@ pan_resource_modifier_convert(struct panfrost_context *ctx,
                 .filter       = PIPE_TEX_FILTER_NEAREST
         };
 
+        ctx->blitter_trace.op = "modifier conversion";
+        ctx->blitter_trace.detail = reason;
+
         for (int i = 0; i <= rsrc->base.last_level; i++) {
                 if (BITSET_TEST(rsrc->valid.data, i)) {
                         blit.dst.level = blit.src.level  = i;
@@ -1371,6 +2352,9 @@ pan_resource_modifier_convert(struct panfrost_context *ctx,
                 }
         }
 
+        ctx->blitter_trace.op = NULL;
+        ctx->blitter_trace.detail = NULL;
+
         panfrost_bo_unreference(rsrc->image.data.bo);
 
         rsrc->image.data.bo = tmp_rsrc->image.data.bo;
@@ -1378,9 +2362,100 @@ pan_resource_modifier_convert(struct panfrost_context *ctx,
 
         panfrost_resource_setup(pan_device(ctx->base.screen), rsrc, modifier,
                                 blit.dst.format);
+
+        /* Setting up with an explicit modifier marks it constant, but it is
+         * still ours to change */
+        rsrc->modifier_constant = false;
+
+        /* The blit did not write the CRCs of the new BO */
+        rsrc->valid.crc = false;
         pipe_resource_reference(&tmp_prsrc, NULL);
 }
 
+/* Streaming uploads convert resources to linear, but textures which are only
+ * written by the CPU while loading are sampled for much longer afterwards.
+ * Once a demoted resource has been sampled by enough batches without a CPU
+ * write in between, blit it back to the modifier it was created with */
+
+void
+pan_resource_maybe_promote(struct panfrost_context *ctx,
+                           struct panfrost_resource *rsrc)
+{
+        uint64_t modifier = rsrc->access.demoted_from;
+
+        if (!modifier || rsrc->modifier_constant ||
+            rsrc->image.layout.modifier != DRM_FORMAT_MOD_LINEAR ||
+            rsrc->access.gpu_samples < LAYOUT_PROMOTE_THRESHOLD)
+                return;
+
+        perf_debug_ctx(ctx, "Restoring layout after %u batches sampled and "
+                       "%u of %u CPU maps wrote",
+                       rsrc->access.gpu_samples, rsrc->access.cpu_writes,
+                       rsrc->access.cpu_maps);
+
+        rsrc->access.demoted_from = 0;
+        rsrc->modifier_updates = 0;
+
+        pan_resource_modifier_convert(ctx, rsrc, modifier,
+                                      "Sampled without CPU writes");
+}
+
+/* Packing is opt-in per resource, or enabled for all textures for debugging.
+ * Only single-level 2D textures which are not currently bound for rendering
+ * are packed, and not those which may be shared since the BO is replaced. */
+
+static bool
+panfrost_should_pack_afbc(struct panfrost_context *ctx,
+                          struct panfrost_resource *rsrc)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct pipe_framebuffer_state *fb = &ctx->pipe_framebuffer;
+
+        if (!(rsrc->base.flags & PAN_RESOURCE_FLAG_PACKED_AFBC) &&
+            !(dev->debug & PAN_DBG_AFBC_PACK))
+                return false;
+
+        if (!drm_is_afbc(rsrc->image.layout.modifier) || rsrc->afbc_packed ||
+            rsrc->pending_clear.valid ||
+            rsrc->modifier_constant || (rsrc->base.bind & PAN_BIND_SHARED_MASK) ||
+            rsrc->base.target != PIPE_TEXTURE_2D ||
+            rsrc->base.last_level != 0 || rsrc->base.nr_samples > 1 ||
+            !BITSET_TEST(rsrc->valid.data, 0) ||
+            rsrc->access.samples_since_write < LAYOUT_PACK_THRESHOLD)
+                return false;
+
+        for (unsigned i = 0; i < fb->nr_cbufs; ++i) {
+                if (fb->cbufs[i] && fb->cbufs[i]->texture == &rsrc->base)
+                        return false;
+        }
+
+        return !fb->zsbuf || fb->zsbuf->texture != &rsrc->base;
+}
+
+void
+pan_resource_maybe_pack(struct panfrost_context *ctx,
+                        struct panfrost_resource *rsrc)
+{
+        if (panfrost_should_pack_afbc(ctx, rsrc))
+                panfrost_afbc_pack(ctx, rsrc);
+}
+
+/* Writes need the worst-case body layout back, which a blit into a freshly
+ * allocated resource with the same modifier provides */
+
+void
+pan_resource_unpack_afbc(struct panfrost_context *ctx,
+                         struct panfrost_resource *rsrc,
+                         const char *reason)
+{
+        if (!rsrc->afbc_packed)
+                return;
+
+        rsrc->afbc_packed = false;
+        pan_resource_modifier_convert(ctx, rsrc, rsrc->image.layout.modifier,
+                                      reason);
+}
+
 /* Validate that an AFBC resource may be used as a particular format. If it may
  * not, decompress it on the fly. Failure to do so can produce wrong results or
  * invalid data faults when sampling or rendering to AFBC */
@@ -1404,46 +2479,149 @@ pan_legalize_afbc_format(struct panfrost_context *ctx,
                         "Reinterpreting AFBC surface as incompatible format");
 }
 
+/* Images are written with pixel granularity, which AFBC can't do, and before
+ * Valhall they are read through the attribute unit, which can't decompress.
+ * Valhall reads images through the texture unit, so AFBC images bound only for
+ * loads are kept compressed. Other bindings decompress the resource, and
+ * pan_resource_maybe_recompress compresses it again once it is only sampled */
+
+static bool
+panfrost_image_needs_decompress(struct panfrost_device *dev,
+                                const struct pipe_image_view *image)
+{
+        return dev->arch < 9 ||
+               ((image->access | image->shader_access) & PIPE_IMAGE_ACCESS_WRITE);
+}
+
+void
+pan_legalize_afbc_image(struct panfrost_context *ctx,
+                        const struct pipe_image_view *image)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+        struct panfrost_resource *rsrc = pan_resource(image->resource);
+        uint64_t modifier = rsrc->image.layout.modifier;
+
+        if (!drm_is_afbc(modifier))
+                return;
+
+        if (!panfrost_image_needs_decompress(dev, image)) {
+                ctx->stats.afbc_image_loads++;
+                pan_legalize_afbc_format(ctx, rsrc, image->format);
+                return;
+        }
+
+        if (!rsrc->modifier_constant)
+                rsrc->access.image_demoted_from = modifier;
+
+        rsrc->access.samples_since_image_write = 0;
+        ctx->stats.afbc_image_decompressions++;
+
+        pan_resource_modifier_convert(ctx, rsrc,
+                        DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED,
+                        "Shader image");
+}
+
+static bool
+panfrost_bound_as_written_image(struct panfrost_context *ctx,
+                                struct panfrost_resource *rsrc)
+{
+        struct panfrost_device *dev = pan_device(ctx->base.screen);
+
+        for (unsigned s = 0; s < PIPE_SHADER_TYPES; ++s) {
+                u_foreach_bit(i, ctx->image_mask[s]) {
+                        const struct pipe_image_view *image = &ctx->images[s][i];
+
+                        if (image->resource == &rsrc->base &&
+                            panfrost_image_needs_decompress(dev, image))
+                                return true;
+                }
+        }
+
+        return false;
+}
+
+void
+pan_resource_maybe_recompress(struct panfrost_context *ctx,
+                              struct panfrost_resource *rsrc)
+{
+        uint64_t modifier = rsrc->access.image_demoted_from;
+
+        if (!modifier || rsrc->modifier_constant ||
+            drm_is_afbc(rsrc->image.layout.modifier) ||
+            rsrc->access.samples_since_image_write < LAYOUT_RECOMPRESS_THRESHOLD ||
+            panfrost_bound_as_written_image(ctx, rsrc))
+                return;
+
+        perf_debug_ctx(ctx, "Compressing after %u batches sampled without "
+                       "image stores", rsrc->access.samples_since_image_write);
+
+        rsrc->access.image_demoted_from = 0;
+        ctx->stats.afbc_image_recompressions++;
+
+        pan_resource_modifier_convert(ctx, rsrc, modifier,
+                                      "Sampled without image stores");
+}
+
+/* Streaming uploads, where the CPU writes a texture again after only a few
+ * batches sampled it, pay for tiling or compression on every upload and get
+ * little back for it, so such textures are converted to linear. Writes not
+ * preceded by any sample, like uploading an atlas piece by piece while
+ * loading, don't count either way, while a write after many samples starts
+ * the count over. pan_resource_maybe_promote converts back once sampling
+ * dominates again.
+ *
+ * Called for each CPU write of a texture, before the sample count is reset.
+ * Only single-level 2D resources are converted, which covers video players
+ * and dynamic atlases.
+ */
+
 static bool
 panfrost_should_linear_convert(struct panfrost_device *dev,
-                               struct panfrost_resource *prsrc,
-                               struct pipe_transfer *transfer)
+                               struct panfrost_resource *prsrc)
 {
-        if (prsrc->modifier_constant)
+        if (prsrc->modifier_constant || !panfrost_is_2d(prsrc) ||
+            (prsrc->base.bind & PAN_BIND_SHARED_MASK) ||
+            prsrc->base.last_level != 0 ||
+            prsrc->image.layout.modifier == DRM_FORMAT_MOD_LINEAR)
                 return false;
 
-        /* Overwriting the entire resource indicates streaming, for which
-         * linear layout is most efficient due to the lack of expensive
-         * conversion.
-         *
-         * For now we just switch to linear after a number of complete
-         * overwrites to keep things simple, but we could do better.
-         *
-         * This mechanism is only implemented for 2D resources. This suffices
-         * for video players, its intended use case.
-         */
+        uint32_t samples = prsrc->access.gpu_samples;
 
-        bool entire_overwrite =
-                panfrost_is_2d(prsrc) &&
-                prsrc->base.last_level == 0 &&
-                transfer->box.width == prsrc->base.width0 &&
-                transfer->box.height == prsrc->base.height0 &&
-                transfer->box.x == 0 &&
-                transfer->box.y == 0;
-
-        if (entire_overwrite)
-                ++prsrc->modifier_updates;
-
-        if (prsrc->modifier_updates >= LAYOUT_CONVERT_THRESHOLD) {
-                perf_debug(dev, "Transitioning to linear due to streaming usage");
-                return true;
-        } else {
+        if (!samples)
+                return false;
+
+        if (samples > LAYOUT_STREAM_SAMPLES) {
+                prsrc->modifier_updates = 0;
                 return false;
         }
+
+        if (++prsrc->modifier_updates < LAYOUT_CONVERT_THRESHOLD)
+                return false;
+
+        perf_debug(dev, "Transitioning to linear due to streaming usage "
+                   "(%u of %u CPU maps wrote)",
+                   prsrc->access.cpu_writes,
+                   prsrc->access.cpu_maps);
+        return true;
 }
 
+/* Converts a streamed resource to linear once a CPU write which only covered
+ * part of it is done. Later uploads are then plain copies. */
+
 static void
-panfrost_ptr_unmap(struct pipe_context *pctx,
+panfrost_streaming_convert(struct panfrost_context *ctx,
+                           struct panfrost_resource *prsrc)
+{
+        if (prsrc->image.layout.modifier == DRM_FORMAT_MOD_LINEAR)
+                return;
+
+        prsrc->access.demoted_from = prsrc->image.layout.modifier;
+        pan_resource_modifier_convert(ctx, prsrc, DRM_FORMAT_MOD_LINEAR,
+                                      "Streaming uploads");
+}
+
+static void
+panfrost_ptr_unmap_impl(struct pipe_context *pctx,
                         struct pipe_transfer *transfer)
 {
         /* Gallium expects writeback here, so we tile */
@@ -1455,32 +2633,54 @@ panfrost_ptr_unmap(struct pipe_context *pctx,
         if (transfer->usage & PIPE_MAP_WRITE)
                 prsrc->valid.crc = false;
 
+        bool streaming = false;
+
+        if (transfer->resource->target != PIPE_BUFFER) {
+                prsrc->access.cpu_maps++;
+
+                if (transfer->usage & PIPE_MAP_WRITE) {
+                        streaming = panfrost_should_linear_convert(dev, prsrc);
+                        prsrc->access.cpu_writes++;
+                        prsrc->access.gpu_samples = 0;
+                        prsrc->access.samples_since_write = 0;
+                }
+        }
+
         /* AFBC will use a staging resource. `initialized` will be set when the
          * fragment job is created; this is deferred to prevent useless surface
          * reloads that can cascade into DATA_INVALID_FAULTs due to reading
          * malformed AFBC data if uninitialized */
 
         bool afbc = trans->staging.rsrc;
+        bool entire_overwrite = panfrost_entire_overwrite(prsrc, &transfer->box);
+        bool linear_converted = false;
 
         if (afbc) {
                 if (transfer->usage & PIPE_MAP_WRITE) {
                         struct panfrost_resource *trans_rsrc = pan_resource(trans->staging.rsrc);
                         struct panfrost_bo *trans_bo = trans_rsrc->image.data.bo;
 
-                        panfrost_bo_mem_clean(trans_bo, 0, trans_bo->size);
+                        panfrost_bo_mem_clean(trans_bo,
+                                              trans_rsrc->image.data.offset,
+                                              trans_rsrc->image.layout.data_size);
 
-                        if (panfrost_should_linear_convert(dev, prsrc, transfer)) {
+                        /* The staging resource has a BO of its own then,
+                         * see panfrost_ptr_map */
+                        if (streaming && entire_overwrite) {
+                                prsrc->access.demoted_from = prsrc->image.layout.modifier;
 
                                 panfrost_bo_unreference(prsrc->image.data.bo);
 
                                 panfrost_resource_setup(dev, prsrc, DRM_FORMAT_MOD_LINEAR,
                                                         prsrc->image.layout.format);
+                                prsrc->modifier_constant = false;
 
                                 prsrc->image.data.bo = trans_bo;
                                 panfrost_bo_reference(prsrc->image.data.bo);
+                                linear_converted = true;
                         } else {
                                 pan_blit_from_staging(pctx, trans);
-                                panfrost_flush_batches_accessing_rsrc(pan_context(pctx),
+                                panfrost_flush_upload(pan_context(pctx),
                                                 pan_resource(trans->staging.rsrc),
                                                 "AFBC write staging blit");
                         }
@@ -1494,12 +2694,16 @@ panfrost_ptr_unmap(struct pipe_context *pctx,
                 struct panfrost_bo *bo = prsrc->image.data.bo;
 
                 if (transfer->usage & PIPE_MAP_WRITE) {
-                        BITSET_SET(prsrc->valid.data, transfer->level);
+                        panfrost_resource_set_valid(prsrc, transfer->level);
 
                         if (prsrc->image.layout.modifier == DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED) {
-                                if (panfrost_should_linear_convert(dev, prsrc, transfer)) {
+                                if (streaming && entire_overwrite) {
+                                        prsrc->access.demoted_from = prsrc->image.layout.modifier;
                                         panfrost_resource_setup(dev, prsrc, DRM_FORMAT_MOD_LINEAR,
                                                                 prsrc->image.layout.format);
+                                        prsrc->modifier_constant = false;
+                                        linear_converted = true;
+
                                         if (prsrc->image.layout.data_size > bo->size) {
                                                 /* We want the BO to be MMAPed. */
                                                 uint32_t flags = bo->flags & ~PAN_BO_DELAY_MMAP;
@@ -1509,6 +2713,7 @@ panfrost_ptr_unmap(struct pipe_context *pctx,
                                                 bo = prsrc->image.data.bo =
                                                         panfrost_bo_create(dev, prsrc->image.layout.data_size, flags, label);
                                                 assert(bo);
+                                                panfrost_bo_set_category(bo, PAN_MEM_RESOURCE);
                                         }
 
                                         util_copy_rect(
@@ -1528,31 +2733,33 @@ panfrost_ptr_unmap(struct pipe_context *pctx,
                 }
         }
 
-        /* TODO: Only the accessed region */
         /* It is important to not do this for AFBC resources, or else the
-         * clean might overwrite the result of the blit. */
+         * clean might overwrite the result of the blit. After a conversion
+         * to linear the box no longer describes what was written. */
         if (!afbc && (transfer->usage & PIPE_MAP_WRITE)) {
-                size_t offset = 0;
-                size_t size = prsrc->image.data.bo->size;
-
-                /* TODO: Don't recalculate */
-                if (prsrc->base.target == PIPE_BUFFER) {
-                        enum pipe_format format = prsrc->image.layout.format;
-                        int bytes_per_block = util_format_get_blocksize(format);
-
-                        offset = transfer->box.x * (size_t) bytes_per_block;
-                        size = transfer->box.width * (size_t) bytes_per_block;
-                }
+                struct panfrost_bo *bo = prsrc->image.data.bo;
 
-                panfrost_bo_mem_clean(prsrc->image.data.bo,
-                                      offset, size);
+                if (linear_converted)
+                        panfrost_bo_mem_clean(bo, 0, bo->size);
+                else
+                        panfrost_box_mem_op(prsrc, transfer->level,
+                                            &transfer->box, false);
         }
 
+        /* Partial writes are converted with a blit, once written */
+        if (streaming && !linear_converted)
+                panfrost_streaming_convert(pan_context(pctx), prsrc);
+
         util_range_add(&prsrc->base, &prsrc->valid_buffer_range,
                        transfer->box.x,
                        transfer->box.x + transfer->box.width);
 
         panfrost_minmax_cache_invalidate(prsrc->index_cache, transfer);
+        panfrost_index_derivatives_invalidate(prsrc, transfer->box.x,
+                                              transfer->box.width);
+
+        if (trans->coherent)
+                panfrost_coherent_map_end(prsrc);
 
         /* Derefence the resource */
         pipe_resource_reference(&transfer->resource, NULL);
@@ -1561,6 +2768,18 @@ panfrost_ptr_unmap(struct pipe_context *pctx,
         ralloc_free(transfer);
 }
 
+static void
+panfrost_ptr_unmap(struct pipe_context *pctx,
+                   struct pipe_transfer *transfer)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+        uint64_t start = panfrost_profile_begin(ctx->profile);
+
+        panfrost_ptr_unmap_impl(pctx, transfer);
+
+        panfrost_profile_end(ctx->profile, PAN_PROFILE_PTR_UNMAP, start);
+}
+
 // TODO: does this need to be changed for cached resources?
 static void
 panfrost_ptr_flush_region(struct pipe_context *pctx,
@@ -1574,8 +2793,130 @@ panfrost_ptr_flush_region(struct pipe_context *pctx,
                                transfer->box.x + box->x,
                                transfer->box.x + box->x + box->width);
         } else {
-                BITSET_SET(rsc->valid.data, transfer->level);
+                panfrost_resource_set_valid(rsc, transfer->level);
+        }
+}
+
+/* Uploads to u-interleaved textures tile straight from the caller's pointer
+ * into the BO, skipping the linear staging copy of a transfer. AFBC uploads
+ * are copied into a transient linear resource and blitted on the GPU. Other
+ * cases, including the full level overwrites which feed the streaming
+ * heuristic of panfrost_should_linear_convert, take the transfer path. */
+
+static void
+panfrost_texture_subdata(struct pipe_context *pctx,
+                         struct pipe_resource *resource,
+                         unsigned level,
+                         unsigned usage,
+                         const struct pipe_box *box,
+                         const void *data,
+                         unsigned stride,
+                         unsigned layer_stride)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+        struct panfrost_resource *rsrc = pan_resource(resource);
+        uint64_t modifier = rsrc->image.layout.modifier;
+        enum pipe_format format = rsrc->image.layout.format;
+
+        bool entire_overwrite =
+                !rsrc->modifier_constant &&
+                panfrost_is_2d(rsrc) &&
+                resource->last_level == 0 &&
+                panfrost_entire_overwrite(rsrc, box);
+
+        bool direct =
+                resource->target != PIPE_BUFFER &&
+                resource->nr_samples <= 1 &&
+                !rsrc->separate_stencil &&
+                resource->format == format &&
+                !entire_overwrite &&
+                (modifier == DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED ||
+                 drm_is_afbc(modifier));
+
+        if (!direct) {
+                u_default_texture_subdata(pctx, resource, level, usage, box,
+                                          data, stride, layer_stride);
+                return;
+        }
+
+        bool streaming =
+                panfrost_should_linear_convert(pan_device(pctx->screen), rsrc);
+
+        rsrc->constant_stencil = false;
+        rsrc->valid.crc = false;
+        rsrc->access.cpu_maps++;
+        rsrc->access.cpu_writes++;
+        rsrc->access.gpu_samples = 0;
+        rsrc->access.samples_since_write = 0;
+
+        if (drm_is_afbc(modifier)) {
+                struct panfrost_resource *staging =
+                        pan_alloc_staging(ctx, rsrc, level, box, true);
+                struct panfrost_bo *staging_bo = staging->image.data.bo;
+                unsigned staging_offset = staging->image.data.offset;
+
+                panfrost_bo_mmap(staging_bo);
+
+                util_copy_box(staging_bo->ptr.cpu + staging_offset, format,
+                              staging->image.layout.slices[0].row_stride,
+                              panfrost_get_layer_stride(&staging->image.layout, 0),
+                              0, 0, 0, box->width, box->height, box->depth,
+                              data, stride, layer_stride, 0, 0, 0);
+
+                panfrost_bo_mem_clean(staging_bo, staging_offset,
+                                      staging->image.layout.data_size);
+
+                struct pipe_blit_info blit = {
+                        .dst.resource = resource,
+                        .dst.format   = pan_blit_format(resource->format),
+                        .dst.level    = level,
+                        .dst.box      = *box,
+                        .src.resource = &staging->base,
+                        .src.format   = pan_blit_format(staging->base.format),
+                        .src.level    = 0,
+                        .src.box      = { 0, 0, 0, box->width, box->height, box->depth },
+                        .filter       = PIPE_TEX_FILTER_NEAREST
+                };
+
+                blit.mask = util_format_get_mask(blit.src.format);
+
+                panfrost_blit(pctx, &blit);
+                panfrost_flush_upload(ctx, staging, "AFBC texture upload blit");
+
+                struct pipe_resource *pstaging = &staging->base;
+                pipe_resource_reference(&pstaging, NULL);
+
+                if (streaming)
+                        panfrost_streaming_convert(ctx, rsrc);
+
+                return;
         }
+
+        panfrost_flush_pending_clear(ctx, rsrc, "CPU write");
+        panfrost_bo_mmap(rsrc->image.data.bo);
+        panfrost_ptr_map_sync(ctx, rsrc, level,
+                              usage | PIPE_MAP_WRITE | PIPE_MAP_DISCARD_RANGE,
+                              box);
+
+        struct panfrost_bo *bo = rsrc->image.data.bo;
+        struct pan_image_slice_layout *slice = &rsrc->image.layout.slices[level];
+        unsigned slice_stride = panfrost_get_layer_stride(&rsrc->image.layout, level);
+
+        for (unsigned z = 0; z < box->depth; ++z) {
+                uint8_t *map = bo->ptr.cpu + slice->offset +
+                               (z + box->z) * slice_stride;
+
+                panfrost_access_tiled_image_threaded(pan_screen(pctx->screen),
+                                (uint8_t *) data + z * layer_stride, map,
+                                box->x, box->y, box->width, box->height,
+                                stride, slice->row_stride, format, true);
+        }
+
+        panfrost_resource_set_valid(rsrc, level);
+        panfrost_box_mem_op(rsrc, level, box, false);
+
+        if (streaming)
+                panfrost_streaming_convert(ctx, rsrc);
 }
 
 static void
@@ -1586,6 +2927,18 @@ panfrost_invalidate_resource(struct pipe_context *pctx, struct pipe_resource *pr
         struct panfrost_resource *rsrc = pan_resource(prsrc);
 
         rsrc->constant_stencil = true;
+        rsrc->pending_clear.valid = false;
+
+        /* The contents are undefined from here on, so later renders needn't
+         * preload them */
+        if (prsrc->target != PIPE_BUFFER) {
+                BITSET_ZERO(rsrc->valid.data);
+                BITSET_ZERO(rsrc->valid.partial);
+        }
+
+        /* Multisampled buffers invalidated after a resolve blit, the usual
+         * way to render multisampled on GLES 3, never reach memory */
+        panfrost_discard_resolved_rsrc(ctx, rsrc);
 
         /* Handle the glInvalidateFramebuffer case */
         if (batch->key.zsbuf && batch->key.zsbuf->texture == prsrc)
@@ -1599,6 +2952,41 @@ panfrost_invalidate_resource(struct pipe_context *pctx, struct pipe_resource *pr
         }
 }
 
+/* Sparse buffers can only be backed from their start, as kbase commits pages
+ * from the start of a region. Committing a range backs everything below it,
+ * and decommitting only releases memory once the range reaches the end of
+ * what is backed. Decommitted contents are undefined, so keeping pages
+ * backed is always allowed. */
+
+static bool
+panfrost_resource_commit(struct pipe_context *pctx, struct pipe_resource *prsrc,
+                         unsigned level, struct pipe_box *box, bool commit)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+        struct panfrost_resource *rsrc = pan_resource(prsrc);
+        struct panfrost_bo *bo = rsrc->image.data.bo;
+
+        assert(prsrc->target == PIPE_BUFFER && level == 0);
+
+        if (!(bo->flags & PAN_BO_SPARSE))
+                return false;
+
+        size_t start = ALIGN_POT(box->x, PAN_SPARSE_PAGE_SIZE);
+        size_t end = ALIGN_POT(box->x + box->width, PAN_SPARSE_PAGE_SIZE);
+
+        if (commit)
+                return end <= bo->size || panfrost_bo_commit(bo, end);
+
+        if (end < bo->size || start >= bo->size)
+                return true;
+
+        /* The GPU must be done with the pages before they go */
+        panfrost_flush_batches_accessing_rsrc(ctx, rsrc, "Sparse decommit");
+        panfrost_bo_wait(bo, INT64_MAX, true);
+
+        return panfrost_bo_commit(bo, start);
+}
+
 static enum pipe_format
 panfrost_resource_get_internal_format(struct pipe_resource *rsrc)
 {
@@ -1616,10 +3004,9 @@ panfrost_generate_mipmap(
         unsigned first_layer,
         unsigned last_layer)
 {
+        struct panfrost_context *ctx = pan_context(pctx);
         struct panfrost_resource *rsrc = pan_resource(prsrc);
 
-        perf_debug_ctx(pan_context(pctx), "Unoptimized mipmap generation");
-
         /* Generating a mipmap invalidates the written levels, so make that
          * explicit so we don't try to wallpaper them back and end up with
          * u_blitter recursion */
@@ -1628,6 +3015,12 @@ panfrost_generate_mipmap(
         for (unsigned l = base_level + 1; l <= last_level; ++l)
                 BITSET_CLEAR(rsrc->valid.data, l);
 
+        if (panfrost_compute_mipmap(ctx, rsrc, format, base_level,
+                                    last_level, first_layer, last_layer))
+                return true;
+
+        perf_debug_ctx(ctx, "Unoptimized mipmap generation");
+
         /* Beyond that, we just delegate the hard stuff. */
 
         bool blit_res = util_gen_mipmap(
@@ -1674,16 +3067,86 @@ panfrost_resource_screen_init(struct pipe_screen *pscreen)
         pscreen->resource_create = u_transfer_helper_resource_create;
         pscreen->resource_destroy = u_transfer_helper_resource_destroy;
         pscreen->resource_from_handle = panfrost_resource_from_handle;
+        pscreen->resource_from_user_memory = panfrost_resource_from_user_memory;
         pscreen->resource_get_handle = panfrost_resource_get_handle;
         pscreen->resource_get_param = panfrost_resource_get_param;
         pscreen->transfer_helper = u_transfer_helper_create(&transfer_vtbl,
                                         U_TRANSFER_HELPER_SEPARATE_Z32S8 |
                                         U_TRANSFER_HELPER_MSAA_MAP);
+
+        slab_create_parent(&pan_screen(pscreen)->transfer_pool,
+                           sizeof(struct panfrost_transfer), 16);
+
+        simple_mtx_init(&pan_screen(pscreen)->coherent.lock, mtx_plain);
+        util_dynarray_init(&pan_screen(pscreen)->coherent.rsrcs, NULL);
+
+        simple_mtx_init(&pan_screen(pscreen)->dirty.lock, mtx_plain);
+        util_dynarray_init(&pan_screen(pscreen)->dirty.ranges, NULL);
+
+        /* The thread submitting the transfer takes a band as well */
+        unsigned num_threads =
+                MIN2(util_get_cpu_caps()->nr_cpus, PAN_TILING_MAX_THREADS) - 1;
+
+        if (num_threads) {
+                util_queue_init(&pan_screen(pscreen)->tiling_queue,
+                                "pan_tiling", 32, num_threads,
+                                UTIL_QUEUE_INIT_RESIZE_IF_FULL |
+                                UTIL_QUEUE_INIT_SET_FULL_THREAD_AFFINITY,
+                                NULL);
+        }
 }
+
 void
 panfrost_resource_screen_destroy(struct pipe_screen *pscreen)
 {
+        struct panfrost_screen *screen = pan_screen(pscreen);
+
+        if (util_queue_is_initialized(&screen->tiling_queue))
+                util_queue_destroy(&screen->tiling_queue);
+
         u_transfer_helper_destroy(pscreen->transfer_helper);
+        slab_destroy_parent(&screen->transfer_pool);
+
+        util_dynarray_fini(&screen->coherent.rsrcs);
+        simple_mtx_destroy(&screen->coherent.lock);
+
+        /* Drops the references held by ranges never submitted */
+        panfrost_resource_clean_dirty(screen);
+        util_dynarray_fini(&screen->dirty.ranges);
+        simple_mtx_destroy(&screen->dirty.lock);
+}
+
+/* Invalidation of a buffer by the threaded context: it allocated a new
+ * buffer, which the application may already have written to, and dst takes
+ * over its BO, like a map discarding the whole resource would. */
+
+void
+panfrost_replace_buffer_storage(struct pipe_context *pctx,
+                                struct pipe_resource *dst,
+                                struct pipe_resource *src,
+                                unsigned minimum_num_rebinds,
+                                uint32_t rebind_mask,
+                                uint32_t delete_buffer_id)
+{
+        struct panfrost_context *ctx = pan_context(pctx);
+        struct panfrost_resource *prsrc = pan_resource(dst);
+        struct panfrost_resource *psrc = pan_resource(src);
+
+        assert(dst->target == PIPE_BUFFER && src->target == PIPE_BUFFER);
+
+        /* Make sure we re-emit any descriptors using this resource */
+        panfrost_dirty_state_all(ctx);
+
+        panfrost_bo_reference(psrc->image.data.bo);
+        panfrost_resource_swap_bo(ctx, prsrc, psrc->image.data.bo);
+
+        util_range_set_empty(&prsrc->valid_buffer_range);
+        util_range_add(dst, &prsrc->valid_buffer_range,
+                       psrc->valid_buffer_range.start,
+                       psrc->valid_buffer_range.end);
+
+        panfrost_minmax_cache_clear(prsrc->index_cache);
+        panfrost_index_derivatives_clear(prsrc);
 }
 
 void
@@ -1697,13 +3160,14 @@ panfrost_resource_context_init(struct pipe_context *pctx)
         pctx->surface_destroy = panfrost_surface_destroy;
         pctx->clear_render_target = panfrost_clear_render_target;
         pctx->clear_depth_stencil = panfrost_clear_depth_stencil;
-        pctx->resource_copy_region = util_resource_copy_region;
+        pctx->resource_copy_region = panfrost_resource_copy_region;
         pctx->blit = panfrost_blit;
         pctx->generate_mipmap = panfrost_generate_mipmap;
         pctx->flush_resource = panfrost_flush_resource;
         pctx->invalidate_resource = panfrost_invalidate_resource;
+        pctx->resource_commit = panfrost_resource_commit;
         pctx->transfer_flush_region = u_transfer_helper_transfer_flush_region;
         pctx->buffer_subdata = u_default_buffer_subdata;
-        pctx->texture_subdata = u_default_texture_subdata;
-        pctx->clear_buffer = u_default_clear_buffer;
+        pctx->texture_subdata = panfrost_texture_subdata;
+        pctx->clear_buffer = panfrost_clear_buffer;
 }
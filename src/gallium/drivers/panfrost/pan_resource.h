@@ -31,15 +31,72 @@
 #include "pan_texture.h"
 #include "drm-uapi/drm.h"
 #include "util/u_range.h"
+#include "util/u_threaded_context.h"
 
+/* Number of consecutive streaming CPU writes, each following at most
+ * LAYOUT_STREAM_SAMPLES batches sampling the resource since the previous
+ * one, before a resource is converted to linear */
 #define LAYOUT_CONVERT_THRESHOLD 8
-#define PAN_MAX_BATCHES 32
+#define LAYOUT_STREAM_SAMPLES 4
+
+/* Number of batches which must sample a demoted resource, with no CPU write
+ * in between, before it is converted back to its original modifier */
+#define LAYOUT_PROMOTE_THRESHOLD 32
+
+/* Number of batches which must sample an AFBC resource, with no write in
+ * between, before its body is packed */
+#define LAYOUT_PACK_THRESHOLD 16
+
+/* Number of batches which must sample a resource decompressed for image
+ * stores, with no image store in between, before it is compressed again */
+#define LAYOUT_RECOMPRESS_THRESHOLD 32
+
+/* Default number of synchronized CPU reads of an uncached buffer before it is
+ * moved to a CPU-cached BO, see the pan_cached_read_threshold driconf option */
+#define PAN_CACHED_READ_THRESHOLD 4
+
+/* Number of BOs a dynamic buffer keeps after being invalidated away from
+ * them, for the next invalidations to reuse */
+#define PAN_BO_RING_SIZE 4
+
+/* Commit granularity of sparse buffers */
+#define PAN_SPARSE_PAGE_SIZE (64 * 1024)
+
+/* Opt-in to packing the AFBC body once the resource stops being rendered to,
+ * see panfrost_afbc_pack() */
+#define PAN_RESOURCE_FLAG_PACKED_AFBC PIPE_RESOURCE_FLAG_DRV_PRIV
+
+/* Initial and maximal number of batch slots of a context. Both are multiples
+ * of BITSET_WORDBITS. */
+#define PAN_MIN_BATCHES 32
+#define PAN_MAX_BATCHES 256
+
+/* Batch tracking of a resource for one context, see panfrost_resource */
+#define PAN_RESOURCE_TRACK_SLOTS 2
+
+struct panfrost_resource_track {
+        /* track_gen of the owning context, or zero if the slot is free */
+        _Atomic uint32_t gen;
+
+        /* Number of bits set in users */
+        unsigned nr_users;
+        BITSET_DECLARE(users, PAN_MAX_BATCHES);
+
+        /* The batch of the context writing the resource, if any */
+        struct panfrost_batch *writer;
+};
 
 #define PAN_BIND_SHARED_MASK (PIPE_BIND_DISPLAY_TARGET | PIPE_BIND_SCANOUT | \
                               PIPE_BIND_SHARED)
 
 struct panfrost_resource {
-        struct pipe_resource base;
+        /* The threaded context's part starts with the pipe_resource, so the
+         * driver keeps using base */
+        union {
+                struct threaded_resource threaded;
+                struct pipe_resource base;
+        };
+
         struct {
                 struct pipe_scissor_state extent;
                 struct {
@@ -59,6 +116,17 @@ struct panfrost_resource {
                  * batch per context may write a resource, so this is the
                  * number of contexts that have an active writer. */
                 _Atomic unsigned nr_writers;
+
+                /** The batches of a few contexts using the resource, so that
+                 * checking for a user or the writer doesn't need a hash
+                 * lookup. A slot is claimed by writing the track_gen of the
+                 * context, and after that only that context touches it. */
+                struct panfrost_resource_track ctx[PAN_RESOURCE_TRACK_SLOTS];
+
+                /** Number of batch uses by contexts which found no free slot,
+                 * tracked in the batch resource set and the writers table of
+                 * the context instead. */
+                _Atomic unsigned nr_spilled;
         } track;
 
         struct renderonly_scanout *scanout;
@@ -77,27 +145,140 @@ struct panfrost_resource {
 
                 /* Has anything been written to this slice? */
                 BITSET_DECLARE(data, MAX_MIP_LEVELS);
+
+                /* Slices only ever written by rendering, with the union of
+                 * the areas rendered to. Outside of it the contents are
+                 * undefined, so renders elsewhere needn't preload them. */
+                BITSET_DECLARE(partial, MAX_MIP_LEVELS);
+                struct pipe_scissor_state extent[MAX_MIP_LEVELS];
         } valid;
 
         /* Whether the modifier can be changed */
         bool modifier_constant;
 
-        /* Used to decide when to convert to another modifier */
+        /* Consecutive streaming CPU writes, to decide when to convert to
+         * linear */
         uint16_t modifier_updates;
 
+        /* Access statistics used to undo a conversion to linear once the
+         * CPU is done streaming into the resource */
+        struct {
+                /* Modifier the resource was converted to linear from, or
+                 * zero if it was never demoted */
+                uint64_t demoted_from;
+
+                /* CPU maps of the resource, and those which wrote to it */
+                uint32_t cpu_maps;
+                uint32_t cpu_writes;
+
+                /* Synchronized CPU reads of an uncached buffer */
+                uint32_t cpu_reads;
+
+                /* Batches sampling the resource since the last CPU write,
+                 * and since the last write of any kind */
+                uint32_t gpu_samples;
+                uint32_t samples_since_write;
+                uint64_t last_sample_batch;
+
+                /* AFBC modifier the resource was decompressed from to be
+                 * bound for image stores, or zero, and the batches sampling
+                 * the resource since the last image store */
+                uint64_t image_demoted_from;
+                uint32_t samples_since_image_write;
+        } access;
+
+        /* Whether the AFBC body is packed, leaving no room to write */
+        bool afbc_packed;
+
+        /* A clear of a single-layer colour surface which has not been written
+         * to memory. The next batch rendering to the surface clears it
+         * instead, and any other access writes the clear out first. */
+        struct {
+                bool valid;
+                enum pipe_format format;
+                unsigned level, layer;
+                uint32_t color[4];
+        } pending_clear;
+
         /* Do all pixels have the same stencil value? */
         bool constant_stencil;
 
         /* The stencil value if constant_stencil is set */
         uint8_t stencil_value;
 
+        /* Tiler hierarchy levels for the next batch rendering to this
+         * resource, from the primitives of the previous one, or 0 for the
+         * default. See panfrost_batch_hierarchy_mask. */
+        uint8_t hierarchy_mask;
+
         /* Cached min/max values for index buffers */
         struct panfrost_minmax_cache *index_cache;
 
+        /* Triangle lists translated from ranges of an index buffer, see
+         * panfrost_translate_indices(). Allocated on first use. */
+        struct panfrost_index_derivatives *index_derivs;
+
+        /* Number of persistent, coherent maps of a CPU-cached buffer, and
+         * the range they cover, protected by the screen's coherent.lock */
+        struct {
+                unsigned maps;
+                unsigned start, end;
+        } coherent;
+
+        /* BOs a dynamic buffer was invalidated away from, oldest first.
+         * Once the GPU is done with the oldest, the next invalidation swaps
+         * it back in instead of allocating. */
+        struct {
+                struct panfrost_bo *bos[PAN_BO_RING_SIZE];
+                unsigned count;
+        } bo_ring;
+
         struct sw_displaytarget *dt;
         unsigned dt_stride;
 };
 
+/* Triangle list indices translated by the GPU from a range of an index buffer,
+ * for a primitive type the hardware does not draw */
+
+#define PAN_INDEX_DERIVATIVES 4
+
+struct panfrost_index_derivative {
+        /* 32-bit triangle list, NULL if the entry is unused */
+        struct pipe_resource *buffer;
+        unsigned out_count;
+
+        /* Source range in indices */
+        unsigned start, count;
+        uint8_t index_size;
+        uint8_t mode;
+        bool flatshade_first;
+};
+
+struct panfrost_index_derivatives {
+        struct panfrost_index_derivative entries[PAN_INDEX_DERIVATIVES];
+
+        /* Next entry to replace */
+        unsigned victim;
+};
+
+/* Linear staging images for blits to and from AFBC are sub-allocated from a
+ * few large CPU-cached BOs per context. Allocations move to the next BO once
+ * the current one is full, reusing it once nothing references it and the
+ * GPU is done with it. */
+
+#define PAN_STAGING_RING_SIZE 4
+#define PAN_STAGING_BO_SIZE (4 * 1024 * 1024)
+
+struct panfrost_staging_ring {
+        struct panfrost_bo *bos[PAN_STAGING_RING_SIZE];
+        unsigned count;
+
+        /* Index of the BO allocations are made from, and the offset of its
+         * first free byte */
+        unsigned current;
+        size_t offset;
+};
+
 static inline struct panfrost_resource *
 pan_resource(struct pipe_resource *p)
 {
@@ -105,12 +286,18 @@ pan_resource(struct pipe_resource *p)
 }
 
 struct panfrost_transfer {
-        struct pipe_transfer base;
+        union {
+                struct threaded_transfer threaded;
+                struct pipe_transfer base;
+        };
         void *map;
         struct {
                 struct pipe_resource *rsrc;
                 struct pipe_box box;
         } staging;
+
+        /* Counted in the resource's coherent maps */
+        bool coherent;
 };
 
 static inline struct panfrost_transfer *
@@ -125,6 +312,26 @@ void panfrost_resource_screen_destroy(struct pipe_screen *screen);
 
 void panfrost_resource_context_init(struct pipe_context *pctx);
 
+void
+panfrost_resource_clean_coherent(struct panfrost_batch *batch);
+
+void
+panfrost_staging_ring_cleanup(struct panfrost_staging_ring *ring);
+
+void
+panfrost_resource_invalidate_coherent(struct panfrost_screen *screen);
+
+void
+panfrost_resource_clean_dirty(struct panfrost_screen *screen);
+
+void
+panfrost_replace_buffer_storage(struct pipe_context *pctx,
+                                struct pipe_resource *dst,
+                                struct pipe_resource *src,
+                                unsigned minimum_num_rebinds,
+                                uint32_t rebind_mask,
+                                uint32_t delete_buffer_id);
+
 /* Blitting */
 
 void
@@ -134,6 +341,51 @@ void
 panfrost_blit(struct pipe_context *pipe,
               const struct pipe_blit_info *info);
 
+bool
+panfrost_afbc_pack(struct panfrost_context *ctx,
+                   struct panfrost_resource *rsrc);
+
+bool
+panfrost_afbc_unpack(struct panfrost_context *ctx,
+                     struct panfrost_resource *rsrc, unsigned level,
+                     const struct pipe_box *box,
+                     struct panfrost_resource *staging);
+
+bool
+panfrost_compute_mipmap(struct panfrost_context *ctx,
+                        struct panfrost_resource *rsrc,
+                        enum pipe_format format,
+                        unsigned base_level, unsigned last_level,
+                        unsigned first_layer, unsigned last_layer);
+
+void
+panfrost_resource_copy_region(struct pipe_context *pctx,
+                              struct pipe_resource *dst,
+                              unsigned dst_level,
+                              unsigned dstx, unsigned dsty, unsigned dstz,
+                              struct pipe_resource *src,
+                              unsigned src_level,
+                              const struct pipe_box *src_box);
+
+void
+panfrost_clear_buffer(struct pipe_context *pctx,
+                      struct pipe_resource *res,
+                      unsigned offset, unsigned size,
+                      const void *clear_value, int clear_value_size);
+
+struct pipe_resource *
+panfrost_translate_indices(struct panfrost_context *ctx,
+                           const struct pipe_draw_info *info,
+                           const struct pipe_draw_start_count_bias *draw,
+                           unsigned *out_count);
+
+void
+panfrost_index_derivatives_invalidate(struct panfrost_resource *rsrc,
+                                      unsigned offset, unsigned size);
+
+void
+panfrost_index_derivatives_clear(struct panfrost_resource *rsrc);
+
 void
 panfrost_resource_set_damage_region(struct pipe_screen *screen,
                                     struct pipe_resource *res,
@@ -171,9 +423,105 @@ pan_resource_modifier_convert(struct panfrost_context *ctx,
                               struct panfrost_resource *rsrc,
                               uint64_t modifier, const char *reason);
 
+/* Records a batch sampling from the resource, counting each batch once */
+
+static inline void
+panfrost_resource_note_sample(struct panfrost_resource *rsrc,
+                              uint64_t batch_seqnum)
+{
+        if (rsrc->access.last_sample_batch != batch_seqnum) {
+                rsrc->access.last_sample_batch = batch_seqnum;
+                rsrc->access.gpu_samples++;
+                rsrc->access.samples_since_write++;
+                rsrc->access.samples_since_image_write++;
+        }
+}
+
+/* Marks a whole slice as written */
+
+static inline void
+panfrost_resource_set_valid(struct panfrost_resource *rsrc, unsigned level)
+{
+        BITSET_SET(rsrc->valid.data, level);
+        BITSET_CLEAR(rsrc->valid.partial, level);
+}
+
+/* Marks the area [minx, maxx) x [miny, maxy) of a slice as rendered to */
+
+static inline void
+panfrost_resource_set_valid_region(struct panfrost_resource *rsrc,
+                                   unsigned level,
+                                   unsigned minx, unsigned miny,
+                                   unsigned maxx, unsigned maxy)
+{
+        struct pipe_scissor_state *ext = &rsrc->valid.extent[level];
+
+        if (!BITSET_TEST(rsrc->valid.data, level)) {
+                BITSET_SET(rsrc->valid.data, level);
+                BITSET_SET(rsrc->valid.partial, level);
+                *ext = (struct pipe_scissor_state) {
+                        .minx = minx, .miny = miny,
+                        .maxx = maxx, .maxy = maxy,
+                };
+        } else if (BITSET_TEST(rsrc->valid.partial, level)) {
+                ext->minx = MIN2(ext->minx, minx);
+                ext->miny = MIN2(ext->miny, miny);
+                ext->maxx = MAX2(ext->maxx, maxx);
+                ext->maxy = MAX2(ext->maxy, maxy);
+        } else {
+                return;
+        }
+
+        if (ext->minx == 0 && ext->miny == 0 &&
+            ext->maxx >= u_minify(rsrc->base.width0, level) &&
+            ext->maxy >= u_minify(rsrc->base.height0, level))
+                BITSET_CLEAR(rsrc->valid.partial, level);
+}
+
+/* Whether the area [minx, maxx) x [miny, maxy) of a slice may hold data */
+
+static inline bool
+panfrost_resource_region_valid(const struct panfrost_resource *rsrc,
+                               unsigned level,
+                               unsigned minx, unsigned miny,
+                               unsigned maxx, unsigned maxy)
+{
+        if (!BITSET_TEST(rsrc->valid.data, level))
+                return false;
+
+        if (!BITSET_TEST(rsrc->valid.partial, level))
+                return true;
+
+        const struct pipe_scissor_state *ext = &rsrc->valid.extent[level];
+
+        return minx < ext->maxx && ext->minx < maxx &&
+               miny < ext->maxy && ext->miny < maxy;
+}
+
+void
+pan_resource_maybe_promote(struct panfrost_context *ctx,
+                           struct panfrost_resource *rsrc);
+
+void
+pan_resource_maybe_pack(struct panfrost_context *ctx,
+                        struct panfrost_resource *rsrc);
+
+void
+pan_resource_unpack_afbc(struct panfrost_context *ctx,
+                         struct panfrost_resource *rsrc,
+                         const char *reason);
+
 void
 pan_legalize_afbc_format(struct panfrost_context *ctx,
                          struct panfrost_resource *rsrc,
                          enum pipe_format format);
 
+void
+pan_legalize_afbc_image(struct panfrost_context *ctx,
+                        const struct pipe_image_view *image);
+
+void
+pan_resource_maybe_recompress(struct panfrost_context *ctx,
+                              struct panfrost_resource *rsrc);
+
 #endif /* PAN_RESOURCE_H */
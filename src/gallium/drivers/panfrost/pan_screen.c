@@ -27,18 +27,23 @@
  */
 
 #include "util/u_debug.h"
+#include "util/u_box.h"
 #include "util/u_memory.h"
 #include "util/format/u_format.h"
 #include "util/format/u_format_s3tc.h"
 #include "util/u_video.h"
 #include "util/u_screen.h"
+#include "util/os_misc.h"
 #include "util/os_time.h"
 #include "util/u_process.h"
+#include "util/xmlconfig.h"
 #include "pipe/p_defines.h"
 #include "pipe/p_screen.h"
 #include "draw/draw_context.h"
 
 #include <fcntl.h>
+#include <unistd.h>
+#include <xf86drmMode.h>
 
 #include "drm-uapi/drm_fourcc.h"
 #include "drm-uapi/panfrost_drm.h"
@@ -82,6 +87,10 @@ static const struct debug_named_value panfrost_debug_options[] = {
         {"nocpuc",    PAN_DBG_UNCACHED_CPU, "Use uncached CPU mappings for textures"},
         {"log",       PAN_DBG_LOG,      "Log job submission etc."},
         {"gofaster",  PAN_DBG_GOFASTER, "Experimental performance improvements"},
+        {"async",     PAN_DBG_ASYNC,    "Submit CSF batches from a separate thread"},
+        {"afbcpack",  PAN_DBG_AFBC_PACK, "Pack AFBC textures once they are no longer rendered to"},
+        {"profile",   PAN_DBG_PROFILE,  "Print CPU time histograms of the draw and submit paths each frame"},
+        {"fastcompile", PAN_DBG_FAST_COMPILE, "Optimize less when compiling shaders in the background"},
         DEBUG_NAMED_VALUE_END
 };
 
@@ -103,6 +112,35 @@ panfrost_get_device_vendor(struct pipe_screen *screen)
         return "Arm";
 }
 
+/* Only the command stream of CSF GPUs can store timestamps */
+bool
+panfrost_has_gpu_timestamps(struct panfrost_device *dev)
+{
+        return dev->kbase && dev->arch >= 10 && dev->mali.timestamp_freq;
+}
+
+uint64_t
+panfrost_timestamp_to_ns(struct panfrost_device *dev, uint64_t timestamp)
+{
+        uint64_t freq = dev->mali.timestamp_freq;
+
+        /* Split the conversion to avoid overflowing */
+        return (timestamp / freq) * 1000000000ull +
+               (timestamp % freq) * 1000000000ull / freq;
+}
+
+static uint64_t
+panfrost_get_timestamp(struct pipe_screen *pscreen)
+{
+        struct panfrost_device *dev = pan_device(pscreen);
+        uint64_t timestamp;
+
+        if (!dev->mali.read_timestamp(&dev->mali, &timestamp))
+                return u_default_get_timestamp(pscreen);
+
+        return panfrost_timestamp_to_ns(dev, timestamp);
+}
+
 static int
 panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
 {
@@ -135,6 +173,11 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
         case PIPE_CAP_CLIP_HALFZ:
                 return 1;
 
+        /* Coherent maps of CPU-cached buffers are cleaned at submit and
+         * invalidated after fence waits, see panfrost_is_coherent_map() */
+        case PIPE_CAP_BUFFER_MAP_PERSISTENT_COHERENT:
+                return 1;
+
         case PIPE_CAP_MAX_RENDER_TARGETS:
         case PIPE_CAP_FBFETCH:
         case PIPE_CAP_FBFETCH_COHERENT:
@@ -203,6 +246,13 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
         case PIPE_CAP_MAX_TEXTURE_ARRAY_LAYERS:
                 return 2048;
 
+        /* Limits of the geometry shader emulation, which buffers all the
+         * vertices emitted, see panfrost_draw_gs */
+        case PIPE_CAP_MAX_GEOMETRY_OUTPUT_VERTICES:
+                return 256;
+        case PIPE_CAP_MAX_GEOMETRY_TOTAL_OUTPUT_COMPONENTS:
+                return 1024;
+
         case PIPE_CAP_GLSL_FEATURE_LEVEL:
         case PIPE_CAP_GLSL_FEATURE_LEVEL_COMPATIBILITY:
                 return is_gl3 ? 330 : 140;
@@ -220,7 +270,34 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
                 return 64;
 
         case PIPE_CAP_QUERY_TIMESTAMP:
-                return is_gl3;
+                return is_gl3 || panfrost_has_gpu_timestamps(dev);
+
+        case PIPE_CAP_QUERY_TIME_ELAPSED:
+                return panfrost_has_gpu_timestamps(dev);
+
+        case PIPE_CAP_QUERY_MEMORY_INFO:
+                return 1;
+
+        /* Copied by the command stream where possible, see
+         * panfrost_get_query_result_resource */
+        case PIPE_CAP_QUERY_BUFFER_OBJECT:
+                return true;
+
+        /* Buffers only, see panfrost_resource_from_user_memory */
+        case PIPE_CAP_RESOURCE_FROM_USER_MEMORY:
+                return dev->kbase && dev->mali.import_user;
+
+        /* Backed by committing pages of reserved VA, see
+         * panfrost_resource_commit */
+        case PIPE_CAP_SPARSE_BUFFER_PAGE_SIZE:
+                return dev->kbase ? PAN_SPARSE_PAGE_SIZE : 0;
+
+        /* Mapped to queue group priorities, see panfrost_context_priority */
+        case PIPE_CAP_CONTEXT_PRIORITY_MASK:
+                return dev->kbase && dev->arch >= 10 ?
+                       (PIPE_CONTEXT_PRIORITY_LOW |
+                        PIPE_CONTEXT_PRIORITY_MEDIUM |
+                        PIPE_CONTEXT_PRIORITY_HIGH) : 0;
 
         /* The hardware requires element alignment for data conversion to work
          * as expected. If data conversion is not required, this restriction is
@@ -230,9 +307,18 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
          *
          * This is less heavy-handed than the 4BYTE_ALIGNED_ONLY caps, which
          * would needlessly require alignment even for 8-bit formats.
+         *
+         * On Valhall, the vertex shader fetches misaligned elements itself
+         * instead, see panfrost_update_vertex_fetch.
          */
         case PIPE_CAP_VERTEX_ATTRIB_ELEMENT_ALIGNED_ONLY:
-                return 1;
+                return dev->arch < 9;
+
+        /* Ballots and votes map to WMASK, which needs the full-warp subgroup
+         * mode of Valhall */
+        case PIPE_CAP_SHADER_BALLOT:
+        case PIPE_CAP_SHADER_GROUP_VOTE:
+                return dev->arch >= 9;
 
         case PIPE_CAP_MAX_TEXTURE_2D_SIZE:
                 return 1 << (MAX_MIP_LEVELS - 1);
@@ -264,8 +350,10 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
         case PIPE_CAP_MAX_VERTEX_ELEMENT_SRC_OFFSET:
                 return 0xffff;
 
+        /* Lets the frontend record readbacks to PBOs as GPU copies, so
+         * only the first map of the PBO waits, for the batch writing it */
         case PIPE_CAP_TEXTURE_TRANSFER_MODES:
-                return 0;
+                return PIPE_TEXTURE_TRANSFER_BLIT;
 
         case PIPE_CAP_ENDIANNESS:
                 return PIPE_ENDIAN_NATIVE;
@@ -331,6 +419,11 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
         case PIPE_CAP_DRAW_INDIRECT:
                 return has_heap;
 
+        /* Loaded by the command stream on CSF */
+        case PIPE_CAP_MULTI_DRAW_INDIRECT:
+        case PIPE_CAP_MULTI_DRAW_INDIRECT_PARAMS:
+                return has_heap && dev->arch >= 10;
+
         case PIPE_CAP_START_INSTANCE:
         case PIPE_CAP_DRAW_PARAMETERS:
                 return pan_is_bifrost(dev);
@@ -346,7 +439,14 @@ panfrost_get_param(struct pipe_screen *screen, enum pipe_cap param)
                         modes |= BITFIELD_BIT(PIPE_PRIM_POLYGON);
                 }
 
-                if (dev->arch >= 9) {
+                if (dev->arch >= 10) {
+                        /* Drawn as triangle lists by the driver, which can
+                         * translate indices in GPU memory without a stall.
+                         * Native quads don't work correctly on Valhall, see
+                         * arb-provoking-vertex-render. */
+                        modes |= BITFIELD_BIT(PIPE_PRIM_QUAD_STRIP);
+                        modes |= BITFIELD_BIT(PIPE_PRIM_POLYGON);
+                } else if (dev->arch >= 9) {
                         /* Although Valhall is supposed to support quads, they
                          * don't seem to work correctly. Disable to fix
                          * arb-provoking-vertex-render.
@@ -376,12 +476,18 @@ panfrost_get_shader_param(struct pipe_screen *screen,
         struct panfrost_device *dev = pan_device(screen);
         bool is_nofp16 = dev->debug & PAN_DBG_NOFP16;
         bool is_deqp = dev->debug & PAN_DBG_DEQP;
+        bool is_gl3 = dev->debug & (PAN_DBG_GL3 | PAN_DBG_DEQP);
 
         switch (shader) {
         case PIPE_SHADER_VERTEX:
         case PIPE_SHADER_FRAGMENT:
         case PIPE_SHADER_COMPUTE:
                 break;
+        case PIPE_SHADER_GEOMETRY:
+                /* Emulated with compute jobs, see panfrost_draw_gs */
+                if (is_gl3 && dev->arch >= 10)
+                        break;
+                return 0;
         default:
                 return 0;
         }
@@ -390,7 +496,8 @@ panfrost_get_shader_param(struct pipe_screen *screen,
          * fragment shaders. Side effects in the geometry pipeline cause
          * trouble with IDVS and conflict with our transform feedback lowering.
          */
-        bool allow_side_effects = (shader != PIPE_SHADER_VERTEX);
+        bool allow_side_effects = (shader == PIPE_SHADER_FRAGMENT ||
+                                   shader == PIPE_SHADER_COMPUTE);
 
         switch (param) {
         case PIPE_SHADER_CAP_MAX_INSTRUCTIONS:
@@ -638,14 +745,14 @@ panfrost_walk_dmabuf_modifiers(struct pipe_screen *screen,
                     test_modifier != pan_best_modifiers[i])
                         continue;
 
-                count++;
-
                 if (max > (int) count) {
                         modifiers[count] = pan_best_modifiers[i];
 
                         if (external_only)
                                 external_only[count] = false;
                 }
+
+                count++;
         }
 
         *out_count = count;
@@ -678,6 +785,215 @@ panfrost_is_dmabuf_modifier_supported(struct pipe_screen *screen,
         return count > 0;
 }
 
+/* Whether the display can scan out a modifier is only known for the usual
+ * window system formats, sRGB views being allocated as UNORM */
+
+static uint32_t
+panfrost_scanout_fourcc(enum pipe_format format)
+{
+        switch (util_format_linear(format)) {
+        case PIPE_FORMAT_B8G8R8A8_UNORM: return DRM_FORMAT_ARGB8888;
+        case PIPE_FORMAT_B8G8R8X8_UNORM: return DRM_FORMAT_XRGB8888;
+        case PIPE_FORMAT_R8G8B8A8_UNORM: return DRM_FORMAT_ABGR8888;
+        case PIPE_FORMAT_R8G8B8X8_UNORM: return DRM_FORMAT_XBGR8888;
+        case PIPE_FORMAT_B5G6R5_UNORM: return DRM_FORMAT_RGB565;
+        case PIPE_FORMAT_B10G10R10A2_UNORM: return DRM_FORMAT_ARGB2101010;
+        case PIPE_FORMAT_B10G10R10X2_UNORM: return DRM_FORMAT_XRGB2101010;
+        case PIPE_FORMAT_R10G10B10A2_UNORM: return DRM_FORMAT_ABGR2101010;
+        case PIPE_FORMAT_R10G10B10X2_UNORM: return DRM_FORMAT_XBGR2101010;
+        default: return 0;
+        }
+}
+
+static void
+panfrost_scanout_add(struct panfrost_screen *screen, uint32_t fourcc,
+                     uint64_t modifier)
+{
+        util_dynarray_foreach(&screen->scanout.pairs,
+                              struct panfrost_scanout_modifier, p) {
+                if (p->fourcc == fourcc && p->modifier == modifier)
+                        return;
+        }
+
+        struct panfrost_scanout_modifier pair = { fourcc, modifier };
+        util_dynarray_append(&screen->scanout.pairs,
+                             struct panfrost_scanout_modifier, pair);
+}
+
+static void
+panfrost_scanout_parse_in_formats(struct panfrost_screen *screen,
+                                  const void *data, size_t size)
+{
+        const struct drm_format_modifier_blob *blob = data;
+
+        if (size < sizeof(*blob) || blob->version != FORMAT_BLOB_CURRENT)
+                return;
+
+        if (blob->formats_offset +
+            ((size_t) blob->count_formats * sizeof(uint32_t)) > size ||
+            blob->modifiers_offset +
+            ((size_t) blob->count_modifiers * sizeof(struct drm_format_modifier)) > size)
+                return;
+
+        const uint8_t *base = data;
+        const uint32_t *formats =
+                (const uint32_t *) (base + blob->formats_offset);
+        const struct drm_format_modifier *mods =
+                (const struct drm_format_modifier *) (base + blob->modifiers_offset);
+
+        /* Each modifier applies to a window of 64 formats, starting at its
+         * offset in the format list */
+        for (unsigned i = 0; i < blob->count_modifiers; ++i) {
+                u_foreach_bit64(b, mods[i].formats) {
+                        unsigned idx = mods[i].offset + b;
+
+                        if (idx < blob->count_formats)
+                                panfrost_scanout_add(screen, formats[idx],
+                                                     mods[i].modifier);
+                }
+        }
+}
+
+static void
+panfrost_scanout_query_plane(struct panfrost_screen *screen, int fd,
+                             uint32_t plane)
+{
+        drmModeObjectPropertiesPtr props =
+                drmModeObjectGetProperties(fd, plane, DRM_MODE_OBJECT_PLANE);
+
+        if (!props)
+                return;
+
+        for (unsigned i = 0; i < props->count_props; ++i) {
+                drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+                bool in_formats = prop && !strcmp(prop->name, "IN_FORMATS");
+                drmModeFreeProperty(prop);
+
+                if (!in_formats)
+                        continue;
+
+                drmModePropertyBlobPtr blob =
+                        drmModeGetPropertyBlob(fd, props->prop_values[i]);
+
+                if (blob) {
+                        panfrost_scanout_parse_in_formats(screen, blob->data,
+                                                          blob->length);
+                        drmModeFreePropertyBlob(blob);
+                }
+        }
+
+        drmModeFreeObjectProperties(props);
+}
+
+/* Collects what the planes of the display controller can scan out, so
+ * scanout buffers pick a modifier the display takes (on RK3588, VOP2 takes
+ * AFBC 16x16 but neither tiled headers nor solid colour blocks). The device
+ * is reopened so that enabling universal planes doesn't change what the
+ * window system sees through its own file description. */
+
+static void
+panfrost_scanout_query(struct panfrost_screen *screen)
+{
+        struct renderonly *ro = screen->dev.ro;
+
+        if (!ro || ro->kms_fd < 0)
+                return;
+
+        char *name = drmGetDeviceNameFromFd2(ro->kms_fd);
+        int fd = name ? open(name, O_RDWR | O_CLOEXEC) : -1;
+        free(name);
+
+        if (fd < 0)
+                return;
+
+        drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+
+        drmModePlaneResPtr res = drmModeGetPlaneResources(fd);
+
+        if (res) {
+                for (unsigned i = 0; i < res->count_planes; ++i)
+                        panfrost_scanout_query_plane(screen, fd, res->planes[i]);
+
+                drmModeFreePlaneResources(res);
+        }
+
+        close(fd);
+}
+
+/* Whether some plane of the display can scan out the format with the
+ * modifier. Anything goes if the display doesn't say, like without
+ * renderonly or for formats it doesn't list. */
+
+bool
+panfrost_scanout_supports_modifier(struct panfrost_screen *screen,
+                                   enum pipe_format format, uint64_t modifier)
+{
+        uint32_t fourcc = panfrost_scanout_fourcc(format);
+
+        if (!screen->dev.ro || !fourcc)
+                return true;
+
+        simple_mtx_lock(&screen->scanout.lock);
+
+        if (!screen->scanout.queried) {
+                panfrost_scanout_query(screen);
+                screen->scanout.queried = true;
+        }
+
+        simple_mtx_unlock(&screen->scanout.lock);
+
+        bool listed = false;
+
+        util_dynarray_foreach(&screen->scanout.pairs,
+                              struct panfrost_scanout_modifier, p) {
+                if (p->fourcc != fourcc)
+                        continue;
+
+                if (p->modifier == modifier)
+                        return true;
+
+                listed = true;
+        }
+
+        return !listed;
+}
+
+/* The GPU shares system memory with the CPU */
+static uint64_t
+panfrost_global_mem_size(void)
+{
+        uint64_t size;
+
+        if (!os_get_total_physical_memory(&size))
+                return 1024 * 1024 * 512;
+
+        return size;
+}
+
+/* There is no dedicated memory, so report the budget (or all of the system
+ * memory without one) as both device and staging memory. BOs in the cache
+ * are released under pressure, so they count as available. */
+static void
+panfrost_query_memory_info(struct pipe_screen *pscreen,
+                           struct pipe_memory_info *info)
+{
+        struct panfrost_device *dev = pan_device(pscreen);
+        uint64_t total = dev->mem.budget ?: panfrost_global_mem_size();
+        uint64_t used = panfrost_bo_mem_total(dev);
+        int64_t cached = p_atomic_read(&dev->mem.size[PAN_MEM_BO_CACHE]);
+
+        used -= MIN2(used, MAX2(cached, 0));
+
+        info->total_device_memory = total / 1024;
+        info->avail_device_memory = (total - MIN2(used, total)) / 1024;
+        info->total_staging_memory = info->total_device_memory;
+        info->avail_staging_memory = info->avail_device_memory;
+        info->device_memory_evicted =
+                p_atomic_read(&dev->stats.mem_evicted) / 1024;
+        info->nr_device_memory_evictions =
+                p_atomic_read(&dev->stats.mem_evictions);
+}
+
 static int
 panfrost_get_compute_param(struct pipe_screen *pscreen, enum pipe_shader_ir ir_type,
                 enum pipe_compute_cap param, void *ret)
@@ -731,7 +1047,7 @@ panfrost_get_compute_param(struct pipe_screen *pscreen, enum pipe_shader_ir ir_t
 		RET((uint64_t []) { dev->arch >= 6 ? 256 : 128 });
 
 	case PIPE_COMPUTE_CAP_MAX_GLOBAL_SIZE:
-		RET((uint64_t []) { 1024*1024*512 /* Maybe get memory */ });
+		RET((uint64_t []) { panfrost_global_mem_size() });
 
 	case PIPE_COMPUTE_CAP_MAX_LOCAL_SIZE:
 		RET((uint64_t []) { 32768 });
@@ -740,8 +1056,9 @@ panfrost_get_compute_param(struct pipe_screen *pscreen, enum pipe_shader_ir ir_t
 	case PIPE_COMPUTE_CAP_MAX_INPUT_SIZE:
 		RET((uint64_t []) { 4096 });
 
+	/* OpenCL requires at least a quarter of the global size */
 	case PIPE_COMPUTE_CAP_MAX_MEM_ALLOC_SIZE:
-		RET((uint64_t []) { 1024*1024*512 /* Maybe get memory */ });
+		RET((uint64_t []) { panfrost_global_mem_size() / 2 });
 
 	case PIPE_COMPUTE_CAP_MAX_CLOCK_FREQUENCY:
 		RET((uint32_t []) { 800 /* MHz -- TODO */ });
@@ -768,12 +1085,18 @@ panfrost_destroy_screen(struct pipe_screen *pscreen)
         struct panfrost_device *dev = pan_device(pscreen);
         struct panfrost_screen *screen = pan_screen(pscreen);
 
+        panfrost_shader_screen_destroy(screen);
         panfrost_resource_screen_destroy(pscreen);
         panfrost_pool_cleanup(&screen->indirect_draw.bin_pool);
         panfrost_pool_cleanup(&screen->blitter.bin_pool);
         panfrost_pool_cleanup(&screen->blitter.desc_pool);
         pan_blend_shaders_cleanup(dev);
 
+        if (screen->kcpu.ctx)
+                dev->mali.context_destroy(&dev->mali, screen->kcpu.ctx);
+        simple_mtx_destroy(&screen->kcpu.lock);
+        simple_mtx_destroy(&screen->scanout.lock);
+
         if (screen->vtbl.screen_destroy)
                 screen->vtbl.screen_destroy(pscreen);
 
@@ -816,6 +1139,35 @@ panfrost_get_driver_query_info(struct pipe_screen *pscreen, unsigned index,
         return 1;
 }
 
+/* Only the part of the front buffer that may have changed is copied to the
+ * display target: the box the frontend displays, within the damage region
+ * of the frame. The copy is widened to whole 16x16 tiles, so tiled and AFBC
+ * resources are unpacked (by the GPU for AFBC) in whole blocks. */
+
+static void
+panfrost_frontbuffer_box(const struct panfrost_resource *rsrc,
+                         const struct pipe_box *box, struct pipe_box *out)
+{
+        const struct pipe_scissor_state *damage = &rsrc->damage.extent;
+        int minx = damage->minx, miny = damage->miny;
+        int maxx = MIN2(damage->maxx, rsrc->base.width0);
+        int maxy = MIN2(damage->maxy, rsrc->base.height0);
+
+        if (box) {
+                minx = MAX2(minx, box->x);
+                miny = MAX2(miny, box->y);
+                maxx = MIN2(maxx, box->x + box->width);
+                maxy = MIN2(maxy, box->y + box->height);
+        }
+
+        minx = ROUND_DOWN_TO(MAX2(minx, 0), 16);
+        miny = ROUND_DOWN_TO(MAX2(miny, 0), 16);
+        maxx = MIN2(ALIGN_POT(maxx, 16), rsrc->base.width0);
+        maxy = MIN2(ALIGN_POT(maxy, 16), rsrc->base.height0);
+
+        u_box_2d(minx, miny, MAX2(maxx - minx, 0), MAX2(maxy - miny, 0), out);
+}
+
 static void
 panfrost_flush_frontbuffer(struct pipe_screen *_screen,
                            struct pipe_context *pctx,
@@ -828,35 +1180,96 @@ panfrost_flush_frontbuffer(struct pipe_screen *_screen,
         struct sw_winsys *winsys = screen->sw_winsys;
 
         assert(level == 0);
+        assert(rsrc->dt);
 
-        struct pipe_box my_box = {
-                .width = rsrc->base.width0,
-                .height = rsrc->base.height0,
-                .depth = 1,
-        };
+        struct pipe_box my_box;
+        panfrost_frontbuffer_box(rsrc, box, &my_box);
 
-        assert(rsrc->dt);
-        uint8_t *map = winsys->displaytarget_map(winsys, rsrc->dt,
-                                                 PIPE_USAGE_DEFAULT);
-        assert(map);
+        if (my_box.width && my_box.height) {
+                uint8_t *map = winsys->displaytarget_map(winsys, rsrc->dt,
+                                                         PIPE_USAGE_DEFAULT);
+                assert(map);
+
+                struct pipe_transfer *trans = NULL;
+                uint8_t *tex_map = pctx->texture_map(pctx, prsrc, level,
+                                                     PIPE_MAP_READ, &my_box,
+                                                     &trans);
 
-        struct pipe_transfer *trans = NULL;
-        uint8_t *tex_map = pctx->texture_map(pctx, prsrc, level,
-                                             PIPE_MAP_READ, &my_box, &trans);
+                unsigned bpp = util_format_get_blocksize(prsrc->format);
+                unsigned offset = my_box.x * bpp;
+                unsigned size = my_box.width * bpp;
 
-        for (unsigned row = 0; row < rsrc->base.height0; ++row)
-                memcpy(map + row * rsrc->dt_stride,
-                       tex_map + row * trans->stride,
-                       MIN2(rsrc->dt_stride, trans->stride));
+                map += (my_box.y * rsrc->dt_stride) + offset;
 
-        pctx->texture_unmap(pctx, trans);
+                for (unsigned row = 0; row < my_box.height; ++row)
+                        memcpy(map + row * rsrc->dt_stride,
+                               tex_map + row * trans->stride,
+                               MIN2(size, rsrc->dt_stride - offset));
+
+                pctx->texture_unmap(pctx, trans);
+                winsys->displaytarget_unmap(winsys, rsrc->dt);
+        }
 
         winsys->displaytarget_display(winsys, rsrc->dt, context_private, box);
 }
 
+/* Startup time breakdown, printed with PAN_MESA_DEBUG=perf */
+static void
+panfrost_startup_step(struct panfrost_device *dev, const char *step,
+                      int64_t *time)
+{
+        int64_t now = os_time_get_nano();
+
+        perf_debug(dev, "Screen creation: %s took %.3f ms", step,
+                   (now - *time) / 1000000.0);
+        *time = now;
+}
+
+/* Performance knobs from driconf, so that per-application profiles can set
+ * them. Debug flags are only ever added, and environment variables take
+ * precedence over driconf for the device options they also control. */
+
+static void
+panfrost_apply_driconf(struct panfrost_screen *screen,
+                       const struct driOptionCache *options)
+{
+        struct panfrost_device *dev = pan_device(&screen->base);
+
+        screen->fp16_color = driQueryOptionb(options, "pan_fp16_color");
+        screen->explicit_sync = driQueryOptionb(options, "pan_explicit_sync");
+        screen->max_frames_in_flight =
+                driQueryOptioni(options, "pan_max_frames_in_flight");
+        screen->cached_read_threshold =
+                driQueryOptioni(options, "pan_cached_read_threshold");
+
+        if (driQueryOptionb(options, "pan_gofaster"))
+                dev->debug |= PAN_DBG_GOFASTER;
+        if (driQueryOptionb(options, "pan_no_afbc"))
+                dev->debug |= PAN_DBG_NO_AFBC;
+        if (driQueryOptionb(options, "pan_no_crc"))
+                dev->debug |= PAN_DBG_NO_CRC;
+        if (driQueryOptionb(options, "pan_uncached_cpu"))
+                dev->debug |= PAN_DBG_UNCACHED_CPU;
+        if (driQueryOptionb(options, "pan_uncached_gpu"))
+                dev->debug |= PAN_DBG_UNCACHED_GPU;
+
+        if (!debug_get_option("PAN_CACHED_POOLS", NULL) &&
+            driQueryOptionb(options, "pan_cached_pools"))
+                dev->cached_pools = dev->kbase;
+
+        unsigned bo_cache_mb = driQueryOptioni(options, "pan_bo_cache_max_size");
+
+        if (!debug_get_option("PAN_BO_CACHE_MAX_SIZE", NULL) && bo_cache_mb)
+                dev->bo_cache.max_size = (uint64_t)bo_cache_mb << 20;
+}
+
 struct pipe_screen *
-panfrost_create_screen(int fd, struct renderonly *ro)
+panfrost_create_screen(int fd, const struct pipe_screen_config *config,
+                       struct renderonly *ro)
 {
+        int64_t start = os_time_get_nano();
+        int64_t time = start;
+
         /* Create the screen */
         struct panfrost_screen *screen = rzalloc(NULL, struct panfrost_screen);
 
@@ -865,9 +1278,19 @@ panfrost_create_screen(int fd, struct renderonly *ro)
 
         struct panfrost_device *dev = pan_device(&screen->base);
 
+        simple_mtx_init(&screen->kcpu.lock, mtx_plain);
+        simple_mtx_init(&screen->scanout.lock, mtx_plain);
+        util_dynarray_init(&screen->scanout.pairs, screen);
+
         /* Debug must be set first for pandecode to work correctly */
         dev->debug = debug_get_flags_option("PAN_MESA_DEBUG", panfrost_debug_options, 0);
         panfrost_open_device(screen, fd, dev);
+        panfrost_startup_step(dev, "opening the device", &time);
+
+        screen->cached_read_threshold = PAN_CACHED_READ_THRESHOLD;
+
+        if (config && config->options)
+                panfrost_apply_driconf(screen, config->options);
 
         if (dev->debug & PAN_DBG_NO_AFBC)
                 dev->has_afbc = false;
@@ -881,10 +1304,17 @@ panfrost_create_screen(int fd, struct renderonly *ro)
 
         dev->ro = ro;
 
-        /* The functionality is only useful with kbase */
-        if (dev->kbase)
+        /* Batch timing needs the timestamps of the CSF queues */
+        if (panfrost_has_gpu_timestamps(dev))
+                panfrost_perfetto_init();
+
+        /* The functionality is only useful with kbase, and not needed at all
+         * without implicit sync */
+        if (dev->kbase && !screen->explicit_sync)
                 dev->has_dmabuf_fence = panfrost_check_dmabuf_fence(dev);
 
+        panfrost_startup_step(dev, "checking dma-buf fences", &time);
+
         screen->base.destroy = panfrost_destroy_screen;
 
         screen->base.get_name = panfrost_get_name;
@@ -895,7 +1325,9 @@ panfrost_create_screen(int fd, struct renderonly *ro)
         screen->base.get_shader_param = panfrost_get_shader_param;
         screen->base.get_compute_param = panfrost_get_compute_param;
         screen->base.get_paramf = panfrost_get_paramf;
-        screen->base.get_timestamp = u_default_get_timestamp;
+        screen->base.query_memory_info = panfrost_query_memory_info;
+        screen->base.get_timestamp = panfrost_has_gpu_timestamps(dev) ?
+                panfrost_get_timestamp : u_default_get_timestamp;
         screen->base.is_format_supported = panfrost_is_format_supported;
         screen->base.query_dmabuf_modifiers = panfrost_query_dmabuf_modifiers;
         screen->base.is_dmabuf_modifier_supported =
@@ -912,7 +1344,15 @@ panfrost_create_screen(int fd, struct renderonly *ro)
         panfrost_resource_screen_init(&screen->base);
         pan_blend_shaders_init(dev);
 
+        panfrost_startup_step(dev, "resource and blend setup", &time);
+
         panfrost_disk_cache_init(screen);
+        panfrost_shader_screen_init(screen);
+
+        /* Share the cache with the internal shaders, compiled on first use */
+        dev->disk_cache = screen->disk_cache;
+
+        panfrost_startup_step(dev, "shader cache setup", &time);
 
         panfrost_pool_init(&screen->indirect_draw.bin_pool, NULL, dev,
                            PAN_BO_EXECUTE, 65536, "Indirect draw shaders",
@@ -936,6 +1376,10 @@ panfrost_create_screen(int fd, struct renderonly *ro)
         else
                 unreachable("Unhandled architecture major");
 
+        panfrost_startup_step(dev, "command stream setup", &time);
+        perf_debug(dev, "Screen creation took %.3f ms",
+                   (time - start) / 1000000.0);
+
         return &screen->base;
 }
 
@@ -948,7 +1392,7 @@ panfrost_create_screen_sw(struct sw_winsys *winsys)
         if (fd < 0)
                 return NULL;
 
-        struct pipe_screen *scr = panfrost_create_screen(fd, NULL);
+        struct pipe_screen *scr = panfrost_create_screen(fd, NULL, NULL);
 
         if (scr)
                 pan_screen(scr)->sw_winsys = winsys;
@@ -34,18 +34,96 @@
 #include "pipe/p_defines.h"
 #include "renderonly/renderonly.h"
 #include "util/u_dynarray.h"
+#include "util/u_queue.h"
 #include "util/bitset.h"
 #include "util/set.h"
 #include "util/log.h"
 #include "util/disk_cache.h"
+#include "util/simple_mtx.h"
+#include "util/slab.h"
 
 #include "pan_device.h"
 #include "pan_mempool.h"
 
 #define PAN_QUERY_DRAW_CALLS (PIPE_QUERY_DRIVER_SPECIFIC + 0)
+#define PAN_QUERY_TILER_HEAP_PEAK (PIPE_QUERY_DRIVER_SPECIFIC + 1)
+#define PAN_QUERY_LARGE_PAGE_MEMORY (PIPE_QUERY_DRIVER_SPECIFIC + 2)
+#define PAN_QUERY_CRC_ELIMINATED_TILES (PIPE_QUERY_DRIVER_SPECIFIC + 3)
+
+/* Software counters, see panfrost_query_counter */
+#define PAN_QUERY_FLUSHES (PIPE_QUERY_DRIVER_SPECIFIC + 4)
+#define PAN_QUERY_FLUSHES_EXPLICIT (PIPE_QUERY_DRIVER_SPECIFIC + 5)
+#define PAN_QUERY_FLUSHES_RESOURCE (PIPE_QUERY_DRIVER_SPECIFIC + 6)
+#define PAN_QUERY_FLUSHES_BATCH_SLOTS (PIPE_QUERY_DRIVER_SPECIFIC + 7)
+#define PAN_QUERY_FLUSHES_SPLIT (PIPE_QUERY_DRIVER_SPECIFIC + 8)
+#define PAN_QUERY_BO_ALLOCS (PIPE_QUERY_DRIVER_SPECIFIC + 9)
+#define PAN_QUERY_BO_FREES (PIPE_QUERY_DRIVER_SPECIFIC + 10)
+#define PAN_QUERY_BO_CACHE_HITS (PIPE_QUERY_DRIVER_SPECIFIC + 11)
+#define PAN_QUERY_BO_CACHE_MISSES (PIPE_QUERY_DRIVER_SPECIFIC + 12)
+#define PAN_QUERY_SHADER_COMPILES (PIPE_QUERY_DRIVER_SPECIFIC + 13)
+#define PAN_QUERY_STAGING_BLITS (PIPE_QUERY_DRIVER_SPECIFIC + 14)
+#define PAN_QUERY_MODIFIER_CONVERSIONS (PIPE_QUERY_DRIVER_SPECIFIC + 15)
+#define PAN_QUERY_AFBC_PACKS (PIPE_QUERY_DRIVER_SPECIFIC + 16)
+#define PAN_QUERY_CS_RING_WRAPS (PIPE_QUERY_DRIVER_SPECIFIC + 17)
+#define PAN_QUERY_KCPU_COMMANDS (PIPE_QUERY_DRIVER_SPECIFIC + 18)
+#define PAN_QUERY_UPLOADED_BYTES (PIPE_QUERY_DRIVER_SPECIFIC + 19)
+#define PAN_QUERY_AFBC_IMAGE_LOADS (PIPE_QUERY_DRIVER_SPECIFIC + 20)
+#define PAN_QUERY_AFBC_IMAGE_DECOMPRESSIONS (PIPE_QUERY_DRIVER_SPECIFIC + 21)
+#define PAN_QUERY_AFBC_IMAGE_RECOMPRESSIONS (PIPE_QUERY_DRIVER_SPECIFIC + 22)
+#define PAN_QUERY_ZS_ONLY_BATCHES (PIPE_QUERY_DRIVER_SPECIFIC + 23)
+#define PAN_QUERY_MEMORY_EVICTIONS (PIPE_QUERY_DRIVER_SPECIFIC + 24)
+
+/* Memory per category, the first five in the order of enum
+ * pan_mem_category */
+#define PAN_QUERY_MEMORY_RESOURCES (PIPE_QUERY_DRIVER_SPECIFIC + 25)
+#define PAN_QUERY_MEMORY_POOLS (PIPE_QUERY_DRIVER_SPECIFIC + 26)
+#define PAN_QUERY_MEMORY_HEAPS (PIPE_QUERY_DRIVER_SPECIFIC + 27)
+#define PAN_QUERY_MEMORY_SCRATCH (PIPE_QUERY_DRIVER_SPECIFIC + 28)
+#define PAN_QUERY_MEMORY_BO_CACHE (PIPE_QUERY_DRIVER_SPECIFIC + 29)
+#define PAN_QUERY_MEMORY_OTHER (PIPE_QUERY_DRIVER_SPECIFIC + 30)
 
 static const struct pipe_driver_query_info panfrost_driver_query_list[] = {
         {"draw-calls", PAN_QUERY_DRAW_CALLS, { 0 }},
+        {"tiler-heap-peak", PAN_QUERY_TILER_HEAP_PEAK, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"large-page-memory", PAN_QUERY_LARGE_PAGE_MEMORY, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"crc-eliminated-tiles", PAN_QUERY_CRC_ELIMINATED_TILES, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_PERCENTAGE, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"flushes", PAN_QUERY_FLUSHES, { 0 }},
+        {"flushes-explicit", PAN_QUERY_FLUSHES_EXPLICIT, { 0 }},
+        {"flushes-resource", PAN_QUERY_FLUSHES_RESOURCE, { 0 }},
+        {"flushes-batch-slots", PAN_QUERY_FLUSHES_BATCH_SLOTS, { 0 }},
+        {"flushes-split", PAN_QUERY_FLUSHES_SPLIT, { 0 }},
+        {"bo-allocs", PAN_QUERY_BO_ALLOCS, { 0 }},
+        {"bo-frees", PAN_QUERY_BO_FREES, { 0 }},
+        {"bo-cache-hits", PAN_QUERY_BO_CACHE_HITS, { 0 }},
+        {"bo-cache-misses", PAN_QUERY_BO_CACHE_MISSES, { 0 }},
+        {"shader-compiles", PAN_QUERY_SHADER_COMPILES, { 0 }},
+        {"staging-blits", PAN_QUERY_STAGING_BLITS, { 0 }},
+        {"modifier-conversions", PAN_QUERY_MODIFIER_CONVERSIONS, { 0 }},
+        {"afbc-packs", PAN_QUERY_AFBC_PACKS, { 0 }},
+        {"cs-ring-wraps", PAN_QUERY_CS_RING_WRAPS, { 0 }},
+        {"kcpu-commands", PAN_QUERY_KCPU_COMMANDS, { 0 }},
+        {"uploaded-bytes", PAN_QUERY_UPLOADED_BYTES, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"afbc-image-loads", PAN_QUERY_AFBC_IMAGE_LOADS, { 0 }},
+        {"afbc-image-decompressions", PAN_QUERY_AFBC_IMAGE_DECOMPRESSIONS, { 0 }},
+        {"afbc-image-recompressions", PAN_QUERY_AFBC_IMAGE_RECOMPRESSIONS, { 0 }},
+        {"zs-only-batches", PAN_QUERY_ZS_ONLY_BATCHES, { 0 }},
+        {"memory-evictions", PAN_QUERY_MEMORY_EVICTIONS, { 0 }},
+        {"memory-resources", PAN_QUERY_MEMORY_RESOURCES, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"memory-pools", PAN_QUERY_MEMORY_POOLS, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"memory-heaps", PAN_QUERY_MEMORY_HEAPS, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"memory-scratch", PAN_QUERY_MEMORY_SCRATCH, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"memory-bo-cache", PAN_QUERY_MEMORY_BO_CACHE, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
+        {"memory-other", PAN_QUERY_MEMORY_OTHER, { 0 },
+         PIPE_DRIVER_QUERY_TYPE_BYTES, PIPE_DRIVER_QUERY_RESULT_TYPE_AVERAGE},
 };
 
 struct panfrost_batch;
@@ -106,6 +184,22 @@ struct panfrost_vtable {
         void (*emit_csf_toplevel)(struct panfrost_batch *);
 
         void (*init_cs)(struct panfrost_context *ctx, struct panfrost_cs *cs);
+
+        /* Write a GPU timestamp to the given address from the CS of the
+         * batch, after the work queued so far when end_of_pipe is set */
+        void (*emit_timestamp)(struct panfrost_batch *, mali_ptr, bool end_of_pipe);
+
+        /* Write the result of an occlusion query with the given number of
+         * per-core counters from the CS of the batch, as a 32 or 64-bit
+         * value. Without counters, 1 is written as the availability. */
+        void (*emit_occlusion_result)(struct panfrost_batch *, mali_ptr counters,
+                                      unsigned count, bool predicate,
+                                      bool is64, mali_ptr dst);
+};
+
+struct panfrost_scanout_modifier {
+        uint32_t fourcc;
+        uint64_t modifier;
 };
 
 struct panfrost_screen {
@@ -123,6 +217,79 @@ struct panfrost_screen {
 
         struct panfrost_vtable vtbl;
         struct disk_cache *disk_cache;
+
+        /* On CSF kbase, a KCPU queue not owned by any context for exporting
+         * fences as sync files. Created on first use. */
+        struct {
+                simple_mtx_t lock;
+                struct kbase_context *ctx;
+        } kcpu;
+
+        /* Transfers of the threaded contexts of the screen */
+        struct slab_parent_pool transfer_pool;
+
+        /* Buffers with persistent, coherent mappings of a CPU-cached BO.
+         * The GPU doesn't snoop the CPU caches, so the mapped ranges are
+         * cleaned when a batch using them is submitted, and invalidated
+         * once a fence wait returns. */
+        struct {
+                simple_mtx_t lock;
+                struct util_dynarray rsrcs;
+        } coherent;
+
+        /* Ranges of CPU-cached BOs written through transfers, which are
+         * cleaned together when the next batch is submitted rather than
+         * one by one at unmap */
+        struct {
+                simple_mtx_t lock;
+                struct util_dynarray ranges;
+        } dirty;
+
+        /* Worker threads sharing large tiled texture transfers, not
+         * initialized on single core systems */
+        struct util_queue tiling_queue;
+
+        /* Worker threads compiling shader variants ahead of their first use,
+         * not initialized on single core systems */
+        struct util_queue shader_queue;
+
+        /* Shader binaries of all contexts, deduplicated by the SHA1 of the
+         * code so that contexts sharing shaders share their binaries. Maps
+         * to panfrost_shader_bin. */
+        struct {
+                simple_mtx_t lock;
+                struct panfrost_pool pool;
+                struct hash_table *bins;
+        } shader_bins;
+
+        /* From driconf, compute colour outputs to UNORM8 render targets at
+         * half precision when the compiler can show it is safe */
+        bool fp16_color;
+
+        /* From driconf, shared buffers are synchronised with explicit fences
+         * only (sync files through fence_server_sync and fence fds), so
+         * batches neither wait on nor attach implicit dma-buf fences */
+        bool explicit_sync;
+
+        /* From driconf, frames a context may have queued on the GPU at the
+         * end of a frame, or 0 for no limit */
+        unsigned max_frames_in_flight;
+
+        /* From driconf, synchronized CPU reads of an uncached buffer before
+         * it is moved to a CPU-cached BO, or 0 to never move it */
+        unsigned cached_read_threshold;
+
+        /* Set once a context captures frames for PAN_CAPTURE_FILE */
+        uint32_t capture_claimed;
+
+        /* Format/modifier pairs the KMS planes can scan out, read from their
+         * IN_FORMATS property on first use with renderonly. Empty if the
+         * display doesn't say. */
+        struct {
+                simple_mtx_t lock;
+                bool queried;
+                struct util_dynarray pairs;
+        } scanout;
 };
 
 static inline struct panfrost_screen *
@@ -141,6 +308,16 @@ int
 panfrost_get_driver_query_info(struct pipe_screen *pscreen, unsigned index,
                                struct pipe_driver_query_info *info);
 
+bool
+panfrost_has_gpu_timestamps(struct panfrost_device *dev);
+
+bool
+panfrost_scanout_supports_modifier(struct panfrost_screen *screen,
+                                   enum pipe_format format, uint64_t modifier);
+
+uint64_t
+panfrost_timestamp_to_ns(struct panfrost_device *dev, uint64_t timestamp);
+
 void panfrost_cmdstream_screen_init_v4(struct panfrost_screen *screen);
 void panfrost_cmdstream_screen_init_v5(struct panfrost_screen *screen);
 void panfrost_cmdstream_screen_init_v6(struct panfrost_screen *screen);
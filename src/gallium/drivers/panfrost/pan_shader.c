@@ -33,20 +33,31 @@
 #include "pan_bo.h"
 #include "pan_shader.h"
 #include "util/u_memory.h"
+#include "util/u_cpu_detect.h"
 #include "nir/tgsi_to_nir.h"
 #include "nir_serialize.h"
+#include "nir/nir_lower_blend.h"
 
 static struct panfrost_uncompiled_shader *
-panfrost_alloc_shader(const nir_shader *nir)
+panfrost_alloc_shader(struct panfrost_screen *screen, const nir_shader *nir)
 {
         struct panfrost_uncompiled_shader *so =
                 rzalloc(NULL, struct panfrost_uncompiled_shader);
 
         simple_mtx_init(&so->lock, mtx_plain);
         util_dynarray_init(&so->variants, so);
+        util_dynarray_init(&so->pending, so);
+        util_dynarray_init(&so->xfb_variants, so);
+        util_dynarray_init(&so->gs_vs_variants, so);
+        util_dynarray_init(&so->used_keys, so);
 
         so->nir = nir;
 
+        /* The hash is only used as a disk cache key, so skip serializing the
+         * shader when there is no disk cache */
+        if (!screen->disk_cache)
+                return so;
+
         /* Serialize the NIR to a binary blob that we can hash for the disk
          * cache. Drop unnecessary information (like variable names) so the
          * serialized NIR is smaller, and also to let us detect more isomorphic
@@ -67,13 +78,36 @@ panfrost_alloc_variant(struct panfrost_uncompiled_shader *so)
         return util_dynarray_grow(&so->variants, struct panfrost_compiled_shader, 1);
 }
 
+static void
+panfrost_blend_rt_to_nir(const struct pan_blend_equation eq,
+                         nir_lower_blend_rt *rt)
+{
+        rt->rgb.func = eq.rgb_func;
+        rt->rgb.src_factor = eq.rgb_src_factor;
+        rt->rgb.invert_src_factor = eq.rgb_invert_src_factor;
+        rt->rgb.dst_factor = eq.rgb_dst_factor;
+        rt->rgb.invert_dst_factor = eq.rgb_invert_dst_factor;
+        rt->alpha.func = eq.alpha_func;
+        rt->alpha.src_factor = eq.alpha_src_factor;
+        rt->alpha.invert_src_factor = eq.alpha_invert_src_factor;
+        rt->alpha.dst_factor = eq.alpha_dst_factor;
+        rt->alpha.invert_dst_factor = eq.alpha_invert_dst_factor;
+        rt->colormask = eq.color_mask;
+}
+
+/* Iterations of the NIR optimization loop for fast compiles. Most shaders
+ * stop making progress by then anyway. */
+#define PAN_FAST_COMPILE_NIR_ITERATIONS 2
+
 static void
 panfrost_shader_compile(struct panfrost_screen *screen,
                         const nir_shader *ir,
                         struct util_debug_callback *dbg,
                         struct panfrost_shader_key *key,
                         unsigned req_local_mem,
+                        bool fast,
                         unsigned fixed_varying_mask,
+                        unsigned fp16_varying_mask,
                         struct panfrost_shader_binary *out)
 {
         struct panfrost_device *dev = pan_device(&screen->base);
@@ -84,11 +118,15 @@ panfrost_shader_compile(struct panfrost_screen *screen,
                 .debug = dbg,
                 .gpu_id = dev->gpu_id,
                 .fixed_sysval_ubo = -1,
+                .cpu_preamble = true,
+                .push_constants = true,
+                .nir_opt_iterations = fast ? PAN_FAST_COMPILE_NIR_ITERATIONS : 0,
         };
 
         /* Lower this early so the backends don't have to worry about it */
         if (s->info.stage == MESA_SHADER_FRAGMENT) {
                 inputs.fixed_varying_mask = key->fs.fixed_varying_mask;
+                inputs.fp16_varying_mask = key->fs.fp16_varying_mask;
 
                 if (s->info.outputs_written & BITFIELD_BIT(FRAG_RESULT_COLOR)) {
                         NIR_PASS_V(s, nir_lower_fragcolor,
@@ -108,12 +146,42 @@ panfrost_shader_compile(struct panfrost_screen *screen,
                                    false);
                 }
 
+                if (key->fs.logicop_enable || key->fs.blend_in_shader) {
+                        nir_lower_blend_options options = {
+                                .logicop_enable = key->fs.logicop_enable,
+                                .logicop_func = key->fs.logicop_func,
+                        };
+
+                        for (unsigned i = 0; i < ARRAY_SIZE(options.rt); ++i) {
+                                options.format[i] = key->fs.rt_formats[i];
+                                options.rt[i].colormask = 0xF;
+
+                                if (key->fs.blend_in_shader & BITFIELD_BIT(i))
+                                        panfrost_blend_rt_to_nir(key->fs.blend[i], &options.rt[i]);
+                        }
+
+                        NIR_PASS_V(s, nir_lower_blend, &options);
+                }
+
                 memcpy(inputs.rt_formats, key->fs.rt_formats, sizeof(inputs.rt_formats));
+                inputs.fp16_rt_mask = key->fs.fp16_rt_mask;
         } else if (s->info.stage == MESA_SHADER_VERTEX) {
                 inputs.fixed_varying_mask = fixed_varying_mask;
-
-                /* No IDVS for internal XFB shaders */
-                inputs.no_idvs = s->info.has_transform_feedback_varyings;
+                inputs.fp16_varying_mask = fp16_varying_mask;
+                inputs.vertex_fetch = key->vs.fetch;
+
+                /* The flag is cleared on the shader once its transform
+                 * feedback program is created, later transform feedback
+                 * variants come from the key */
+                s->info.has_transform_feedback_varyings = key->vs.is_xfb;
+
+                /* No IDVS for internal XFB shaders, nor for programs
+                 * feeding a geometry shader, which run as compute jobs */
+                inputs.gs.inputs = key->vs.gs_inputs;
+                inputs.no_idvs = s->info.has_transform_feedback_varyings ||
+                                 key->vs.gs_inputs;
+        } else if (s->info.stage == MESA_SHADER_GEOMETRY) {
+                inputs.gs.topology = key->gs.topology;
         }
 
         util_dynarray_init(&out->binary, NULL);
@@ -128,40 +196,117 @@ panfrost_shader_compile(struct panfrost_screen *screen,
         ralloc_free(s);
 }
 
+/* Produce the binary for a variant, from the disk cache if possible. Does not
+ * touch any context state, so this may run on a worker thread. Fast compiles
+ * bound the NIR optimization loop, see PAN_FAST_COMPILE_NIR_ITERATIONS */
+
 static void
-panfrost_shader_get(struct pipe_screen *pscreen,
-                    struct panfrost_pool *shader_pool,
-                    struct panfrost_pool *desc_pool,
-                    struct panfrost_uncompiled_shader *uncompiled,
-                    struct util_debug_callback *dbg,
-                    struct panfrost_compiled_shader *state,
-                    unsigned req_local_mem)
+panfrost_shader_get_binary(struct panfrost_screen *screen,
+                           struct panfrost_uncompiled_shader *uncompiled,
+                           struct util_debug_callback *dbg,
+                           struct panfrost_shader_key *key,
+                           unsigned req_local_mem, bool fast,
+                           struct panfrost_shader_binary *res)
 {
-        struct panfrost_screen *screen = pan_screen(pscreen);
-        struct panfrost_device *dev = pan_device(pscreen);
-
-        struct panfrost_shader_binary res = { 0 };
-
         /* Try to retrieve the variant from the disk cache. If that fails,
          * compile a new variant and store in the disk cache for later reuse.
          */
-        if (!panfrost_disk_cache_retrieve(screen->disk_cache, uncompiled, &state->key, &res)) {
-                panfrost_shader_compile(screen, uncompiled->nir, dbg, &state->key,
-                                        req_local_mem,
-                                        uncompiled->fixed_varying_mask, &res);
+        if (!panfrost_disk_cache_retrieve(screen->disk_cache, uncompiled, key, res)) {
+                p_atomic_inc(&screen->dev.stats.shader_compiles);
+                panfrost_shader_compile(screen, uncompiled->nir, dbg, key,
+                                        req_local_mem, fast,
+                                        uncompiled->fixed_varying_mask,
+                                        uncompiled->fp16_varying_mask, res);
+
+                panfrost_disk_cache_store(screen->disk_cache, uncompiled, key, res);
+        }
+}
+
+static uint32_t
+panfrost_shader_bin_hash(const void *key)
+{
+        return _mesa_hash_data(key, 20);
+}
+
+static bool
+panfrost_shader_bin_equal(const void *a, const void *b)
+{
+        return memcmp(a, b, 20) == 0;
+}
+
+/* Find the binary in the screen's store, uploading it if no context did yet,
+ * and take a reference on it */
+
+static struct panfrost_shader_bin *
+panfrost_shader_bin_get(struct panfrost_screen *screen,
+                        const struct util_dynarray *binary)
+{
+        unsigned char sha1[20];
+        _mesa_sha1_compute(binary->data, binary->size, sha1);
+
+        simple_mtx_lock(&screen->shader_bins.lock);
+
+        struct hash_entry *he =
+                _mesa_hash_table_search(screen->shader_bins.bins, sha1);
+        struct panfrost_shader_bin *bin = he ? he->data : NULL;
+
+        if (bin) {
+                bin->refcnt++;
+        } else {
+                struct panfrost_pool *pool = &screen->shader_bins.pool;
+
+                bin = CALLOC_STRUCT(panfrost_shader_bin);
+                memcpy(bin->sha1, sha1, sizeof(sha1));
+                bin->refcnt = 1;
+                bin->ref = panfrost_pool_take_ref(pool,
+                        pan_pool_upload_aligned(&pool->base, binary->data,
+                                                binary->size, 128));
+
+                _mesa_hash_table_insert(screen->shader_bins.bins, bin->sha1, bin);
+        }
+
+        simple_mtx_unlock(&screen->shader_bins.lock);
+        return bin;
+}
+
+static void
+panfrost_shader_bin_release(struct panfrost_screen *screen,
+                            struct panfrost_shader_bin *bin)
+{
+        if (!bin)
+                return;
+
+        simple_mtx_lock(&screen->shader_bins.lock);
 
-                panfrost_disk_cache_store(screen->disk_cache, uncompiled, &state->key, &res);
+        if (--bin->refcnt == 0) {
+                _mesa_hash_table_remove_key(screen->shader_bins.bins, bin->sha1);
+                panfrost_bo_unreference(bin->ref.bo);
+                FREE(bin);
         }
 
-        state->info = res.info;
+        simple_mtx_unlock(&screen->shader_bins.lock);
+}
+
+/* Upload a compiled binary and prepare its descriptors, consuming the binary */
+
+static void
+panfrost_shader_upload(struct pipe_screen *pscreen,
+                       struct panfrost_pool *desc_pool,
+                       struct panfrost_uncompiled_shader *uncompiled,
+                       struct panfrost_compiled_shader *state,
+                       struct panfrost_shader_binary *res)
+{
+        struct panfrost_screen *screen = pan_screen(pscreen);
+        struct panfrost_device *dev = pan_device(pscreen);
+
+        state->info = res->info;
 
-        if (res.binary.size) {
-                state->bin = panfrost_pool_take_ref(shader_pool,
-                        pan_pool_upload_aligned(&shader_pool->base,
-                                res.binary.data, res.binary.size, 128));
+        if (res->binary.size) {
+                state->shared_bin = panfrost_shader_bin_get(screen, &res->binary);
+                state->bin = state->shared_bin->ref;
         }
 
-        util_dynarray_fini(&res.binary);
+        util_dynarray_fini(&res->binary);
 
         /* Don't upload RSD for fragment shaders since they need draw-time
          * merging for e.g. depth/stencil/alpha. RSDs are replaced by simpler
@@ -173,12 +318,118 @@ panfrost_shader_get(struct pipe_screen *pscreen,
         panfrost_analyze_sysvals(state);
 }
 
+static void
+panfrost_shader_get(struct pipe_screen *pscreen,
+                    struct panfrost_pool *desc_pool,
+                    struct panfrost_uncompiled_shader *uncompiled,
+                    struct util_debug_callback *dbg,
+                    struct panfrost_compiled_shader *state,
+                    unsigned req_local_mem)
+{
+        struct panfrost_shader_binary res = { 0 };
+
+        panfrost_shader_get_binary(pan_screen(pscreen), uncompiled, dbg,
+                                   &state->key, req_local_mem, false, &res);
+
+        panfrost_shader_upload(pscreen, desc_pool, uncompiled, state, &res);
+}
+
+/* A variant compiled on the screen's shader queue ahead of its first use.
+ * Only the binary is produced in the background: uploading it needs the
+ * pools of the context that ends up using the variant. */
+
+struct panfrost_shader_job {
+        struct util_queue_fence fence;
+        struct panfrost_screen *screen;
+        struct panfrost_uncompiled_shader *uncompiled;
+        struct panfrost_shader_key key;
+
+        /* Copy of the context's debug callback, if it may be called from any
+         * thread */
+        struct util_debug_callback debug;
+        bool has_debug;
+
+        struct panfrost_shader_binary res;
+};
+
+static void
+panfrost_shader_job_execute(void *data, void *gdata, int thread_index)
+{
+        struct panfrost_shader_job *job = data;
+        bool fast = job->screen->dev.debug & PAN_DBG_FAST_COMPILE;
+
+        panfrost_shader_get_binary(job->screen, job->uncompiled,
+                                   job->has_debug ? &job->debug : NULL,
+                                   &job->key, 0, fast, &job->res);
+}
+
+/* Find a queued compile of the key, removing it from the pending list */
+
+static struct panfrost_shader_job *
+panfrost_take_pending_variant_locked(struct panfrost_uncompiled_shader *uncompiled,
+                                     struct panfrost_shader_key *key)
+{
+        util_dynarray_foreach(&uncompiled->pending, struct panfrost_shader_job *, it) {
+                struct panfrost_shader_job *job = *it;
+
+                if (memcmp(key, &job->key, sizeof(*key)) == 0) {
+                        *it = util_dynarray_pop(&uncompiled->pending,
+                                                struct panfrost_shader_job *);
+                        return job;
+                }
+        }
+
+        return NULL;
+}
+
+static void
+panfrost_free_shader_job(struct panfrost_shader_job *job)
+{
+        util_queue_fence_wait(&job->fence);
+        util_queue_fence_destroy(&job->fence);
+        util_dynarray_fini(&job->res.binary);
+        FREE(job);
+}
+
+static bool
+pan_blend_factor_is_src1(enum blend_factor factor)
+{
+        return factor == BLEND_FACTOR_SRC1_COLOR ||
+               factor == BLEND_FACTOR_SRC1_ALPHA;
+}
+
+/* Whether a render target would need a blend shader that the fragment shader
+ * can replace. Blend constants would have to be keyed too, and dual-source
+ * blending needs the second colour in the blend, so skip those. The store
+ * is done by fixed-function, so the format must be blendable. */
+
+static bool
+panfrost_can_fuse_blend(const struct panfrost_blend_state *so, unsigned rt,
+                        enum pipe_format format)
+{
+        const struct pan_blend_info info = so->info[rt];
+        const struct pan_blend_equation eq = so->pan.rts[rt].equation;
+
+        return info.enabled && !info.fixed_function && !info.opaque &&
+               !info.constant_mask &&
+               panfrost_blendable_formats_v7[format].internal &&
+               !pan_blend_factor_is_src1(eq.rgb_src_factor) &&
+               !pan_blend_factor_is_src1(eq.rgb_dst_factor) &&
+               !pan_blend_factor_is_src1(eq.alpha_src_factor) &&
+               !pan_blend_factor_is_src1(eq.alpha_dst_factor);
+}
+
 static void
 panfrost_build_key(struct panfrost_context *ctx,
                    struct panfrost_shader_key *key,
                    const nir_shader *nir)
 {
-        /* We don't currently have vertex shader variants */
+        /* Vertex shaders are only keyed for the attributes they fetch */
+        if (nir->info.stage == MESA_SHADER_VERTEX) {
+                key->vs.fetch = ctx->vertex_fetch;
+                return;
+        }
+
         if (nir->info.stage != MESA_SHADER_FRAGMENT)
                return;
 
@@ -187,6 +438,11 @@ panfrost_build_key(struct panfrost_context *ctx,
         struct pipe_rasterizer_state *rast = (void *) ctx->rasterizer;
         struct panfrost_uncompiled_shader *vs = ctx->uncompiled[MESA_SHADER_VERTEX];
 
+        /* With a geometry shader, the fragment shader is linked with the
+         * vertex shader loading the vertices it emits */
+        if (ctx->uncompiled[MESA_SHADER_GEOMETRY])
+                vs = ctx->uncompiled[MESA_SHADER_GEOMETRY]->gs_vs;
+
         /* gl_FragColor lowering needs the number of colour buffers */
         if (nir->info.outputs_written & BITFIELD_BIT(FRAG_RESULT_COLOR)) {
                 key->fs.nr_cbufs_for_fragcolor = fb->nr_cbufs;
@@ -216,10 +472,71 @@ panfrost_build_key(struct panfrost_context *ctx,
                 }
         }
 
+        /* Colour math for 8-bit UNORM render targets is safe to run at half
+         * precision on Valhall, which executes fp16 as vec2. Only key the
+         * render targets the shader writes to limit variants. */
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
+
+        if (dev->arch >= 9 && screen->fp16_color &&
+            !(dev->debug & PAN_DBG_NOFP16)) {
+                uint8_t written = nir->info.outputs_written >> FRAG_RESULT_DATA0;
+
+                if (nir->info.outputs_written & BITFIELD_BIT(FRAG_RESULT_COLOR))
+                        written = BITFIELD_MASK(8);
+
+                for (unsigned i = 0; i < fb->nr_cbufs; ++i) {
+                        if (!fb->cbufs[i] || !(written & BITFIELD_BIT(i)))
+                                continue;
+
+                        enum pipe_format fmt = fb->cbufs[i]->format;
+
+                        if (util_format_is_unorm8(util_format_description(fmt)) &&
+                            !util_format_is_srgb(fmt))
+                                key->fs.fp16_rt_mask |= BITFIELD_BIT(i);
+                }
+        }
+
+        /* Logic ops run in the fragment shader on Valhall, which then stores
+         * with a replace equation. They only apply to normalized formats
+         * here, integer formats still need a blend shader to store. This must
+         * match panfrost_get_blend. */
+        if (dev->arch >= 9 && ctx->blend && ctx->blend->base.logicop_enable) {
+                key->fs.logicop_enable = true;
+                key->fs.logicop_func = ctx->blend->base.logicop_func;
+
+                for (unsigned i = 0; i < fb->nr_cbufs; ++i) {
+                        if (!fb->cbufs[i])
+                                continue;
+
+                        enum pipe_format fmt = fb->cbufs[i]->format;
+
+                        if (panfrost_logicop_in_shader(fmt))
+                                key->fs.rt_formats[i] = fmt;
+                }
+        } else if (dev->arch >= 9 && panfrost_blend_keys_fs(ctx->blend) &&
+                   !nir->info.fs.color_is_dual_source) {
+                /* Likewise, fold stable blend states that need blend shaders
+                 * into the fragment shader, see panfrost_get_blend */
+                for (unsigned i = 0; i < fb->nr_cbufs; ++i) {
+                        if (!fb->cbufs[i] || i >= ctx->blend->pan.rt_count)
+                                continue;
+
+                        enum pipe_format fmt = fb->cbufs[i]->format;
+
+                        if (!panfrost_can_fuse_blend(ctx->blend, i, fmt))
+                                continue;
+
+                        key->fs.rt_formats[i] = fmt;
+                        key->fs.blend[i] = ctx->blend->pan.rts[i].equation;
+                        key->fs.blend_in_shader |= BITFIELD_BIT(i);
+                }
+        }
+
         /* Funny desktop GL varying lowering on Valhall */
         if (dev->arch >= 9) {
                 assert(vs != NULL && "too early");
                 key->fs.fixed_varying_mask = vs->fixed_varying_mask;
+                key->fs.fp16_varying_mask = vs->fp16_varying_mask;
         }
 }
 
@@ -262,12 +579,76 @@ update_so_info(struct pipe_stream_output_info *so_info,
 	return so_outputs;
 }
 
+static bool
+panfrost_key_is_used(struct panfrost_uncompiled_shader *uncompiled,
+                     const struct panfrost_shader_key *key)
+{
+        util_dynarray_foreach(&uncompiled->used_keys, struct panfrost_shader_key, it) {
+                if (memcmp(key, it, sizeof(*key)) == 0)
+                        return true;
+        }
+
+        return false;
+}
+
+/* Record that a variant was used, so it can be prefetched the next time the
+ * shader is created */
+
+static void
+panfrost_record_variant_locked(struct panfrost_screen *screen,
+                               struct panfrost_uncompiled_shader *uncompiled,
+                               const struct panfrost_shader_key *key)
+{
+        if (!screen->disk_cache || panfrost_key_is_used(uncompiled, key) ||
+            util_dynarray_num_elements(&uncompiled->used_keys,
+                                       struct panfrost_shader_key) >=
+            PAN_MAX_RECORDED_VARIANTS)
+                return;
+
+        util_dynarray_append(&uncompiled->used_keys,
+                             struct panfrost_shader_key, *key);
+
+        panfrost_disk_cache_store_keys(screen->disk_cache, uncompiled,
+                                       &uncompiled->used_keys);
+}
+
+/* Slots accessed by the compiled shader, after any lowering, to size the
+ * varying buffer of a draw */
+
+static uint64_t
+panfrost_varying_mask(const struct pan_shader_info *info, gl_shader_stage stage)
+{
+        const struct pan_shader_varying *varyings;
+        unsigned count;
+        uint64_t mask = 0;
+
+        if (stage == MESA_SHADER_VERTEX) {
+                varyings = info->varyings.output;
+                count = info->varyings.output_count;
+        } else if (stage == MESA_SHADER_FRAGMENT) {
+                varyings = info->varyings.input;
+                count = info->varyings.input_count;
+        } else {
+                return 0;
+        }
+
+        for (unsigned i = 0; i < count; ++i) {
+                if (varyings[i].format != PIPE_FORMAT_NONE)
+                        mask |= BITFIELD64_BIT(varyings[i].location);
+        }
+
+        return mask & ~(VARYING_BIT_POS | VARYING_BIT_PSIZ);
+}
+
 static struct panfrost_compiled_shader *
 panfrost_new_variant_locked(
         struct panfrost_context *ctx,
+        struct panfrost_pool *desc_pool,
         struct panfrost_uncompiled_shader *uncompiled,
         struct panfrost_shader_key *key)
 {
+        struct panfrost_shader_job *job =
+                panfrost_take_pending_variant_locked(uncompiled, key);
         struct panfrost_compiled_shader *prog = panfrost_alloc_variant(uncompiled);
 
         *prog = (struct panfrost_compiled_shader) {
@@ -275,8 +656,16 @@ panfrost_new_variant_locked(
                 .stream_output = uncompiled->stream_output,
         };
 
-        panfrost_shader_get(ctx->base.screen, &ctx->shaders, &ctx->descs,
-                            uncompiled, &ctx->base.debug, prog, 0);
+        if (job) {
+                /* Only block if the worker hasn't got to it yet */
+                util_queue_fence_wait(&job->fence);
+                panfrost_shader_upload(ctx->base.screen, desc_pool,
+                                       uncompiled, prog, &job->res);
+                panfrost_free_shader_job(job);
+        } else {
+                panfrost_shader_get(ctx->base.screen, desc_pool,
+                                    uncompiled, &ctx->base.debug, prog, 0);
+        }
 
         /* Fixup the stream out information */
         prog->so_mask =
@@ -284,10 +673,93 @@ panfrost_new_variant_locked(
                                prog->info.outputs_written);
 
         prog->earlyzs = pan_earlyzs_analyze(&prog->info);
+        prog->varying_mask = panfrost_varying_mask(&prog->info,
+                                                   uncompiled->nir->info.stage);
+
+        panfrost_record_variant_locked(pan_screen(ctx->base.screen),
+                                       uncompiled, key);
 
         return prog;
 }
 
+/* Queue the compile of a variant. Falls back to compiling it right away when
+ * there are no worker threads, which only happens when creating the CSO. This
+ * doesn't take the lock, so callers either hold it or are creating the CSO,
+ * which nothing else sees yet. */
+
+static void
+panfrost_queue_variant(struct panfrost_context *ctx,
+                       struct panfrost_uncompiled_shader *uncompiled,
+                       struct panfrost_shader_key *key)
+{
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
+
+        if (!util_queue_is_initialized(&screen->shader_queue)) {
+                simple_mtx_lock(&ctx->cso_descs.lock);
+                panfrost_new_variant_locked(ctx, &ctx->cso_descs.pool,
+                                            uncompiled, key);
+                simple_mtx_unlock(&ctx->cso_descs.lock);
+                return;
+        }
+
+        struct panfrost_shader_job *job = CALLOC_STRUCT(panfrost_shader_job);
+
+        job->screen = screen;
+        job->uncompiled = uncompiled;
+        job->key = *key;
+
+        if (ctx->base.debug.debug_message && ctx->base.debug.async) {
+                job->debug = ctx->base.debug;
+                job->has_debug = true;
+        }
+
+        util_queue_fence_init(&job->fence);
+        util_dynarray_append(&uncompiled->pending,
+                             struct panfrost_shader_job *, job);
+
+        util_queue_add_job(&screen->shader_queue, job, &job->fence,
+                           panfrost_shader_job_execute, NULL, 0);
+}
+
+/* Queue the variants used by a previous run of the application, as recorded
+ * in the disk cache, other than the default variant which is already queued.
+ * The binaries are usually found in the disk cache, so this mostly prefetches
+ * them from disk, and a later draw doesn't stall on a missing variant. */
+
+static void
+panfrost_prefetch_variants(struct panfrost_context *ctx,
+                           struct panfrost_uncompiled_shader *uncompiled,
+                           const struct panfrost_shader_key *default_key)
+{
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
+
+        /* Compiling every variant up front would only slow down shader
+         * creation without worker threads */
+        if (!screen->disk_cache ||
+            !util_queue_is_initialized(&screen->shader_queue))
+                return;
+
+        panfrost_disk_cache_retrieve_keys(screen->disk_cache, uncompiled,
+                                          &uncompiled->used_keys);
+
+        util_dynarray_foreach(&uncompiled->used_keys, struct panfrost_shader_key, key) {
+                if (memcmp(key, default_key, sizeof(*key)) == 0)
+                        continue;
+
+                /* Fused blending variants are capped */
+                if (uncompiled->nir->info.stage == MESA_SHADER_FRAGMENT &&
+                    key->fs.blend_in_shader) {
+                        if (uncompiled->nr_fused_variants >=
+                            PAN_MAX_FUSED_BLEND_VARIANTS)
+                                continue;
+
+                        uncompiled->nr_fused_variants++;
+                }
+
+                panfrost_queue_variant(ctx, uncompiled, key);
+        }
+}
+
 static void
 panfrost_bind_shader_state(
         struct pipe_context *pctx,
@@ -305,6 +777,53 @@ panfrost_bind_shader_state(
                 panfrost_update_shader_variant(ctx, type);
 }
 
+static struct panfrost_compiled_shader *
+panfrost_find_variant_locked(struct panfrost_uncompiled_shader *uncompiled,
+                             const struct panfrost_shader_key *key)
+{
+        util_dynarray_foreach(&uncompiled->variants, struct panfrost_compiled_shader, so) {
+                if (memcmp(key, &so->key, sizeof(*key)) == 0)
+                        return so;
+        }
+
+        return NULL;
+}
+
+/* Whether a fused blending variant, which isn't compiled yet, can be used
+ * without waiting. Otherwise, queue its compile if there is room for another
+ * fused variant, and rekey at the next draw to check on it. */
+
+static bool
+panfrost_fused_variant_ready_locked(struct panfrost_context *ctx,
+                                    struct panfrost_uncompiled_shader *uncompiled,
+                                    struct panfrost_shader_key *key)
+{
+        struct panfrost_screen *screen = pan_screen(ctx->base.screen);
+
+        util_dynarray_foreach(&uncompiled->pending, struct panfrost_shader_job *, it) {
+                if (memcmp(key, &(*it)->key, sizeof(*key)) == 0) {
+                        if (util_queue_fence_is_signalled(&(*it)->fence))
+                                return true;
+
+                        ctx->fs_blend_rekey = true;
+                        return false;
+                }
+        }
+
+        if (uncompiled->nr_fused_variants >= PAN_MAX_FUSED_BLEND_VARIANTS)
+                return false;
+
+        uncompiled->nr_fused_variants++;
+
+        /* Without worker threads, there is nothing to wait for */
+        if (!util_queue_is_initialized(&screen->shader_queue))
+                return true;
+
+        panfrost_queue_variant(ctx, uncompiled, key);
+        ctx->fs_blend_rekey = true;
+        return false;
+}
+
 void
 panfrost_update_shader_variant(struct panfrost_context *ctx,
                                enum pipe_shader_type type)
@@ -321,6 +840,11 @@ panfrost_update_shader_variant(struct panfrost_context *ctx,
         if (!ctx->uncompiled[type])
                 return;
 
+        /* Geometry shaders are keyed at draw time, see
+         * panfrost_update_gs_variant */
+        if (type == PIPE_SHADER_GEOMETRY)
+                return;
+
         /* Match the appropriate variant */
         struct panfrost_uncompiled_shader *uncompiled = ctx->uncompiled[type];
         struct panfrost_compiled_shader *compiled = NULL;
@@ -330,15 +854,25 @@ panfrost_update_shader_variant(struct panfrost_context *ctx,
         struct panfrost_shader_key key = { 0 };
         panfrost_build_key(ctx, &key, uncompiled->nir);
 
-        util_dynarray_foreach(&uncompiled->variants, struct panfrost_compiled_shader, so) {
-                if (memcmp(&key, &so->key, sizeof(key)) == 0) {
-                        compiled = so;
-                        break;
+        compiled = panfrost_find_variant_locked(uncompiled, &key);
+
+        /* Fusing blending is only an optimization, so rather than stall on
+         * the compile, keep using blend shaders until the variant is ready */
+        if (compiled == NULL && type == PIPE_SHADER_FRAGMENT &&
+            key.fs.blend_in_shader &&
+            !panfrost_fused_variant_ready_locked(ctx, uncompiled, &key)) {
+                u_foreach_bit(i, key.fs.blend_in_shader) {
+                        key.fs.rt_formats[i] = PIPE_FORMAT_NONE;
+                        key.fs.blend[i] = (struct pan_blend_equation) { 0 };
                 }
+
+                key.fs.blend_in_shader = 0;
+                compiled = panfrost_find_variant_locked(uncompiled, &key);
         }
 
         if (compiled == NULL)
-                compiled = panfrost_new_variant_locked(ctx, uncompiled, &key);
+                compiled = panfrost_new_variant_locked(ctx, &ctx->descs,
+                                                       uncompiled, &key);
 
         ctx->prog[type] = compiled;
 
@@ -348,6 +882,157 @@ panfrost_update_shader_variant(struct panfrost_context *ctx,
         simple_mtx_unlock(&uncompiled->lock);
 }
 
+/* Rekey the fragment shader for the blend state on Valhall, dirtying the
+ * state derived from the shader if the variant changes */
+
+void
+panfrost_update_fs_for_blend(struct panfrost_context *ctx)
+{
+        struct panfrost_compiled_shader *old = ctx->prog[PIPE_SHADER_FRAGMENT];
+
+        panfrost_update_shader_variant(ctx, PIPE_SHADER_FRAGMENT);
+
+        if (ctx->prog[PIPE_SHADER_FRAGMENT] != old) {
+                ctx->dirty |= PAN_DIRTY_TLS_SIZE | PAN_DIRTY_BLEND;
+                ctx->dirty_shader[PIPE_SHADER_FRAGMENT] |= PAN_DIRTY_STAGE_SHADER;
+        }
+}
+
+/* Rekey the vertex shader for the attributes it fetches itself on Valhall,
+ * dirtying the state derived from the shader if the variant changes */
+
+void
+panfrost_update_vs_for_fetch(struct panfrost_context *ctx)
+{
+        struct panfrost_compiled_shader *old = ctx->prog[PIPE_SHADER_VERTEX];
+
+        panfrost_update_shader_variant(ctx, PIPE_SHADER_VERTEX);
+
+        if (ctx->prog[PIPE_SHADER_VERTEX] != old) {
+                ctx->dirty |= PAN_DIRTY_TLS_SIZE;
+                ctx->dirty_shader[PIPE_SHADER_VERTEX] |= PAN_DIRTY_STAGE_SHADER;
+        }
+}
+
+/* The transform feedback program must fetch the same attributes as the bound
+ * vertex shader variant. Those are kept apart from the regular variants, which
+ * the bound variant points into. */
+
+struct panfrost_compiled_shader *
+panfrost_get_xfb_variant(struct panfrost_context *ctx,
+                         struct panfrost_uncompiled_shader *uncompiled)
+{
+        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+
+        if (!vs->key.vs.fetch.mask)
+                return uncompiled->xfb;
+
+        struct panfrost_compiled_shader *xfb = NULL;
+
+        simple_mtx_lock(&uncompiled->lock);
+
+        util_dynarray_foreach(&uncompiled->xfb_variants,
+                              struct panfrost_compiled_shader *, it) {
+                if (memcmp(&(*it)->key.vs.fetch, &vs->key.vs.fetch,
+                           sizeof(vs->key.vs.fetch)) == 0) {
+                        xfb = *it;
+                        break;
+                }
+        }
+
+        if (!xfb) {
+                xfb = calloc(1, sizeof(struct panfrost_compiled_shader));
+                xfb->key = vs->key;
+                xfb->key.vs.is_xfb = true;
+
+                simple_mtx_lock(&ctx->cso_descs.lock);
+                panfrost_shader_get(ctx->base.screen, &ctx->cso_descs.pool,
+                                    uncompiled, &ctx->base.debug, xfb, 0);
+                simple_mtx_unlock(&ctx->cso_descs.lock);
+
+                util_dynarray_append(&uncompiled->xfb_variants,
+                                     struct panfrost_compiled_shader *, xfb);
+        }
+
+        simple_mtx_unlock(&uncompiled->lock);
+        return xfb;
+}
+
+/* Likewise, the program feeding an emulated geometry shader fetches the same
+ * attributes as the bound variant, and is also keyed for the varyings the
+ * geometry shader reads */
+
+struct panfrost_compiled_shader *
+panfrost_get_gs_vs_variant(struct panfrost_context *ctx,
+                           struct panfrost_uncompiled_shader *uncompiled,
+                           uint64_t gs_inputs)
+{
+        struct panfrost_compiled_shader *vs = ctx->prog[PIPE_SHADER_VERTEX];
+        struct panfrost_compiled_shader *variant = NULL;
+
+        struct panfrost_shader_key key = vs->key;
+        key.vs.gs_inputs = gs_inputs;
+
+        simple_mtx_lock(&uncompiled->lock);
+
+        util_dynarray_foreach(&uncompiled->gs_vs_variants,
+                              struct panfrost_compiled_shader *, it) {
+                if (memcmp(&(*it)->key, &key, sizeof(key)) == 0) {
+                        variant = *it;
+                        break;
+                }
+        }
+
+        if (!variant) {
+                variant = calloc(1, sizeof(struct panfrost_compiled_shader));
+                variant->key = key;
+
+                simple_mtx_lock(&ctx->cso_descs.lock);
+                panfrost_shader_get(ctx->base.screen, &ctx->cso_descs.pool,
+                                    uncompiled, &ctx->base.debug, variant, 0);
+                simple_mtx_unlock(&ctx->cso_descs.lock);
+
+                util_dynarray_append(&uncompiled->gs_vs_variants,
+                                     struct panfrost_compiled_shader *, variant);
+        }
+
+        simple_mtx_unlock(&uncompiled->lock);
+        return variant;
+}
+
+/* Geometry shaders read their input vertices according to the primitive type
+ * of the draw, so they are keyed for it, rather than for state */
+
+void
+panfrost_update_gs_variant(struct panfrost_context *ctx,
+                           enum pipe_prim_type topology)
+{
+        struct panfrost_uncompiled_shader *uncompiled =
+                ctx->uncompiled[PIPE_SHADER_GEOMETRY];
+        struct panfrost_compiled_shader *old = ctx->prog[PIPE_SHADER_GEOMETRY];
+
+        if (old && old->key.gs.topology == topology)
+                return;
+
+        struct panfrost_shader_key key = { 0 };
+        key.gs.topology = topology;
+
+        simple_mtx_lock(&uncompiled->lock);
+
+        struct panfrost_compiled_shader *compiled =
+                panfrost_find_variant_locked(uncompiled, &key);
+
+        if (compiled == NULL)
+                compiled = panfrost_new_variant_locked(ctx, &ctx->descs,
+                                                       uncompiled, &key);
+
+        ctx->prog[PIPE_SHADER_GEOMETRY] = compiled;
+        simple_mtx_unlock(&uncompiled->lock);
+
+        ctx->dirty |= PAN_DIRTY_TLS_SIZE;
+        ctx->dirty_shader[PIPE_SHADER_GEOMETRY] |= PAN_DIRTY_STAGE_SHADER;
+}
+
 static void
 panfrost_bind_vs_state(struct pipe_context *pctx, void *hwcso)
 {
@@ -364,6 +1049,177 @@ panfrost_bind_fs_state(struct pipe_context *pctx, void *hwcso)
         panfrost_bind_shader_state(pctx, hwcso, PIPE_SHADER_FRAGMENT);
 }
 
+static void
+panfrost_bind_gs_state(struct pipe_context *pctx, void *hwcso)
+{
+        panfrost_bind_shader_state(pctx, hwcso, PIPE_SHADER_GEOMETRY);
+
+        /* The fragment shader is linked with the passthrough vertex shader of
+         * the geometry shader, see panfrost_build_key */
+        struct panfrost_context *ctx = pan_context(pctx);
+        panfrost_update_shader_variant(ctx, PIPE_SHADER_FRAGMENT);
+}
+
+static bool
+panfrost_position_source(nir_ssa_scalar s, int *attrib, int8_t *comp,
+                         float *constant)
+{
+        if (nir_ssa_scalar_is_const(s)) {
+                *comp = -1;
+                *constant = nir_ssa_scalar_as_float(s);
+                return true;
+        }
+
+        if (s.def->parent_instr->type != nir_instr_type_intrinsic)
+                return false;
+
+        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(s.def->parent_instr);
+        int location;
+
+        if (intr->intrinsic == nir_intrinsic_load_deref) {
+                nir_deref_instr *deref = nir_src_as_deref(intr->src[0]);
+                nir_variable *var = nir_deref_instr_get_variable(deref);
+
+                if (!var || deref->deref_type != nir_deref_type_var ||
+                    var->data.mode != nir_var_shader_in ||
+                    glsl_get_base_type(var->type) != GLSL_TYPE_FLOAT)
+                        return false;
+
+                location = var->data.driver_location;
+                *comp = s.comp + var->data.location_frac;
+        } else if (intr->intrinsic == nir_intrinsic_load_input) {
+                if (!nir_src_is_const(intr->src[0]) ||
+                    nir_src_as_uint(intr->src[0]) != 0 ||
+                    nir_intrinsic_dest_type(intr) != nir_type_float32)
+                        return false;
+
+                location = nir_intrinsic_base(intr);
+                *comp = s.comp + nir_intrinsic_component(intr);
+        } else {
+                return false;
+        }
+
+        /* All components have to come from the same attribute */
+        if (*attrib >= 0 && *attrib != location)
+                return false;
+
+        *attrib = location;
+        return true;
+}
+
+static bool
+panfrost_is_position_store(nir_intrinsic_instr *intr, nir_ssa_def **value)
+{
+        if (intr->intrinsic == nir_intrinsic_store_deref) {
+                nir_deref_instr *deref = nir_src_as_deref(intr->src[0]);
+                nir_variable *var = nir_deref_instr_get_variable(deref);
+
+                if (!var || var->data.mode != nir_var_shader_out ||
+                    var->data.location != VARYING_SLOT_POS)
+                        return false;
+
+                *value = (deref->deref_type == nir_deref_type_var &&
+                          nir_intrinsic_write_mask(intr) == 0xf) ?
+                         intr->src[1].ssa : NULL;
+                return true;
+        } else if (intr->intrinsic == nir_intrinsic_store_output) {
+                if (nir_intrinsic_io_semantics(intr).location != VARYING_SLOT_POS)
+                        return false;
+
+                *value = (nir_src_is_const(intr->src[1]) &&
+                          nir_src_as_uint(intr->src[1]) == 0 &&
+                          nir_intrinsic_component(intr) == 0 &&
+                          nir_intrinsic_write_mask(intr) == 0xf) ?
+                         intr->src[0].ssa : NULL;
+                return true;
+        }
+
+        return false;
+}
+
+/* Look for vertex shaders writing gl_Position exactly once, unconditionally,
+ * from a vertex attribute and constants. This is how blits, cursors and
+ * compositors with pre-transformed vertices tend to look. */
+
+static void
+panfrost_analyze_position(struct panfrost_uncompiled_shader *so)
+{
+        nir_function_impl *impl = nir_shader_get_entrypoint(so->nir);
+        nir_ssa_def *value = NULL;
+        unsigned stores = 0;
+
+        if (so->nir->info.outputs_written & VARYING_BIT_PSIZ)
+                return;
+
+        nir_foreach_block(block, impl) {
+                nir_foreach_instr(instr, block) {
+                        if (instr->type != nir_instr_type_intrinsic)
+                                continue;
+
+                        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+                        nir_ssa_def *v;
+
+                        if (!panfrost_is_position_store(intr, &v))
+                                continue;
+
+                        if (block->cf_node.parent != &impl->cf_node)
+                                return;
+
+                        value = v;
+                        stores++;
+                }
+        }
+
+        if (stores != 1 || !value || value->bit_size != 32)
+                return;
+
+        int attrib = -1;
+
+        for (unsigned c = 0; c < 4; ++c) {
+                /* Depth does not affect the screen-space bounds */
+                if (c == 2)
+                        continue;
+
+                if (!panfrost_position_source(nir_ssa_scalar_resolved(value, c),
+                                              &attrib, &so->position.comp[c],
+                                              &so->position.constant[c]))
+                        return;
+        }
+
+        so->position.attrib = MAX2(attrib, 0);
+        so->position.valid = true;
+}
+
+/* On Valhall, mediump float varyings are stored at half precision, taking 8
+ * bytes of the varying buffer instead of 16. Only whole slots with a single
+ * vector can be stored this way, so indirect access keeps 16 byte strides.
+ * The mask must match what nir_lower_mediump_io will lower in the backend. */
+
+static uint32_t
+panfrost_fp16_varying_mask(nir_shader *nir)
+{
+        uint32_t mask = 0, reject = 0;
+
+        nir_foreach_shader_out_variable(var, nir) {
+                if (var->data.location < VARYING_SLOT_VAR0 ||
+                    var->data.location > VARYING_SLOT_VAR31)
+                        continue;
+
+                unsigned index = var->data.location - VARYING_SLOT_VAR0;
+                unsigned slots = glsl_count_attribute_slots(var->type, false);
+                bool mediump = var->data.precision == GLSL_PRECISION_MEDIUM ||
+                               var->data.precision == GLSL_PRECISION_LOW;
+
+                if (mediump && glsl_type_is_vector_or_scalar(var->type) &&
+                    glsl_get_base_type(var->type) == GLSL_TYPE_FLOAT)
+                        mask |= BITFIELD_BIT(index);
+                else
+                        reject |= BITFIELD_RANGE(index, MIN2(slots, 32 - index));
+        }
+
+        return mask & ~reject;
+}
+
 static void *
 panfrost_create_shader_state(
         struct pipe_context *pctx,
@@ -373,7 +1229,8 @@ panfrost_create_shader_state(
                           tgsi_to_nir(cso->tokens, pctx->screen, false) :
                           cso->ir.nir;
 
-        struct panfrost_uncompiled_shader *so = panfrost_alloc_shader(nir);
+        struct panfrost_uncompiled_shader *so =
+                panfrost_alloc_shader(pan_screen(pctx->screen), nir);
 
         /* The driver gets ownership of the nir_shader for graphics. The NIR is
          * ralloc'd. Free the NIR when we free the uncompiled shader.
@@ -388,6 +1245,27 @@ panfrost_create_shader_state(
                 so->fixed_varying_mask =
                         (so->nir->info.outputs_written & BITFIELD_MASK(VARYING_SLOT_VAR0)) &
                         ~VARYING_BIT_POS & ~VARYING_BIT_PSIZ;
+
+                if (pan_device(pctx->screen)->arch >= 9)
+                        so->fp16_varying_mask = panfrost_fp16_varying_mask(so->nir);
+
+                panfrost_analyze_position(so);
+        }
+
+        /* Geometry shaders run as compute kernels, and a vertex shader loads
+         * the vertices they emit for rasterization */
+        if (so->nir->info.stage == MESA_SHADER_GEOMETRY) {
+                const nir_shader_compiler_options *options =
+                        pctx->screen->get_compiler_options(pctx->screen,
+                                                           PIPE_SHADER_IR_NIR,
+                                                           PIPE_SHADER_VERTEX);
+
+                struct pipe_shader_state passthrough = {
+                        .type = PIPE_SHADER_IR_NIR,
+                        .ir.nir = pan_gs_passthrough_vs(so->nir, options),
+                };
+
+                so->gs_vs = panfrost_create_shader_state(pctx, &passthrough);
         }
 
         /* If this shader uses transform feedback, compile the transform
@@ -401,10 +1279,12 @@ panfrost_create_shader_state(
                 xfb->info.internal = true;
 
                 so->xfb = calloc(1, sizeof(struct panfrost_compiled_shader));
-                so->xfb->key.vs_is_xfb = true;
+                so->xfb->key.vs.is_xfb = true;
 
-                panfrost_shader_get(ctx->base.screen, &ctx->shaders, &ctx->descs,
+                simple_mtx_lock(&ctx->cso_descs.lock);
+                panfrost_shader_get(ctx->base.screen, &ctx->cso_descs.pool,
                                     so, &ctx->base.debug, so->xfb, 0);
+                simple_mtx_unlock(&ctx->cso_descs.lock);
 
                 /* Since transform feedback is handled via the transform
                  * feedback program, the original program no longer uses XFB
@@ -412,10 +1292,9 @@ panfrost_create_shader_state(
                 nir->info.has_transform_feedback_varyings = false;
         }
 
-        /* Compile the program. We don't use vertex shader keys, so there will
-         * be no further vertex shader variants. We do have fragment shader
-         * keys, but we can still compile with a default key that will work most
-         * of the time.
+        /* Compile the program with a default key that will work most of the
+         * time. Vertex shaders are only keyed for the attributes they fetch
+         * themselves, which is rare.
          */
         struct panfrost_shader_key key = { 0 };
 
@@ -432,11 +1311,17 @@ panfrost_create_shader_state(
                 key.fs.nr_cbufs_for_fragcolor = 1;
         }
 
-        /* Creating a CSO is single-threaded, so it's ok to use the
-         * locked function without explicitly taking the lock. Creating a
-         * default variant acts as a precompile.
+        /* Geometry shaders are mostly drawn with lists of their input type */
+        if (so->nir->info.stage == MESA_SHADER_GEOMETRY)
+                key.gs.topology = so->nir->info.gs.input_primitive;
+
+        /* Creating a default variant acts as a precompile. It is compiled in
+         * the background, so the application can keep creating shaders and
+         * only waits if it draws with the variant before it is ready.
          */
-        panfrost_new_variant_locked(ctx, so, &key);
+        panfrost_queue_variant(ctx, so, &key);
+
+        panfrost_prefetch_variants(ctx, so, &key);
 
         return so;
 }
@@ -444,21 +1329,42 @@ panfrost_create_shader_state(
 static void
 panfrost_delete_shader_state(struct pipe_context *pctx, void *so)
 {
+        struct panfrost_screen *screen = pan_screen(pctx->screen);
         struct panfrost_uncompiled_shader *cso = (struct panfrost_uncompiled_shader *) so;
 
+        util_dynarray_foreach(&cso->pending, struct panfrost_shader_job *, job)
+                panfrost_free_shader_job(*job);
+
         util_dynarray_foreach(&cso->variants, struct panfrost_compiled_shader, so) {
-                panfrost_bo_unreference(so->bin.bo);
+                panfrost_shader_bin_release(screen, so->shared_bin);
                 panfrost_bo_unreference(so->state.bo);
                 panfrost_bo_unreference(so->linkage.bo);
         }
 
         if (cso->xfb) {
-                panfrost_bo_unreference(cso->xfb->bin.bo);
+                panfrost_shader_bin_release(screen, cso->xfb->shared_bin);
                 panfrost_bo_unreference(cso->xfb->state.bo);
                 panfrost_bo_unreference(cso->xfb->linkage.bo);
                 free(cso->xfb);
         }
 
+        util_dynarray_foreach(&cso->xfb_variants, struct panfrost_compiled_shader *, xfb) {
+                panfrost_shader_bin_release(screen, (*xfb)->shared_bin);
+                panfrost_bo_unreference((*xfb)->state.bo);
+                panfrost_bo_unreference((*xfb)->linkage.bo);
+                free(*xfb);
+        }
+
+        util_dynarray_foreach(&cso->gs_vs_variants, struct panfrost_compiled_shader *, v) {
+                panfrost_shader_bin_release(screen, (*v)->shared_bin);
+                panfrost_bo_unreference((*v)->state.bo);
+                panfrost_bo_unreference((*v)->linkage.bo);
+                free(*v);
+        }
+
+        if (cso->gs_vs)
+                panfrost_delete_shader_state(pctx, cso->gs_vs);
+
         simple_mtx_destroy(&cso->lock);
 
         ralloc_free(so);
@@ -474,14 +1380,17 @@ panfrost_create_compute_state(
         const struct pipe_compute_state *cso)
 {
         struct panfrost_context *ctx = pan_context(pctx);
-        struct panfrost_uncompiled_shader *so = panfrost_alloc_shader(cso->prog);
+        struct panfrost_uncompiled_shader *so =
+                panfrost_alloc_shader(pan_screen(pctx->screen), cso->prog);
         struct panfrost_compiled_shader *v = panfrost_alloc_variant(so);
         memset(v, 0, sizeof *v);
 
         assert(cso->ir_type == PIPE_SHADER_IR_NIR && "TGSI kernels unsupported");
 
-        panfrost_shader_get(pctx->screen, &ctx->shaders, &ctx->descs,
+        simple_mtx_lock(&ctx->cso_descs.lock);
+        panfrost_shader_get(pctx->screen, &ctx->cso_descs.pool,
                             so, &ctx->base.debug, v, cso->static_shared_mem);
+        simple_mtx_unlock(&ctx->cso_descs.lock);
 
         /* The NIR becomes invalid after this. For compute kernels, we never
          * need to access it again. Don't keep a dangling pointer around.
@@ -503,6 +1412,84 @@ panfrost_bind_compute_state(struct pipe_context *pipe, void *cso)
                 uncompiled ? util_dynarray_begin(&uncompiled->variants) : NULL;
 }
 
+static void
+panfrost_set_max_shader_compiler_threads(struct pipe_screen *pscreen,
+                                         unsigned max_threads)
+{
+        struct panfrost_screen *screen = pan_screen(pscreen);
+
+        if (util_queue_is_initialized(&screen->shader_queue))
+                util_queue_adjust_num_threads(&screen->shader_queue, max_threads);
+}
+
+static bool
+panfrost_is_parallel_shader_compilation_finished(struct pipe_screen *pscreen,
+                                                 void *hwcso,
+                                                 enum pipe_shader_type type)
+{
+        struct panfrost_uncompiled_shader *so = hwcso;
+        bool finished = true;
+
+        simple_mtx_lock(&so->lock);
+
+        util_dynarray_foreach(&so->pending, struct panfrost_shader_job *, job)
+                finished &= util_queue_fence_is_signalled(&(*job)->fence);
+
+        simple_mtx_unlock(&so->lock);
+        return finished;
+}
+
+void
+panfrost_shader_screen_init(struct panfrost_screen *screen)
+{
+        unsigned nr_cpus = util_get_cpu_caps()->nr_cpus;
+
+        /* Allow for a worker per core, so loading screens compiling hundreds
+         * of shaders can use the whole CPU. Threads are only spawned as the
+         * queue fills up, and the application may lower the count through
+         * KHR_parallel_shader_compile. */
+        if (nr_cpus > 1) {
+                util_queue_init(&screen->shader_queue, "pan_shader", 64,
+                                nr_cpus,
+                                UTIL_QUEUE_INIT_RESIZE_IF_FULL |
+                                UTIL_QUEUE_INIT_SCALE_THREADS |
+                                UTIL_QUEUE_INIT_USE_MINIMUM_PRIORITY |
+                                UTIL_QUEUE_INIT_SET_FULL_THREAD_AFFINITY,
+                                NULL);
+        }
+
+        simple_mtx_init(&screen->shader_bins.lock, mtx_plain);
+        panfrost_pool_init(&screen->shader_bins.pool, NULL, &screen->dev,
+                           PAN_BO_EXECUTE, 4096, "Shaders", true, false);
+        screen->shader_bins.bins =
+                _mesa_hash_table_create(NULL, panfrost_shader_bin_hash,
+                                        panfrost_shader_bin_equal);
+
+        screen->base.set_max_shader_compiler_threads =
+                panfrost_set_max_shader_compiler_threads;
+        screen->base.is_parallel_shader_compilation_finished =
+                panfrost_is_parallel_shader_compilation_finished;
+}
+
+void
+panfrost_shader_screen_destroy(struct panfrost_screen *screen)
+{
+        if (util_queue_is_initialized(&screen->shader_queue))
+                util_queue_destroy(&screen->shader_queue);
+
+        /* Shaders leaked by the application still hold binaries */
+        hash_table_foreach(screen->shader_bins.bins, he) {
+                struct panfrost_shader_bin *bin = he->data;
+
+                panfrost_bo_unreference(bin->ref.bo);
+                FREE(bin);
+        }
+
+        _mesa_hash_table_destroy(screen->shader_bins.bins, NULL);
+        panfrost_pool_cleanup(&screen->shader_bins.pool);
+        simple_mtx_destroy(&screen->shader_bins.lock);
+}
+
 void
 panfrost_shader_context_init(struct pipe_context *pctx)
 {
@@ -514,6 +1501,10 @@ panfrost_shader_context_init(struct pipe_context *pctx)
         pctx->delete_fs_state = panfrost_delete_shader_state;
         pctx->bind_fs_state = panfrost_bind_fs_state;
 
+        pctx->create_gs_state = panfrost_create_shader_state;
+        pctx->delete_gs_state = panfrost_delete_shader_state;
+        pctx->bind_gs_state = panfrost_bind_gs_state;
+
         pctx->create_compute_state = panfrost_create_compute_state;
         pctx->bind_compute_state = panfrost_bind_compute_state;
         pctx->delete_compute_state = panfrost_delete_shader_state;
@@ -0,0 +1,136 @@
+#
+# Copyright (C) 2023 Collabora, Ltd.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the "Software"),
+# to deal in the Software without restriction, including without limitation
+# the rights to use, copy, modify, merge, publish, distribute, sublicense,
+# and/or sell copies of the Software, and to permit persons to whom the
+# Software is furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice (including the next
+# paragraph) shall be included in all copies or substantial portions of the
+# Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+# IN THE SOFTWARE.
+#
+
+import argparse
+import sys
+
+parser = argparse.ArgumentParser()
+parser.add_argument('-p', '--import-path', required=True)
+parser.add_argument('-C', '--src', required=True)
+parser.add_argument('-H', '--hdr', required=True)
+args = parser.parse_args()
+sys.path.insert(0, args.import_path)
+
+
+from u_trace import Header
+from u_trace import Tracepoint
+from u_trace import TracepointArg
+from u_trace import utrace_generate
+
+# Tracepoints enabled unless PAN_GPU_TRACEPOINT says otherwise. Timestamps
+# are written by the CSF queues, so each tracepoint costs a few instructions
+# in the command stream of its batch.
+pan_default_tps = []
+
+Header('util/u_dump.h')
+
+
+def begin_end_tp(name, args=[], end_args=[], tp_print=None,
+                 end_tp_print=None, tp_default_enabled=True):
+    global pan_default_tps
+    if tp_default_enabled:
+        pan_default_tps.append(name)
+    Tracepoint('start_{0}'.format(name),
+               toggle_name=name,
+               args=args,
+               tp_perfetto='panfrost_start_{0}'.format(name),
+               tp_print=tp_print)
+    Tracepoint('end_{0}'.format(name),
+               toggle_name=name,
+               args=end_args,
+               tp_perfetto='panfrost_end_{0}'.format(name),
+               tp_print=end_tp_print,
+               end_of_pipe=True)
+
+
+def singular_tp(name, args=[], tp_print=None, tp_default_enabled=True):
+    global pan_default_tps
+    if tp_default_enabled:
+        pan_default_tps.append(name)
+    Tracepoint(name,
+               toggle_name=name,
+               args=args,
+               tp_print=tp_print)
+
+
+# The whole batch, from the first command on the vertex queue to the end of
+# the fragment job. The end carries the reason the batch was flushed, and the
+# buffers drawn, cleared and preloaded from memory as PIPE_CLEAR_* masks.
+begin_end_tp('batch',
+    args=[TracepointArg(type='uint32_t', var='seqnum',   c_format='%u'),
+          TracepointArg(type='uint16_t', var='width',    c_format='%u'),
+          TracepointArg(type='uint16_t', var='height',   c_format='%u'),
+          TracepointArg(type='uint8_t',  var='nr_cbufs', c_format='%u')],
+    end_args=[TracepointArg(type='const char *', var='reason',  c_format='%s'),
+              TracepointArg(type='uint16_t',     var='draws',   c_format='0x%x'),
+              TracepointArg(type='uint16_t',     var='clear',   c_format='0x%x'),
+              TracepointArg(type='uint16_t',     var='preload', c_format='0x%x')],
+    tp_print=['seqnum=%u, %ux%u, cbufs=%u', '__entry->seqnum',
+        '__entry->width', '__entry->height', '__entry->nr_cbufs'],
+    end_tp_print=['reason=%s, draws=0x%x, clear=0x%x, preload=0x%x',
+        '__entry->reason', '__entry->draws', '__entry->clear',
+        '__entry->preload'],
+)
+
+# Rectangles drawn by u_blitter, for blits, clears with a quad and the
+# blits of modifier conversions. op says which, detail is the reason for
+# conversions.
+begin_end_tp('blitter',
+    args=[TracepointArg(type='const char *', var='op',     c_format='%s'),
+          TracepointArg(type='const char *', var='detail', c_format='%s'),
+          TracepointArg(type='uint16_t',     var='width',  c_format='%u'),
+          TracepointArg(type='uint16_t',     var='height', c_format='%u')],
+    tp_print=['%s%s%s, %ux%u', '__entry->op',
+        '__entry->detail[0] ? ": " : ""', '__entry->detail',
+        '__entry->width', '__entry->height'],
+)
+
+begin_end_tp('compute',
+    args=[TracepointArg(type='uint32_t', var='x', c_format='%u'),
+          TracepointArg(type='uint32_t', var='y', c_format='%u'),
+          TracepointArg(type='uint32_t', var='z', c_format='%u')],
+    tp_print=['grid=%ux%ux%u', '__entry->x', '__entry->y', '__entry->z'],
+)
+
+# Clears folded into the batch, which cost nothing on the GPU
+singular_tp('clear',
+    args=[TracepointArg(type='uint16_t', var='buffers', c_format='0x%x')],
+    tp_print=['buffers=0x%x', '__entry->buffers'],
+)
+
+# Every draw stores a timestamp, which keeps consecutive draws from being
+# merged, so these are only recorded when asked for.
+singular_tp('draw',
+    args=[TracepointArg(type='enum pipe_prim_type', var='mode', c_format='%s', to_prim_type='util_str_prim_mode({}, true)'),
+          TracepointArg(type='uint32_t', var='count',     c_format='%u'),
+          TracepointArg(type='uint32_t', var='instances', c_format='%u')],
+    tp_print=['%s, count=%u, instances=%u', 'util_str_prim_mode(__entry->mode, true)',
+        '__entry->count', '__entry->instances'],
+    tp_default_enabled=False,
+)
+
+utrace_generate(cpath=args.src,
+                hpath=args.hdr,
+                ctx_param='struct pipe_context *pctx',
+                trace_toggle_name='pan_gpu_tracepoint',
+                trace_toggle_defaults=pan_default_tps)
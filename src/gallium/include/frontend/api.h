@@ -237,6 +237,7 @@ struct st_config_options
    bool force_gl_map_buffer_synchronized;
    bool transcode_etc;
    bool transcode_astc;
+   bool transcode_cache;
    char *force_gl_vendor;
    char *force_gl_renderer;
    char *mesa_extension_override;
@@ -28,9 +28,12 @@
 #include <stdbool.h>
 
 struct pipe_screen;
+struct pipe_screen_config;
 struct renderonly;
 
-struct pipe_screen *panfrost_drm_screen_create(int drmFD);
-struct pipe_screen *panfrost_drm_screen_create_renderonly(struct renderonly *ro);
+struct pipe_screen *panfrost_drm_screen_create(int drmFD,
+                                               const struct pipe_screen_config *config);
+struct pipe_screen *panfrost_drm_screen_create_renderonly(struct renderonly *ro,
+                                                          const struct pipe_screen_config *config);
 
 #endif /* __PAN_DRM_PUBLIC_H__ */
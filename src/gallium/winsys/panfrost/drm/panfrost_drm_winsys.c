@@ -23,6 +23,7 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 
@@ -111,14 +112,20 @@ free_scanout:
 }
 
 struct pipe_screen *
-panfrost_drm_screen_create(int fd)
+panfrost_drm_screen_create(int fd, const struct pipe_screen_config *config)
 {
-   return panfrost_create_screen(os_dupfd_cloexec(fd), NULL);
+   /* With KBASE_NOOP, the device only has to be found, e.g. through
+    * drm-shim, and submissions go to the kbase noop backend */
+   if (getenv("KBASE_NOOP"))
+      return panfrost_create_screen(-1, config, NULL);
+
+   return panfrost_create_screen(os_dupfd_cloexec(fd), config, NULL);
 }
 
 struct pipe_screen *
-panfrost_drm_screen_create_renderonly(struct renderonly *ro)
+panfrost_drm_screen_create_renderonly(struct renderonly *ro,
+                                      const struct pipe_screen_config *config)
 {
    ro->create_for_resource = panfrost_create_kms_dumb_buffer_for_resource;
-   return panfrost_create_screen(os_dupfd_cloexec(ro->gpu_fd), ro);
+   return panfrost_create_screen(os_dupfd_cloexec(ro->gpu_fd), config, ro);
 }
@@ -78,6 +78,8 @@
 #include "util/u_sampler.h"
 #include "util/u_math.h"
 #include "util/u_box.h"
+#include "util/disk_cache.h"
+#include "util/mesa-sha1.h"
 #include "util/u_memory.h"
 #include "util/u_simple_shaders.h"
 #include "cso_cache/cso_context.h"
@@ -541,6 +543,146 @@ st_MapTextureImage(struct gl_context *ctx,
 }
 
 
+/**
+ * Decompress a compressed fallback image into an uncompressed format.
+ */
+static void
+compressed_fallback_decompress(struct gl_texture_image *texImage,
+                               const struct st_texture_image_transfer *itransfer,
+                               GLubyte *dst, unsigned dst_stride,
+                               unsigned width, unsigned height)
+{
+   if (texImage->TexFormat == MESA_FORMAT_ETC1_RGB8) {
+      _mesa_etc1_unpack_rgba8888(dst, dst_stride,
+                                 itransfer->temp_data,
+                                 itransfer->temp_stride,
+                                 width, height);
+   } else if (_mesa_is_format_etc2(texImage->TexFormat)) {
+      bool bgra = texImage->pt->format == PIPE_FORMAT_B8G8R8A8_SRGB;
+
+      _mesa_unpack_etc2_format(dst, dst_stride,
+                               itransfer->temp_data,
+                               itransfer->temp_stride,
+                               width, height,
+                               texImage->TexFormat,
+                               bgra);
+   } else if (_mesa_is_format_astc_2d(texImage->TexFormat)) {
+      _mesa_unpack_astc_2d_ldr(dst, dst_stride,
+                               itransfer->temp_data,
+                               itransfer->temp_stride,
+                               width, height,
+                               texImage->TexFormat);
+   } else if (_mesa_is_format_s3tc(texImage->TexFormat)) {
+      _mesa_unpack_s3tc(dst, dst_stride,
+                        itransfer->temp_data,
+                        itransfer->temp_stride,
+                        width, height,
+                        texImage->TexFormat);
+   } else if (_mesa_is_format_rgtc(texImage->TexFormat) ||
+              _mesa_is_format_latc(texImage->TexFormat)) {
+      _mesa_unpack_rgtc(dst, dst_stride,
+                        itransfer->temp_data,
+                        itransfer->temp_stride,
+                        width, height,
+                        texImage->TexFormat);
+   } else if (_mesa_is_format_bptc(texImage->TexFormat)) {
+      _mesa_unpack_bptc(dst, dst_stride,
+                        itransfer->temp_data,
+                        itransfer->temp_stride,
+                        width, height,
+                        texImage->TexFormat);
+   } else {
+      unreachable("unexpected format for a compressed format fallback");
+   }
+}
+
+
+/**
+ * Like compressed_fallback_decompress, but keeps the result in the disk
+ * cache with the transcode_cache option, keyed by the compressed data.
+ * Decompressing ASTC in particular is slow, and applications tend to load
+ * the same textures every time they run.
+ */
+static void
+compressed_fallback_decompress_cached(struct st_context *st,
+                                      struct gl_texture_image *texImage,
+                                      const struct st_texture_image_transfer *itransfer,
+                                      GLubyte *dst, unsigned dst_stride,
+                                      unsigned width, unsigned height)
+{
+   struct disk_cache *cache = st->ctx->Cache;
+
+   /* Hashing isn't worth it for small images */
+   if (!st->transcode_cache || !cache || width * height < 64 * 64) {
+      compressed_fallback_decompress(texImage, itransfer, dst, dst_stride,
+                                     width, height);
+      return;
+   }
+
+   unsigned blk_w, blk_h;
+   _mesa_get_format_block_size(texImage->TexFormat, &blk_w, &blk_h);
+
+   unsigned row_size = DIV_ROUND_UP(width, blk_w) *
+                       _mesa_get_format_bytes(texImage->TexFormat);
+   unsigned rows = DIV_ROUND_UP(height, blk_h);
+
+   struct {
+      char tag[8];
+      uint32_t src_format, dst_format, width, height;
+      unsigned char sha1[SHA1_DIGEST_LENGTH];
+   } desc = {
+      .tag = "st-dec",
+      .src_format = texImage->TexFormat,
+      .dst_format = texImage->pt->format,
+      .width = width,
+      .height = height,
+   };
+
+   struct mesa_sha1 ctx;
+   _mesa_sha1_init(&ctx);
+
+   for (unsigned y = 0; y < rows; y++)
+      _mesa_sha1_update(&ctx, itransfer->temp_data + y * itransfer->temp_stride,
+                        row_size);
+
+   _mesa_sha1_final(&ctx, desc.sha1);
+
+   cache_key key;
+   disk_cache_compute_key(cache, &desc, sizeof(desc), key);
+
+   unsigned stride = util_format_get_stride(texImage->pt->format, width);
+   size_t size = (size_t)stride * height;
+   size_t cached_size = 0;
+   GLubyte *data = disk_cache_get(cache, key, &cached_size);
+
+   if (data && cached_size != size) {
+      free(data);
+      data = NULL;
+   }
+
+   if (!data) {
+      data = malloc(size);
+
+      if (!data) {
+         compressed_fallback_decompress(texImage, itransfer, dst, dst_stride,
+                                        width, height);
+         return;
+      }
+
+      compressed_fallback_decompress(texImage, itransfer, data, stride,
+                                     width, height);
+
+      /* The cache copies the data and writes it from its own thread */
+      disk_cache_put(cache, key, data, size, NULL);
+   }
+
+   for (unsigned y = 0; y < height; y++)
+      memcpy(dst + y * dst_stride, data + y * stride, stride);
+
+   free(data);
+}
+
+
 void
 st_UnmapTextureImage(struct gl_context *ctx,
                      struct gl_texture_image *texImage,
@@ -621,50 +763,10 @@ st_UnmapTextureImage(struct gl_context *ctx,
                            GL_UNSIGNED_BYTE, tmp, &pack);
             free(tmp);
          } else {
-            /* Decompress into an uncompressed format. */
-            if (texImage->TexFormat == MESA_FORMAT_ETC1_RGB8) {
-               _mesa_etc1_unpack_rgba8888(map, transfer->stride,
-                                          itransfer->temp_data,
-                                          itransfer->temp_stride,
-                                          transfer->box.width,
-                                          transfer->box.height);
-            } else if (_mesa_is_format_etc2(texImage->TexFormat)) {
-               bool bgra = texImage->pt->format == PIPE_FORMAT_B8G8R8A8_SRGB;
-
-               _mesa_unpack_etc2_format(map, transfer->stride,
-                                        itransfer->temp_data,
-                                        itransfer->temp_stride,
-                                        transfer->box.width, transfer->box.height,
-                                        texImage->TexFormat,
-                                        bgra);
-            } else if (_mesa_is_format_astc_2d(texImage->TexFormat)) {
-               _mesa_unpack_astc_2d_ldr(map, transfer->stride,
-                                        itransfer->temp_data,
-                                        itransfer->temp_stride,
-                                        transfer->box.width, transfer->box.height,
-                                        texImage->TexFormat);
-            } else if (_mesa_is_format_s3tc(texImage->TexFormat)) {
-               _mesa_unpack_s3tc(map, transfer->stride,
-                                 itransfer->temp_data,
-                                 itransfer->temp_stride,
-                                 transfer->box.width, transfer->box.height,
-                                 texImage->TexFormat);
-            } else if (_mesa_is_format_rgtc(texImage->TexFormat) ||
-                       _mesa_is_format_latc(texImage->TexFormat)) {
-               _mesa_unpack_rgtc(map, transfer->stride,
-                                 itransfer->temp_data,
-                                 itransfer->temp_stride,
-                                 transfer->box.width, transfer->box.height,
-                                 texImage->TexFormat);
-            } else if (_mesa_is_format_bptc(texImage->TexFormat)) {
-               _mesa_unpack_bptc(map, transfer->stride,
-                                 itransfer->temp_data,
-                                 itransfer->temp_stride,
-                                 transfer->box.width, transfer->box.height,
-                                 texImage->TexFormat);
-            } else {
-               unreachable("unexpected format for a compressed format fallback");
-            }
+            compressed_fallback_decompress_cached(st, texImage, itransfer,
+                                                  map, transfer->stride,
+                                                  transfer->box.width,
+                                                  transfer->box.height);
          }
 
          st_texture_image_unmap(st, texImage, slice);
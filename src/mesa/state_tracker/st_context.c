@@ -578,6 +578,7 @@ st_create_context_priv(struct gl_context *ctx, struct pipe_context *pipe,
                         screen->is_format_supported(screen, PIPE_FORMAT_DXT5_RGBA,
                                                     PIPE_TEXTURE_2D, 0, 0,
                                                     PIPE_BIND_SAMPLER_VIEW);
+   st->transcode_cache = options->transcode_cache;
    st->has_astc_2d_ldr =
       screen->is_format_supported(screen, PIPE_FORMAT_ASTC_4x4_SRGB,
                                   PIPE_TEXTURE_2D, 0, 0, PIPE_BIND_SAMPLER_VIEW);
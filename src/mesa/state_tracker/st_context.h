@@ -141,6 +141,7 @@ struct st_context
    boolean has_etc2;
    boolean transcode_etc;
    boolean transcode_astc;
+   boolean transcode_cache;
    boolean has_astc_2d_ldr;
    boolean has_astc_5x5_ldr;
    boolean has_s3tc;
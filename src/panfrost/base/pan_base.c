@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -32,11 +33,16 @@
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 #include <poll.h>
 #include <pthread.h>
 
+#include "util/futex.h"
 #include "util/macros.h"
+#include "util/u_atomic.h"
+#include "util/u_debug.h"
 #include "pan_base.h"
 
 #include "mali_kbase_ioctl.h"
@@ -67,6 +73,141 @@ kbase_open(kbase k, int fd, unsigned cs_queue_count, bool verbose)
         return false;
 }
 
+/* The properties only change when the kernel driver is reloaded, which
+ * needs a reboot on most systems, so they are keyed on the device number and
+ * the boot ID. Set PAN_GPUPROPS_CACHE=0 to always query them. */
+#define KBASE_GPUPROPS_CACHE_MAGIC 0x50504b50 /* PKPP */
+#define KBASE_GPUPROPS_CACHE_MAX 65536
+
+struct kbase_gpuprops_cache {
+        uint32_t magic;
+        uint32_t api;
+        uint32_t size;
+        char boot_id[40];
+};
+
+static bool
+kbase_gpuprops_cache_path(kbase k, char *path, size_t size, bool create)
+{
+        struct stat st;
+
+        if (!debug_get_bool_option("PAN_GPUPROPS_CACHE", true) ||
+            k->fd == -1 || fstat(k->fd, &st) == -1 || !S_ISCHR(st.st_mode))
+                return false;
+
+        const char *xdg = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        int len;
+
+        if (xdg && xdg[0] == '/')
+                len = snprintf(path, size, "%s", xdg);
+        else if (home && home[0] == '/')
+                len = snprintf(path, size, "%s/.cache", home);
+        else
+                return false;
+
+        if (len >= size - 64)
+                return false;
+
+        if (create)
+                mkdir(path, 0755);
+
+        len += snprintf(path + len, size - len, "/panfrost");
+
+        if (create)
+                mkdir(path, 0755);
+
+        len += snprintf(path + len, size - len, "/kbase-%u-%u",
+                        major(st.st_rdev), minor(st.st_rdev));
+        return len < size;
+}
+
+static bool
+kbase_gpuprops_cache_key(kbase k, struct kbase_gpuprops_cache *key)
+{
+        *key = (struct kbase_gpuprops_cache) {
+                .magic = KBASE_GPUPROPS_CACHE_MAGIC,
+                .api = k->api,
+                .size = k->gpuprops_size,
+        };
+
+        int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return false;
+
+        ssize_t len = read(fd, key->boot_id, sizeof(key->boot_id) - 1);
+        close(fd);
+
+        return len > 0;
+}
+
+bool
+kbase_gpuprops_cache_load(kbase k)
+{
+        char path[PATH_MAX];
+        struct kbase_gpuprops_cache key, header;
+
+        if (!kbase_gpuprops_cache_path(k, path, sizeof(path), false) ||
+            !kbase_gpuprops_cache_key(k, &key))
+                return false;
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+                return false;
+
+        bool ok = false;
+
+        if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+            header.magic != key.magic || header.api != key.api ||
+            memcmp(header.boot_id, key.boot_id, sizeof(key.boot_id)) ||
+            !header.size || header.size > KBASE_GPUPROPS_CACHE_MAX)
+                goto out;
+
+        void *props = malloc(header.size);
+        if (!props)
+                goto out;
+
+        if (read(fd, props, header.size) != header.size) {
+                free(props);
+                goto out;
+        }
+
+        k->gpuprops = props;
+        k->gpuprops_size = header.size;
+        ok = true;
+
+out:
+        close(fd);
+        return ok;
+}
+
+void
+kbase_gpuprops_cache_store(kbase k)
+{
+        char path[PATH_MAX], tmp[PATH_MAX + 16];
+        struct kbase_gpuprops_cache key;
+
+        if (!k->gpuprops_size ||
+            !kbase_gpuprops_cache_path(k, path, sizeof(path), true) ||
+            !kbase_gpuprops_cache_key(k, &key))
+                return;
+
+        /* Write then rename, so other processes never see part of it */
+        snprintf(tmp, sizeof(tmp), "%s.%i", path, getpid());
+
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1)
+                return;
+
+        bool ok = write(fd, &key, sizeof(key)) == sizeof(key) &&
+                write(fd, k->gpuprops, k->gpuprops_size) == k->gpuprops_size;
+
+        close(fd);
+
+        if (!ok || rename(tmp, path) == -1)
+                unlink(tmp);
+}
+
 /* If fd != -1, ownership is passed in */
 int
 kbase_alloc_gem_handle_locked(kbase k, base_va va, int fd)
@@ -163,7 +304,7 @@ kbase_wait_bo(kbase k, int handle, int64_t timeout_ns, bool wait_readers)
                         return -1;
                 }
                 kbase_handle *ptr = util_dynarray_element(&k->gem_handles, kbase_handle, handle);
-                if (!ptr->use_count) {
+                if (!(wait_readers ? ptr->use_count : ptr->write_count)) {
                         pthread_mutex_unlock(&k->handle_lock);
                         kbase_wait_fini(wait);
                         return 0;
@@ -179,9 +320,15 @@ kbase_wait_bo(kbase k, int handle, int64_t timeout_ns, bool wait_readers)
 static void
 adjust_time(struct timespec *tp, int64_t ns)
 {
-        ns += tp->tv_nsec;
-        tp->tv_nsec = ns % 1000000000;
+        /* Split the seconds off first, so that huge timeouts such as
+         * INT64_MAX don't overflow when adding tv_nsec */
         tp->tv_sec += ns / 1000000000;
+        tp->tv_nsec += ns % 1000000000;
+
+        if (tp->tv_nsec >= 1000000000) {
+                tp->tv_nsec -= 1000000000;
+                ++tp->tv_sec;
+        }
 }
 
 static int64_t
@@ -222,11 +369,53 @@ kbase_wait_init(kbase k, int64_t timeout_ns)
         };
 }
 
+#if UTIL_FUTEX_SUPPORTED
+/* With the event thread running, sleep until it has handled events again
+ * instead of reading them from this thread */
+static bool
+kbase_wait_for_event_thread(struct kbase_wait_ctx *ctx)
+{
+        kbase k = ctx->k;
+
+        /* The sequence number is read before the caller checks its
+         * condition, so that events handled in between are not missed */
+        if (!ctx->started) {
+                ctx->seq = p_atomic_read(&k->event_seq);
+                ctx->started = true;
+                return true;
+        }
+
+        p_atomic_inc(&k->event_waiters);
+        int ret = futex_wait(&k->event_seq, ctx->seq, &ctx->until);
+        p_atomic_dec(&k->event_waiters);
+
+        if (ret == -1 && errno == ETIMEDOUT) {
+                /* The thread might not have got to the last events yet,
+                 * which matters most for zero timeouts. Check once more
+                 * after handling them here. */
+                if (ctx->flushed)
+                        return false;
+
+                ctx->flushed = true;
+                kbase_flush_events(k);
+                return true;
+        }
+
+        ctx->seq = p_atomic_read(&k->event_seq);
+        return true;
+}
+#endif
+
 bool
 kbase_wait_for_event(struct kbase_wait_ctx *ctx)
 {
         kbase k = ctx->k;
 
+#if UTIL_FUTEX_SUPPORTED
+        if (k->event_thread_running)
+                return kbase_wait_for_event_thread(ctx);
+#endif
+
         /* Return instantly the first time so that a check outside the
          * wait_for_Event loop is not required */
         if (!ctx->has_cnd_lock) {
@@ -266,7 +455,7 @@ kbase_wait_fini(struct kbase_wait_ctx ctx)
 }
 
 void
-kbase_ensure_handle_events(kbase k)
+kbase_flush_events(kbase k)
 {
         /* If we don't manage to take the lock, then events have recently/will
          * soon be handled, there is no need to do anything. */
@@ -277,6 +466,16 @@ kbase_ensure_handle_events(kbase k)
         }
 }
 
+void
+kbase_ensure_handle_events(kbase k)
+{
+        /* The event thread handles them soon enough */
+        if (k->event_thread_running)
+                return;
+
+        kbase_flush_events(k);
+}
+
 bool
 kbase_poll_fd_until(int fd, bool wait_shared, struct timespec tp)
 {
@@ -25,11 +25,19 @@
 #ifndef PAN_BASE_H
 #define PAN_BASE_H
 
+#include "util/bitset.h"
 #include "util/u_dynarray.h"
 #include "util/list.h"
 
 #define PAN_EVENT_SIZE 16
 
+/* Event slots are allocated in chunks which never move, as threads sleep on
+ * the futexes of the slots. The event memory of the slots is reserved for
+ * the maximum up front, so that its addresses stay valid, but it is only
+ * backed a page at a time. */
+#define KBASE_EVENT_SLOT_CHUNK 64
+#define KBASE_MAX_EVENT_SLOTS 4096
+
 typedef uint64_t base_va;
 struct base_ptr {
         void *cpu;
@@ -51,18 +59,69 @@ struct kbase_event_slot {
         struct kbase_sync_link **back;
         uint64_t last_submit;
         uint64_t last;
+
+        /* Incremented whenever last changes. Threads sleeping on it are
+         * woken only if waiters is non-zero. */
+        uint32_t futex;
+        uint32_t waiters;
+};
+
+/* Tiler heaps are handed out to batches in turn, so that the vertex work of
+ * one batch can overlap with fragment work using another heap */
+#define KBASE_MAX_TILER_HEAPS 3
+
+struct kbase_tiler_heap {
+        base_va va;
+        base_va header;
+        /* Chunk counts the heap was created with, kept when the context
+         * is recreated */
+        unsigned initial_chunks;
+        unsigned max_chunks;
+};
+
+/* Scheduling priority of the queue group of a context */
+enum kbase_context_priority {
+        KBASE_CONTEXT_PRIORITY_LOW,
+        KBASE_CONTEXT_PRIORITY_MEDIUM,
+        KBASE_CONTEXT_PRIORITY_HIGH,
+};
+
+/* A queue group, which contexts with the same priority and core mask may
+ * share, so that fewer of the firmware's CSG slots are needed */
+struct kbase_group {
+        struct list_head link;
+        uint8_t handle;
+        uint32_t uid;
+        enum kbase_context_priority priority;
+        uint64_t core_mask;
+        /* Bit n is set while a context uses the queues starting at
+         * n * cs_queue_count */
+        uint32_t sets;
+        unsigned max_sets;
+        /* Set once the group faulted, so that no context joins it */
+        bool dead;
 };
 
 struct kbase_context {
         uint8_t csg_handle;
         uint8_t kcpu_queue;
         bool kcpu_init; // TODO: Always create a queue?
+        /* Fence waits not yet enqueued, merged into one sync file, or -1 */
+        int kcpu_fence;
         uint32_t csg_uid;
         unsigned num_csi;
+        /* The group of the context, and its first queue index there */
+        struct kbase_group *group;
+        unsigned csi_base;
+
+        /* Kept when the context is recreated */
+        enum kbase_context_priority priority;
+        /* Shader cores the fragment and compute work may run on */
+        uint64_t core_mask;
 
         unsigned tiler_heap_chunk_size;
-        base_va tiler_heap_va;
-        base_va tiler_heap_header;
+        unsigned num_tiler_heaps;
+        struct kbase_tiler_heap tiler_heaps[KBASE_MAX_TILER_HEAPS];
 };
 
 struct kbase_cs {
@@ -81,14 +140,44 @@ struct kbase_cs {
 
 #define KBASE_SLOT_COUNT 2
 
+/* How an atom accesses a BO, for implicit sync on job manager GPUs */
+#define KBASE_ACCESS_READ (1 << 0)
+#define KBASE_ACCESS_WRITE (1 << 1)
+
 typedef struct {
         base_va va;
         int fd;
+        /* Atoms in flight using the BO, and how many of them write it */
         uint8_t use_count;
-        /* For emulating implicit sync. TODO make this work on v10 */
-        uint8_t last_access[KBASE_SLOT_COUNT];
+        uint8_t write_count;
+        /* For emulating implicit sync. TODO make this work on v10
+         *
+         * The last atom writing the BO, and the last atom on each slot
+         * reading it since, only meaningful while those atoms are in
+         * flight. */
+        uint8_t last_write;
+        uint8_t last_write_slot;
+        uint8_t last_read[KBASE_SLOT_COUNT];
 } kbase_handle;
 
+/* An atom in flight on a job manager GPU. The arrays are kept when the
+ * atom number is reused, so that submission doesn't allocate. */
+struct kbase_atom {
+        bool pending;
+        unsigned num_handles;
+        unsigned capacity;
+        int32_t *handles;
+        uint8_t *access;
+        base_va *extres;
+};
+
+/* Atoms built by submit but not submitted yet, so that several can go
+ * through a single KBASE_IOCTL_JOB_SUBMIT. Kept around, so that it only
+ * allocates until it has grown to the largest flush. */
+struct kbase_atom_queue {
+        struct util_dynarray atoms;
+};
+
 struct kbase_;
 typedef struct kbase_ *kbase;
 
@@ -99,9 +188,14 @@ struct kbase_ {
         int fd;
         unsigned api;
         unsigned page_size;
-        // TODO: Actually we may want to try to pack multiple contexts / queue
-        // "sets" into a single group...
         unsigned cs_queue_count;
+        /* How many contexts may share a queue group, set by the driver
+         * before creating contexts. Zero or one gives each its own. */
+        unsigned contexts_per_group;
+        /* CSG slots of the firmware and queues per group, zero if the
+         * interface couldn't be queried */
+        unsigned csg_slots;
+        unsigned csg_streams;
 
         /* Must not hold handle_lock while acquiring event_read_lock */
         pthread_mutex_t handle_lock;
@@ -110,25 +204,83 @@ struct kbase_ {
         pthread_cond_t event_cnd;
         /* TODO: Per-context/queue locks? */
         pthread_mutex_t queue_lock;
+        pthread_mutex_t group_lock;
+
+        /* Queue groups in use, and the most there ever were at once. With
+         * more groups than CSG slots, the scheduler has to evict groups to
+         * run the others. */
+        struct list_head groups;
+        unsigned group_count;
+        unsigned group_peak;
+        /* How many groups were created while all slots were taken, and
+         * how often a group was reported for not making progress */
+        uint64_t group_oversubscribed;
+        uint64_t group_timeouts;
 
         struct list_head syncobjs;
+        /* Destroyed syncobjs, reused by later creates */
+        struct list_head syncobj_cache;
 
         unsigned gpuprops_size;
         void *gpuprops;
 
+        /* Rate of the GPU timestamp in Hz, or zero if it can't be read */
+        uint64_t timestamp_freq;
+
         void *tracking_region;
         void *csf_user_reg;
+        /* The event memory of slot n is at n * PAN_EVENT_SIZE in both
+         * ranges, event_mem_size bytes of which are backed */
         struct base_ptr event_mem;
         struct base_ptr kcpu_event_mem;
-        // TODO: dynamically size
-        struct kbase_event_slot event_slots[256];
-        // TODO: USe a bitset?
+        size_t event_mem_size;
+        struct kbase_event_slot *event_slot_chunks[KBASE_MAX_EVENT_SLOTS /
+                                                   KBASE_EVENT_SLOT_CHUNK];
+        /* Slots bound to a queue, freed slots are reused first */
+        BITSET_DECLARE(event_slots_used, KBASE_MAX_EVENT_SLOTS);
+        /* Slots below this have been allocated, only ever increases */
         unsigned event_slot_usage;
 
+        /* On CSF, events are read by a thread of their own, which wakes
+         * threads sleeping on the futexes of the slots that progressed,
+         * rather than every waiter polling the device. */
+        bool event_thread_running;
+        bool event_thread_stop;
+        /* Set while the thread sleeps without a timeout because the GPU
+         * was idle, a submission has to wake it through event_thread_fd */
+        bool event_thread_idle;
+        pthread_t event_thread;
+        int event_thread_fd;
+        /* Incremented each time the thread has handled events */
+        uint32_t event_seq;
+        uint32_t event_waiters;
+
         uint8_t atom_number;
 
+        /* How often CS submission used the doorbell fast path, or had to
+         * fall back to the kick ioctl. Printed on close when verbose. */
+        uint64_t doorbell_count;
+        uint64_t kick_count;
+
+        /* How often a KCPU enqueue found the queue full */
+        uint64_t kcpu_stall_count;
+
+        /* The last fatal error reported for a queue group, kept for hang
+         * reports. csi is ~0 if the error was not for a single queue. */
+        struct {
+                uint64_t sideband;
+                uint32_t status;
+                uint8_t csg_handle;
+                unsigned csi;
+                bool valid;
+        } last_fault;
+
+        /* Tiler heap out-of-memory events, by queue group handle, so that
+         * the driver can grow the heaps of the context which ran out */
+        uint32_t tiler_oom[256];
+
         struct util_dynarray gem_handles;
-        struct util_dynarray atom_bos[256];
+        struct kbase_atom atoms[256];
         uint64_t job_seq;
 
         void (*close)(kbase k);
@@ -139,9 +291,31 @@ struct kbase_ {
         struct base_ptr (*alloc)(kbase k, size_t size,
                                  unsigned pan_flags,
                                  unsigned mali_flags);
+        /* Like alloc, but reserves va_size bytes of VA, and maps them on the
+         * CPU, while only backing the first size bytes. Not for executable
+         * or growable allocations. */
+        struct base_ptr (*alloc_reserve)(kbase k, size_t size, size_t va_size,
+                                         unsigned pan_flags,
+                                         unsigned mali_flags);
         void (*free)(kbase k, base_va va);
 
-        int (*import_dmabuf)(kbase k, int fd);
+        /* Change how much of an allocation from alloc_reserve is backed, in
+         * place. Returns false if the pages could not be allocated. */
+        bool (*mem_commit)(kbase k, base_va va, size_t size);
+
+        /* Mark a native allocation as (not) needed.  While evictable the
+         * kernel may reclaim the backing pages under memory pressure; making
+         * it unevictable again returns false if the backing could not be
+         * restored, in which case the allocation must be freed. */
+        bool (*mem_evictable)(kbase k, base_va va, bool evictable);
+
+        /* A GPU-only import doesn't allow CPU access, which protected
+         * buffers require, and only reserves the CPU VA it needs */
+        int (*import_dmabuf)(kbase k, int fd, bool gpu_only);
+        /* Returns a handle for application memory, with ptr and size
+         * page-aligned, or -1.
+         * NULL where imports of user memory are not supported. */
+        int (*import_user)(kbase k, void *ptr, size_t size);
         void *(*mmap_import)(kbase k, base_va va, size_t size);
 
         void (*cache_clean)(void *ptr, size_t size);
@@ -152,27 +326,60 @@ struct kbase_ {
         bool (*handle_events)(kbase k);
 
         /* <= v9 GPUs */
-        int (*submit)(kbase k, uint64_t va, unsigned req,
+        /* access has KBASE_ACCESS_* flags for each handle, or is NULL
+         * if every BO may be read and written. If q is not NULL, the atom
+         * is only added to it, and submitted by submit_queue, which must
+         * happen before waiting on o. */
+        int (*submit)(kbase k, struct kbase_atom_queue *q,
+                      uint64_t va, unsigned req,
                       struct kbase_syncobj *o,
-                      int32_t *handles, unsigned num_handles);
+                      int32_t *handles, const uint8_t *access,
+                      unsigned num_handles);
+        /* Submits the queued atoms in order, and empties the queue */
+        bool (*submit_queue)(kbase k, struct kbase_atom_queue *q);
 
         /* >= v10 GPUs */
-        struct kbase_context *(*context_create)(kbase k);
+        struct kbase_context *(*context_create)(kbase k,
+                                                enum kbase_context_priority priority,
+                                                uint64_t core_mask);
+        /* A context without a queue group, only usable for KCPU commands */
+        struct kbase_context *(*kcpu_context_create)(kbase k);
         void (*context_destroy)(kbase k, struct kbase_context *ctx);
         bool (*context_recreate)(kbase k, struct kbase_context *ctx);
+        /* Replaces an idle tiler heap with one using the given chunk
+         * counts. This changes its VA and first chunk. */
+        bool (*tiler_heap_recreate)(kbase k, struct kbase_context *ctx,
+                                    unsigned idx, unsigned initial_chunks,
+                                    unsigned max_chunks);
 
         // TODO: Pass in a priority?
         struct kbase_cs (*cs_bind)(kbase k, struct kbase_context *ctx,
                                    base_va va, unsigned size);
+        /* Terminates the queue, keeping its event slot for cs_rebind */
         void (*cs_term)(kbase k, struct kbase_cs *cs);
+        /* Terminates the queue for good, freeing its event slot */
+        void (*cs_free)(kbase k, struct kbase_cs *cs);
         void (*cs_rebind)(kbase k, struct kbase_cs *cs);
+        /* Moves an idle queue to a new ring buffer, with the insert and
+         * extract offsets starting back from zero */
+        bool (*cs_resize)(kbase k, struct kbase_cs *cs,
+                          base_va va, unsigned size);
+        /* Returns how far into the ring the GPU has read */
+        uint64_t (*cs_extract)(kbase k, struct kbase_cs *cs);
 
         bool (*cs_submit)(kbase k, struct kbase_cs *cs, uint64_t insert_offset,
                           struct kbase_syncobj *o, uint64_t seqnum);
+        /* Returns false on timeout, a zero timeout only polls */
         bool (*cs_wait)(kbase k, struct kbase_cs *cs, uint64_t extract_offset,
-                        struct kbase_syncobj *o);
+                        struct kbase_syncobj *o, int64_t timeout_ns);
+
+        /* Reads the current value of the timestamp stored by the GPU */
+        bool (*read_timestamp)(kbase k, uint64_t *timestamp);
 
         int (*kcpu_fence_export)(kbase k, struct kbase_context *ctx);
+        /* Returns a sync file signalled once every fence of o is reached */
+        int (*kcpu_syncobj_export)(kbase k, struct kbase_context *ctx,
+                                   struct kbase_syncobj *o);
         bool (*kcpu_fence_import)(kbase k, struct kbase_context *ctx, int fd);
 
         bool (*kcpu_cqs_set)(kbase k, struct kbase_context *ctx,
@@ -184,8 +391,17 @@ struct kbase_ {
         struct kbase_syncobj *(*syncobj_create)(kbase k);
         void (*syncobj_destroy)(kbase k, struct kbase_syncobj *o);
         struct kbase_syncobj *(*syncobj_dup)(kbase k, struct kbase_syncobj *o);
-        /* TODO: timeout? (and for cs_wait) */
-        bool (*syncobj_wait)(kbase k, struct kbase_syncobj *o);
+        /* Make the syncobj also wait for the point seqnum on an event slot */
+        void (*syncobj_add_point)(kbase k, struct kbase_syncobj *o,
+                                  unsigned slot, uint64_t seqnum);
+        /* Copies up to max of the points the syncobj still waits for, and
+         * returns how many there are */
+        unsigned (*syncobj_get_points)(kbase k, struct kbase_syncobj *o,
+                                       unsigned *slots, uint64_t *seqnums,
+                                       unsigned max);
+        /* Returns false on timeout, a zero timeout only polls */
+        bool (*syncobj_wait)(kbase k, struct kbase_syncobj *o,
+                             int64_t timeout_ns);
 
         /* Returns false if there are no active queues */
         bool (*callback_all_queues)(kbase k, int32_t *count,
@@ -197,12 +413,24 @@ struct kbase_ {
 
 bool kbase_open(kbase k, int fd, unsigned cs_queue_count, bool verbose);
 
+static inline struct kbase_event_slot *
+kbase_event_slot(kbase k, unsigned slot)
+{
+        return &k->event_slot_chunks[slot / KBASE_EVENT_SLOT_CHUNK]
+                                    [slot % KBASE_EVENT_SLOT_CHUNK];
+}
+
 /* Called from kbase_open */
 bool kbase_open_old(kbase k);
 bool kbase_open_new(kbase k);
 bool kbase_open_csf(kbase k);
 bool kbase_open_csf_noop(kbase k);
 
+/* GPU properties saved by an earlier process, so that they needn't be
+ * queried again. Loading fills in gpuprops and gpuprops_size. */
+bool kbase_gpuprops_cache_load(kbase k);
+void kbase_gpuprops_cache_store(kbase k);
+
 /* BO management */
 int kbase_alloc_gem_handle(kbase k, base_va va, int fd);
 int kbase_alloc_gem_handle_locked(kbase k, base_va va, int fd);
@@ -216,6 +444,11 @@ struct kbase_wait_ctx {
         struct timespec until;
         bool has_lock;
         bool has_cnd_lock;
+
+        /* Used instead of the locks while the event thread is running */
+        bool started;
+        bool flushed;
+        uint32_t seq;
 };
 
 struct kbase_wait_ctx kbase_wait_init(kbase k, int64_t timeout_ns);
@@ -224,6 +457,9 @@ bool kbase_wait_for_event(struct kbase_wait_ctx *ctx);
 void kbase_wait_fini(struct kbase_wait_ctx ctx);
 
 void kbase_ensure_handle_events(kbase k);
+/* Like kbase_ensure_handle_events, but also with the event thread running,
+ * for when the caller can't wait for the thread to catch up */
+void kbase_flush_events(kbase k);
 
 bool kbase_poll_fd_until(int fd, bool wait_shared, struct timespec tp);
 
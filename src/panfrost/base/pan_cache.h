@@ -26,42 +26,58 @@
 
 #ifdef __aarch64__
 
-static void
-cache_clean(volatile void *addr)
-{
-        __asm__ volatile ("dc cvac, %0" :: "r" (addr) : "memory");
-}
+/* The smallest data cache line size of any core, from CTR_EL0.DminLine,
+ * which is log2 of the number of words */
 
-static void
-cache_invalidate(volatile void *addr)
+static size_t
+cache_line_size(void)
 {
-        __asm__ volatile ("dc civac, %0" :: "r" (addr) : "memory");
-}
+        static size_t line_size;
 
-typedef void (*cacheline_op)(volatile void *addr);
+        if (!line_size) {
+                uint64_t ctr;
+                __asm__ volatile ("mrs %0, ctr_el0" : "=r" (ctr));
+                line_size = 4 << ((ctr >> 16) & 0xf);
+        }
 
-#define CACHELINE_SIZE 64
-
-static void
-cacheline_op_range(volatile void *start, size_t length, cacheline_op op)
-{
-        volatile void *ptr = (volatile void *)((uintptr_t) start & ~((uintptr_t) CACHELINE_SIZE - 1));
-        volatile void *end = (volatile void *) ALIGN_POT((uintptr_t) start + length, CACHELINE_SIZE);
-        for (; ptr < end; ptr += CACHELINE_SIZE)
-                op(ptr);
+        return line_size;
 }
 
+/* Issues a DC instruction for every line in the range, four lines per
+ * iteration. A macro rather than a function pointer so that the instruction
+ * is inlined into the loop. */
+
+#define CACHE_OP_RANGE(insn, start, length) do {                            \
+        uintptr_t line = cache_line_size();                                 \
+        uintptr_t ptr = (uintptr_t) (start) & ~(line - 1);                  \
+        uintptr_t end = ALIGN_POT((uintptr_t) (start) + (length), line);    \
+                                                                            \
+        for (; ptr + 4 * line <= end; ptr += 4 * line) {                    \
+                __asm__ volatile (insn ", %0\n\t"                           \
+                                  insn ", %1\n\t"                           \
+                                  insn ", %2\n\t"                           \
+                                  insn ", %3"                                \
+                                  :: "r" (ptr), "r" (ptr + line),           \
+                                     "r" (ptr + 2 * line),                  \
+                                     "r" (ptr + 3 * line)                   \
+                                  : "memory");                              \
+        }                                                                   \
+                                                                            \
+        for (; ptr < end; ptr += line)                                      \
+                __asm__ volatile (insn ", %0" :: "r" (ptr) : "memory");     \
+} while (0)
+
 static void
 cache_clean_range(volatile void *start, size_t length)
 {
         /* TODO: Do an invalidate at the start of the range? */
-        cacheline_op_range(start, length, cache_clean);
+        CACHE_OP_RANGE("dc cvac", start, length);
 }
 
 static void
 cache_invalidate_range(volatile void *start, size_t length)
 {
-        cacheline_op_range(start, length, cache_invalidate);
+        CACHE_OP_RANGE("dc civac", start, length);
 }
 
 #endif /* __aarch64__ */
@@ -31,6 +31,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
@@ -43,10 +45,16 @@
 #define RUNNING_ON_VALGRIND 0
 #endif
 
+#include "util/bitscan.h"
+#include "util/detect_arch.h"
+#include "util/futex.h"
 #include "util/macros.h"
 #include "util/list.h"
 #include "util/u_atomic.h"
+#include "util/u_math.h"
 #include "util/os_file.h"
+#include "util/libsync.h"
+#include "util/u_thread.h"
 
 #include "pan_base.h"
 #include "pan_cache.h"
@@ -242,6 +250,11 @@ munmap_tracking(kbase k)
 static bool
 get_gpuprops(kbase k)
 {
+        if (kbase_gpuprops_cache_load(k)) {
+                LOG("Using cached GPU properties\n");
+                return true;
+        }
+
         struct kbase_ioctl_get_gpuprops props = { 0 };
 
         int ret = kbase_ioctl(k->fd, KBASE_IOCTL_GET_GPUPROPS, &props);
@@ -265,13 +278,22 @@ get_gpuprops(kbase k)
                 return false;
         }
 
+        kbase_gpuprops_cache_store(k);
         return true;
 }
 #else
 static bool
 get_gpuprops(kbase k)
 {
-        k->gpuprops = calloc(1, sizeof(struct kbase_ioctl_gpu_props_reg_dump));
+        if (kbase_gpuprops_cache_load(k)) {
+                if (k->gpuprops_size == sizeof(struct kbase_ioctl_gpu_props_reg_dump))
+                        return true;
+
+                free(k->gpuprops);
+        }
+
+        k->gpuprops_size = sizeof(struct kbase_ioctl_gpu_props_reg_dump);
+        k->gpuprops = calloc(1, k->gpuprops_size);
 
         int ret = kbase_ioctl(k->fd, KBASE_IOCTL_GPU_PROPS_REG_DUMP, k->gpuprops);
         if (ret == -1) {
@@ -279,6 +301,7 @@ get_gpuprops(kbase k)
                 return false;
         }
 
+        kbase_gpuprops_cache_store(k);
         return true;
 }
 #endif
@@ -287,6 +310,7 @@ static bool
 free_gpuprops(kbase k)
 {
         free(k->gpuprops);
+        k->gpuprops = NULL;
         return true;
 }
 
@@ -313,6 +337,89 @@ munmap_user_reg(kbase k)
                 return munmap(k->csf_user_reg, k->page_size) == 0;
         return true;
 }
+
+static bool
+kbase_read_timeinfo(kbase k, uint64_t *timestamp, uint64_t *monotonic_ns)
+{
+        union kbase_ioctl_get_cpu_gpu_timeinfo info = {
+                .in.request_flags = BASE_TIMEINFO_TIMESTAMP_FLAG |
+                                    BASE_TIMEINFO_MONOTONIC_FLAG,
+        };
+
+        int ret = kbase_ioctl(k->fd, KBASE_IOCTL_GET_CPU_GPU_TIMEINFO, &info);
+        if (ret == -1)
+                return false;
+
+        *timestamp = info.out.timestamp;
+        if (monotonic_ns)
+                *monotonic_ns = info.out.sec * 1000000000ull + info.out.nsec;
+
+        return true;
+}
+
+static bool
+kbase_read_timestamp(kbase k, uint64_t *timestamp)
+{
+        return kbase_read_timeinfo(k, timestamp, NULL);
+}
+
+/* The GPU timestamp counts the system timer, the rate of which is not part
+ * of the GPU properties. Read it from the CPU where that is possible, and
+ * otherwise measure it against CLOCK_MONOTONIC. A zero frequency means that
+ * timestamps are unavailable, which is not an error. */
+static bool
+get_timestamp_freq(kbase k)
+{
+        k->timestamp_freq = 0;
+
+        uint64_t ts0, ns0, ts1, ns1;
+        if (!kbase_read_timeinfo(k, &ts0, &ns0))
+                return true;
+
+#if DETECT_ARCH_AARCH64
+        uint64_t freq;
+        __asm__ volatile("mrs %0, cntfrq_el0" : "=r" (freq));
+        k->timestamp_freq = freq;
+#elif DETECT_ARCH_ARM
+        uint32_t freq;
+        __asm__ volatile("mrc p15, 0, %0, c14, c0, 0" : "=r" (freq));
+        k->timestamp_freq = freq;
+#endif
+
+        if (k->timestamp_freq)
+                goto out;
+
+        usleep(10000);
+
+        if (!kbase_read_timeinfo(k, &ts1, &ns1) || ns1 <= ns0 || ts1 <= ts0)
+                return true;
+
+        k->timestamp_freq = (ts1 - ts0) * 1000000000ull / (ns1 - ns0);
+
+out:
+        LOG("GPU timestamp frequency: %"PRIu64" Hz\n", k->timestamp_freq);
+        return true;
+}
+
+/* Only used to decide how many contexts fit in a queue group, and to tell
+ * when there are more groups than the firmware can run at once, so a
+ * failure is not an error */
+static bool
+get_csf_iface(kbase k)
+{
+        union kbase_ioctl_cs_get_glb_iface iface = { 0 };
+
+        if (kbase_ioctl(k->fd, KBASE_IOCTL_CS_GET_GLB_IFACE, &iface) == -1 ||
+            !iface.out.group_num)
+                return true;
+
+        k->csg_slots = iface.out.group_num;
+        k->csg_streams = iface.out.total_stream_num / iface.out.group_num;
+
+        LOG("%u CSG slots, %u queues per group\n",
+            k->csg_slots, k->csg_streams);
+        return true;
+}
 #endif
 
 #if PAN_BASE_API >= 1
@@ -332,13 +439,15 @@ init_mem_exec(kbase k)
         return true;
 }
 
+/* Nothing makes JIT allocations, so only reserve a token zone rather than
+ * 128 GiB of the address space */
 static bool
 init_mem_jit(kbase k)
 {
         struct kbase_ioctl_mem_jit_init init = {
-                .va_pages = 1 << 25,
-                .max_allocations = 255,
-                .phys_pages = 1 << 25,
+                .va_pages = 1 << 12,
+                .max_allocations = 1,
+                .phys_pages = 1 << 12,
         };
 
         int ret = kbase_ioctl(k->fd, KBASE_IOCTL_MEM_JIT_INIT, &init);
@@ -353,47 +462,154 @@ init_mem_jit(kbase k)
 
 #if PAN_BASE_API >= 2
 static struct base_ptr
-kbase_alloc(kbase k, size_t size, unsigned pan_flags, unsigned mali_flags);
+kbase_alloc_reserve(kbase k, size_t size, size_t va_size, unsigned pan_flags,
+                    unsigned mali_flags);
 
 static bool
-alloc_event_mem(kbase k)
+kbase_mem_commit(kbase k, base_va va, size_t size);
+
+/* Command streams wait on the event memory of other queues, so it can't
+ * move once a slot is in use. Reserve the VA for every slot, and back it
+ * as slots are allocated. */
+static struct base_ptr
+alloc_event_range(kbase k)
 {
-        k->event_mem = kbase_alloc(k, k->page_size * 2,
+        return kbase_alloc_reserve(k, k->page_size,
+                                   KBASE_MAX_EVENT_SLOTS * PAN_EVENT_SIZE,
                                    PANFROST_BO_NOEXEC,
                                    BASE_MEM_PROT_CPU_RD | BASE_MEM_PROT_CPU_WR |
                                    BASE_MEM_PROT_GPU_RD | BASE_MEM_PROT_GPU_WR |
                                    BASE_MEM_SAME_VA | BASE_MEM_CSF_EVENT);
-        k->kcpu_event_mem = (struct base_ptr) {
-                .cpu = k->event_mem.cpu + k->page_size,
-                .gpu = k->event_mem.gpu + k->page_size,
-        };
-        return k->event_mem.cpu;
 }
 
 static bool
 free_event_mem(kbase k)
 {
+        size_t size = KBASE_MAX_EVENT_SLOTS * PAN_EVENT_SIZE;
+        bool ret = true;
+
         if (k->event_mem.cpu)
-                return munmap(k->event_mem.cpu, k->page_size * 2) == 0;
+                ret &= munmap(k->event_mem.cpu, size) == 0;
+        if (k->kcpu_event_mem.cpu)
+                ret &= munmap(k->kcpu_event_mem.cpu, size) == 0;
+
+        return ret;
+}
+
+static bool
+alloc_event_mem(kbase k)
+{
+        k->event_mem = alloc_event_range(k);
+        k->kcpu_event_mem = alloc_event_range(k);
+
+        if (!k->event_mem.cpu || !k->kcpu_event_mem.cpu) {
+                free_event_mem(k);
+                return false;
+        }
+
+        k->event_mem_size = k->page_size;
         return true;
 }
 #endif
 
+/* Makes sure that the slots below count have their state allocated, and
+ * on CSF their event memory backed. Called with queue_lock held, or
+ * before any queue exists. */
+static bool
+kbase_event_slots_grow(kbase k, unsigned count)
+{
+        if (count > KBASE_MAX_EVENT_SLOTS)
+                return false;
+
+        if (count <= k->event_slot_usage)
+                return true;
+
 #if PAN_BASE_API >= 2
+        size_t size = ALIGN_POT(count * PAN_EVENT_SIZE, k->page_size);
+
+        if (size > k->event_mem_size) {
+                if (!kbase_mem_commit(k, k->event_mem.gpu, size) ||
+                    !kbase_mem_commit(k, k->kcpu_event_mem.gpu, size))
+                        return false;
+
+                k->event_mem_size = size;
+        }
+#endif
+
+        for (unsigned i = 0; i < DIV_ROUND_UP(count, KBASE_EVENT_SLOT_CHUNK); ++i) {
+                if (k->event_slot_chunks[i])
+                        continue;
+
+                k->event_slot_chunks[i] =
+                        calloc(KBASE_EVENT_SLOT_CHUNK,
+                               sizeof(struct kbase_event_slot));
+
+                if (!k->event_slot_chunks[i])
+                        return false;
+        }
+
+        /* Publish the slots only once their chunks are allocated, as
+         * usage is checked without queue_lock */
+        p_atomic_set(&k->event_slot_usage, count);
+        return true;
+}
+
+/* Job manager kbases use the atom number as the slot, so they are all in
+ * use from the start */
 static bool
-cs_group_create(kbase k, struct kbase_context *c)
+alloc_event_slots(kbase k)
+{
+        if (PAN_BASE_API >= 2)
+                return true;
+
+        if (!kbase_event_slots_grow(k, 256))
+                return false;
+
+        BITSET_SET_RANGE(k->event_slots_used, 0, 255);
+        return true;
+}
+
+static bool
+free_event_slots(kbase k)
 {
+        for (unsigned i = 0; i < ARRAY_SIZE(k->event_slot_chunks); ++i) {
+                free(k->event_slot_chunks[i]);
+                k->event_slot_chunks[i] = NULL;
+        }
+
+        k->event_slot_usage = 0;
+        return true;
+}
+
+#if PAN_BASE_API >= 2
+static struct kbase_group *
+cs_group_new(kbase k, struct kbase_context *c)
+{
+        static const uint8_t priorities[] = {
+                [KBASE_CONTEXT_PRIORITY_LOW] = BASE_QUEUE_GROUP_PRIORITY_LOW,
+                [KBASE_CONTEXT_PRIORITY_MEDIUM] = BASE_QUEUE_GROUP_PRIORITY_MEDIUM,
+                [KBASE_CONTEXT_PRIORITY_HIGH] = BASE_QUEUE_GROUP_PRIORITY_HIGH,
+        };
+
+        unsigned max_sets = MAX2(k->contexts_per_group, 1);
+
+        /* Each context needs cs_queue_count queues of the group */
+        if (k->csg_streams)
+                max_sets = MIN2(max_sets, MAX2(k->csg_streams / k->cs_queue_count, 1));
+
+        max_sets = MIN2(max_sets, 32);
+
         /* TODO: What about compute-only contexts? */
         union kbase_ioctl_cs_queue_group_create_1_6 create = {
                 .in = {
                         /* Mali *still* only supports a single tiler unit */
                         .tiler_mask = 1,
-                        .fragment_mask = ~0ULL,
-                        .compute_mask = ~0ULL,
+                        .fragment_mask = c->core_mask,
+                        .compute_mask = c->core_mask,
 
-                        .cs_min = k->cs_queue_count,
+                        .cs_min = k->cs_queue_count * max_sets,
 
-                        .priority = 1,
+                        .priority = priorities[c->priority],
                         .tiler_max = 1,
                         .fragment_max = 64,
                         .compute_max = 64,
@@ -404,14 +620,65 @@ cs_group_create(kbase k, struct kbase_context *c)
 
         if (ret == -1) {
                 perror("ioctl(KBASE_IOCTL_CS_QUEUE_GROUP_CREATE_1_6)");
-                return false;
+                return NULL;
         }
 
-        c->csg_handle = create.out.group_handle;
-        c->csg_uid = create.out.group_uid;
+        struct kbase_group *g = calloc(1, sizeof(*g));
+
+        g->handle = create.out.group_handle;
+        g->uid = create.out.group_uid;
+        g->priority = c->priority;
+        g->core_mask = c->core_mask;
+        g->max_sets = max_sets;
 
         /* Should be at least 1 */
-        assert(c->csg_uid);
+        assert(g->uid);
+
+        list_addtail(&g->link, &k->groups);
+
+        if (k->csg_slots && k->group_count >= k->csg_slots)
+                ++k->group_oversubscribed;
+
+        k->group_peak = MAX2(k->group_peak, ++k->group_count);
+
+        return g;
+}
+
+static bool
+cs_group_create(kbase k, struct kbase_context *c)
+{
+        struct kbase_group *group = NULL;
+
+        pthread_mutex_lock(&k->group_lock);
+
+        if (k->contexts_per_group > 1) {
+                list_for_each_entry(struct kbase_group, g, &k->groups, link) {
+                        if (!g->dead && g->priority == c->priority &&
+                            g->core_mask == c->core_mask &&
+                            util_bitcount(g->sets) < g->max_sets) {
+                                group = g;
+                                break;
+                        }
+                }
+        }
+
+        if (!group)
+                group = cs_group_new(k, c);
+
+        if (!group) {
+                pthread_mutex_unlock(&k->group_lock);
+                return false;
+        }
+
+        unsigned set = ffs(~group->sets) - 1;
+        group->sets |= BITFIELD_BIT(set);
+
+        pthread_mutex_unlock(&k->group_lock);
+
+        c->group = group;
+        c->csi_base = set * k->cs_queue_count;
+        c->csg_handle = group->handle;
+        c->csg_uid = group->uid;
 
         return true;
 }
@@ -419,15 +686,38 @@ cs_group_create(kbase k, struct kbase_context *c)
 static bool
 cs_group_term(kbase k, struct kbase_context *c)
 {
-        if (!c->csg_uid)
+        struct kbase_group *g = c->group;
+
+        if (!g)
                 return true;
 
+        /* The context is gone from the group either way, don't leave it
+         * again when a context which failed to be recreated is destroyed */
+        c->group = NULL;
+        c->csg_uid = 0;
+
+        pthread_mutex_lock(&k->group_lock);
+
+        g->sets &= ~BITFIELD_BIT(c->csi_base / k->cs_queue_count);
+
+        if (g->sets) {
+                pthread_mutex_unlock(&k->group_lock);
+                return true;
+        }
+
+        list_del(&g->link);
+        --k->group_count;
+
+        pthread_mutex_unlock(&k->group_lock);
+
         struct kbase_ioctl_cs_queue_group_term term = {
-                .group_handle = c->csg_handle
+                .group_handle = g->handle
         };
 
         int ret = kbase_ioctl(k->fd, KBASE_IOCTL_CS_QUEUE_GROUP_TERMINATE, &term);
 
+        free(g);
+
         if (ret == -1) {
                 perror("ioctl(KBASE_IOCTL_CS_QUEUE_GROUP_TERMINATE)");
                 return false;
@@ -438,15 +728,14 @@ cs_group_term(kbase k, struct kbase_context *c)
 
 #if PAN_BASE_API >= 2
 static bool
-tiler_heap_create(kbase k, struct kbase_context *c)
+tiler_heap_init(kbase k, struct kbase_context *c, unsigned idx,
+                unsigned initial_chunks, unsigned max_chunks)
 {
-        c->tiler_heap_chunk_size = 1 << 21; /* 2 MB */
-
         union kbase_ioctl_cs_tiler_heap_init init = {
                 .in = {
                         .chunk_size = c->tiler_heap_chunk_size,
-                        .initial_chunks = 5,
-                        .max_chunks = 200,
+                        .initial_chunks = initial_chunks,
+                        .max_chunks = max_chunks,
                         .target_in_flight = 65535,
                 }
         };
@@ -458,20 +747,24 @@ tiler_heap_create(kbase k, struct kbase_context *c)
                 return false;
         }
 
-        c->tiler_heap_va = init.out.gpu_heap_va;
-        c->tiler_heap_header = init.out.first_chunk_va;
+        c->tiler_heaps[idx] = (struct kbase_tiler_heap) {
+                .va = init.out.gpu_heap_va,
+                .header = init.out.first_chunk_va,
+                .initial_chunks = initial_chunks,
+                .max_chunks = max_chunks,
+        };
+
+        LOG("tiler heap %u: %u -> %u chunks\n", idx, initial_chunks,
+            max_chunks);
 
         return true;
 }
 
 static bool
-tiler_heap_term(kbase k, struct kbase_context *c)
+tiler_heap_term_one(kbase k, struct kbase_context *c, unsigned idx)
 {
-        if (!c->tiler_heap_va)
-                return true;
-
         struct kbase_ioctl_cs_tiler_heap_term term = {
-                .gpu_heap_va = c->tiler_heap_va
+                .gpu_heap_va = c->tiler_heaps[idx].va
         };
 
         int ret = kbase_ioctl(k->fd, KBASE_IOCTL_CS_TILER_HEAP_TERM, &term);
@@ -482,14 +775,198 @@ tiler_heap_term(kbase k, struct kbase_context *c)
         }
         return true;
 }
+
+static bool
+tiler_heap_create(kbase k, struct kbase_context *c)
+{
+        c->tiler_heap_chunk_size = 1 << 21; /* 2 MB */
+        c->num_tiler_heaps = 0;
+
+        for (unsigned i = 0; i < KBASE_MAX_TILER_HEAPS; ++i) {
+                struct kbase_tiler_heap *heap = &c->tiler_heaps[i];
+
+                /* Only the first heap gets chunks up front, the kernel
+                 * grows the others when they are used. After a reset, keep
+                 * the counts the heaps were resized to. */
+                unsigned initial = heap->initial_chunks ?: (i ? 1 : 5);
+                unsigned max = heap->max_chunks ?: 200;
+
+                /* Fewer heaps only means less overlap */
+                if (!tiler_heap_init(k, c, i, initial, max))
+                        return c->num_tiler_heaps > 0;
+
+                c->num_tiler_heaps = i + 1;
+        }
+
+        return true;
+}
+
+static bool
+tiler_heap_term(kbase k, struct kbase_context *c)
+{
+        bool ok = true;
+
+        for (unsigned i = 0; i < c->num_tiler_heaps; ++i)
+                ok &= tiler_heap_term_one(k, c, i);
+
+        c->num_tiler_heaps = 0;
+        return ok;
+}
+
+static bool
+kbase_tiler_heap_recreate(kbase k, struct kbase_context *c, unsigned idx,
+                          unsigned initial_chunks, unsigned max_chunks)
+{
+        assert(idx < c->num_tiler_heaps);
+
+        tiler_heap_term_one(k, c, idx);
+
+        if (tiler_heap_init(k, c, idx, initial_chunks, max_chunks))
+                return true;
+
+        /* Try to get back a heap like the old one */
+        struct kbase_tiler_heap old = c->tiler_heaps[idx];
+        if (!tiler_heap_init(k, c, idx, old.initial_chunks, old.max_chunks))
+                fprintf(stderr, "error: lost tiler heap %u\n", idx);
+
+        return false;
+}
+#endif
+
+#if PAN_BASE_API >= 2 && !defined(PAN_BASE_NOOP) && UTIL_FUTEX_SUPPORTED
+static bool
+kbase_handle_events(kbase k);
+
+/* Whether any queue has work which hasn't completed yet */
+static bool
+kbase_gpu_busy(kbase k)
+{
+        bool busy = false;
+
+        pthread_mutex_lock(&k->queue_lock);
+
+        for (unsigned i = 0; i < k->event_slot_usage; ++i) {
+                struct kbase_event_slot *slot = kbase_event_slot(k, i);
+
+                busy |= BITSET_TEST(k->event_slots_used, i) &&
+                        slot->last != slot->last_submit;
+        }
+
+        pthread_mutex_unlock(&k->queue_lock);
+
+        return busy;
+}
+
+static void *
+kbase_event_thread(void *data)
+{
+        kbase k = data;
+
+        u_thread_setname("kbase-events");
+
+        struct pollfd pfd[2] = {
+                { .fd = k->fd, .events = POLLIN },
+                { .fd = k->event_thread_fd, .events = POLLIN },
+        };
+
+        /* With work in flight, look at the event memory every so often even
+         * without an interrupt */
+        const struct timespec busy_timeout = { .tv_nsec = 50 * 1000000 };
+
+        while (!p_atomic_read(&k->event_thread_stop)) {
+                /* Nothing can complete while the GPU is idle, so sleep until
+                 * there is an event or a submission. idle is set before
+                 * checking for work so that a submission can't be missed. */
+                p_atomic_set(&k->event_thread_idle, true);
+                bool busy = kbase_gpu_busy(k);
+                if (busy)
+                        p_atomic_set(&k->event_thread_idle, false);
+
+                int ret = ppoll(pfd, ARRAY_SIZE(pfd),
+                                busy ? &busy_timeout : NULL, NULL);
+
+                if (ret == -1 && errno != EINTR)
+                        perror("poll(mali fd)");
+
+                p_atomic_set(&k->event_thread_idle, false);
+
+                if (pfd[1].revents & POLLIN) {
+                        uint64_t count;
+                        read(k->event_thread_fd, &count, sizeof(count));
+                }
+
+                pthread_mutex_lock(&k->event_read_lock);
+                kbase_handle_events(k);
+                pthread_mutex_unlock(&k->event_read_lock);
+        }
+
+        return NULL;
+}
+
+/* Wake the event thread if it is sleeping without a timeout */
+static void
+kbase_event_thread_kick(kbase k)
+{
+        if (k->event_thread_running &&
+            p_atomic_xchg(&k->event_thread_idle, false)) {
+                uint64_t one = 1;
+                write(k->event_thread_fd, &one, sizeof(one));
+        }
+}
+
+static bool
+start_event_thread(kbase k)
+{
+        /* Without the thread, waiters read events themselves */
+        k->event_thread_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (k->event_thread_fd == -1) {
+                perror("eventfd");
+                return true;
+        }
+
+        if (pthread_create(&k->event_thread, NULL, kbase_event_thread, k)) {
+                close(k->event_thread_fd);
+                return true;
+        }
+
+        k->event_thread_running = true;
+        return true;
+}
+
+static bool
+stop_event_thread(kbase k)
+{
+        if (!k->event_thread_running)
+                return true;
+
+        p_atomic_set(&k->event_thread_stop, true);
+
+        uint64_t one = 1;
+        write(k->event_thread_fd, &one, sizeof(one));
+
+        pthread_join(k->event_thread, NULL);
+        close(k->event_thread_fd);
+
+        k->event_thread_running = false;
+        return true;
+}
+#else
+static void
+kbase_event_thread_kick(kbase k)
+{
+}
 #endif
 
 typedef bool (* kbase_func)(kbase k);
 
+/* Steps which are async may run on another thread, from when the first of
+ * them is reached until kbase_open returns. Nothing else in the setup may
+ * depend on them, and their cleanup must cope with them not having run. */
 struct kbase_op {
         kbase_func part;
         kbase_func cleanup;
         const char *label;
+        bool async;
 };
 
 static struct kbase_op kbase_main[] = {
@@ -501,9 +978,12 @@ static struct kbase_op kbase_main[] = {
 #if PAN_BASE_API == 0
         { set_flags, NULL, "Set flags" },
 #endif
-        { get_gpuprops, free_gpuprops, "Get GPU properties" },
+        { get_gpuprops, free_gpuprops, "Get GPU properties", true },
+        { alloc_event_slots, free_event_slots, "Allocate event slots" },
 #if PAN_BASE_API >= 2
         { mmap_user_reg, munmap_user_reg, "Map user register page" },
+        { get_timestamp_freq, NULL, "Get timestamp frequency", true },
+        { get_csf_iface, NULL, "Get CSF interface", true },
 #endif
 #if PAN_BASE_API >= 1
         { init_mem_exec, NULL, "Initialise EXEC_VA zone" },
@@ -512,11 +992,27 @@ static struct kbase_op kbase_main[] = {
 #if PAN_BASE_API >= 2
         { alloc_event_mem, free_event_mem, "Allocate event memory" },
 #endif
+#if PAN_BASE_API >= 2 && !defined(PAN_BASE_NOOP) && UTIL_FUTEX_SUPPORTED
+        { start_event_thread, stop_event_thread, "Start event thread" },
+#endif
 };
 
 static void
 kbase_close(kbase k)
 {
+        if (k->doorbell_count || k->kick_count)
+                LOG("CS submissions: %"PRIu64" doorbell, %"PRIu64" kick\n",
+                    k->doorbell_count, k->kick_count);
+
+        if (k->kcpu_stall_count)
+                LOG("KCPU queue full %"PRIu64" times\n", k->kcpu_stall_count);
+
+        if (k->group_peak)
+                LOG("Queue groups: %u at most, %u slots, %"PRIu64" created "
+                    "oversubscribed, %"PRIu64" progress timeouts\n",
+                    k->group_peak, k->csg_slots,
+                    k->group_oversubscribed, k->group_timeouts);
+
         while (k->setup_state) {
                 unsigned i = k->setup_state - 1;
                 if (kbase_main[i].cleanup)
@@ -524,10 +1020,22 @@ kbase_close(kbase k)
                 --k->setup_state;
         }
 
+#if PAN_BASE_API < 2
+        for (unsigned i = 0; i < ARRAY_SIZE(k->atoms); ++i) {
+                free(k->atoms[i].handles);
+                free(k->atoms[i].access);
+                free(k->atoms[i].extres);
+        }
+#endif
+
+        list_for_each_entry_safe(struct kbase_syncobj, o, &k->syncobj_cache, link)
+                kbase_syncobj_free(o);
+
         pthread_mutex_destroy(&k->handle_lock);
         pthread_mutex_destroy(&k->event_read_lock);
         pthread_mutex_destroy(&k->event_cnd_lock);
         pthread_mutex_destroy(&k->queue_lock);
+        pthread_mutex_destroy(&k->group_lock);
         pthread_cond_destroy(&k->event_cnd);
 
         close(k->fd);
@@ -542,6 +1050,9 @@ kbase_get_pan_gpuprop(kbase k, unsigned name, uint64_t *value)
                 [DRM_PANFROST_PARAM_TEXTURE_FEATURES0] = KBASE_GPUPROP_RAW_TEXTURE_FEATURES_0,
                 [DRM_PANFROST_PARAM_THREAD_TLS_ALLOC] = KBASE_GPUPROP_TLS_ALLOC,
                 [DRM_PANFROST_PARAM_TILER_FEATURES] = KBASE_GPUPROP_RAW_TILER_FEATURES,
+                [DRM_PANFROST_PARAM_THREAD_FEATURES] = KBASE_GPUPROP_RAW_THREAD_FEATURES,
+                [DRM_PANFROST_PARAM_MAX_THREADS] = KBASE_GPUPROP_MAX_THREADS,
+                [DRM_PANFROST_PARAM_THREAD_MAX_WORKGROUP_SZ] = KBASE_GPUPROP_MAX_WORKGROUP_SIZE,
         };
 
         if (name < ARRAY_SIZE(conv) && conv[name])
@@ -575,20 +1086,61 @@ kbase_free(kbase k, base_va va)
                 perror("ioctl(KBASE_IOCTL_MEM_FREE)");
 }
 
+static bool
+kbase_mem_evictable(kbase k, base_va va, bool evictable)
+{
+        struct kbase_ioctl_mem_flags_change change = {
+                .gpu_va = va,
+                .flags = evictable ? BASE_MEM_DONT_NEED : 0,
+                .mask = BASE_MEM_DONT_NEED,
+        };
+
+        int ret = kbase_ioctl(k->fd, KBASE_IOCTL_MEM_FLAGS_CHANGE, &change);
+
+        if (ret == -1) {
+                LOG("mem_flags_change(0x%"PRIx64", %i) failed: %s\n",
+                    (uint64_t) va, evictable, strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
+static bool
+kbase_mem_commit(kbase k, base_va va, size_t size)
+{
+        struct kbase_ioctl_mem_commit commit = {
+                .gpu_addr = va,
+                .pages = DIV_ROUND_UP(size, k->page_size),
+        };
+
+        int ret = kbase_ioctl(k->fd, KBASE_IOCTL_MEM_COMMIT, &commit);
+
+        if (ret == -1) {
+                LOG("mem_commit(0x%"PRIx64", %zu) failed: %s\n",
+                    (uint64_t) va, size, strerror(errno));
+                return false;
+        }
+
+        return true;
+}
+
 static struct base_ptr
-kbase_alloc(kbase k, size_t size, unsigned pan_flags, unsigned mali_flags)
+kbase_alloc_reserve(kbase k, size_t size, size_t va_size, unsigned pan_flags,
+                    unsigned mali_flags)
 {
         struct base_ptr r = {0};
 
-        unsigned pages = DIV_ROUND_UP(size, k->page_size);
-
         union kbase_ioctl_mem_alloc a = {
                 .in = {
-                        .va_pages = pages,
-                        .commit_pages = pages,
+                        .va_pages = DIV_ROUND_UP(va_size, k->page_size),
+                        .commit_pages = DIV_ROUND_UP(size, k->page_size),
                 }
         };
 
+        /* The whole VA range is mapped */
+        size = va_size;
+
         size_t alloc_size = size;
         unsigned flags = mali_flags;
         bool exec_align = false;
@@ -694,8 +1246,14 @@ kbase_alloc(kbase k, size_t size, unsigned pan_flags, unsigned mali_flags)
         return r;
 }
 
+static struct base_ptr
+kbase_alloc(kbase k, size_t size, unsigned pan_flags, unsigned mali_flags)
+{
+        return kbase_alloc_reserve(k, size, size, pan_flags, mali_flags);
+}
+
 static int
-kbase_import_dmabuf(kbase k, int fd)
+kbase_import_dmabuf(kbase k, int fd, bool gpu_only)
 {
         int ret;
 
@@ -727,11 +1285,13 @@ kbase_import_dmabuf(kbase k, int fd)
                 .in = {
                         .phandle = (uintptr_t) &dup,
                         .type = BASE_MEM_IMPORT_TYPE_UMM,
-                        /* Usage flags: CPU/GPU reads/writes */
-                        .flags = 0xf,
+                        .flags = BASE_MEM_PROT_GPU_RD | BASE_MEM_PROT_GPU_WR,
                 }
         };
 
+        if (!gpu_only)
+                import.in.flags |= BASE_MEM_PROT_CPU_RD | BASE_MEM_PROT_CPU_WR;
+
         ret = kbase_ioctl(k->fd, KBASE_IOCTL_MEM_IMPORT, &import);
 
         int handle;
@@ -740,9 +1300,12 @@ kbase_import_dmabuf(kbase k, int fd)
                 perror("ioctl(KBASE_IOCTL_MEM_IMPORT)");
                 handle = -1;
         } else if (import.out.flags & BASE_MEM_NEED_MMAP) {
+                /* With SAME_VA, the mapping picks the GPU VA. For a GPU-only
+                 * import it only reserves the range. */
+                int prot = gpu_only ? PROT_NONE : (PROT_READ | PROT_WRITE);
                 uint64_t va = (uintptr_t) kbase_mmap(NULL, import.out.va_pages * k->page_size,
-                                                     PROT_READ | PROT_WRITE,
-                                                     MAP_SHARED, k->fd, import.out.gpu_va);
+                                                     prot, MAP_SHARED, k->fd,
+                                                     import.out.gpu_va);
 
                 if (va == (uintptr_t) MAP_FAILED) {
                         perror("mmap(IMPORTED BO)");
@@ -759,6 +1322,52 @@ kbase_import_dmabuf(kbase k, int fd)
         return handle;
 }
 
+#if PAN_BASE_API >= 2
+/* Makes application memory visible to the GPU. CSF pins the pages at import,
+ * so no external resource has to be attached to each submission. The CPU
+ * keeps using ptr, as the GPU VA is always a new range. */
+static int
+kbase_import_user(kbase k, void *ptr, size_t size)
+{
+        struct base_mem_import_user_buffer user = {
+                .ptr = (uintptr_t) ptr,
+                .length = size,
+        };
+
+        union kbase_ioctl_mem_import import = {
+                .in = {
+                        .phandle = (uintptr_t) &user,
+                        .type = BASE_MEM_IMPORT_TYPE_USER_BUFFER,
+                        .flags = BASE_MEM_PROT_GPU_RD | BASE_MEM_PROT_GPU_WR,
+                }
+        };
+
+        int ret = kbase_ioctl(k->fd, KBASE_IOCTL_MEM_IMPORT, &import);
+        if (ret == -1) {
+                perror("ioctl(KBASE_IOCTL_MEM_IMPORT(USER_BUFFER))");
+                return -1;
+        }
+
+        uint64_t va = import.out.gpu_va;
+
+        /* With SAME_VA, mapping picks the GPU VA, it only reserves the range
+         * as for GPU-only dma-bufs */
+        if (import.out.flags & BASE_MEM_NEED_MMAP) {
+                void *map = kbase_mmap(NULL, import.out.va_pages * k->page_size,
+                                       PROT_NONE, MAP_SHARED, k->fd, va);
+
+                if (map == MAP_FAILED) {
+                        perror("mmap(IMPORTED USER BUFFER)");
+                        return -1;
+                }
+
+                va = (uintptr_t) map;
+        }
+
+        return kbase_alloc_gem_handle(k, va, -1);
+}
+#endif
+
 static void *
 kbase_mmap_import(kbase k, base_va va, size_t size)
 {
@@ -766,59 +1375,105 @@ kbase_mmap_import(kbase k, base_va va, size_t size)
 }
 
 struct kbase_fence {
-        struct list_head link;
-
         unsigned slot;
         uint64_t value;
 };
 
+/* Enough for the queues of a few contexts without allocating */
+#define KBASE_SYNCOBJ_INLINE_FENCES 6
+
+/* The points to wait for, at most one per event slot. Points are removed
+ * once signalled, so a syncobj with no fences is signalled. */
 struct kbase_syncobj {
         struct list_head link;
 
-        struct list_head fences;
+        /* Points at inline_fences until more are needed */
+        struct kbase_fence *fences;
+        unsigned count, capacity;
+
+        struct kbase_fence inline_fences[KBASE_SYNCOBJ_INLINE_FENCES];
 };
 
 static struct kbase_syncobj *
 kbase_syncobj_create(kbase k)
 {
-        struct kbase_syncobj *o = calloc(1, sizeof(*o));
-        list_inithead(&o->fences);
+        struct kbase_syncobj *o = NULL;
+
         pthread_mutex_lock(&k->queue_lock);
+
+        if (!list_is_empty(&k->syncobj_cache)) {
+                o = list_first_entry(&k->syncobj_cache,
+                                     struct kbase_syncobj, link);
+                list_del(&o->link);
+        } else {
+                o = calloc(1, sizeof(*o));
+                o->fences = o->inline_fences;
+                o->capacity = KBASE_SYNCOBJ_INLINE_FENCES;
+        }
+
+        o->count = 0;
         list_add(&o->link, &k->syncobjs);
+
         pthread_mutex_unlock(&k->queue_lock);
         return o;
 }
 
+static void
+kbase_syncobj_free(struct kbase_syncobj *o)
+{
+        if (o->fences != o->inline_fences)
+                free(o->fences);
+
+        free(o);
+}
+
 static void
 kbase_syncobj_destroy(kbase k, struct kbase_syncobj *o)
 {
         pthread_mutex_lock(&k->queue_lock);
         list_del(&o->link);
-        pthread_mutex_unlock(&k->queue_lock);
 
-        list_for_each_entry_safe(struct kbase_fence, fence, &o->fences, link) {
-                list_del(&fence->link);
-                free(fence);
+        /* Syncobjs which grew are rare, so they aren't worth keeping */
+        if (o->fences == o->inline_fences) {
+                list_add(&o->link, &k->syncobj_cache);
+                o = NULL;
         }
 
-        free(o);
+        pthread_mutex_unlock(&k->queue_lock);
+
+        if (o)
+                kbase_syncobj_free(o);
 }
 
 static void
 kbase_syncobj_add_fence(struct kbase_syncobj *o, unsigned slot, uint64_t value)
 {
-        struct kbase_fence *fence = calloc(1, sizeof(*fence));
+        if (o->count == o->capacity) {
+                unsigned capacity = o->capacity * 2;
+                struct kbase_fence *fences =
+                        malloc(capacity * sizeof(*fences));
+
+                memcpy(fences, o->fences, o->count * sizeof(*fences));
+
+                if (o->fences != o->inline_fences)
+                        free(o->fences);
 
-        fence->slot = slot;
-        fence->value = value;
+                o->fences = fences;
+                o->capacity = capacity;
+        }
 
-        list_add(&fence->link, &o->fences);
+        o->fences[o->count++] = (struct kbase_fence) {
+                .slot = slot,
+                .value = value,
+        };
 }
 
 static void
 kbase_syncobj_update_fence(struct kbase_syncobj *o, unsigned slot, uint64_t value)
 {
-        list_for_each_entry(struct kbase_fence, fence, &o->fences, link) {
+        for (unsigned i = 0; i < o->count; ++i) {
+                struct kbase_fence *fence = &o->fences[i];
+
                 if (fence->slot == slot) {
                         if (value > fence->value)
                                 fence->value = value;
@@ -837,58 +1492,161 @@ kbase_syncobj_dup(kbase k, struct kbase_syncobj *o)
 
         pthread_mutex_lock(&k->queue_lock);
 
-        list_for_each_entry(struct kbase_fence, fence, &o->fences, link)
-                kbase_syncobj_add_fence(dup, fence->slot, fence->value);
+        if (o->count <= dup->capacity) {
+                memcpy(dup->fences, o->fences, o->count * sizeof(*o->fences));
+                dup->count = o->count;
+        } else {
+                for (unsigned i = 0; i < o->count; ++i)
+                        kbase_syncobj_add_fence(dup, o->fences[i].slot,
+                                                o->fences[i].value);
+        }
 
         pthread_mutex_unlock(&k->queue_lock);
 
         return dup;
 }
 
-static void
-kbase_syncobj_update(kbase k, struct kbase_syncobj *o)
-{
-        list_for_each_entry_safe(struct kbase_fence, fence, &o->fences, link) {
-                uint64_t value = k->event_slots[fence->slot].last;
+static void
+kbase_syncobj_add_point(kbase k, struct kbase_syncobj *o,
+                        unsigned slot, uint64_t seqnum)
+{
+        pthread_mutex_lock(&k->queue_lock);
+        kbase_syncobj_update_fence(o, slot, seqnum);
+        pthread_mutex_unlock(&k->queue_lock);
+}
+
+/* Drops the signalled points, by comparing against the last seqnum seen on
+ * each slot */
+static void
+kbase_syncobj_update(kbase k, struct kbase_syncobj *o)
+{
+        for (unsigned i = 0; i < o->count;) {
+                struct kbase_fence *fence = &o->fences[i];
+                uint64_t value =
+                        p_atomic_read(&kbase_event_slot(k, fence->slot)->last);
+
+                if (value > fence->value) {
+                        LOG("syncobj %p slot %u value %"PRIu64" vs %"PRIu64"\n",
+                            o, fence->slot, fence->value, value);
+
+                        *fence = o->fences[--o->count];
+                } else {
+                        ++i;
+                }
+        }
+}
+
+static unsigned
+kbase_syncobj_get_points(kbase k, struct kbase_syncobj *o,
+                         unsigned *slots, uint64_t *seqnums, unsigned max)
+{
+        pthread_mutex_lock(&k->queue_lock);
+        kbase_syncobj_update(k, o);
+
+        unsigned count = o->count;
+
+        for (unsigned i = 0; i < MIN2(count, max); ++i) {
+                slots[i] = o->fences[i].slot;
+                seqnums[i] = o->fences[i].value;
+        }
+
+        pthread_mutex_unlock(&k->queue_lock);
+        return count;
+}
+
+#if UTIL_FUTEX_SUPPORTED
+/* With the event thread running, sleep on the futex of a slot which has not
+ * reached its seqnum yet, so that only threads waiting for that slot are
+ * woken when it progresses */
+static bool
+kbase_syncobj_wait_futex(kbase k, struct kbase_syncobj *o, int64_t timeout_ns)
+{
+        struct kbase_wait_ctx wait = kbase_wait_init(k, timeout_ns);
+        bool flushed = false;
+
+        for (;;) {
+                pthread_mutex_lock(&k->queue_lock);
+                kbase_syncobj_update(k, o);
+
+                if (!o->count) {
+                        pthread_mutex_unlock(&k->queue_lock);
+                        return true;
+                }
+
+                struct kbase_fence *fence = &o->fences[0];
+                struct kbase_event_slot *slot = kbase_event_slot(k, fence->slot);
+
+                /* The slot is only signalled with the lock held, so this is
+                 * the value matching what was just checked */
+                p_atomic_inc(&slot->waiters);
+                uint32_t seq = p_atomic_read(&slot->futex);
+
+                pthread_mutex_unlock(&k->queue_lock);
+
+                int ret = futex_wait(&slot->futex, seq, &wait.until);
+                p_atomic_dec(&slot->waiters);
 
-                if (value > fence->value) {
-                        LOG("syncobj %p slot %u value %"PRIu64" vs %"PRIu64"\n",
-                            o, fence->slot, fence->value, value);
+                if (ret == -1 && errno == ETIMEDOUT) {
+                        /* The thread might not have got to the last events
+                         * yet, which matters most for zero timeouts */
+                        if (flushed)
+                                break;
 
-                        list_del(&fence->link);
-                        free(fence);
+                        flushed = true;
+                        kbase_flush_events(k);
                 }
         }
+
+        LOG("syncobj %p wait timeout\n", o);
+        return false;
 }
+#endif
 
 static bool
-kbase_syncobj_wait(kbase k, struct kbase_syncobj *o)
+kbase_syncobj_wait(kbase k, struct kbase_syncobj *o, int64_t timeout_ns)
 {
-        if (list_is_empty(&o->fences)) {
+        if (!o->count) {
                 LOG("syncobj has no fences\n");
                 return true;
         }
 
-        struct kbase_wait_ctx wait = kbase_wait_init(k, 1 * 1000000000LL);
+#if UTIL_FUTEX_SUPPORTED
+        if (k->event_thread_running)
+                return kbase_syncobj_wait_futex(k, o, timeout_ns);
+#endif
+
+        struct kbase_wait_ctx wait = kbase_wait_init(k, timeout_ns);
 
         while (kbase_wait_for_event(&wait)) {
                 kbase_syncobj_update(k, o);
 
-                if (list_is_empty(&o->fences)) {
+                if (!o->count) {
                         kbase_wait_fini(wait);
                         return true;
                 }
         }
 
+        /* The last poll may have handled events without another check,
+         * which matters most for zero timeouts. */
+        kbase_syncobj_update(k, o);
+        bool done = !o->count;
+
         kbase_wait_fini(wait);
 
-        fprintf(stderr, "syncobj %p wait timeout\n", o);
-        return false;
+        if (!done)
+                LOG("syncobj %p wait timeout\n", o);
+
+        return done;
 }
 
 static bool
 kbase_poll_event(kbase k, int64_t timeout_ns)
 {
+#ifdef PAN_BASE_NOOP
+        /* Work completes as soon as it is submitted */
+        return true;
+#endif
+
         struct pollfd pfd = {
                 .fd = k->fd,
                 .events = POLLIN,
@@ -936,21 +1694,30 @@ kbase_handle_events(kbase k)
 
                 pthread_mutex_lock(&k->handle_lock);
 
-                k->event_slots[event.atom_number].last = event.udata.blob[0];
+                kbase_event_slot(k, event.atom_number)->last = event.udata.blob[0];
 
                 unsigned size = util_dynarray_num_elements(&k->gem_handles,
                                                            kbase_handle);
                 kbase_handle *handle_data = util_dynarray_begin(&k->gem_handles);
 
-                struct util_dynarray *handles = k->atom_bos + event.atom_number;
+                struct kbase_atom *atom = &k->atoms[event.atom_number];
 
-                util_dynarray_foreach(handles, int32_t, h) {
-                        if (*h >= size)
+                for (unsigned i = 0; i < atom->num_handles; ++i) {
+                        int32_t h = atom->handles[i];
+
+                        if (h >= size)
                                 continue;
-                        assert(handle_data[*h].use_count);
-                        --handle_data[*h].use_count;
+                        assert(handle_data[h].use_count);
+                        --handle_data[h].use_count;
+
+                        if (atom->access[i] & KBASE_ACCESS_WRITE) {
+                                assert(handle_data[h].write_count);
+                                --handle_data[h].write_count;
+                        }
                 }
-                util_dynarray_fini(handles);
+
+                atom->num_handles = 0;
+                atom->pending = false;
 
                 pthread_mutex_unlock(&k->handle_lock);
         }
@@ -1007,6 +1774,12 @@ kbase_read_event(kbase k)
                         "sideband 0x%"PRIx64"\n",
                         e.payload.fatal_group.status,
                         (uint64_t) e.payload.fatal_group.sideband);
+
+                k->last_fault.sideband = e.payload.fatal_group.sideband;
+                k->last_fault.status = e.payload.fatal_group.status;
+                k->last_fault.csg_handle = event.payload.csg_error.handle;
+                k->last_fault.csi = ~0;
+                k->last_fault.valid = true;
                 break;
         }
         case BASE_GPU_QUEUE_GROUP_QUEUE_ERROR_FATAL: {
@@ -1018,16 +1791,23 @@ kbase_read_event(kbase k)
                         queue, e.payload.fatal_queue.status,
                         (uint64_t) e.payload.fatal_queue.sideband);
 
-                /* TODO: Decode the instruct that it got stuck at */
-
+                /* The faulting instruction is decoded by the driver's hang
+                 * report, which knows where the queue's ring is mapped */
+                k->last_fault.sideband = e.payload.fatal_queue.sideband;
+                k->last_fault.status = e.payload.fatal_queue.status;
+                k->last_fault.csg_handle = event.payload.csg_error.handle;
+                k->last_fault.csi = queue;
+                k->last_fault.valid = true;
                 break;
         }
 
         case BASE_GPU_QUEUE_GROUP_ERROR_TIMEOUT:
                 fprintf(stderr, "Command stream timeout!\n");
+                p_atomic_inc(&k->group_timeouts);
                 break;
         case BASE_GPU_QUEUE_GROUP_ERROR_TILER_HEAP_OOM:
                 fprintf(stderr, "Command stream OOM!\n");
+                p_atomic_inc(&k->tiler_oom[event.payload.csg_error.handle]);
                 break;
         default:
                 fprintf(stderr, "Unknown error type!\n");
@@ -1036,6 +1816,19 @@ kbase_read_event(kbase k)
         return false;
 }
 
+/* Wake the threads sleeping until the seqnum of the slot changes. Called
+ * with the queue_lock held, after changing last. */
+static void
+kbase_slot_signal(struct kbase_event_slot *slot)
+{
+        p_atomic_inc(&slot->futex);
+
+#if UTIL_FUTEX_SUPPORTED
+        if (p_atomic_read(&slot->waiters))
+                futex_wake(&slot->futex, INT_MAX);
+#endif
+}
+
 static void
 kbase_update_queue_callbacks(kbase k,
                              struct kbase_event_slot *slot,
@@ -1067,20 +1860,23 @@ static bool
 kbase_handle_events(kbase k)
 {
 #ifdef PAN_BASE_NOOP
-        return true;
-#endif
-
+        bool ret = true;
+#else
         /* This will clear the event count, so there's no need to do it in a
          * loop. */
         bool ret = kbase_read_event(k);
+#endif
 
         uint64_t *event_mem = k->event_mem.cpu;
 
         pthread_mutex_lock(&k->queue_lock);
 
         for (unsigned i = 0; i < k->event_slot_usage; ++i) {
+                if (!BITSET_TEST(k->event_slots_used, i))
+                        continue;
+
                 uint64_t seqnum = event_mem[i * 2];
-                uint64_t cmp = k->event_slots[i].last;
+                uint64_t cmp = kbase_event_slot(k, i)->last;
 
                 LOG("MAIN SEQ %"PRIu64" > %"PRIu64"?\n", seqnum, cmp);
 
@@ -1090,16 +1886,25 @@ kbase_handle_events(kbase k)
                                         "from %"PRIu64" to %"PRIu64"!\n",
                                         i, cmp, seqnum);
                 } else /*if (seqnum > cmp)*/ {
-                        kbase_update_queue_callbacks(k, &k->event_slots[i],
+                        kbase_update_queue_callbacks(k, kbase_event_slot(k, i),
                                                      seqnum);
                 }
 
                 /* TODO: Atomic operations? */
-                k->event_slots[i].last = seqnum;
+                if (seqnum != cmp) {
+                        kbase_event_slot(k, i)->last = seqnum;
+                        kbase_slot_signal(kbase_event_slot(k, i));
+                }
         }
 
         pthread_mutex_unlock(&k->queue_lock);
 
+        p_atomic_inc(&k->event_seq);
+#if UTIL_FUTEX_SUPPORTED
+        if (p_atomic_read(&k->event_waiters))
+                futex_wake(&k->event_seq, INT_MAX);
+#endif
+
         return ret;
 }
 
@@ -1117,21 +1922,67 @@ kbase_latest_slot(uint8_t a, uint8_t b, uint8_t newest)
         return a;
 }
 
-static int
-kbase_submit(kbase k, uint64_t va, unsigned req,
-             struct kbase_syncobj *o,
-             int32_t *handles, unsigned num_handles)
+/* Makes the atom depend on the atom dep, on the given slot, if it is still
+ * in flight and newer than its current dependency there */
+static void
+kbase_add_dep(kbase k, struct base_jd_atom_v2 *atom, unsigned *dep_slots,
+              bool *data_dep, unsigned slot, uint8_t dep, bool data)
+{
+        if (!k->atoms[dep].pending)
+                return;
+
+        uint8_t latest = kbase_latest_slot(dep_slots[slot], dep,
+                                           atom->atom_number);
+
+        /* Data dependencies propagate errors, so only use them when the
+         * atom reads what the one it depends on wrote */
+        if (latest != dep_slots[slot])
+                data_dep[slot] = data;
+        else if (latest == dep)
+                data_dep[slot] |= data;
+
+        dep_slots[slot] = latest;
+}
+
+static bool
+kbase_atom_reserve(struct kbase_atom *atom, unsigned num_handles)
 {
-        struct util_dynarray buf;
-        util_dynarray_init(&buf, NULL);
+        if (num_handles <= atom->capacity)
+                return true;
+
+        unsigned capacity = MAX2(util_next_power_of_two(num_handles), 64);
+
+        int32_t *handles = realloc(atom->handles, capacity * sizeof(*handles));
+        if (handles)
+                atom->handles = handles;
+
+        uint8_t *access = realloc(atom->access, capacity * sizeof(*access));
+        if (access)
+                atom->access = access;
 
-        memcpy(util_dynarray_resize(&buf, int32_t, num_handles),
-               handles, num_handles * sizeof(int32_t));
+        base_va *extres = realloc(atom->extres, capacity * sizeof(*extres));
+        if (extres)
+                atom->extres = extres;
 
+        if (!handles || !access || !extres)
+                return false;
+
+        atom->capacity = capacity;
+        return true;
+}
+
+static int
+kbase_submit(kbase k, struct kbase_atom_queue *q,
+             uint64_t va, unsigned req,
+             struct kbase_syncobj *o,
+             int32_t *handles, const uint8_t *access,
+             unsigned num_handles)
+{
         pthread_mutex_lock(&k->handle_lock);
 
         unsigned slot = (req & PANFROST_JD_REQ_FS) ? 0 : 1;
         unsigned dep_slots[KBASE_SLOT_COUNT];
+        bool data_dep[KBASE_SLOT_COUNT] = { false };
 
         uint8_t nr = k->atom_number++;
 
@@ -1145,36 +1996,68 @@ kbase_submit(kbase k, uint64_t va, unsigned req,
                 dep_slots[i] = nr;
 
         /* Make sure that we haven't taken an atom that's already in use. */
-        assert(!k->atom_bos[nr].data);
-        k->atom_bos[atom.atom_number] = buf;
+        struct kbase_atom *a = &k->atoms[nr];
+        assert(!a->pending);
+
+        if (!kbase_atom_reserve(a, num_handles)) {
+                pthread_mutex_unlock(&k->handle_lock);
+                errno = ENOMEM;
+                return -1;
+        }
 
         unsigned handle_buf_size = util_dynarray_num_elements(&k->gem_handles, kbase_handle);
         kbase_handle *handle_buf = util_dynarray_begin(&k->gem_handles);
 
-        struct util_dynarray extres;
-        util_dynarray_init(&extres, NULL);
+        unsigned nr_extres = 0;
 
         /* Mark the BOs as in use */
         for (unsigned i = 0; i < num_handles; ++i) {
                 int32_t h = handles[i];
+                kbase_handle *handle = &handle_buf[h];
+                uint8_t flags = access ? access[i] :
+                        (KBASE_ACCESS_READ | KBASE_ACCESS_WRITE);
+
                 assert(h < handle_buf_size);
-                assert(handle_buf[h].use_count < 255);
+                assert(handle->use_count < 255);
+
+                /* Implicit sync: everything waits for the last writer, and
+                 * writers also wait for the readers since */
+                if (handle->write_count)
+                        kbase_add_dep(k, &atom, dep_slots, data_dep,
+                                      handle->last_write_slot,
+                                      handle->last_write,
+                                      flags & KBASE_ACCESS_READ);
+
+                if ((flags & KBASE_ACCESS_WRITE) && handle->use_count) {
+                        for (unsigned s = 0; s < KBASE_SLOT_COUNT; ++s)
+                                kbase_add_dep(k, &atom, dep_slots, data_dep,
+                                              s, handle->last_read[s], false);
+                }
 
-                /* Implicit sync */
-                if (handle_buf[h].use_count)
+                if (flags & KBASE_ACCESS_WRITE) {
+                        handle->last_write = nr;
+                        handle->last_write_slot = slot;
+                        ++handle->write_count;
+
+                        /* Later writers only need to wait for this atom */
                         for (unsigned s = 0; s < KBASE_SLOT_COUNT; ++s)
-                                dep_slots[s] =
-                                        kbase_latest_slot(dep_slots[s],
-                                                          handle_buf[h].last_access[s],
-                                                          nr);
+                                handle->last_read[s] = nr;
+                } else {
+                        handle->last_read[slot] = nr;
+                }
+
+                ++handle->use_count;
 
-                handle_buf[h].last_access[slot] = nr;
-                ++handle_buf[h].use_count;
+                a->handles[i] = h;
+                a->access[i] = flags;
 
-                if (handle_buf[h].fd != -1)
-                        util_dynarray_append(&extres, base_va, handle_buf[h].va);
+                if (handle->fd != -1)
+                        a->extres[nr_extres++] = handle->va;
         }
 
+        a->num_handles = num_handles;
+        a->pending = true;
+
         pthread_mutex_unlock(&k->handle_lock);
 
         /* TODO: Better work out the difference between handle_lock and
@@ -1186,20 +2069,19 @@ kbase_submit(kbase k, uint64_t va, unsigned req,
         }
 
         assert(KBASE_SLOT_COUNT == 2);
-        if (dep_slots[0] != nr) {
-                atom.pre_dep[0].atom_id = dep_slots[0];
-                /* TODO: Use data dependencies?  */
-                atom.pre_dep[0].dependency_type = BASE_JD_DEP_TYPE_ORDER;
-        }
-        if (dep_slots[1] != nr) {
-                atom.pre_dep[1].atom_id = dep_slots[1];
-                atom.pre_dep[1].dependency_type = BASE_JD_DEP_TYPE_ORDER;
+        for (unsigned s = 0; s < KBASE_SLOT_COUNT; ++s) {
+                if (dep_slots[s] == nr)
+                        continue;
+
+                atom.pre_dep[s].atom_id = dep_slots[s];
+                atom.pre_dep[s].dependency_type = data_dep[s] ?
+                        BASE_JD_DEP_TYPE_DATA : BASE_JD_DEP_TYPE_ORDER;
         }
 
-        if (extres.size) {
+        if (nr_extres) {
                 atom.core_req |= BASE_JD_REQ_EXTERNAL_RESOURCES;
-                atom.nr_extres = util_dynarray_num_elements(&extres, base_va);
-                atom.extres_list = (uintptr_t) util_dynarray_begin(&extres);
+                atom.nr_extres = nr_extres;
+                atom.extres_list = (uintptr_t) a->extres;
         }
 
         if (req & PANFROST_JD_REQ_FS)
@@ -1207,6 +2089,13 @@ kbase_submit(kbase k, uint64_t va, unsigned req,
         else
                 atom.core_req |= BASE_JD_REQ_CS | BASE_JD_REQ_T;
 
+        /* Dependencies on atoms earlier in the same ioctl work, as kbase
+         * handles the atoms in order */
+        if (q) {
+                util_dynarray_append(&q->atoms, struct base_jd_atom_v2, atom);
+                return atom.atom_number;
+        }
+
         struct kbase_ioctl_job_submit submit = {
                 .nr_atoms = 1,
                 .stride = sizeof(atom),
@@ -1215,8 +2104,6 @@ kbase_submit(kbase k, uint64_t va, unsigned req,
 
         int ret = kbase_ioctl(k->fd, KBASE_IOCTL_JOB_SUBMIT, &submit);
 
-        util_dynarray_fini(&extres);
-
         if (ret == -1) {
                 perror("ioctl(KBASE_IOCTL_JOB_SUBMIT)");
                 return -1;
@@ -1225,11 +2112,42 @@ kbase_submit(kbase k, uint64_t va, unsigned req,
         return atom.atom_number;
 }
 
+static bool
+kbase_submit_queue(kbase k, struct kbase_atom_queue *q)
+{
+        unsigned count = util_dynarray_num_elements(&q->atoms,
+                                                    struct base_jd_atom_v2);
+
+        if (!count)
+                return true;
+
+        struct kbase_ioctl_job_submit submit = {
+                .nr_atoms = count,
+                .stride = sizeof(struct base_jd_atom_v2),
+                .addr = (uintptr_t) util_dynarray_begin(&q->atoms),
+        };
+
+        int ret = kbase_ioctl(k->fd, KBASE_IOCTL_JOB_SUBMIT, &submit);
+
+        util_dynarray_clear(&q->atoms);
+
+        if (ret == -1) {
+                perror("ioctl(KBASE_IOCTL_JOB_SUBMIT)");
+                return false;
+        }
+
+        return true;
+}
+
 #else
 static struct kbase_context *
-kbase_context_create(kbase k)
+kbase_context_create(kbase k, enum kbase_context_priority priority,
+                     uint64_t core_mask)
 {
         struct kbase_context *c = calloc(1, sizeof(*c));
+        c->kcpu_fence = -1;
+        c->priority = priority;
+        c->core_mask = core_mask;
 
         if (!cs_group_create(k, c)) {
                 free(c);
@@ -1245,6 +2163,17 @@ kbase_context_create(kbase k)
         return c;
 }
 
+static struct kbase_context *
+kbase_kcpu_context_create(kbase k)
+{
+        /* The queue is created on first use, and context_destroy skips the
+         * group and heap when they were never created. */
+        struct kbase_context *c = calloc(1, sizeof(*c));
+        c->kcpu_fence = -1;
+
+        return c;
+}
+
 static void
 kbase_kcpu_queue_destroy(kbase k, struct kbase_context *ctx);
 
@@ -1262,17 +2191,24 @@ kbase_context_recreate(kbase k, struct kbase_context *ctx)
 {
         kbase_kcpu_queue_destroy(k, ctx);
         tiler_heap_term(k, ctx);
+
+        /* A fault takes down every queue of the group, so the contexts
+         * sharing it will be recreated as well, in a new group */
+        if (ctx->group) {
+                pthread_mutex_lock(&k->group_lock);
+                ctx->group->dead = true;
+                pthread_mutex_unlock(&k->group_lock);
+        }
+
         cs_group_term(k, ctx);
 
-        if (!cs_group_create(k, ctx)) {
-                free(ctx);
+        /* On failure the context stays allocated, the caller still owns it
+         * and destroys it as usual */
+        if (!cs_group_create(k, ctx))
                 return false;
-        }
 
-        if (!tiler_heap_create(k, ctx)) {
-                free(ctx);
+        if (!tiler_heap_create(k, ctx))
                 return false;
-        }
 
         return true;
 }
@@ -1333,24 +2269,58 @@ kbase_cs_bind_noevent(kbase k, struct kbase_context *ctx,
         return cs;
 }
 
+/* Returns the lowest free event slot, so that the event memory only grows
+ * once every freed slot is in use again. Called with queue_lock held. */
+static int
+kbase_event_slot_alloc(kbase k)
+{
+        for (unsigned i = 0; i < BITSET_WORDS(KBASE_MAX_EVENT_SLOTS); ++i) {
+                BITSET_WORD avail = ~k->event_slots_used[i];
+
+                if (!avail)
+                        continue;
+
+                unsigned slot = i * BITSET_WORDBITS + ffs(avail) - 1;
+
+                if (!kbase_event_slots_grow(k, MAX2(slot + 1, k->event_slot_usage)))
+                        return -1;
+
+                BITSET_SET(k->event_slots_used, slot);
+                return slot;
+        }
+
+        return -1;
+}
+
 static struct kbase_cs
 kbase_cs_bind(kbase k, struct kbase_context *ctx,
               base_va va, unsigned size)
 {
-        struct kbase_cs cs = kbase_cs_bind_noevent(k, ctx, va, size, ctx->num_csi++);
+        pthread_mutex_lock(&k->queue_lock);
+        int event_slot = kbase_event_slot_alloc(k);
+        pthread_mutex_unlock(&k->queue_lock);
 
-        // TODO: Fix this problem properly
-        if (k->event_slot_usage >= 256) {
-                fprintf(stderr, "error: Too many contexts created!\n");
+        if (event_slot < 0) {
+                fprintf(stderr, "error: Too many queues created!\n");
 
-                /* *very* dangerous, but might just work */
-                --k->event_slot_usage;
+                /* Not bound, so that cs_term leaves the slots alone */
+                return (struct kbase_cs) {
+                        .ctx = ctx,
+                        .va = va,
+                        .size = size,
+                        .event_mem_offset = KBASE_MAX_EVENT_SLOTS,
+                };
         }
 
+        struct kbase_cs cs = kbase_cs_bind_noevent(k, ctx, va, size,
+                                                   ctx->csi_base + ctx->num_csi++);
+
         // TODO: This is a misnomer... it isn't a byte offset
-        cs.event_mem_offset = k->event_slot_usage++;
-        k->event_slots[cs.event_mem_offset].back =
-                &k->event_slots[cs.event_mem_offset].syncobjs;
+        cs.event_mem_offset = event_slot;
+
+        struct kbase_event_slot *slot = kbase_event_slot(k, event_slot);
+        slot->syncobjs = NULL;
+        slot->back = &slot->syncobjs;
 
         uint64_t *event_data = k->event_mem.cpu + cs.event_mem_offset * PAN_EVENT_SIZE;
 
@@ -1365,9 +2335,10 @@ kbase_cs_bind(kbase k, struct kbase_context *ctx,
         kcpu_data[0] = 0;
         kcpu_data[1] = 0;
 
-        /* To match the event data */
-        k->event_slots[cs.event_mem_offset].last = 1;
-        k->event_slots[cs.event_mem_offset].last_submit = 1;
+        /* To match the event data. When the slot is reused, usages of BOs
+         * by the old queue look either complete or not submitted yet. */
+        slot->last = 1;
+        slot->last_submit = 1;
 
         return cs;
 }
@@ -1387,24 +2358,48 @@ kbase_cs_term(kbase k, struct kbase_cs *cs)
 
         kbase_ioctl(k->fd, KBASE_IOCTL_CS_QUEUE_TERMINATE, &term);
 
+        if (cs->event_mem_offset >= k->event_slot_usage)
+                return;
+
+        struct kbase_event_slot *slot = kbase_event_slot(k, cs->event_mem_offset);
+
         pthread_mutex_lock(&k->queue_lock);
-        kbase_update_queue_callbacks(k, &k->event_slots[cs->event_mem_offset],
-                                     ~0ULL);
+        kbase_update_queue_callbacks(k, slot, ~0ULL);
 
-        k->event_slots[cs->event_mem_offset].last = ~0ULL;
+        slot->last = ~0ULL;
 
         /* Make sure that no syncobjs are referencing this CS */
         list_for_each_entry(struct kbase_syncobj, o, &k->syncobjs, link)
                 kbase_syncobj_update(k, o);
 
 
-        k->event_slots[cs->event_mem_offset].last = 0;
+        slot->last = 0;
+        kbase_slot_signal(slot);
+        pthread_mutex_unlock(&k->queue_lock);
+}
+
+static void
+kbase_cs_free(kbase k, struct kbase_cs *cs)
+{
+        kbase_cs_term(k, cs);
+
+        if (cs->event_mem_offset >= k->event_slot_usage)
+                return;
+
+        pthread_mutex_lock(&k->queue_lock);
+        BITSET_CLEAR(k->event_slots_used, cs->event_mem_offset);
         pthread_mutex_unlock(&k->queue_lock);
+
+        cs->event_mem_offset = KBASE_MAX_EVENT_SLOTS;
 }
 
 static void
 kbase_cs_rebind(kbase k, struct kbase_cs *cs)
 {
+        /* The context may have been given other queues of a group when it
+         * was recreated */
+        cs->csi = cs->ctx->csi_base + cs->csi % k->cs_queue_count;
+
         struct kbase_cs new;
         new = kbase_cs_bind_noevent(k, cs->ctx, cs->va, cs->size, cs->csi);
 
@@ -1440,6 +2435,50 @@ kbase_cs_kick(kbase k, struct kbase_cs *cs)
 #define CS_WRITE_REGISTER(cs, r, v) \
         *((uint64_t *)(cs->user_io + 4096 + r)) = v
 
+static bool
+kbase_cs_resize(kbase k, struct kbase_cs *cs, base_va va, unsigned size)
+{
+        if (cs->user_io) {
+                LOG("unmapping %p user_io %p\n", cs, cs->user_io);
+                munmap(cs->user_io,
+                       k->page_size * BASEP_QUEUE_NR_MMAP_USER_PAGES);
+        }
+
+        /* Terminating the queue unbinds it from its CSI, so that the new
+         * ring can take its place. The event slot is kept as-is, the
+         * caller is responsible for there being no work in flight. */
+        struct kbase_ioctl_cs_queue_terminate term = {
+                .buffer_gpu_addr = cs->va,
+        };
+
+        kbase_ioctl(k->fd, KBASE_IOCTL_CS_QUEUE_TERMINATE, &term);
+
+        struct kbase_cs new;
+        new = kbase_cs_bind_noevent(k, cs->ctx, va, size, cs->csi);
+
+        cs->va = va;
+        cs->size = size;
+        cs->user_io = new.user_io;
+        cs->last_insert = 0;
+
+        LOG("resized %p to %u bytes, user_io %p\n", cs, size, cs->user_io);
+
+        return cs->user_io != NULL;
+}
+
+static uint64_t
+kbase_cs_extract(kbase k, struct kbase_cs *cs)
+{
+#ifdef PAN_BASE_NOOP
+        return cs->last_insert;
+#else
+        if (!cs->user_io)
+                return cs->last_insert;
+
+        return CS_READ_REGISTER(cs, CS_EXTRACT);
+#endif
+}
+
 static bool
 kbase_cs_submit(kbase k, struct kbase_cs *cs, uint64_t insert_offset,
                 struct kbase_syncobj *o, uint64_t seqnum)
@@ -1453,17 +2492,24 @@ kbase_cs_submit(kbase k, struct kbase_cs *cs, uint64_t insert_offset,
         if (insert_offset == cs->last_insert)
                 return true;
 
-#ifndef PAN_BASE_NOOP
         struct kbase_event_slot *slot =
-                &k->event_slots[cs->event_mem_offset];
+                kbase_event_slot(k, cs->event_mem_offset);
 
         pthread_mutex_lock(&k->queue_lock);
         slot->last_submit = seqnum + 1;
 
         if (o)
                 kbase_syncobj_update_fence(o, cs->event_mem_offset, seqnum);
-        pthread_mutex_unlock(&k->queue_lock);
+
+#ifdef PAN_BASE_NOOP
+        /* Write the seqnum as the CS would once it has run, so that the
+         * next event check retires the work */
+        uint64_t *event_mem = k->event_mem.cpu;
+        p_atomic_set(&event_mem[cs->event_mem_offset * 2], seqnum + 1);
 #endif
+        pthread_mutex_unlock(&k->queue_lock);
+
+        kbase_event_thread_kick(k);
 
         memory_barrier();
 
@@ -1473,14 +2519,24 @@ kbase_cs_submit(kbase k, struct kbase_cs *cs, uint64_t insert_offset,
         CS_WRITE_REGISTER(cs, CS_INSERT, insert_offset);
         cs->last_insert = insert_offset;
 
-        if (false /*active*/) {
+        /* When the CSI is active, its group is resident on a CSG slot and
+         * the doorbell page is mapped to the hardware doorbell, so ringing
+         * it is enough. If the group was descheduled in the meantime, the
+         * doorbell may have gone to the dummy page, so kick to make sure
+         * that the kernel notices the new work. */
+        if (active) {
                 memory_barrier();
                 CS_RING_DOORBELL(cs);
                 memory_barrier();
 
                 active = CS_READ_REGISTER(cs, CS_ACTIVE);
                 LOG("active is now %i\n", active);
+        }
+
+        if (active) {
+                p_atomic_inc(&k->doorbell_count);
         } else {
+                p_atomic_inc(&k->kick_count);
                 kbase_cs_kick(k, cs);
         }
 
@@ -1489,14 +2545,18 @@ kbase_cs_submit(kbase k, struct kbase_cs *cs, uint64_t insert_offset,
 
 static bool
 kbase_cs_wait(kbase k, struct kbase_cs *cs, uint64_t extract_offset,
-              struct kbase_syncobj *o)
+              struct kbase_syncobj *o, int64_t timeout_ns)
 {
         if (!cs->user_io)
                 return false;
 
-        if (kbase_syncobj_wait(k, o))
+        if (kbase_syncobj_wait(k, o, timeout_ns))
                 return true;
 
+        /* Polling is expected to fail, don't complain about it */
+        if (!timeout_ns)
+                return false;
+
         uint64_t e = CS_READ_REGISTER(cs, CS_EXTRACT);
         unsigned a = CS_READ_REGISTER(cs, CS_ACTIVE);
 
@@ -1505,9 +2565,9 @@ kbase_cs_wait(kbase k, struct kbase_cs *cs, uint64_t extract_offset,
                 cs->csi, e, extract_offset, a);
 
         fprintf(stderr, "fences:\n");
-        list_for_each_entry(struct kbase_fence, fence, &o->fences, link) {
+        for (unsigned i = 0; i < o->count; ++i) {
                 fprintf(stderr, " slot %i: seqnum %"PRIu64"\n",
-                        fence->slot, fence->value);
+                        o->fences[i].slot, o->fences[i].value);
         }
 
         return false;
@@ -1541,6 +2601,12 @@ kbase_kcpu_queue_create(kbase k, struct kbase_context *ctx)
 static void
 kbase_kcpu_queue_destroy(kbase k, struct kbase_context *ctx)
 {
+        /* Nothing is left to order after the merged fence */
+        if (ctx->kcpu_fence != -1) {
+                close(ctx->kcpu_fence);
+                ctx->kcpu_fence = -1;
+        }
+
         if (!ctx->kcpu_init)
                 return;
 
@@ -1558,6 +2624,9 @@ kbase_kcpu_queue_destroy(kbase k, struct kbase_context *ctx)
         ctx->kcpu_init = false;
 }
 
+/* How long to wait for space in a full KCPU queue before giving up */
+#define KCPU_ENQUEUE_TIMEOUT_NS 5000000000LL
+
 static bool
 kbase_kcpu_command(kbase k, struct kbase_context *ctx, struct base_kcpu_command *cmd)
 {
@@ -1567,33 +2636,77 @@ kbase_kcpu_command(kbase k, struct kbase_context *ctx, struct base_kcpu_command
         if (!kbase_kcpu_queue_create(k, ctx))
                 return false;
 
+        /* Fence waits are merged and held back until a command which must
+         * be ordered after them, so that they only take up one slot of the
+         * queue */
+        struct base_kcpu_command cmds[2];
+        unsigned count = 0;
+
+        if (ctx->kcpu_fence != -1) {
+                cmds[count++] = (struct base_kcpu_command) {
+                        .type = BASE_KCPU_COMMAND_TYPE_FENCE_WAIT,
+                        .info.fence.fence = (uintptr_t) &(struct base_fence) {
+                                .basep.fd = ctx->kcpu_fence,
+                        },
+                };
+        }
+
+        cmds[count++] = *cmd;
+
         struct kbase_ioctl_kcpu_queue_enqueue enqueue = {
-                .addr = (uintptr_t) cmd,
-                .nr_commands = 1,
+                .addr = (uintptr_t) cmds,
+                .nr_commands = count,
                 .id = ctx->kcpu_queue,
         };
 
         err = kbase_ioctl(k->fd, KBASE_IOCTL_KCPU_QUEUE_ENQUEUE, &enqueue);
-        if (err != -1)
-                return ret;
+        if (err == -1 && errno != EBUSY) {
+                perror("ioctl(KBASE_IOCTL_KCPU_QUEUE_ENQUEUE)");
+                ret = false;
+        } else if (err == -1) {
+                /* The queue is limited to 256 commands. Commands retire as
+                 * GPU work completes, so wait for events, but also poll
+                 * every so often for commands waiting on other fences. */
+                p_atomic_inc(&k->kcpu_stall_count);
+
+                int64_t slice = 100000;
+                int64_t waited = 0;
+
+                while (err == -1 && errno == EBUSY) {
+                        if (waited >= KCPU_ENQUEUE_TIMEOUT_NS) {
+                                fprintf(stderr, "error: KCPU queue %i still full "
+                                        "after %"PRIi64" ms, dropping command\n",
+                                        ctx->kcpu_queue, waited / 1000000);
+                                break;
+                        }
 
-        /* If the enqueue failed, probably we hit the limit of enqueued
-         * commands (256), wait a bit and try again.
-         */
+                        struct kbase_wait_ctx wait = kbase_wait_init(k, slice);
+                        while (kbase_wait_for_event(&wait)) {
+                                err = kbase_ioctl(k->fd, KBASE_IOCTL_KCPU_QUEUE_ENQUEUE,
+                                                  &enqueue);
+                                if (err != -1 || errno != EBUSY)
+                                        break;
+                        }
+                        kbase_wait_fini(wait);
 
-        struct kbase_wait_ctx wait = kbase_wait_init(k, 1000000000);
-        while (kbase_wait_for_event(&wait)) {
-                err = kbase_ioctl(k->fd, KBASE_IOCTL_KCPU_QUEUE_ENQUEUE, &enqueue);
-                if (err != -1)
-                        break;
+                        waited += slice;
+                        slice = MIN2(slice * 2, 10000000);
+                }
 
-                if (errno != EBUSY) {
+                if (err == -1) {
+                        if (errno != EBUSY)
+                                perror("ioctl(KBASE_IOCTL_KCPU_QUEUE_ENQUEUE)");
                         ret = false;
-                        perror("ioctl(KBASE_IOCTL_KCPU_QUEUE_ENQUEUE");
-                        break;
                 }
         }
-        kbase_wait_fini(wait);
+
+        /* The kernel holds its own reference once the wait is enqueued. On
+         * failure it is dropped rather than kept for the next command, as
+         * the caller will not wait for that command either. */
+        if (ctx->kcpu_fence != -1) {
+                close(ctx->kcpu_fence);
+                ctx->kcpu_fence = -1;
+        }
 
         return ret;
 }
@@ -1616,14 +2729,52 @@ kbase_kcpu_fence_export(kbase k, struct kbase_context *ctx)
 static bool
 kbase_kcpu_fence_import(kbase k, struct kbase_context *ctx, int fd)
 {
-        struct base_kcpu_command fence_cmd = {
-                .type = BASE_KCPU_COMMAND_TYPE_FENCE_WAIT,
-                .info.fence.fence = (uintptr_t) &(struct base_fence) {
-                        .basep.fd = fd,
-                },
-        };
+        /* Merging means that fences of a dma-buf used by several batches,
+         * or of many dma-bufs, take a single command. The wait is
+         * enqueued along with the next command. */
+        if (sync_accumulate("panfrost", &ctx->kcpu_fence, fd)) {
+                perror("sync_merge");
+                return false;
+        }
+
+        return true;
+}
+
+static bool
+kbase_kcpu_cqs_wait(kbase k, struct kbase_context *ctx,
+                    base_va addr, uint64_t value);
+
+static int
+kbase_kcpu_syncobj_export(kbase k, struct kbase_context *ctx,
+                          struct kbase_syncobj *o)
+{
+        struct util_dynarray fences;
+        util_dynarray_init(&fences, NULL);
+
+        /* Copy the fences, as KCPU commands can block when the queue is
+         * full, which must not happen with the queue lock held. */
+        pthread_mutex_lock(&k->queue_lock);
+        kbase_syncobj_update(k, o);
+        for (unsigned i = 0; i < o->count; ++i)
+                util_dynarray_append(&fences, struct kbase_fence, o->fences[i]);
+        pthread_mutex_unlock(&k->queue_lock);
+
+        int fd = -1;
+
+        util_dynarray_foreach(&fences, struct kbase_fence, fence) {
+                /* The event memory holds seqnum + 1 once the work is done,
+                 * matching the "greater than" wait condition */
+                base_va addr = k->event_mem.gpu + fence->slot * PAN_EVENT_SIZE;
 
-        return kbase_kcpu_command(k, ctx, &fence_cmd);
+                if (!kbase_kcpu_cqs_wait(k, ctx, addr, fence->value))
+                        goto out;
+        }
+
+        fd = kbase_kcpu_fence_export(k, ctx);
+
+out:
+        util_dynarray_fini(&fences);
+        return fd;
 }
 
 static bool
@@ -1678,10 +2829,11 @@ kbase_callback_all_queues(kbase k, int32_t *count,
         int32_t queue_count = 0;
 
         for (unsigned i = 0; i < k->event_slot_usage; ++i) {
-                struct kbase_event_slot *slot = &k->event_slots[i];
+                struct kbase_event_slot *slot = kbase_event_slot(k, i);
 
                 /* There is no need to do anything for idle slots */
-                if (slot->last == slot->last_submit)
+                if (!BITSET_TEST(k->event_slots_used, i) ||
+                    slot->last == slot->last_submit)
                         continue;
 
                 struct kbase_sync_link *link = malloc(sizeof(*link));
@@ -1740,6 +2892,40 @@ kbase_mem_sync(kbase k, base_va gpu, void *cpu, size_t size,
                 perror("ioctl(KBASE_IOCTL_MEM_SYNC)");
 }
 
+struct kbase_setup_thread {
+        kbase k;
+        pthread_t thread;
+        unsigned first;
+        bool started;
+        bool running;
+        bool ok;
+};
+
+static void *
+kbase_setup_thread(void *data)
+{
+        struct kbase_setup_thread *s = data;
+
+        for (unsigned i = s->first; i < ARRAY_SIZE(kbase_main); ++i) {
+                if (kbase_main[i].async && !kbase_main[i].part(s->k)) {
+                        s->ok = false;
+                        break;
+                }
+        }
+
+        return NULL;
+}
+
+static bool
+kbase_setup_join(struct kbase_setup_thread *s)
+{
+        if (s->running)
+                pthread_join(s->thread, NULL);
+
+        s->running = false;
+        return s->ok;
+}
+
 bool
 #if defined(PAN_BASE_NOOP)
 kbase_open_csf_noop
@@ -1758,6 +2944,7 @@ kbase_open_csf
         pthread_mutex_init(&k->event_read_lock, NULL);
         pthread_mutex_init(&k->event_cnd_lock, NULL);
         pthread_mutex_init(&k->queue_lock, NULL);
+        pthread_mutex_init(&k->group_lock, NULL);
 
         pthread_condattr_t attr;
         pthread_condattr_init(&attr);
@@ -1766,6 +2953,8 @@ kbase_open_csf
         pthread_condattr_destroy(&attr);
 
         list_inithead(&k->syncobjs);
+        list_inithead(&k->syncobj_cache);
+        list_inithead(&k->groups);
 
         /* For later APIs, we've already checked the version in pan_base.c */
 #if PAN_BASE_API == 0
@@ -1779,8 +2968,14 @@ kbase_open_csf
         k->get_mali_gpuprop = kbase_get_mali_gpuprop;
 
         k->alloc = kbase_alloc;
+        k->alloc_reserve = kbase_alloc_reserve;
         k->free = kbase_free;
+        k->mem_commit = kbase_mem_commit;
+        k->mem_evictable = kbase_mem_evictable;
         k->import_dmabuf = kbase_import_dmabuf;
+#if PAN_BASE_API >= 2
+        k->import_user = kbase_import_user;
+#endif
         k->mmap_import = kbase_mmap_import;
 
         k->poll_event = kbase_poll_event;
@@ -1788,19 +2983,28 @@ kbase_open_csf
 
 #if PAN_BASE_API < 2
         k->submit = kbase_submit;
+        k->submit_queue = kbase_submit_queue;
 #else
         k->context_create = kbase_context_create;
+        k->kcpu_context_create = kbase_kcpu_context_create;
         k->context_destroy = kbase_context_destroy;
         k->context_recreate = kbase_context_recreate;
+        k->tiler_heap_recreate = kbase_tiler_heap_recreate;
 
         k->cs_bind = kbase_cs_bind;
         k->cs_term = kbase_cs_term;
+        k->cs_free = kbase_cs_free;
         k->cs_rebind = kbase_cs_rebind;
+        k->cs_resize = kbase_cs_resize;
+        k->cs_extract = kbase_cs_extract;
         k->cs_submit = kbase_cs_submit;
         k->cs_wait = kbase_cs_wait;
 
+        k->read_timestamp = kbase_read_timestamp;
+
         k->kcpu_fence_export = kbase_kcpu_fence_export;
         k->kcpu_fence_import = kbase_kcpu_fence_import;
+        k->kcpu_syncobj_export = kbase_kcpu_syncobj_export;
         k->kcpu_cqs_set = kbase_kcpu_cqs_set;
         k->kcpu_cqs_wait = kbase_kcpu_cqs_wait;
 #endif
@@ -1808,18 +3012,41 @@ kbase_open_csf
         k->syncobj_create = kbase_syncobj_create;
         k->syncobj_destroy = kbase_syncobj_destroy;
         k->syncobj_dup = kbase_syncobj_dup;
+        k->syncobj_add_point = kbase_syncobj_add_point;
+        k->syncobj_get_points = kbase_syncobj_get_points;
         k->syncobj_wait = kbase_syncobj_wait;
 
         k->callback_all_queues = kbase_callback_all_queues;
 
         k->mem_sync = kbase_mem_sync;
 
+        struct kbase_setup_thread setup = { .k = k, .ok = true };
+
         for (unsigned i = 0; i < ARRAY_SIZE(kbase_main); ++i) {
                 ++k->setup_state;
+
+                if (kbase_main[i].async && !setup.started) {
+                        setup.first = i;
+                        setup.started = true;
+                        setup.running = !pthread_create(&setup.thread, NULL,
+                                                        kbase_setup_thread,
+                                                        &setup);
+                }
+
+                if (kbase_main[i].async && setup.running)
+                        continue;
+
                 if (!kbase_main[i].part(k)) {
+                        kbase_setup_join(&setup);
                         k->close(k);
                         return false;
                 }
         }
+
+        if (!kbase_setup_join(&setup)) {
+                k->close(k);
+                return false;
+        }
+
         return true;
 }
@@ -97,14 +97,9 @@ bi_instr * bi_${opcode.replace('.', '_').lower()}${to_suffix(ops[opcode])}(${sig
     nr_dests = "nr_dests" if op["variable_dests"] else op["dests"]
     nr_srcs = "nr_srcs" if op["variable_srcs"] else src_count(op)
 %>
-    size_t size = sizeof(bi_instr) + sizeof(bi_index) * (${nr_dests} + ${nr_srcs});
-    bi_instr *I = (bi_instr *) rzalloc_size(b->shader, size);
+    bi_instr *I = bi_alloc_instr(b->shader, ${nr_dests}, ${nr_srcs});
 
     I->op = BI_OPCODE_${opcode.replace('.', '_').upper()};
-    I->nr_dests = ${nr_dests};
-    I->nr_srcs = ${nr_srcs};
-    I->dest = (bi_index *) (&I[1]);
-    I->src = I->dest + ${nr_dests};
 
 % if not op["variable_dests"]:
 % for dest in range(op["dests"]):
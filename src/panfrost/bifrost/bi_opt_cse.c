@@ -29,8 +29,8 @@
 #include "util/xxhash.h"
 
 /* This pass handles CSE'ing repeated expressions created in the process of
- * translating from NIR. Also, currently this is intra-block only, to make it
- * work over multiple block we'd need to bring forward dominance calculation.
+ * translating from NIR. It works globally, walking the dominance tree so an
+ * expression is available in every block dominated by the one computing it.
  */
 
 static inline uint32_t
@@ -142,44 +142,97 @@ instr_can_cse(const bi_instr *I)
         return true;
 }
 
-void
-bi_opt_cse(bi_context *ctx)
+/* Phis only mean the same thing within a block, and cross-lane instructions
+ * read other lanes of sources that may have diverged by the time a dominated
+ * block is reached, so only CSE those locally */
+
+static bool
+instr_is_block_local(const bi_instr *I)
 {
-        struct set *instr_set = _mesa_set_create(NULL, hash_instr, instrs_equal);
+        switch (I->op) {
+        case BI_OPCODE_PHI:
+        case BI_OPCODE_CLPER_I32:
+        case BI_OPCODE_CLPER_OLD_I32:
+        case BI_OPCODE_WMASK:
+                return true;
+        default:
+                return false;
+        }
+}
 
-        bi_foreach_block(ctx, block) {
-                bi_index *replacement = calloc(sizeof(bi_index), ctx->ssa_alloc);
-                _mesa_set_clear(instr_set, NULL);
+static void
+rewrite_srcs(bi_instr *I, const bi_index *replacement)
+{
+        bi_foreach_ssa_src(I, s) {
+                if (bi_is_staging_src(I, s))
+                        continue;
 
-                bi_foreach_instr_in_block(block, instr) {
-                        /* Rewrite before trying to CSE anything so we converge
-                         * locally in one iteration */
-                        bi_foreach_ssa_src(instr, s) {
-                                if (bi_is_staging_src(instr, s))
-                                        continue;
+                bi_index repl = replacement[I->src[s].value];
+                if (!bi_is_null(repl))
+                        bi_replace_src(I, s, repl);
+        }
+}
 
-                                bi_index repl = replacement[instr->src[s].value];
-                                if (!bi_is_null(repl))
-                                        bi_replace_src(instr, s, repl);
+static void
+cse_block(bi_block *block, struct set *instr_set, struct set *local_set,
+          bi_index *replacement)
+{
+        struct util_dynarray added;
+        util_dynarray_init(&added, NULL);
+        _mesa_set_clear(local_set, NULL);
+
+        bi_foreach_instr_in_block(block, instr) {
+                /* Rewrite before trying to CSE anything so we converge
+                 * in one iteration */
+                rewrite_srcs(instr, replacement);
+
+                if (!instr_can_cse(instr))
+                        continue;
+
+                bool local = instr_is_block_local(instr);
+                bool found;
+                struct set_entry *entry =
+                        _mesa_set_search_or_add(local ? local_set : instr_set,
+                                                instr, &found);
+                if (found) {
+                        const bi_instr *match = entry->key;
+
+                        bi_foreach_dest(instr, d) {
+                                replacement[instr->dest[d].value] = match->dest[d];
                         }
+                } else if (!local) {
+                        util_dynarray_append(&added, bi_instr *, instr);
+                }
+        }
 
-                        if (!instr_can_cse(instr))
-                                continue;
+        util_dynarray_foreach(&block->dom_children, bi_block *, child)
+                cse_block(*child, instr_set, local_set, replacement);
 
-                        bool found;
-                        struct set_entry *entry =
-                                _mesa_set_search_or_add(instr_set, instr, &found);
-                        if (found) {
-                                const bi_instr *match = entry->key;
+        /* Expressions from this block are not available to its siblings */
+        util_dynarray_foreach(&added, bi_instr *, instr)
+                _mesa_set_remove_key(instr_set, *instr);
 
-                                bi_foreach_dest(instr, d) {
-                                        replacement[instr->dest[d].value] = match->dest[d];
-                                }
-                        }
-                }
+        util_dynarray_fini(&added);
+}
+
+void
+bi_opt_cse(bi_context *ctx)
+{
+        struct set *instr_set = _mesa_set_create(NULL, hash_instr, instrs_equal);
+        struct set *local_set = _mesa_set_create(NULL, hash_instr, instrs_equal);
+        bi_index *replacement = calloc(sizeof(bi_index), ctx->ssa_alloc);
+
+        bi_calc_dominance(ctx);
+        cse_block(bi_start_block(&ctx->blocks), instr_set, local_set,
+                  replacement);
 
-                free(replacement);
+        /* Phis read values along back edges, which are visited after them */
+        bi_foreach_instr_global(ctx, I) {
+                if (I->op == BI_OPCODE_PHI)
+                        rewrite_srcs(I, replacement);
         }
 
+        free(replacement);
         _mesa_set_destroy(instr_set, NULL);
+        _mesa_set_destroy(local_set, NULL);
 }
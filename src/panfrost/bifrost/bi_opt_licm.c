@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2022 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+
+#include "compiler.h"
+#include "bi_builder.h"
+
+/*
+ * Loop-invariant code motion. NIR hoists what it can, but lowering creates
+ * new arithmetic inside loops: address calculations from push UBO and FAU
+ * lowering, immediate moves, and the like. Hoist pure arithmetic whose sources
+ * are all defined outside the loop into the preheader.
+ *
+ * Control flow is structured, so a loop is the range of blocks in source
+ * order from its header to the last block jumping back to it. Inner loops
+ * come after outer loops, so visiting headers in reverse order lets an
+ * invariant move out of a whole nest.
+ */
+
+static bool
+bi_instr_can_hoist(const bi_instr *I)
+{
+        switch (I->op) {
+        case BI_OPCODE_PHI:
+        case BI_OPCODE_DTSEL_IMM:
+        case BI_OPCODE_DISCARD_F32:
+        case BI_OPCODE_CLPER_I32:
+        case BI_OPCODE_CLPER_OLD_I32:
+        case BI_OPCODE_WMASK:
+        case BI_OPCODE_JUMP:
+                return false;
+        default:
+                break;
+        }
+
+        if (bi_opcode_props[I->op].message || bi_opcode_props[I->op].branch)
+                return false;
+
+        if (I->branch_target || bi_side_effects(I))
+                return false;
+
+        bi_foreach_dest(I, d) {
+                if (I->dest[d].type != BI_INDEX_NORMAL)
+                        return false;
+        }
+
+        bi_foreach_src(I, s) {
+                if (I->src[s].type == BI_INDEX_REGISTER)
+                        return false;
+        }
+
+        return true;
+}
+
+static bool
+bi_is_loop_invariant(const bi_instr *I, bi_block **def_block,
+                     const unsigned *order, unsigned header, unsigned end)
+{
+        bi_foreach_ssa_src(I, s) {
+                bi_block *def = def_block[I->src[s].value];
+
+                if (def && order[def->index] >= header &&
+                    order[def->index] <= end)
+                        return false;
+        }
+
+        return true;
+}
+
+void
+bi_opt_licm(bi_context *ctx)
+{
+        bi_block **blocks = calloc(ctx->num_blocks, sizeof(bi_block *));
+        unsigned *order = calloc(ctx->num_blocks, sizeof(unsigned));
+        bi_block **def_block = calloc(ctx->ssa_alloc, sizeof(bi_block *));
+        unsigned nr_blocks = 0;
+
+        bi_calc_dominance(ctx);
+
+        bi_foreach_block(ctx, block) {
+                order[block->index] = nr_blocks;
+                blocks[nr_blocks++] = block;
+
+                bi_foreach_instr_in_block(block, I) {
+                        bi_foreach_dest(I, d) {
+                                if (bi_is_ssa(I->dest[d]))
+                                        def_block[I->dest[d].value] = block;
+                        }
+                }
+        }
+
+        for (unsigned h = nr_blocks; h-- > 0; ) {
+                bi_block *header = blocks[h];
+                bi_block *preheader = NULL;
+                unsigned nr_entries = 0, end = h;
+                bool loop = false;
+
+                bi_foreach_predecessor(header, pred) {
+                        unsigned p = order[(*pred)->index];
+
+                        if (p >= h) {
+                                end = MAX2(end, p);
+                                loop = true;
+                        } else {
+                                preheader = *pred;
+                                nr_entries++;
+                        }
+                }
+
+                if (!loop || nr_entries != 1 ||
+                    bi_num_successors(preheader) != 1)
+                        continue;
+
+                for (unsigned b = h; b <= end; ++b) {
+                        bi_block *block = blocks[b];
+
+                        /* Only hoist out of blocks that run on every
+                         * iteration, so nothing is computed that the loop
+                         * would not have computed anyway */
+                        bool every_iteration = true;
+
+                        bi_foreach_predecessor(header, pred) {
+                                if (order[(*pred)->index] >= h)
+                                        every_iteration &= bi_block_dominates(block, *pred);
+                        }
+
+                        if (!every_iteration)
+                                continue;
+
+                        bi_foreach_instr_in_block_safe(block, I) {
+                                if (!bi_instr_can_hoist(I) ||
+                                    !bi_is_loop_invariant(I, def_block, order, h, end))
+                                        continue;
+
+                                bi_remove_instruction(I);
+
+                                bi_cursor cursor = bi_after_block_logical(preheader);
+                                bi_builder_insert(&cursor, I);
+
+                                bi_foreach_dest(I, d)
+                                        def_block[I->dest[d].value] = preheader;
+                        }
+                }
+        }
+
+        free(def_block);
+        free(order);
+        free(blocks);
+}
@@ -29,7 +29,11 @@
  * 1. +LD_VAR_IMM, register_format f32/f16, sample mode
  * 2. +VAR_TEX, register format f32/f16, sample mode (TODO)
  *
- * Analyze the shader for these instructions and push accordingly.
+ * Analyze the shader for these instructions and push accordingly. Preloaded
+ * messages are sent for every thread before the shader starts, so they may
+ * come from any block every thread executes, that is any block dominating the
+ * end of the shader. Textures are preferred, since they have the longest
+ * latency to hide.
  */
 
 static bool
@@ -86,67 +90,83 @@ bi_is_var_tex(enum bi_opcode op)
         return (op == BI_OPCODE_VAR_TEX_F32) || (op == BI_OPCODE_VAR_TEX_F16);
 }
 
+static void
+bi_preload_message(bi_context *ctx, bi_instr *I, unsigned index)
+{
+        struct bifrost_message_preload msg;
+
+        if (bi_is_var_tex(I->op)) {
+                msg = (struct bifrost_message_preload) {
+                        .enabled = true,
+                        .texture = true,
+                        .varying_index = I->varying_index,
+                        .texture_index = I->texture_index,
+                        .fp16 = (I->op == BI_OPCODE_VAR_TEX_F16),
+                        .skip = I->skip,
+                        .zero_lod = I->lod_mode
+                };
+        } else {
+                msg = (struct bifrost_message_preload) {
+                        .enabled = true,
+                        .varying_index = I->varying_index,
+                        .fp16 = (I->register_format == BI_REGISTER_FORMAT_F16),
+                        .num_components = I->vecsize + 1
+                };
+        }
+
+        /* Report the preloading */
+        ctx->info.bifrost->messages[index] = msg;
+
+        /* Replace with a collect of preloaded registers. The collect kills
+         * the moves, so the collect is free (it is coalesced).
+         */
+        bi_builder b = bi_init_builder(ctx, bi_before_instr(I));
+
+        unsigned nr = bi_count_write_registers(I, 0);
+        bi_instr *collect = bi_collect_i32_to(&b, I->dest[0], nr);
+
+        /* The registers themselves must be preloaded at the start of the
+         * program. Preloaded registers are coalesced, so these moves are free.
+         */
+        b.cursor = bi_before_block(bi_start_block(&ctx->blocks));
+        bi_foreach_src(collect, i) {
+                unsigned reg = (index * 4) + i;
+
+                collect->src[i] = bi_mov_i32(&b, bi_register(reg));
+        }
+
+        bi_remove_instruction(I);
+}
+
 void
 bi_opt_message_preload(bi_context *ctx)
 {
         unsigned nr_preload = 0;
+        bi_block *end = list_last_entry(&ctx->blocks, bi_block, link);
 
-        /* We only preload from the first block */
-        bi_block *block = bi_start_block(&ctx->blocks);
-        bi_builder b = bi_init_builder(ctx, bi_before_nonempty_block(block));
-
-        bi_foreach_instr_in_block_safe(block, I) {
-                if (I->nr_dests != 1) continue;
-
-                struct bifrost_message_preload msg;
-
-                if (bi_can_preload_ld_var(I)) {
-                        msg = (struct bifrost_message_preload) {
-                                .enabled = true,
-                                .varying_index = I->varying_index,
-                                .fp16 = (I->register_format == BI_REGISTER_FORMAT_F16),
-                                .num_components = I->vecsize + 1
-                        };
-                } else if (bi_is_var_tex(I->op)) {
-                        msg = (struct bifrost_message_preload) {
-                                .enabled = true,
-                                .texture = true,
-                                .varying_index = I->varying_index,
-                                .texture_index = I->texture_index,
-                                .fp16 = (I->op == BI_OPCODE_VAR_TEX_F16),
-                                .skip = I->skip,
-                                .zero_lod = I->lod_mode
-                        };
-                } else {
-                        continue;
-                }
-
-                /* Report the preloading */
-                ctx->info.bifrost->messages[nr_preload] = msg;
+        bi_calc_dominance(ctx);
 
-                /* Replace with a collect of preloaded registers. The collect
-                 * kills the moves, so the collect is free (it is coalesced).
-                 */
-                b.cursor = bi_before_instr(I);
+        /* Textures first, then varyings */
+        for (unsigned pass = 0; pass < 2; ++pass) {
+                bool texture = (pass == 0);
 
-                unsigned nr = bi_count_write_registers(I, 0);
-                bi_instr *collect = bi_collect_i32_to(&b, I->dest[0], nr);
+                bi_foreach_block(ctx, block) {
+                        if (!bi_block_dominates(block, end))
+                                continue;
 
-                /* The registers themselves must be preloaded at the start of
-                 * the program. Preloaded registers are coalesced, so these
-                 * moves are free.
-                 */
-                b.cursor = bi_before_block(block);
-                bi_foreach_src(collect, i) {
-                        unsigned reg = (nr_preload * 4) + i;
+                        bi_foreach_instr_in_block_safe(block, I) {
+                                if (I->nr_dests != 1) continue;
 
-                        collect->src[i] = bi_mov_i32(&b, bi_register(reg));
-                }
+                                if (texture ? !bi_is_var_tex(I->op) :
+                                              !bi_can_preload_ld_var(I))
+                                        continue;
 
-                bi_remove_instruction(I);
+                                bi_preload_message(ctx, I, nr_preload);
 
-                /* Maximum number of preloaded messages */
-                if ((++nr_preload) == 2)
-                        break;
+                                /* Maximum number of preloaded messages */
+                                if ((++nr_preload) == 2)
+                                        return;
+                        }
+                }
         }
 }
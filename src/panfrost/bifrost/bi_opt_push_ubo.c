@@ -50,8 +50,11 @@ bi_is_direct_aligned_ubo(bi_instr *ins)
 #define MAX_UBO_WORDS (65536 / 16)
 
 struct bi_ubo_block {
+        /* Starts of ranges that were pushed, to rewrite loads */
         BITSET_DECLARE(pushed, MAX_UBO_WORDS);
+
         uint8_t range[MAX_UBO_WORDS];
+        uint32_t weight[MAX_UBO_WORDS];
 };
 
 struct bi_ubo_analysis {
@@ -69,60 +72,68 @@ bi_analyze_ranges(bi_context *ctx)
 
         res.blocks = calloc(res.nr_blocks, sizeof(struct bi_ubo_block));
 
-        bi_foreach_instr_global(ctx, ins) {
-                if (!bi_is_direct_aligned_ubo(ins)) continue;
+        bi_foreach_block(ctx, block) {
+                bi_foreach_instr_in_block(block, ins) {
+                        if (!bi_is_direct_aligned_ubo(ins)) continue;
 
-                unsigned ubo = ins->src[1].value;
-                unsigned word = ins->src[0].value / 4;
-                unsigned channels = bi_opcode_props[ins->op].sr_count;
+                        unsigned ubo = ins->src[1].value;
+                        unsigned word = ins->src[0].value / 4;
+                        unsigned channels = bi_opcode_props[ins->op].sr_count;
 
-                assert(ubo < res.nr_blocks);
-                assert(channels > 0 && channels <= 4);
+                        assert(ubo < res.nr_blocks);
+                        assert(channels > 0 && channels <= 4);
 
-                if (word >= MAX_UBO_WORDS) continue;
+                        if (word + channels > MAX_UBO_WORDS) continue;
 
-                /* Must use max if the same base is read with different channel
-                 * counts, which is possible with nir_opt_shrink_vectors */
-                uint8_t *range = res.blocks[ubo].range;
-                range[word] = MAX2(range[word], channels);
+                        /* Must use max if the same base is read with different
+                         * channel counts, which is possible with
+                         * nir_opt_shrink_vectors */
+                        uint8_t *range = res.blocks[ubo].range;
+                        range[word] = MAX2(range[word], channels);
+                        res.blocks[ubo].weight[word] += pan_ubo_load_weight(block->loop_nesting);
+                }
         }
 
         return res;
 }
 
-/* Select UBO words to push. A sophisticated implementation would consider the
- * number of uses and perhaps the control flow to estimate benefit. This is not
- * sophisticated. Select from the last UBO first to prioritize sysvals. */
+/* Select UBO words to push with the planner shared with Midgard */
 
 static void
 bi_pick_ubo(struct panfrost_ubo_push *push, struct bi_ubo_analysis *analysis)
 {
+        struct util_dynarray ranges;
+        util_dynarray_init(&ranges, NULL);
+
         for (signed ubo = analysis->nr_blocks - 1; ubo >= 0; --ubo) {
                 struct bi_ubo_block *block = &analysis->blocks[ubo];
 
                 for (unsigned r = 0; r < MAX_UBO_WORDS; ++r) {
-                        unsigned range = block->range[r];
-
                         /* Don't push something we don't access */
-                        if (range == 0) continue;
+                        if (block->range[r] == 0) continue;
 
-                        /* Don't push more than possible */
-                        if (push->count > PAN_MAX_PUSH - range)
-                                return;
+                        struct pan_ubo_range range = {
+                                .ubo = ubo,
+                                .word = r,
+                                .nr_words = block->range[r],
+                                .weight = block->weight[r],
+                        };
 
-                        for (unsigned offs = 0; offs < range; ++offs) {
-                                struct panfrost_ubo_word word = {
-                                        .ubo = ubo,
-                                        .offset = (r + offs) * 4
-                                };
+                        util_dynarray_append(&ranges, struct pan_ubo_range, range);
+                }
+        }
 
-                                push->words[push->count++] = word;
-                        }
+        pan_pick_ubo_ranges(push, ranges.data,
+                            util_dynarray_num_elements(&ranges, struct pan_ubo_range),
+                            PAN_MAX_PUSH);
 
-                        /* Mark it as pushed so we can rewrite */
-                        BITSET_SET(block->pushed, r);
-                }
+        /* Mark the pushed ranges so we can rewrite */
+        util_dynarray_foreach(&ranges, struct pan_ubo_range, r) {
+                if (r->pushed)
+                        BITSET_SET(analysis->blocks[r->ubo].pushed, r->word);
         }
+
+        util_dynarray_fini(&ranges);
 }
 
 void
@@ -37,35 +37,35 @@ struct sched_ctx {
         BITSET_WORD *live;
 };
 
-struct sched_node {
-        struct dag_node dag;
-
-        /* Instruction this node represents */
-        bi_instr *instr;
-};
-
 static void
-add_dep(struct sched_node *a, struct sched_node *b)
+add_dep(struct bi_sched_node *a, struct bi_sched_node *b)
 {
         if (a && b)
                 dag_add_edge(&a->dag, &b->dag, 0);
 }
 
-static struct dag *
-create_dag(bi_context *ctx, bi_block *block, void *memctx)
+/* Build the dependency graph of a block, excluding its terminating branches.
+ * Edges point from an instruction to the instructions it must follow, so the
+ * heads are the instructions that may be scheduled last. Nodes are allocated
+ * with node_size bytes, letting schedulers embed bi_sched_node in their own
+ * node structures. */
+
+struct dag *
+bi_create_sched_dag(bi_context *ctx, bi_block *block, void *memctx,
+                    size_t node_size)
 {
         struct dag *dag = dag_create(ctx);
 
-        struct sched_node **last_write =
-                calloc(ctx->ssa_alloc, sizeof(struct sched_node *));
-        struct sched_node *coverage = NULL;
-        struct sched_node *preload = NULL;
+        struct bi_sched_node **last_write =
+                calloc(ctx->ssa_alloc, sizeof(struct bi_sched_node *));
+        struct bi_sched_node *coverage = NULL;
+        struct bi_sched_node *preload = NULL;
 
         /* Last memory load, to serialize stores against */
-        struct sched_node *memory_load = NULL;
+        struct bi_sched_node *memory_load = NULL;
 
         /* Last memory store, to serialize loads and stores against */
-        struct sched_node *memory_store = NULL;
+        struct bi_sched_node *memory_store = NULL;
 
         bi_foreach_instr_in_block(block, I) {
                 /* Leave branches at the end */
@@ -74,7 +74,8 @@ create_dag(bi_context *ctx, bi_block *block, void *memctx)
 
                 assert(I->branch_target == NULL);
 
-                struct sched_node *node = rzalloc(memctx, struct sched_node);
+                assert(node_size >= sizeof(struct bi_sched_node));
+                struct bi_sched_node *node = rzalloc_size(memctx, node_size);
                 node->instr = I;
                 dag_init_node(dag, &node->dag);
 
@@ -180,8 +181,8 @@ create_dag(bi_context *ctx, bi_block *block, void *memctx)
  *
  *      live_in = (live_out - KILL) + GEN
  */
-static signed
-calculate_pressure_delta(bi_instr *I, BITSET_WORD *live)
+signed
+bi_calculate_pressure_delta(bi_instr *I, BITSET_WORD *live)
 {
         signed delta = 0;
 
@@ -213,14 +214,14 @@ calculate_pressure_delta(bi_instr *I, BITSET_WORD *live)
  * Choose the next instruction, bottom-up. For now we use a simple greedy
  * heuristic: choose the instruction that has the best effect on liveness.
  */
-static struct sched_node *
+static struct bi_sched_node *
 choose_instr(struct sched_ctx *s)
 {
         int32_t min_delta = INT32_MAX;
-        struct sched_node *best = NULL;
+        struct bi_sched_node *best = NULL;
 
-        list_for_each_entry(struct sched_node, n, &s->dag->heads, dag.link) {
-                int32_t delta = calculate_pressure_delta(n->instr, s->live);
+        list_for_each_entry(struct bi_sched_node, n, &s->dag->heads, dag.link) {
+                int32_t delta = bi_calculate_pressure_delta(n->instr, s->live);
 
                 if (delta < min_delta) {
                         best = n;
@@ -242,7 +243,7 @@ pressure_schedule_block(bi_context *ctx, bi_block *block, struct sched_ctx *s)
         memcpy(s->live, block->ssa_live_out, BITSET_WORDS(ctx->ssa_alloc) * sizeof(BITSET_WORD));
 
         bi_foreach_instr_in_block_rev(block, I) {
-                pressure += calculate_pressure_delta(I, s->live);
+                pressure += bi_calculate_pressure_delta(I, s->live);
                 orig_max_pressure = MAX2(pressure, orig_max_pressure);
                 bi_liveness_ins_update_ssa(s->live, I);
                 nr_ins++;
@@ -254,12 +255,12 @@ pressure_schedule_block(bi_context *ctx, bi_block *block, struct sched_ctx *s)
         signed max_pressure = 0;
         pressure = 0;
 
-        struct sched_node **schedule = calloc(nr_ins, sizeof(struct sched_node *));
+        struct bi_sched_node **schedule = calloc(nr_ins, sizeof(struct bi_sched_node *));
         nr_ins = 0;
 
         while (!list_is_empty(&s->dag->heads)) {
-                struct sched_node *node = choose_instr(s);
-                pressure += calculate_pressure_delta(node->instr, s->live);
+                struct bi_sched_node *node = choose_instr(s);
+                pressure += bi_calculate_pressure_delta(node->instr, s->live);
                 max_pressure = MAX2(pressure, max_pressure);
                 dag_prune_head(s->dag, &node->dag);
 
@@ -291,7 +292,8 @@ bi_pressure_schedule(bi_context *ctx)
 
         bi_foreach_block(ctx, block) {
                 struct sched_ctx sctx = {
-                        .dag = create_dag(ctx, block, memctx),
+                        .dag = bi_create_sched_dag(ctx, block, memctx,
+                                                   sizeof(struct bi_sched_node)),
                         .live = live
                 };
 
@@ -28,6 +28,7 @@
 #include "nodearray.h"
 #include "bi_builder.h"
 #include "util/u_memory.h"
+#include "util/os_time.h"
 
 struct lcra_state {
         unsigned node_count;
@@ -339,6 +340,32 @@ bi_make_affinity(uint64_t clobber, unsigned count, bool split_file)
 static void
 bi_mark_interference(bi_block *block, struct lcra_state *l, uint8_t *live, uint64_t preload_live, unsigned node_count, bool is_blend, bool split_file, bool aligned_sr)
 {
+        /* Only nodes live out of the block or read within it can be live
+         * anywhere in the block. Gather those once, rather than visiting every
+         * node in the shader for every write, which is quadratic in the size
+         * of the shader. */
+        BITSET_WORD *seen = calloc(BITSET_WORDS(node_count), sizeof(BITSET_WORD));
+        unsigned *nodes = malloc(sizeof(unsigned) * MAX2(node_count, 1));
+        unsigned nr_nodes = 0;
+
+        for (unsigned i = 0; i < node_count; ++i) {
+                if (live[i]) {
+                        BITSET_SET(seen, i);
+                        nodes[nr_nodes++] = i;
+                }
+        }
+
+        bi_foreach_instr_in_block(block, ins) {
+                bi_foreach_ssa_src(ins, s) {
+                        unsigned i = ins->src[s].value;
+
+                        if (!BITSET_TEST(seen, i)) {
+                                BITSET_SET(seen, i);
+                                nodes[nr_nodes++] = i;
+                        }
+                }
+        }
+
         bi_foreach_instr_in_block_rev(block, ins) {
                 /* Mark all registers live after the instruction as
                  * interfering with the destination */
@@ -361,7 +388,8 @@ bi_mark_interference(bi_block *block, struct lcra_state *l, uint8_t *live, uint6
 
                         l->affinity[node] &= affinity;
 
-                        for (unsigned i = 0; i < node_count; ++i) {
+                        for (unsigned k = 0; k < nr_nodes; ++k) {
+                                unsigned i = nodes[k];
                                 uint8_t r = live[i];
 
                                 /* Nodes only interfere if they occupy
@@ -403,9 +431,9 @@ bi_mark_interference(bi_block *block, struct lcra_state *l, uint8_t *live, uint6
                         /* Blend shaders might clobber r0-r15, r48. */
                         uint64_t clobber = BITFIELD64_MASK(16) | BITFIELD64_BIT(48);
 
-                        for (unsigned i = 0; i < node_count; ++i) {
-                                if (live[i])
-                                        l->affinity[i] &= ~clobber;
+                        for (unsigned k = 0; k < nr_nodes; ++k) {
+                                if (live[nodes[k]])
+                                        l->affinity[nodes[k]] &= ~clobber;
                         }
                 }
 
@@ -415,6 +443,9 @@ bi_mark_interference(bi_block *block, struct lcra_state *l, uint8_t *live, uint6
         }
 
         block->reg_live_in = preload_live;
+
+        free(seen);
+        free(nodes);
 }
 
 static void
@@ -600,10 +631,105 @@ bi_rewrite_index_src_single(bi_instr *ins, bi_index old, bi_index new)
         }
 }
 
-/* If register allocation fails, find the best spill node */
+/*
+ * A node may be rematerialized, recomputing it right before each use instead
+ * of spilling it, if it has a single definition writing the whole node without
+ * side effects, from sources that read the same everywhere in the shader:
+ * immediates and uniforms, but not registers, which may be overwritten.
+ * Returns the definition of each node that may be rematerialized.
+ */
+static bi_instr **
+bi_find_remat_defs(bi_context *ctx, unsigned node_count)
+{
+        bi_instr **defs = calloc(node_count, sizeof(bi_instr *));
+        BITSET_WORD *multiple = calloc(BITSET_WORDS(node_count), sizeof(BITSET_WORD));
+
+        bi_foreach_instr_global(ctx, I) {
+                bi_foreach_dest(I, d) {
+                        if (!bi_is_ssa(I->dest[d]))
+                                continue;
+
+                        unsigned node = I->dest[d].value;
+
+                        if (defs[node] || I->nr_dests != 1 || I->dest[d].offset)
+                                BITSET_SET(multiple, node);
+
+                        defs[node] = I;
+                }
+        }
+
+        for (unsigned i = 0; i < node_count; ++i) {
+                bi_instr *I = defs[i];
+
+                if (!I)
+                        continue;
+
+                bool remat = !BITSET_TEST(multiple, i) && !I->no_spill &&
+                             !bi_side_effects(I) &&
+                             bi_opcode_props[I->op].message == BIFROST_MESSAGE_NONE &&
+                             !bi_opcode_props[I->op].branch;
+
+                bi_foreach_src(I, s) {
+                        if (bi_is_ssa(I->src[s]) ||
+                            I->src[s].type == BI_INDEX_REGISTER)
+                                remat = false;
+                }
+
+                if (!remat)
+                        defs[i] = NULL;
+        }
+
+        free(multiple);
+        return defs;
+}
+
+/* Rematerialize a node before each of its uses, and remove its definition */
+
+static void
+bi_remat_node(bi_context *ctx, bi_instr *def, bi_index index)
+{
+        bi_foreach_instr_global_safe(ctx, I) {
+                if (I == def || !bi_has_arg(I, index))
+                        continue;
+
+                bi_instr *clone = bi_alloc_instr(ctx, def->nr_dests,
+                                                 def->nr_srcs);
+                bi_index *dest = clone->dest, *src = clone->src;
+
+                memcpy(clone, def, sizeof(bi_instr));
+                clone->dest = dest;
+                clone->src = src;
+                memcpy(clone->src, def->src, sizeof(bi_index) * def->nr_srcs);
+
+                bi_index tmp = bi_temp(ctx);
+                clone->dest[0] = bi_replace_index(def->dest[0], tmp);
+                clone->no_spill = true;
+
+                list_addtail(&clone->link, &I->link);
+                bi_rewrite_index_src_single(I, index, tmp);
+                ctx->remats++;
+        }
+
+        bi_remove_instruction(def);
+}
+
+/* Constraint counts stay far below 2^31, so the top bit is free to rank
+ * rematerializable nodes first */
+
+static unsigned
+bi_spill_benefit(struct lcra_state *l, bi_instr **remat, unsigned i)
+{
+        unsigned benefit = lcra_count_constraints(l, i);
+
+        return (remat && remat[i]) ? (benefit | (1u << 31)) : benefit;
+}
+
+/* If register allocation fails, find the best spill node. If remat is
+ * non-NULL, rematerializable nodes are preferred, since they need neither
+ * memory nor the extra registers a spill's address can take. */
 
 static signed
-bi_choose_spill_node(bi_context *ctx, struct lcra_state *l)
+bi_choose_spill_node(bi_context *ctx, struct lcra_state *l, bi_instr **remat)
 {
         /* Pick a node satisfying bi_spill_register's preconditions */
         BITSET_WORD *no_spill = calloc(sizeof(BITSET_WORD), BITSET_WORDS(l->node_count));
@@ -639,7 +765,7 @@ bi_choose_spill_node(bi_context *ctx, struct lcra_state *l)
 
                         if (BITSET_TEST(no_spill, i)) continue;
 
-                        unsigned benefit = lcra_count_constraints(l, i);
+                        unsigned benefit = bi_spill_benefit(l, remat, i);
 
                         if (benefit > best_benefit) {
                                 best_benefit = benefit;
@@ -656,7 +782,7 @@ bi_choose_spill_node(bi_context *ctx, struct lcra_state *l)
 
                         if (BITSET_TEST(no_spill, i)) continue;
 
-                        unsigned benefit = lcra_count_constraints(l, i);
+                        unsigned benefit = bi_spill_benefit(l, remat, i);
 
                         if (benefit > best_benefit) {
                                 best_benefit = benefit;
@@ -1059,6 +1185,7 @@ bi_register_allocate(bi_context *ctx)
 {
         struct lcra_state *l = NULL;
         bool success = false;
+        int64_t start = os_time_get_nano();
 
         unsigned iter_count = 1000; /* max iterations */
 
@@ -1093,13 +1220,27 @@ bi_register_allocate(bi_context *ctx)
                 if (success) {
                         ctx->info.work_reg_count = 64;
                 } else {
-                        signed spill_node = bi_choose_spill_node(ctx, l);
+                        bi_instr **remat = NULL;
+
+                        if (bifrost_debug & BIFROST_DBG_REMAT)
+                                remat = bi_find_remat_defs(ctx, l->node_count);
+
+                        signed spill_node = bi_choose_spill_node(ctx, l, remat);
                         lcra_free(l);
                         l = NULL;
 
                         if (spill_node == -1)
                                 unreachable("Failed to choose spill node\n");
 
+                        if (remat && remat[spill_node]) {
+                                bi_remat_node(ctx, remat[spill_node],
+                                              bi_get_index(spill_node));
+                                free(remat);
+                                continue;
+                        }
+
+                        free(remat);
+
                         if (ctx->inputs->is_blend)
                                 unreachable("Blend shaders may not spill");
 
@@ -1128,4 +1269,6 @@ bi_register_allocate(bi_context *ctx)
         bi_install_registers(ctx, l);
 
         lcra_free(l);
+
+        ctx->ra_time_us = (os_time_get_nano() - start) / 1000;
 }
@@ -1250,6 +1250,106 @@ bi_pop_instr(struct bi_clause_state *clause, struct bi_tuple_state *tuple,
                                             BI_FTZ_STATE_DISABLE;
 }
 
+/* Whether an FMA could pair with the ADD instruction add_idx in the tuple,
+ * counting the instructions taking the ADD would make available. Works on
+ * copies of the state, since popping the ADD is destructive. */
+
+static bool
+bi_has_fma_partner(struct bi_worklist st,
+                   const struct bi_clause_state *clause,
+                   const struct bi_tuple_state *tuple,
+                   uint64_t live_after_temp,
+                   unsigned add_idx)
+{
+        struct bi_clause_state clause_copy = *clause;
+        struct bi_tuple_state tuple_copy = *tuple;
+        bi_instr *add = st.instructions[add_idx];
+        unsigned i;
+
+        bi_pop_instr(&clause_copy, &tuple_copy, add, live_after_temp, false);
+        tuple_copy.add = add;
+
+        BITSET_FOREACH_SET(i, st.worklist, st.count) {
+                if (i != add_idx &&
+                    bi_instr_schedulable(st.instructions[i], &clause_copy,
+                                         &tuple_copy, live_after_temp, true))
+                        return true;
+        }
+
+        if (!st.dependents[add_idx])
+                return false;
+
+        BITSET_FOREACH_SET(i, st.dependents[add_idx], st.count) {
+                if (st.dep_counts[i] == 1 &&
+                    bi_instr_schedulable(st.instructions[i], &clause_copy,
+                                         &tuple_copy, live_after_temp, true))
+                        return true;
+        }
+
+        return false;
+}
+
+/* Pair selection for the ADD, which is scheduled first. Greedily taking the
+ * cheapest ADD can leave nothing to pair with it, for instance when it uses
+ * up the register reads or the FAU slot, leaving a NOP in the FMA. Consider
+ * the cheapest few candidates in the order bi_choose_index would, taking the
+ * first that leaves a schedulable FMA. */
+
+#define BI_PAIR_LOOKAHEAD 4
+
+static unsigned
+bi_choose_add_index(struct bi_worklist st,
+                    struct bi_clause_state *clause,
+                    struct bi_tuple_state *tuple,
+                    uint64_t live_after_temp)
+{
+        unsigned best[BI_PAIR_LOOKAHEAD];
+        signed best_cost[BI_PAIR_LOOKAHEAD];
+        unsigned nr_best = 0, i;
+
+        BITSET_FOREACH_SET(i, st.worklist, st.count) {
+                bi_instr *instr = st.instructions[i];
+
+                if (!bi_instr_schedulable(instr, clause, tuple, live_after_temp, false))
+                        continue;
+
+                signed cost = bi_instr_cost(instr, tuple);
+
+                /* Insertion sort, with later instructions first on ties */
+                unsigned pos = 0;
+                while (pos < nr_best && best_cost[pos] < cost)
+                        pos++;
+
+                if (pos == BI_PAIR_LOOKAHEAD)
+                        continue;
+
+                unsigned nr_move = MIN2(nr_best, BI_PAIR_LOOKAHEAD - 1) - pos;
+                memmove(best + pos + 1, best + pos, nr_move * sizeof(best[0]));
+                memmove(best_cost + pos + 1, best_cost + pos,
+                        nr_move * sizeof(best_cost[0]));
+
+                best[pos] = i;
+                best_cost[pos] = cost;
+                nr_best = MIN2(nr_best + 1, BI_PAIR_LOOKAHEAD);
+        }
+
+        if (nr_best == 0)
+                return ~0;
+
+        /* Placement constraints outweigh pairing */
+        bi_instr *first = st.instructions[best[0]];
+
+        if (bi_opcode_props[first->op].last || bi_must_message(first))
+                return best[0];
+
+        for (unsigned j = 0; j < nr_best; ++j) {
+                if (bi_has_fma_partner(st, clause, tuple, live_after_temp, best[j]))
+                        return best[j];
+        }
+
+        return best[0];
+}
+
 /* Choose the best instruction and pop it off the worklist. Returns NULL if no
  * instruction is available. This function is destructive. */
 
@@ -1292,7 +1392,9 @@ bi_take_instr(bi_context *ctx, struct bi_worklist st,
                 return NULL;
 #endif
 
-        unsigned idx = bi_choose_index(st, clause, tuple, live_after_temp, fma);
+        unsigned idx = fma ?
+                bi_choose_index(st, clause, tuple, live_after_temp, true) :
+                bi_choose_add_index(st, clause, tuple, live_after_temp);
 
         if (idx >= st.count)
                 return NULL;
@@ -2090,7 +2192,7 @@ bi_add_nop_for_atest(bi_context *ctx)
         /* Add a NOP so we can wait for the dependencies required by the first
          * clause */
 
-        bi_instr *I = rzalloc(ctx, bi_instr);
+        bi_instr *I = bi_alloc_instr(ctx, 0, 0);
         I->op = BI_OPCODE_NOP;
 
         bi_clause *new_clause = ralloc(ctx, bi_clause);
@@ -30,6 +30,7 @@
 #include "compiler/nir/nir_builder.h"
 #include "compiler/nir/nir_schedule.h"
 #include "util/u_debug.h"
+#include "util/os_time.h"
 
 #include "disassemble.h"
 #include "valhall/va_compiler.h"
@@ -56,6 +57,9 @@ static const struct debug_named_value bifrost_debug_options[] = {
         {"nosb",      BIFROST_DBG_NOSB,         "Disable scoreboarding"},
         {"nopreload", BIFROST_DBG_NOPRELOAD,    "Disable message preloading"},
         {"spill",     BIFROST_DBG_SPILL,        "Test register spilling"},
+        {"remat",     BIFROST_DBG_REMAT,        "Rematerialize values instead of spilling them"},
+        {"nopreamble",BIFROST_DBG_NOPREAMBLE,   "Don't hoist uniform computation to a preamble"},
+        {"passtime",  BIFROST_DBG_PASSTIME,     "Report the time spent in each compiler pass"},
         DEBUG_NAMED_VALUE_END
 };
 
@@ -74,6 +78,58 @@ int bifrost_debug = 0;
 
 static bi_block *emit_cf_list(bi_context *ctx, struct exec_list *list);
 
+/* Time spent in each NIR and backend pass of a shader, summed over every run
+ * of the pass and every variant, reported with BIFROST_MESA_DEBUG=passtime */
+
+#define BI_MAX_TIMED_PASSES 64
+
+struct bi_pass_times {
+        unsigned count;
+
+        struct bi_pass_time {
+                const char *name;
+                int64_t ns;
+                unsigned runs;
+        } passes[BI_MAX_TIMED_PASSES];
+};
+
+static void
+bi_record_pass_time(struct bi_pass_times *times, const char *name,
+                    int64_t start)
+{
+        int64_t ns = os_time_get_nano() - start;
+        unsigned i;
+
+        for (i = 0; i < times->count; ++i) {
+                if (strcmp(times->passes[i].name, name) == 0)
+                        break;
+        }
+
+        if (i == times->count) {
+                if (times->count == BI_MAX_TIMED_PASSES)
+                        return;
+
+                times->passes[times->count++] =
+                        (struct bi_pass_time) { .name = name };
+        }
+
+        times->passes[i].ns += ns;
+        times->passes[i].runs++;
+}
+
+#define BI_TIME_PASS(times, name, ...) do {                             \
+        int64_t _start = (times) ? os_time_get_nano() : 0;              \
+        __VA_ARGS__;                                                    \
+        if (times)                                                      \
+                bi_record_pass_time(times, name, _start);               \
+} while (0)
+
+#define BI_NIR_PASS(times, progress, nir, pass, ...)                    \
+        BI_TIME_PASS(times, #pass, NIR_PASS(progress, nir, pass, ##__VA_ARGS__))
+
+#define BI_PASS(ctx, pass, ...)                                         \
+        BI_TIME_PASS((ctx)->pass_times, #pass, pass(ctx, ##__VA_ARGS__))
+
 static bi_index
 bi_preload(bi_builder *b, unsigned reg)
 {
@@ -437,19 +493,18 @@ bi_emit_load_attr(bi_builder *b, nir_intrinsic_instr *instr)
         bi_index dest = (component == 0) ? bi_dest_index(&instr->dest) : bi_temp(b->shader);
         bi_instr *I;
 
-        /* The attribute offset field was removed from the compute job payload
-         * in v10. */
-        bool needs_offset = b->shader->arch >= 10 &&
-                b->shader->nir->info.has_transform_feedback_varyings;
-
-        bi_index vertex_id = bi_vertex_id_offset(b, needs_offset);
+        /* Transform feedback programs on v10 load attributes for the vertex
+         * they fetched, see pan_lower_xfb_vertex_fetch */
+        bi_index vertex_id =
+                (instr->intrinsic == nir_intrinsic_load_per_vertex_input) ?
+                bi_src_index(&instr->src[0]) : bi_vertex_id(b);
 
         if (immediate) {
                 I = bi_ld_attr_imm_to(b, dest, vertex_id,
                                       bi_instance_id(b), regfmt, vecsize,
                                       imm_index);
         } else {
-                bi_index idx = bi_src_index(&instr->src[0]);
+                bi_index idx = bi_src_index(offset);
 
                 if (constant)
                         idx = bi_imm_u32(imm_index);
@@ -470,7 +525,8 @@ bi_emit_load_attr(bi_builder *b, nir_intrinsic_instr *instr)
  * ABI: Special (desktop GL) slots come first, tightly packed. General varyings
  * come later, sparsely packed. This handles both linked and separable shaders
  * with a common code path, with minimal keying only for desktop GL. Each slot
- * consumes 16 bytes (TODO: fp16, partial vectors).
+ * consumes 16 bytes, except general varyings the vertex shader stores at half
+ * precision which consume 8 (TODO: partial vectors).
  */
 static unsigned
 bi_varying_base_bytes(bi_context *ctx, nir_intrinsic_instr *intr)
@@ -479,15 +535,27 @@ bi_varying_base_bytes(bi_context *ctx, nir_intrinsic_instr *intr)
         uint32_t mask = ctx->inputs->fixed_varying_mask;
 
         if (sem.location >= VARYING_SLOT_VAR0) {
-                unsigned nr_special = util_bitcount(mask);
                 unsigned general_index = (sem.location - VARYING_SLOT_VAR0);
 
-                return 16 * (nr_special + general_index);
+                return pan_varying_general_offset(mask,
+                                                  ctx->inputs->fp16_varying_mask,
+                                                  general_index);
         } else {
                 return 16 * (util_bitcount(mask & BITFIELD_MASK(sem.location)));
         }
 }
 
+/* Whether the varying is stored at half precision in the varying buffer */
+static bool
+bi_varying_is_fp16(bi_context *ctx, nir_intrinsic_instr *intr)
+{
+        nir_io_semantics sem = nir_intrinsic_io_semantics(intr);
+
+        return ctx->malloc_idvs && sem.location >= VARYING_SLOT_VAR0 &&
+               (ctx->inputs->fp16_varying_mask &
+                BITFIELD_BIT(sem.location - VARYING_SLOT_VAR0));
+}
+
 /*
  * Compute the offset in bytes of a varying with an immediate offset, adding the
  * offset to the base computed above. Convenience method.
@@ -543,6 +611,12 @@ bi_emit_load_vary(bi_builder *b, nir_intrinsic_instr *instr)
         enum bi_source_format source_format =
                 smooth ? BI_SOURCE_FORMAT_F32 : BI_SOURCE_FORMAT_FLAT32;
 
+        /* The hardware converts to the destination size as it loads */
+        if (bi_varying_is_fp16(b->shader, instr)) {
+                source_format = smooth ? BI_SOURCE_FORMAT_F16 :
+                                BI_SOURCE_FORMAT_FLAT16;
+        }
+
         nir_src *offset = nir_get_io_offset_src(instr);
         unsigned imm_index = 0;
         bool immediate = bi_is_intr_immediate(instr, &imm_index, 20);
@@ -1090,6 +1164,9 @@ bi_emit_store_vary(bi_builder *b, nir_intrinsic_instr *instr)
 
                 bool varying = (b->shader->idvs == BI_IDVS_VARYING);
 
+                assert(!(varying && bi_varying_is_fp16(b->shader, instr)) ||
+                       T_size == 16);
+
                 bi_store(b, nr * nir_src_bit_size(instr->src[0]),
                          data, a[0], a[1],
                          varying ? BI_SEG_VARY : BI_SEG_POS,
@@ -1612,6 +1689,146 @@ bi_emit_ld_tile(bi_builder *b, nir_intrinsic_instr *instr)
         bi_emit_cached_split(b, dest, size * nr);
 }
 
+/*
+ * Subgroup operations on Valhall. Warps are sixteen lanes, so CLPER with the
+ * sixteen lane subgroup reads any lane of the warp and WMASK gives a ballot.
+ *
+ * Reductions and scans read every lane of the warp in turn rather than using
+ * a butterfly: CLPER returns a fixed value for inactive lanes, and returning
+ * the identity of the operation means lanes outside the current control flow
+ * don't contribute, which a butterfly can't guarantee once lanes are inactive.
+ */
+
+static bi_index
+bi_subgroup_bool(bi_builder *b, nir_src src)
+{
+        bi_index idx = bi_src_index(&src);
+
+        if (nir_src_bit_size(src) == 16)
+                return bi_u16_to_u32(b, bi_half(idx, false));
+        else if (nir_src_bit_size(src) == 8)
+                return bi_u8_to_u32(b, bi_byte(idx, 0));
+
+        return idx;
+}
+
+static bi_index
+bi_subgroup_ballot(bi_builder *b, bi_index cond)
+{
+        return bi_wmask(b, cond, BI_SUBGROUP_SUBGROUP16, 0);
+}
+
+static bi_index
+bi_read_lane(bi_builder *b, bi_index value, bi_index lane,
+             enum bi_inactive_result inactive)
+{
+        return bi_clper_i32(b, value, lane, inactive, BI_LANE_OP_NONE,
+                            BI_SUBGROUP_SUBGROUP16);
+}
+
+static enum bi_inactive_result
+bi_reduction_identity(nir_op op)
+{
+        switch (op) {
+        case nir_op_iadd:
+        case nir_op_ior:
+        case nir_op_ixor:
+        case nir_op_umax:
+        case nir_op_fadd:
+                return BI_INACTIVE_RESULT_ZERO;
+        case nir_op_imul:
+                return BI_INACTIVE_RESULT_I1;
+        case nir_op_fmul:
+                return BI_INACTIVE_RESULT_F1;
+        case nir_op_iand:
+        case nir_op_umin:
+                return BI_INACTIVE_RESULT_UMAX;
+        case nir_op_imin:
+                return BI_INACTIVE_RESULT_SMAX;
+        case nir_op_imax:
+                return BI_INACTIVE_RESULT_SMIN;
+        case nir_op_fmin:
+                return BI_INACTIVE_RESULT_INF;
+        case nir_op_fmax:
+                return BI_INACTIVE_RESULT_INFN;
+        default:
+                unreachable("Invalid reduction op");
+        }
+}
+
+static uint32_t
+bi_reduction_identity_value(nir_op op)
+{
+        switch (bi_reduction_identity(op)) {
+        case BI_INACTIVE_RESULT_ZERO: return 0;
+        case BI_INACTIVE_RESULT_I1:   return 1;
+        case BI_INACTIVE_RESULT_F1:   return 0x3F800000;
+        case BI_INACTIVE_RESULT_UMAX: return UINT32_MAX;
+        case BI_INACTIVE_RESULT_SMAX: return INT32_MAX;
+        case BI_INACTIVE_RESULT_SMIN: return (uint32_t) INT32_MIN;
+        case BI_INACTIVE_RESULT_INF:  return 0x7F800000;
+        case BI_INACTIVE_RESULT_INFN: return 0xFF800000;
+        default: unreachable("Invalid identity");
+        }
+}
+
+static bi_index
+bi_reduction_op(bi_builder *b, nir_op op, bi_index s0, bi_index s1)
+{
+        switch (op) {
+        case nir_op_iadd: return bi_iadd_u32(b, s0, s1, false);
+        case nir_op_imul: return bi_imul_i32(b, s0, s1);
+        case nir_op_iand: return bi_lshift_and_i32(b, s0, s1, bi_imm_u8(0));
+        case nir_op_ior:  return bi_lshift_or_i32(b, s0, s1, bi_imm_u8(0));
+        case nir_op_ixor: return bi_lshift_xor_i32(b, s0, s1, bi_imm_u8(0));
+        case nir_op_imin: return bi_csel_s32(b, s0, s1, s0, s1, BI_CMPF_LT);
+        case nir_op_imax: return bi_csel_s32(b, s0, s1, s0, s1, BI_CMPF_GT);
+        case nir_op_umin: return bi_csel_u32(b, s0, s1, s0, s1, BI_CMPF_LT);
+        case nir_op_umax: return bi_csel_u32(b, s0, s1, s0, s1, BI_CMPF_GT);
+        case nir_op_fadd: return bi_fadd_f32(b, s0, s1);
+        case nir_op_fmul: return bi_fma_f32(b, s0, s1, bi_negzero());
+        case nir_op_fmin: return bi_fmin_f32(b, s0, s1);
+        case nir_op_fmax: return bi_fmax_f32(b, s0, s1);
+        default: unreachable("Invalid reduction op");
+        }
+}
+
+static void
+bi_emit_subgroup_reduction(bi_builder *b, nir_intrinsic_instr *instr)
+{
+        nir_op op = nir_intrinsic_reduction_op(instr);
+        enum bi_inactive_result identity = bi_reduction_identity(op);
+        bi_index value = bi_src_index(&instr->src[0]);
+        bi_index lane_id = bi_mov_i32(b, bi_fau(BIR_FAU_LANE_ID, false));
+        bi_index acc = bi_null();
+
+        assert(b->shader->arch >= 9);
+        assert(nir_dest_bit_size(instr->dest) == 32 && "should've been lowered");
+        assert(instr->intrinsic != nir_intrinsic_reduce ||
+               nir_intrinsic_cluster_size(instr) == 0);
+
+        for (unsigned i = 0; i < pan_subgroup_size(b->shader->arch); ++i) {
+                bi_index x = bi_read_lane(b, value, bi_imm_u32(i), identity);
+
+                /* Scans only accumulate the lanes up to this one */
+                if (instr->intrinsic != nir_intrinsic_reduce) {
+                        enum bi_cmpf cmpf =
+                                (instr->intrinsic == nir_intrinsic_inclusive_scan) ?
+                                BI_CMPF_GE : BI_CMPF_GT;
+
+                        bi_index in_scan = bi_icmp_u32(b, lane_id, bi_imm_u32(i),
+                                                       cmpf, BI_RESULT_TYPE_M1);
+
+                        x = bi_mux_i32(b, bi_imm_u32(bi_reduction_identity_value(op)),
+                                       x, in_scan, BI_MUX_INT_ZERO);
+                }
+
+                acc = bi_is_null(acc) ? x : bi_reduction_op(b, op, acc, x);
+        }
+
+        bi_mov_i32_to(b, bi_dest_index(&instr->dest), acc);
+}
+
 static void
 bi_emit_intrinsic(bi_builder *b, nir_intrinsic_instr *instr)
 {
@@ -1639,6 +1856,11 @@ bi_emit_intrinsic(bi_builder *b, nir_intrinsic_instr *instr)
                         unreachable("Unsupported shader stage");
                 break;
 
+        case nir_intrinsic_load_per_vertex_input:
+                assert(stage == MESA_SHADER_VERTEX);
+                bi_emit_load_attr(b, instr);
+                break;
+
         case nir_intrinsic_store_output:
                 if (stage == MESA_SHADER_FRAGMENT)
                         bi_emit_fragment_out(b, instr);
@@ -1661,6 +1883,17 @@ bi_emit_intrinsic(bi_builder *b, nir_intrinsic_instr *instr)
                 bi_emit_load_push_constant(b, instr);
                 break;
 
+        case nir_intrinsic_load_preamble: {
+                /* Preamble storage is laid out so vectors don't straddle a
+                 * sysval, see bi_preamble_def_size */
+                unsigned base = nir_intrinsic_base(instr);
+
+                bi_load_sysval_to(b, dst, PAN_SYSVAL(PREAMBLE, base / 4),
+                                  nir_dest_num_components(instr->dest),
+                                  (base % 4) * 4);
+                break;
+        }
+
         case nir_intrinsic_load_global:
         case nir_intrinsic_load_global_constant:
                 bi_emit_load(b, instr, BI_SEG_NONE);
@@ -1832,9 +2065,17 @@ bi_emit_intrinsic(bi_builder *b, nir_intrinsic_instr *instr)
 
         case nir_intrinsic_load_ssbo_address:
         case nir_intrinsic_load_xfb_address:
+        case nir_intrinsic_load_xfb_index_buffer_pan:
+        case nir_intrinsic_load_vertex_fetch_buffer_pan:
+        case nir_intrinsic_load_gs_buffer_pan:
                 bi_load_sysval_nir(b, instr, 2, 0);
                 break;
 
+        case nir_intrinsic_load_xfb_index_format_pan:
+        case nir_intrinsic_load_vertex_fetch_layout_pan:
+                bi_load_sysval_nir(b, instr, 2, 8);
+                break;
+
         case nir_intrinsic_load_work_dim:
         case nir_intrinsic_load_num_vertices:
         case nir_intrinsic_load_first_vertex:
@@ -1920,6 +2161,55 @@ bi_emit_intrinsic(bi_builder *b, nir_intrinsic_instr *instr)
                 bi_mov_i32_to(b, dst, bi_fau(BIR_FAU_LANE_ID, false));
                 break;
 
+        case nir_intrinsic_ballot:
+                assert(nir_dest_bit_size(instr->dest) == 32);
+                bi_mov_i32_to(b, dst,
+                              bi_subgroup_ballot(b, bi_subgroup_bool(b, instr->src[0])));
+                break;
+
+        case nir_intrinsic_vote_any:
+                bi_icmp_i32_to(b, dst,
+                               bi_subgroup_ballot(b, bi_subgroup_bool(b, instr->src[0])),
+                               bi_zero(), BI_CMPF_NE, BI_RESULT_TYPE_M1);
+                break;
+
+        case nir_intrinsic_vote_all:
+                bi_icmp_i32_to(b, dst,
+                               bi_subgroup_ballot(b, bi_subgroup_bool(b, instr->src[0])),
+                               bi_subgroup_ballot(b, bi_imm_u32(~0)),
+                               BI_CMPF_EQ, BI_RESULT_TYPE_M1);
+                break;
+
+        case nir_intrinsic_first_invocation: {
+                bi_index active = bi_subgroup_ballot(b, bi_imm_u32(~0));
+                bi_clz_u32_to(b, dst, bi_bitrev_i32(b, active), false);
+                break;
+        }
+
+        case nir_intrinsic_read_first_invocation: {
+                bi_index active = bi_subgroup_ballot(b, bi_imm_u32(~0));
+                bi_index lane = bi_clz_u32(b, bi_bitrev_i32(b, active), false);
+
+                assert(nir_dest_bit_size(instr->dest) == 32 && "should've been lowered");
+                bi_mov_i32_to(b, dst, bi_read_lane(b, bi_src_index(&instr->src[0]),
+                                                   lane, BI_INACTIVE_RESULT_ZERO));
+                break;
+        }
+
+        case nir_intrinsic_read_invocation:
+        case nir_intrinsic_shuffle:
+                assert(nir_dest_bit_size(instr->dest) == 32 && "should've been lowered");
+                bi_mov_i32_to(b, dst, bi_read_lane(b, bi_src_index(&instr->src[0]),
+                                                   bi_src_index(&instr->src[1]),
+                                                   BI_INACTIVE_RESULT_ZERO));
+                break;
+
+        case nir_intrinsic_reduce:
+        case nir_intrinsic_inclusive_scan:
+        case nir_intrinsic_exclusive_scan:
+                bi_emit_subgroup_reduction(b, instr);
+                break;
+
         case nir_intrinsic_load_local_invocation_id:
                 bi_collect_v3i32_to(b, dst,
                                     bi_u16_to_u32(b, bi_half(bi_preload(b, 55), 0)),
@@ -4053,6 +4343,7 @@ emit_block(bi_context *ctx, nir_block *block)
 
         list_addtail(&ctx->current_block->link, &ctx->blocks);
         list_inithead(&ctx->current_block->instructions);
+        ctx->current_block->loop_nesting = ctx->loop_nesting;
 
         bi_builder _b = bi_init_builder(ctx, bi_after_block(ctx->current_block));
 
@@ -4076,6 +4367,9 @@ emit_if(bi_context *ctx, nir_if *nif)
                         bi_half(bi_src_index(&nif->condition), false),
                         bi_zero(), BI_CMPF_EQ);
 
+        /* Divergence is only analyzed on Valhall */
+        bool uniform = ctx->arch >= 9 && !nir_src_is_divergent(nif->condition);
+
         /* Emit the two subblocks. */
         bi_block *then_block = emit_cf_list(ctx, &nif->then_list);
         bi_block *end_then_block = ctx->current_block;
@@ -4086,6 +4380,9 @@ emit_if(bi_context *ctx, nir_if *nif)
         bi_block *end_else_block = ctx->current_block;
         ctx->after_block = create_empty_block(ctx);
 
+        before_block->uniform_branch = uniform;
+        ctx->after_block->uniform_join = uniform;
+
         /* Now that we have the subblocks emitted, fix up the branches */
 
         assert(then_block);
@@ -4118,8 +4415,17 @@ emit_loop(bi_context *ctx, nir_loop *nloop)
         ctx->break_block = create_empty_block(ctx);
         ctx->after_block = ctx->continue_block;
 
+        /* If every thread breaks and continues together, threads rejoin
+         * neither at the header nor after the loop */
+        if (ctx->arch >= 9 && !nloop->divergent) {
+                ctx->continue_block->uniform_join = true;
+                ctx->break_block->uniform_join = true;
+        }
+
         /* Emit the body itself */
+        ctx->loop_nesting++;
         emit_cf_list(ctx, &nloop->body);
+        ctx->loop_nesting--;
 
         /* Branch back to loop back */
         bi_builder _b = bi_init_builder(ctx, bi_after_block(ctx->current_block));
@@ -4171,7 +4477,7 @@ emit_cf_list(bi_context *ctx, struct exec_list *list)
 /* shader-db stuff */
 
 struct bi_stats {
-        unsigned nr_clauses, nr_tuples, nr_ins;
+        unsigned nr_clauses, nr_tuples, nr_ins, nr_nops;
         unsigned nr_arith, nr_texture, nr_varying, nr_ldst;
 };
 
@@ -4181,6 +4487,10 @@ bi_count_tuple_stats(bi_clause *clause, bi_tuple *tuple, struct bi_stats *stats)
         /* Count instructions */
         stats->nr_ins += (tuple->fma ? 1 : 0) + (tuple->add ? 1 : 0);
 
+        /* Count slots the scheduler couldn't fill, which are packed as NOPs */
+        stats->nr_nops += (!tuple->fma || tuple->fma->op == BI_OPCODE_NOP) +
+                          (!tuple->add || tuple->add->op == BI_OPCODE_NOP);
+
         /* Non-message passing tuples are always arithmetic */
         if (tuple->add != clause->message) {
                 stats->nr_arith++;
@@ -4268,6 +4578,30 @@ bi_shader_stage_name(bi_context *ctx)
                 return gl_shader_stage_name(ctx->stage);
 }
 
+/* Workgroups of a compute shader a core runs at once, or 0 if the workgroup
+ * size is only known at dispatch. This assumes the architectural thread
+ * count, the driver uses the limits reported by the GPU. */
+static unsigned
+bi_workgroup_occupancy(bi_context *ctx)
+{
+        const struct shader_info *info = &ctx->nir->info;
+
+        if (!gl_shader_stage_is_compute(ctx->stage) ||
+            info->workgroup_size_variable)
+                return 0;
+
+        unsigned max_threads = pan_arch_max_thread_count(ctx->arch);
+        unsigned threads =
+                pan_max_threads_per_core(ctx->arch, max_threads,
+                                         max_threads * 32,
+                                         ctx->info.work_reg_count);
+        unsigned wg_size = info->workgroup_size[0] *
+                           info->workgroup_size[1] *
+                           info->workgroup_size[2];
+
+        return threads / MAX2(wg_size, 1);
+}
+
 static char *
 bi_print_stats(bi_context *ctx, unsigned size)
 {
@@ -4309,12 +4643,12 @@ bi_print_stats(bi_context *ctx, unsigned size)
 
         /* Dump stats */
         char *str = ralloc_asprintf(NULL, "%s shader: "
-                        "%u inst, %u tuples, %u clauses, "
+                        "%u inst, %u tuples, %u clauses, %u nops, "
                         "%f cycles, %f arith, %f texture, %f vary, %f ldst, "
                         "%u quadwords, %u threads",
                         bi_shader_stage_name(ctx),
                         stats.nr_ins, stats.nr_tuples, stats.nr_clauses,
-                        cycles_bound, cycles_arith, cycles_texture,
+                        stats.nr_nops, cycles_bound, cycles_arith, cycles_texture,
                         cycles_varying, cycles_ldst,
                         size / 16, nr_threads);
 
@@ -4322,8 +4656,15 @@ bi_print_stats(bi_context *ctx, unsigned size)
                 ralloc_asprintf_append(&str, ", %u preloads", bi_count_preload_cost(ctx));
         }
 
-        ralloc_asprintf_append(&str, ", %u loops, %u:%u spills:fills",
-                        ctx->loop_count, ctx->spills, ctx->fills);
+        ralloc_asprintf_append(&str, ", %u loops, %u:%u spills:fills, "
+                        "%u remats, %u us RA",
+                        ctx->loop_count, ctx->spills, ctx->fills,
+                        ctx->remats, ctx->ra_time_us);
+
+        unsigned occupancy = bi_workgroup_occupancy(ctx);
+
+        if (occupancy)
+                ralloc_asprintf_append(&str, ", %u workgroups/core", occupancy);
 
         return str;
 }
@@ -4367,14 +4708,26 @@ va_print_stats(bi_context *ctx, unsigned size)
         unsigned nr_threads = (ctx->info.work_reg_count <= 32) ? 2 : 1;
 
         /* Dump stats */
-        return ralloc_asprintf(NULL, "%s shader: "
+        char *str = ralloc_asprintf(NULL, "%s shader: "
                         "%u inst, %f cycles, %f fma, %f cvt, %f sfu, %f v, "
                         "%f t, %f ls, %u quadwords, %u threads, %u loops, "
-                        "%u:%u spills:fills",
+                        "%u:%u spills:fills, %u remats, %u us RA, "
+                        "%u:%u sched cycles before:after, "
+                        "%u:%u pushed:moved constants",
                         bi_shader_stage_name(ctx),
                         nr_ins, cycles, cycles_fma, cycles_cvt, cycles_sfu,
                         cycles_v, cycles_t, cycles_ls, size / 16, nr_threads,
-                        ctx->loop_count, ctx->spills, ctx->fills);
+                        ctx->loop_count, ctx->spills, ctx->fills,
+                        ctx->remats, ctx->ra_time_us,
+                        ctx->sched_cycles_before, ctx->sched_cycles_after,
+                        ctx->pushed_constants, ctx->constant_moves);
+
+        unsigned occupancy = bi_workgroup_occupancy(ctx);
+
+        if (occupancy)
+                ralloc_asprintf_append(&str, ", %u workgroups/core", occupancy);
+
+        return str;
 }
 
 static int
@@ -4403,6 +4756,29 @@ should_split_wrmask(const nir_instr *instr, UNUSED const void *data)
         }
 }
 
+/*
+ * LOAD and STORE move up to 128 bits per message, so adjacent accesses are
+ * merged up to a vec4 of 32-bit or a vec2 of 16-bit values, the widest vectors
+ * the rest of the backend handles. Accesses are kept aligned to their size
+ * rounded up to a power of two, so no message straddles a 16-byte boundary.
+ */
+static bool
+bi_mem_vectorize_cb(unsigned align_mul, unsigned align_offset,
+                    unsigned bit_size, unsigned num_components,
+                    nir_intrinsic_instr *low, nir_intrinsic_instr *high,
+                    void *data)
+{
+        if (!(bit_size == 32 && num_components <= 4) &&
+            !(bit_size == 16 && num_components <= 2))
+                return false;
+
+        unsigned align = align_offset ?
+                         (1 << (ffs(align_offset) - 1)) : align_mul;
+        unsigned bytes = (bit_size / 8) * num_components;
+
+        return align >= MIN2(util_next_power_of_two(bytes), 16);
+}
+
 /*
  * Some operations are only available as 32-bit instructions. 64-bit floats are
  * unsupported and ints are lowered with nir_lower_int64.  Certain 8-bit and
@@ -4411,6 +4787,25 @@ should_split_wrmask(const nir_instr *instr, UNUSED const void *data)
 static unsigned
 bi_lower_bit_size(const nir_instr *instr, UNUSED void *data)
 {
+        if (instr->type == nir_instr_type_intrinsic) {
+                nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+
+                /* Cross-lane permutes are 32-bit */
+                switch (intr->intrinsic) {
+                case nir_intrinsic_read_invocation:
+                case nir_intrinsic_read_first_invocation:
+                case nir_intrinsic_shuffle:
+                case nir_intrinsic_reduce:
+                case nir_intrinsic_inclusive_scan:
+                case nir_intrinsic_exclusive_scan: {
+                        unsigned sz = nir_dest_bit_size(intr->dest);
+                        return (sz == 8 || sz == 16) ? 32 : 0;
+                }
+                default:
+                        return 0;
+                }
+        }
+
         if (instr->type != nir_instr_type_alu)
                 return 0;
 
@@ -4544,12 +4939,13 @@ bifrost_nir_lower_blend_components(struct nir_builder *b,
 }
 
 static void
-bi_optimize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
+bi_optimize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend,
+                unsigned max_iterations, struct bi_pass_times *times)
 {
         bool progress;
         unsigned lower_flrp = 16 | 32 | 64;
 
-        NIR_PASS(progress, nir, nir_lower_regs_to_ssa);
+        BI_NIR_PASS(times, progress, nir, nir_lower_regs_to_ssa);
 
         nir_lower_tex_options lower_tex_options = {
                 .lower_txs_lod = true,
@@ -4559,50 +4955,54 @@ bi_optimize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
                 .lower_invalid_implicit_lod = true,
         };
 
-        NIR_PASS(progress, nir, pan_nir_lower_64bit_intrin);
-        NIR_PASS(progress, nir, pan_lower_helper_invocation);
+        BI_NIR_PASS(times, progress, nir, pan_nir_lower_64bit_intrin);
+        BI_NIR_PASS(times, progress, nir, pan_lower_helper_invocation);
 
-        NIR_PASS(progress, nir, nir_lower_int64);
+        BI_NIR_PASS(times, progress, nir, nir_lower_int64);
 
         nir_lower_idiv_options idiv_options = {
                 .allow_fp16 = true,
         };
-        NIR_PASS(progress, nir, nir_opt_idiv_const, 8);
-        NIR_PASS(progress, nir, nir_lower_idiv, &idiv_options);
+        BI_NIR_PASS(times, progress, nir, nir_opt_idiv_const, 8);
+        BI_NIR_PASS(times, progress, nir, nir_lower_idiv, &idiv_options);
 
-        NIR_PASS(progress, nir, nir_lower_tex, &lower_tex_options);
-        NIR_PASS(progress, nir, nir_lower_alu_to_scalar, bi_scalarize_filter, NULL);
-        NIR_PASS(progress, nir, nir_lower_load_const_to_scalar);
-        NIR_PASS(progress, nir, nir_lower_phis_to_scalar, true);
+        BI_NIR_PASS(times, progress, nir, nir_lower_tex, &lower_tex_options);
+        BI_NIR_PASS(times, progress, nir, nir_lower_alu_to_scalar, bi_scalarize_filter, NULL);
+        BI_NIR_PASS(times, progress, nir, nir_lower_load_const_to_scalar);
+        BI_NIR_PASS(times, progress, nir, nir_lower_phis_to_scalar, true);
+
+        /* With a budget, the loop stops early even if it is still making
+         * progress. The passes after the loop are needed either way. */
+        unsigned iterations = 0;
 
         do {
                 progress = false;
 
-                NIR_PASS(progress, nir, nir_lower_var_copies);
-                NIR_PASS(progress, nir, nir_lower_vars_to_ssa);
-                NIR_PASS(progress, nir, nir_lower_wrmasks, should_split_wrmask, NULL);
+                BI_NIR_PASS(times, progress, nir, nir_lower_var_copies);
+                BI_NIR_PASS(times, progress, nir, nir_lower_vars_to_ssa);
+                BI_NIR_PASS(times, progress, nir, nir_lower_wrmasks, should_split_wrmask, NULL);
 
-                NIR_PASS(progress, nir, nir_copy_prop);
-                NIR_PASS(progress, nir, nir_opt_remove_phis);
-                NIR_PASS(progress, nir, nir_opt_dce);
-                NIR_PASS(progress, nir, nir_opt_dead_cf);
-                NIR_PASS(progress, nir, nir_opt_cse);
-                NIR_PASS(progress, nir, nir_opt_peephole_select, 64, false, true);
-                NIR_PASS(progress, nir, nir_opt_algebraic);
-                NIR_PASS(progress, nir, nir_opt_constant_folding);
+                BI_NIR_PASS(times, progress, nir, nir_copy_prop);
+                BI_NIR_PASS(times, progress, nir, nir_opt_remove_phis);
+                BI_NIR_PASS(times, progress, nir, nir_opt_dce);
+                BI_NIR_PASS(times, progress, nir, nir_opt_dead_cf);
+                BI_NIR_PASS(times, progress, nir, nir_opt_cse);
+                BI_NIR_PASS(times, progress, nir, nir_opt_peephole_select, 64, false, true);
+                BI_NIR_PASS(times, progress, nir, nir_opt_algebraic);
+                BI_NIR_PASS(times, progress, nir, nir_opt_constant_folding);
 
-                NIR_PASS(progress, nir, nir_lower_alu);
+                BI_NIR_PASS(times, progress, nir, nir_lower_alu);
 
                 if (lower_flrp != 0) {
                         bool lower_flrp_progress = false;
-                        NIR_PASS(lower_flrp_progress,
-                                 nir,
-                                 nir_lower_flrp,
-                                 lower_flrp,
-                                 false /* always_precise */);
+                        BI_NIR_PASS(times, lower_flrp_progress,
+                                    nir,
+                                    nir_lower_flrp,
+                                    lower_flrp,
+                                    false /* always_precise */);
                         if (lower_flrp_progress) {
-                                NIR_PASS(progress, nir,
-                                         nir_opt_constant_folding);
+                                BI_NIR_PASS(times, progress, nir,
+                                            nir_opt_constant_folding);
                                 progress = true;
                         }
 
@@ -4612,16 +5012,16 @@ bi_optimize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
                         lower_flrp = 0;
                 }
 
-                NIR_PASS(progress, nir, nir_opt_undef);
-                NIR_PASS(progress, nir, nir_lower_undef_to_zero);
+                BI_NIR_PASS(times, progress, nir, nir_opt_undef);
+                BI_NIR_PASS(times, progress, nir, nir_lower_undef_to_zero);
 
-                NIR_PASS(progress, nir, nir_opt_shrink_vectors);
-                NIR_PASS(progress, nir, nir_opt_loop_unroll);
-        } while (progress);
+                BI_NIR_PASS(times, progress, nir, nir_opt_shrink_vectors);
+                BI_NIR_PASS(times, progress, nir, nir_opt_loop_unroll);
+        } while (progress && ++iterations != max_iterations);
 
         /* TODO: Why is 64-bit getting rematerialized?
          * KHR-GLES31.core.shader_image_load_store.basic-allTargets-atomicFS */
-        NIR_PASS(progress, nir, nir_lower_int64);
+        BI_NIR_PASS(times, progress, nir, nir_lower_int64);
 
         /* We need to cleanup after each iteration of late algebraic
          * optimizations, since otherwise NIR can produce weird edge cases
@@ -4629,36 +5029,36 @@ bi_optimize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
         bool late_algebraic = true;
         while (late_algebraic) {
                 late_algebraic = false;
-                NIR_PASS(late_algebraic, nir, nir_opt_algebraic_late);
-                NIR_PASS(progress, nir, nir_opt_constant_folding);
-                NIR_PASS(progress, nir, nir_copy_prop);
-                NIR_PASS(progress, nir, nir_opt_dce);
-                NIR_PASS(progress, nir, nir_opt_cse);
+                BI_NIR_PASS(times, late_algebraic, nir, nir_opt_algebraic_late);
+                BI_NIR_PASS(times, progress, nir, nir_opt_constant_folding);
+                BI_NIR_PASS(times, progress, nir, nir_copy_prop);
+                BI_NIR_PASS(times, progress, nir, nir_opt_dce);
+                BI_NIR_PASS(times, progress, nir, nir_opt_cse);
         }
 
         /* This opt currently helps on Bifrost but not Valhall */
         if (gpu_id < 0x9000)
-                NIR_PASS(progress, nir, bifrost_nir_opt_boolean_bitwise);
+                BI_NIR_PASS(times, progress, nir, bifrost_nir_opt_boolean_bitwise);
 
-        NIR_PASS(progress, nir, nir_lower_alu_to_scalar, bi_scalarize_filter, NULL);
-        NIR_PASS(progress, nir, nir_opt_vectorize, bi_vectorize_filter, NULL);
-        NIR_PASS(progress, nir, nir_lower_bool_to_bitsize);
+        BI_NIR_PASS(times, progress, nir, nir_lower_alu_to_scalar, bi_scalarize_filter, NULL);
+        BI_NIR_PASS(times, progress, nir, nir_opt_vectorize, bi_vectorize_filter, NULL);
+        BI_NIR_PASS(times, progress, nir, nir_lower_bool_to_bitsize);
 
         /* Prepass to simplify instruction selection */
         late_algebraic = false;
-        NIR_PASS(late_algebraic, nir, bifrost_nir_lower_algebraic_late);
+        BI_NIR_PASS(times, late_algebraic, nir, bifrost_nir_lower_algebraic_late);
 
         while (late_algebraic) {
                 late_algebraic = false;
-                NIR_PASS(late_algebraic, nir, nir_opt_algebraic_late);
-                NIR_PASS(progress, nir, nir_opt_constant_folding);
-                NIR_PASS(progress, nir, nir_copy_prop);
-                NIR_PASS(progress, nir, nir_opt_dce);
-                NIR_PASS(progress, nir, nir_opt_cse);
+                BI_NIR_PASS(times, late_algebraic, nir, nir_opt_algebraic_late);
+                BI_NIR_PASS(times, progress, nir, nir_opt_constant_folding);
+                BI_NIR_PASS(times, progress, nir, nir_copy_prop);
+                BI_NIR_PASS(times, progress, nir, nir_opt_dce);
+                BI_NIR_PASS(times, progress, nir, nir_opt_cse);
         }
 
-        NIR_PASS(progress, nir, nir_lower_load_const_to_scalar);
-        NIR_PASS(progress, nir, nir_opt_dce);
+        BI_NIR_PASS(times, progress, nir, nir_lower_load_const_to_scalar);
+        BI_NIR_PASS(times, progress, nir, nir_opt_dce);
 
         if (nir->info.stage == MESA_SHADER_FRAGMENT) {
                 NIR_PASS_V(nir, nir_shader_instructions_pass,
@@ -4828,8 +5228,49 @@ bi_fp32_varying_mask(nir_shader *nir)
         return mask;
 }
 
+/* Compute warps are filled with consecutive local invocations, so the subgroup
+ * of an invocation follows from its local index */
+
+static bool
+bi_lower_subgroup_id(nir_builder *b, nir_instr *instr, void *data)
+{
+        unsigned size = *((unsigned *) data);
+
+        if (instr->type != nir_instr_type_intrinsic)
+                return false;
+
+        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+        nir_ssa_def *value;
+
+        b->cursor = nir_before_instr(instr);
+
+        switch (intr->intrinsic) {
+        case nir_intrinsic_load_subgroup_id:
+                value = nir_udiv_imm(b, nir_load_local_invocation_index(b), size);
+                break;
+
+        case nir_intrinsic_load_num_subgroups: {
+                nir_ssa_def *wg = nir_load_workgroup_size(b);
+                nir_ssa_def *count = nir_imul(b, nir_imul(b, nir_channel(b, wg, 0),
+                                                             nir_channel(b, wg, 1)),
+                                              nir_channel(b, wg, 2));
+
+                value = nir_udiv_imm(b, nir_iadd_imm(b, count, size - 1), size);
+                break;
+        }
+
+        default:
+                return false;
+        }
+
+        nir_ssa_def_rewrite_uses(&intr->dest.ssa, value);
+        nir_instr_remove(instr);
+        return true;
+}
+
 static void
-bi_finalize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
+bi_finalize_nir(nir_shader *nir, const struct panfrost_compile_inputs *inputs,
+                struct bi_pass_times *times)
 {
         /* Lower gl_Position pre-optimisation, but after lowering vars to ssa
          * (so we don't accidentally duplicate the epilogue since mesa/st has
@@ -4837,7 +5278,8 @@ bi_finalize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
 
         NIR_PASS_V(nir, nir_lower_vars_to_ssa);
 
-        if (nir->info.stage == MESA_SHADER_VERTEX) {
+        /* Vertices fed to an emulated geometry shader stay in clip space */
+        if (nir->info.stage == MESA_SHADER_VERTEX && !inputs->gs.inputs) {
                 NIR_PASS_V(nir, nir_lower_viewport_transform);
                 NIR_PASS_V(nir, nir_lower_point_size, 1.0, 0.0);
 
@@ -4857,7 +5299,7 @@ bi_finalize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
          * (currently unconditional for Valhall), we force vec4 alignment for
          * scratch access.
          */
-        bool packed_tls = (gpu_id >= 0x9000);
+        bool packed_tls = (inputs->gpu_id >= 0x9000);
 
         /* Lower large arrays to scratch and small arrays to bcsel */
         NIR_PASS_V(nir, nir_lower_vars_to_scratch, nir_var_function_temp, 256,
@@ -4878,22 +5320,89 @@ bi_finalize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
          */
         NIR_PASS_V(nir, nir_opt_constant_folding);
 
+        /* Geometry shaders become compute kernels, see pan_lower_gs */
+        if (nir->info.stage == MESA_SHADER_GEOMETRY)
+                NIR_PASS_V(nir, pan_lower_gs, inputs->gs.topology);
+
         if (nir->info.stage == MESA_SHADER_FRAGMENT) {
                 NIR_PASS_V(nir, nir_lower_mediump_io,
                            nir_var_shader_in | nir_var_shader_out,
                            ~bi_fp32_varying_mask(nir), false);
+
+                if (inputs->fp16_rt_mask) {
+                        NIR_PASS_V(nir, pan_nir_lower_fp16_color,
+                                   inputs->fp16_rt_mask);
+                }
         } else if (nir->info.stage == MESA_SHADER_VERTEX) {
-                if (gpu_id >= 0x9000) {
+                if (inputs->gpu_id >= 0x9000) {
+                        uint64_t mask = BITFIELD64_BIT(VARYING_SLOT_PSIZ);
+
+                        /* Varyings stored at half precision, the fragment
+                         * shader is compiled for the same layout */
+                        if (!inputs->no_idvs) {
+                                mask |= ((uint64_t) inputs->fp16_varying_mask)
+                                        << VARYING_SLOT_VAR0;
+                        }
+
                         NIR_PASS_V(nir, nir_lower_mediump_io, nir_var_shader_out,
-                                        BITFIELD64_BIT(VARYING_SLOT_PSIZ), false);
+                                        mask, false);
                 }
 
                 NIR_PASS_V(nir, pan_nir_lower_store_component);
+
+                if (inputs->vertex_fetch.mask) {
+                        NIR_PASS_V(nir, pan_lower_vertex_fetch,
+                                   &inputs->vertex_fetch);
+                }
         }
 
+        /* Merge memory accesses into wider messages. This must happen before
+         * SSBO accesses become 64-bit address arithmetic, which the vectorizer
+         * can't see through */
+        nir_load_store_vectorize_options vectorize_opts = {
+                .modes = nir_var_mem_ssbo | nir_var_mem_global |
+                         nir_var_mem_shared,
+                .callback = bi_mem_vectorize_cb,
+        };
+
+        NIR_PASS_V(nir, nir_opt_load_store_vectorize, &vectorize_opts);
         NIR_PASS_V(nir, nir_lower_ssbo);
         NIR_PASS_V(nir, pan_nir_lower_zs_store);
         NIR_PASS_V(nir, pan_lower_sample_pos);
+
+        /* Subgroup operations map to cross-lane instructions on Valhall,
+         * which work on the full sixteen-lane warp */
+        if (inputs->gpu_id >= 0x9000) {
+                unsigned subgroup_size = pan_subgroup_size(inputs->gpu_id >> 12);
+                bool progress = false;
+
+                const nir_lower_subgroups_options subgroups_opts = {
+                        .subgroup_size = subgroup_size,
+                        .ballot_bit_size = 32,
+                        .ballot_components = 1,
+                        .lower_to_scalar = true,
+                        .lower_vote_eq = true,
+                        .lower_subgroup_masks = true,
+                        .lower_relative_shuffle = true,
+                        .lower_shuffle_to_32bit = true,
+                        .lower_quad = true,
+                        .lower_elect = true,
+                };
+
+                NIR_PASS_V(nir, nir_lower_subgroups, &subgroups_opts);
+
+                if (nir->info.stage == MESA_SHADER_COMPUTE) {
+                        NIR_PASS(progress, nir, nir_shader_instructions_pass,
+                                 bi_lower_subgroup_id,
+                                 nir_metadata_block_index |
+                                 nir_metadata_dominance,
+                                 &subgroup_size);
+
+                        if (progress)
+                                NIR_PASS_V(nir, nir_lower_compute_system_values, NULL);
+                }
+        }
+
         NIR_PASS_V(nir, nir_lower_bit_size, bi_lower_bit_size, NULL);
         NIR_PASS_V(nir, nir_lower_64bit_phis);
 
@@ -4902,9 +5411,142 @@ bi_finalize_nir(nir_shader *nir, unsigned gpu_id, bool is_blend)
                            nir_var_shader_in | nir_var_shader_out);
                 NIR_PASS_V(nir, nir_io_add_intrinsic_xfb_info);
                 NIR_PASS_V(nir, pan_lower_xfb);
+
+                /* The attribute offset field was removed from the compute
+                 * job payload in v10, so the program finds its vertex */
+                if (inputs->gpu_id >= 0xa000)
+                        NIR_PASS_V(nir, pan_lower_xfb_vertex_fetch);
         }
 
-        bi_optimize_nir(nir, gpu_id, is_blend);
+        if (inputs->gs.inputs) {
+                NIR_PASS_V(nir, pan_lower_gs_vs, inputs->gs.inputs);
+
+                /* As for transform feedback, see above */
+                if (inputs->gpu_id >= 0xa000)
+                        NIR_PASS_V(nir, pan_lower_xfb_vertex_fetch);
+        }
+
+        bi_optimize_nir(nir, inputs->gpu_id, inputs->is_blend,
+                        inputs->nir_opt_iterations, times);
+}
+
+static void
+bi_preamble_def_size(nir_ssa_def *def, unsigned *size, unsigned *align)
+{
+        /* Storage is in words, and a vector must fit in the vec4 of one
+         * preamble sysval */
+        *size = def->num_components;
+        *align = util_next_power_of_two(def->num_components);
+}
+
+static float
+bi_preamble_instr_cost(nir_instr *instr, const void *data)
+{
+        /* UBO loads are pushed to FAU anyway, so only hoisting arithmetic
+         * saves anything */
+        if (instr->type != nir_instr_type_alu)
+                return 0.0;
+
+        nir_alu_instr *alu = nir_instr_as_alu(instr);
+
+        switch (alu->op) {
+        case nir_op_mov:
+        case nir_op_vec2:
+        case nir_op_vec3:
+        case nir_op_vec4:
+                return 0.0;
+
+        /* Lowered to several instructions, or run at quarter rate */
+        case nir_op_frcp:
+        case nir_op_frsq:
+        case nir_op_fsqrt:
+        case nir_op_fexp2:
+        case nir_op_flog2:
+        case nir_op_fsin:
+        case nir_op_fcos:
+        case nir_op_fdiv:
+        case nir_op_fpow:
+        case nir_op_idiv:
+        case nir_op_udiv:
+        case nir_op_imod:
+        case nir_op_umod:
+        case nir_op_irem:
+                return 4.0 * alu->dest.dest.ssa.num_components;
+
+        default:
+                return alu->dest.dest.ssa.num_components;
+        }
+}
+
+static float
+bi_preamble_rewrite_cost(nir_ssa_def *def, const void *data)
+{
+        /* FAU is read directly by ALU instructions, other users need a move */
+        nir_foreach_use(use, def) {
+                if (use->parent_instr->type != nir_instr_type_alu)
+                        return def->num_components;
+
+                nir_op op = nir_instr_as_alu(use->parent_instr)->op;
+
+                if (op == nir_op_mov || nir_op_is_vec(op))
+                        return def->num_components;
+        }
+
+        return 0.0;
+}
+
+static bool
+bi_preamble_avoid_instr(const nir_instr *instr, const void *data)
+{
+        /* Preamble storage is pushed as 32-bit words */
+        nir_ssa_def *def = nir_instr_ssa_def((nir_instr *) instr);
+
+        return def == NULL || def->bit_size != 32;
+}
+
+static const nir_opt_preamble_options bi_preamble_options = {
+        .def_size = bi_preamble_def_size,
+        .instr_cost_cb = bi_preamble_instr_cost,
+        .rewrite_cost_cb = bi_preamble_rewrite_cost,
+        .avoid_instr_cb = bi_preamble_avoid_instr,
+        .can_move_instr_cb = pan_nir_preamble_can_eval,
+
+        /* Kept small, as it competes with the other sysvals for FAU */
+        .preamble_storage_size = PAN_MAX_PREAMBLE_WORDS,
+};
+
+/*
+ * Hoist uniform-only computation into a preamble, which the driver evaluates
+ * on the CPU once per draw. The shader then reads the results from preamble
+ * sysvals, which end up pushed to FAU.
+ */
+static void
+bi_opt_preamble(nir_shader *nir, struct pan_shader_info *info)
+{
+        /* nir_opt_preamble can't be undone, so keep a copy in case the
+         * preamble is too large to translate */
+        nir_shader *orig = nir_shader_clone(NULL, nir);
+        unsigned size;
+
+        if (!nir_opt_preamble(nir, &bi_preamble_options, &size)) {
+                ralloc_free(orig);
+                return;
+        }
+
+        if (!pan_nir_collect_preamble(nir, &info->preamble)) {
+                nir_shader_replace(nir, orig);
+                return;
+        }
+
+        ralloc_free(orig);
+
+        /* The preamble now lives in info->preamble, the backend only
+         * compiles the main shader */
+        nir_function_impl *entrypoint = nir_shader_get_entrypoint(nir);
+        exec_node_remove(&entrypoint->preamble->node);
+        entrypoint->preamble = NULL;
+
+        NIR_PASS_V(nir, nir_opt_dce);
 }
 
 static bi_context *
@@ -4913,9 +5555,12 @@ bi_compile_variant_nir(nir_shader *nir,
                        struct util_dynarray *binary,
                        struct hash_table_u64 *sysval_to_id,
                        struct bi_shader_info info,
-                       enum bi_idvs_mode idvs)
+                       enum bi_idvs_mode idvs,
+                       struct bi_pass_times *times)
 {
         bi_context *ctx = rzalloc(NULL, bi_context);
+        ctx->linear_ctx = linear_zalloc_parent(ctx, 0);
+        ctx->pass_times = times;
 
         /* There may be another program in the dynarray, start at the end */
         unsigned offset = binary->size;
@@ -4954,6 +5599,14 @@ bi_compile_variant_nir(nir_shader *nir,
                 }
         }
 
+        /* Valhall only reconverges after divergent branches, which needs
+         * the divergence of the control flow. LCSSA makes the divergence of
+         * values leaving loops exact. */
+        if (ctx->arch >= 9) {
+                nir_convert_to_lcssa(nir, true, true);
+                NIR_PASS_V(nir, nir_divergence_analysis);
+        }
+
         /* If nothing is pushed, all UBOs need to be uploaded */
         ctx->ubo_mask = ~0;
 
@@ -4980,8 +5633,9 @@ bi_compile_variant_nir(nir_shader *nir,
                 ctx->ssa_alloc += func->impl->ssa_alloc;
                 ctx->reg_alloc += func->impl->reg_alloc;
 
-                emit_cf_list(ctx, &func->impl->body);
-                bi_emit_phis_deferred(ctx);
+                BI_TIME_PASS(times, "emit_cf_list",
+                             emit_cf_list(ctx, &func->impl->body);
+                             bi_emit_phis_deferred(ctx));
                 break; /* TODO: Multi-function shaders */
         }
 
@@ -5010,45 +5664,50 @@ bi_compile_variant_nir(nir_shader *nir,
         bool optimize = !(bifrost_debug & BIFROST_DBG_NOOPT);
 
         /* Runs before constant folding */
-        bi_lower_swizzle(ctx);
+        BI_PASS(ctx, bi_lower_swizzle);
         bi_validate(ctx, "Early lowering");
 
         /* Runs before copy prop */
         if (optimize && !ctx->inputs->no_ubo_to_push) {
-                bi_opt_push_ubo(ctx);
+                BI_PASS(ctx, bi_opt_push_ubo);
         }
 
         if (likely(optimize)) {
-                bi_opt_copy_prop(ctx);
+                bool folded;
 
-                while (bi_opt_constant_fold(ctx))
-                        bi_opt_copy_prop(ctx);
+                do {
+                        BI_PASS(ctx, bi_opt_copy_prop);
+                        BI_TIME_PASS(times, "bi_opt_constant_fold",
+                                     folded = bi_opt_constant_fold(ctx));
+                } while (folded);
 
-                bi_opt_mod_prop_forward(ctx);
-                bi_opt_mod_prop_backward(ctx);
+                BI_PASS(ctx, bi_opt_mod_prop_forward);
+                BI_PASS(ctx, bi_opt_mod_prop_backward);
 
                 /* Push LD_VAR_IMM/VAR_TEX instructions. Must run after
                  * mod_prop_backward to fuse VAR_TEX */
                 if (ctx->arch == 7 && ctx->stage == MESA_SHADER_FRAGMENT &&
                     !(bifrost_debug & BIFROST_DBG_NOPRELOAD)) {
-                        bi_opt_dead_code_eliminate(ctx);
-                        bi_opt_message_preload(ctx);
-                        bi_opt_copy_prop(ctx);
+                        BI_PASS(ctx, bi_opt_dead_code_eliminate);
+                        BI_PASS(ctx, bi_opt_message_preload);
+                        BI_PASS(ctx, bi_opt_copy_prop);
                 }
 
-                bi_opt_dead_code_eliminate(ctx);
-                bi_opt_cse(ctx);
-                bi_opt_dead_code_eliminate(ctx);
+                BI_PASS(ctx, bi_opt_dead_code_eliminate);
+                BI_PASS(ctx, bi_opt_cse);
+                BI_PASS(ctx, bi_opt_licm);
+                BI_PASS(ctx, bi_opt_dead_code_eliminate);
                 if (!ctx->inputs->no_ubo_to_push)
-                        bi_opt_reorder_push(ctx);
+                        BI_PASS(ctx, bi_opt_reorder_push);
                 bi_validate(ctx, "Optimization passes");
         }
 
-        bi_lower_opt_instructions(ctx);
+        BI_PASS(ctx, bi_lower_opt_instructions);
 
         if (ctx->arch >= 9) {
-                va_optimize(ctx);
-                va_lower_isel(ctx);
+                BI_PASS(ctx, va_optimize);
+                BI_PASS(ctx, va_lower_isel);
+                BI_PASS(ctx, va_push_constants);
 
                 bi_foreach_instr_global_safe(ctx, I) {
                         /* Phis become single moves so shouldn't be affected */
@@ -5063,8 +5722,8 @@ bi_compile_variant_nir(nir_shader *nir,
 
                 /* We need to clean up after constant lowering */
                 if (likely(optimize)) {
-                        bi_opt_cse(ctx);
-                        bi_opt_dead_code_eliminate(ctx);
+                        BI_PASS(ctx, bi_opt_cse);
+                        BI_PASS(ctx, bi_opt_dead_code_eliminate);
                 }
 
                 bi_validate(ctx, "Valhall passes");
@@ -5083,66 +5742,71 @@ bi_compile_variant_nir(nir_shader *nir,
          * shaders, so this analysis is only required in fragment shaders.
          */
         if (ctx->stage == MESA_SHADER_FRAGMENT)
-                bi_analyze_helper_requirements(ctx);
+                BI_PASS(ctx, bi_analyze_helper_requirements);
 
         /* Fuse TEXC after analyzing helper requirements so the analysis
          * doesn't have to know about dual textures */
         if (likely(optimize)) {
-                bi_opt_fuse_dual_texture(ctx);
+                BI_PASS(ctx, bi_opt_fuse_dual_texture);
         }
 
         /* Lower FAU after fusing dual texture, because fusing dual texture
          * creates new immediates that themselves may need lowering.
          */
         if (ctx->arch <= 8) {
-                bi_lower_fau(ctx);
+                BI_PASS(ctx, bi_lower_fau);
         }
 
         /* Lowering FAU can create redundant moves. Run CSE+DCE to clean up. */
         if (likely(optimize)) {
-                bi_opt_cse(ctx);
-                bi_opt_dead_code_eliminate(ctx);
+                BI_PASS(ctx, bi_opt_cse);
+                BI_PASS(ctx, bi_opt_dead_code_eliminate);
         }
 
         bi_validate(ctx, "Late lowering");
 
         if (likely(!(bifrost_debug & BIFROST_DBG_NOPSCHED))) {
-                bi_pressure_schedule(ctx);
+                BI_PASS(ctx, bi_pressure_schedule);
+
+                /* Cover message latency on top of the pressure schedule */
+                if (ctx->arch >= 9)
+                        BI_PASS(ctx, va_schedule);
+
                 bi_validate(ctx, "Pre-RA scheduling");
         }
 
-        bi_register_allocate(ctx);
+        BI_PASS(ctx, bi_register_allocate);
 
         if (likely(optimize))
-                bi_opt_post_ra(ctx);
+                BI_PASS(ctx, bi_opt_post_ra);
 
         if (bifrost_debug & BIFROST_DBG_SHADERS && !skip_internal)
                 bi_print_shader(ctx, stdout);
 
         if (ctx->arch >= 9) {
-                va_assign_slots(ctx);
-                va_insert_flow_control_nops(ctx);
-                va_merge_flow(ctx);
-                va_mark_last(ctx);
+                BI_PASS(ctx, va_assign_slots);
+                BI_PASS(ctx, va_insert_flow_control_nops);
+                BI_PASS(ctx, va_merge_flow);
+                BI_PASS(ctx, va_mark_last);
         } else {
-                bi_schedule(ctx);
-                bi_assign_scoreboard(ctx);
+                BI_PASS(ctx, bi_schedule);
+                BI_PASS(ctx, bi_assign_scoreboard);
 
                 /* Analyze after scheduling since we depend on instruction
                  * order. Valhall calls as part of va_insert_flow_control_nops,
                  * as the handling for clauses differs from instructions.
                  */
-                bi_analyze_helper_terminate(ctx);
-                bi_mark_clauses_td(ctx);
+                BI_PASS(ctx, bi_analyze_helper_terminate);
+                BI_PASS(ctx, bi_mark_clauses_td);
         }
 
         if (bifrost_debug & BIFROST_DBG_SHADERS && !skip_internal)
                 bi_print_shader(ctx, stdout);
 
         if (ctx->arch <= 8) {
-                bi_pack_clauses(ctx, binary, offset);
+                BI_PASS(ctx, bi_pack_clauses, binary, offset);
         } else {
-                bi_pack_valhall(ctx, binary);
+                BI_PASS(ctx, bi_pack_valhall, binary);
         }
 
         if (bifrost_debug & BIFROST_DBG_SHADERS && !skip_internal) {
@@ -5187,7 +5851,8 @@ bi_compile_variant(nir_shader *nir,
                    struct util_dynarray *binary,
                    struct hash_table_u64 *sysval_to_id,
                    struct pan_shader_info *info,
-                   enum bi_idvs_mode idvs)
+                   enum bi_idvs_mode idvs,
+                   struct bi_pass_times *times)
 {
         struct bi_shader_info local_info = {
                 .push = &info->push,
@@ -5211,7 +5876,8 @@ bi_compile_variant(nir_shader *nir,
          * offset, to keep the ABI simple. */
         assert((offset == 0) ^ (idvs == BI_IDVS_VARYING));
 
-        bi_context *ctx = bi_compile_variant_nir(nir, inputs, binary, sysval_to_id, local_info, idvs);
+        bi_context *ctx = bi_compile_variant_nir(nir, inputs, binary, sysval_to_id, local_info, idvs,
+                                                 times);
 
         /* A register is preloaded <==> it is live before the first block */
         bi_block *first_block = list_first_entry(&ctx->blocks, bi_block, link);
@@ -5275,6 +5941,48 @@ bi_compile_variant(nir_shader *nir,
         ralloc_free(ctx);
 }
 
+static int
+bi_compare_pass_time(const void *a, const void *b)
+{
+        const struct bi_pass_time *A = a, *B = b;
+
+        return (A->ns < B->ns) - (A->ns > B->ns);
+}
+
+/* Slowest passes first, in the style of the shader-db statistics */
+
+static void
+bi_report_pass_times(nir_shader *nir,
+                     const struct panfrost_compile_inputs *inputs,
+                     struct bi_pass_times *times)
+{
+        int64_t total = 0;
+
+        qsort(times->passes, times->count, sizeof(times->passes[0]),
+              bi_compare_pass_time);
+
+        for (unsigned i = 0; i < times->count; ++i)
+                total += times->passes[i].ns;
+
+        char *str = ralloc_asprintf(NULL, "%s shader passes: %u us total",
+                                    gl_shader_stage_name(nir->info.stage),
+                                    (unsigned) (total / 1000));
+
+        for (unsigned i = 0; i < times->count; ++i) {
+                ralloc_asprintf_append(&str, ", %u us %s (%u)",
+                                       (unsigned) (times->passes[i].ns / 1000),
+                                       times->passes[i].name,
+                                       times->passes[i].runs);
+        }
+
+        fprintf(stderr, "SHADER-DB: %s\n", str);
+
+        if (inputs->debug)
+                util_debug_message(inputs->debug, SHADER_INFO, "%s", str);
+
+        ralloc_free(str);
+}
+
 /* Decide if Index-Driven Vertex Shading should be used for a given shader */
 static bool
 bi_should_idvs(nir_shader *nir, const struct panfrost_compile_inputs *inputs)
@@ -5304,7 +6012,16 @@ bifrost_compile_shader_nir(nir_shader *nir,
 {
         bifrost_debug = debug_get_option_bifrost_debug();
 
-        bi_finalize_nir(nir, inputs->gpu_id, inputs->is_blend);
+        struct bi_pass_times pass_times = { 0 };
+        struct bi_pass_times *times =
+                (bifrost_debug & BIFROST_DBG_PASSTIME) ? &pass_times : NULL;
+
+        bi_finalize_nir(nir, inputs, times);
+
+        if (inputs->cpu_preamble && inputs->gpu_id >= 0x9000 &&
+            !(bifrost_debug & BIFROST_DBG_NOPREAMBLE))
+                bi_opt_preamble(nir, info);
+
         struct hash_table_u64 *sysval_to_id =
                 panfrost_init_sysvals(&info->sysvals,
                                       inputs->fixed_sysval_layout,
@@ -5316,10 +6033,13 @@ bifrost_compile_shader_nir(nir_shader *nir,
         pan_nir_collect_varyings(nir, info);
 
         if (info->vs.idvs) {
-                bi_compile_variant(nir, inputs, binary, sysval_to_id, info, BI_IDVS_POSITION);
-                bi_compile_variant(nir, inputs, binary, sysval_to_id, info, BI_IDVS_VARYING);
+                bi_compile_variant(nir, inputs, binary, sysval_to_id, info,
+                                   BI_IDVS_POSITION, times);
+                bi_compile_variant(nir, inputs, binary, sysval_to_id, info,
+                                   BI_IDVS_VARYING, times);
         } else {
-                bi_compile_variant(nir, inputs, binary, sysval_to_id, info, BI_IDVS_NONE);
+                bi_compile_variant(nir, inputs, binary, sysval_to_id, info,
+                                   BI_IDVS_NONE, times);
         }
 
         if (gl_shader_stage_is_compute(nir->info.stage)) {
@@ -5337,4 +6057,7 @@ bifrost_compile_shader_nir(nir_shader *nir,
         info->ubo_mask &= (1 << nir->info.num_ubos) - 1;
 
         _mesa_hash_table_u64_destroy(sysval_to_id);
+
+        if (times)
+                bi_report_pass_times(nir, inputs, times);
 }
@@ -224,16 +224,114 @@ bi_side_effects(const bi_instr *I)
 /* Branch reconvergence is required when the execution mask may change
  * between adjacent instructions (clauses). This occurs for conditional
  * branches and for the last instruction (clause) in a block whose
- * fallthrough successor has multiple predecessors.
+ * fallthrough successor has multiple predecessors. Branches which are known
+ * to be uniform can't change the execution mask.
  */
 
 bool
 bi_reconverge_branches(bi_block *block)
 {
-        if (bi_num_successors(block) == 1)
-                return bi_num_predecessors(block->successors[0]) > 1;
-        else
-                return true;
+        if (bi_num_successors(block) == 1) {
+                return bi_num_predecessors(block->successors[0]) > 1 &&
+                       !block->successors[0]->uniform_join;
+        } else {
+                return !block->uniform_branch;
+        }
+}
+
+static bi_block *
+bi_dom_intersect(const unsigned *order, bi_block *a, bi_block *b)
+{
+        while (a != b) {
+                while (order[a->index] > order[b->index])
+                        a = a->idom;
+
+                while (order[b->index] > order[a->index])
+                        b = b->idom;
+        }
+
+        return a;
+}
+
+static unsigned
+bi_dom_number(bi_block *block, unsigned index)
+{
+        block->dom_pre_index = index++;
+
+        util_dynarray_foreach(&block->dom_children, bi_block *, child)
+                index = bi_dom_number(*child, index);
+
+        block->dom_post_index = index++;
+        return index;
+}
+
+/*
+ * Calculate the dominance tree with the algorithm from "A Simple, Fast
+ * Dominance Algorithm" by Cooper, Harvey and Kennedy. Blocks are visited in
+ * the structured order they were emitted in, which is a reverse postorder of
+ * the forward edges, so this converges quickly.
+ */
+void
+bi_calc_dominance(bi_context *ctx)
+{
+        unsigned *order = calloc(ctx->num_blocks, sizeof(unsigned));
+        unsigned i = 0;
+
+        bi_foreach_block(ctx, block) {
+                order[block->index] = i++;
+                block->idom = NULL;
+                block->dom_pre_index = ~0;
+                block->dom_post_index = 0;
+
+                util_dynarray_fini(&block->dom_children);
+                util_dynarray_init(&block->dom_children, block);
+        }
+
+        bi_block *start = bi_start_block(&ctx->blocks);
+        start->idom = start;
+
+        bool progress = true;
+
+        while (progress) {
+                progress = false;
+
+                bi_foreach_block(ctx, block) {
+                        if (block == start)
+                                continue;
+
+                        bi_block *idom = NULL;
+
+                        bi_foreach_predecessor(block, pred) {
+                                if (!(*pred)->idom)
+                                        continue;
+
+                                idom = idom ? bi_dom_intersect(order, idom, *pred) : *pred;
+                        }
+
+                        if (idom && block->idom != idom) {
+                                block->idom = idom;
+                                progress = true;
+                        }
+                }
+        }
+
+        start->idom = NULL;
+
+        bi_foreach_block(ctx, block) {
+                if (block->idom)
+                        util_dynarray_append(&block->idom->dom_children, bi_block *, block);
+        }
+
+        bi_dom_number(start, 0);
+        free(order);
+}
+
+/* Requires bi_calc_dominance. Blocks dominate themselves. */
+bool
+bi_block_dominates(const bi_block *parent, const bi_block *child)
+{
+        return parent->dom_pre_index <= child->dom_pre_index &&
+               child->dom_post_index <= parent->dom_post_index;
 }
 
 /*
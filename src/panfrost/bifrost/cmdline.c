@@ -25,6 +25,7 @@
  */
 
 #include <getopt.h>
+#include <stdarg.h>
 #include <string.h>
 #include "disassemble.h"
 #include "valhall/disassemble.h"
@@ -35,7 +36,9 @@
 #include "compiler/glsl/glsl_to_nir.h"
 #include "compiler/glsl/gl_nir.h"
 #include "compiler/nir_types.h"
+#include "util/u_debug.h"
 #include "util/u_dynarray.h"
+#include "util/os_time.h"
 #include "bifrost_compile.h"
 
 unsigned gpu_id = 0x7212;
@@ -114,9 +117,54 @@ fixup_varying_slots(nir_shader *nir, nir_variable_mode mode)
    }
 }
 
+/* Totals over a shader corpus, parsed back from the shader-db statistics the
+ * compiler reports through the debug callback */
+
+struct corpus_stats {
+        unsigned nr_shaders;
+        unsigned nr_ins, nr_tuples, nr_clauses, nr_nops;
+        float cycles;
+};
+
 static void
-compile_shader(int stages, char **files)
+stats_debug_message(void *data, unsigned *id, enum util_debug_type type,
+                    const char *fmt, va_list args)
+{
+        struct corpus_stats *stats = data;
+        char *str = NULL;
+
+        if (type != UTIL_DEBUG_TYPE_SHADER_INFO)
+                return;
+
+        if (vasprintf(&str, fmt, args) < 0)
+                return;
+
+        printf("    %s\n", str);
+
+        const char *body = strstr(str, "shader: ");
+        unsigned ins, tuples, clauses, nops;
+        float cycles;
+
+        if (body && sscanf(body, "shader: %u inst, %u tuples, %u clauses, "
+                           "%u nops, %f cycles",
+                           &ins, &tuples, &clauses, &nops, &cycles) == 5) {
+                stats->nr_shaders++;
+                stats->nr_ins += ins;
+                stats->nr_tuples += tuples;
+                stats->nr_clauses += clauses;
+                stats->nr_nops += nops;
+                stats->cycles += cycles;
+        }
+
+        free(str);
+}
+
+/* Returns the time spent in the backend compiler, in nanoseconds */
+
+static int64_t
+compile_shader(int stages, char **files, struct util_debug_callback *debug)
 {
+        int64_t backend_ns = 0;
         struct gl_shader_program *prog;
         nir_shader *nir[MESA_SHADER_COMPUTE + 1];
         unsigned shader_types[MESA_SHADER_COMPUTE + 1];
@@ -192,13 +240,22 @@ compile_shader(int stages, char **files)
                 NIR_PASS_V(nir[i], nir_opt_constant_folding);
 
                 struct panfrost_compile_inputs inputs = {
+                        .debug = debug,
                         .gpu_id = gpu_id,
                         .fixed_sysval_ubo = -1,
                 };
                 struct pan_shader_info info = { 0 };
 
                 util_dynarray_clear(&binary);
+
+                int64_t start = os_time_get_nano();
                 bifrost_compile_shader_nir(nir[i], &inputs, &binary, &info);
+                backend_ns += os_time_get_nano() - start;
+                ralloc_free(nir[i]);
+
+                /* Only statistics are wanted */
+                if (debug)
+                        continue;
 
                 char *fn = NULL;
                 asprintf(&fn, "shader_%u.bin", i);
@@ -210,6 +267,42 @@ compile_shader(int stages, char **files)
         }
 
         util_dynarray_fini(&binary);
+        standalone_compiler_cleanup(prog);
+        return backend_ns;
+}
+
+/* Compile each shader of a corpus separately, reporting scheduling quality:
+ * how many tuple slots are left as NOPs, clause counts and estimated cycles.
+ * Meant for comparing scheduler changes on Bifrost. The time spent in the
+ * backend is reported too, for comparing compile-time changes. */
+
+static void
+report_stats(int nr_files, char **files)
+{
+        struct corpus_stats stats = { 0 };
+        int64_t backend_ns = 0;
+        struct util_debug_callback debug = {
+                .debug_message = stats_debug_message,
+                .data = &stats,
+        };
+
+        for (int i = 0; i < nr_files; ++i) {
+                printf("%s:\n", files[i]);
+                backend_ns += compile_shader(1, &files[i], &debug);
+        }
+
+        unsigned nr_slots = stats.nr_tuples * 2;
+        float fill = nr_slots ?
+                ((float) (nr_slots - stats.nr_nops)) / nr_slots : 0.0;
+
+        printf("%u shaders, %u inst, %u tuples, %u clauses, %u nops, "
+               "%.1f%% tuple fill, %.2f tuples/clause, %f cycles\n",
+               stats.nr_shaders, stats.nr_ins, stats.nr_tuples,
+               stats.nr_clauses, stats.nr_nops, fill * 100.0,
+               stats.nr_clauses ?
+               ((float) stats.nr_tuples) / stats.nr_clauses : 0.0,
+               stats.cycles);
+        printf("%.2f ms in the backend compiler\n", backend_ns / 1000000.0);
 }
 
 #define BI_FOURCC(ch0, ch1, ch2, ch3) ( \
@@ -332,11 +425,13 @@ main(int argc, char **argv)
         }
 
         if (strcmp(argv[optind], "compile") == 0)
-                compile_shader(argc - optind - 1, &argv[optind + 1]);
+                compile_shader(argc - optind - 1, &argv[optind + 1], NULL);
+        else if (strcmp(argv[optind], "stats") == 0)
+                report_stats(argc - optind - 1, &argv[optind + 1]);
         else if (strcmp(argv[optind], "disasm") == 0)
                 disassemble(argv[optind + 1]);
         else {
-                fprintf(stderr, "Unknown command. Valid: compile/disasm\n");
+                fprintf(stderr, "Unknown command. Valid: compile/stats/disasm\n");
                 return 1;
         }
 
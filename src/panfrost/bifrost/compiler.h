@@ -34,6 +34,7 @@
 #include "util/u_math.h"
 #include "util/half_float.h"
 #include "util/u_worklist.h"
+#include "util/dag.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -698,11 +699,20 @@ typedef struct bi_block {
         /* Index of the block in source order */
         unsigned index;
 
+        /* Number of loops containing the block */
+        unsigned loop_nesting;
+
         /* Control flow graph */
         struct bi_block *successors[2];
         struct util_dynarray predecessors;
         bool unconditional_jumps;
 
+        /* Dominance tree, computed by bi_calc_dominance. The immediate
+         * dominator of the start block is NULL. */
+        struct bi_block *idom;
+        struct util_dynarray dom_children;
+        unsigned dom_pre_index, dom_post_index;
+
         /* Per 32-bit word live masks for the block indexed by node */
         uint8_t *live_in;
         uint8_t *live_out;
@@ -726,6 +736,14 @@ typedef struct bi_block {
          */
         bool needs_nop;
 
+        /* On Valhall, set if the conditional branch ending the block is
+         * uniform, or if all paths into the block were split by uniform
+         * branches. Either way no threads can diverge or rejoin here, see
+         * bi_reconverge_branches.
+         */
+        bool uniform_branch;
+        bool uniform_join;
+
         /* Flags available for pass-internal use */
         uint8_t pass_flags;
 } bi_block;
@@ -820,6 +838,14 @@ typedef struct {
        gl_shader_stage stage;
        struct list_head blocks; /* list of bi_block */
        struct hash_table_u64 *sysval_to_id;
+
+       /* Time spent in each pass, or NULL if not measured */
+       struct bi_pass_times *pass_times;
+
+       /* Linear allocator for instructions, which are never freed before the
+        * context. Saves ralloc's per-node header and bookkeeping, and keeps
+        * instructions created together close in memory */
+       void *linear_ctx;
        uint32_t quirks;
        unsigned arch;
        enum bi_idvs_mode idvs;
@@ -857,6 +883,9 @@ typedef struct {
        /* Mask of UBOs that need to be uploaded */
        uint32_t ubo_mask;
 
+       /* Number of loops around the code being emitted */
+       unsigned loop_nesting;
+
        /* During instruction selection, map from vector bi_index to its scalar
         * components, populated by a split.
         */
@@ -866,8 +895,39 @@ typedef struct {
        unsigned loop_count;
        unsigned spills;
        unsigned fills;
+
+       /* Values recomputed at their uses instead of spilled, and the time
+        * register allocation took */
+       unsigned remats;
+       unsigned ra_time_us;
+
+       /* Constants pushed as uniforms, and uses of constants built with
+        * instructions instead, on Valhall */
+       unsigned pushed_constants;
+       unsigned constant_moves;
+
+       /* Estimated cycles of the scheduled blocks before and after latency
+        * scheduling, on Valhall */
+       unsigned sched_cycles_before;
+       unsigned sched_cycles_after;
 } bi_context;
 
+/* Allocates a zeroed instruction with its destinations and sources stored
+ * inline after it */
+
+static inline bi_instr *
+bi_alloc_instr(bi_context *ctx, unsigned nr_dests, unsigned nr_srcs)
+{
+        size_t size = sizeof(bi_instr) + sizeof(bi_index) * (nr_dests + nr_srcs);
+        bi_instr *I = (bi_instr *) linear_zalloc_child(ctx->linear_ctx, size);
+
+        I->nr_dests = nr_dests;
+        I->nr_srcs = nr_srcs;
+        I->dest = (bi_index *) (&I[1]);
+        I->src = I->dest + nr_dests;
+        return I;
+}
+
 static inline void
 bi_remove_instruction(bi_instr *ins)
 {
@@ -1105,6 +1165,8 @@ unsigned bi_writemask(const bi_instr *ins, unsigned dest);
 bi_clause * bi_next_clause(bi_context *ctx, bi_block *block, bi_clause *clause);
 bool bi_side_effects(const bi_instr *I);
 bool bi_reconverge_branches(bi_block *block);
+void bi_calc_dominance(bi_context *ctx);
+bool bi_block_dominates(const bi_block *parent, const bi_block *child);
 
 bool bi_can_replace_with_csel(bi_instr *I);
 
@@ -1125,6 +1187,7 @@ void bi_mark_clauses_td(bi_context *ctx);
 void bi_analyze_helper_requirements(bi_context *ctx);
 void bi_opt_copy_prop(bi_context *ctx);
 void bi_opt_cse(bi_context *ctx);
+void bi_opt_licm(bi_context *ctx);
 void bi_opt_mod_prop_forward(bi_context *ctx);
 void bi_opt_mod_prop_backward(bi_context *ctx);
 void bi_opt_dead_code_eliminate(bi_context *ctx);
@@ -1143,6 +1206,18 @@ void va_lower_split_64bit(bi_context *ctx);
 void bi_lower_opt_instructions(bi_context *ctx);
 
 void bi_pressure_schedule(bi_context *ctx);
+
+/* Node of the dependency graph shared by the pre-RA schedulers */
+struct bi_sched_node {
+        struct dag_node dag;
+
+        /* Instruction this node represents */
+        bi_instr *instr;
+};
+
+struct dag *bi_create_sched_dag(bi_context *ctx, bi_block *block,
+                                void *memctx, size_t node_size);
+signed bi_calculate_pressure_delta(bi_instr *I, BITSET_WORD *live);
 void bi_schedule(bi_context *ctx);
 bool bi_can_fma(bi_instr *ins);
 bool bi_can_add(bi_instr *ins);
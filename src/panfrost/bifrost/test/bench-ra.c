@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Register allocation time on a corpus of generated straight-line shaders.
+ * Each shader keeps a window of values live and replaces a random one with
+ * an FMA of three others, so the window size sets the register pressure;
+ * the largest windows need spilling. */
+
+#include "compiler.h"
+#include "bi_builder.h"
+#include "bi_test.h"
+#include "pan_bench.h"
+
+struct ra_shader {
+        const char *name;
+        unsigned instructions;
+        unsigned live;
+        unsigned arch;
+};
+
+static uint32_t
+ra_random(uint32_t *state)
+{
+        *state = *state * 1103515245 + 12345;
+        return *state >> 8;
+}
+
+static bi_context *
+ra_build(void *memctx, const struct ra_shader *s)
+{
+        bi_builder *b = bit_builder(memctx);
+        bi_index *live = ralloc_array(memctx, bi_index, s->live);
+        uint32_t seed = s->instructions ^ (s->live << 16);
+
+        b->shader->arch = s->arch;
+
+        for (unsigned i = 0; i < s->live; ++i)
+                live[i] = bi_mov_i32(b, bi_imm_u32(i));
+
+        for (unsigned i = 0; i < s->instructions; ++i) {
+                bi_index x = live[ra_random(&seed) % s->live];
+                bi_index y = live[ra_random(&seed) % s->live];
+                bi_index z = live[ra_random(&seed) % s->live];
+
+                live[ra_random(&seed) % s->live] = bi_fma_f32(b, x, y, z);
+        }
+
+        /* Keep every value of the window alive until the end */
+        bi_index sum = live[0];
+
+        for (unsigned i = 1; i < s->live; ++i)
+                sum = bi_fadd_f32(b, sum, live[i]);
+
+        bi_mov_i32_to(b, bi_register(0), sum);
+        return b->shader;
+}
+
+static int64_t
+bench_ra(void *data, unsigned ops)
+{
+        const struct ra_shader *s = data;
+        int64_t ns = 0;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                void *memctx = ralloc_context(NULL);
+                bi_context *ctx = ra_build(memctx, s);
+
+                int64_t start = os_time_get_nano();
+                bi_register_allocate(ctx);
+                ns += os_time_get_nano() - start;
+
+                pan_bench_consume(ctx->info.tls_size);
+                ralloc_free(memctx);
+        }
+
+        /* Never report zero, which would mean "time the whole call" */
+        return MAX2(ns, 1);
+}
+
+int
+main(int argc, char **argv)
+{
+        static const struct ra_shader corpus[] = {
+                { "RA Valhall 64 instrs, 8 live", 64, 8, 10 },
+                { "RA Valhall 512 instrs, 24 live", 512, 24, 10 },
+                { "RA Valhall 2048 instrs, 48 live", 2048, 48, 10 },
+                { "RA Valhall 1024 instrs, 80 live (spills)", 1024, 80, 10 },
+                { "RA Bifrost 512 instrs, 24 live", 512, 24, 7 },
+        };
+
+        for (unsigned i = 0; i < ARRAY_SIZE(corpus); ++i)
+                pan_bench_run(corpus[i].name, bench_ra, (void *)&corpus[i], 0);
+
+        return 0;
+}
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2022 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "compiler.h"
+#include "bi_test.h"
+#include "bi_builder.h"
+
+#include <gtest/gtest.h>
+
+/* Build preheader -> header -> [then ->] latch -> exit, with the latch looping
+ * back to the header. Without a then block, the header is the latch. */
+struct loop {
+   bi_block *preheader, *header, *then, *latch, *exit;
+};
+
+static struct loop
+bit_loop(bi_builder *b, bool diamond)
+{
+   struct loop l;
+
+   l.preheader = bi_start_block(&b->shader->blocks);
+   l.header = bit_block(b->shader);
+   l.then = diamond ? bit_block(b->shader) : NULL;
+   l.latch = diamond ? bit_block(b->shader) : l.header;
+   l.exit = bit_block(b->shader);
+
+   bi_block_add_successor(l.preheader, l.header);
+
+   if (diamond) {
+      bi_block_add_successor(l.header, l.then);
+      bi_block_add_successor(l.header, l.latch);
+      bi_block_add_successor(l.then, l.latch);
+   }
+
+   bi_block_add_successor(l.latch, l.header);
+   bi_block_add_successor(l.latch, l.exit);
+
+   return l;
+}
+
+#define CASE(diamond, instr, expected) do { \
+   bi_builder *A = bit_builder(mem_ctx); \
+   bi_builder *B = bit_builder(mem_ctx); \
+   { \
+      bi_builder *b = A; \
+      struct loop l = bit_loop(b, diamond); \
+      UNUSED bi_index u = bi_temp(b->shader); \
+      UNUSED bi_index v = bi_temp(b->shader); \
+      UNUSED bi_index t = bi_temp(b->shader); \
+      UNUSED bi_index x = bi_temp(b->shader); \
+      UNUSED bi_index y = bi_temp(b->shader); \
+      UNUSED bi_index z = bi_temp(b->shader); \
+      UNUSED bool hoisted = false; \
+      instr; \
+   } \
+   { \
+      bi_builder *b = B; \
+      struct loop l = bit_loop(b, diamond); \
+      UNUSED bi_index u = bi_temp(b->shader); \
+      UNUSED bi_index v = bi_temp(b->shader); \
+      UNUSED bi_index t = bi_temp(b->shader); \
+      UNUSED bi_index x = bi_temp(b->shader); \
+      UNUSED bi_index y = bi_temp(b->shader); \
+      UNUSED bi_index z = bi_temp(b->shader); \
+      UNUSED bool hoisted = true; \
+      expected; \
+   } \
+   bi_opt_licm(A->shader); \
+   ASSERT_SHADER_EQUAL(A->shader, B->shader); \
+} while(0)
+
+#define NEGCASE(diamond, instr) CASE(diamond, instr, instr)
+
+/* Emit at the end of a block, or at the end of the preheader when building the
+ * expected shader for an instruction that should be hoisted */
+#define AT(block) b->cursor = bi_after_block(l.block)
+#define HOIST(block) b->cursor = bi_after_block(hoisted ? l.preheader : l.block)
+
+class LICM : public testing::Test {
+protected:
+   LICM() {
+      mem_ctx = ralloc_context(NULL);
+   }
+
+   ~LICM() {
+      ralloc_free(mem_ctx);
+   }
+
+   void *mem_ctx;
+};
+
+TEST_F(LICM, HoistInvariantArithmetic)
+{
+   CASE(false, {
+      HOIST(header);
+      bi_fadd_f32_to(b, x, u, v);
+      bi_fadd_f32_to(b, y, x, v);
+      AT(header);
+      bi_store_i32(b, y, u, v, BI_SEG_NONE, 0);
+   }, {
+      HOIST(header);
+      bi_fadd_f32_to(b, x, u, v);
+      bi_fadd_f32_to(b, y, x, v);
+      AT(header);
+      bi_store_i32(b, y, u, v, BI_SEG_NONE, 0);
+   });
+}
+
+TEST_F(LICM, KeepLoopCarriedValues)
+{
+   CASE(false, {
+      AT(header);
+      bi_instr *phi = bi_phi_to(b, t, 2);
+      phi->src[0] = u;
+      phi->src[1] = y;
+      bi_fadd_f32_to(b, x, t, v);
+      HOIST(header);
+      bi_fadd_f32_to(b, z, u, u);
+      AT(header);
+      bi_fadd_f32_to(b, y, x, z);
+   }, {
+      AT(header);
+      bi_instr *phi = bi_phi_to(b, t, 2);
+      phi->src[0] = u;
+      phi->src[1] = y;
+      bi_fadd_f32_to(b, x, t, v);
+      HOIST(header);
+      bi_fadd_f32_to(b, z, u, u);
+      AT(header);
+      bi_fadd_f32_to(b, y, x, z);
+   });
+}
+
+TEST_F(LICM, KeepMessages)
+{
+   NEGCASE(false, {
+      AT(header);
+      bi_load_i32_to(b, x, u, v, BI_SEG_NONE, 0);
+      bi_fadd_f32_to(b, y, x, v);
+   });
+}
+
+TEST_F(LICM, KeepConditionalArithmetic)
+{
+   NEGCASE(true, {
+      AT(then);
+      bi_fadd_f32_to(b, x, u, v);
+      bi_store_i32(b, x, u, v, BI_SEG_NONE, 0);
+   });
+}
+
+TEST_F(LICM, HoistFromBlockRunningEveryIteration)
+{
+   CASE(true, {
+      HOIST(latch);
+      bi_fadd_f32_to(b, x, u, v);
+      AT(latch);
+      bi_store_i32(b, x, u, v, BI_SEG_NONE, 0);
+   }, {
+      HOIST(latch);
+      bi_fadd_f32_to(b, x, u, v);
+      AT(latch);
+      bi_store_i32(b, x, u, v, BI_SEG_NONE, 0);
+   });
+}
@@ -181,3 +181,49 @@ TEST_F(MessagePreload, PreloadVartexLodModes)
          preload_moves(b, v, 4, 1);
    });
 }
+
+TEST_F(MessagePreload, PreloadTexturesFirst)
+{
+   CASE({
+         bi_ld_var_imm_to(b, u, bi_register(61), BI_REGISTER_FORMAT_F32,
+                          BI_SAMPLE_SAMPLE, BI_UPDATE_STORE, BI_VECSIZE_V4, 0);
+         bi_var_tex_f32_to(b, v, false, BI_SAMPLE_CENTER, BI_UPDATE_STORE, 0, 0);
+         bi_var_tex_f32_to(b, w, false, BI_SAMPLE_CENTER, BI_UPDATE_STORE, 1, 1);
+   }, {
+         bi_ld_var_imm_to(b, u, bi_register(61), BI_REGISTER_FORMAT_F32,
+                          BI_SAMPLE_SAMPLE, BI_UPDATE_STORE, BI_VECSIZE_V4, 0);
+         preload_moves(b, v, 4, 0);
+         preload_moves(b, w, 4, 1);
+   });
+}
+
+TEST_F(MessagePreload, PreloadFromUnconditionalBlocks)
+{
+#define BUILD_IF(then_instr, merge_instr) { \
+      bi_block *start = bi_start_block(&b->shader->blocks); \
+      bi_block *then = bit_block(b->shader); \
+      bi_block *merge = bit_block(b->shader); \
+      bi_block_add_successor(start, then); \
+      bi_block_add_successor(start, merge); \
+      bi_block_add_successor(then, merge); \
+      b->cursor = bi_after_block(then); \
+      then_instr; \
+      b->cursor = bi_after_block(merge); \
+      merge_instr; \
+   }
+
+   CASE(BUILD_IF({
+         bi_ld_var_imm_to(b, u, bi_register(61), BI_REGISTER_FORMAT_F32,
+                          BI_SAMPLE_SAMPLE, BI_UPDATE_STORE, BI_VECSIZE_V4, 0);
+   }, {
+         bi_ld_var_imm_to(b, v, bi_register(61), BI_REGISTER_FORMAT_F32,
+                          BI_SAMPLE_SAMPLE, BI_UPDATE_STORE, BI_VECSIZE_V4, 1);
+   }), BUILD_IF({
+         bi_ld_var_imm_to(b, u, bi_register(61), BI_REGISTER_FORMAT_F32,
+                          BI_SAMPLE_SAMPLE, BI_UPDATE_STORE, BI_VECSIZE_V4, 0);
+   }, {
+         preload_moves(b, v, 4, 0);
+   }));
+
+#undef BUILD_IF
+}
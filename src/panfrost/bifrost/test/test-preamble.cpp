@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "compiler.h"
+#include "compiler/nir/nir_builder.h"
+
+#include <gtest/gtest.h>
+
+/* A single UBO of four floats */
+static const float ubo0[4] = { 1.0, 2.0, 3.0, 4.0 };
+
+static uint32_t
+load_ubo(void *data, unsigned ubo, unsigned offset)
+{
+   uint32_t word = 0;
+
+   if (ubo == 0 && offset + 4 <= sizeof(ubo0))
+      memcpy(&word, (const uint8_t *) ubo0 + offset, 4);
+
+   return word;
+}
+
+class PreambleEval : public testing::Test {
+protected:
+   PreambleEval() {
+      static const nir_shader_compiler_options options = { };
+      nir_builder main =
+         nir_builder_init_simple_shader(MESA_SHADER_VERTEX, &options,
+                                        "preamble test");
+
+      nir_function_impl *impl = nir_shader_get_preamble(main.shader);
+      nir_builder_init(&_b, impl);
+      _b.cursor = nir_after_cf_list(&impl->body);
+      b = &_b;
+   }
+
+   ~PreambleEval() {
+      ralloc_free(b->shader);
+   }
+
+   nir_ssa_def *load(unsigned ubo, nir_ssa_def *offset, unsigned nr) {
+      nir_intrinsic_instr *load =
+         nir_intrinsic_instr_create(b->shader, nir_intrinsic_load_ubo);
+
+      load->num_components = nr;
+      load->src[0] = nir_src_for_ssa(nir_imm_int(b, ubo));
+      load->src[1] = nir_src_for_ssa(offset);
+      nir_intrinsic_set_align(load, 4, 0);
+      nir_intrinsic_set_range_base(load, 0);
+      nir_intrinsic_set_range(load, ~0);
+      nir_ssa_dest_init(&load->instr, &load->dest, nr, 32, NULL);
+      nir_builder_instr_insert(b, &load->instr);
+
+      return &load->dest.ssa;
+   }
+
+   void store(nir_ssa_def *value, unsigned base) {
+      nir_intrinsic_instr *store =
+         nir_intrinsic_instr_create(b->shader, nir_intrinsic_store_preamble);
+
+      store->num_components = value->num_components;
+      store->src[0] = nir_src_for_ssa(value);
+      nir_intrinsic_set_base(store, base);
+      nir_builder_instr_insert(b, &store->instr);
+   }
+
+   bool eval(uint32_t *words) {
+      struct pan_preamble preamble;
+
+      if (!pan_nir_collect_preamble(b->shader, &preamble))
+         return false;
+
+      memset(words, 0, PAN_MAX_PREAMBLE_WORDS * 4);
+      pan_preamble_eval(&preamble, load_ubo, NULL, words);
+      return true;
+   }
+
+   float word(const uint32_t *words, unsigned i) {
+      return uif(words[i]);
+   }
+
+   nir_builder *b, _b;
+};
+
+TEST_F(PreambleEval, Arithmetic)
+{
+   nir_ssa_def *v = load(0, nir_imm_int(b, 0), 4);
+   store(nir_fadd_imm(b, nir_fmul_imm(b, v, 2.0), 1.0), 0);
+   store(nir_fdot(b, v, v), 4);
+
+   uint32_t words[PAN_MAX_PREAMBLE_WORDS];
+   ASSERT_TRUE(eval(words));
+
+   EXPECT_EQ(word(words, 0), 3.0);
+   EXPECT_EQ(word(words, 1), 5.0);
+   EXPECT_EQ(word(words, 2), 7.0);
+   EXPECT_EQ(word(words, 3), 9.0);
+   EXPECT_EQ(word(words, 4), 30.0);
+}
+
+TEST_F(PreambleEval, Swizzle)
+{
+   static const unsigned swizzle[] = { 3, 2 };
+   nir_ssa_def *v = load(0, nir_imm_int(b, 0), 4);
+   store(nir_swizzle(b, v, swizzle, 2), 2);
+
+   uint32_t words[PAN_MAX_PREAMBLE_WORDS];
+   ASSERT_TRUE(eval(words));
+
+   EXPECT_EQ(word(words, 2), 4.0);
+   EXPECT_EQ(word(words, 3), 3.0);
+}
+
+TEST_F(PreambleEval, ComputedOffset)
+{
+   /* Offset of the second float, computed from the first */
+   nir_ssa_def *first = load(0, nir_imm_int(b, 0), 1);
+   nir_ssa_def *offset = nir_ishl_imm(b, nir_f2u32(b, first), 2);
+   store(load(0, offset, 1), 0);
+
+   uint32_t words[PAN_MAX_PREAMBLE_WORDS];
+   ASSERT_TRUE(eval(words));
+
+   EXPECT_EQ(word(words, 0), 2.0);
+}
+
+TEST_F(PreambleEval, OutOfBoundsLoadIsZero)
+{
+   store(load(0, nir_imm_int(b, 64), 2), 0);
+   store(load(1, nir_imm_int(b, 0), 1), 2);
+
+   uint32_t words[PAN_MAX_PREAMBLE_WORDS];
+   ASSERT_TRUE(eval(words));
+
+   EXPECT_EQ(words[0], 0u);
+   EXPECT_EQ(words[1], 0u);
+   EXPECT_EQ(words[2], 0u);
+}
+
+TEST_F(PreambleEval, Rejects64Bit)
+{
+   nir_ssa_def *v = nir_f2f64(b, load(0, nir_imm_int(b, 0), 1));
+   store(nir_f2f32(b, nir_fmul_imm(b, v, 2.0)), 0);
+
+   uint32_t words[PAN_MAX_PREAMBLE_WORDS];
+   EXPECT_FALSE(eval(words));
+}
+
+TEST_F(PreambleEval, RejectsTooManyWords)
+{
+   store(load(0, nir_imm_int(b, 0), 4), PAN_MAX_PREAMBLE_WORDS - 2);
+
+   uint32_t words[PAN_MAX_PREAMBLE_WORDS];
+   EXPECT_FALSE(eval(words));
+}
@@ -35,7 +35,23 @@ add_imm(bi_context *ctx)
    }
 }
 
+/* Lower with the constants of the shader pushed to an empty push buffer */
+static inline void
+push_imm(bi_context *ctx)
+{
+   struct panfrost_compile_inputs *inputs =
+      rzalloc(ctx, struct panfrost_compile_inputs);
+
+   inputs->push_constants = true;
+   ctx->inputs = inputs;
+   ctx->info.push = rzalloc(ctx, struct panfrost_ubo_push);
+
+   va_push_constants(ctx);
+   add_imm(ctx);
+}
+
 #define CASE(instr, expected) INSTRUCTION_CASE(instr, expected, add_imm)
+#define PUSH_CASE(instr, expected) INSTRUCTION_CASE(instr, expected, push_imm)
 
 class LowerConstants : public testing::Test {
 protected:
@@ -201,3 +217,55 @@ TEST_F(LowerConstants, MaintainMkvecRestrictedSwizzles)
         bi_mkvec_v2i8_to(b, bi_register(0), bi_register(0),
                          bi_byte(va_lut(11), 2), va_lut(0)));
 }
+
+static bi_index
+uniform(unsigned word)
+{
+   return bi_fau((enum bir_fau) (BIR_FAU_UNIFORM | (word >> 1)), word & 1);
+}
+
+TEST_F(LowerConstants, PushConstant)
+{
+   PUSH_CASE(bi_fadd_f32_to(b, bi_register(0), bi_register(0), bi_imm_f32(1234.5678)),
+             bi_fadd_f32_to(b, bi_register(0), bi_register(0), uniform(0)));
+
+   /* Inline encodings are still preferred */
+   PUSH_CASE(bi_fadd_f32_to(b, bi_register(0), bi_register(0), bi_imm_f32(1.0)),
+             bi_fadd_f32_to(b, bi_register(0), bi_register(0), va_lut(16)));
+}
+
+TEST_F(LowerConstants, PushConstantOnce)
+{
+   PUSH_CASE({
+      bi_fadd_f32_to(b, bi_register(0), bi_register(0), bi_imm_f32(1234.5678));
+      bi_fadd_f32_to(b, bi_register(1), bi_register(1), bi_imm_f32(-1234.5678));
+      bi_fadd_f32_to(b, bi_register(2), bi_register(2), bi_imm_f32(1234.5678));
+   }, {
+      bi_fadd_f32_to(b, bi_register(0), bi_register(0), uniform(0));
+      bi_fadd_f32_to(b, bi_register(1), bi_register(1), bi_neg(uniform(0)));
+      bi_fadd_f32_to(b, bi_register(2), bi_register(2), uniform(0));
+   });
+}
+
+TEST_F(LowerConstants, PairConstantsInSlot)
+{
+   PUSH_CASE({
+      bi_fadd_f32_to(b, bi_register(0), bi_register(0), bi_imm_f32(4321.8765));
+      bi_fma_f32_to(b, bi_register(1), bi_register(1), bi_imm_f32(1234.5678),
+                    bi_imm_f32(4321.8765));
+   }, {
+      bi_fadd_f32_to(b, bi_register(0), bi_register(0), uniform(0));
+      bi_fma_f32_to(b, bi_register(1), bi_register(1), uniform(1), uniform(0));
+   });
+}
+
+TEST_F(LowerConstants, ShareHalvesOfPushedWord)
+{
+   PUSH_CASE({
+      bi_fadd_v2f16_to(b, bi_register(0), bi_register(0), bi_imm_f16(1234.0));
+      bi_fadd_v2f16_to(b, bi_register(1), bi_register(1), bi_imm_f16(4321.0));
+   }, {
+      bi_fadd_v2f16_to(b, bi_register(0), bi_register(0), bi_half(uniform(0), false));
+      bi_fadd_v2f16_to(b, bi_register(1), bi_register(1), bi_half(uniform(0), true));
+   });
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2022 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "bi_test.h"
+#include "bi_builder.h"
+#include "va_compiler.h"
+
+#include <gtest/gtest.h>
+
+#define CASE(instr, expected) do { \
+   bi_builder *A = bit_builder(mem_ctx); \
+   bi_builder *B = bit_builder(mem_ctx); \
+   { \
+      bi_builder *b = A; \
+      bi_index u = bi_temp(b->shader); \
+      bi_index v = bi_temp(b->shader); \
+      bi_index x = bi_temp(b->shader); \
+      bi_index y = bi_temp(b->shader); \
+      bi_index t = bi_temp(b->shader); \
+      UNUSED bi_index r = bi_temp(b->shader); \
+      instr; \
+   } \
+   { \
+      bi_builder *b = B; \
+      bi_index u = bi_temp(b->shader); \
+      bi_index v = bi_temp(b->shader); \
+      bi_index x = bi_temp(b->shader); \
+      bi_index y = bi_temp(b->shader); \
+      bi_index t = bi_temp(b->shader); \
+      UNUSED bi_index r = bi_temp(b->shader); \
+      expected; \
+   } \
+   va_schedule(A->shader); \
+   ASSERT_SHADER_EQUAL(A->shader, B->shader); \
+} while(0)
+
+#define NEGCASE(instr) CASE(instr, instr)
+
+class Schedule : public testing::Test {
+protected:
+   Schedule() {
+      mem_ctx = ralloc_context(NULL);
+   }
+
+   ~Schedule() {
+      ralloc_free(mem_ctx);
+   }
+
+   void *mem_ctx;
+};
+
+TEST_F(Schedule, HoistLoadAboveArithmetic)
+{
+   CASE({
+         bi_fadd_f32_to(b, x, u, v);
+         bi_fadd_f32_to(b, y, x, v);
+         bi_load_i32_to(b, t, u, v, BI_SEG_NONE, 0);
+         bi_fadd_f32_to(b, r, t, y);
+   }, {
+         bi_load_i32_to(b, t, u, v, BI_SEG_NONE, 0);
+         bi_fadd_f32_to(b, x, u, v);
+         bi_fadd_f32_to(b, y, x, v);
+         bi_fadd_f32_to(b, r, t, y);
+   });
+}
+
+TEST_F(Schedule, LatencyAlreadyCovered)
+{
+   NEGCASE({
+         bi_load_i32_to(b, t, u, v, BI_SEG_NONE, 0);
+         bi_fadd_f32_to(b, x, u, v);
+         bi_fadd_f32_to(b, y, x, v);
+         bi_fadd_f32_to(b, r, t, y);
+   });
+}
+
+TEST_F(Schedule, LoadStaysAfterStore)
+{
+   NEGCASE({
+         bi_fadd_f32_to(b, x, u, v);
+         bi_store_i32(b, x, u, v, BI_SEG_NONE, 0);
+         bi_load_i32_to(b, t, u, v, BI_SEG_NONE, 0);
+         bi_fadd_f32_to(b, r, t, u);
+   });
+}
+
+TEST_F(Schedule, DependentChainUnchanged)
+{
+   NEGCASE({
+         bi_load_i32_to(b, t, u, v, BI_SEG_NONE, 0);
+         bi_fadd_f32_to(b, x, t, v);
+         bi_fadd_f32_to(b, y, x, v);
+         bi_fadd_f32_to(b, r, y, u);
+   });
+}
@@ -38,12 +38,14 @@ bool va_validate_fau(bi_instr *I);
 void va_validate(FILE *fp, bi_context *ctx);
 void va_repair_fau(bi_builder *b, bi_instr *I);
 void va_fuse_add_imm(bi_instr *I);
+void va_push_constants(bi_context *ctx);
 void va_lower_constants(bi_context *ctx, bi_instr *I);
 void va_lower_isel(bi_context *ctx);
 void va_assign_slots(bi_context *ctx);
 void va_insert_flow_control_nops(bi_context *ctx);
 void va_merge_flow(bi_context *ctx);
 void va_mark_last(bi_context *ctx);
+void va_schedule(bi_context *ctx);
 uint64_t va_pack_instr(const bi_instr *I);
 
 static inline unsigned
@@ -24,10 +24,16 @@
 #include "va_compiler.h"
 #include "valhall.h"
 #include "bi_builder.h"
+#include "util/hash_table.h"
+#include "util/u_dynarray.h"
 
 /* Only some special immediates are available, as specified in the Table of
  * Immediates in the specification. Other immediates must be lowered, either to
  * uniforms or to moves.
+ *
+ * Constants used by the shader are pooled before lowering, see
+ * va_push_constants. Constants that can't be encoded inline but made it into
+ * the pool are read as uniforms, and the rest are built with moves.
  */
 
 static bi_index
@@ -108,31 +114,37 @@ is_extension_of_16(uint32_t x, bool is_signed)
       return (x <= UINT16_MAX);
 }
 
+/*
+ * Try to encode the constant with the table of immediates, using swizzles and
+ * modifiers of the source where possible. Returns null if there is no inline
+ * encoding. Staging sources are registers, so constants are never inline.
+ */
 static bi_index
-va_resolve_constant(bi_builder *b, uint32_t value, struct va_src_info info, bool is_signed, bool staging)
+va_resolve_inline(uint32_t value, struct va_src_info info, bool is_signed, bool staging)
 {
+   if (staging)
+      return bi_null();
+
    /* Try the constant as-is */
-   if (!staging) {
-      bi_index lut = va_lut_index_32(value);
-      if (!bi_is_null(lut)) return lut;
+   bi_index lut = va_lut_index_32(value);
+   if (!bi_is_null(lut)) return lut;
 
-      /* ...or negated as a FP32 constant */
-      if (info.absneg && info.size == VA_SIZE_32) {
-         lut = bi_neg(va_lut_index_32(fui(-uif(value))));
-         if (!bi_is_null(lut)) return lut;
-      }
+   /* ...or negated as a FP32 constant */
+   if (info.absneg && info.size == VA_SIZE_32) {
+      lut = bi_neg(va_lut_index_32(fui(-uif(value))));
+      if (!bi_is_null(lut)) return lut;
+   }
 
-      /* ...or negated as a FP16 constant */
-      if (info.absneg && info.size == VA_SIZE_16) {
-         lut = bi_neg(va_lut_index_32(value ^ 0x80008000));
-         if (!bi_is_null(lut)) return lut;
-      }
+   /* ...or negated as a FP16 constant */
+   if (info.absneg && info.size == VA_SIZE_16) {
+      lut = bi_neg(va_lut_index_32(value ^ 0x80008000));
+      if (!bi_is_null(lut)) return lut;
    }
 
    /* Try using a single half of a FP16 constant */
    bool replicated_halves = (value & 0xFFFF) == (value >> 16);
-   if (!staging && info.swizzle && info.size == VA_SIZE_16 && replicated_halves) {
-      bi_index lut = va_lut_index_16(value & 0xFFFF);
+   if (info.swizzle && info.size == VA_SIZE_16 && replicated_halves) {
+      lut = va_lut_index_16(value & 0xFFFF);
       if (!bi_is_null(lut)) return lut;
 
       /* ...possibly negated */
@@ -143,34 +155,316 @@ va_resolve_constant(bi_builder *b, uint32_t value, struct va_src_info info, bool
    }
 
    /* Try extending a byte */
-   if (!staging && (info.widen || info.lanes || info.lane) &&
+   if ((info.widen || info.lanes || info.lane) &&
        is_extension_of_8(value, is_signed)) {
 
-      bi_index lut = va_lut_index_8(value & 0xFF);
+      lut = va_lut_index_8(value & 0xFF);
       if (!bi_is_null(lut)) return lut;
    }
 
    /* Try extending a halfword */
-   if (!staging && info.widen &&
+   if (info.widen &&
        is_extension_of_16(value, is_signed)) {
 
-      bi_index lut = va_lut_index_16(value & 0xFFFF);
+      lut = va_lut_index_16(value & 0xFFFF);
       if (!bi_is_null(lut)) return lut;
    }
 
    /* Try demoting the constant to FP16 */
-   if (!staging && info.swizzle && info.size == VA_SIZE_32) {
-      bi_index lut = va_demote_constant_fp16(value);
+   if (info.swizzle && info.size == VA_SIZE_32) {
+      lut = va_demote_constant_fp16(value);
       if (!bi_is_null(lut)) return lut;
 
       if (info.absneg) {
-         bi_index lut = bi_neg(va_demote_constant_fp16(fui(-uif(value))));
+         lut = bi_neg(va_demote_constant_fp16(fui(-uif(value))));
          if (!bi_is_null(lut)) return lut;
       }
    }
 
-   /* TODO: Optimize to uniform */
-   return va_mov_imm(b, value);
+   return bi_null();
+}
+
+/*
+ * Resolve any swizzle of a constant source, keeping in mind the different
+ * interpretations of swizzles in different contexts.
+ */
+static uint32_t
+va_constant_value(const bi_instr *I, unsigned s, struct va_src_info info)
+{
+   uint32_t value = I->src[s].value;
+   enum bi_swizzle swz = I->src[s].swizzle;
+
+   if (info.size == VA_SIZE_32) {
+      /* Extracting a half from the 32-bit value */
+      if (swz == BI_SWIZZLE_H00)
+         value = (value & 0xFFFF);
+      else if (swz == BI_SWIZZLE_H11)
+         value = (value >> 16);
+      else
+         assert(swz == BI_SWIZZLE_H01);
+
+      /* FP16 -> FP32 */
+      if (info.swizzle && swz != BI_SWIZZLE_H01)
+         value = fui(_mesa_half_to_float(value));
+   } else if (info.size == VA_SIZE_16) {
+      assert(swz >= BI_SWIZZLE_H00 && swz <= BI_SWIZZLE_H11);
+      value = bi_apply_swizzle(value, swz);
+   } else if (info.size == VA_SIZE_8 && (info.lane || info.lanes)) {
+      /* 8-bit extract */
+      unsigned chan = (swz - BI_SWIZZLE_B0000);
+      assert(chan < 4);
+
+      value = (value >> (8 * chan)) & 0xFF;
+   } else {
+      /* TODO: Any other special handling? */
+      value = bi_apply_swizzle(value, swz);
+   }
+
+   return value;
+}
+
+static bi_index
+va_pushed_word(unsigned word)
+{
+   return bi_fau(BIR_FAU_UNIFORM | (word >> 1), word & 1);
+}
+
+/*
+ * Look for the constant among the pushed constants, either as a whole word,
+ * negated, or as a half of a word for sources that can swizzle halves.
+ */
+static bi_index
+va_lookup_pushed(const struct panfrost_ubo_push *push, uint32_t value,
+                 struct va_src_info info)
+{
+   bool replicated_halves = (value & 0xFFFF) == (value >> 16);
+
+   if (!push)
+      return bi_null();
+
+   for (unsigned i = 0; i < push->count; ++i) {
+      if (push->words[i].ubo != PAN_UBO_CONSTANTS)
+         continue;
+
+      uint32_t c = push->constants[i];
+
+      if (c == value)
+         return va_pushed_word(i);
+
+      if (info.absneg && info.size == VA_SIZE_32 && c == (value ^ BITFIELD_BIT(31)))
+         return bi_neg(va_pushed_word(i));
+
+      if (info.absneg && info.size == VA_SIZE_16 && c == (value ^ 0x80008000))
+         return bi_neg(va_pushed_word(i));
+
+      if (info.swizzle && info.size == VA_SIZE_16 && replicated_halves) {
+         if ((c & 0xFFFF) == (value & 0xFFFF))
+            return bi_half(va_pushed_word(i), false);
+         else if ((c >> 16) == (value & 0xFFFF))
+            return bi_half(va_pushed_word(i), true);
+      }
+   }
+
+   return bi_null();
+}
+
+struct va_constant {
+   uint32_t value;
+   unsigned uses;
+
+   /* Another constant read by the same instruction, which is best pushed to
+    * the other half of the 64-bit slot. Index into the pool plus one. */
+   unsigned partner;
+
+   /* Every use reads replicated 16-bit halves, or is an FP32 source which can
+    * negate, allowing the constant to share a pushed word */
+   bool all_half, all_neg;
+   bool pushed;
+};
+
+static int
+va_constant_cmp(const void *a_, const void *b_)
+{
+   const struct va_constant *a = *((const struct va_constant **) a_);
+   const struct va_constant *b = *((const struct va_constant **) b_);
+
+   /* Most used first, ties broken by value for determinism */
+   if (a->uses != b->uses)
+      return (a->uses > b->uses) ? -1 : 1;
+
+   return (a->value > b->value) - (a->value < b->value);
+}
+
+static bool
+va_has_fau(const bi_instr *I)
+{
+   bi_foreach_src(I, s) {
+      if (I->src[s].type == BI_INDEX_FAU)
+         return true;
+   }
+
+   return false;
+}
+
+static unsigned
+va_push_word(struct panfrost_ubo_push *push, uint32_t value)
+{
+   unsigned word = push->count++;
+
+   push->words[word] = (struct panfrost_ubo_word) {
+      .ubo = PAN_UBO_CONSTANTS,
+      .offset = word,
+   };
+
+   push->constants[word] = value;
+   return word;
+}
+
+static void
+va_push_constant(bi_context *ctx, struct va_constant *k, signed *open_half)
+{
+   struct panfrost_ubo_push *push = ctx->info.push;
+   struct va_src_info info = {
+      .size = k->all_half ? VA_SIZE_16 : VA_SIZE_32,
+      .swizzle = k->all_half,
+      .absneg = k->all_neg,
+   };
+
+   /* Shared with a pushed word already */
+   if (!bi_is_null(va_lookup_pushed(push, k->value, info))) {
+      k->pushed = true;
+      return;
+   }
+
+   /* Halves pack two to a word */
+   if (k->all_half && *open_half >= 0) {
+      push->constants[*open_half] &= 0xFFFF;
+      push->constants[*open_half] |= (k->value << 16);
+      *open_half = -1;
+      k->pushed = true;
+      return;
+   }
+
+   if (push->count >= PAN_MAX_PUSH)
+      return;
+
+   unsigned word = va_push_word(push, k->value);
+   ctx->pushed_constants++;
+   k->pushed = true;
+
+   if (k->all_half)
+      *open_half = word;
+}
+
+/*
+ * Build a pool of the constants in the shader without an inline encoding, and
+ * push as many as fit in the remaining push words, most used first. Each value
+ * is pushed once for the whole shader. An instruction may only read a single
+ * 64-bit uniform slot, so constants read by the same instruction are paired in
+ * a slot where possible.
+ */
+void
+va_push_constants(bi_context *ctx)
+{
+   struct panfrost_ubo_push *push = ctx->info.push;
+
+   if (!ctx->inputs->push_constants || ctx->inputs->is_blend || !push)
+      return;
+
+   struct hash_table_u64 *index = _mesa_hash_table_u64_create(ctx);
+   struct util_dynarray pool;
+   util_dynarray_init(&pool, ctx);
+
+   bi_foreach_instr_global(ctx, I) {
+      if (I->op == BI_OPCODE_PHI || va_has_fau(I))
+         continue;
+
+      unsigned first = 0;
+
+      bi_foreach_src(I, s) {
+         if (I->src[s].type != BI_INDEX_CONSTANT)
+            continue;
+
+         bool is_signed = valhall_opcodes[I->op].is_signed;
+         bool staging = (s < valhall_opcodes[I->op].nr_staging_srcs);
+         struct va_src_info info = va_src_info(I->op, s);
+         uint32_t value = va_constant_value(I, s, info);
+
+         if (staging || !bi_is_null(va_resolve_inline(value, info, is_signed, staging)))
+            continue;
+
+         bool half = info.swizzle && info.size == VA_SIZE_16 &&
+                     (value & 0xFFFF) == (value >> 16);
+         bool neg = info.absneg && info.size == VA_SIZE_32;
+
+         uintptr_t idx = (uintptr_t) _mesa_hash_table_u64_search(index, value);
+
+         if (!idx) {
+            struct va_constant k = {
+               .value = value,
+               .all_half = half,
+               .all_neg = neg,
+            };
+
+            util_dynarray_append(&pool, struct va_constant, k);
+            idx = util_dynarray_num_elements(&pool, struct va_constant);
+            _mesa_hash_table_u64_insert(index, value, (void *) idx);
+         }
+
+         struct va_constant *k =
+            util_dynarray_element(&pool, struct va_constant, idx - 1);
+
+         k->uses++;
+         k->all_half &= half;
+         k->all_neg &= neg;
+
+         if (!first) {
+            first = idx;
+         } else if (first != idx) {
+            struct va_constant *f =
+               util_dynarray_element(&pool, struct va_constant, first - 1);
+
+            if (!f->partner) f->partner = idx;
+            if (!k->partner) k->partner = first;
+         }
+      }
+   }
+
+   unsigned count = util_dynarray_num_elements(&pool, struct va_constant);
+   struct va_constant *base = util_dynarray_begin(&pool);
+   struct va_constant **order = ralloc_array(ctx, struct va_constant *, count);
+
+   for (unsigned i = 0; i < count; ++i)
+      order[i] = &base[i];
+
+   qsort(order, count, sizeof(*order), va_constant_cmp);
+
+   signed open_half = -1;
+
+   for (unsigned i = 0; i < count; ++i) {
+      struct va_constant *k = order[i];
+
+      if (k->pushed)
+         continue;
+
+      /* Start a new slot for constants with a partner, so the pair can share
+       * it, padding the odd word left behind */
+      struct va_constant *partner =
+         k->partner ? &base[k->partner - 1] : NULL;
+
+      if (partner && !partner->pushed && (push->count & 1) &&
+          push->count < PAN_MAX_PUSH)
+         va_push_word(push, 0);
+
+      va_push_constant(ctx, k, &open_half);
+
+      if (partner && !partner->pushed)
+         va_push_constant(ctx, partner, &open_half);
+   }
+
+   ralloc_free(order);
+   util_dynarray_fini(&pool);
+   _mesa_hash_table_u64_destroy(index);
 }
 
 void
@@ -186,39 +480,18 @@ va_lower_constants(bi_context *ctx, bi_instr *I)
          bool is_signed = valhall_opcodes[I->op].is_signed;
          bool staging = (s < valhall_opcodes[I->op].nr_staging_srcs);
          struct va_src_info info = va_src_info(I->op, s);
-         uint32_t value = I->src[s].value;
-         enum bi_swizzle swz = I->src[s].swizzle;
+         uint32_t value = va_constant_value(I, s, info);
 
-         /* Resolve any swizzle, keeping in mind the different interpretations
-          * swizzles in different contexts.
-          */
-         if (info.size == VA_SIZE_32) {
-            /* Extracting a half from the 32-bit value */
-            if (swz == BI_SWIZZLE_H00)
-               value = (value & 0xFFFF);
-            else if (swz == BI_SWIZZLE_H11)
-               value = (value >> 16);
-            else
-               assert(swz == BI_SWIZZLE_H01);
-
-            /* FP16 -> FP32 */
-            if (info.swizzle && swz != BI_SWIZZLE_H01)
-               value = fui(_mesa_half_to_float(value));
-         } else if (info.size == VA_SIZE_16) {
-            assert(swz >= BI_SWIZZLE_H00 && swz <= BI_SWIZZLE_H11);
-            value = bi_apply_swizzle(value, swz);
-         } else if (info.size == VA_SIZE_8 && (info.lane || info.lanes)) {
-            /* 8-bit extract */
-            unsigned chan = (swz - BI_SWIZZLE_B0000);
-            assert(chan < 4);
-
-            value = (value >> (8 * chan)) & 0xFF;
-         } else {
-            /* TODO: Any other special handling? */
-            value = bi_apply_swizzle(value, swz);
+         bi_index cons = va_resolve_inline(value, info, is_signed, staging);
+
+         if (bi_is_null(cons) && !staging)
+            cons = va_lookup_pushed(ctx->info.push, value, info);
+
+         if (bi_is_null(cons)) {
+            cons = va_mov_imm(&b, value);
+            ctx->constant_moves++;
          }
 
-         bi_index cons = va_resolve_constant(&b, value, info, is_signed, staging);
          cons.neg ^= I->src[s].neg;
          I->src[s] = cons;
 
@@ -396,6 +396,10 @@ va_pack_alu(const bi_instr *I)
       hex |= ((uint64_t) I->subgroup) << 36;
       break;
 
+   case BI_OPCODE_WMASK:
+      hex |= ((uint64_t) I->subgroup) << 36;
+      break;
+
    case BI_OPCODE_LD_VAR:
    case BI_OPCODE_LD_VAR_FLAT:
    case BI_OPCODE_LD_VAR_IMM:
@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2022 Collabora Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "va_compiler.h"
+
+/*
+ * Pre-RA latency scheduler for Valhall. Valhall issues in order and only waits
+ * on the result of a message at its first use, so a message whose consumer
+ * follows right behind stalls the warp for the whole round trip. Schedule each
+ * block bottom-up over the dependency graph of bi_pressure_schedule, delaying
+ * (that is, hoisting) messages until enough independent work sits between them
+ * and their users to cover their latency.
+ *
+ * Hoisting lengthens live ranges, so register pressure may not grow past what
+ * the input order needs, or the limit for full occupancy if that is higher.
+ * When the limit is reached, the scheduler falls back to picking instructions
+ * by their effect on liveness. The new order is kept only if the cycle model
+ * says it is faster.
+ */
+
+/* Registers a thread may use while still running at full occupancy */
+#define VA_FULL_OCCUPANCY_REGS 32
+
+struct va_sched_node {
+   struct bi_sched_node base;
+
+   /* Earliest bottom-up cycle the node may be scheduled at without its users
+    * waiting on the result */
+   unsigned earliest;
+
+   /* Longest latency-weighted dependency chain from the top of the block to
+    * the node's result */
+   unsigned depth;
+};
+
+/* Rough round trip estimates, in issue cycles, of the result of an instruction
+ * becoming available. Arithmetic latency is hidden by the pipeline. */
+static unsigned
+va_latency(const bi_instr *I)
+{
+   if (bi_opcode_props[I->op].message == BIFROST_MESSAGE_NONE)
+      return 1;
+
+   switch (valhall_opcodes[I->op].unit) {
+   case VA_UNIT_T:
+   case VA_UNIT_VT:
+      return 40;
+   case VA_UNIT_LS:
+      return 30;
+   case VA_UNIT_V:
+      return 12;
+   default:
+      return 8;
+   }
+}
+
+/* Issue cycles of a sequence of instructions, waiting on sources produced
+ * earlier in the sequence. ready is indexed by SSA value and must be zero on
+ * entry; it is zero again on exit. */
+static unsigned
+va_estimate_cycles(bi_instr **order, unsigned nr, unsigned *ready)
+{
+   unsigned cycle = 0;
+
+   for (unsigned i = 0; i < nr; ++i) {
+      bi_instr *I = order[i];
+
+      bi_foreach_ssa_src(I, s)
+         cycle = MAX2(cycle, ready[I->src[s].value]);
+
+      bi_foreach_dest(I, d)
+         ready[I->dest[d].value] = cycle + va_latency(I);
+
+      cycle++;
+   }
+
+   for (unsigned i = 0; i < nr; ++i) {
+      bi_foreach_dest(order[i], d)
+         ready[order[i]->dest[d].value] = 0;
+   }
+
+   return cycle;
+}
+
+static void
+va_compute_depth(struct dag_node *dag_node, UNUSED void *data)
+{
+   struct va_sched_node *node = (struct va_sched_node *) dag_node;
+
+   util_dynarray_foreach(&dag_node->edges, struct dag_edge, edge) {
+      struct va_sched_node *child = (struct va_sched_node *) edge->child;
+
+      node->depth = MAX2(node->depth,
+                         child->depth + va_latency(child->base.instr));
+   }
+}
+
+/* Registers live at the end of the block */
+static unsigned
+va_live_out_pressure(bi_context *ctx, bi_block *block, const unsigned *sizes)
+{
+   unsigned pressure = 0;
+   unsigned i;
+
+   BITSET_FOREACH_SET(i, block->ssa_live_out, ctx->ssa_alloc)
+      pressure += sizes[i];
+
+   return pressure;
+}
+
+static struct va_sched_node *
+va_choose_instr(struct dag *dag, BITSET_WORD *live, unsigned cycle,
+                bool limit_pressure)
+{
+   struct va_sched_node *best = NULL;
+   signed best_delta = 0;
+
+   list_for_each_entry(struct va_sched_node, n, &dag->heads, base.dag.link) {
+      signed delta = bi_calculate_pressure_delta(n->base.instr, live);
+
+      if (!best) {
+         best = n;
+         best_delta = delta;
+         continue;
+      }
+
+      if (limit_pressure) {
+         if (delta < best_delta) {
+            best = n;
+            best_delta = delta;
+         }
+
+         continue;
+      }
+
+      bool ready = n->earliest <= cycle;
+      bool best_ready = best->earliest <= cycle;
+
+      /* Prefer instructions that can issue without waiting. Otherwise, wait
+       * as little as possible. */
+      if (ready != best_ready) {
+         if (ready) {
+            best = n;
+            best_delta = delta;
+         }
+
+         continue;
+      }
+
+      if (!ready && n->earliest != best->earliest) {
+         if (n->earliest < best->earliest) {
+            best = n;
+            best_delta = delta;
+         }
+
+         continue;
+      }
+
+      /* Schedule the longest chains last, leaving room above for the work
+       * they depend on, then break ties on liveness */
+      if (n->depth > best->depth ||
+          (n->depth == best->depth && delta < best_delta)) {
+         best = n;
+         best_delta = delta;
+      }
+   }
+
+   return best;
+}
+
+static void
+va_schedule_block(bi_context *ctx, bi_block *block, void *memctx,
+                  BITSET_WORD *live, const unsigned *sizes, unsigned *ready)
+{
+   struct dag *dag = bi_create_sched_dag(ctx, block, memctx,
+                                         sizeof(struct va_sched_node));
+
+   unsigned nr_ins = 0;
+   bi_foreach_instr_in_block(block, I) {
+      if (I->op == BI_OPCODE_JUMP || bi_opcode_props[I->op].branch)
+         break;
+
+      nr_ins++;
+   }
+
+   if (nr_ins == 0)
+      return;
+
+   bi_instr **orig = calloc(nr_ins, sizeof(bi_instr *));
+   bi_instr **order = calloc(nr_ins, sizeof(bi_instr *));
+
+   unsigned i = 0;
+   bi_foreach_instr_in_block(block, I) {
+      if (i == nr_ins)
+         break;
+
+      orig[i++] = I;
+   }
+
+   /* Register pressure of the input order */
+   unsigned live_out = va_live_out_pressure(ctx, block, sizes);
+   signed pressure = live_out, max_pressure = live_out;
+
+   memcpy(live, block->ssa_live_out, BITSET_WORDS(ctx->ssa_alloc) * sizeof(BITSET_WORD));
+
+   for (i = nr_ins; i-- > 0; ) {
+      pressure += bi_calculate_pressure_delta(orig[i], live);
+      max_pressure = MAX2(pressure, max_pressure);
+      bi_liveness_ins_update_ssa(live, orig[i]);
+   }
+
+   signed limit = MAX2(max_pressure, VA_FULL_OCCUPANCY_REGS);
+   signed new_max_pressure = live_out;
+
+   dag_traverse_bottom_up(dag, va_compute_depth, NULL);
+
+   /* Schedule bottom-up */
+   memcpy(live, block->ssa_live_out, BITSET_WORDS(ctx->ssa_alloc) * sizeof(BITSET_WORD));
+   pressure = live_out;
+
+   unsigned cycle = 0;
+
+   for (i = nr_ins; i-- > 0; ) {
+      struct va_sched_node *node =
+         va_choose_instr(dag, live, cycle, pressure >= limit);
+
+      cycle = MAX2(cycle, node->earliest) + 1;
+
+      util_dynarray_foreach(&node->base.dag.edges, struct dag_edge, edge) {
+         struct va_sched_node *child = (struct va_sched_node *) edge->child;
+
+         child->earliest = MAX2(child->earliest,
+                                cycle + va_latency(child->base.instr) - 1);
+      }
+
+      pressure += bi_calculate_pressure_delta(node->base.instr, live);
+      new_max_pressure = MAX2(pressure, new_max_pressure);
+      bi_liveness_ins_update_ssa(live, node->base.instr);
+      dag_prune_head(dag, &node->base.dag);
+
+      order[i] = node->base.instr;
+   }
+
+   assert(list_is_empty(&dag->heads));
+
+   unsigned before = va_estimate_cycles(orig, nr_ins, ready);
+   unsigned after = va_estimate_cycles(order, nr_ins, ready);
+
+   /* Apply the schedule if it looks like a win */
+   if (after < before && new_max_pressure <= limit) {
+      for (i = nr_ins; i-- > 0; ) {
+         bi_remove_instruction(order[i]);
+         list_add(&order[i]->link, &block->instructions);
+      }
+   } else {
+      after = before;
+   }
+
+   ctx->sched_cycles_before += before;
+   ctx->sched_cycles_after += after;
+
+   free(orig);
+   free(order);
+}
+
+void
+va_schedule(bi_context *ctx)
+{
+   bi_compute_liveness_ssa(ctx);
+
+   void *memctx = ralloc_context(ctx);
+   BITSET_WORD *live = ralloc_array(memctx, BITSET_WORD, BITSET_WORDS(ctx->ssa_alloc));
+   unsigned *sizes = rzalloc_array(memctx, unsigned, ctx->ssa_alloc);
+   unsigned *ready = rzalloc_array(memctx, unsigned, ctx->ssa_alloc);
+
+   bi_foreach_instr_global(ctx, I) {
+      bi_foreach_dest(I, d)
+         sizes[I->dest[d].value] = bi_count_write_registers(I, d);
+   }
+
+   bi_foreach_block(ctx, block)
+      va_schedule_block(ctx, block, memctx, live, sizes, ready);
+
+   ralloc_free(memctx);
+}
@@ -1716,9 +1716,11 @@ pandecode_cs_command(uint64_t command, mali_ptr va,
         }
 
         case 40: {
-                if (addr || l >> 16 || arg1 > 1) {
+                /* The upper half of the low word is the mask of scoreboard
+                 * slots to wait for before storing */
+                if (addr || arg1 > 1) {
                         pandecode_log("str type %02x, (unk %02x), "
-                                      "(unk %x), [x%02x, %i]\n",
+                                      "wait 0x%x, [x%02x, %i]\n",
                                       addr, arg1,
                                       l >> 16, arg2, (int16_t) l);
                 } else {
@@ -1727,8 +1729,12 @@ pandecode_cs_command(uint64_t command, mali_ptr va,
                                 "cycles",
                         }[arg1];
 
-                        pandecode_log("str %s, [x%02x, %i]\n",
-                                      type, arg2, (int16_t) l);
+                        if (l >> 16)
+                                pandecode_log("str %s, [x%02x, %i], wait 0x%x\n",
+                                              type, arg2, (int16_t) l, l >> 16);
+                        else
+                                pandecode_log("str %s, [x%02x, %i]\n",
+                                              type, arg2, (int16_t) l);
                 }
                 break;
         }
@@ -42,16 +42,28 @@ pack_header = """
 #define PAN_PACK_H
 
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
 
 #include "util/bitpack_helpers.h"
 
+/* Values known to be held by the CS registers at the current point of a
+ * command stream. Register moves which would not change the value are
+ * skipped. */
+struct pan_cs_shadow {
+   uint32_t values[256];
+   uint64_t valid[4];
+};
+
 /* Most functions assume the caller has done bounds checking */
 typedef struct pan_command_stream {
    uint64_t *ptr;
    uint64_t *begin;
    uint64_t *end;
    uint64_t gpu;
+
+   /* Optional, only for streams which execute straight through */
+   struct pan_cs_shadow *shadow;
 } pan_command_stream;
 
 struct pan_command_stream_decoded {
@@ -135,6 +147,17 @@ __gen_clear_value(uint8_t *restrict cl, uint32_t start, uint32_t end)
         ({ PREFIX2(T, pack)((uint32_t *) (dst), &name);  \\
            _loop_terminate = NULL; }))
 
+/* Like pan_pack, but into a packed template, writing only the given words.
+ * Fields outside of these words are ignored, and the other fields of these
+ * words are packed with their defaults, so the mask usually comes from the
+ * _WORDS of the fields packed. */
+#define pan_pack_words(dst, T, words, name)                 \\
+   for (struct PREFIX1(T) name = { PREFIX2(T, header) }, \\
+        *_loop_terminate = (void *) (dst);                  \\
+        __builtin_expect(_loop_terminate != NULL, 1);       \\
+        ({ PREFIX2(T, pack_words)((uint32_t *) (dst), &name, (words)); \\
+           _loop_terminate = NULL; }))
+
 #define pan_unpack(src, T, name)                        \\
         struct PREFIX1(T) name;                         \\
         PREFIX2(T, unpack)((uint8_t *)(src), &name)
@@ -266,10 +289,46 @@ with_cs = """
         PREFIX4(A, SECTION, S, TYPE) name;                             \\
         PREFIX4(A, SECTION, S, unpack)(buf, buf_unk, &name)
 
+static inline void
+pan_cs_shadow_invalidate(struct pan_cs_shadow *shadow, unsigned reg,
+                         unsigned count)
+{
+   for (unsigned i = reg; i < reg + count; ++i)
+      shadow->valid[i / 64] &= ~(1ULL << (i % 64));
+}
+
+static inline bool
+pan_cs_shadow_holds(const struct pan_cs_shadow *shadow, unsigned reg,
+                    uint32_t value)
+{
+   return (shadow->valid[reg / 64] & (1ULL << (reg % 64))) &&
+          shadow->values[reg] == value;
+}
+
+static inline void
+pan_cs_shadow_set(struct pan_cs_shadow *shadow, unsigned reg, uint32_t value)
+{
+   shadow->values[reg] = value;
+   shadow->valid[reg / 64] |= (1ULL << (reg % 64));
+}
+
+/* Instructions which leave all registers alone: NOP, the register moves
+ * (tracked separately), WAIT, the job launches, FLUSH_TILER, STR, SLOT,
+ * RESOURCES, EVSTR, EVWAIT, STORE_STATE and HEAPCTX. Anything else may write
+ * registers or transfer control, so forgets everything. */
+#define PAN_CS_OPS_KEEP_REGS \
+   (BITFIELD64_RANGE(0, 8) | BITFIELD64_BIT(9) | BITFIELD64_BIT(21) | \
+    BITFIELD64_BIT(23) | BITFIELD64_BIT(34) | BITFIELD64_RANGE(38, 3) | \
+    BITFIELD64_BIT(48) | BITFIELD64_RANGE(52, 2))
+
 static inline void
 pan_emit_cs_ins(pan_command_stream *s, uint8_t op, uint64_t instr)
 {
    assert(instr < (1ULL << 56));
+
+   if (s->shadow && (op >= 64 || !(PAN_CS_OPS_KEEP_REGS & BITFIELD64_BIT(op))))
+      memset(s->shadow->valid, 0, sizeof(s->shadow->valid));
+
    instr |= ((uint64_t)op << 56);
    *((s->ptr)++) = instr;
 }
@@ -277,13 +336,31 @@ pan_emit_cs_ins(pan_command_stream *s, uint8_t op, uint64_t instr)
 static inline void
 pan_emit_cs_32(pan_command_stream *s, uint8_t reg, uint32_t value)
 {
+   if (s->shadow) {
+      if (pan_cs_shadow_holds(s->shadow, reg, value))
+         return;
+
+      pan_cs_shadow_set(s->shadow, reg, value);
+   }
+
    pan_emit_cs_ins(s, 2, ((uint64_t) reg << 48) | value);
 }
 
+/* Writes the pair reg, reg + 1 */
 static inline void
 pan_emit_cs_48(pan_command_stream *s, uint8_t reg, uint64_t value)
 {
    assert(value < (1ULL << 48));
+
+   if (s->shadow) {
+      if (pan_cs_shadow_holds(s->shadow, reg, value) &&
+          pan_cs_shadow_holds(s->shadow, reg + 1, value >> 32))
+         return;
+
+      pan_cs_shadow_set(s->shadow, reg, value);
+      pan_cs_shadow_set(s->shadow, reg + 1, value >> 32);
+   }
+
    pan_emit_cs_ins(s, 1, ((uint64_t) reg << 48) | value);
 }
 
@@ -924,12 +1001,52 @@ class Parser(object):
         print("")
 
     def emit_pack_function(self, name, group):
-        print("static inline void\n%s_pack(uint32_t * restrict cl,\n%sconst struct %s * restrict values)\n{" %
-              (name, ' ' * (len(name) + 6), name))
-
-        group.emit_pack_function()
+        length = group.get_length()
 
-        print("}\n\n")
+        if length == 0:
+            print("static inline void\n%s_pack(uint32_t * restrict cl,\n%sconst struct %s * restrict values)\n{" %
+                  (name, ' ' * (len(name) + 6), name))
+            group.emit_pack_function()
+            print("}\n\n")
+        else:
+            # Descriptors are mostly packed straight into write-combined or
+            # uncached GPU mappings. Build the words on the stack and store
+            # the descriptor with a single copy, which the compiler lowers to
+            # wide stores, rather than one 32-bit store per word.
+            print("static inline void\n%s_pack(uint32_t * restrict dst,\n%sconst struct %s * restrict values)\n{" %
+                  (name, ' ' * (len(name) + 6), name))
+            print("   uint32_t cl[%d];\n" % (length // 4))
+
+            group.emit_pack_function()
+
+            print("\n   memcpy(dst, cl, sizeof(cl));")
+            print("}\n\n")
+
+            # Delta packing into an already packed template: only the words
+            # in the mask are written, each from the values alone. With a
+            # constant mask, the other words are not even computed.
+            print("static inline void\n%s_pack_words(uint32_t * restrict dst,\n%sconst struct %s * restrict values,\n%suint32_t words)\n{" %
+                  (name, ' ' * (len(name) + 12), name, ' ' * (len(name) + 12)))
+            print("   uint32_t cl[%d];\n" % (length // 4))
+
+            group.emit_pack_function()
+
+            print("\n   for (unsigned i = 0; i < %d; ++i) {" % (length // 4))
+            print("      if (words & (1u << i))")
+            print("         dst[i] = cl[i];")
+            print("   }")
+            print("}\n\n")
+
+            # Words covered by each field, for the mask above
+            for field in group.fields:
+                if not type(field) is Field:
+                    continue
+
+                mask = 0
+                for index in range(field.start // 32, field.end // 32 + 1):
+                    mask |= 1 << index
+
+                print('#define {}_{}_WORDS {}'.format(name, field.name.upper(), hex(mask)))
 
         # Should be a whole number of words
         assert((group.length % 4) == 0)
@@ -147,6 +147,10 @@ panfrost_afbc_format(unsigned arch, enum pipe_format format)
         case PIPE_FORMAT_X24S8_UINT:
                 return PIPE_FORMAT_R8G8B8A8_UNORM;
 
+        /* Valhall compresses separate stencil, as used by Z32F_S8X24 */
+        case PIPE_FORMAT_S8_UINT:
+                return arch >= 9 ? PIPE_FORMAT_S8_UINT : PIPE_FORMAT_NONE;
+
         default:
                 return PIPE_FORMAT_NONE;
         }
@@ -69,6 +69,36 @@ is_2srcdest(enum blend_func blend_func,
                !invert_src && !invert_dest;
 }
 
+/* In the alpha equation, colour factors read the alpha channel, and the
+ * saturate factor is defined as one. Rewrite them in terms of the alpha
+ * factors, so equations like (SRC_COLOR, INV_SRC_ALPHA) for alpha are seen to
+ * use a single factor and can be encoded in fixed-function. */
+
+static void
+canonicalize_alpha_factor(enum blend_factor *factor, bool *invert)
+{
+        switch (*factor) {
+        case BLEND_FACTOR_SRC_COLOR:
+                *factor = BLEND_FACTOR_SRC_ALPHA;
+                break;
+        case BLEND_FACTOR_SRC1_COLOR:
+                *factor = BLEND_FACTOR_SRC1_ALPHA;
+                break;
+        case BLEND_FACTOR_DST_COLOR:
+                *factor = BLEND_FACTOR_DST_ALPHA;
+                break;
+        case BLEND_FACTOR_CONSTANT_COLOR:
+                *factor = BLEND_FACTOR_CONSTANT_ALPHA;
+                break;
+        case BLEND_FACTOR_SRC_ALPHA_SATURATE:
+                *factor = BLEND_FACTOR_ZERO;
+                *invert = !*invert;
+                break;
+        default:
+                break;
+        }
+}
+
 static bool
 can_fixed_function_equation(enum blend_func blend_func,
                             enum blend_factor src_factor,
@@ -78,6 +108,11 @@ can_fixed_function_equation(enum blend_func blend_func,
                             bool is_alpha,
                             bool supports_2src)
 {
+        if (is_alpha) {
+                canonicalize_alpha_factor(&src_factor, &invert_src);
+                canonicalize_alpha_factor(&dest_factor, &invert_dest);
+        }
+
         if (is_2srcdest(blend_func, src_factor, invert_src,
                        dest_factor, invert_dest, is_alpha)) {
 
@@ -112,13 +147,32 @@ blend_factor_constant_mask(enum blend_factor factor)
                 return 0b0000; /* - */
 }
 
+/* Determines which components of the blend constant affect the result. Only
+ * written channels count, and the alpha equation only ever reads the alpha
+ * component of the constant. Fewer components means more chances of a
+ * homogenous constant, and hence of fixed-function blending. */
+
 unsigned
 pan_blend_constant_mask(const struct pan_blend_equation eq)
 {
-        return blend_factor_constant_mask(eq.rgb_src_factor) |
-               blend_factor_constant_mask(eq.rgb_dst_factor) |
-               blend_factor_constant_mask(eq.alpha_src_factor) |
-               blend_factor_constant_mask(eq.alpha_dst_factor);
+        unsigned rgb_mask = eq.color_mask & 0b0111;
+        unsigned mask = 0;
+
+        if (!eq.blend_enable)
+                return 0;
+
+        if (rgb_mask) {
+                mask |= (blend_factor_constant_mask(eq.rgb_src_factor) |
+                         blend_factor_constant_mask(eq.rgb_dst_factor)) &
+                        (rgb_mask | 0b1000);
+        }
+
+        if ((eq.color_mask & 0b1000) &&
+            (blend_factor_constant_mask(eq.alpha_src_factor) |
+             blend_factor_constant_mask(eq.alpha_dst_factor)))
+                mask |= 0b1000;
+
+        return mask;
 }
 
 /* Only "homogenous" (scalar or vector with all components equal) constants are
@@ -198,6 +252,11 @@ to_panfrost_function(enum blend_func blend_func,
         assert(can_fixed_function_equation(blend_func, src_factor, invert_src,
                                            dest_factor, invert_dest, is_alpha, true));
 
+        if (is_alpha) {
+                canonicalize_alpha_factor(&src_factor, &invert_src);
+                canonicalize_alpha_factor(&dest_factor, &invert_dest);
+        }
+
         if (src_factor == BLEND_FACTOR_ZERO && !invert_src) {
                 function->a = MALI_BLEND_OPERAND_A_ZERO;
                 function->b = MALI_BLEND_OPERAND_B_DEST;
@@ -857,7 +916,7 @@ GENX(pan_blend_get_shader_locked)(const struct panfrost_device *dev,
 
         struct pan_shader_info info;
 
-        GENX(pan_shader_compile)(nir, &inputs, &variant->binary, &info);
+        GENX(pan_shader_compile_cached)(dev, nir, &inputs, &variant->binary, &info);
 
         /* Blend shaders can't have sysvals */
         assert(info.sysvals.sysval_count == 0);
@@ -36,6 +36,7 @@
 #include "pan_scoreboard.h"
 #include "pan_texture.h"
 #include "compiler/nir/nir_builder.h"
+#include "util/u_atomic.h"
 #include "util/u_math.h"
 
 #if PAN_ARCH >= 6
@@ -315,6 +316,49 @@ pan_blitter_emit_rsd(const struct panfrost_device *dev,
 }
 #endif
 
+/* Finds an entry published to a lookup table, without locking. Entries are
+ * never removed, so probing can stop at the first empty slot. */
+
+static void *
+pan_blitter_lookup(struct pan_blitter_lookup *lookup, const void *key,
+                   size_t key_size)
+{
+        uint32_t hash = _mesa_hash_data(key, key_size);
+
+        for (unsigned i = 0; i < PAN_BLITTER_LOOKUP_SIZE; ++i) {
+                void *entry = p_atomic_read(&lookup->entries[(hash + i) %
+                                                             PAN_BLITTER_LOOKUP_SIZE]);
+
+                if (!entry)
+                        return NULL;
+
+                if (!memcmp(entry, key, key_size))
+                        return entry;
+        }
+
+        return NULL;
+}
+
+/* Publishes a complete entry to a lookup table. Called with the lock of the
+ * table held, so there is a single writer. */
+
+static void
+pan_blitter_publish(struct pan_blitter_lookup *lookup, void *entry,
+                    size_t key_size)
+{
+        uint32_t hash = _mesa_hash_data(entry, key_size);
+
+        for (unsigned i = 0; i < PAN_BLITTER_LOOKUP_SIZE; ++i) {
+                void **slot = &lookup->entries[(hash + i) %
+                                               PAN_BLITTER_LOOKUP_SIZE];
+
+                if (!*slot) {
+                        p_atomic_set(slot, entry);
+                        return;
+                }
+        }
+}
+
 static void
 pan_blitter_get_blend_shaders(struct panfrost_device *dev,
                               unsigned rt_count,
@@ -341,10 +385,18 @@ pan_blitter_get_blend_shaders(struct panfrost_device *dev,
                         .type = blit_shader->blend_types[i],
                 };
 
+                struct pan_blit_blend_shader_data *blend_shader =
+                        pan_blitter_lookup(&dev->blitter.shaders.blend_lookup,
+                                           &key, sizeof(key));
+                if (blend_shader) {
+                        blend_shaders[i] = blend_shader->address;
+                        continue;
+                }
+
                 pthread_mutex_lock(&dev->blitter.shaders.lock);
                 struct hash_entry *he =
                         _mesa_hash_table_search(dev->blitter.shaders.blend, &key);
-                struct pan_blit_blend_shader_data *blend_shader = he ? he->data : NULL;
+                blend_shader = he ? he->data : NULL;
                 if (blend_shader) {
                          blend_shaders[i] = blend_shader->address;
                          pthread_mutex_unlock(&dev->blitter.shaders.lock);
@@ -382,6 +434,8 @@ pan_blitter_get_blend_shaders(struct panfrost_device *dev,
                 pthread_mutex_unlock(&dev->blend_shaders.lock);
                 _mesa_hash_table_insert(dev->blitter.shaders.blend,
                                         &blend_shader->key, blend_shader);
+                pan_blitter_publish(&dev->blitter.shaders.blend_lookup,
+                                    blend_shader, sizeof(key));
                 pthread_mutex_unlock(&dev->blitter.shaders.lock);
                 blend_shaders[i] = blend_shader->address;
         }
@@ -392,9 +446,16 @@ static const struct pan_blit_shader_data *
 pan_blitter_get_blit_shader(struct panfrost_device *dev,
                             const struct pan_blit_shader_key *key)
 {
+        struct pan_blit_shader_data *shader =
+                pan_blitter_lookup(&dev->blitter.shaders.blit_lookup, key,
+                                   sizeof(*key));
+
+        if (shader)
+                return shader;
+
         pthread_mutex_lock(&dev->blitter.shaders.lock);
         struct hash_entry *he = _mesa_hash_table_search(dev->blitter.shaders.blit, key);
-        struct pan_blit_shader_data *shader = he ? he->data : NULL;
+        shader = he ? he->data : NULL;
 
         if (shader)
                 goto out;
@@ -603,7 +664,8 @@ pan_blitter_get_blit_shader(struct panfrost_device *dev,
         for (unsigned i = 0; i < active_count; ++i)
                 BITSET_SET(b.shader->info.textures_used, i);
 
-        GENX(pan_shader_compile)(b.shader, &inputs, &binary, &shader->info);
+        GENX(pan_shader_compile_cached)(dev, b.shader, &inputs, &binary,
+                                        &shader->info);
 
         /* Blit shaders shouldn't have sysvals */
         assert(shader->info.sysvals.sysval_count == 0);
@@ -625,6 +687,8 @@ pan_blitter_get_blit_shader(struct panfrost_device *dev,
 #endif
 
         _mesa_hash_table_insert(dev->blitter.shaders.blit, &shader->key, shader);
+        pan_blitter_publish(&dev->blitter.shaders.blit_lookup, shader,
+                            sizeof(*key));
 
 out:
         pthread_mutex_unlock(&dev->blitter.shaders.lock);
@@ -719,10 +783,16 @@ pan_blitter_get_rsd(struct panfrost_device *dev,
                 rsd_key.rts[i].array = blit_key.surfaces[i].array;
         }
 
+        struct pan_blit_rsd_data *rsd =
+                pan_blitter_lookup(&dev->blitter.rsds.lookup, &rsd_key,
+                                   sizeof(rsd_key));
+        if (rsd)
+                return rsd->address;
+
         pthread_mutex_lock(&dev->blitter.rsds.lock);
         struct hash_entry *he =
                 _mesa_hash_table_search(dev->blitter.rsds.rsds, &rsd_key);
-        struct pan_blit_rsd_data *rsd = he ? he->data : NULL;
+        rsd = he ? he->data : NULL;
         if (rsd)
                 goto out;
 
@@ -747,6 +817,7 @@ pan_blitter_get_rsd(struct panfrost_device *dev,
                              rsd_ptr.cpu);
         rsd->address = rsd_ptr.gpu;
         _mesa_hash_table_insert(dev->blitter.rsds.rsds, &rsd->key, rsd);
+        pan_blitter_publish(&dev->blitter.rsds.lookup, rsd, sizeof(rsd_key));
 
 out:
         pthread_mutex_unlock(&dev->blitter.rsds.lock);
@@ -1601,43 +1672,6 @@ static bool pan_blit_rsd_key_equal(const void *a, const void *b)
         return !memcmp(a, b, sizeof(struct pan_blit_rsd_key));
 }
 
-static void
-pan_blitter_prefill_blit_shader_cache(struct panfrost_device *dev)
-{
-        static const struct pan_blit_shader_key prefill[] = {
-                {
-                        .surfaces[0] = {
-                                .loc = FRAG_RESULT_DEPTH,
-                                .type = nir_type_float32,
-                                .dim = MALI_TEXTURE_DIMENSION_2D,
-                                .src_samples = 1,
-                                .dst_samples = 1,
-                        },
-                },
-                {
-                        .surfaces[1] = {
-                                .loc = FRAG_RESULT_STENCIL,
-                                .type = nir_type_uint32,
-                                .dim = MALI_TEXTURE_DIMENSION_2D,
-                                .src_samples = 1,
-                                .dst_samples = 1,
-                        },
-                },
-                {
-                        .surfaces[0] = {
-                                .loc = FRAG_RESULT_DATA0,
-                                .type = nir_type_float32,
-                                .dim = MALI_TEXTURE_DIMENSION_2D,
-                                .src_samples = 1,
-                                .dst_samples = 1,
-                        },
-                },
-        };
-
-        for (unsigned i = 0; i < ARRAY_SIZE(prefill); i++)
-                pan_blitter_get_blit_shader(dev, &prefill[i]);
-}
-
 void
 GENX(pan_blitter_init)(struct panfrost_device *dev,
                        struct pan_pool *bin_pool,
@@ -1650,13 +1684,21 @@ GENX(pan_blitter_init)(struct panfrost_device *dev,
                 _mesa_hash_table_create(NULL, pan_blit_blend_shader_key_hash,
                                         pan_blit_blend_shader_key_equal);
         dev->blitter.shaders.pool = bin_pool;
+        memset(&dev->blitter.shaders.blit_lookup, 0,
+               sizeof(dev->blitter.shaders.blit_lookup));
+        memset(&dev->blitter.shaders.blend_lookup, 0,
+               sizeof(dev->blitter.shaders.blend_lookup));
         pthread_mutex_init(&dev->blitter.shaders.lock, NULL);
-        pan_blitter_prefill_blit_shader_cache(dev);
+
+        /* Shaders are compiled on first use, under the lock, rather than
+         * making every process pay for them at startup. The disk cache
+         * makes that cheap after the first run. */
 
         dev->blitter.rsds.pool = desc_pool;
         dev->blitter.rsds.rsds =
                 _mesa_hash_table_create(NULL, pan_blit_rsd_key_hash,
                                         pan_blit_rsd_key_equal);
+        memset(&dev->blitter.rsds.lookup, 0, sizeof(dev->blitter.rsds.lookup));
         pthread_mutex_init(&dev->blitter.rsds.lock, NULL);
 }
 
@@ -40,6 +40,7 @@
 #include "util/u_inlines.h"
 #include "util/u_math.h"
 #include "util/os_file.h"
+#include "util/os_time.h"
 
 /* This file implements a userspace BO cache. Allocating and freeing
  * GPU-visible buffers is very expensive, and even the extra kernel roundtrips
@@ -47,7 +48,7 @@
  * solves both of these problems and does not require kernel updates.
  *
  * Cached BOs are sorted into a bucket based on rounding their size down to the
- * nearest power-of-two. Each bucket contains a linked list of free panfrost_bo
+ * nearest size class, four per power-of-two. Each bucket contains a linked list of free panfrost_bo
  * objects. Putting a BO into the cache is accomplished by adding it to the
  * corresponding bucket. Getting a BO from the cache consists of finding the
  * appropriate bucket and sorting. A cache eviction is a kernel-level free of a
@@ -56,6 +57,94 @@
  * around the linked list.
  */
 
+/* Adds to the memory accounted to the category of a BO */
+
+static void
+panfrost_bo_account(struct panfrost_bo *bo, int64_t size)
+{
+        if (bo->category != PAN_MEM_UNTRACKED)
+                p_atomic_add(&bo->dev->mem.size[bo->category], size);
+}
+
+/* Accounts the memory of a BO to another category */
+
+void
+panfrost_bo_set_category(struct panfrost_bo *bo, unsigned category)
+{
+        assert(category != PAN_MEM_UNTRACKED && category < PAN_MEM_CATEGORIES);
+
+        if (bo->category == PAN_MEM_UNTRACKED || bo->category == category)
+                return;
+
+        panfrost_bo_account(bo, -(int64_t) bo->size);
+        bo->category = category;
+        panfrost_bo_account(bo, bo->size);
+}
+
+/* Memory of all the BOs allocated by the driver, including the BO cache */
+
+uint64_t
+panfrost_bo_mem_total(struct panfrost_device *dev)
+{
+        int64_t total = 0;
+
+        for (unsigned i = 0; i < PAN_MEM_CATEGORIES; ++i)
+                total += p_atomic_read(&dev->mem.size[i]);
+
+        return MAX2(total, 0);
+}
+
+/* Size to actually allocate for a BO of the given size */
+
+static size_t
+panfrost_bo_placement_size(struct panfrost_device *dev, size_t size,
+                           uint32_t flags)
+{
+        /* To maximize BO cache usage, don't allocate tiny BOs */
+        size = ALIGN_POT(size, 4096);
+
+        if (!dev->kbase || (flags & (PAN_BO_GROWABLE | PAN_BO_SPARSE)) ||
+            size < PAN_BO_LARGE_PAGE_SIZE)
+                return size;
+
+        size_t large = ALIGN_POT(size, PAN_BO_LARGE_PAGE_SIZE);
+
+        return (large - size) <= size / 4 ? large : size;
+}
+
+/* VA to reserve for a BO of the given size, see PAN_BO_RESERVE_MIN_SIZE */
+
+static size_t
+panfrost_bo_reserve_size(struct panfrost_device *dev, size_t size,
+                         uint32_t flags)
+{
+        if (!dev->kbase || size < PAN_BO_RESERVE_MIN_SIZE ||
+            (flags & (PAN_BO_EXECUTE | PAN_BO_GROWABLE | PAN_BO_SHARED |
+                      PAN_BO_EVENT)) ||
+            (dev->debug & PAN_DBG_NO_CACHE))
+                return size;
+
+        /* Up to the top of the size class of the BO in the cache */
+        unsigned level = util_logbase2(size);
+        size_t step = (size_t) 1 << (level - BO_CACHE_SUBCLASS_BITS);
+        size_t va_size = ALIGN_POT(size + 1, step);
+
+        /* Keep the VA a multiple of 2 MiB pages when the size is */
+        if (!(size % PAN_BO_LARGE_PAGE_SIZE))
+                va_size = ALIGN_POT(va_size, PAN_BO_LARGE_PAGE_SIZE);
+
+        return va_size;
+}
+
+static bool
+panfrost_bo_large_pages(struct panfrost_bo *bo)
+{
+        return bo->dev->kbase &&
+                !(bo->flags & (PAN_BO_GROWABLE | PAN_BO_SHARED | PAN_BO_SPARSE |
+                               PAN_BO_USERPTR)) &&
+                !(bo->size % PAN_BO_LARGE_PAGE_SIZE);
+}
+
 static struct panfrost_bo *
 panfrost_bo_alloc(struct panfrost_device *dev, size_t size,
                   uint32_t flags, const char *label)
@@ -73,6 +162,7 @@ panfrost_bo_alloc(struct panfrost_device *dev, size_t size,
         }
 
         void *cpu = NULL;
+        size_t va_size = size;
 
         bool cached = false;
 
@@ -89,7 +179,17 @@ panfrost_bo_alloc(struct panfrost_device *dev, size_t size,
 
                 unsigned mali_flags = (flags & PAN_BO_EVENT) ? 0x8200f : 0;
 
-                struct base_ptr p = dev->mali.alloc(&dev->mali, size, create_bo.flags, mali_flags);
+                va_size = panfrost_bo_reserve_size(dev, size, flags);
+
+                if (flags & PAN_BO_SPARSE) {
+                        va_size = size;
+                        size = create_bo.size = 0;
+                }
+
+                struct base_ptr p = va_size > size ?
+                        dev->mali.alloc_reserve(&dev->mali, size, va_size,
+                                                create_bo.flags, mali_flags) :
+                        dev->mali.alloc(&dev->mali, size, create_bo.flags, mali_flags);
 
                 if (p.gpu) {
                         cpu = p.cpu;
@@ -113,6 +213,7 @@ panfrost_bo_alloc(struct panfrost_device *dev, size_t size,
         assert(!memcmp(bo, &((struct panfrost_bo){}), sizeof(*bo)));
 
         bo->size = create_bo.size;
+        bo->va_size = va_size > size ? va_size : 0;
         bo->ptr.gpu = create_bo.offset;
         bo->ptr.cpu = cpu;
         if ((uintptr_t) bo->ptr.cpu != bo->ptr.gpu)
@@ -123,6 +224,13 @@ panfrost_bo_alloc(struct panfrost_device *dev, size_t size,
         bo->label = label;
         bo->cached = cached;
         bo->dmabuf_fd = -1;
+        bo->category = PAN_MEM_OTHER;
+        panfrost_bo_account(bo, bo->size);
+
+        if (panfrost_bo_large_pages(bo))
+                p_atomic_add(&dev->large_page_size, bo->size);
+
+        p_atomic_inc(&dev->stats.bo_allocs);
         return bo;
 }
 
@@ -144,8 +252,14 @@ panfrost_bo_free(struct panfrost_bo *bo)
                 fflush(NULL);
         }
 
+        panfrost_bo_account(bo, -(int64_t) bo->size);
+
         if (dev->kbase) {
-                os_munmap(bo->ptr.cpu, bo->size);
+                if (panfrost_bo_large_pages(bo))
+                        p_atomic_add(&dev->large_page_size, -(int64_t) bo->size);
+
+                if (bo->ptr.cpu && !(bo->flags & PAN_BO_USERPTR))
+                        os_munmap(bo->ptr.cpu, MAX2(bo->size, bo->va_size));
                 if (bo->munmap_ptr)
                         os_munmap(bo->munmap_ptr, bo->size);
                 if (bo->free_ioctl)
@@ -160,10 +274,34 @@ panfrost_bo_free(struct panfrost_bo *bo)
                 assert(0);
         }
 
+        p_atomic_inc(&dev->stats.bo_frees);
+
         /* BO will be freed with the stable_array, but zero to indicate free */
         memset(bo, 0, sizeof(*bo));
 }
 
+/* Called with the kbase queue_lock held */
+static bool
+panfrost_usage_finished(kbase k, const struct panfrost_usage *u)
+{
+        /* Skip invalid usages */
+        if (u->queue >= k->event_slot_usage)
+                return true;
+
+        struct kbase_event_slot *slot = kbase_event_slot(k, u->queue);
+        uint64_t seqnum = u->seqnum;
+
+        /* There is a race condition, where we can depend on an
+         * unsubmitted batch. In that cade, decrease the seqnum.
+         * Otherwise, skip invalid dependencies. TODO: do GC? */
+        if (slot->last_submit == seqnum)
+                --seqnum;
+        else if (slot->last_submit < seqnum)
+                return true;
+
+        return slot->last > seqnum;
+}
+
 static bool
 panfrost_bo_usage_finished(struct panfrost_bo *bo, bool readers)
 {
@@ -171,40 +309,114 @@ panfrost_bo_usage_finished(struct panfrost_bo *bo, bool readers)
         kbase k = &dev->mali;
 
         bool ret = true;
+        bool overflow = p_atomic_read(&bo->usage_overflow);
 
-        pthread_mutex_lock(&dev->bo_usage_lock);
+        if (overflow)
+                pthread_mutex_lock(&dev->bo_usage_lock);
         pthread_mutex_lock(&dev->mali.queue_lock);
 
-        util_dynarray_foreach(&bo->usage, struct panfrost_usage, u) {
+        for (unsigned i = 0; i < PAN_BO_USAGE_SLOTS && ret; ++i) {
+                struct panfrost_usage u;
+
+                if (!panfrost_usage_unpack(p_atomic_read(&bo->usage_slots[i]), &u))
+                        continue;
+
                 /* Skip if we are only waiting for writers */
-                if (!u->write && !readers)
+                if (!u.write && !readers)
                         continue;
 
-                /* Usages are ordered, so everything else is also invalid */
-                if (u->queue >= k->event_slot_usage)
+                ret = panfrost_usage_finished(k, &u);
+        }
+
+        if (overflow) {
+                util_dynarray_foreach(&bo->usage, struct panfrost_usage, u) {
+                        if (!ret)
+                                break;
+
+                        if (!u->write && !readers)
+                                continue;
+
+                        ret = panfrost_usage_finished(k, u);
+                }
+        }
+
+        pthread_mutex_unlock(&dev->mali.queue_lock);
+        if (overflow)
+                pthread_mutex_unlock(&dev->bo_usage_lock);
+
+        return ret;
+}
+
+/* Records that a queue accesses the BO up to a seqnum. The common case does
+ * not take any lock: the usage either raises the seqnum of the slot for the
+ * same queue and access type, or replaces an empty or completed slot. Only
+ * once all slots are used by pending work does it go to the locked list. */
+void
+panfrost_bo_add_usage(struct panfrost_bo *bo, struct panfrost_usage u)
+{
+        struct panfrost_device *dev = bo->dev;
+        kbase k = &dev->mali;
+
+        uint32_t access = u.write ? PAN_BO_ACCESS_RW : PAN_BO_ACCESS_READ;
+        uint32_t old_access = p_atomic_read(&bo->gpu_access);
+
+        while ((old_access & access) != access) {
+                uint32_t prev = p_atomic_cmpxchg(&bo->gpu_access, old_access,
+                                                 old_access | access);
+                if (prev == old_access)
                         break;
+                old_access = prev;
+        }
+
+        uint64_t packed = panfrost_usage_pack(u);
+        uint64_t key = packed & PAN_USAGE_KEY_MASK;
+
+        for (unsigned i = 0; i < PAN_BO_USAGE_SLOTS; ++i) {
+                uint64_t v = p_atomic_read(&bo->usage_slots[i]);
+
+                while (v && (v & PAN_USAGE_KEY_MASK) == key) {
+                        if (v >= packed)
+                                return;
 
-                struct kbase_event_slot *slot = &k->event_slots[u->queue];
-                uint64_t seqnum = u->seqnum;
+                        uint64_t prev = p_atomic_cmpxchg(&bo->usage_slots[i], v, packed);
+                        if (prev == v)
+                                return;
+                        v = prev;
+                }
+        }
+
+        for (unsigned i = 0; i < PAN_BO_USAGE_SLOTS; ++i) {
+                uint64_t v = p_atomic_read(&bo->usage_slots[i]);
+                struct panfrost_usage old;
 
-                /* There is a race condition, where we can depend on an
-                 * unsubmitted batch. In that cade, decrease the seqnum.
-                 * Otherwise, skip invalid dependencies. TODO: do GC? */
-                if (slot->last_submit == seqnum)
-                        --seqnum;
-                else if (slot->last_submit < seqnum)
+                /* Reading the event slot without queue_lock is fine, as
+                 * the value only ever increases */
+                if (panfrost_usage_unpack(v, &old) &&
+                    old.queue < k->event_slot_usage &&
+                    p_atomic_read(&kbase_event_slot(k, old.queue)->last) <= old.seqnum)
                         continue;
 
-                if (slot->last <= seqnum) {
-                        ret = false;
+                if (p_atomic_cmpxchg(&bo->usage_slots[i], v, packed) == v)
+                        return;
+        }
+
+        pthread_mutex_lock(&dev->bo_usage_lock);
+
+        bool found = false;
+
+        util_dynarray_foreach(&bo->usage, struct panfrost_usage, d) {
+                if (d->queue == u.queue && d->write == u.write) {
+                        d->seqnum = MAX2(d->seqnum, u.seqnum);
+                        found = true;
                         break;
                 }
         }
 
-        pthread_mutex_unlock(&dev->mali.queue_lock);
-        pthread_mutex_unlock(&dev->bo_usage_lock);
+        if (!found)
+                util_dynarray_append(&bo->usage, struct panfrost_usage, u);
 
-        return ret;
+        p_atomic_set(&bo->usage_overflow, true);
+        pthread_mutex_unlock(&dev->bo_usage_lock);
 }
 
 /* Returns true if the BO is ready, false otherwise.
@@ -267,8 +479,12 @@ panfrost_bo_wait(struct panfrost_bo *bo, int64_t timeout_ns, bool wait_readers)
         if (ret != -1) {
                 /* Set gpu_access to 0 so that the next call to bo_wait()
                  * doesn't have to call the WAIT_BO ioctl.
+                 * kbase only waits for the readers when asked to.
                  */
-                bo->gpu_access = 0;
+                if (dev->kbase && !wait_readers)
+                        bo->gpu_access &= PAN_BO_ACCESS_READ;
+                else
+                        bo->gpu_access = 0;
                 return true;
         }
 
@@ -310,18 +526,23 @@ panfrost_bo_mem_clean(struct panfrost_bo *bo, size_t offset, size_t length)
 static unsigned
 pan_bucket_index(unsigned size)
 {
-        /* Round down to POT to compute a bucket index */
+        /* Round down to POT to find the level */
+        unsigned level = util_logbase2(size);
 
-        unsigned bucket_index = util_logbase2(size);
+        /* Clamp the level; all huge allocations will be sorted into the
+         * largest bucket */
+        if (level < MIN_BO_CACHE_BUCKET)
+                return 0;
+        else if (level >= MAX_BO_CACHE_BUCKET)
+                return NR_BO_CACHE_BUCKETS - 1;
 
-        /* Clamp the bucket index; all huge allocations will be
-         * sorted into the largest bucket */
-
-        bucket_index = CLAMP(bucket_index, MIN_BO_CACHE_BUCKET,
-                             MAX_BO_CACHE_BUCKET);
+        /* The bits below the leading one pick the class within the level */
+        unsigned shift = level - BO_CACHE_SUBCLASS_BITS;
+        unsigned subclass = (size >> shift) & BITFIELD_MASK(BO_CACHE_SUBCLASS_BITS);
 
         /* Reindex from 0 */
-        return (bucket_index - MIN_BO_CACHE_BUCKET);
+        return ((level - MIN_BO_CACHE_BUCKET) << BO_CACHE_SUBCLASS_BITS) +
+               subclass;
 }
 
 static struct list_head *
@@ -335,19 +556,33 @@ pan_bucket(struct panfrost_device *dev, unsigned size)
  * cache. If it fails, it returns NULL signaling the caller to allocate a new
  * BO. */
 
+/* Splice a BO out of the cache. Must be called with the cache lock held. */
+
+static void
+panfrost_bo_cache_remove(struct panfrost_device *dev, struct panfrost_bo *bo)
+{
+        list_del(&bo->bucket_link);
+        list_del(&bo->lru_link);
+        dev->bo_cache.size -= bo->size;
+}
+
 static struct panfrost_bo *
 panfrost_bo_cache_fetch(struct panfrost_device *dev,
                         size_t size, uint32_t flags, const char *label,
                         bool dontwait)
 {
+        struct panfrost_bo *bo;
+
+retry:
+        bo = NULL;
         pthread_mutex_lock(&dev->bo_cache.lock);
         struct list_head *bucket = pan_bucket(dev, size);
-        struct panfrost_bo *bo = NULL;
 
         /* Iterate the bucket looking for something suitable */
         list_for_each_entry_safe(struct panfrost_bo, entry, bucket,
                                  bucket_link) {
-                if (entry->size < size || entry->flags != flags)
+                if (MAX2(entry->size, entry->va_size) < size ||
+                    entry->flags != flags)
                         continue;
 
                 /* If the oldest BO in the cache is busy, likely so is
@@ -361,36 +596,89 @@ panfrost_bo_cache_fetch(struct panfrost_device *dev,
                                 break;
                 }
 
-                struct drm_panfrost_madvise madv = {
-                        .handle = entry->gem_handle,
-                        .madv = PANFROST_MADV_WILLNEED,
-                };
-                int ret = 0;
-
                 /* This one works, splice it out of the cache */
-                list_del(&entry->bucket_link);
-                list_del(&entry->lru_link);
-
-                if (dev->kbase) {
-                        /* With kbase, BOs are never freed from the cache */
-                        madv.retained = true;
-                } else {
-                        ret = drmIoctl(dev->fd, DRM_IOCTL_PANFROST_MADVISE, &madv);
-                }
-                if (!ret && !madv.retained) {
-                        panfrost_bo_free(entry);
-                        continue;
-                }
-                /* Let's go! */
+                panfrost_bo_cache_remove(dev, entry);
                 bo = entry;
-                bo->label = label;
                 break;
         }
         pthread_mutex_unlock(&dev->bo_cache.lock);
 
+        if (!bo)
+                return NULL;
+
+        /* The BO is ours now, so check it still has its backing without
+         * holding the lock over the ioctl */
+        struct drm_panfrost_madvise madv = {
+                .handle = bo->gem_handle,
+                .madv = PANFROST_MADV_WILLNEED,
+        };
+        int ret = 0;
+
+        if (dev->kbase) {
+                /* Evictable BOs might have lost their backing */
+                madv.retained = !bo->evictable ||
+                        dev->mali.mem_evictable(&dev->mali, bo->ptr.gpu, false);
+                bo->evictable = false;
+        } else {
+                ret = drmIoctl(dev->fd, DRM_IOCTL_PANFROST_MADVISE, &madv);
+        }
+        if (!ret && !madv.retained) {
+                panfrost_bo_free(bo);
+                goto retry;
+        }
+
+        panfrost_bo_set_category(bo, PAN_MEM_OTHER);
+
+        /* Grow a BO with reserved VA in place, rather than allocating a new
+         * BO and VA range */
+        if (bo->size < size) {
+                bool large = panfrost_bo_large_pages(bo);
+
+                if (!dev->mali.mem_commit(&dev->mali, bo->ptr.gpu, size)) {
+                        panfrost_bo_free(bo);
+                        goto retry;
+                }
+
+                if (large)
+                        p_atomic_add(&dev->large_page_size, -(int64_t) bo->size);
+
+                panfrost_bo_account(bo, (int64_t) size - (int64_t) bo->size);
+                bo->size = size;
+
+                if (panfrost_bo_large_pages(bo))
+                        p_atomic_add(&dev->large_page_size, bo->size);
+        }
+
+        /* Let's go! */
+        bo->label = label;
         return bo;
 }
 
+/* Backs the first size bytes of a sparse BO, and releases the pages above
+ * them. The GPU must be done with any pages released. */
+
+bool
+panfrost_bo_commit(struct panfrost_bo *bo, size_t size)
+{
+        struct panfrost_device *dev = bo->dev;
+
+        assert(bo->flags & PAN_BO_SPARSE);
+
+        size = ALIGN_POT(size, 4096);
+        if (size > bo->va_size)
+                return false;
+
+        if (size == bo->size)
+                return true;
+
+        if (!dev->mali.mem_commit(&dev->mali, bo->ptr.gpu, size))
+                return false;
+
+        panfrost_bo_account(bo, (int64_t) size - (int64_t) bo->size);
+        bo->size = size;
+        return true;
+}
+
 static void
 panfrost_bo_cache_evict_stale_bos(struct panfrost_device *dev)
 {
@@ -407,11 +695,11 @@ panfrost_bo_cache_evict_stale_bos(struct panfrost_device *dev)
                  * seconds old, but we don't really care, as long as unused BOs
                  * are dropped at some point.
                  */
-                if (time.tv_sec - entry->last_used <= 2)
+                if (time.tv_sec - entry->last_used <= 2 &&
+                    dev->bo_cache.size <= dev->bo_cache.max_size)
                         break;
 
-                list_del(&entry->bucket_link);
-                list_del(&entry->lru_link);
+                panfrost_bo_cache_remove(dev, entry);
                 panfrost_bo_free(entry);
         }
 }
@@ -424,30 +712,39 @@ panfrost_bo_cache_put(struct panfrost_bo *bo)
 {
         struct panfrost_device *dev = bo->dev;
 
-        if (bo->flags & PAN_BO_SHARED || dev->debug & PAN_DBG_NO_CACHE)
+        if (bo->flags & (PAN_BO_SHARED | PAN_BO_SPARSE | PAN_BO_USERPTR) ||
+            dev->debug & PAN_DBG_NO_CACHE)
                 return false;
 
-        /* Must be first */
-        pthread_mutex_lock(&dev->bo_cache.lock);
-
-        struct list_head *bucket = pan_bucket(dev, MAX2(bo->size, 4096));
         struct drm_panfrost_madvise madv;
         struct timespec time;
 
+        panfrost_bo_set_category(bo, PAN_MEM_BO_CACHE);
+
         madv.handle = bo->gem_handle;
         madv.madv = PANFROST_MADV_DONTNEED;
 	madv.retained = 0;
 
-        // TODO: Allow freeing madvise'd BOs with kbase... not that it really
-        // matters for boards with 16 GB RAM
+        /* kbase has no madvise, but native allocations can be marked as
+         * DONT_NEED instead. Small BOs are not worth the extra ioctls. Nobody
+         * else can see the BO yet, so do this before taking the lock. */
         if (!dev->kbase)
                 drmIoctl(dev->fd, DRM_IOCTL_PANFROST_MADVISE, &madv);
+        else if (bo->size >= PAN_BO_CACHE_EVICTABLE_MIN_SIZE &&
+                 !(bo->flags & (PAN_BO_EVENT | PAN_BO_GROWABLE)))
+                bo->evictable = dev->mali.mem_evictable(&dev->mali,
+                                                        bo->ptr.gpu, true);
+
+        pthread_mutex_lock(&dev->bo_cache.lock);
+
+        struct list_head *bucket = pan_bucket(dev, MAX2(bo->size, 4096));
 
         /* Add us to the bucket */
         list_addtail(&bo->bucket_link, bucket);
 
         /* Add us to the LRU list and update the last_used field. */
         list_addtail(&bo->lru_link, &dev->bo_cache.lru);
+        dev->bo_cache.size += bo->size;
         clock_gettime(CLOCK_MONOTONIC, &time);
         bo->last_used = time.tv_sec;
 
@@ -455,19 +752,188 @@ panfrost_bo_cache_put(struct panfrost_bo *bo)
         if (dev->kbase)
                 bo->gpu_access = 0;
 
+        /* Update the label to help debug BO cache memory usage issues */
+        bo->label = "Unused (BO cache)";
+
         /* Let's do some cleanup in the BO cache while we hold the
-         * lock.
+         * lock. This also trims the cache back below its high-water
+         * mark, oldest BOs first, which may free this BO.
          */
         panfrost_bo_cache_evict_stale_bos(dev);
 
-        /* Update the label to help debug BO cache memory usage issues */
-        bo->label = "Unused (BO cache)";
-
-        /* Must be last */
         pthread_mutex_unlock(&dev->bo_cache.lock);
         return true;
 }
 
+/* Small BOs on kbase are sub-allocated from 2 MiB slab BOs, to avoid an
+ * ioctl and a VA mapping per allocation. Sub-allocated BOs are otherwise
+ * normal BOs with their own handle, usage tracking and refcount; each one
+ * holds a reference on its slab BO, so the backing stays alive until the
+ * last entry has been released by the GPU. */
+
+struct panfrost_bo_slab {
+        /* Link in dev->bo_slab.partial when the slab has free entries */
+        struct list_head link;
+
+        struct panfrost_bo *bo;
+        uint32_t flags;
+        unsigned order;
+
+        unsigned num_entries;
+        unsigned num_free;
+
+        /* Stack of free entry indices */
+        uint16_t free[];
+};
+
+#define PAN_BO_SLAB_ALLOWED_FLAGS \
+        (PAN_BO_EXECUTE | PAN_BO_INVISIBLE | PAN_BO_DELAY_MMAP | \
+         PAN_BO_CACHEABLE)
+
+static bool
+panfrost_bo_slab_allowed(struct panfrost_device *dev, size_t size,
+                         uint32_t flags)
+{
+        return dev->kbase && size <= (1 << PAN_BO_SLAB_MAX_ORDER) &&
+                !(flags & ~PAN_BO_SLAB_ALLOWED_FLAGS) &&
+                !(dev->debug & PAN_DBG_NO_CACHE);
+}
+
+static struct panfrost_bo *
+panfrost_bo_slab_alloc(struct panfrost_device *dev, size_t size,
+                       uint32_t flags, const char *label)
+{
+        unsigned order = MAX2(util_logbase2_ceil(size), PAN_BO_SLAB_MIN_ORDER);
+        struct list_head *partial =
+                &dev->bo_slab.partial[order - PAN_BO_SLAB_MIN_ORDER];
+        struct panfrost_bo_slab *slab = NULL;
+
+        /* The parent BO is always mapped, so there is no need to keep
+         * separate slabs for delayed mappings */
+        flags &= ~PAN_BO_DELAY_MMAP;
+
+        pthread_mutex_lock(&dev->bo_slab.lock);
+
+        list_for_each_entry(struct panfrost_bo_slab, entry, partial, link) {
+                if (entry->flags == flags) {
+                        slab = entry;
+                        break;
+                }
+        }
+
+        if (!slab) {
+                unsigned num_entries = PAN_BO_SLAB_SIZE >> order;
+
+                /* Creating the slab BO may reclaim slabs if memory is low,
+                 * so don't hold the lock */
+                pthread_mutex_unlock(&dev->bo_slab.lock);
+
+                slab = calloc(1, sizeof(*slab) +
+                              num_entries * sizeof(slab->free[0]));
+                if (!slab)
+                        return NULL;
+
+                slab->bo = panfrost_bo_create(dev, PAN_BO_SLAB_SIZE, flags,
+                                              "Slab");
+                slab->flags = flags;
+                slab->order = order;
+                slab->num_entries = num_entries;
+                slab->num_free = num_entries;
+
+                /* Hand out the lowest entries first */
+                for (unsigned i = 0; i < num_entries; ++i)
+                        slab->free[i] = num_entries - 1 - i;
+
+                pthread_mutex_lock(&dev->bo_slab.lock);
+                list_add(&slab->link, partial);
+        }
+
+        unsigned index = slab->free[--slab->num_free];
+        if (!slab->num_free)
+                list_del(&slab->link);
+
+        panfrost_bo_reference(slab->bo);
+
+        pthread_mutex_unlock(&dev->bo_slab.lock);
+
+        struct panfrost_bo *parent = slab->bo;
+        size_t offset = (size_t) index << order;
+        mali_ptr va = parent->ptr.gpu + offset;
+        int handle = kbase_alloc_gem_handle(&dev->mali, va, -1);
+
+        struct panfrost_bo *bo = pan_lookup_bo(dev, handle);
+        assert(!memcmp(bo, &((struct panfrost_bo){}), sizeof(*bo)));
+
+        bo->size = 1 << order;
+        bo->ptr.gpu = va;
+        bo->ptr.cpu = parent->ptr.cpu ? parent->ptr.cpu + offset : NULL;
+        bo->gem_handle = handle;
+        bo->flags = flags;
+        bo->dev = dev;
+        bo->label = label;
+        bo->cached = parent->cached;
+        bo->dmabuf_fd = -1;
+        bo->slab = slab;
+        return bo;
+}
+
+/* Return a sub-allocated BO to its slab, once the GPU is done with it. Called
+ * with the BO map lock held, so this must not drop the last reference on the
+ * slab BO; that only happens in panfrost_bo_slab_reclaim. */
+
+static void
+panfrost_bo_slab_free(struct panfrost_bo *bo)
+{
+        struct panfrost_device *dev = bo->dev;
+        struct panfrost_bo_slab *slab = bo->slab;
+        unsigned index = (bo->ptr.gpu - slab->bo->ptr.gpu) >> slab->order;
+
+        kbase_free_gem_handle(&dev->mali, bo->gem_handle);
+        memset(bo, 0, sizeof(*bo));
+
+        pthread_mutex_lock(&dev->bo_slab.lock);
+
+        /* The slab list still holds a reference, and the slab can't be
+         * reclaimed before the entry is returned, so this is never the last
+         * reference */
+        panfrost_bo_unreference(slab->bo);
+
+        if (!slab->num_free) {
+                list_add(&slab->link, &dev->bo_slab.partial[slab->order -
+                                                            PAN_BO_SLAB_MIN_ORDER]);
+        }
+
+        slab->free[slab->num_free++] = index;
+
+        pthread_mutex_unlock(&dev->bo_slab.lock);
+}
+
+/* Free all slabs without any live entries */
+
+static void
+panfrost_bo_slab_reclaim(struct panfrost_device *dev)
+{
+        struct list_head empty;
+        list_inithead(&empty);
+
+        pthread_mutex_lock(&dev->bo_slab.lock);
+        for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_slab.partial); ++i) {
+                list_for_each_entry_safe(struct panfrost_bo_slab, slab,
+                                         &dev->bo_slab.partial[i], link) {
+                        if (slab->num_free == slab->num_entries) {
+                                list_del(&slab->link);
+                                list_addtail(&slab->link, &empty);
+                        }
+                }
+        }
+        pthread_mutex_unlock(&dev->bo_slab.lock);
+
+        list_for_each_entry_safe(struct panfrost_bo_slab, slab, &empty, link) {
+                panfrost_bo_unreference(slab->bo);
+                free(slab);
+        }
+}
+
 /* Evicts all BOs from the cache. Called during context
  * destroy or during low-memory situations (to free up
  * memory that may be unused by us just sitting in our
@@ -478,20 +944,43 @@ void
 panfrost_bo_cache_evict_all(
                 struct panfrost_device *dev)
 {
+        /* Empty slabs go back to the cache first */
+        panfrost_bo_slab_reclaim(dev);
+
         pthread_mutex_lock(&dev->bo_cache.lock);
         for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_cache.buckets); ++i) {
                 struct list_head *bucket = &dev->bo_cache.buckets[i];
 
                 list_for_each_entry_safe(struct panfrost_bo, entry, bucket,
                                          bucket_link) {
-                        list_del(&entry->bucket_link);
-                        list_del(&entry->lru_link);
+                        panfrost_bo_cache_remove(dev, entry);
                         panfrost_bo_free(entry);
                 }
         }
         pthread_mutex_unlock(&dev->bo_cache.lock);
 }
 
+/* Called before allocating a new BO. Going over the budget releases the BO
+ * cache, and signals contexts to release what they keep for reuse, rather
+ * than waiting for allocations to fail. */
+
+static void
+panfrost_bo_check_budget(struct panfrost_device *dev, size_t size)
+{
+        if (!dev->mem.budget ||
+            panfrost_bo_mem_total(dev) + size <= dev->mem.budget)
+                return;
+
+        int64_t cached = p_atomic_read(&dev->mem.size[PAN_MEM_BO_CACHE]);
+
+        panfrost_bo_cache_evict_all(dev);
+
+        p_atomic_inc(&dev->mem.pressure);
+        p_atomic_inc(&dev->stats.mem_evictions);
+        p_atomic_add(&dev->stats.mem_evicted,
+                     cached - p_atomic_read(&dev->mem.size[PAN_MEM_BO_CACHE]));
+}
+
 void
 panfrost_bo_mmap(struct panfrost_bo *bo)
 {
@@ -501,6 +990,21 @@ panfrost_bo_mmap(struct panfrost_bo *bo)
         if (bo->ptr.cpu)
                 return;
 
+        /* Only imports without SAME_VA are mapped lazily on kbase */
+        if (bo->dev->kbase) {
+                if (bo->flags & PAN_BO_INVISIBLE)
+                        return;
+
+                bo->ptr.cpu = bo->dev->mali.mmap_import(&bo->dev->mali,
+                                                        bo->ptr.gpu, bo->size);
+                if (bo->ptr.cpu == MAP_FAILED) {
+                        bo->ptr.cpu = NULL;
+                        fprintf(stderr, "mmap of imported BO failed: %m\n");
+                }
+
+                return;
+        }
+
         ret = drmIoctl(bo->dev->fd, DRM_IOCTL_PANFROST_MMAP_BO, &mmap_bo);
         if (ret) {
                 fprintf(stderr, "DRM_IOCTL_PANFROST_MMAP_BO failed: %m\n");
@@ -546,21 +1050,34 @@ panfrost_bo_create(struct panfrost_device *dev, size_t size,
         /* Kernel will fail (confusingly) with EPERM otherwise */
         assert(size > 0);
 
-        /* To maximize BO cache usage, don't allocate tiny BOs */
-        size = ALIGN_POT(size, 4096);
+        if (panfrost_bo_slab_allowed(dev, size, flags)) {
+                bo = panfrost_bo_slab_alloc(dev, size, flags, label);
+                if (bo)
+                        goto done;
+        }
+
+        size = panfrost_bo_placement_size(dev, size, flags);
 
         /* GROWABLE BOs cannot be mmapped */
         if (flags & PAN_BO_GROWABLE)
                 assert(flags & PAN_BO_INVISIBLE);
 
+        /* Only kbase can leave part of the VA of a BO unbacked */
+        if (flags & PAN_BO_SPARSE)
+                assert(dev->kbase);
+
         /* Ideally, we get a BO that's ready in the cache, or allocate a fresh
          * BO. If allocation fails, we can try waiting for something in the
          * cache. But if there's no nothing suitable, we should flush the cache
          * to make space for the new allocation.
          */
         bo = panfrost_bo_cache_fetch(dev, size, flags, label, true);
-        if (!bo)
+        p_atomic_inc(bo ? &dev->stats.bo_cache_hits :
+                     &dev->stats.bo_cache_misses);
+        if (!bo) {
+                panfrost_bo_check_budget(dev, size);
                 bo = panfrost_bo_alloc(dev, size, flags, label);
+        }
         if (!bo)
                 bo = panfrost_bo_cache_fetch(dev, size, flags, label, false);
         if (!bo) {
@@ -587,6 +1104,7 @@ panfrost_bo_create(struct panfrost_device *dev, size_t size,
         if (!(flags & (PAN_BO_INVISIBLE | PAN_BO_DELAY_MMAP)))
                 panfrost_bo_mmap(bo);
 
+done:
         if ((dev->debug & PAN_DBG_BO_CLEAR) && !(flags & PAN_BO_INVISIBLE)) {
                 memset(bo->ptr.cpu, 0, bo->size);
                 panfrost_bo_mem_clean(bo, 0, bo->size);
@@ -595,8 +1113,11 @@ panfrost_bo_create(struct panfrost_device *dev, size_t size,
         p_atomic_set(&bo->refcnt, 1);
 
         util_dynarray_init(&bo->usage, NULL);
+        memset(bo->usage_slots, 0, sizeof(bo->usage_slots));
+        bo->usage_overflow = false;
 
-        if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC)) {
+        /* The slab BO itself is already known to pandecode */
+        if ((dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC)) && !bo->slab) {
                 if (flags & PAN_BO_INVISIBLE)
                         pandecode_inject_mmap(bo->ptr.gpu, NULL, bo->size, NULL);
                 else if (!(flags & PAN_BO_DELAY_MMAP))
@@ -628,6 +1149,11 @@ panfrost_bo_fini(struct panfrost_bo *bo)
 {
         struct panfrost_device *dev = bo->dev;
 
+        if (bo->slab) {
+                panfrost_bo_slab_free(bo);
+                return;
+        }
+
         /* When the reference count goes to zero, we need to cleanup */
         panfrost_bo_munmap(bo);
 
@@ -743,17 +1269,24 @@ panfrost_bo_unreference(struct panfrost_bo *bo)
         pthread_mutex_unlock(&dev->bo_map_lock);
 }
 
+/* Only PAN_BO_INVISIBLE is allowed in flags, for buffers the CPU never
+ * accesses. Those can be protected buffers, which can't be mapped at all. */
+
 struct panfrost_bo *
-panfrost_bo_import(struct panfrost_device *dev, int fd)
+panfrost_bo_import(struct panfrost_device *dev, int fd, uint32_t flags)
 {
         struct panfrost_bo *bo;
         struct drm_panfrost_get_bo_offset get_bo_offset = {0,};
         ASSERTED int ret;
         kbase_handle handle = { .fd = -1 };
         unsigned gem_handle;
+        bool gpu_only = flags & PAN_BO_INVISIBLE;
+        int64_t start = dev->bo_log ? os_time_get_nano() : 0;
+
+        assert(!(flags & ~PAN_BO_INVISIBLE));
 
         if (dev->kbase) {
-                gem_handle = dev->mali.import_dmabuf(&dev->mali, fd);
+                gem_handle = dev->mali.import_dmabuf(&dev->mali, fd, gpu_only);
                 if (gem_handle == -1)
                         return NULL;
         } else {
@@ -779,10 +1312,20 @@ panfrost_bo_import(struct panfrost_device *dev, int fd)
                 bo->dev = dev;
                 bo->size = lseek(fd, 0, SEEK_END);
                 bo->ptr.gpu = (mali_ptr) get_bo_offset.offset;
-                if (dev->kbase && (sizeof(void *) > 4 || get_bo_offset.offset < (1LL << 32))) {
+
+                /* With SAME_VA, the import is already mapped at its GPU
+                 * address (only reserved for GPU-only imports). Otherwise,
+                 * CPU mappings are made on first use by panfrost_bo_mmap, as
+                 * imports like video frames are often never accessed by the
+                 * CPU. */
+                bool same_va = sizeof(void *) > 4 ||
+                               get_bo_offset.offset < (1LL << 32);
+
+                if (dev->kbase && same_va && gpu_only) {
+                        bo->munmap_ptr = (void *)(uintptr_t) get_bo_offset.offset;
+                } else if (dev->kbase && same_va) {
                         bo->ptr.cpu = (void *)(uintptr_t) get_bo_offset.offset;
                 } else if (dev->kbase) {
-                        bo->ptr.cpu = dev->mali.mmap_import(&dev->mali, bo->ptr.gpu, bo->size);
                         bo->free_ioctl = true;
                 }
                 /* Sometimes this can fail and return -1. size of -1 is not
@@ -793,9 +1336,11 @@ panfrost_bo_import(struct panfrost_device *dev, int fd)
                         pthread_mutex_unlock(&dev->bo_map_lock);
                         return NULL;
                 }
-                bo->flags = PAN_BO_SHARED;
+                bo->flags = PAN_BO_SHARED | flags;
                 bo->gem_handle = gem_handle;
                 util_dynarray_init(&bo->usage, NULL);
+                memset(bo->usage_slots, 0, sizeof(bo->usage_slots));
+                bo->usage_overflow = false;
                 if (dev->kbase) {
                         /* kbase always maps dma-bufs with caching */
                         bo->cached = true;
@@ -832,15 +1377,68 @@ panfrost_bo_import(struct panfrost_device *dev, int fd)
 
                 struct timespec tp;
                 clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-                fprintf(dev->bo_log, "%"PRIu64".%09li import %"PRIx64" to %"PRIx64" size %zu fd %i new %i handle %i found %i\n",
+                fprintf(dev->bo_log, "%"PRIu64".%09li import %"PRIx64" to %"PRIx64" size %zu fd %i new %i handle %i found %i gpu-only %i took %"PRIi64" ns\n",
                         (uint64_t) tp.tv_sec, tp.tv_nsec, bo->ptr.gpu, bo->ptr.gpu + bo->size, bo->size,
-                        fd, new_fd, gem_handle, found);
+                        fd, new_fd, gem_handle, found, gpu_only,
+                        os_time_get_nano() - start);
                 fflush(NULL);
         }
 
         return bo;
 }
 
+/* Wraps application memory starting on a page, which must outlive the BO.
+ * The rest of the last page is imported as well. The GPU accesses it through
+ * its own VA, while CPU accesses go straight to ptr, so nothing is ever
+ * copied. */
+
+struct panfrost_bo *
+panfrost_bo_import_user(struct panfrost_device *dev, void *ptr, size_t size)
+{
+        if (!dev->kbase || !dev->mali.import_user ||
+            ((uintptr_t) ptr & (dev->mali.page_size - 1)))
+                return NULL;
+
+        size = ALIGN_POT(size, dev->mali.page_size);
+
+        int gem_handle = dev->mali.import_user(&dev->mali, ptr, size);
+        if (gem_handle == -1)
+                return NULL;
+
+        mali_ptr va = kbase_gem_handle_get(&dev->mali, gem_handle).va;
+
+        pthread_mutex_lock(&dev->bo_map_lock);
+        struct panfrost_bo *bo = pan_lookup_bo(dev, gem_handle);
+        assert(!bo->dev);
+
+        bo->dev = dev;
+        bo->size = size;
+        bo->ptr.gpu = va;
+        bo->ptr.cpu = ptr;
+        bo->flags = PAN_BO_USERPTR;
+        bo->gem_handle = gem_handle;
+        bo->label = "User memory";
+        bo->dmabuf_fd = -1;
+
+        /* Application memory is CPU-cached, the GPU only sees writes once
+         * they are cleaned */
+        bo->cached = true;
+
+        /* Only the reservation which picked the GPU VA is unmapped */
+        if (sizeof(void *) > 4 || va < (1ull << 32))
+                bo->munmap_ptr = (void *)(uintptr_t) va;
+        else
+                bo->free_ioctl = true;
+
+        util_dynarray_init(&bo->usage, NULL);
+        memset(bo->usage_slots, 0, sizeof(bo->usage_slots));
+        bo->usage_overflow = false;
+        p_atomic_set(&bo->refcnt, 1);
+        pthread_mutex_unlock(&dev->bo_map_lock);
+
+        return bo;
+}
+
 int
 panfrost_bo_export(struct panfrost_bo *bo)
 {
@@ -27,6 +27,7 @@
 #define __PAN_BO_H__
 
 #include "util/list.h"
+#include "util/u_atomic.h"
 #include "util/u_dynarray.h"
 #include "panfrost-job.h"
 #include <time.h>
@@ -57,6 +58,15 @@
 /* Use the caching policy for resource BOs */
 #define PAN_BO_CACHEABLE          (1 << 6)
 
+/* kbase only: VA is reserved and mapped for the requested size, but only the
+ * start of it is backed, as set by panfrost_bo_commit. Starts out with
+ * nothing backed. */
+#define PAN_BO_SPARSE             (1 << 7)
+
+/* kbase only: wraps application memory. The CPU pointer is the application's
+ * and is never unmapped, and the BO is never cached or replaced. */
+#define PAN_BO_USERPTR            (1 << 8)
+
 /* GPU access flags */
 
 /* BO is either shared (can be accessed by more than one GPU batch) or private
@@ -78,6 +88,7 @@
 typedef uint8_t pan_bo_access;
 
 struct panfrost_device;
+struct panfrost_bo_slab;
 
 struct panfrost_ptr {
         /* CPU address */
@@ -93,6 +104,37 @@ struct panfrost_usage {
         uint64_t seqnum;
 };
 
+/* Number of usages of a BO which can be tracked without bo_usage_lock. Each
+ * queue accessing the BO needs up to two, for reads and writes. */
+#define PAN_BO_USAGE_SLOTS 8
+
+/* Usages are packed into 64 bits so that slots can be updated atomically:
+ * the queue in the low twelve bits, enough for KBASE_MAX_EVENT_SLOTS, then
+ * the write flag, then seqnum + 1, so that an empty slot is zero and later
+ * seqnums compare greater. */
+#define PAN_USAGE_KEY_MASK 0x1fff
+
+static inline uint64_t
+panfrost_usage_pack(struct panfrost_usage u)
+{
+        return ((u.seqnum + 1) << 13) | ((uint64_t) u.write << 12) | (u.queue & 0xfff);
+}
+
+static inline bool
+panfrost_usage_unpack(uint64_t packed, struct panfrost_usage *u)
+{
+        if (!packed)
+                return false;
+
+        *u = (struct panfrost_usage) {
+                .queue = packed & 0xfff,
+                .write = (packed >> 12) & 1,
+                .seqnum = (packed >> 13) - 1,
+        };
+
+        return true;
+}
+
 struct panfrost_bo {
         /* Must be first for casting */
         struct list_head bucket_link;
@@ -116,11 +158,21 @@ struct panfrost_bo {
         /* Mapping for the entire object (all levels) */
         struct panfrost_ptr ptr;
 
+        /* struct panfrost_usage packed by panfrost_usage_pack, or zero */
+        uint64_t usage_slots[PAN_BO_USAGE_SLOTS];
+
+        /* Usages which did not fit into usage_slots, protected by
+         * bo_usage_lock. usage_overflow is set once this is used. */
         struct util_dynarray usage;
+        bool usage_overflow;
 
         /* Size of all entire trees */
         size_t size;
 
+        /* On kbase, size of the VA range reserved and mapped for the BO, of
+         * which only size bytes are backed. Zero if it is just size. */
+        size_t va_size;
+
         int gem_handle;
 
         uint32_t flags;
@@ -147,13 +199,25 @@ struct panfrost_bo {
         /* Is the BO cached CPU-side? */
         bool cached;
 
+        /* Has the BO been marked as evictable while in the BO cache? */
+        bool evictable;
+
+        /* For BOs sub-allocated from a slab, the slab they belong to. Such
+         * BOs hold a reference on the slab BO until they are freed. */
+        struct panfrost_bo_slab *slab;
+
         /* File descriptor for the dma-buf */
         int dmabuf_fd;
+
+        /* enum pan_mem_category the size of the BO is accounted to */
+        uint8_t category;
 };
 
 bool
 panfrost_bo_wait(struct panfrost_bo *bo, int64_t timeout_ns, bool wait_readers);
 void
+panfrost_bo_add_usage(struct panfrost_bo *bo, struct panfrost_usage u);
+void
 panfrost_bo_mem_invalidate(struct panfrost_bo *bo, size_t offset, size_t length);
 void
 panfrost_bo_mem_clean(struct panfrost_bo *bo, size_t offset, size_t length);
@@ -164,13 +228,21 @@ panfrost_bo_unreference(struct panfrost_bo *bo);
 struct panfrost_bo *
 panfrost_bo_create(struct panfrost_device *dev, size_t size,
                    uint32_t flags, const char *label);
+bool
+panfrost_bo_commit(struct panfrost_bo *bo, size_t size);
 void
 panfrost_bo_mmap(struct panfrost_bo *bo);
 struct panfrost_bo *
-panfrost_bo_import(struct panfrost_device *dev, int fd);
+panfrost_bo_import(struct panfrost_device *dev, int fd, uint32_t flags);
+struct panfrost_bo *
+panfrost_bo_import_user(struct panfrost_device *dev, void *ptr, size_t size);
 int
 panfrost_bo_export(struct panfrost_bo *bo);
 void
 panfrost_bo_cache_evict_all(struct panfrost_device *dev);
+void
+panfrost_bo_set_category(struct panfrost_bo *bo, unsigned category);
+uint64_t
+panfrost_bo_mem_total(struct panfrost_device *dev);
 
 #endif /* __PAN_BO_H__ */
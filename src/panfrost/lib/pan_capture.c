@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "util/hash_table.h"
+#include "util/ralloc.h"
+#include "util/simple_mtx.h"
+#include "util/u_atomic.h"
+#include "util/u_dynarray.h"
+#include "util/u_queue.h"
+
+#include "pan_bo.h"
+#include "pan_capture.h"
+#include "pan_device.h"
+
+#define XXH_INLINE_ALL
+#include "util/xxhash.h"
+
+/* Records are gathered in memory and handed to a writer thread at the end of
+ * each frame, or once this much is pending, so that file I/O doesn't stall
+ * submissions */
+#define PAN_CAPTURE_FLUSH_SIZE (64 * 1024 * 1024)
+
+/* What was last written for the region at an address */
+struct pan_capture_entry {
+        struct pan_capture_region region;
+        uint64_t hash;
+        bool has_data;
+};
+
+struct pan_capture {
+        struct panfrost_device *dev;
+        FILE *fp;
+
+        /* Submissions may come from the submit thread of the context */
+        simple_mtx_t lock;
+
+        /* Records not handed to the writer yet */
+        struct util_dynarray pending;
+        struct util_queue writer;
+
+        struct hash_table_u64 *regions;
+        unsigned submits, frames;
+};
+
+struct pan_capture_job {
+        FILE *fp;
+        struct util_dynarray data;
+};
+
+static void
+pan_capture_write_job(void *data, void *gdata, int thread_index)
+{
+        struct pan_capture_job *job = data;
+
+        fwrite(job->data.data, job->data.size, 1, job->fp);
+}
+
+static void
+pan_capture_free_job(void *data, void *gdata, int thread_index)
+{
+        struct pan_capture_job *job = data;
+
+        util_dynarray_fini(&job->data);
+        free(job);
+}
+
+static void
+pan_capture_flush(struct pan_capture *cap)
+{
+        if (!cap->pending.size)
+                return;
+
+        struct pan_capture_job *job = malloc(sizeof(*job));
+
+        job->fp = cap->fp;
+        job->data = cap->pending;
+        util_dynarray_init(&cap->pending, NULL);
+
+        util_queue_add_job(&cap->writer, job, NULL, pan_capture_write_job,
+                           pan_capture_free_job, job->data.size);
+}
+
+static void
+pan_capture_append(struct pan_capture *cap, const void *data, size_t size)
+{
+        if (size)
+                memcpy(util_dynarray_grow_bytes(&cap->pending, 1, size),
+                       data, size);
+}
+
+static void
+pan_capture_write(struct pan_capture *cap, enum pan_capture_type type,
+                  const void *payload, uint32_t payload_size,
+                  const void *data, uint32_t data_size)
+{
+        struct pan_capture_record record = {
+                .type = type,
+                .size = payload_size + data_size,
+        };
+
+        /* Only between records, so that submissions aren't split */
+        if (cap->pending.size >= PAN_CAPTURE_FLUSH_SIZE)
+                pan_capture_flush(cap);
+
+        pan_capture_append(cap, &record, sizeof(record));
+        pan_capture_append(cap, payload, payload_size);
+
+        /* Without data, the caller writes it */
+        if (data)
+                pan_capture_append(cap, data, data_size);
+}
+
+static struct pan_capture_entry *
+pan_capture_region(struct pan_capture *cap, uint64_t va, uint64_t size,
+                   enum pan_capture_region_kind kind, uint32_t flags)
+{
+        struct pan_capture_entry *entry =
+                _mesa_hash_table_u64_search(cap->regions, va);
+
+        if (entry && entry->region.size == size &&
+            entry->region.kind == kind && entry->region.flags == flags)
+                return entry;
+
+        if (!entry) {
+                entry = rzalloc(cap->regions, struct pan_capture_entry);
+                _mesa_hash_table_u64_insert(cap->regions, va, entry);
+        }
+
+        entry->region = (struct pan_capture_region) {
+                .va = va,
+                .size = size,
+                .kind = kind,
+                .flags = flags,
+        };
+        entry->has_data = false;
+
+        pan_capture_write(cap, PAN_CAPTURE_REGION, &entry->region,
+                          sizeof(entry->region), NULL, 0);
+        return entry;
+}
+
+static void
+pan_capture_data(struct pan_capture *cap, struct pan_capture_entry *entry,
+                 const void *cpu)
+{
+        uint64_t hash = XXH64(cpu, entry->region.size, 0);
+
+        if (entry->has_data && entry->hash == hash)
+                return;
+
+        entry->hash = hash;
+        entry->has_data = true;
+
+        struct pan_capture_data data = {
+                .va = entry->region.va,
+                .size = entry->region.size,
+        };
+
+        pan_capture_write(cap, PAN_CAPTURE_DATA, &data, sizeof(data),
+                          cpu, entry->region.size);
+}
+
+struct pan_capture *
+pan_capture_create(struct panfrost_device *dev, const char *path,
+                   const uint32_t hw_resources[PAN_CAPTURE_QUEUES])
+{
+        FILE *fp = fopen(path, "wb");
+
+        if (!fp) {
+                fprintf(stderr, "panfrost: failed to open capture file %s: %m\n",
+                        path);
+                return NULL;
+        }
+
+        struct pan_capture *cap = rzalloc(NULL, struct pan_capture);
+
+        if (!util_queue_init(&cap->writer, "pan_capture", 8, 1,
+                             UTIL_QUEUE_INIT_RESIZE_IF_FULL, NULL)) {
+                fclose(fp);
+                ralloc_free(cap);
+                return NULL;
+        }
+
+        cap->dev = dev;
+        cap->fp = fp;
+        cap->regions = _mesa_hash_table_u64_create(cap);
+        util_dynarray_init(&cap->pending, NULL);
+        simple_mtx_init(&cap->lock, mtx_plain);
+
+        struct pan_capture_header header = {
+                .magic = PAN_CAPTURE_MAGIC,
+                .version = PAN_CAPTURE_VERSION,
+                .gpu_id = dev->gpu_id,
+        };
+
+        for (unsigned i = 0; i < PAN_CAPTURE_QUEUES; ++i)
+                header.hw_resources[i] = hw_resources[i];
+
+        pan_capture_write(cap, PAN_CAPTURE_HEADER, &header, sizeof(header),
+                          NULL, 0);
+
+        return cap;
+}
+
+void
+pan_capture_destroy(struct pan_capture *cap)
+{
+        if (!cap)
+                return;
+
+        fprintf(stderr, "panfrost: captured %u submissions in %u frames\n",
+                cap->submits, cap->frames);
+
+        pan_capture_flush(cap);
+        util_queue_finish(&cap->writer);
+        util_queue_destroy(&cap->writer);
+
+        fclose(cap->fp);
+        simple_mtx_destroy(&cap->lock);
+        ralloc_free(cap);
+}
+
+void
+pan_capture_snapshot(struct pan_capture *cap, const struct kbase_context *kctx)
+{
+        struct panfrost_device *dev = cap->dev;
+        kbase k = &dev->mali;
+
+        simple_mtx_lock(&cap->lock);
+
+        pthread_mutex_lock(&k->handle_lock);
+        unsigned handles = util_dynarray_num_elements(&k->gem_handles,
+                                                      kbase_handle);
+        pthread_mutex_unlock(&k->handle_lock);
+
+        pthread_mutex_lock(&dev->bo_map_lock);
+
+        for (unsigned i = 0; i < handles; ++i) {
+                struct panfrost_bo *bo = pan_lookup_bo_existing(dev, i);
+
+                /* Skip freed BOs and those in the BO cache. Sub-allocated
+                 * BOs are covered by their slab. */
+                if (!bo || !bo->size || !p_atomic_read(&bo->refcnt) ||
+                    bo->slab)
+                        continue;
+
+                struct pan_capture_entry *entry =
+                        pan_capture_region(cap, bo->ptr.gpu, bo->size,
+                                           PAN_CAPTURE_REGION_BO, bo->flags);
+
+                /* Growable memory is only backed where the GPU faulted */
+                if (!bo->ptr.cpu ||
+                    (bo->flags & (PAN_BO_GROWABLE | PAN_BO_INVISIBLE)))
+                        continue;
+
+                if (bo->cached)
+                        panfrost_bo_mem_invalidate(bo, 0, bo->size);
+
+                pan_capture_data(cap, entry, bo->ptr.cpu);
+        }
+
+        pthread_mutex_unlock(&dev->bo_map_lock);
+
+        struct pan_capture_entry *events =
+                pan_capture_region(cap, k->event_mem.gpu, k->event_mem_size,
+                                   PAN_CAPTURE_REGION_EVENT, 0);
+        pan_capture_data(cap, events, k->event_mem.cpu);
+
+        struct pan_capture_entry *kcpu_events =
+                pan_capture_region(cap, k->kcpu_event_mem.gpu,
+                                   k->event_mem_size,
+                                   PAN_CAPTURE_REGION_EVENT, 0);
+        pan_capture_data(cap, kcpu_events, k->kcpu_event_mem.cpu);
+
+        for (unsigned i = 0; i < kctx->num_tiler_heaps; ++i) {
+                pan_capture_region(cap, kctx->tiler_heaps[i].va, k->page_size,
+                                   PAN_CAPTURE_REGION_HEAP, i);
+                pan_capture_region(cap, kctx->tiler_heaps[i].header,
+                                   kctx->tiler_heap_chunk_size,
+                                   PAN_CAPTURE_REGION_HEAP_CHUNK, i);
+        }
+
+        simple_mtx_unlock(&cap->lock);
+}
+
+static void
+pan_capture_write_ring(struct pan_capture *cap,
+                       const struct pan_capture_ring *ring)
+{
+        uint64_t start = ring->start % ring->size;
+        uint64_t end = start + (ring->end - ring->start);
+
+        if (end > ring->size) {
+                pan_capture_append(cap, ring->cpu + start, ring->size - start);
+                start = 0;
+                end -= ring->size;
+        }
+
+        pan_capture_append(cap, ring->cpu + start, end - start);
+}
+
+void
+pan_capture_submit(struct pan_capture *cap,
+                   const struct pan_capture_ring rings[PAN_CAPTURE_QUEUES])
+{
+        struct pan_capture_submit submit;
+        uint32_t size = 0;
+
+        for (unsigned i = 0; i < PAN_CAPTURE_QUEUES; ++i) {
+                submit.count[i] = (rings[i].end - rings[i].start) / 8;
+                size += submit.count[i] * 8;
+        }
+
+        simple_mtx_lock(&cap->lock);
+
+        pan_capture_write(cap, PAN_CAPTURE_SUBMIT, &submit, sizeof(submit),
+                          NULL, size);
+
+        for (unsigned i = 0; i < PAN_CAPTURE_QUEUES; ++i)
+                pan_capture_write_ring(cap, &rings[i]);
+
+        cap->submits++;
+        simple_mtx_unlock(&cap->lock);
+}
+
+void
+pan_capture_end_frame(struct pan_capture *cap)
+{
+        simple_mtx_lock(&cap->lock);
+
+        pan_capture_write(cap, PAN_CAPTURE_FRAME, NULL, 0, NULL, 0);
+        pan_capture_flush(cap);
+        cap->frames++;
+
+        simple_mtx_unlock(&cap->lock);
+}
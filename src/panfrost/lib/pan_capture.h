@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __PAN_CAPTURE_H__
+#define __PAN_CAPTURE_H__
+
+#include <stdint.h>
+
+/* Captures of the CSF command streams of some frames, with the memory they
+ * use, for replaying with panfrost_replay or decoding with
+ * panfrost_capture_decode. A capture is a sequence of
+ * records: a header, then memory regions and their contents, each
+ * submission with the instructions added to the ring of each queue, and
+ * frame ends.
+ *
+ * Memory contents are only written when they changed since the previous
+ * submission, which is waited for while capturing so that GPU writes are
+ * included. GPU addresses are those of the capturing process, the replay
+ * relocates them to its own allocations.
+ *
+ * Records are written to the file by a thread of the capture, so a capture
+ * is only complete once it is destroyed. */
+
+#define PAN_CAPTURE_MAGIC 0x4e415043 /* "CPAN" */
+#define PAN_CAPTURE_VERSION 1
+
+/* Vertex, fragment and compute */
+#define PAN_CAPTURE_QUEUES 3
+
+enum pan_capture_type {
+        PAN_CAPTURE_HEADER = 1,
+        PAN_CAPTURE_REGION,
+        PAN_CAPTURE_DATA,
+        PAN_CAPTURE_SUBMIT,
+        PAN_CAPTURE_FRAME,
+};
+
+/* Each record starts with this, followed by size bytes of payload */
+struct pan_capture_record {
+        uint32_t type;
+        uint32_t size;
+};
+
+struct pan_capture_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t gpu_id;
+        /* Iterator mask of each queue, for CS_RESOURCES */
+        uint32_t hw_resources[PAN_CAPTURE_QUEUES];
+};
+
+enum pan_capture_region_kind {
+        /* A BO, flags are its PAN_BO_* flags */
+        PAN_CAPTURE_REGION_BO,
+        /* The kbase event memory */
+        PAN_CAPTURE_REGION_EVENT,
+        /* A tiler heap context and its first chunk, which are owned by
+         * kbase. flags is the index of the heap. */
+        PAN_CAPTURE_REGION_HEAP,
+        PAN_CAPTURE_REGION_HEAP_CHUNK,
+};
+
+/* A region replaces any earlier one at the same address */
+struct pan_capture_region {
+        uint64_t va;
+        uint64_t size;
+        uint32_t kind;
+        uint32_t flags;
+};
+
+/* Followed by size bytes to copy to va */
+struct pan_capture_data {
+        uint64_t va;
+        uint64_t size;
+};
+
+/* Followed by the instructions of each queue in turn. The queues of a
+ * submission are submitted together, then waited for. */
+struct pan_capture_submit {
+        uint32_t count[PAN_CAPTURE_QUEUES];
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct panfrost_device;
+struct kbase_context;
+struct pan_capture;
+
+/* The part of a CS ring between two offsets, which may wrap around */
+struct pan_capture_ring {
+        const void *cpu;
+        unsigned size;
+        uint64_t start, end;
+};
+
+struct pan_capture *
+pan_capture_create(struct panfrost_device *dev, const char *path,
+                   const uint32_t hw_resources[PAN_CAPTURE_QUEUES]);
+
+void
+pan_capture_destroy(struct pan_capture *cap);
+
+/* Write the regions used by a kbase context and the contents of those
+ * which changed. Must be called before each pan_capture_submit. */
+void
+pan_capture_snapshot(struct pan_capture *cap, const struct kbase_context *kctx);
+
+void
+pan_capture_submit(struct pan_capture *cap,
+                   const struct pan_capture_ring rings[PAN_CAPTURE_QUEUES]);
+
+void
+pan_capture_end_frame(struct pan_capture *cap);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
+#endif
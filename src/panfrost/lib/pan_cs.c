@@ -100,10 +100,8 @@ GENX(pan_select_crc_rt)(const struct pan_fb_info *fb, unsigned tile_size)
          * CRCs are more expensive at smaller tile sizes, reducing the benefit.
          * Restricting CRC to 16x16 should work in practice.
          */
-        if (tile_size != 16 * 16) {
-                assert(tile_size < 16 * 16);
+        if (tile_size != 16 * 16)
                 return -1;
-        }
 
 #if PAN_ARCH <= 6
         if (fb->rt_count == 1 && fb->rts[0].view && !fb->rts[0].discard &&
@@ -116,7 +114,7 @@ GENX(pan_select_crc_rt)(const struct pan_fb_info *fb, unsigned tile_size)
         int best_rt = -1;
 
         for (unsigned i = 0; i < fb->rt_count; i++) {
-		if (!fb->rts[i].view || fb->rts[0].discard ||
+                if (!fb->rts[i].view || fb->rts[i].discard ||
                     !fb->rts[i].view->image->layout.crc)
                         continue;
 
@@ -194,13 +192,26 @@ pan_prepare_s(const struct pan_fb_info *fb,
         struct pan_surface surf;
         pan_iview_get_surface(s, 0, 0, 0, &surf);
 
-        assert(s->image->layout.modifier == DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED ||
-               s->image->layout.modifier == DRM_FORMAT_MOD_LINEAR);
-        ext->s_writeback_base = surf.data;
-        ext->s_writeback_row_stride = s->image->layout.slices[level].row_stride;
-        ext->s_writeback_surface_stride =
-                (s->image->layout.nr_samples > 1) ?
-                s->image->layout.slices[level].surface_stride : 0;
+        if (drm_is_afbc(s->image->layout.modifier)) {
+                /* Separate stencil is only compressed on Valhall, see
+                 * panfrost_afbc_format */
+#if PAN_ARCH >= 9
+                ext->s_writeback_base = surf.afbc.header;
+                ext->s_writeback_row_stride = s->image->layout.slices[level].row_stride;
+                ext->s_afbc_body_offset = surf.afbc.body - surf.afbc.header;
+#else
+                unreachable("AFBC stencil requires Valhall");
+#endif
+        } else {
+                assert(s->image->layout.modifier == DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED ||
+                       s->image->layout.modifier == DRM_FORMAT_MOD_LINEAR);
+                ext->s_writeback_base = surf.data;
+                ext->s_writeback_row_stride = s->image->layout.slices[level].row_stride;
+                ext->s_writeback_surface_stride =
+                        (s->image->layout.nr_samples > 1) ?
+                        s->image->layout.slices[level].surface_stride : 0;
+        }
+
         ext->s_block_format = mod_to_block_fmt(s->image->layout.modifier);
         ext->s_write_format = translate_s_format(s->format);
 }
@@ -228,8 +239,6 @@ pan_prepare_zs(const struct pan_fb_info *fb,
                 ext->zs_writeback_row_stride = slice->row_stride;
                 /* TODO: surface stride? */
                 ext->zs_afbc_body_offset = surf.afbc.body - surf.afbc.header;
-
-                /* TODO: stencil AFBC? */
 #else
 #if PAN_ARCH >= 6
                 ext->zs_afbc_row_stride = pan_afbc_stride_blocks(zs->image->layout.modifier, slice->row_stride);
@@ -358,6 +367,43 @@ pan_select_max_tile_size(unsigned tile_buffer_bytes, unsigned bytes_per_pixel)
         return tile_buffer_bytes >> util_logbase2_ceil(bytes_per_pixel);
 }
 
+/*
+ * Valhall v10 supports 32x32 tiles. The depth/stencil tile buffer is only
+ * sized for 16x16 tiles at 4x MSAA, so larger tiles are limited to
+ * single-sampled batches without colour buffers, i.e. depth prepasses and
+ * shadow maps. These otherwise use the full tile buffer for nothing.
+ *
+ * A larger tile than the AFBC superblock forces clean tile writes, see
+ * pan_force_clean_write_rt, so only do this when depth/stencil are cleared
+ * rather than preloaded, as every tile is written out anyway.
+ */
+static unsigned
+pan_max_effective_tile_size(const struct pan_fb_info *fb,
+                            unsigned cbuf_bytes_per_pixel)
+{
+        if (PAN_ARCH >= 10 && !cbuf_bytes_per_pixel && fb->nr_samples <= 1 &&
+            !fb->zs.preload.z && !fb->zs.preload.s)
+                return 32 * 32;
+
+        return 16 * 16;
+}
+
+unsigned
+GENX(pan_select_tile_size)(const struct panfrost_device *dev,
+                           const struct pan_fb_info *fb)
+{
+        unsigned bytes_per_pixel = pan_cbuf_bytes_per_pixel(fb);
+        unsigned tile_size =
+                pan_select_max_tile_size(dev->optimal_tib_size,
+                                         bytes_per_pixel);
+
+        /* Clamp tile size to hardware limits */
+        tile_size = MIN2(tile_size, pan_max_effective_tile_size(fb, bytes_per_pixel));
+        assert(tile_size >= 4 * 4);
+
+        return tile_size;
+}
+
 static enum mali_color_format
 pan_mfbd_raw_format(unsigned bits)
 {
@@ -465,21 +511,21 @@ pan_afbc_compression_mode(enum pipe_format format)
 #endif
 
 static void
-pan_prepare_rt(const struct pan_fb_info *fb, unsigned idx,
+pan_prepare_rt(const struct pan_fb_color_attachment *att,
+               const struct pan_image_view *rt, bool discard,
                unsigned cbuf_offset,
                struct MALI_RENDER_TARGET *cfg)
 {
-        cfg->clean_pixel_write_enable = fb->rts[idx].clear;
+        cfg->clean_pixel_write_enable = att->clear;
         cfg->internal_buffer_offset = cbuf_offset;
-        if (fb->rts[idx].clear) {
-                cfg->clear.color_0 = fb->rts[idx].clear_value[0];
-                cfg->clear.color_1 = fb->rts[idx].clear_value[1];
-                cfg->clear.color_2 = fb->rts[idx].clear_value[2];
-                cfg->clear.color_3 = fb->rts[idx].clear_value[3];
+        if (att->clear) {
+                cfg->clear.color_0 = att->clear_value[0];
+                cfg->clear.color_1 = att->clear_value[1];
+                cfg->clear.color_2 = att->clear_value[2];
+                cfg->clear.color_3 = att->clear_value[3];
         }
 
-        const struct pan_image_view *rt = fb->rts[idx].view;
-        if (!rt || fb->rts[idx].discard) {
+        if (!rt || discard) {
                 cfg->internal_format = MALI_COLOR_BUFFER_INTERNAL_FORMAT_R8G8B8A8;
                 cfg->internal_buffer_offset = cbuf_offset;
 #if PAN_ARCH >= 7
@@ -645,10 +691,39 @@ pan_emit_rt(const struct pan_fb_info *fb,
             unsigned idx, unsigned cbuf_offset, void *out)
 {
         pan_pack(out, RENDER_TARGET, cfg) {
-                pan_prepare_rt(fb, idx, cbuf_offset, &cfg);
+                pan_prepare_rt(&fb->rts[idx], fb->rts[idx].view,
+                               fb->rts[idx].discard, cbuf_offset, &cfg);
         }
 }
 
+/* A resolve target is an extra render target sharing the tile buffer
+ * storage of its colour buffer, so the writeback of the former averages the
+ * samples the latter holds. */
+
+static void
+pan_emit_resolve_rt(const struct pan_fb_info *fb,
+                    unsigned idx, unsigned cbuf_offset, void *out)
+{
+        pan_pack(out, RENDER_TARGET, cfg) {
+                pan_prepare_rt(&fb->rts[idx], fb->rts[idx].resolve, false,
+                               cbuf_offset, &cfg);
+        }
+}
+
+static unsigned
+pan_rt_desc_count(const struct pan_fb_info *fb)
+{
+        unsigned count = MAX2(fb->rt_count, 1);
+
+        for (unsigned i = 0; i < fb->rt_count; i++) {
+                if (fb->rts[i].view && fb->rts[i].resolve)
+                        count++;
+        }
+
+        assert(count <= 8);
+        return count;
+}
+
 #if PAN_ARCH >= 6
 /* All Bifrost and Valhall GPUs are affected by issue TSIX-2033:
  *
@@ -680,7 +755,7 @@ pan_force_clean_write_rt(const struct pan_image_view *rt, unsigned tile_size)
         unsigned superblock = panfrost_afbc_superblock_width(rt->image->layout.modifier);
 
         assert(superblock >= 16);
-        assert(tile_size <= 16*16);
+        assert(tile_size <= 32*32);
 
         /* Tile size and superblock differ unless they are both 16x16 */
         return !(superblock == 16 && tile_size == 16*16);
@@ -690,12 +765,16 @@ static bool
 pan_force_clean_write(const struct pan_fb_info *fb, unsigned tile_size)
 {
         /* Maximum tile size */
-        assert(tile_size <= 16*16);
+        assert(tile_size <= 32*32);
 
         for (unsigned i = 0; i < fb->rt_count; ++i) {
                 if (fb->rts[i].view && !fb->rts[i].discard &&
                     pan_force_clean_write_rt(fb->rts[i].view, tile_size))
                         return true;
+
+                if (fb->rts[i].view && fb->rts[i].resolve &&
+                    pan_force_clean_write_rt(fb->rts[i].resolve, tile_size))
+                        return true;
         }
 
         if (fb->zs.view.zs && !fb->zs.discard.z &&
@@ -728,12 +807,7 @@ GENX(pan_emit_fbd)(const struct panfrost_device *dev,
 #endif
 
         unsigned bytes_per_pixel = pan_cbuf_bytes_per_pixel(fb);
-        unsigned tile_size = pan_select_max_tile_size(dev->optimal_tib_size,
-                                                      bytes_per_pixel);
-
-        /* Clamp tile size to hardware limits */
-        tile_size = MIN2(tile_size, 16 * 16);
-        assert(tile_size >= 4 * 4);
+        unsigned tile_size = GENX(pan_select_tile_size)(dev, fb);
 
         /* Colour buffer allocations must be 1K aligned. */
         unsigned cbuf_allocation = ALIGN_POT(bytes_per_pixel * tile_size, 1024);
@@ -764,7 +838,7 @@ GENX(pan_emit_fbd)(const struct panfrost_device *dev,
 
                 cfg.effective_tile_size = tile_size;
                 cfg.tie_break_rule = MALI_TIE_BREAK_RULE_MINUS_180_IN_0_OUT;
-                cfg.render_target_count = MAX2(fb->rt_count, 1);
+                cfg.render_target_count = pan_rt_desc_count(fb);
 
                 /* Default to 24 bit depth if there's no surface. */
                 cfg.z_internal_format =
@@ -821,8 +895,10 @@ GENX(pan_emit_fbd)(const struct panfrost_device *dev,
         }
 
         unsigned rt_count = MAX2(fb->rt_count, 1);
+        unsigned cbuf_offsets[8] = { 0 };
         unsigned cbuf_offset = 0;
         for (unsigned i = 0; i < rt_count; i++) {
+                cbuf_offsets[i] = cbuf_offset;
                 pan_emit_rt(fb, i, cbuf_offset, rtd);
                 rtd += pan_size(RENDER_TARGET);
                 if (!fb->rts[i].view)
@@ -834,7 +910,16 @@ GENX(pan_emit_fbd)(const struct panfrost_device *dev,
                 if (i != crc_rt)
                         *(fb->rts[i].crc_valid) = false;
         }
-        tags |= MALI_POSITIVE(MAX2(fb->rt_count, 1)) << 2;
+
+        for (unsigned i = 0; i < fb->rt_count; i++) {
+                if (!fb->rts[i].view || !fb->rts[i].resolve)
+                        continue;
+
+                pan_emit_resolve_rt(fb, i, cbuf_offsets[i], rtd);
+                rtd += pan_size(RENDER_TARGET);
+        }
+
+        tags |= MALI_POSITIVE(pan_rt_desc_count(fb)) << 2;
 
         return tags;
 }
@@ -970,15 +1055,17 @@ GENX(pan_emit_tiler_ctx)(const struct panfrost_device *dev,
                          bool first_provoking_vertex,
                          mali_ptr heap,
                          mali_ptr scratch,
+                         unsigned hierarchy_mask,
                          void *out)
 {
         unsigned max_levels = dev->tiler_features.max_levels;
         assert(max_levels >= 2);
+        assert(util_bitcount(hierarchy_mask) <= max_levels);
 
         pan_pack(out, TILER_CONTEXT, tiler) {
-                /* TODO: Select hierarchy mask more effectively. */
-
-                /* Disable the smallest hierarchy level. This is required to
+                /* Unless the caller chose the levels from the primitives
+                 * drawn before, see panfrost_choose_bifrost_hierarchy_mask,
+                 * disable the smallest hierarchy level. This is required to
                  * use 32x32 tiles on v10, and helps reduce tiler heap memory
                  * usage for other GPUs. The rasteriser can efficiently skip
                  * primitives not entering the current quadrant of a tile, so
@@ -988,7 +1075,10 @@ GENX(pan_emit_tiler_ctx)(const struct panfrost_device *dev,
                  * set of primitive lists could help with performance.
                  * Maybe then v10 should disable two levels?
                  */
-                tiler.hierarchy_mask = (max_levels >= 8) ? 0xFE : 0x28;
+                if (hierarchy_mask)
+                        tiler.hierarchy_mask = hierarchy_mask;
+                else
+                        tiler.hierarchy_mask = (max_levels >= 8) ? 0xFE : 0x28;
 
                 tiler.fb_width = fb_width;
                 tiler.fb_height = fb_height;
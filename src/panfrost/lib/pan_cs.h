@@ -38,6 +38,12 @@ struct pan_compute_dim {
 
 struct pan_fb_color_attachment {
         const struct pan_image_view *view;
+
+        /* Optional single-sampled view the samples of the tile buffer are
+         * averaged into on writeback, along with (or, when discarded,
+         * instead of) view. Needs an extra render target descriptor. */
+        const struct pan_image_view *resolve;
+
         bool *crc_valid;
         bool clear;
         bool preload;
@@ -133,6 +139,57 @@ pan_wls_instances(const struct pan_compute_dim *dim)
                util_next_power_of_two(dim->z);
 }
 
+/*
+ * Number of WLS instances for a dispatch whose grid may be unknown (indirect
+ * dispatch, dim == NULL). Each instance backs one workgroup in flight on a
+ * core, so more instances than the workgroups a core can hold at once given
+ * the register usage of the shader are never used.
+ */
+static inline unsigned
+pan_wls_instances_for_occupancy(const struct pan_compute_dim *dim,
+                                unsigned max_threads,
+                                unsigned threads_per_wg)
+{
+        unsigned per_core = util_next_power_of_two(
+                        MAX2(max_threads / MAX2(threads_per_wg, 1), 1));
+
+        return dim ? MIN2(pan_wls_instances(dim), per_core) : per_core;
+}
+
+/*
+ * Split a dispatch of count[] workgroups in tasks, the unit of work sent to a
+ * shader core. A task covers the whole grid along the axes below the task
+ * axis and `increment` workgroups along it. Tasks are made as large as the
+ * core can run at once, so each task keeps its core busy while leaving
+ * enough of them to spread over all cores.
+ */
+static inline void
+pan_compute_task_split(const unsigned count[3], unsigned max_threads,
+                       unsigned threads_per_wg, unsigned *axis,
+                       unsigned *increment)
+{
+        uint64_t threads_per_task = MAX2(threads_per_wg, 1);
+
+        for (unsigned i = 0; i < 3; ++i) {
+                uint64_t n = MAX2(count[i], 1);
+
+                if (threads_per_task * n >= max_threads) {
+                        *increment = MAX2(max_threads / threads_per_task, 1);
+                        *axis = i;
+                        break;
+                } else if (i == 2) {
+                        *increment = n;
+                        *axis = i;
+                        break;
+                }
+
+                threads_per_task *= n;
+        }
+
+        /* The increment is a 14-bit field */
+        *increment = MIN2(*increment, BITFIELD_MASK(14));
+}
+
 static inline unsigned
 pan_wls_adjust_size(unsigned wls_size)
 {
@@ -157,6 +214,10 @@ GENX(pan_emit_tls)(const struct pan_tls_info *info,
 int
 GENX(pan_select_crc_rt)(const struct pan_fb_info *fb, unsigned tile_size);
 
+unsigned
+GENX(pan_select_tile_size)(const struct panfrost_device *dev,
+                           const struct pan_fb_info *fb);
+
 unsigned
 GENX(pan_emit_fbd)(const struct panfrost_device *dev,
                    const struct pan_fb_info *fb,
@@ -174,6 +235,7 @@ GENX(pan_emit_tiler_ctx)(const struct panfrost_device *dev,
                          unsigned fb_width, unsigned fb_height,
                          unsigned nr_samples, bool first_provoking_vertex,
                          mali_ptr heap, mali_ptr scratch,
+                         unsigned hierarchy_mask,
                          void *out);
 #endif
 
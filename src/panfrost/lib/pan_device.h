@@ -58,19 +58,85 @@ extern "C" {
 #define MIN_BO_CACHE_BUCKET (12) /* 2^12 = 4KB */
 #define MAX_BO_CACHE_BUCKET (22) /* 2^22 = 4MB */
 
-/* Fencepost problem, hence the off-by-one */
-#define NR_BO_CACHE_BUCKETS (MAX_BO_CACHE_BUCKET - MIN_BO_CACHE_BUCKET + 1)
+/* Each power-of-two level is split in 2^BO_CACHE_SUBCLASS_BITS size classes,
+ * so a cached BO is at most 25% bigger than the request it is reused for,
+ * rather than up to twice as big */
+#define BO_CACHE_SUBCLASS_BITS (2)
+
+/* Fencepost problem, hence the off-by-one: everything from 2^22 up shares
+ * the last bucket */
+#define NR_BO_CACHE_BUCKETS \
+        (((MAX_BO_CACHE_BUCKET - MIN_BO_CACHE_BUCKET) << BO_CACHE_SUBCLASS_BITS) + 1)
+
+/* Default BO cache high-water mark, overridable with
+ * PAN_BO_CACHE_MAX_SIZE (in MiB) */
+#define PAN_BO_CACHE_DEFAULT_MAX_SIZE (128 << 20)
+
+/* On kbase, BOs of at least PAN_BO_LARGE_PAGE_SIZE are rounded up to a
+ * multiple of it when that wastes at most a quarter of the BO, so that the
+ * kernel can back them with 2 MiB pages and map them with 2 MiB GPU MMU
+ * entries */
+#define PAN_BO_LARGE_PAGE_SIZE (2 << 20)
+
+/* On kbase, BOs of at least this size reserve VA up to the top of their BO
+ * cache size class but only commit the pages they need, so that the BO cache
+ * can reuse them for larger requests of the class by committing more pages
+ * in place */
+#define PAN_BO_RESERVE_MIN_SIZE (1 << 20)
+
+/* On kbase, small BOs are sub-allocated from shared slab BOs of this size,
+ * in power-of-two entries between 2^PAN_BO_SLAB_MIN_ORDER and
+ * 2^PAN_BO_SLAB_MAX_ORDER bytes */
+#define PAN_BO_SLAB_SIZE (2 << 20)
+#define PAN_BO_SLAB_MIN_ORDER 8 /* 256 B */
+#define PAN_BO_SLAB_MAX_ORDER 12 /* 4 KiB */
+#define PAN_BO_SLAB_ORDERS (PAN_BO_SLAB_MAX_ORDER - PAN_BO_SLAB_MIN_ORDER + 1)
+
+/* On kbase, cached BOs at least this large are marked as evictable, so that
+ * the kernel may reclaim their pages under memory pressure */
+#define PAN_BO_CACHE_EVICTABLE_MIN_SIZE (64 << 10)
+
+/* What the memory of a BO is used for, for accounting. Imported BOs and
+ * those sub-allocated from slabs are not accounted, the slabs themselves
+ * are. BOs are accounted as PAN_MEM_OTHER until their user sets another
+ * category, and as PAN_MEM_BO_CACHE while cached. */
+enum pan_mem_category {
+        PAN_MEM_UNTRACKED = 0,
+        PAN_MEM_OTHER,
+        PAN_MEM_RESOURCE,
+        PAN_MEM_POOL,
+        PAN_MEM_HEAP,
+        PAN_MEM_SCRATCH,
+        PAN_MEM_BO_CACHE,
+        PAN_MEM_CATEGORIES,
+};
+
+/* Default memory budget, as a fraction of the physical memory, overridable
+ * with PAN_MEM_BUDGET (in MiB, 0 to disable) */
+#define PAN_MEM_BUDGET_DEFAULT_PERCENT 75
+
+#define PAN_BLITTER_LOOKUP_SIZE 64
+
+/* Open-addressed table of the entries of a blitter hash table, which starts
+ * each entry with its key, for lookups without taking the lock. Slots are
+ * only filled, under the lock, once the entry is complete, and stay until
+ * cleanup. Entries which don't fit are only found in the hash table. */
+struct pan_blitter_lookup {
+        void *entries[PAN_BLITTER_LOOKUP_SIZE];
+};
 
 struct pan_blitter {
         struct {
                 struct pan_pool *pool;
                 struct hash_table *blit;
                 struct hash_table *blend;
+                struct pan_blitter_lookup blit_lookup, blend_lookup;
                 pthread_mutex_t lock;
         } shaders;
         struct {
                 struct pan_pool *pool;
                 struct hash_table *rsds;
+                struct pan_blitter_lookup lookup;
                 pthread_mutex_t lock;
         } rsds;
 };
@@ -178,6 +244,8 @@ struct panfrost_model {
         } quirks;
 };
 
+struct disk_cache;
+
 struct panfrost_device {
         /* For ralloc */
         void *memctx;
@@ -202,6 +270,13 @@ struct panfrost_device {
         unsigned optimal_tib_size;
 
         unsigned thread_tls_alloc;
+
+        /* Thread limits of a shader core, see
+         * panfrost_compute_max_thread_count */
+        unsigned max_threads_per_core;
+        unsigned max_threads_per_wg;
+        unsigned registers_per_core;
+
         struct panfrost_tiler_features tiler_features;
         const struct panfrost_model *model;
         bool has_afbc;
@@ -209,6 +284,10 @@ struct panfrost_device {
         /* Does the kernel support dma-buf fence import/export? */
         bool has_dmabuf_fence;
 
+        /* Put the descriptor pools of batches in CPU-cached memory, which
+         * is cleaned at submit, instead of write-combined memory */
+        bool cached_pools;
+
         /* Table of formats, indexed by a PIPE format */
         const struct panfrost_format *formats;
 
@@ -222,7 +301,7 @@ struct panfrost_device {
 
         struct renderonly *ro;
 
-        /* Hold this while updating usage field of BOs */
+        /* Hold this while accessing the usage overflow list of BOs */
         pthread_mutex_t bo_usage_lock;
 
         pthread_mutex_t bo_map_lock;
@@ -237,16 +316,33 @@ struct panfrost_device {
                  */
                 struct list_head lru;
 
-                /* The BO cache is a set of buckets with power-of-two sizes
-                 * ranging from 2^12 (4096, the page size) to
-                 * 2^(12 + MAX_BO_CACHE_BUCKETS).
+                /* The BO cache is a set of buckets with sizes ranging from
+                 * 2^12 (4096, the page size) to 2^MAX_BO_CACHE_BUCKET, each
+                 * power-of-two split in 2^BO_CACHE_SUBCLASS_BITS classes.
                  * Each bucket is a linked list of free panfrost_bo objects. */
 
                 struct list_head buckets[NR_BO_CACHE_BUCKETS];
+
+                /* Total size of the BOs currently in the cache, and the
+                 * high-water mark above which the least recently used BOs
+                 * are freed regardless of their age. */
+                size_t size;
+                size_t max_size;
         } bo_cache;
 
+        struct {
+                pthread_mutex_t lock;
+
+                /* Slabs with free entries, one list per entry size */
+                struct list_head partial[PAN_BO_SLAB_ORDERS];
+        } bo_slab;
+
         struct pan_blitter blitter;
         struct pan_blend_shaders blend_shaders;
+
+        /* On-disk cache for the internal shaders above, owned by the driver.
+         * Optional. */
+        struct disk_cache *disk_cache;
         struct pan_indirect_draw_shaders indirect_draw_shaders;
         struct pan_indirect_dispatch indirect_dispatch;
 
@@ -275,6 +371,33 @@ struct panfrost_device {
         struct kbase_ mali;
 
         FILE *bo_log;
+
+        /* Total size of the live BOs allocated with large page placement,
+         * whether or not they are currently in the BO cache */
+        int64_t large_page_size;
+
+        /* Memory of the BOs allocated by the driver per category, updated
+         * atomically. Allocating above the budget releases the BO cache and
+         * bumps pressure, which contexts check at the end of each frame to
+         * release the memory they keep for reuse. A zero budget disables
+         * this. */
+        struct {
+                int64_t size[PAN_MEM_CATEGORIES];
+                uint64_t budget;
+                uint32_t pressure;
+        } mem;
+
+        /* Software counters for the driver queries, updated atomically as
+         * BOs and shaders can be created from any thread */
+        struct {
+                uint64_t bo_allocs;
+                uint64_t bo_frees;
+                uint64_t bo_cache_hits;
+                uint64_t bo_cache_misses;
+                uint64_t shader_compiles;
+                uint64_t mem_evictions;
+                uint64_t mem_evicted;
+        } stats;
 };
 
 void
@@ -289,6 +412,10 @@ panfrost_check_dmabuf_fence(struct panfrost_device *dev);
 bool
 panfrost_supports_compressed_format(struct panfrost_device *dev, unsigned fmt);
 
+unsigned
+panfrost_compute_max_thread_count(const struct panfrost_device *dev,
+                                  unsigned work_reg_count);
+
 void
 panfrost_upload_sample_positions(struct panfrost_device *dev);
 
@@ -48,6 +48,24 @@ panfrost_choose_hierarchy_mask(
         unsigned width, unsigned height,
         unsigned vertex_count, bool hierarchy);
 
+#define PAN_TILER_HIERARCHY_LEVELS 8
+
+/* Level of the Bifrost and Valhall tiler hierarchy whose bins match
+ * primitives of the given area in pixels */
+static inline unsigned
+panfrost_hierarchy_level_for_area(unsigned area)
+{
+        unsigned side_log2 = util_logbase2(MAX2(area, 1)) / 2;
+
+        return MIN2(side_log2 > 4 ? side_log2 - 4 : 0,
+                    PAN_TILER_HIERARCHY_LEVELS - 1);
+}
+
+unsigned
+panfrost_choose_bifrost_hierarchy_mask(unsigned width, unsigned height,
+                                       unsigned first_level,
+                                       const uint32_t *level_prims);
+
 #if defined(PAN_ARCH) && PAN_ARCH <= 5
 static inline unsigned
 panfrost_tiler_get_polygon_list_size(const struct panfrost_device *dev,
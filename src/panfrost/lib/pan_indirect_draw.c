@@ -1124,7 +1124,8 @@ create_indirect_draw_shader(struct panfrost_device *dev,
         struct util_dynarray binary;
 
         util_dynarray_init(&binary, NULL);
-        GENX(pan_shader_compile)(b->shader, &inputs, &binary, &shader_info);
+        GENX(pan_shader_compile_cached)(dev, b->shader, &inputs, &binary,
+                                        &shader_info);
 
         assert(!shader_info.tls_size);
         assert(!shader_info.wls_size);
@@ -285,6 +285,42 @@ panfrost_texture_offset(const struct pan_image_layout *layout,
                (surface_idx * layout->slices[level].surface_stride);
 }
 
+/* Computes the byte range of a layer of a mip level covering a region given
+ * in blocks, relative to the start of the image. For u-interleaved images
+ * the region is expanded to whole tiles. AFBC is not handled. */
+
+void
+panfrost_get_region_range(const struct pan_image_layout *layout,
+                          unsigned level, unsigned layer,
+                          unsigned x, unsigned y,
+                          unsigned width, unsigned height,
+                          size_t *offset, size_t *size)
+{
+        const struct pan_image_slice_layout *slice = &layout->slices[level];
+        struct pan_block_size block_size =
+                panfrost_block_size(layout->modifier, layout->format);
+        unsigned tile_size = util_format_get_blocksize(layout->format) *
+                block_size.width * block_size.height;
+
+        assert(!drm_is_afbc(layout->modifier));
+        assert(width > 0 && height > 0);
+
+        unsigned x0 = x / block_size.width;
+        unsigned y0 = y / block_size.height;
+        unsigned x1 = DIV_ROUND_UP(x + width, block_size.width);
+        unsigned y1 = DIV_ROUND_UP(y + height, block_size.height);
+
+        size_t base = slice->offset +
+                (size_t) layer * panfrost_get_layer_stride(layout, level);
+        size_t start = base + (size_t) y0 * slice->row_stride +
+                (size_t) x0 * tile_size;
+        size_t end = base + (size_t) (y1 - 1) * slice->row_stride +
+                (size_t) x1 * tile_size;
+
+        *offset = start;
+        *size = end - start;
+}
+
 bool
 pan_image_layout_init(struct pan_image_layout *layout,
                       const struct pan_image_explicit_layout *explicit_layout)
@@ -31,6 +31,8 @@
 #include "util/macros.h"
 #include "util/hash_table.h"
 #include "util/u_thread.h"
+#include "util/u_debug.h"
+#include "util/os_misc.h"
 #include "drm-uapi/panfrost_drm.h"
 #include "dma-uapi/dma-buf.h"
 #include "pan_encoder.h"
@@ -188,40 +190,65 @@ panfrost_query_core_count(struct panfrost_device *dev, unsigned *core_id_range)
         return util_bitcount(mask);
 }
 
-/* Architectural maximums, since this register may be not implemented
- * by a given chip. G31 is actually 512 instead of 768 but it doesn't
- * really matter. */
+/* The thread registers may be not implemented by a given chip, so fall back
+ * on architectural maximums */
 
 static unsigned
-panfrost_max_thread_count(unsigned arch)
+panfrost_query_thread_tls_alloc(struct panfrost_device *dev, unsigned major)
+{
+        unsigned tls = panfrost_query_raw(dev,
+                        DRM_PANFROST_PARAM_THREAD_TLS_ALLOC, false, 0);
+
+        return (tls > 0) ? tls : pan_arch_max_thread_count(major);
+}
+
+static void
+panfrost_query_thread_limits(struct panfrost_device *dev)
 {
-        switch (arch) {
-        /* Midgard */
-        case 4:
-        case 5:
-                return 256;
-
-        /* Bifrost, first generation */
-        case 6:
-                return 384;
-
-        /* Bifrost, second generation (G31 is 512 but it doesn't matter) */
-        case 7:
-                return 768;
-
-        /* Valhall (for completeness) */
-        default:
-                return 1024;
+        unsigned max_threads = pan_arch_max_thread_count(dev->arch);
+
+        dev->max_threads_per_core =
+                panfrost_query_raw(dev, DRM_PANFROST_PARAM_MAX_THREADS,
+                                   false, max_threads);
+
+        dev->max_threads_per_wg =
+                panfrost_query_raw(dev, DRM_PANFROST_PARAM_THREAD_MAX_WORKGROUP_SZ,
+                                   false, max_threads);
+
+        if (!dev->max_threads_per_core)
+                dev->max_threads_per_core = max_threads;
+
+        if (!dev->max_threads_per_wg)
+                dev->max_threads_per_wg = max_threads;
+
+        /* The register file size is in the low bits of THREAD_FEATURES,
+         * which grew to 22 bits on Valhall. Otherwise assume the core runs
+         * all of its threads with 32 registers (4 on Midgard) each. */
+        unsigned features =
+                panfrost_query_raw(dev, DRM_PANFROST_PARAM_THREAD_FEATURES,
+                                   false, 0);
+
+        dev->registers_per_core = features &
+                (dev->arch >= 9 ? BITFIELD_MASK(22) : BITFIELD_MASK(16));
+
+        if (!dev->registers_per_core) {
+                dev->registers_per_core = dev->max_threads_per_core *
+                                          (dev->arch <= 5 ? 4 : 32);
         }
 }
 
-static unsigned
-panfrost_query_thread_tls_alloc(struct panfrost_device *dev, unsigned major)
+/* Number of threads of a compute shader that may run at once on a core */
+
+unsigned
+panfrost_compute_max_thread_count(const struct panfrost_device *dev,
+                                  unsigned work_reg_count)
 {
-        unsigned tls = panfrost_query_raw(dev,
-                        DRM_PANFROST_PARAM_THREAD_TLS_ALLOC, false, 0);
+        unsigned threads =
+                pan_max_threads_per_core(dev->arch, dev->max_threads_per_core,
+                                         dev->registers_per_core,
+                                         work_reg_count);
 
-        return (tls > 0) ? tls : panfrost_max_thread_count(major);
+        return MIN2(threads, dev->max_threads_per_wg);
 }
 
 static uint32_t
@@ -301,6 +328,12 @@ panfrost_open_device(void *memctx, int fd, struct panfrost_device *dev)
         if (kbase_open(&dev->mali, fd, 4, (dev->debug & PAN_DBG_LOG))) {
                 dev->kbase = true;
                 fd = -1;
+
+                /* Contexts sharing a queue group take fewer of the
+                 * firmware's CSG slots, at the cost of being scheduled,
+                 * and reset, together */
+                dev->mali.contexts_per_group =
+                        debug_get_num_option("PAN_SHARED_CSG", 1);
         }
 
         dev->fd = fd;
@@ -328,6 +361,7 @@ panfrost_open_device(void *memctx, int fd, struct panfrost_device *dev)
 
         dev->core_count = panfrost_query_core_count(dev, &dev->core_id_range);
         dev->thread_tls_alloc = panfrost_query_thread_tls_alloc(dev, dev->arch);
+        panfrost_query_thread_limits(dev);
         dev->optimal_tib_size = panfrost_query_optimal_tib_size(dev);
         dev->compressed_formats = panfrost_query_compressed_formats(dev);
         dev->tiler_features = panfrost_query_tiler_features(dev);
@@ -346,10 +380,29 @@ panfrost_open_device(void *memctx, int fd, struct panfrost_device *dev)
         pthread_mutex_init(&dev->bo_map_lock, NULL);
         pthread_mutex_init(&dev->bo_cache.lock, NULL);
         list_inithead(&dev->bo_cache.lru);
+        dev->bo_cache.max_size =
+                debug_get_num_option("PAN_BO_CACHE_MAX_SIZE",
+                                     PAN_BO_CACHE_DEFAULT_MAX_SIZE >> 20) << 20;
+
+        /* The GPU shares system memory, so the budget defaults to a part
+         * of it */
+        uint64_t phys = 0;
+        os_get_total_physical_memory(&phys);
+        dev->mem.budget =
+                debug_get_num_option("PAN_MEM_BUDGET",
+                                     (phys * PAN_MEM_BUDGET_DEFAULT_PERCENT / 100) >> 20) << 20;
+
+        /* Only kbase can map BOs cached */
+        dev->cached_pools = dev->kbase &&
+                debug_get_bool_option("PAN_CACHED_POOLS", false);
 
         for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_cache.buckets); ++i)
                 list_inithead(&dev->bo_cache.buckets[i]);
 
+        pthread_mutex_init(&dev->bo_slab.lock, NULL);
+        for (unsigned i = 0; i < ARRAY_SIZE(dev->bo_slab.partial); ++i)
+                list_inithead(&dev->bo_slab.partial[i]);
+
         /* Initialize pandecode before we start allocating */
         if (dev->debug & (PAN_DBG_TRACE | PAN_DBG_SYNC))
                 pandecode_initialize(!(dev->debug & PAN_DBG_TRACE));
@@ -358,9 +411,11 @@ panfrost_open_device(void *memctx, int fd, struct panfrost_device *dev)
          * active for a single job chain at once, so a single heap can be
          * shared across batches/contextes */
 
-        if (dev->arch < 10)
+        if (dev->arch < 10) {
                 dev->tiler_heap = panfrost_bo_create(dev, 128 * 1024 * 1024,
                                              PAN_BO_INVISIBLE | PAN_BO_GROWABLE, "Tiler heap");
+                panfrost_bo_set_category(dev->tiler_heap, PAN_MEM_HEAP);
+        }
 
         pthread_mutex_init(&dev->submit_lock, NULL);
 
@@ -380,6 +435,7 @@ panfrost_close_device(struct panfrost_device *dev)
                 panfrost_bo_unreference(dev->sample_positions);
                 panfrost_bo_cache_evict_all(dev);
                 pthread_mutex_destroy(&dev->bo_cache.lock);
+                pthread_mutex_destroy(&dev->bo_slab.lock);
                 pthread_mutex_destroy(&dev->bo_map_lock);
                 pthread_mutex_destroy(&dev->bo_usage_lock);
                 stable_array_fini(&dev->bo_map);
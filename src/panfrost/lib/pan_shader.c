@@ -22,6 +22,9 @@
  * SOFTWARE.
  */
 
+#include "compiler/nir/nir_serialize.h"
+#include "util/blob.h"
+#include "util/disk_cache.h"
 #include "pan_device.h"
 #include "pan_shader.h"
 #include "pan_format.h"
@@ -220,3 +223,104 @@ GENX(pan_shader_compile)(nir_shader *s,
         }
 #endif
 }
+
+/* Key an internal shader on its NIR and on everything in the compile inputs
+ * affecting code generation. The pointers in the inputs are either debug only
+ * or hashed by content. */
+static void
+pan_shader_cache_key(struct disk_cache *cache, const nir_shader *nir,
+                     const struct panfrost_compile_inputs *inputs,
+                     cache_key key)
+{
+        struct blob blob;
+        blob_init(&blob);
+
+        nir_serialize(&blob, nir, true);
+
+        blob_write_uint32(&blob, inputs->gpu_id);
+        blob_write_uint8(&blob, inputs->is_blend);
+        blob_write_uint8(&blob, inputs->is_blit);
+        blob_write_uint32(&blob, inputs->blend.rt);
+        blob_write_uint32(&blob, inputs->blend.nr_samples);
+        blob_write_uint64(&blob, inputs->blend.bifrost_blend_desc);
+        blob_write_uint32(&blob, inputs->fixed_sysval_ubo);
+        blob_write_uint8(&blob, inputs->no_idvs);
+        blob_write_uint8(&blob, inputs->no_ubo_to_push);
+        blob_write_bytes(&blob, inputs->rt_formats, sizeof(inputs->rt_formats));
+        blob_write_uint8(&blob, inputs->raw_fmt_mask);
+        blob_write_uint32(&blob, inputs->nr_cbufs);
+        blob_write_uint8(&blob, inputs->fp16_rt_mask);
+        blob_write_uint32(&blob, inputs->fixed_varying_mask);
+        blob_write_uint32(&blob, inputs->fp16_varying_mask);
+        blob_write_uint8(&blob, inputs->bifrost.static_rt_conv);
+        blob_write_bytes(&blob, inputs->bifrost.rt_conv, sizeof(inputs->bifrost.rt_conv));
+
+        if (inputs->fixed_sysval_layout) {
+                blob_write_bytes(&blob, inputs->fixed_sysval_layout,
+                                 sizeof(*inputs->fixed_sysval_layout));
+        }
+
+        disk_cache_compute_key(cache, blob.data, blob.size, key);
+        blob_finish(&blob);
+}
+
+/*
+ * Compile an internal (blit, blend, indirect draw or dispatch) shader, going
+ * through the device's disk cache if there is one. Internal shaders are built
+ * by every process, many of them on first use or at screen creation, so this
+ * takes their compile out of application startup.
+ */
+void
+GENX(pan_shader_compile_cached)(const struct panfrost_device *dev,
+                                nir_shader *s,
+                                struct panfrost_compile_inputs *inputs,
+                                struct util_dynarray *binary,
+                                struct pan_shader_info *info)
+{
+        struct disk_cache *cache = dev->disk_cache;
+
+        if (!cache) {
+                GENX(pan_shader_compile)(s, inputs, binary, info);
+                return;
+        }
+
+        cache_key key;
+        pan_shader_cache_key(cache, s, inputs, key);
+
+        unsigned offset = binary->size;
+        size_t size;
+        void *buffer = disk_cache_get(cache, key, &size);
+
+        if (buffer) {
+                struct blob_reader blob;
+                blob_reader_init(&blob, buffer, size);
+
+                uint32_t binary_size = blob_read_uint32(&blob);
+                void *ptr = util_dynarray_grow_bytes(binary, 1, binary_size);
+
+                blob_copy_bytes(&blob, ptr, binary_size);
+                blob_copy_bytes(&blob, info, sizeof(*info));
+
+                bool overrun = blob.overrun;
+                free(buffer);
+
+                if (!overrun)
+                        return;
+
+                /* Corrupt entry, compile instead */
+                binary->size = offset;
+        }
+
+        GENX(pan_shader_compile)(s, inputs, binary, info);
+
+        struct blob blob;
+        blob_init(&blob);
+
+        blob_write_uint32(&blob, binary->size - offset);
+        blob_write_bytes(&blob, (uint8_t *) binary->data + offset,
+                         binary->size - offset);
+        blob_write_bytes(&blob, info, sizeof(*info));
+
+        disk_cache_put(cache, key, blob.data, blob.size, NULL);
+        blob_finish(&blob);
+}
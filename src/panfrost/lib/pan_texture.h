@@ -213,6 +213,13 @@ panfrost_texture_offset(const struct pan_image_layout *layout,
                         unsigned level, unsigned array_idx,
                         unsigned surface_idx);
 
+void
+panfrost_get_region_range(const struct pan_image_layout *layout,
+                          unsigned level, unsigned layer,
+                          unsigned x, unsigned y,
+                          unsigned width, unsigned height,
+                          size_t *offset, size_t *size);
+
 struct pan_pool;
 struct pan_scoreboard;
 
@@ -372,3 +372,52 @@ panfrost_choose_hierarchy_mask(
 
         return 0xFF;
 }
+
+/* On Bifrost and Valhall, level i of the hierarchy bins primitives in squares
+ * of 16 << i pixels, and the tiler writes each primitive to the finest enabled
+ * level where it covers few bins. Fine levels only pay off for small
+ * primitives: when all primitives are large, they mostly cost tiler heap
+ * memory for their headers. Levels with bins larger than the framebuffer
+ * never help either.
+ *
+ * Given the number of primitives whose size matches each level, see
+ * panfrost_hierarchy_level_for_area, keep the levels from the finest one
+ * which a fair share of primitives need up to the first level whose bins
+ * cover the whole framebuffer. The sizes are estimated from above, so the
+ * level below the estimate is kept too. Returns 0 without enough samples to
+ * decide, leaving the default to the caller. */
+
+unsigned
+panfrost_choose_bifrost_hierarchy_mask(unsigned width, unsigned height,
+                                       unsigned first_level,
+                                       const uint32_t *level_prims)
+{
+        unsigned total = 0;
+
+        for (unsigned i = 0; i < PAN_TILER_HIERARCHY_LEVELS; ++i)
+                total += level_prims[i];
+
+        if (total < 64)
+                return 0;
+
+        unsigned top = first_level;
+
+        while (top < PAN_TILER_HIERARCHY_LEVELS - 1 &&
+               (16u << top) < MAX2(width, height))
+                top++;
+
+        /* Finest level needed by at least one in sixteen primitives */
+        unsigned fine = 0, seen = 0;
+
+        while (fine < top) {
+                seen += level_prims[fine];
+
+                if (seen >= total / 16)
+                        break;
+
+                fine++;
+        }
+
+        fine = CLAMP((int) fine - 1, (int) first_level, (int) top);
+        return BITFIELD_RANGE(fine, top - fine + 1);
+}
@@ -57,6 +57,10 @@
 #define PAN_DBG_UNCACHED_CPU  0x200000
 #define PAN_DBG_LOG           0x400000
 #define PAN_DBG_GOFASTER      0x800000
+#define PAN_DBG_ASYNC        0x1000000
+#define PAN_DBG_AFBC_PACK    0x2000000
+#define PAN_DBG_PROFILE      0x4000000
+#define PAN_DBG_FAST_COMPILE 0x8000000
 
 struct panfrost_device;
 
@@ -0,0 +1,320 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Image layout computation, the BO cache and descriptor packing. The BO
+ * cache is exercised on the no-op kbase device, so no GPU is needed. */
+
+#include <fcntl.h>
+
+#include "util/ralloc.h"
+
+#define PAN_ARCH 10
+#include "genxml/gen_macros.h"
+
+#include "pan_bench.h"
+#include "pan_bo.h"
+#include "pan_device.h"
+#include "pan_texture.h"
+
+struct layout_bench {
+        const char *name;
+        uint64_t modifier;
+        enum pipe_format format;
+        unsigned width, height, levels;
+};
+
+static int64_t
+bench_layout(void *data, unsigned ops)
+{
+        const struct layout_bench *b = data;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                struct pan_image_layout l = {
+                        .modifier = b->modifier,
+                        .format = b->format,
+                        .width = b->width,
+                        .height = b->height,
+                        .depth = 1,
+                        .nr_samples = 1,
+                        .dim = MALI_TEXTURE_DIMENSION_2D,
+                        .nr_slices = b->levels,
+                        .array_size = 1,
+                };
+
+                pan_image_layout_init(&l, NULL);
+                pan_bench_consume(l.data_size);
+        }
+
+        return 0;
+}
+
+static void
+run_layouts(void)
+{
+        const uint64_t afbc = DRM_FORMAT_MOD_ARM_AFBC(
+                AFBC_FORMAT_MOD_BLOCK_SIZE_16x16 | AFBC_FORMAT_MOD_SPARSE |
+                AFBC_FORMAT_MOD_YTR);
+        const uint64_t afbc_wide = DRM_FORMAT_MOD_ARM_AFBC(
+                AFBC_FORMAT_MOD_BLOCK_SIZE_32x8 | AFBC_FORMAT_MOD_SPARSE |
+                AFBC_FORMAT_MOD_YTR);
+
+        struct layout_bench benches[] = {
+                { "layout AFBC 16x16 1920x1080", afbc,
+                  PIPE_FORMAT_R8G8B8A8_UNORM, 1920, 1080, 1 },
+                { "layout AFBC 16x16 2048x2048 mipmapped", afbc,
+                  PIPE_FORMAT_R8G8B8A8_UNORM, 2048, 2048, 12 },
+                { "layout AFBC 32x8 1920x1080", afbc_wide,
+                  PIPE_FORMAT_R8G8B8A8_UNORM, 1920, 1080, 1 },
+                { "layout u-interleaved 2048x2048 mipmapped",
+                  DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED,
+                  PIPE_FORMAT_R8G8B8A8_UNORM, 2048, 2048, 12 },
+                { "layout linear 1920x1080", DRM_FORMAT_MOD_LINEAR,
+                  PIPE_FORMAT_R8G8B8A8_UNORM, 1920, 1080, 1 },
+        };
+
+        for (unsigned i = 0; i < ARRAY_SIZE(benches); ++i)
+                pan_bench_run(benches[i].name, bench_layout, &benches[i], 0);
+}
+
+struct bo_bench {
+        struct panfrost_device *dev;
+        const size_t *sizes;
+        unsigned nr_sizes;
+};
+
+/* Creating a BO of a size which was just freed is served from the cache */
+static int64_t
+bench_bo_cache(void *data, unsigned ops)
+{
+        struct bo_bench *b = data;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                size_t size = b->sizes[i % b->nr_sizes];
+                struct panfrost_bo *bo =
+                        panfrost_bo_create(b->dev, size, 0, "Benchmark");
+
+                panfrost_bo_unreference(bo);
+        }
+
+        return 0;
+}
+
+static void
+run_bo_cache(void *memctx)
+{
+        struct panfrost_device *dev = rzalloc(memctx, struct panfrost_device);
+
+        panfrost_open_device(memctx, -1, dev);
+
+        if (!dev->model) {
+                printf("BO cache: no-op device unavailable, skipping\n");
+                return;
+        }
+
+        static const size_t one[] = { 64 * 1024 };
+        static const size_t mixed[] = { 4096, 64 * 1024, 1024 * 1024, 16384 };
+
+        struct bo_bench single = { dev, one, ARRAY_SIZE(one) };
+        struct bo_bench several = { dev, mixed, ARRAY_SIZE(mixed) };
+
+        pan_bench_run("BO cache fetch/put 64K", bench_bo_cache, &single, 0);
+        pan_bench_run("BO cache fetch/put mixed sizes", bench_bo_cache,
+                      &several, 0);
+
+        panfrost_close_device(dev);
+}
+
+static int64_t
+bench_pack_sampler(void *data, unsigned ops)
+{
+        struct mali_sampler_packed *out = data;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                pan_pack(out, SAMPLER, cfg) {
+                        cfg.wrap_mode_s = MALI_WRAP_MODE_REPEAT;
+                        cfg.wrap_mode_t = MALI_WRAP_MODE_CLAMP_TO_EDGE;
+                        cfg.wrap_mode_r = MALI_WRAP_MODE_MIRRORED_REPEAT;
+                        cfg.magnify_nearest = i & 1;
+                        cfg.minify_nearest = i & 2;
+                        cfg.normalized_coordinates = true;
+                        cfg.maximum_lod = FIXED_16(12.0, false);
+                        cfg.border_color_r = i;
+                }
+
+                pan_bench_consume(out->opaque[0]);
+        }
+
+        return 0;
+}
+
+static int64_t
+bench_pack_attribute(void *data, unsigned ops)
+{
+        struct mali_attribute_packed *out = data;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                pan_pack(out, ATTRIBUTE, cfg) {
+                        cfg.buffer_index = i & 15;
+                        cfg.format = i << 10;
+                        cfg.offset = i * 16;
+                }
+
+                pan_bench_consume(out->opaque[0]);
+        }
+
+        return 0;
+}
+
+static int64_t
+bench_pack_buffer(void *data, unsigned ops)
+{
+        struct mali_buffer_packed *out = data;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                pan_pack(out, BUFFER, cfg) {
+                        cfg.address = 0x100000000ull + i * 256;
+                        cfg.size = 256;
+                }
+
+                pan_bench_consume(out->opaque[0]);
+        }
+
+        return 0;
+}
+
+static int64_t
+bench_pack_shader_program(void *data, unsigned ops)
+{
+        struct mali_shader_program_packed *out = data;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                pan_pack(out, SHADER_PROGRAM, cfg) {
+                        cfg.stage = MALI_SHADER_STAGE_FRAGMENT;
+                        cfg.primary_shader = true;
+                        cfg.register_allocation =
+                                MALI_SHADER_REGISTER_ALLOCATION_32_PER_THREAD;
+                        cfg.binary = 0x200000000ull + i * 128;
+                }
+
+                pan_bench_consume(out->opaque[0]);
+        }
+
+        return 0;
+}
+
+static void
+run_pack(void)
+{
+        union {
+                struct mali_sampler_packed sampler;
+                struct mali_attribute_packed attribute;
+                struct mali_buffer_packed buffer;
+                struct mali_shader_program_packed shader_program;
+        } out;
+
+        pan_bench_run("pack SAMPLER", bench_pack_sampler, &out, 0);
+        pan_bench_run("pack ATTRIBUTE", bench_pack_attribute, &out, 0);
+        pan_bench_run("pack BUFFER", bench_pack_buffer, &out, 0);
+        pan_bench_run("pack SHADER_PROGRAM", bench_pack_shader_program,
+                      &out, 0);
+}
+
+struct pool_bench {
+        struct panfrost_bo *bo;
+        unsigned count;
+};
+
+/* Fills a batch pool sized BO with sampler descriptors, as batches do with
+ * their descriptors. CPU-cached BOs have to be cleaned before submit. */
+static int64_t
+bench_pool_fill(void *data, unsigned ops)
+{
+        struct pool_bench *b = data;
+        struct mali_sampler_packed *out = b->bo->ptr.cpu;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                for (unsigned j = 0; j < b->count; ++j) {
+                        pan_pack(&out[j], SAMPLER, cfg) {
+                                cfg.wrap_mode_s = MALI_WRAP_MODE_REPEAT;
+                                cfg.magnify_nearest = j & 1;
+                                cfg.normalized_coordinates = true;
+                                cfg.border_color_r = i;
+                        }
+                }
+
+                panfrost_bo_mem_clean(b->bo, 0, b->count * sizeof(*out));
+        }
+
+        return 0;
+}
+
+static void
+run_pool_memory(void *memctx)
+{
+        int fd = open("/dev/mali0", O_RDWR | O_CLOEXEC);
+
+        if (fd < 0) {
+                printf("Pool memory: no kbase device, skipping\n");
+                return;
+        }
+
+        struct panfrost_device *dev = rzalloc(memctx, struct panfrost_device);
+        panfrost_open_device(memctx, fd, dev);
+
+        if (!dev->model) {
+                printf("Pool memory: unsupported device, skipping\n");
+                return;
+        }
+
+        const size_t size = 65536;
+        struct panfrost_bo *wc =
+                panfrost_bo_create(dev, size, 0, "Benchmark");
+        struct panfrost_bo *cached =
+                panfrost_bo_create(dev, size, PAN_BO_CACHEABLE, "Benchmark");
+
+        struct pool_bench b_wc = { wc, size / sizeof(struct mali_sampler_packed) };
+        struct pool_bench b_cached = { cached, b_wc.count };
+
+        pan_bench_run("pool fill 64K write-combined", bench_pool_fill,
+                      &b_wc, size);
+        pan_bench_run("pool fill 64K cached + clean", bench_pool_fill,
+                      &b_cached, size);
+
+        panfrost_bo_unreference(wc);
+        panfrost_bo_unreference(cached);
+        panfrost_close_device(dev);
+}
+
+int
+main(int argc, char **argv)
+{
+        void *memctx = ralloc_context(NULL);
+
+        run_layouts();
+        run_bo_cache(memctx);
+        run_pack();
+        run_pool_memory(memctx);
+
+        ralloc_free(memctx);
+        return 0;
+}
@@ -484,3 +484,77 @@ TEST(AFBCLayout, Tiled16x16Minimal)
    EXPECT_EQ(l.slices[0].surface_stride, 4096 + (32 * 8 * 8 * 8));
    EXPECT_EQ(l.slices[0].size, 4096 + (32 * 8 * 8 * 8));
 }
+
+TEST(RegionRange, Linear)
+{
+   struct pan_image_layout l = {
+      .modifier = DRM_FORMAT_MOD_LINEAR,
+      .format = PIPE_FORMAT_R8G8B8A8_UNORM,
+      .width = 256,
+      .height = 256,
+      .depth = 1,
+      .nr_samples = 1,
+      .dim = MALI_TEXTURE_DIMENSION_2D,
+      .nr_slices = 1
+   };
+
+   ASSERT_TRUE(pan_image_layout_init(&l, NULL));
+
+   size_t offset, size;
+   panfrost_get_region_range(&l, 0, 0, 16, 8, 32, 4, &offset, &size);
+
+   EXPECT_EQ(offset, (8 * 1024) + (16 * 4));
+   EXPECT_EQ(size, (3 * 1024) + (32 * 4));
+}
+
+TEST(RegionRange, LinearArrayLayer)
+{
+   struct pan_image_layout l = {
+      .modifier = DRM_FORMAT_MOD_LINEAR,
+      .format = PIPE_FORMAT_R8G8B8A8_UNORM,
+      .width = 64,
+      .height = 64,
+      .depth = 1,
+      .nr_samples = 1,
+      .dim = MALI_TEXTURE_DIMENSION_2D,
+      .nr_slices = 1,
+      .array_size = 4
+   };
+
+   ASSERT_TRUE(pan_image_layout_init(&l, NULL));
+
+   size_t offset, size;
+   panfrost_get_region_range(&l, 0, 2, 0, 0, 64, 64, &offset, &size);
+
+   EXPECT_EQ(offset, 2 * 16384);
+   EXPECT_EQ(size, 16384);
+}
+
+TEST(RegionRange, UInterleaved)
+{
+   struct pan_image_layout l = {
+      .modifier = DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED,
+      .format = PIPE_FORMAT_R8G8B8A8_UNORM,
+      .width = 4096,
+      .height = 4096,
+      .depth = 1,
+      .nr_samples = 1,
+      .dim = MALI_TEXTURE_DIMENSION_2D,
+      .nr_slices = 1
+   };
+
+   ASSERT_TRUE(pan_image_layout_init(&l, NULL));
+
+   /* 16x16 tiles of 1024 bytes, 256 tiles per row */
+   size_t offset, size;
+   panfrost_get_region_range(&l, 0, 0, 256, 256, 256, 256, &offset, &size);
+
+   EXPECT_EQ(offset, (16 * 262144) + (16 * 1024));
+   EXPECT_EQ(size, (15 * 262144) + (16 * 1024));
+
+   /* Unaligned regions are rounded out to whole tiles */
+   panfrost_get_region_range(&l, 0, 0, 8, 8, 1, 1, &offset, &size);
+
+   EXPECT_EQ(offset, 0);
+   EXPECT_EQ(size, 1024);
+}
@@ -203,6 +203,9 @@ typedef struct midgard_block {
 
         /* Are helper invocations required by this block? */
         bool helpers_in;
+
+        /* Number of loops the block is nested in */
+        unsigned loop_nesting;
 } midgard_block;
 
 typedef struct midgard_bundle {
@@ -256,6 +259,14 @@ typedef struct compiler_context {
         unsigned spills;
         unsigned fills;
 
+        /* Count of values promoted to pipeline registers for shaderdb */
+        unsigned pipelined;
+
+        /* Count of UBO loads promoted to uniforms and left as loads for
+         * shaderdb */
+        unsigned promoted_loads;
+        unsigned ubo_loads;
+
         /* Current NIR function */
         nir_function *func;
 
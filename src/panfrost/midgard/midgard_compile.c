@@ -88,6 +88,7 @@ schedule_barrier(compiler_context *ctx)
 {
         midgard_block *temp = ctx->after_block;
         ctx->after_block = create_empty_block(ctx);
+        ctx->after_block->loop_nesting = ctx->current_loop_depth;
         ctx->block_count++;
         list_addtail(&ctx->after_block->base.link, &ctx->blocks);
         list_inithead(&ctx->after_block->base.instructions);
@@ -2888,6 +2889,7 @@ emit_block_init(compiler_context *ctx)
         list_addtail(&this_block->base.link, &ctx->blocks);
 
         this_block->scheduled = false;
+        this_block->loop_nesting = ctx->current_loop_depth;
         ++ctx->block_count;
 
         /* Set up current block */
@@ -3361,16 +3363,29 @@ midgard_compile_shader_nir(nir_shader *nir,
         if ((midgard_debug & MIDGARD_DBG_SHADERDB || inputs->debug) &&
             !nir->info.internal) {
                 unsigned nr_bundles = 0, nr_ins = 0;
+                unsigned nr_alu_bundles = 0, nr_alu_ops = 0;
 
-                /* Count instructions and bundles */
+                /* Count instructions and bundles. The fill rate of ALU
+                 * bundles is the number of ALU ops over five times the
+                 * number of ALU bundles, counts are reported so that they
+                 * can be summed over a corpus. */
 
                 mir_foreach_block(ctx, _block) {
                         midgard_block *block = (midgard_block *) _block;
                         nr_bundles += util_dynarray_num_elements(
                                               &block->bundles, midgard_bundle);
 
-                        mir_foreach_bundle_in_block(block, bun)
+                        mir_foreach_bundle_in_block(block, bun) {
                                 nr_ins += bun->instruction_count;
+
+                                if (!mir_is_alu_bundle(bun))
+                                        continue;
+
+                                nr_alu_bundles++;
+
+                                for (unsigned i = 0; i < bun->instruction_count; ++i)
+                                        nr_alu_ops += !bun->instructions[i]->compact_branch;
+                        }
                 }
 
                 /* Calculate thread count. There are certain cutoffs by
@@ -3389,14 +3404,19 @@ midgard_compile_shader_nir(nir_shader *nir,
 
                 asprintf(&shaderdb, "%s shader: "
                         "%u inst, %u bundles, %u quadwords, "
+                        "%u alu bundles, %u alu ops, %u pipelined, "
                         "%u registers, %u threads, %u loops, "
-                        "%u:%u spills:fills",
+                        "%u:%u spills:fills, %u uniforms, "
+                        "%u:%u promoted:ubo loads",
                         ctx->inputs->is_blend ? "PAN_SHADER_BLEND" :
                         gl_shader_stage_name(ctx->stage),
                         nr_ins, nr_bundles, ctx->quadword_count,
+                        nr_alu_bundles, nr_alu_ops, ctx->pipelined,
                         nr_registers, nr_threads,
                         ctx->loop_count,
-                        ctx->spills, ctx->fills);
+                        ctx->spills, ctx->fills,
+                        info->push.count / 4,
+                        ctx->promoted_loads, ctx->ubo_loads);
 
                 if (midgard_debug & MIDGARD_DBG_SHADERDB)
                         fprintf(stderr, "SHADER-DB: %s\n", shaderdb);
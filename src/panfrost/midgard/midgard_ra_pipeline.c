@@ -136,9 +136,22 @@ mir_create_pipeline_registers(compiler_context *ctx)
                         if (!mir_is_alu_bundle(bundle)) continue;
                         if (bundle->instruction_count < 2) continue;
 
-                        /* Only first 2 instructions could pipeline */
-                        bool succ = mir_pipeline_ins(ctx, block, bundle, 0, 0);
-                        mir_pipeline_ins(ctx, block, bundle, 1, succ);
+                        /* Only the first stage (vmul/sadd) can write a
+                         * pipeline register. Bundles are ordered by unit, so
+                         * those come first, but either may be missing. */
+                        unsigned pipeline_count = 0;
+
+                        for (unsigned i = 0; i < bundle->instruction_count; ++i) {
+                                midgard_instruction *ins = bundle->instructions[i];
+
+                                if (ins->compact_branch || ins->unit >= UNIT_VADD)
+                                        break;
+
+                                if (mir_pipeline_ins(ctx, block, bundle, i, pipeline_count))
+                                        pipeline_count++;
+                        }
+
+                        ctx->pipelined += pipeline_count;
                 }
         }
 }
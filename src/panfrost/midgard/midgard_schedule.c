@@ -393,6 +393,12 @@ struct midgard_predicate {
          * hardware issue, unknown cause.
          */
         bool any_st_vary_a32, any_non_st_vary_a32;
+
+        /* For ALU: units of the bundle still to be filled after this one.
+         * Among equally good instructions, those which can't go in any of
+         * them are preferred, so flexible instructions are left for the
+         * later units instead of leaving them empty. */
+        unsigned units_left;
 };
 
 static bool
@@ -611,6 +617,24 @@ mir_has_unit(midgard_instruction *ins, unsigned unit)
         return false;
 }
 
+static bool
+mir_fits_units(midgard_instruction *ins, unsigned units)
+{
+        u_foreach_bit(i, units) {
+                unsigned unit = BITFIELD_BIT(i);
+
+                if (!mir_has_unit(ins, unit))
+                        continue;
+
+                if ((unit & UNITS_SCALAR) && !mir_is_scalar(ins))
+                        continue;
+
+                return true;
+        }
+
+        return false;
+}
+
 /* Net change in liveness if an instruction were scheduled. Loosely based on
  * ir3's scheduler. */
 
@@ -680,6 +704,7 @@ mir_choose_instruction(
         signed best_index = -1;
         signed best_effect = INT_MAX;
         bool best_conditional = false;
+        bool best_flexible = true;
 
         /* Enforce a simple metric limiting distance to keep down register
          * pressure. TOOD: replace with liveness tracking for much better
@@ -763,12 +788,21 @@ mir_choose_instruction(
                 if (effect > best_effect)
                         continue;
 
-                if (effect == best_effect && (signed) i < best_index)
-                        continue;
+                bool flexible = alu && !branch &&
+                        mir_fits_units(instructions[i], predicate->units_left);
+
+                if (effect == best_effect) {
+                        if (flexible && !best_flexible)
+                                continue;
+
+                        if (flexible == best_flexible && (signed) i < best_index)
+                                continue;
+                }
 
                 best_effect = effect;
                 best_index = i;
                 best_conditional = conditional;
+                best_flexible = flexible;
         }
 
         /* Did we find anything?  */
@@ -865,6 +899,9 @@ mir_choose_alu(midgard_instruction **slot,
                 struct midgard_predicate *predicate,
                 unsigned unit)
 {
+        /* Whatever happens, this unit is not left to fill anymore */
+        predicate->units_left &= ~unit;
+
         /* Did we already schedule to this slot? */
         if ((*slot) != NULL)
                 return;
@@ -1275,6 +1312,17 @@ mir_schedule_alu(
         if (writeout & PAN_WRITEOUT_S)
                 mir_schedule_zs_write(ctx, &predicate, instructions, liveness, worklist, len, branch, &smul, &vadd, &vlut, true);
 
+        /* Units filled by now are not left to fill */
+        predicate.units_left = UNITS_ALL;
+
+        midgard_instruction *filled[] = { vmul, sadd, vadd, smul, vlut };
+        unsigned filled_units[] = { UNIT_VMUL, UNIT_SADD, UNIT_VADD, UNIT_SMUL, UNIT_VLUT };
+
+        for (unsigned i = 0; i < ARRAY_SIZE(filled); ++i) {
+                if (filled[i])
+                        predicate.units_left &= ~filled_units[i];
+        }
+
         mir_choose_alu(&smul, instructions, liveness, worklist, len, &predicate, UNIT_SMUL);
 
         for (unsigned mode = 1; mode < 3; ++mode) {
@@ -33,7 +33,9 @@
  * registers available, requiring a balance.
  *
  * We use a heuristic to determine the ideal count, implemented by
- * mir_work_heuristic, which returns the ideal number of work registers.
+ * mir_work_heuristic, which returns the ideal number of work registers. The
+ * uniforms are then picked by the push planner shared with Bifrost, weighting
+ * loads by loop nesting.
  */
 
 static bool
@@ -59,6 +61,7 @@ mir_is_direct_aligned_ubo(midgard_instruction *ins)
 struct mir_ubo_block {
         BITSET_DECLARE(uses, MAX_UBO_QWORDS);
         BITSET_DECLARE(pushed, MAX_UBO_QWORDS);
+        uint32_t weight[MAX_UBO_QWORDS];
 };
 
 struct mir_ubo_analysis {
@@ -76,52 +79,64 @@ mir_analyze_ranges(compiler_context *ctx)
 
         res.blocks = calloc(res.nr_blocks, sizeof(struct mir_ubo_block));
 
-        mir_foreach_instr_global(ctx, ins) {
-                if (!mir_is_direct_aligned_ubo(ins)) continue;
+        mir_foreach_block(ctx, _block) {
+                midgard_block *block = (midgard_block *) _block;
 
-                unsigned ubo = midgard_unpack_ubo_index_imm(ins->load_store);
-                unsigned offset = ins->constants.u32[0] / 16;
+                mir_foreach_instr_in_block(block, ins) {
+                        if (!mir_is_direct_aligned_ubo(ins)) continue;
 
-                assert(ubo < res.nr_blocks);
+                        unsigned ubo = midgard_unpack_ubo_index_imm(ins->load_store);
+                        unsigned offset = ins->constants.u32[0] / 16;
+
+                        assert(ubo < res.nr_blocks);
+
+                        if (offset >= MAX_UBO_QWORDS) continue;
 
-                if (offset < MAX_UBO_QWORDS)
                         BITSET_SET(res.blocks[ubo].uses, offset);
+                        res.blocks[ubo].weight[offset] +=
+                                pan_ubo_load_weight(block->loop_nesting);
+                }
         }
 
         return res;
 }
 
-/* Select UBO words to push. A sophisticated implementation would consider the
- * number of uses and perhaps the control flow to estimate benefit. This is not
- * sophisticated. Select from the last UBO first to prioritize sysvals. */
+/* Select UBO words to push. Uniform registers are vec4, so each range is a
+ * whole aligned qword, which keeps the pushed words aligned to registers. */
 
 static void
 mir_pick_ubo(struct panfrost_ubo_push *push, struct mir_ubo_analysis *analysis, unsigned max_qwords)
 {
-        unsigned max_words = MIN2(PAN_MAX_PUSH, max_qwords * 4);
+        struct util_dynarray ranges;
+        util_dynarray_init(&ranges, NULL);
 
         for (signed ubo = analysis->nr_blocks - 1; ubo >= 0; --ubo) {
                 struct mir_ubo_block *block = &analysis->blocks[ubo];
 
                 unsigned vec4;
                 BITSET_FOREACH_SET(vec4, block->uses, MAX_UBO_QWORDS) {
-                        /* Don't push more than possible */
-                        if (push->count > max_words - 4)
-                                return;
-
-                        for (unsigned offs = 0; offs < 4; ++offs) {
-                                struct panfrost_ubo_word word = {
-                                        .ubo = ubo,
-                                        .offset = (vec4 * 16) + (offs * 4)
-                                };
+                        struct pan_ubo_range range = {
+                                .ubo = ubo,
+                                .word = vec4 * 4,
+                                .nr_words = 4,
+                                .weight = block->weight[vec4],
+                        };
+
+                        util_dynarray_append(&ranges, struct pan_ubo_range, range);
+                }
+        }
 
-                                push->words[push->count++] = word;
-                        }
+        pan_pick_ubo_ranges(push, ranges.data,
+                            util_dynarray_num_elements(&ranges, struct pan_ubo_range),
+                            max_qwords * 4);
 
-                        /* Mark it as pushed so we can rewrite */
-                        BITSET_SET(block->pushed, vec4);
-                }
+        /* Mark it as pushed so we can rewrite */
+        util_dynarray_foreach(&ranges, struct pan_ubo_range, r) {
+                if (r->pushed)
+                        BITSET_SET(analysis->blocks[r->ubo].pushed, r->word / 4);
         }
+
+        util_dynarray_fini(&ranges);
 }
 
 #if 0
@@ -222,8 +237,12 @@ mir_work_heuristic(compiler_context *ctx, struct mir_ubo_analysis *analysis)
          * failure to pack vector registers, load/store registers, texture
          * registers...), hence why this is a heuristic parameter */
 
-        if (pressure > 6)
-                return 16;
+        if (pressure > 6) {
+                /* A single thread runs either way, so only spilling matters.
+                 * Leave headroom over the estimate and give the rest of the
+                 * registers to uniforms, rather than all or nothing */
+                return MIN2(pressure + 4, 16);
+        }
 
         /* If there's no chance of spilling, prioritize UBOs and thread count */
 
@@ -297,6 +316,7 @@ midgard_promote_uniforms(compiler_context *ctx)
                         else
                                 ctx->ubo_mask = ~0;
 
+                        ctx->ubo_loads++;
                         continue;
                 }
 
@@ -304,9 +324,12 @@ midgard_promote_uniforms(compiler_context *ctx)
                 assert(ubo < analysis.nr_blocks);
                 if (!BITSET_TEST(analysis.blocks[ubo].pushed, qword)) {
                         ctx->ubo_mask |= BITSET_BIT(ubo);
+                        ctx->ubo_loads++;
                         continue;
                 }
 
+                ctx->promoted_loads++;
+
                 /* Find where we pushed to, TODO: unaligned pushes to pack */
                 unsigned base = pan_lookup_pushed_ubo(&ctx->info->push, ubo, qword * 16);
                 assert((base & 0x3) == 0);
@@ -23,13 +23,41 @@
 
 #include "pan_perf.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include <pan_perf_metrics.h>
 #include <lib/pan_device.h>
 #include <drm-uapi/panfrost_drm.h>
+#include <base/include/mali_kbase_ioctl.h>
 
 #define PAN_COUNTERS_PER_CATEGORY 64
 #define PAN_SHADER_CORE_INDEX 3
 
+// Hardware counter reader interface of kbase, from mali_kbase_hwcnt_reader.h.
+// Dumps are in the same layout of 64 counters per block as with Panfrost.
+#define KBASE_HWCNT_READER 0xBE
+
+struct kbase_hwcnt_reader_metadata {
+   uint64_t timestamp;
+   uint32_t event_id;
+   uint32_t buffer_idx;
+};
+
+#define KBASE_HWCNT_READER_GET_BUFFER_SIZE \
+   _IOR(KBASE_HWCNT_READER, 0x01, uint32_t)
+#define KBASE_HWCNT_READER_DUMP \
+   _IOW(KBASE_HWCNT_READER, 0x10, uint32_t)
+#define KBASE_HWCNT_READER_GET_BUFFER \
+   _IOR(KBASE_HWCNT_READER, 0x20, struct kbase_hwcnt_reader_metadata)
+#define KBASE_HWCNT_READER_PUT_BUFFER \
+   _IOW(KBASE_HWCNT_READER, 0x21, struct kbase_hwcnt_reader_metadata)
+
+#define PAN_KBASE_HWCNT_BUFFERS 4
+
 uint32_t
 panfrost_perf_counter_read(const struct panfrost_perf_counter *counter,
                            const struct panfrost_perf *perf)
@@ -65,6 +93,7 @@ void
 panfrost_perf_init(struct panfrost_perf *perf, struct panfrost_device *dev)
 {
    perf->dev = dev;
+   perf->kbase_reader_fd = -1;
 
    if (dev->model == NULL)
            unreachable("Invalid GPU ID");
@@ -88,6 +117,91 @@ panfrost_perf_init(struct panfrost_perf *perf, struct panfrost_device *dev)
    perf->category_offset[3] = PAN_COUNTERS_PER_CATEGORY * (2 + l2_slices);
 }
 
+static int
+panfrost_perf_kbase_enable(struct panfrost_perf *perf)
+{
+   struct kbase_ioctl_hwcnt_reader_setup setup = {
+      .buffer_count = PAN_KBASE_HWCNT_BUFFERS,
+      .fe_bm = ~0,
+      .shader_bm = ~0,
+      .tiler_bm = ~0,
+      .mmu_l2_bm = ~0,
+   };
+
+   int fd = ioctl(perf->dev->mali.fd, KBASE_IOCTL_HWCNT_READER_SETUP, &setup);
+   if (fd < 0)
+      return -errno;
+
+   uint32_t size = 0;
+   if (ioctl(fd, KBASE_HWCNT_READER_GET_BUFFER_SIZE, &size) < 0) {
+      int ret = -errno;
+      close(fd);
+      return ret;
+   }
+
+   void *buffers = mmap(NULL, size * PAN_KBASE_HWCNT_BUFFERS, PROT_READ,
+                        MAP_PRIVATE, fd, 0);
+   if (buffers == MAP_FAILED) {
+      int ret = -errno;
+      close(fd);
+      return ret;
+   }
+
+   perf->kbase_reader_fd = fd;
+   perf->kbase_buffers = buffers;
+   perf->kbase_buffer_size = size;
+   perf->kbase_buffer_count = PAN_KBASE_HWCNT_BUFFERS;
+   return 0;
+}
+
+static int
+panfrost_perf_kbase_disable(struct panfrost_perf *perf)
+{
+   if (perf->kbase_reader_fd < 0)
+      return 0;
+
+   munmap(perf->kbase_buffers,
+          perf->kbase_buffer_size * perf->kbase_buffer_count);
+   close(perf->kbase_reader_fd);
+
+   perf->kbase_reader_fd = -1;
+   perf->kbase_buffers = NULL;
+   return 0;
+}
+
+static int
+panfrost_perf_kbase_dump(struct panfrost_perf *perf)
+{
+   int fd = perf->kbase_reader_fd;
+   if (fd < 0)
+      return -EINVAL;
+
+   if (ioctl(fd, KBASE_HWCNT_READER_DUMP, 0) < 0)
+      return -errno;
+
+   // The dump is asynchronous, wait for its buffer to be filled
+   struct pollfd pfd = { .fd = fd, .events = POLLIN };
+   int ret = poll(&pfd, 1, 1000);
+   if (ret <= 0)
+      return ret < 0 ? -errno : -ETIMEDOUT;
+
+   struct kbase_hwcnt_reader_metadata meta = { 0 };
+   if (ioctl(fd, KBASE_HWCNT_READER_GET_BUFFER, &meta) < 0)
+      return -errno;
+
+   uint32_t size = MIN2(perf->kbase_buffer_size,
+                        perf->n_counter_values * sizeof(uint32_t));
+   memcpy(perf->counter_values,
+          (uint8_t *) perf->kbase_buffers +
+          (meta.buffer_idx % perf->kbase_buffer_count) * perf->kbase_buffer_size,
+          size);
+
+   if (ioctl(fd, KBASE_HWCNT_READER_PUT_BUFFER, &meta) < 0)
+      return -errno;
+
+   return 0;
+}
+
 static int
 panfrost_perf_query(struct panfrost_perf *perf, uint32_t enable)
 {
@@ -98,18 +212,27 @@ panfrost_perf_query(struct panfrost_perf *perf, uint32_t enable)
 int
 panfrost_perf_enable(struct panfrost_perf *perf)
 {
+   if (perf->dev->kbase)
+      return panfrost_perf_kbase_enable(perf);
+
    return panfrost_perf_query(perf, 1 /* enable */);
 }
 
 int
 panfrost_perf_disable(struct panfrost_perf *perf)
 {
+   if (perf->dev->kbase)
+      return panfrost_perf_kbase_disable(perf);
+
    return panfrost_perf_query(perf, 0 /* disable */);
 }
 
 int
 panfrost_perf_dump(struct panfrost_perf *perf)
 {
+   if (perf->dev->kbase)
+      return panfrost_perf_kbase_dump(perf);
+
    // Dump performance counter values to the memory buffer pointed to by counter_values
    struct drm_panfrost_perfcnt_dump perfcnt_dump = {(uint64_t)(uintptr_t)perf->counter_values};
    return drmIoctl(perf->dev->fd, DRM_IOCTL_PANFROST_PERFCNT_DUMP, &perfcnt_dump);
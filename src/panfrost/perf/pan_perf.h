@@ -91,6 +91,12 @@ struct panfrost_perf {
    uint32_t *counter_values;
    uint32_t n_counter_values;
 
+   // On kbase, the hardware counter reader and its ring of dump buffers
+   int kbase_reader_fd;
+   void *kbase_buffers;
+   uint32_t kbase_buffer_size;
+   uint32_t kbase_buffer_count;
+
    /* Offsets of categories */
    unsigned category_offset[PAN_PERF_MAX_CATEGORIES];
 };
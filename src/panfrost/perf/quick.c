@@ -1,9 +1,12 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <lib/pan_device.h>
 #include "pan_perf.h"
 
 int main(void) {
         int fd = drmOpenWithType("panfrost", NULL, DRM_NODE_RENDER);
+        if (fd < 0)
+                fd = open("/dev/mali0", O_RDWR | O_CLOEXEC | O_NONBLOCK);
 
         if (fd < 0) {
                 fprintf(stderr, "No panfrost device\n");
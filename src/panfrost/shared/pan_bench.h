@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef __PAN_BENCH_H__
+#define __PAN_BENCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util/os_time.h"
+#include "util/u_debug.h"
+
+/* Minimal harness for the microbenchmarks run by `meson test --benchmark`.
+ * A benchmark body runs a given number of operations. The count is doubled
+ * until a run takes at least PAN_BENCH_TIME_MS (default 100), and the time
+ * per operation of that run is reported.
+ *
+ * Bodies which need untimed setup for each operation return the time spent
+ * in the measured part, others return zero to have the whole call timed. */
+
+typedef int64_t (*pan_bench_fn)(void *data, unsigned ops);
+
+/* Results are added to this, so benchmarks aren't optimised away */
+static volatile uint64_t pan_bench_sink;
+
+static inline void
+pan_bench_consume(uint64_t value)
+{
+        pan_bench_sink += value;
+}
+
+/* bytes is the amount of data an operation processes, for reporting
+ * throughput, or zero */
+static inline double
+pan_bench_run(const char *name, pan_bench_fn fn, void *data, uint64_t bytes)
+{
+        int64_t min_ns = debug_get_num_option("PAN_BENCH_TIME_MS", 100) * 1000000;
+        unsigned ops = 1;
+        int64_t ns;
+
+        /* Warm up caches and lazily initialised state */
+        fn(data, 1);
+
+        for (;;) {
+                int64_t start = os_time_get_nano();
+                int64_t measured = fn(data, ops);
+                ns = measured ? measured : os_time_get_nano() - start;
+
+                if (ns >= min_ns || ops >= (1u << 30))
+                        break;
+
+                ops *= 2;
+        }
+
+        double ns_per_op = (double)ns / ops;
+
+        if (bytes) {
+                printf("%-48s %12.1f ns/op %10.1f MB/s\n", name, ns_per_op,
+                       (bytes * 1000.0) / ns_per_op);
+        } else {
+                printf("%-48s %12.1f ns/op\n", name, ns_per_op);
+        }
+
+        fflush(stdout);
+        return ns_per_op;
+}
+
+#endif
@@ -27,97 +27,197 @@
 /* Index buffer min/max cache. We need to calculate the min/max for arbitrary
  * slices (start, start + count) of the index buffer at drawtime. As this can
  * be quite expensive, we cache. Conceptually, we just use a hash table mapping
- * the key (start, count) to the value (min, max). In practice, mesa's hash
+ * the key (range, restart) to the value (min, max). In practice, mesa's hash
  * table implementation is higher overhead than we would like and makes
- * handling memory usage a little complicated. So we use this data structure
- * instead. Searching is O(n) to the size, but the size is capped at the
- * PANFROST_MINMAX_SIZE constant (so this is a tradeoff between cache hit/miss
- * ratio and cache search speed). Note that keys are adjacent so we get cache
- * line alignment benefits. Insertion is O(1) and in-order until the cache
- * fills up, after that it evicts the oldest cached value in a ring facilitated
- * by index.
+ * handling memory usage a little complicated. So we use a small set
+ * associative cache instead: the key hashes to a set of a few adjacent
+ * entries, which are searched linearly and replaced round robin once full.
+ *
+ * Ranges are kept in bytes, so writes to the buffer can invalidate just the
+ * entries they overlap whatever the index size of the draws.
  */
 
+#include <string.h>
 #include "pan_minmax_cache.h"
 
-bool
-panfrost_minmax_cache_get(struct panfrost_minmax_cache *cache, unsigned start, unsigned count,
-                     unsigned *min_index, unsigned *max_index)
+static struct panfrost_minmax_key
+panfrost_minmax_key(unsigned index_size, unsigned start, unsigned count,
+                    bool restart, unsigned restart_index)
 {
-        uint64_t ht_key = (((uint64_t)count) << 32) | start;
-        bool found = false;
+        return (struct panfrost_minmax_key) {
+                .offset = start * index_size,
+                .size = count * index_size,
+                .restart_index = restart ? restart_index : 0,
+                .index_size = index_size,
+                .restart = restart,
+        };
+}
 
-        if (!cache)
-           return false;
+static bool
+panfrost_minmax_key_equal(const struct panfrost_minmax_key *a,
+                          const struct panfrost_minmax_key *b)
+{
+        return a->offset == b->offset && a->size == b->size &&
+               a->restart_index == b->restart_index &&
+               a->index_size == b->index_size && a->restart == b->restart;
+}
 
-        for (unsigned i = 0; i < cache->size; ++i) {
-                if (cache->keys[i] == ht_key) {
-                        uint64_t hit = cache->values[i];
+static struct panfrost_minmax_entry *
+panfrost_minmax_set(struct panfrost_minmax_cache *cache,
+                    const struct panfrost_minmax_key *key, unsigned *set)
+{
+        /* Draws usually start on nicely aligned offsets, so mix the bits
+         * down before taking the set */
+        uint32_t hash = (key->offset * 0x9e3779b1) ^ (key->size * 0x85ebca6b) ^
+                        key->restart_index ^ (key->index_size << 1) ^ key->restart;
+
+        hash ^= hash >> 16;
+        *set = hash % PANFROST_MINMAX_SETS;
+        return cache->entries[*set];
+}
 
-                        *min_index = hit & 0xffffffff;
-                        *max_index = hit >> 32;
-                        found = true;
-                        break;
+bool
+panfrost_minmax_cache_get(struct panfrost_minmax_cache *cache,
+                          unsigned index_size, unsigned start, unsigned count,
+                          bool restart, unsigned restart_index,
+                          unsigned *min_index, unsigned *max_index)
+{
+        if (!cache || !cache->size)
+                return false;
+
+        struct panfrost_minmax_key key =
+                panfrost_minmax_key(index_size, start, count, restart,
+                                    restart_index);
+        unsigned set;
+        struct panfrost_minmax_entry *entries =
+                panfrost_minmax_set(cache, &key, &set);
+
+        for (unsigned i = 0; i < PANFROST_MINMAX_WAYS; ++i) {
+                if (entries[i].valid &&
+                    panfrost_minmax_key_equal(&entries[i].key, &key)) {
+                        *min_index = entries[i].min_index;
+                        *max_index = entries[i].max_index;
+                        return true;
                 }
         }
 
-        return found;
+        return false;
 }
 
 void
-panfrost_minmax_cache_add(struct panfrost_minmax_cache *cache, unsigned start, unsigned count,
-                     unsigned min_index, unsigned max_index)
+panfrost_minmax_cache_add(struct panfrost_minmax_cache *cache,
+                          unsigned index_size, unsigned start, unsigned count,
+                          bool restart, unsigned restart_index,
+                          unsigned min_index, unsigned max_index)
 {
-        uint64_t ht_key = (((uint64_t)count) << 32) | start;
-        uint64_t value = min_index | (((uint64_t)max_index) << 32);
-        unsigned index = 0;
-
         if (!cache)
                 return;
 
-        if (cache->size == PANFROST_MINMAX_SIZE) {
-                index = cache->index++;
-                cache->index = cache->index % PANFROST_MINMAX_SIZE;
+        struct panfrost_minmax_key key =
+                panfrost_minmax_key(index_size, start, count, restart,
+                                    restart_index);
+        unsigned set;
+        struct panfrost_minmax_entry *entries =
+                panfrost_minmax_set(cache, &key, &set);
+        struct panfrost_minmax_entry *entry = NULL;
+
+        /* Prefer a free way, otherwise evict the oldest */
+        for (unsigned i = 0; i < PANFROST_MINMAX_WAYS; ++i) {
+                if (!entries[i].valid) {
+                        entry = &entries[i];
+                        break;
+                }
+        }
+
+        if (!entry) {
+                entry = &entries[cache->victim[set]];
+                cache->victim[set] = (cache->victim[set] + 1) % PANFROST_MINMAX_WAYS;
         } else {
-                index = cache->size++;
+                cache->size++;
         }
 
-        cache->keys[index] =  ht_key;
-        cache->values[index] = value;
+        if (cache->start == cache->end) {
+                cache->start = key.offset;
+                cache->end = key.offset + key.size;
+        } else {
+                cache->start = MIN2(cache->start, key.offset);
+                cache->end = MAX2(cache->end, key.offset + key.size);
+        }
 
+        *entry = (struct panfrost_minmax_entry) {
+                .key = key,
+                .min_index = min_index,
+                .max_index = max_index,
+                .valid = true,
+        };
 }
 
-/* If we've been caching min/max indices and we update the index
- * buffer, that may invalidate the min/max. Check what's been cached vs
- * what we've written, and throw out invalid entries. */
+/* Throw out the cached entries overlapping a written byte range of the index
+ * buffer, keeping the rest */
 
 void
-panfrost_minmax_cache_invalidate(struct panfrost_minmax_cache *cache, struct pipe_transfer *transfer)
+panfrost_minmax_cache_invalidate_range(struct panfrost_minmax_cache *cache,
+                                       unsigned offset, unsigned size)
 {
-        /* Ensure there is a cache to invalidate and a write */
-        if (!cache)
+        if (!cache || !cache->size)
                 return;
 
-        if (!(transfer->usage & PIPE_MAP_WRITE))
+        /* 1D range intersection */
+        if (MAX2(offset, cache->start) >= MIN2(offset + size, cache->end))
                 return;
 
-        unsigned valid_count = 0;
+        unsigned start = ~0, end = 0;
+
+        for (unsigned s = 0; s < PANFROST_MINMAX_SETS; ++s) {
+                for (unsigned i = 0; i < PANFROST_MINMAX_WAYS; ++i) {
+                        struct panfrost_minmax_entry *entry = &cache->entries[s][i];
 
-        for (unsigned i = 0; i < cache->size; ++i) {
-                uint64_t key = cache->keys[i];
+                        if (!entry->valid)
+                                continue;
 
-                uint32_t start = key & 0xffffffff;
-                uint32_t count = key >> 32;
+                        uint32_t e_start = entry->key.offset;
+                        uint32_t e_end = e_start + entry->key.size;
 
-                /* 1D range intersection */
-                bool invalid = MAX2(transfer->box.x, start) < MIN2(transfer->box.x + transfer->box.width, start + count);
-                if (!invalid) {
-                        cache->keys[valid_count] = key;
-                        cache->values[valid_count] = cache->values[i];
-                        valid_count++;
+                        if (MAX2(offset, e_start) < MIN2(offset + size, e_end)) {
+                                entry->valid = false;
+                                cache->size--;
+                        } else {
+                                start = MIN2(start, e_start);
+                                end = MAX2(end, e_end);
+                        }
                 }
         }
 
-        cache->size = valid_count;
-        cache->index = 0;
+        if (cache->size) {
+                cache->start = start;
+                cache->end = end;
+        } else {
+                cache->start = cache->end = 0;
+        }
+}
+
+/* If we've been caching min/max indices and we update the index
+ * buffer, that may invalidate the min/max. Check what's been cached vs
+ * what we've written, and throw out invalid entries. */
+
+void
+panfrost_minmax_cache_invalidate(struct panfrost_minmax_cache *cache, struct pipe_transfer *transfer)
+{
+        /* Ensure there is a write */
+        if (!(transfer->usage & PIPE_MAP_WRITE))
+                return;
+
+        panfrost_minmax_cache_invalidate_range(cache, transfer->box.x,
+                                               transfer->box.width);
+}
+
+/* Writes from the GPU can land anywhere in the buffer */
+
+void
+panfrost_minmax_cache_clear(struct panfrost_minmax_cache *cache)
+{
+        if (!cache || !cache->size)
+                return;
+
+        memset(cache, 0, sizeof(*cache));
 }
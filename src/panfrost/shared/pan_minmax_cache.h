@@ -29,24 +29,68 @@
 
 #include "util/u_transfer.h"
 
-#define PANFROST_MINMAX_SIZE 64
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sets of PANFROST_MINMAX_WAYS entries, PANFROST_MINMAX_SIZE in total */
+#define PANFROST_MINMAX_SETS 64
+#define PANFROST_MINMAX_WAYS 4
+#define PANFROST_MINMAX_SIZE (PANFROST_MINMAX_SETS * PANFROST_MINMAX_WAYS)
+
+struct panfrost_minmax_key {
+        /* Byte range of the index buffer covered */
+        uint32_t offset;
+        uint32_t size;
+
+        /* Index skipped by the search if restart is set, zero otherwise */
+        uint32_t restart_index;
+        uint8_t index_size;
+        bool restart;
+};
+
+struct panfrost_minmax_entry {
+        struct panfrost_minmax_key key;
+        unsigned min_index, max_index;
+        bool valid;
+};
 
 struct panfrost_minmax_cache {
-        uint64_t keys[PANFROST_MINMAX_SIZE];
-        uint64_t values[PANFROST_MINMAX_SIZE];
+        struct panfrost_minmax_entry entries[PANFROST_MINMAX_SETS][PANFROST_MINMAX_WAYS];
+
+        /* Next way to replace in each set */
+        uint8_t victim[PANFROST_MINMAX_SETS];
+
+        /* Number of valid entries, and the union of their byte ranges, to
+         * make invalidations that can't hit anything cheap */
         unsigned size;
-        unsigned index;
+        uint32_t start, end;
 };
 
 bool
-panfrost_minmax_cache_get(struct panfrost_minmax_cache *cache, unsigned start, unsigned count,
-                     unsigned *min_index, unsigned *max_index);
+panfrost_minmax_cache_get(struct panfrost_minmax_cache *cache,
+                          unsigned index_size, unsigned start, unsigned count,
+                          bool restart, unsigned restart_index,
+                          unsigned *min_index, unsigned *max_index);
+
+void
+panfrost_minmax_cache_add(struct panfrost_minmax_cache *cache,
+                          unsigned index_size, unsigned start, unsigned count,
+                          bool restart, unsigned restart_index,
+                          unsigned min_index, unsigned max_index);
 
 void
-panfrost_minmax_cache_add(struct panfrost_minmax_cache *cache, unsigned start, unsigned count,
-                     unsigned min_index, unsigned max_index);
+panfrost_minmax_cache_invalidate_range(struct panfrost_minmax_cache *cache,
+                                       unsigned offset, unsigned size);
 
 void
 panfrost_minmax_cache_invalidate(struct panfrost_minmax_cache *cache, struct pipe_transfer *transfer);
 
+void
+panfrost_minmax_cache_clear(struct panfrost_minmax_cache *cache);
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
 #endif
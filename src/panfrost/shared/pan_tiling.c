@@ -362,6 +362,12 @@ panfrost_access_tiled_image(void *dst, void *src,
       w -= dist;
    }
 
+#if PAN_TILING_NEON
+   if (panfrost_access_tiled_image_neon(dst, OFFSET(src, x, y), x, y, w, h,
+                                        dst_stride, src_stride, bpp, is_store))
+      return;
+#endif
+
    if (bpp == 8)
       panfrost_access_tiled_image_uint8_t(dst,  OFFSET(src, x, y), x, y, w, h, dst_stride, src_stride, is_store);
    else if (bpp == 16)
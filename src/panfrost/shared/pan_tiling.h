@@ -27,9 +27,17 @@
 #ifndef H_PANFROST_TILING
 #define H_PANFROST_TILING
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <util/detect_arch.h>
 #include <util/format/u_format.h>
 
+#if (DETECT_ARCH_AARCH64 || DETECT_ARCH_ARM) && !defined(__SOFTFP__)
+#define PAN_TILING_NEON 1
+#else
+#define PAN_TILING_NEON 0
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -74,6 +82,22 @@ void panfrost_store_tiled_image(void *dst, const void *src,
                                 uint32_t src_stride,
                                 enum pipe_format format);
 
+#if PAN_TILING_NEON
+/**
+ * NEON implementation of the tiling kernels for 8, 16, 32, 64 and 128-bit
+ * blocks, used by the above for regions aligned to whole tiles. Returns false
+ * if NEON can't be used, in which case nothing is accessed. Arguments are as
+ * for the internal C kernels: dst is the tiled image, src points to the
+ * (x, y) corner of the linear image, even for loads.
+ */
+bool panfrost_access_tiled_image_neon(void *dst, void *src,
+                                      unsigned x, unsigned y,
+                                      unsigned w, unsigned h,
+                                      uint32_t dst_stride,
+                                      uint32_t src_stride,
+                                      unsigned bpp,
+                                      bool is_store);
+#endif
 
 #ifdef __cplusplus
 } /* extern C */
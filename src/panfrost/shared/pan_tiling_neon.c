@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "pan_tiling.h"
+
+#if PAN_TILING_NEON
+
+/* armhf builds default to vfp, not neon, and refuses to compile neon intrinsics
+ * unless you tell it "no really".
+ */
+#if DETECT_ARCH_ARM
+#pragma GCC target ("fpu=neon")
+#endif
+
+#include <arm_neon.h>
+#include <assert.h>
+#include <stdbool.h>
+#include "util/macros.h"
+#include "util/u_cpu_detect.h"
+
+/*
+ * NEON versions of the aligned u-interleaved kernels in pan_tiling.c.
+ *
+ * Within a 16x16 tile, the two lowest bits of the index are (x0 ^ y0) and y0,
+ * so each 2x2 quad of pixels is stored contiguously, with the pixels of the
+ * odd row swapped:
+ *
+ *    (0, 0) (1, 0) (1, 1) (0, 1)
+ *
+ * The kernels handle two rows at a time. For each pair of pixels in the even
+ * row, the matching pair of the odd row is reversed and appended, giving one
+ * quad. The remaining index bits place the quad in the tile: the x bits are
+ * constant per quad (quad_x), the y bits constant per pair of rows (quad_y).
+ */
+
+/* Quad index for the bits x1..x3 of the x coordinate, for even x */
+static const uint8_t quad_x[8] = {
+   0x00, 0x01, 0x04, 0x05, 0x10, 0x11, 0x14, 0x15
+};
+
+/* Quad index for the bits y1..y3 of the y coordinate, for even y */
+static const uint8_t quad_y[8] = {
+   0x00, 0x03, 0x0C, 0x0F, 0x30, 0x33, 0x3C, 0x3F
+};
+
+#define QUAD(tile, qy, p, shift) \
+   ((tile) + (((unsigned) ((qy) ^ quad_x[p]) * 4) << (shift)))
+
+static ALWAYS_INLINE void
+store_quads_8(uint8_t *tile, unsigned qy, const uint8_t *r0, const uint8_t *r1)
+{
+   uint8x16_t a = vld1q_u8(r0);
+   uint8x16_t b = vrev16q_u8(vld1q_u8(r1));
+   uint16x8x2_t q = vzipq_u16(vreinterpretq_u16_u8(a),
+                              vreinterpretq_u16_u8(b));
+   uint32x4_t lo = vreinterpretq_u32_u16(q.val[0]);
+   uint32x4_t hi = vreinterpretq_u32_u16(q.val[1]);
+
+   vst1q_lane_u32((uint32_t *) QUAD(tile, qy, 0, 0), lo, 0);
+   vst1q_lane_u32((uint32_t *) QUAD(tile, qy, 1, 0), lo, 1);
+   vst1q_lane_u32((uint32_t *) QUAD(tile, qy, 2, 0), lo, 2);
+   vst1q_lane_u32((uint32_t *) QUAD(tile, qy, 3, 0), lo, 3);
+   vst1q_lane_u32((uint32_t *) QUAD(tile, qy, 4, 0), hi, 0);
+   vst1q_lane_u32((uint32_t *) QUAD(tile, qy, 5, 0), hi, 1);
+   vst1q_lane_u32((uint32_t *) QUAD(tile, qy, 6, 0), hi, 2);
+   vst1q_lane_u32((uint32_t *) QUAD(tile, qy, 7, 0), hi, 3);
+}
+
+static ALWAYS_INLINE void
+load_quads_8(const uint8_t *tile, unsigned qy, uint8_t *r0, uint8_t *r1)
+{
+   uint32x4_t lo = vdupq_n_u32(0), hi = vdupq_n_u32(0);
+
+   lo = vld1q_lane_u32((const uint32_t *) QUAD(tile, qy, 0, 0), lo, 0);
+   lo = vld1q_lane_u32((const uint32_t *) QUAD(tile, qy, 1, 0), lo, 1);
+   lo = vld1q_lane_u32((const uint32_t *) QUAD(tile, qy, 2, 0), lo, 2);
+   lo = vld1q_lane_u32((const uint32_t *) QUAD(tile, qy, 3, 0), lo, 3);
+   hi = vld1q_lane_u32((const uint32_t *) QUAD(tile, qy, 4, 0), hi, 0);
+   hi = vld1q_lane_u32((const uint32_t *) QUAD(tile, qy, 5, 0), hi, 1);
+   hi = vld1q_lane_u32((const uint32_t *) QUAD(tile, qy, 6, 0), hi, 2);
+   hi = vld1q_lane_u32((const uint32_t *) QUAD(tile, qy, 7, 0), hi, 3);
+
+   uint16x8x2_t q = vuzpq_u16(vreinterpretq_u16_u32(lo),
+                              vreinterpretq_u16_u32(hi));
+
+   vst1q_u8(r0, vreinterpretq_u8_u16(q.val[0]));
+   vst1q_u8(r1, vrev16q_u8(vreinterpretq_u8_u16(q.val[1])));
+}
+
+static ALWAYS_INLINE void
+store_quads_16(uint8_t *tile, unsigned qy, const uint8_t *r0, const uint8_t *r1)
+{
+   for (unsigned k = 0; k < 2; ++k) {
+      uint16x8_t a = vld1q_u16((const uint16_t *) r0 + (k * 8));
+      uint16x8_t b = vrev32q_u16(vld1q_u16((const uint16_t *) r1 + (k * 8)));
+      uint32x4x2_t q = vzipq_u32(vreinterpretq_u32_u16(a),
+                                 vreinterpretq_u32_u16(b));
+
+      vst1_u32((uint32_t *) QUAD(tile, qy, 4 * k + 0, 1), vget_low_u32(q.val[0]));
+      vst1_u32((uint32_t *) QUAD(tile, qy, 4 * k + 1, 1), vget_high_u32(q.val[0]));
+      vst1_u32((uint32_t *) QUAD(tile, qy, 4 * k + 2, 1), vget_low_u32(q.val[1]));
+      vst1_u32((uint32_t *) QUAD(tile, qy, 4 * k + 3, 1), vget_high_u32(q.val[1]));
+   }
+}
+
+static ALWAYS_INLINE void
+load_quads_16(const uint8_t *tile, unsigned qy, uint8_t *r0, uint8_t *r1)
+{
+   for (unsigned k = 0; k < 2; ++k) {
+      uint32x4_t lo =
+         vcombine_u32(vld1_u32((const uint32_t *) QUAD(tile, qy, 4 * k + 0, 1)),
+                      vld1_u32((const uint32_t *) QUAD(tile, qy, 4 * k + 1, 1)));
+      uint32x4_t hi =
+         vcombine_u32(vld1_u32((const uint32_t *) QUAD(tile, qy, 4 * k + 2, 1)),
+                      vld1_u32((const uint32_t *) QUAD(tile, qy, 4 * k + 3, 1)));
+      uint32x4x2_t q = vuzpq_u32(lo, hi);
+
+      vst1q_u16((uint16_t *) r0 + (k * 8), vreinterpretq_u16_u32(q.val[0]));
+      vst1q_u16((uint16_t *) r1 + (k * 8),
+                vrev32q_u16(vreinterpretq_u16_u32(q.val[1])));
+   }
+}
+
+static ALWAYS_INLINE void
+store_quads_32(uint8_t *tile, unsigned qy, const uint8_t *r0, const uint8_t *r1)
+{
+   for (unsigned k = 0; k < 4; ++k) {
+      uint32x4_t a = vld1q_u32((const uint32_t *) r0 + (k * 4));
+      uint32x4_t b = vrev64q_u32(vld1q_u32((const uint32_t *) r1 + (k * 4)));
+
+      vst1q_u32((uint32_t *) QUAD(tile, qy, 2 * k + 0, 2),
+                vcombine_u32(vget_low_u32(a), vget_low_u32(b)));
+      vst1q_u32((uint32_t *) QUAD(tile, qy, 2 * k + 1, 2),
+                vcombine_u32(vget_high_u32(a), vget_high_u32(b)));
+   }
+}
+
+static ALWAYS_INLINE void
+load_quads_32(const uint8_t *tile, unsigned qy, uint8_t *r0, uint8_t *r1)
+{
+   for (unsigned k = 0; k < 4; ++k) {
+      uint32x4_t qa = vld1q_u32((const uint32_t *) QUAD(tile, qy, 2 * k + 0, 2));
+      uint32x4_t qb = vld1q_u32((const uint32_t *) QUAD(tile, qy, 2 * k + 1, 2));
+
+      vst1q_u32((uint32_t *) r0 + (k * 4),
+                vcombine_u32(vget_low_u32(qa), vget_low_u32(qb)));
+      vst1q_u32((uint32_t *) r1 + (k * 4),
+                vrev64q_u32(vcombine_u32(vget_high_u32(qa), vget_high_u32(qb))));
+   }
+}
+
+static ALWAYS_INLINE void
+store_quads_64(uint8_t *tile, unsigned qy, const uint8_t *r0, const uint8_t *r1)
+{
+   for (unsigned p = 0; p < 8; ++p) {
+      uint64x2_t a = vld1q_u64((const uint64_t *) r0 + (p * 2));
+      uint64x2_t b = vld1q_u64((const uint64_t *) r1 + (p * 2));
+      uint64_t *quad = (uint64_t *) QUAD(tile, qy, p, 3);
+
+      vst1q_u64(quad + 0, a);
+      vst1q_u64(quad + 2, vextq_u64(b, b, 1));
+   }
+}
+
+static ALWAYS_INLINE void
+load_quads_64(const uint8_t *tile, unsigned qy, uint8_t *r0, uint8_t *r1)
+{
+   for (unsigned p = 0; p < 8; ++p) {
+      const uint64_t *quad = (const uint64_t *) QUAD(tile, qy, p, 3);
+      uint64x2_t a = vld1q_u64(quad + 0);
+      uint64x2_t b = vld1q_u64(quad + 2);
+
+      vst1q_u64((uint64_t *) r0 + (p * 2), a);
+      vst1q_u64((uint64_t *) r1 + (p * 2), vextq_u64(b, b, 1));
+   }
+}
+
+static ALWAYS_INLINE void
+store_quads_128(uint8_t *tile, unsigned qy, const uint8_t *r0, const uint8_t *r1)
+{
+   for (unsigned p = 0; p < 8; ++p) {
+      uint8_t *quad = QUAD(tile, qy, p, 4);
+
+      vst1q_u8(quad + 0, vld1q_u8(r0 + (p * 32) + 0));
+      vst1q_u8(quad + 16, vld1q_u8(r0 + (p * 32) + 16));
+      vst1q_u8(quad + 32, vld1q_u8(r1 + (p * 32) + 16));
+      vst1q_u8(quad + 48, vld1q_u8(r1 + (p * 32) + 0));
+   }
+}
+
+static ALWAYS_INLINE void
+load_quads_128(const uint8_t *tile, unsigned qy, uint8_t *r0, uint8_t *r1)
+{
+   for (unsigned p = 0; p < 8; ++p) {
+      const uint8_t *quad = QUAD(tile, qy, p, 4);
+
+      vst1q_u8(r0 + (p * 32) + 0, vld1q_u8(quad + 0));
+      vst1q_u8(r0 + (p * 32) + 16, vld1q_u8(quad + 16));
+      vst1q_u8(r1 + (p * 32) + 16, vld1q_u8(quad + 32));
+      vst1q_u8(r1 + (p * 32) + 0, vld1q_u8(quad + 48));
+   }
+}
+
+/* Iterate over pairs of rows and the tiles they cross. The region must be
+ * aligned to whole tiles. */
+
+#define TILED_ACCESS_NEON(kernel, shift) { \
+   uint8_t *dest_start = (uint8_t *) dst + ((sx >> 4) * (256 << shift)); \
+   for (unsigned y = 0; y < h; y += 2) { \
+      uint8_t *tile = dest_start + (((sy + y) >> 4) * dst_stride); \
+      uint8_t *r0 = (uint8_t *) src + (y * src_stride); \
+      uint8_t *r1 = r0 + src_stride; \
+      unsigned qy = quad_y[((sy + y) & 0xF) >> 1]; \
+      for (unsigned x = 0; x < w; x += 16) { \
+         kernel(tile, qy, r0, r1); \
+         tile += (256 << shift); \
+         r0 += (16 << shift); \
+         r1 += (16 << shift); \
+      } \
+   } \
+}
+
+bool
+panfrost_access_tiled_image_neon(void *dst, void *src,
+                                 unsigned sx, unsigned sy,
+                                 unsigned w, unsigned h,
+                                 uint32_t dst_stride,
+                                 uint32_t src_stride,
+                                 unsigned bpp,
+                                 bool is_store)
+{
+   /* CPU detect for NEON support.  On arm64, it's implied. */
+#if DETECT_ARCH_ARM
+   if (!util_get_cpu_caps()->has_neon)
+      return false;
+#endif
+
+   assert(((sx | sy | w | h) & 0xF) == 0 && "unaligned region");
+
+   switch (bpp) {
+   case 8:
+      if (is_store)
+         TILED_ACCESS_NEON(store_quads_8, 0)
+      else
+         TILED_ACCESS_NEON(load_quads_8, 0)
+      return true;
+   case 16:
+      if (is_store)
+         TILED_ACCESS_NEON(store_quads_16, 1)
+      else
+         TILED_ACCESS_NEON(load_quads_16, 1)
+      return true;
+   case 32:
+      if (is_store)
+         TILED_ACCESS_NEON(store_quads_32, 2)
+      else
+         TILED_ACCESS_NEON(load_quads_32, 2)
+      return true;
+   case 64:
+      if (is_store)
+         TILED_ACCESS_NEON(store_quads_64, 3)
+      else
+         TILED_ACCESS_NEON(load_quads_64, 3)
+      return true;
+   case 128:
+      if (is_store)
+         TILED_ACCESS_NEON(store_quads_128, 4)
+      else
+         TILED_ACCESS_NEON(load_quads_128, 4)
+      return true;
+   default:
+      return false;
+   }
+}
+
+#endif /* PAN_TILING_NEON */
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Throughput of loading and storing u-interleaved tiled images, for whole
+ * images and for small unaligned regions */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pan_bench.h"
+#include "pan_tiling.h"
+
+struct tiling_bench {
+        enum pipe_format format;
+        bool store;
+        unsigned x, y, w, h;
+
+        void *tiled, *linear;
+        unsigned tiled_stride, linear_stride;
+};
+
+static int64_t
+bench_tiling(void *data, unsigned ops)
+{
+        struct tiling_bench *b = data;
+
+        for (unsigned i = 0; i < ops; ++i) {
+                if (b->store) {
+                        panfrost_store_tiled_image(b->tiled, b->linear,
+                                                   b->x, b->y, b->w, b->h,
+                                                   b->tiled_stride,
+                                                   b->linear_stride,
+                                                   b->format);
+                } else {
+                        panfrost_load_tiled_image(b->linear, b->tiled,
+                                                  b->x, b->y, b->w, b->h,
+                                                  b->linear_stride,
+                                                  b->tiled_stride,
+                                                  b->format);
+                }
+        }
+
+        pan_bench_consume(*(uint8_t *)b->linear);
+        return 0;
+}
+
+static void
+run_tiling(enum pipe_format format, bool store, unsigned size,
+           unsigned x, unsigned y, unsigned w, unsigned h)
+{
+        const struct util_format_description *desc =
+                util_format_description(format);
+        unsigned bw = desc->block.width, bh = desc->block.height;
+        unsigned blocksize = desc->block.bits / 8;
+
+        /* Tiles are 16x16 blocks */
+        unsigned width_tiles = DIV_ROUND_UP(size / bw, 16);
+        unsigned height_tiles = DIV_ROUND_UP(size / bh, 16);
+
+        struct tiling_bench b = {
+                .format = format,
+                .store = store,
+                .x = x, .y = y, .w = w, .h = h,
+                .tiled_stride = width_tiles * 16 * 16 * blocksize,
+                .linear_stride = DIV_ROUND_UP(w, bw) * blocksize,
+        };
+
+        b.tiled = calloc(height_tiles, b.tiled_stride);
+        b.linear = calloc(DIV_ROUND_UP(h, bh), b.linear_stride);
+
+        char name[128];
+        snprintf(name, sizeof(name), "%s %s %ux%u+%u+%u",
+                 store ? "store" : "load", util_format_short_name(format),
+                 w, h, x, y);
+
+        pan_bench_run(name, bench_tiling, &b,
+                      DIV_ROUND_UP(h, bh) * b.linear_stride);
+
+        free(b.tiled);
+        free(b.linear);
+}
+
+int
+main(int argc, char **argv)
+{
+        static const enum pipe_format formats[] = {
+                PIPE_FORMAT_R8_UINT,
+                PIPE_FORMAT_R8G8_UINT,
+                PIPE_FORMAT_R5G6B5_UNORM,
+                PIPE_FORMAT_R8G8B8A8_UINT,
+                PIPE_FORMAT_R16G16B16A16_UINT,
+                PIPE_FORMAT_R32G32B32A32_UINT,
+                PIPE_FORMAT_ETC2_RGB8,
+                PIPE_FORMAT_ASTC_4x4,
+        };
+
+        for (unsigned i = 0; i < ARRAY_SIZE(formats); ++i) {
+                for (unsigned store = 0; store < 2; ++store) {
+                        /* A whole 1024x1024 image, aligned to tiles */
+                        run_tiling(formats[i], store, 1024, 0, 0, 1024, 1024);
+
+                        /* A small update which isn't aligned to tiles */
+                        run_tiling(formats[i], store, 1024, 20, 36, 100, 60);
+                }
+        }
+
+        return 0;
+}
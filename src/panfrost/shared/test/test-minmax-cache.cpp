@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2022 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pan_minmax_cache.h"
+
+#include <gtest/gtest.h>
+
+class MinMaxCache : public testing::Test {
+protected:
+   MinMaxCache() {
+      cache = (struct panfrost_minmax_cache *) calloc(1, sizeof(*cache));
+   }
+
+   ~MinMaxCache() {
+      free(cache);
+   }
+
+   bool get(unsigned index_size, unsigned start, unsigned count,
+            bool restart = false)
+   {
+      return panfrost_minmax_cache_get(cache, index_size, start, count,
+                                       restart, restart ? ~0 : 0,
+                                       &min, &max);
+   }
+
+   void add(unsigned index_size, unsigned start, unsigned count,
+            unsigned lo, unsigned hi, bool restart = false)
+   {
+      panfrost_minmax_cache_add(cache, index_size, start, count,
+                                restart, restart ? ~0 : 0, lo, hi);
+   }
+
+   struct panfrost_minmax_cache *cache;
+   unsigned min, max;
+};
+
+TEST_F(MinMaxCache, Hit)
+{
+   add(2, 16, 32, 3, 7);
+
+   ASSERT_TRUE(get(2, 16, 32));
+   EXPECT_EQ(min, 3);
+   EXPECT_EQ(max, 7);
+}
+
+TEST_F(MinMaxCache, KeyedOnIndexSizeAndRestart)
+{
+   add(2, 16, 32, 3, 7);
+
+   EXPECT_FALSE(get(1, 16, 32));
+   EXPECT_FALSE(get(4, 16, 32));
+   EXPECT_FALSE(get(2, 16, 32, true));
+}
+
+TEST_F(MinMaxCache, InvalidateOverlappingBytes)
+{
+   /* Bytes [32, 96) and [256, 320) */
+   add(2, 16, 32, 3, 7);
+   add(4, 64, 16, 1, 2);
+
+   panfrost_minmax_cache_invalidate_range(cache, 90, 4);
+
+   EXPECT_FALSE(get(2, 16, 32));
+   EXPECT_TRUE(get(4, 64, 16));
+}
+
+TEST_F(MinMaxCache, InvalidateDisjointBytes)
+{
+   add(2, 16, 32, 3, 7);
+
+   panfrost_minmax_cache_invalidate_range(cache, 96, 160);
+
+   EXPECT_TRUE(get(2, 16, 32));
+}
+
+TEST_F(MinMaxCache, Clear)
+{
+   add(2, 16, 32, 3, 7);
+
+   panfrost_minmax_cache_clear(cache);
+
+   EXPECT_FALSE(get(2, 16, 32));
+}
+
+TEST_F(MinMaxCache, EvictsWhenFull)
+{
+   for (unsigned i = 0; i < 2 * PANFROST_MINMAX_SIZE; ++i)
+      add(1, i, 1, i, i);
+
+   /* Recent entries are kept */
+   ASSERT_TRUE(get(1, 2 * PANFROST_MINMAX_SIZE - 1, 1));
+   EXPECT_EQ(min, 2 * PANFROST_MINMAX_SIZE - 1);
+   EXPECT_LE(cache->size, PANFROST_MINMAX_SIZE);
+}
@@ -277,3 +277,83 @@ TEST(UInterleavedTiling, PartialASTC)
    test_ldst(50, 40, 5, 4, 10,  8, 512, PIPE_FORMAT_ASTC_5x4);
    test_ldst(50, 50, 5, 5, 10, 10, 512, PIPE_FORMAT_ASTC_5x5);
 }
+
+TEST(UInterleavedTiling, FullTiles)
+{
+   /* Large enough to go through the optimized kernels for each size */
+   test_ldst(80, 64, 16, 16, 48, 32, 48 * 1, PIPE_FORMAT_R8_UINT);
+   test_ldst(80, 64, 16, 16, 48, 32, 48 * 2, PIPE_FORMAT_R8G8_UINT);
+   test_ldst(80, 64, 16, 16, 48, 32, 48 * 4, PIPE_FORMAT_R32_UINT);
+   test_ldst(80, 64, 16, 16, 48, 32, 48 * 8, PIPE_FORMAT_R32G32_UINT);
+   test_ldst(80, 64, 16, 16, 48, 32, 48 * 16, PIPE_FORMAT_R32G32B32A32_UINT);
+}
+
+TEST(UInterleavedTiling, PartialAndFullTiles)
+{
+   test_ldst(80, 64, 5, 3, 70, 58, 369 * 1, PIPE_FORMAT_R8_UINT);
+   test_ldst(80, 64, 5, 3, 70, 58, 369 * 2, PIPE_FORMAT_R8G8_UINT);
+   test_ldst(80, 64, 5, 3, 70, 58, 369 * 4, PIPE_FORMAT_R32_UINT);
+   test_ldst(80, 64, 5, 3, 70, 58, 369 * 8, PIPE_FORMAT_R32G32_UINT);
+   test_ldst(80, 64, 5, 3, 70, 58, 369 * 16, PIPE_FORMAT_R32G32B32A32_UINT);
+}
+
+#if PAN_TILING_NEON
+/* Check the NEON kernels on their own against the reference */
+static void
+test_neon(unsigned bpp, enum pipe_format format, bool store)
+{
+   unsigned bytes = bpp / 8;
+   unsigned width = 64, height = 48;
+   unsigned rx = 16, ry = 16, rw = 32, rh = 32;
+   unsigned tiled_stride = width * 16 * bytes;
+   unsigned linear_stride = rw * bytes + 64;
+   size_t tiled_size = tiled_stride * (height / 16);
+   size_t linear_size = linear_stride * rh;
+
+   uint8_t *tiled = (uint8_t *) calloc(1, tiled_size);
+   uint8_t *linear = (uint8_t *) calloc(1, linear_size);
+   uint8_t *ref = (uint8_t *) calloc(1, store ? tiled_size : linear_size);
+
+   uint8_t *src = store ? linear : tiled;
+   for (unsigned i = 0; i < (store ? linear_size : tiled_size); ++i)
+      src[i] = (i * 7) & 0xFF;
+
+   uint32_t dst_stride = store ? tiled_stride : linear_stride;
+   uint32_t src_stride = store ? linear_stride : tiled_stride;
+
+   if (!panfrost_access_tiled_image_neon(tiled, linear, rx, ry, rw, rh,
+                                         tiled_stride, linear_stride,
+                                         bpp, store)) {
+      free(ref);
+      free(tiled);
+      free(linear);
+      GTEST_SKIP() << "NEON not available";
+   }
+
+   ref_access_tiled(ref, src, rx, ry, rw, rh, dst_stride, src_stride,
+                    format, store);
+
+   if (store)
+      EXPECT_EQ(memcmp(ref, tiled, tiled_size), 0);
+   else
+      EXPECT_EQ(memcmp(ref, linear, linear_size), 0);
+
+   free(ref);
+   free(tiled);
+   free(linear);
+}
+
+TEST(UInterleavedTiling, NEONKernels)
+{
+   test_neon(8, PIPE_FORMAT_R8_UINT, true);
+   test_neon(8, PIPE_FORMAT_R8_UINT, false);
+   test_neon(16, PIPE_FORMAT_R8G8_UINT, true);
+   test_neon(16, PIPE_FORMAT_R8G8_UINT, false);
+   test_neon(32, PIPE_FORMAT_R32_UINT, true);
+   test_neon(32, PIPE_FORMAT_R32_UINT, false);
+   test_neon(64, PIPE_FORMAT_R32G32_UINT, true);
+   test_neon(64, PIPE_FORMAT_R32G32_UINT, false);
+   test_neon(128, PIPE_FORMAT_R32G32B32A32_UINT, true);
+   test_neon(128, PIPE_FORMAT_R32G32B32A32_UINT, false);
+}
+#endif
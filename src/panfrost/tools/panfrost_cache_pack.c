@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Packs a shader cache into a single read-only fossilize database, to ship
+ * prebuilt shaders for an application in a system image. Run the application
+ * once on the target with a private multi-file cache, then pack it:
+ *
+ *    MESA_SHADER_CACHE_DIR=/tmp/app-cache app
+ *    panfrost_cache_pack /tmp/app-cache/mesa_shader_cache app out/
+ *
+ * Install out/app.foz and out/app_idx.foz in the single-file cache directory
+ * of the image, and list the database at runtime with
+ *
+ *    MESA_DISK_CACHE_SINGLE_FILE=1 MESA_DISK_CACHE_READ_ONLY_FOZ_DBS=app
+ *
+ * Read-only databases are mapped, so cache hits don't make any syscall.
+ * Entries are copied verbatim: they are still checked against the driver
+ * build when loaded, so caches of several drivers may be packed together.
+ */
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "util/fossilize_db.h"
+#include "util/macros.h"
+
+static void
+print_help(const char *progname)
+{
+        fprintf(stderr, "Usage: %s <multi-file cache dir> <name> <output dir>\n",
+                progname);
+}
+
+static bool
+parse_hex(const char *str, uint8_t *out, unsigned bytes)
+{
+        for (unsigned i = 0; i < bytes; ++i) {
+                unsigned byte;
+
+                if (sscanf(str + (i * 2), "%2x", &byte) != 1)
+                        return false;
+
+                out[i] = byte;
+        }
+
+        return true;
+}
+
+static void *
+read_file(const char *filename, size_t *size)
+{
+        FILE *fp = fopen(filename, "rb");
+        struct stat sb;
+        void *data = NULL;
+
+        if (!fp)
+                return NULL;
+
+        if (fstat(fileno(fp), &sb) == 0 && sb.st_size > 0) {
+                data = malloc(sb.st_size);
+
+                if (data && fread(data, 1, sb.st_size, fp) != sb.st_size) {
+                        free(data);
+                        data = NULL;
+                }
+
+                *size = sb.st_size;
+        }
+
+        fclose(fp);
+        return data;
+}
+
+/* Entries of the multi-file cache live in <dir>/<2 hex digits>/<38 hex
+ * digits>, named after their key. Anything else, like the index and the
+ * temporary files of interrupted writes, is skipped. */
+
+static unsigned
+pack_subdir(struct foz_db *db, const char *path, const char *prefix)
+{
+        DIR *dir = opendir(path);
+        unsigned count = 0;
+
+        if (!dir)
+                return 0;
+
+        struct dirent *ent;
+
+        while ((ent = readdir(dir))) {
+                char hex[41];
+                uint8_t key[20];
+
+                if (strlen(ent->d_name) != 38)
+                        continue;
+
+                snprintf(hex, sizeof(hex), "%s%s", prefix, ent->d_name);
+
+                if (!parse_hex(hex, key, sizeof(key)))
+                        continue;
+
+                char *filename;
+                if (asprintf(&filename, "%s/%s", path, ent->d_name) == -1)
+                        continue;
+
+                size_t size = 0;
+                void *data = read_file(filename, &size);
+                free(filename);
+
+                if (data && foz_write_entry(db, key, data, size))
+                        count++;
+
+                free(data);
+        }
+
+        closedir(dir);
+        return count;
+}
+
+static bool
+rename_output(const char *out, const char *from, const char *to)
+{
+        char *src, *dst;
+        bool ok = false;
+
+        if (asprintf(&src, "%s/%s", out, from) == -1)
+                return false;
+
+        if (asprintf(&dst, "%s/%s", out, to) != -1) {
+                ok = rename(src, dst) == 0;
+                free(dst);
+        }
+
+        free(src);
+        return ok;
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc != 4) {
+                print_help(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        const char *in = argv[1], *name = argv[2];
+        char *out = argv[3];
+
+        /* Only the output database should be opened */
+        unsetenv("MESA_DISK_CACHE_READ_ONLY_FOZ_DBS");
+
+        struct foz_db db = { 0 };
+
+        if (!foz_prepare(&db, out)) {
+                fprintf(stderr, "Could not create a database in %s\n", out);
+                foz_destroy(&db);
+                return EXIT_FAILURE;
+        }
+
+        DIR *dir = opendir(in);
+
+        if (!dir) {
+                fprintf(stderr, "Could not open %s\n", in);
+                foz_destroy(&db);
+                return EXIT_FAILURE;
+        }
+
+        struct dirent *ent;
+        unsigned count = 0;
+
+        while ((ent = readdir(dir))) {
+                uint8_t byte;
+
+                if (strlen(ent->d_name) != 2 ||
+                    !parse_hex(ent->d_name, &byte, 1))
+                        continue;
+
+                char *path;
+                if (asprintf(&path, "%s/%s", in, ent->d_name) == -1)
+                        continue;
+
+                count += pack_subdir(&db, path, ent->d_name);
+                free(path);
+        }
+
+        closedir(dir);
+        foz_destroy(&db);
+
+        char *foz, *idx;
+
+        if (asprintf(&foz, "%s.foz", name) == -1)
+                return EXIT_FAILURE;
+
+        if (asprintf(&idx, "%s_idx.foz", name) == -1) {
+                free(foz);
+                return EXIT_FAILURE;
+        }
+
+        bool ok = rename_output(out, "foz_cache.foz", foz) &&
+                  rename_output(out, "foz_cache_idx.foz", idx);
+
+        free(foz);
+        free(idx);
+
+        if (!ok) {
+                fprintf(stderr, "Could not name the database %s\n", name);
+                return EXIT_FAILURE;
+        }
+
+        printf("Packed %u entries into %s/%s.foz\n", count, out, name);
+        return EXIT_SUCCESS;
+}
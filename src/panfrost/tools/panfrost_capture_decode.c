@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Decodes command streams captured with PAN_CAPTURE_FILE, the same way
+ * PAN_MESA_DEBUG=trace does while running, but without slowing down the
+ * traced process:
+ *
+ *    PAN_CAPTURE_FILE=trace.bin PAN_CAPTURE_FRAME_INTERVAL=100 \
+ *    PAN_CAPTURE_FRAME_COUNT=10 app
+ *    PANDECODE_DUMP_FILE=trace.dump panfrost_capture_decode trace.bin
+ *
+ * Captured regions are mapped for pandecode at their captured addresses, so
+ * nothing needs relocating. The instructions of each submission are mapped
+ * at an address no region uses, and decoded one queue after the other.
+ * Growable and invisible memory is never captured and decodes as zeroes.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/macros.h"
+#include "util/u_dynarray.h"
+
+#include "pan_capture.h"
+#include "wrap.h"
+
+/* Above the 47-bit addresses kbase hands out */
+#define DECODE_CS_VA 0xffff00000000ull
+
+struct decode_region {
+        struct pan_capture_region region;
+        void *cpu;
+};
+
+struct decode {
+        struct pan_capture_header header;
+        struct util_dynarray regions;
+        unsigned submits, frames;
+};
+
+static const char *
+decode_region_name(const struct pan_capture_region *c)
+{
+        switch (c->kind) {
+        case PAN_CAPTURE_REGION_BO:
+                return "BO";
+        case PAN_CAPTURE_REGION_EVENT:
+                return "Event memory";
+        case PAN_CAPTURE_REGION_HEAP:
+                return "Tiler heap context";
+        case PAN_CAPTURE_REGION_HEAP_CHUNK:
+                return "Tiler heap chunk";
+        default:
+                return "Unknown region";
+        }
+}
+
+static struct decode_region *
+decode_region_lookup(struct decode *d, uint64_t va)
+{
+        util_dynarray_foreach(&d->regions, struct decode_region, region) {
+                if (region->region.va <= va &&
+                    va < region->region.va + region->region.size)
+                        return region;
+        }
+
+        return NULL;
+}
+
+static bool
+decode_add_region(struct decode *d, const struct pan_capture_region *c)
+{
+        /* Regions overlapping the new one have been freed by the driver */
+        struct decode_region *regions = util_dynarray_begin(&d->regions);
+        unsigned count = util_dynarray_num_elements(&d->regions,
+                                                    struct decode_region);
+
+        for (unsigned i = 0; i < count;) {
+                struct pan_capture_region *old = &regions[i].region;
+
+                if (old->va < c->va + c->size && c->va < old->va + old->size) {
+                        pandecode_inject_free(old->va, old->size);
+                        free(regions[i].cpu);
+                        regions[i] = regions[--count];
+                } else {
+                        ++i;
+                }
+        }
+
+        d->regions.size = count * sizeof(struct decode_region);
+
+        void *cpu = calloc(1, c->size);
+
+        if (!cpu) {
+                fprintf(stderr, "failed to allocate region 0x%"PRIx64" "
+                        "(%"PRIu64" bytes)\n", c->va, c->size);
+                return false;
+        }
+
+        struct decode_region region = {
+                .region = *c,
+                .cpu = cpu,
+        };
+
+        util_dynarray_append(&d->regions, struct decode_region, region);
+        pandecode_inject_mmap(c->va, cpu, c->size, decode_region_name(c));
+        return true;
+}
+
+static bool
+decode_add_data(struct decode *d, const struct pan_capture_data *c,
+                const void *payload)
+{
+        struct decode_region *region = decode_region_lookup(d, c->va);
+
+        if (!region ||
+            c->va + c->size > region->region.va + region->region.size) {
+                fprintf(stderr, "data for unknown region 0x%"PRIx64"\n",
+                        c->va);
+                return false;
+        }
+
+        memcpy(region->cpu + (c->va - region->region.va), payload, c->size);
+        return true;
+}
+
+static void
+decode_submit(struct decode *d, const struct pan_capture_submit *c,
+              const uint64_t *payload)
+{
+        static const char *queues[PAN_CAPTURE_QUEUES] = {
+                "vertex", "fragment", "compute",
+        };
+
+        for (unsigned q = 0; q < PAN_CAPTURE_QUEUES; ++q) {
+                unsigned size = c->count[q] * 8;
+
+                if (!size)
+                        continue;
+
+                /* Instructions in the capture aren't 8-byte aligned */
+                void *ins = malloc(size);
+                memcpy(ins, payload, size);
+
+                printf("Submission %u, %s queue: %u instructions\n",
+                       d->submits, queues[q], c->count[q]);
+
+                pandecode_inject_mmap(DECODE_CS_VA, ins, size, queues[q]);
+                pandecode_cs(DECODE_CS_VA, size, d->header.gpu_id);
+                pandecode_inject_free(DECODE_CS_VA, size);
+
+                free(ins);
+                payload += c->count[q];
+        }
+
+        d->submits++;
+}
+
+static bool
+decode_capture(struct decode *d, const void *buf, size_t size)
+{
+        const void *end = buf + size;
+        bool ok = true;
+
+        while (ok && buf + sizeof(struct pan_capture_record) <= end) {
+                const struct pan_capture_record *rec = buf;
+                const void *payload = rec + 1;
+
+                buf = payload + rec->size;
+                if (buf > end) {
+                        fprintf(stderr, "truncated capture\n");
+                        return false;
+                }
+
+                switch (rec->type) {
+                case PAN_CAPTURE_HEADER:
+                        memcpy(&d->header, payload,
+                               MIN2(rec->size, sizeof(d->header)));
+                        break;
+                case PAN_CAPTURE_REGION:
+                        ok = decode_add_region(d, payload);
+                        break;
+                case PAN_CAPTURE_DATA:
+                        ok = decode_add_data(d, payload,
+                                             payload + sizeof(struct pan_capture_data));
+                        break;
+                case PAN_CAPTURE_SUBMIT:
+                        decode_submit(d, payload,
+                                      payload + sizeof(struct pan_capture_submit));
+                        break;
+                case PAN_CAPTURE_FRAME:
+                        pandecode_next_frame();
+                        d->frames++;
+                        break;
+                default:
+                        fprintf(stderr, "unknown record type %u\n", rec->type);
+                        return false;
+                }
+        }
+
+        return ok;
+}
+
+static void *
+read_file(const char *path, size_t *size)
+{
+        FILE *fp = fopen(path, "rb");
+
+        if (!fp) {
+                fprintf(stderr, "failed to open %s: %m\n", path);
+                return NULL;
+        }
+
+        fseek(fp, 0, SEEK_END);
+        *size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        void *buf = malloc(*size);
+
+        if (fread(buf, 1, *size, fp) != *size) {
+                fprintf(stderr, "failed to read %s\n", path);
+                free(buf);
+                buf = NULL;
+        }
+
+        fclose(fp);
+        return buf;
+}
+
+int
+main(int argc, char *argv[])
+{
+        if (argc != 2) {
+                printf("Usage: %s capture\n", argv[0]);
+                printf("Decodes to PANDECODE_DUMP_FILE.<frame> (default pandecode.dump), "
+                       "or stderr if it is \"stderr\"\n");
+                return EXIT_FAILURE;
+        }
+
+        size_t size;
+        void *buf = read_file(argv[1], &size);
+
+        if (!buf)
+                return EXIT_FAILURE;
+
+        const struct pan_capture_record *rec = buf;
+        const struct pan_capture_header *header = (const void *)(rec + 1);
+
+        if (size < sizeof(*rec) + sizeof(*header) ||
+            rec->type != PAN_CAPTURE_HEADER ||
+            header->magic != PAN_CAPTURE_MAGIC ||
+            header->version != PAN_CAPTURE_VERSION) {
+                fprintf(stderr, "%s is not a panfrost capture\n", argv[1]);
+                free(buf);
+                return EXIT_FAILURE;
+        }
+
+        struct decode d = {0};
+        util_dynarray_init(&d.regions, NULL);
+
+        pandecode_initialize(false);
+
+        bool ok = decode_capture(&d, buf, size);
+
+        pandecode_close();
+
+        util_dynarray_foreach(&d.regions, struct decode_region, region)
+                free(region->cpu);
+
+        util_dynarray_fini(&d.regions);
+        free(buf);
+
+        printf("Decoded %u submissions in %u frames\n", d.submits, d.frames);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2023 Collabora, Ltd.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a
+# copy of this software and associated documentation files (the "Software"),
+# to deal in the Software without restriction, including without limitation
+# the rights to use, copy, modify, merge, publish, distribute, sublicense,
+# and/or sell copies of the Software, and to permit persons to whom the
+# Software is furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice (including the next
+# paragraph) shall be included in all copies or substantial portions of the
+# Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+# THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+
+"""
+Measures the CPU cost of the driver by replaying apitrace traces with
+KBASE_NOOP, so that submissions complete straight away and no GPU time is
+included. With --shim, the panfrost drm-shim provides the device, so this
+also runs on machines without a Mali GPU.
+
+    panfrost_cpu_bench.py --shim build/src/panfrost/drm-shim/libpanfrost_noop_drm_shim.so \\
+        --runs 5 trace1.trace trace2.trace
+"""
+
+import argparse
+import os
+import re
+import statistics
+import subprocess
+import sys
+
+DRAW_CALL = re.compile(r'^(?:\d+ )?gl(?:Multi)?Draw\w*\(', re.MULTILINE)
+
+
+def count_draws(apitrace, trace):
+    dump = subprocess.run([apitrace, 'dump', '--color=never', trace],
+                          check=True, capture_output=True, text=True).stdout
+    return len(DRAW_CALL.findall(dump))
+
+
+def cpu_time(cmd, env):
+    """Returns the user plus system time of cmd, in seconds"""
+    proc = subprocess.Popen(cmd, env=env, stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    proc.returncode = os.waitstatus_to_exitcode(status)
+
+    if proc.returncode:
+        raise subprocess.CalledProcessError(proc.returncode, cmd)
+
+    return usage.ru_utime + usage.ru_stime
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('traces', nargs='+', help='apitrace traces to replay')
+    parser.add_argument('--runs', type=int, default=3,
+                        help='replays of each trace, the median is reported')
+    parser.add_argument('--retrace', default='eglretrace',
+                        help='retrace binary to replay with')
+    parser.add_argument('--apitrace', default='apitrace',
+                        help='apitrace binary to count draws with')
+    parser.add_argument('--shim', help='drm-shim library to preload')
+    args = parser.parse_args()
+
+    env = dict(os.environ)
+    env['KBASE_NOOP'] = '1'
+    env.setdefault('EGL_PLATFORM', 'surfaceless')
+
+    if args.shim:
+        env['LD_PRELOAD'] = ':'.join(filter(None, [os.path.abspath(args.shim),
+                                                   env.get('LD_PRELOAD')]))
+
+    print(f'{"trace":40} {"draws":>8} {"CPU ms":>10} {"us/draw":>8}')
+
+    for trace in args.traces:
+        draws = count_draws(args.apitrace, trace)
+        times = [cpu_time([args.retrace, '--benchmark', trace], env)
+                 for _ in range(args.runs)]
+        ms = statistics.median(times) * 1000
+        per_draw = f'{ms * 1000 / draws:8.2f}' if draws else f'{"-":>8}'
+
+        print(f'{os.path.basename(trace):40} {draws:8} {ms:10.1f} {per_draw}')
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
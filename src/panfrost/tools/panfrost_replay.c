@@ -0,0 +1,742 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replays command streams captured with PAN_CAPTURE_FILE on a kbase device,
+ * without the driver and application on the CPU side, to benchmark the GPU
+ * work of a frame in isolation:
+ *
+ *    PAN_CAPTURE_FILE=frames.bin PAN_CAPTURE_FRAME=100 app
+ *    panfrost_replay -n 50 frames.bin
+ *
+ * Every captured memory region gets an allocation of its own, and GPU
+ * addresses in the captured data and instructions are relocated to them.
+ * Addresses are only found in 64-bit aligned words and the immediates of
+ * 48-bit moves, so anything else pointing into a region (such as 32-bit
+ * blend shader PCs) keeps the captured address.
+ *
+ * Each submission is waited for before the next one, as it was while
+ * capturing, so the time of a frame is the sum of the times of its
+ * submissions, including copying the memory contents that changed.
+ */
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "drm-uapi/panfrost_drm.h"
+
+#include "util/macros.h"
+#include "util/os_time.h"
+#include "util/u_dynarray.h"
+#include "util/u_math.h"
+
+#define PAN_ARCH 10
+#include "genxml/gen_macros.h"
+
+#include "pan_base.h"
+#include "pan_bo.h"
+#include "pan_capture.h"
+
+/* A captured region and the memory standing in for it */
+struct replay_region {
+        struct pan_capture_region region;
+        struct base_ptr mem;
+        bool owned;
+};
+
+enum replay_op_type {
+        REPLAY_OP_DATA,
+        REPLAY_OP_SUBMIT,
+        REPLAY_OP_FRAME,
+};
+
+/* Records with their addresses already relocated */
+struct replay_op {
+        enum replay_op_type type;
+
+        union {
+                struct {
+                        void *dst;
+                        void *src;
+                        size_t size;
+                } data;
+
+                struct {
+                        uint64_t *ins[PAN_CAPTURE_QUEUES];
+                        uint32_t count[PAN_CAPTURE_QUEUES];
+                } submit;
+        };
+};
+
+struct replay_queue {
+        struct kbase_cs cs;
+        struct base_ptr ring;
+        uint64_t insert;
+        uint64_t event_ptr;
+        uint64_t seqnum;
+};
+
+struct replay {
+        kbase k;
+        struct kbase_context *ctx;
+        struct kbase_syncobj *syncobj;
+        struct replay_queue queues[PAN_CAPTURE_QUEUES];
+        struct pan_capture_header header;
+
+        /* Regions which are live at the current point of the capture,
+         * sorted by address */
+        struct util_dynarray live;
+        /* Every region ever allocated */
+        struct util_dynarray regions;
+
+        struct util_dynarray ops;
+        unsigned frames;
+        uint32_t max_count[PAN_CAPTURE_QUEUES];
+
+        bool verbose;
+};
+
+/* Index of the first live region ending after va */
+static unsigned
+replay_region_search(struct replay *r, uint64_t va)
+{
+        struct replay_region **live = util_dynarray_begin(&r->live);
+        unsigned lo = 0;
+        unsigned hi = util_dynarray_num_elements(&r->live, struct replay_region *);
+
+        while (lo < hi) {
+                unsigned mid = (lo + hi) / 2;
+
+                if (live[mid]->region.va + live[mid]->region.size <= va)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+
+        return lo;
+}
+
+static struct replay_region *
+replay_region_lookup(struct replay *r, uint64_t va)
+{
+        unsigned idx = replay_region_search(r, va);
+
+        if (idx == util_dynarray_num_elements(&r->live, struct replay_region *))
+                return NULL;
+
+        struct replay_region *region =
+                *util_dynarray_element(&r->live, struct replay_region *, idx);
+
+        return region->region.va <= va ? region : NULL;
+}
+
+static bool
+replay_relocate(struct replay *r, uint64_t *va)
+{
+        struct replay_region *region = replay_region_lookup(r, *va);
+
+        if (!region)
+                return false;
+
+        *va = *va - region->region.va + region->mem.gpu;
+        return true;
+}
+
+static struct base_ptr
+replay_alloc_region(struct replay *r, const struct pan_capture_region *c)
+{
+        kbase k = r->k;
+
+        switch (c->kind) {
+        case PAN_CAPTURE_REGION_BO: {
+                unsigned pan_flags = 0;
+
+                if (!(c->flags & PAN_BO_EXECUTE))
+                        pan_flags |= PANFROST_BO_NOEXEC;
+                if (c->flags & PAN_BO_GROWABLE)
+                        pan_flags |= PANFROST_BO_HEAP;
+
+                /* The same flags as pan_bo.c uses for event memory */
+                unsigned mali_flags = (c->flags & PAN_BO_EVENT) ? 0x8200f : 0;
+
+                return k->alloc(k, c->size, pan_flags, mali_flags);
+        }
+
+        case PAN_CAPTURE_REGION_EVENT:
+                /* Synchronisation objects must be in event memory */
+                return k->alloc(k, c->size, PANFROST_BO_NOEXEC, 0x8200f);
+
+        case PAN_CAPTURE_REGION_HEAP:
+        case PAN_CAPTURE_REGION_HEAP_CHUNK: {
+                unsigned idx = c->flags < r->ctx->num_tiler_heaps ? c->flags : 0;
+                struct kbase_tiler_heap *heap = &r->ctx->tiler_heaps[idx];
+
+                return (struct base_ptr) {
+                        .gpu = c->kind == PAN_CAPTURE_REGION_HEAP ?
+                                heap->va : heap->header,
+                };
+        }
+
+        default:
+                return (struct base_ptr) {0};
+        }
+}
+
+static bool
+replay_add_region(struct replay *r, const struct pan_capture_region *c)
+{
+        struct replay_region *region = calloc(1, sizeof(*region));
+
+        region->region = *c;
+        region->mem = replay_alloc_region(r, c);
+        region->owned = region->mem.cpu != NULL;
+
+        if (!region->mem.gpu) {
+                fprintf(stderr, "failed to allocate region 0x%"PRIx64" "
+                        "(%"PRIu64" bytes)\n", c->va, c->size);
+                free(region);
+                return false;
+        }
+
+        util_dynarray_append(&r->regions, struct replay_region *, region);
+
+        /* Regions overlapping the new one have been freed by the driver */
+        unsigned start = replay_region_search(r, c->va);
+        unsigned end = start;
+        unsigned count = util_dynarray_num_elements(&r->live,
+                                                    struct replay_region *);
+        struct replay_region **live = util_dynarray_begin(&r->live);
+
+        while (end < count && live[end]->region.va < c->va + c->size)
+                ++end;
+
+        /* Replace the overlapping regions with the new one */
+        if (end == start) {
+                util_dynarray_append(&r->live, struct replay_region *, NULL);
+                live = util_dynarray_begin(&r->live);
+                memmove(live + start + 1, live + start,
+                        (count - start) * sizeof(*live));
+        } else {
+                memmove(live + start + 1, live + end,
+                        (count - end) * sizeof(*live));
+                r->live.size -= (end - start - 1) * sizeof(*live);
+        }
+
+        live[start] = region;
+        return true;
+}
+
+static bool
+replay_add_data(struct replay *r, const struct pan_capture_data *c,
+                const void *payload)
+{
+        struct replay_region *region = replay_region_lookup(r, c->va);
+
+        if (!region || !region->mem.cpu ||
+            c->va + c->size > region->region.va + region->region.size) {
+                fprintf(stderr, "data for unknown region 0x%"PRIx64"\n",
+                        c->va);
+                return false;
+        }
+
+        void *src = malloc(c->size);
+        memcpy(src, payload, c->size);
+
+        /* Relocate pointers, and the immediates of 48-bit moves in command
+         * streams, which can't be told apart from other data */
+        uint64_t *words = src;
+
+        for (unsigned i = 0; i < c->size / 8; ++i) {
+                uint64_t w = words[i];
+
+                if (replay_relocate(r, &w)) {
+                        words[i] = w;
+                } else if ((w >> 56) == 1) {
+                        uint64_t imm = w & BITFIELD64_MASK(48);
+
+                        if (replay_relocate(r, &imm) && imm < (1ull << 48))
+                                words[i] = (w & ~BITFIELD64_MASK(48)) | imm;
+                }
+        }
+
+        struct replay_op op = {
+                .type = REPLAY_OP_DATA,
+                .data = {
+                        .dst = region->mem.cpu + (c->va - region->region.va),
+                        .src = src,
+                        .size = c->size,
+                },
+        };
+
+        util_dynarray_append(&r->ops, struct replay_op, op);
+        return true;
+}
+
+static bool
+replay_add_submit(struct replay *r, const struct pan_capture_submit *c,
+                  const uint64_t *payload)
+{
+        struct replay_op op = { .type = REPLAY_OP_SUBMIT };
+
+        for (unsigned q = 0; q < PAN_CAPTURE_QUEUES; ++q) {
+                uint32_t count = c->count[q];
+                uint64_t *ins = malloc(MAX2(count, 1) * sizeof(uint64_t));
+
+                for (unsigned i = 0; i < count; ++i) {
+                        uint64_t w = payload[i];
+
+                        if ((w >> 56) == 1) {
+                                uint64_t imm = w & BITFIELD64_MASK(48);
+
+                                if (replay_relocate(r, &imm))
+                                        w = (w & ~BITFIELD64_MASK(48)) | imm;
+                        }
+
+                        ins[i] = w;
+                }
+
+                op.submit.ins[q] = ins;
+                op.submit.count[q] = count;
+                r->max_count[q] = MAX2(r->max_count[q], count);
+                payload += count;
+        }
+
+        util_dynarray_append(&r->ops, struct replay_op, op);
+        return true;
+}
+
+static bool
+replay_load(struct replay *r, const void *buf, size_t size)
+{
+        const void *end = buf + size;
+        bool ok = true;
+
+        while (ok && buf + sizeof(struct pan_capture_record) <= end) {
+                const struct pan_capture_record *rec = buf;
+                const void *payload = rec + 1;
+
+                buf = payload + rec->size;
+                if (buf > end) {
+                        fprintf(stderr, "truncated capture\n");
+                        return false;
+                }
+
+                switch (rec->type) {
+                case PAN_CAPTURE_HEADER:
+                        memcpy(&r->header, payload,
+                               MIN2(rec->size, sizeof(r->header)));
+                        break;
+                case PAN_CAPTURE_REGION:
+                        ok = replay_add_region(r, payload);
+                        break;
+                case PAN_CAPTURE_DATA:
+                        ok = replay_add_data(r, payload,
+                                             payload + sizeof(struct pan_capture_data));
+                        break;
+                case PAN_CAPTURE_SUBMIT:
+                        ok = replay_add_submit(r, payload,
+                                               payload + sizeof(struct pan_capture_submit));
+                        break;
+                case PAN_CAPTURE_FRAME: {
+                        struct replay_op op = { .type = REPLAY_OP_FRAME };
+                        util_dynarray_append(&r->ops, struct replay_op, op);
+                        r->frames++;
+                        break;
+                }
+                default:
+                        fprintf(stderr, "unknown record type %u\n", rec->type);
+                        return false;
+                }
+        }
+
+        return ok;
+}
+
+static void
+replay_write(struct replay_queue *q, const uint64_t *ins, unsigned count)
+{
+        uint64_t *ring = q->ring.cpu;
+        unsigned words = q->cs.size / 8;
+
+        for (unsigned i = 0; i < count; ++i)
+                ring[(q->insert / 8 + i) % words] = ins[i];
+
+        q->insert += count * 8;
+}
+
+/* The same prologue as panfrost_cs_ring_reset */
+static void
+replay_prologue(struct replay *r, struct replay_queue *q, unsigned idx)
+{
+        uint64_t buf[8];
+        pan_command_stream c = { .ptr = buf, .begin = buf, .end = buf + 8 };
+
+        pan_pack_ins(&c, CS_RESOURCES, cfg) { cfg.mask = r->header.hw_resources[idx]; }
+        pan_pack_ins(&c, CS_SLOT, cfg) { cfg.index = 2; }
+        pan_emit_cs_48(&c, 0x48, r->ctx->tiler_heaps[0].va);
+        pan_pack_ins(&c, CS_HEAPCTX, cfg) { cfg.address = 0x48; }
+        while (c.ptr != c.end)
+                pan_pack_ins(&c, CS_NOP, _);
+
+        replay_write(q, buf, c.ptr - buf);
+}
+
+/* Signal the event of the queue once it is done, the same as the driver does
+ * at the end of a batch */
+static void
+replay_trailer(struct replay_queue *q)
+{
+        uint64_t buf[8];
+        pan_command_stream c = { .ptr = buf, .begin = buf, .end = buf + 8 };
+
+        pan_emit_cs_48(&c, 0x48, q->event_ptr);
+        pan_emit_cs_64(&c, 0x4a, q->seqnum + 1);
+        pan_pack_ins(&c, CS_EVSTR_64, cfg) {
+                cfg.unk_2 = (3 << 3);
+                cfg.value = 0x4a;
+                cfg.addr = 0x48;
+        }
+
+        replay_write(q, buf, c.ptr - buf);
+}
+
+static bool
+replay_init_queues(struct replay *r)
+{
+        kbase k = r->k;
+
+        for (unsigned i = 0; i < PAN_CAPTURE_QUEUES; ++i) {
+                struct replay_queue *q = &r->queues[i];
+
+                /* Room for the largest submission and the trailer, which
+                 * is waited for before the next one is written */
+                unsigned size = util_next_power_of_two((r->max_count[i] + 16) * 8);
+                size = MAX2(size, 65536);
+
+                q->ring = k->alloc(k, size, PANFROST_BO_NOEXEC, 0);
+                if (!q->ring.cpu)
+                        return false;
+
+                q->cs = k->cs_bind(k, r->ctx, q->ring.gpu, size);
+                if (!q->cs.user_io)
+                        return false;
+
+                q->event_ptr = k->event_mem.gpu +
+                        q->cs.event_mem_offset * PAN_EVENT_SIZE;
+
+                replay_prologue(r, q, i);
+        }
+
+        return true;
+}
+
+/* Returns the time taken in nanoseconds, or zero on a timeout */
+static uint64_t
+replay_submit(struct replay *r, const struct replay_op *op)
+{
+        kbase k = r->k;
+        int64_t start = os_time_get_nano();
+
+        for (unsigned i = 0; i < PAN_CAPTURE_QUEUES; ++i) {
+                struct replay_queue *q = &r->queues[i];
+
+                if (!op->submit.count[i] && q->insert == q->cs.last_insert)
+                        continue;
+
+                replay_write(q, op->submit.ins[i], op->submit.count[i]);
+                replay_trailer(q);
+
+                /* Also adds the end of the submission to the syncobj */
+                k->cs_submit(k, &q->cs, q->insert, r->syncobj, q->seqnum);
+                q->seqnum++;
+        }
+
+        if (!k->syncobj_wait(k, r->syncobj, 1000000000LL)) {
+                fprintf(stderr, "submission timed out\n");
+                return 0;
+        }
+
+        return os_time_get_nano() - start;
+}
+
+static bool
+replay_run(struct replay *r, uint64_t *frame_ns)
+{
+        unsigned frame = 0;
+        uint64_t ns = 0;
+
+        util_dynarray_foreach(&r->ops, struct replay_op, op) {
+                switch (op->type) {
+                case REPLAY_OP_DATA: {
+                        int64_t start = os_time_get_nano();
+                        memcpy(op->data.dst, op->data.src, op->data.size);
+                        ns += os_time_get_nano() - start;
+                        break;
+                }
+                case REPLAY_OP_SUBMIT: {
+                        uint64_t t = replay_submit(r, op);
+
+                        if (!t)
+                                return false;
+
+                        if (r->verbose)
+                                printf("  submit: %"PRIu64" us\n", t / 1000);
+
+                        ns += t;
+                        break;
+                }
+                case REPLAY_OP_FRAME:
+                        frame_ns[frame++] = ns;
+                        ns = 0;
+                        break;
+                }
+        }
+
+        return true;
+}
+
+static void
+replay_print(struct replay *r, uint64_t *ns, unsigned iterations)
+{
+        uint64_t total = 0;
+
+        for (unsigned f = 0; f < r->frames; ++f) {
+                uint64_t min = UINT64_MAX, max = 0, sum = 0;
+
+                for (unsigned i = 0; i < iterations; ++i) {
+                        uint64_t t = ns[i * r->frames + f];
+
+                        min = MIN2(min, t);
+                        max = MAX2(max, t);
+                        sum += t;
+                }
+
+                total += sum;
+
+                printf("frame %u: min %.3f ms, avg %.3f ms, max %.3f ms\n",
+                       f, min / 1e6, sum / (iterations * 1e6), max / 1e6);
+        }
+
+        if (r->frames)
+                printf("average frame: %.3f ms\n",
+                       total / ((double)iterations * r->frames * 1e6));
+}
+
+static void
+replay_fini(struct replay *r)
+{
+        kbase k = r->k;
+
+        for (unsigned i = 0; i < PAN_CAPTURE_QUEUES; ++i) {
+                if (r->queues[i].cs.user_io)
+                        k->cs_free(k, &r->queues[i].cs);
+                if (r->queues[i].ring.gpu)
+                        k->free(k, r->queues[i].ring.gpu);
+        }
+
+        util_dynarray_foreach(&r->ops, struct replay_op, op) {
+                if (op->type == REPLAY_OP_DATA) {
+                        free(op->data.src);
+                } else if (op->type == REPLAY_OP_SUBMIT) {
+                        for (unsigned i = 0; i < PAN_CAPTURE_QUEUES; ++i)
+                                free(op->submit.ins[i]);
+                }
+        }
+
+        util_dynarray_foreach(&r->regions, struct replay_region *, region) {
+                if ((*region)->owned)
+                        k->free(k, (*region)->mem.gpu);
+                free(*region);
+        }
+
+        util_dynarray_fini(&r->ops);
+        util_dynarray_fini(&r->regions);
+        util_dynarray_fini(&r->live);
+
+        if (r->syncobj)
+                k->syncobj_destroy(k, r->syncobj);
+        if (r->ctx)
+                k->context_destroy(k, r->ctx);
+}
+
+static void *
+read_file(const char *path, size_t *size)
+{
+        FILE *fp = fopen(path, "rb");
+
+        if (!fp) {
+                fprintf(stderr, "failed to open %s: %m\n", path);
+                return NULL;
+        }
+
+        fseek(fp, 0, SEEK_END);
+        *size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        void *buf = malloc(*size);
+
+        if (fread(buf, 1, *size, fp) != *size) {
+                fprintf(stderr, "failed to read %s\n", path);
+                free(buf);
+                buf = NULL;
+        }
+
+        fclose(fp);
+        return buf;
+}
+
+static void
+print_help(const char *argv0)
+{
+        printf("Usage: %s [-n iterations] [-v] capture\n", argv0);
+        printf("\t-n, --iterations\tReplay the frames this many times (default 10)\n");
+        printf("\t-v, --verbose\t\tPrint the time of each submission\n");
+        printf("\t-h, --help\t\tShow this message\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+        static const struct option longopts[] = {
+                { "iterations", required_argument, NULL, 'n' },
+                { "verbose", no_argument, NULL, 'v' },
+                { "help", no_argument, NULL, 'h' },
+                { NULL, 0, NULL, 0 }
+        };
+
+        struct replay r = {0};
+        unsigned iterations = 10;
+        int c;
+
+        while ((c = getopt_long(argc, argv, "n:vh", longopts, NULL)) != -1) {
+                switch (c) {
+                case 'n':
+                        iterations = MAX2(atoi(optarg), 1);
+                        break;
+                case 'v':
+                        r.verbose = true;
+                        break;
+                case 'h':
+                        print_help(argv[0]);
+                        return EXIT_SUCCESS;
+                default:
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                }
+        }
+
+        if (optind + 1 != argc) {
+                print_help(argv[0]);
+                return EXIT_FAILURE;
+        }
+
+        size_t size;
+        void *buf = read_file(argv[optind], &size);
+
+        if (!buf)
+                return EXIT_FAILURE;
+
+        const struct pan_capture_record *rec = buf;
+        const struct pan_capture_header *header = (const void *)(rec + 1);
+
+        if (size < sizeof(*rec) + sizeof(*header) ||
+            rec->type != PAN_CAPTURE_HEADER ||
+            header->magic != PAN_CAPTURE_MAGIC ||
+            header->version != PAN_CAPTURE_VERSION) {
+                fprintf(stderr, "%s is not a panfrost capture\n", argv[optind]);
+                free(buf);
+                return EXIT_FAILURE;
+        }
+
+        int fd = open("/dev/mali0", O_RDWR | O_CLOEXEC);
+
+        if (fd < 0) {
+                fprintf(stderr, "failed to open /dev/mali0: %m\n");
+                free(buf);
+                return EXIT_FAILURE;
+        }
+
+        struct kbase_ k_storage;
+        r.k = &k_storage;
+
+        if (!kbase_open(r.k, fd, PAN_CAPTURE_QUEUES, false)) {
+                fprintf(stderr, "failed to open kbase device\n");
+                close(fd);
+                free(buf);
+                return EXIT_FAILURE;
+        }
+
+        uint64_t gpu_id = 0;
+        r.k->get_pan_gpuprop(r.k, DRM_PANFROST_PARAM_GPU_PROD_ID, &gpu_id);
+
+        if (gpu_id != header->gpu_id) {
+                fprintf(stderr, "warning: captured on GPU 0x%x, replaying on 0x%"PRIx64"\n",
+                        header->gpu_id, gpu_id);
+        }
+
+        util_dynarray_init(&r.live, NULL);
+        util_dynarray_init(&r.regions, NULL);
+        util_dynarray_init(&r.ops, NULL);
+
+        r.ctx = r.k->context_create(r.k);
+        r.syncobj = r.k->syncobj_create(r.k);
+
+        int ret = EXIT_FAILURE;
+        uint64_t *ns = NULL;
+
+        if (!r.ctx || !r.syncobj) {
+                fprintf(stderr, "failed to create context\n");
+                goto out;
+        }
+
+        if (!replay_load(&r, buf, size) || !replay_init_queues(&r))
+                goto out;
+
+        printf("%u frames, %u records\n", r.frames,
+               (unsigned)util_dynarray_num_elements(&r.ops, struct replay_op));
+
+        ns = calloc(iterations * MAX2(r.frames, 1), sizeof(uint64_t));
+
+        for (unsigned i = 0; i < iterations; ++i) {
+                if (!replay_run(&r, ns + i * r.frames))
+                        goto out;
+        }
+
+        replay_print(&r, ns, iterations);
+        ret = EXIT_SUCCESS;
+
+out:
+        free(ns);
+        replay_fini(&r);
+        r.k->close(r.k);
+        free(buf);
+
+        return ret;
+}
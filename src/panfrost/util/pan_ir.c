@@ -24,6 +24,7 @@
  *      Alyssa Rosenzweig <alyssa.rosenzweig@collabora.com>
  */
 
+#include <stdlib.h>
 #include "pan_ir.h"
 #include "util/macros.h"
 
@@ -130,6 +131,97 @@ pan_print_alu_type(nir_alu_type t, FILE *fp)
         fprintf(fp, "%u", size);
 }
 
+static int
+pan_compare_ubo_word(const void *_a, const void *_b)
+{
+        const struct panfrost_ubo_word *a = _a, *b = _b;
+
+        if (a->ubo != b->ubo)
+                return a->ubo - b->ubo;
+        else
+                return a->offset - b->offset;
+}
+
+/* Select UBO words to push, for both Midgard and Bifrost. Greedily take the
+ * range saving the most weighted loads per newly pushed word, so hot ranges
+ * win over cold ones and ranges overlapping what is already pushed come
+ * cheap. Ties are broken in favour of the earlier range, so callers list the
+ * last UBO first to prioritize sysvals. */
+
+void
+pan_pick_ubo_ranges(struct panfrost_ubo_push *push,
+                    struct pan_ubo_range *ranges, unsigned nr_ranges,
+                    unsigned max_words)
+{
+        unsigned first = push->count;
+
+        max_words = MIN2(max_words, PAN_MAX_PUSH);
+
+        for (;;) {
+                signed best = -1;
+                uint64_t best_weight = 0, best_cost = 0;
+
+                for (unsigned i = 0; i < nr_ranges; ++i) {
+                        struct pan_ubo_range *r = &ranges[i];
+
+                        if (r->pushed)
+                                continue;
+
+                        uint64_t weight = r->weight;
+                        uint64_t cost = r->nr_words - util_bitcount(r->pushed_words);
+
+                        /* Don't push more than possible */
+                        if (push->count + cost > max_words)
+                                continue;
+
+                        if (best < 0 || (weight * best_cost) > (best_weight * cost)) {
+                                best = i;
+                                best_weight = weight;
+                                best_cost = cost;
+                        }
+                }
+
+                if (best < 0)
+                        break;
+
+                struct pan_ubo_range *r = &ranges[best];
+
+                for (unsigned offs = 0; offs < r->nr_words; ++offs) {
+                        if (r->pushed_words & BITFIELD_BIT(offs))
+                                continue;
+
+                        struct panfrost_ubo_word word = {
+                                .ubo = r->ubo,
+                                .offset = (r->word + offs) * 4
+                        };
+
+                        push->words[push->count++] = word;
+                }
+
+                r->pushed = true;
+
+                /* Overlapping ranges share the words just pushed */
+                for (unsigned i = 0; i < nr_ranges; ++i) {
+                        struct pan_ubo_range *o = &ranges[i];
+
+                        if (o->ubo != r->ubo)
+                                continue;
+
+                        for (unsigned offs = 0; offs < o->nr_words; ++offs) {
+                                unsigned w = o->word + offs;
+
+                                if (w >= r->word && w < r->word + r->nr_words)
+                                        o->pushed_words |= BITFIELD_BIT(offs);
+                        }
+                }
+        }
+
+        /* Keep words in memory order, so contiguous ranges can be uploaded
+         * with a single copy */
+        qsort(push->words + first, push->count - first, sizeof(push->words[0]),
+              pan_compare_ubo_word);
+}
+
 /* Could optimize with a better data structure if anyone cares, TODO: profile */
 
 unsigned
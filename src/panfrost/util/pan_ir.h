@@ -27,8 +27,13 @@
 #include <stdint.h>
 #include "compiler/nir/nir.h"
 #include "util/u_dynarray.h"
+#include "util/u_math.h"
 #include "util/hash_table.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /* On Valhall, the driver gives the hardware a table of resource tables.
  * Resources are addressed as the index of the table together with the index of
  * the resource within the table. For simplicity, we put one type of resource
@@ -109,6 +114,10 @@ enum {
         PAN_SYSVAL_BLEND_CONSTANTS = 16,
         PAN_SYSVAL_XFB = 17,
         PAN_SYSVAL_NUM_VERTICES = 18,
+        PAN_SYSVAL_XFB_INDICES = 19,
+        PAN_SYSVAL_PREAMBLE = 20,
+        PAN_SYSVAL_VERTEX_FETCH = 21,
+        PAN_SYSVAL_GS = 22,
 };
 
 #define PAN_TXS_SYSVAL_ID(texidx, dim, is_array)          \
@@ -153,11 +162,107 @@ struct panfrost_ubo_word {
         uint16_t offset;
 };
 
+/* Pseudo UBO of push words holding constants of the shader itself, rather
+ * than data from a buffer. The value of push word i is constants[i]. */
+#define PAN_UBO_CONSTANTS UINT16_MAX
+
 struct panfrost_ubo_push {
         unsigned count;
         struct panfrost_ubo_word words[PAN_MAX_PUSH];
+        uint32_t constants[PAN_MAX_PUSH];
 };
 
+/* A range of words read by direct UBO loads, as a candidate for pushing. The
+ * weight estimates the number of loads pushing it saves. */
+struct pan_ubo_range {
+        uint16_t ubo;
+        uint16_t word;
+        uint8_t nr_words;
+
+        /* Filled in by pan_pick_ubo_ranges: words of the range pushed by
+         * overlapping ranges, and whether the range itself was pushed */
+        uint8_t pushed_words;
+        bool pushed;
+
+        uint32_t weight;
+};
+
+/* Estimate how much it is worth to push a load. Assume loops run several
+ * iterations, so loads in loops dominate. */
+static inline uint32_t
+pan_ubo_load_weight(unsigned loop_nesting)
+{
+        return 1u << (3 * MIN2(loop_nesting, 4));
+}
+
+void
+pan_pick_ubo_ranges(struct panfrost_ubo_push *push,
+                    struct pan_ubo_range *ranges, unsigned nr_ranges,
+                    unsigned max_words);
+
+/* Uniform computation hoisted out of a shader by nir_opt_preamble, which the
+ * driver evaluates on the CPU once per draw. The shader reads the results as
+ * PAN_SYSVAL_PREAMBLE sysvals, one vec4 of words each, which are pushed like
+ * any other sysval.
+ *
+ * The program is a list of scalarised operations on an array of values, so
+ * evaluating it doesn't need the NIR around.
+ */
+
+#define PAN_MAX_PREAMBLE_INSTRS 48
+#define PAN_MAX_PREAMBLE_VALUES 128
+#define PAN_MAX_PREAMBLE_WORDS 16
+
+/* Operations other than ALU, numbered after the NIR opcodes */
+enum {
+        PAN_PREAMBLE_LOAD_UBO = nir_num_opcodes,
+        PAN_PREAMBLE_STORE,
+};
+
+struct pan_preamble_instr {
+        /* nir_op for ALU operations */
+        uint16_t op;
+
+        /* Bit size the operation is evaluated at, as for constant folding */
+        uint8_t bit_size;
+        uint8_t num_components;
+
+        /* UBO index for loads, first word written for stores */
+        uint8_t index;
+
+        /* First value written */
+        uint8_t dest;
+
+        /* Value read for each component of each source. Loads take their
+         * byte offset in src[0][0], stores their data in src[0] */
+        uint8_t src[4][4];
+};
+
+struct pan_preamble {
+        unsigned nr_instrs;
+        uint16_t float_controls;
+
+        /* Initial values, with the constants of the program */
+        uint32_t values[PAN_MAX_PREAMBLE_VALUES];
+
+        struct pan_preamble_instr instrs[PAN_MAX_PREAMBLE_INSTRS];
+};
+
+/* Returns the word at a byte offset into a UBO, or zero if out of bounds */
+typedef uint32_t (*pan_preamble_load_ubo)(void *data, unsigned ubo,
+                                          unsigned offset);
+
+bool
+pan_nir_preamble_can_eval(const nir_instr *instr, const void *data);
+
+bool
+pan_nir_collect_preamble(nir_shader *nir, struct pan_preamble *preamble);
+
+void
+pan_preamble_eval(const struct pan_preamble *preamble,
+                  pan_preamble_load_ubo load_ubo, void *data,
+                  uint32_t words[PAN_MAX_PREAMBLE_WORDS]);
+
 /* Helper for searching the above. Note this is O(N) to the number of pushed
  * constants, do not run in the draw call hot path */
 
@@ -177,6 +282,17 @@ pan_lookup_sysval(struct hash_table_u64 *sysval_to_id,
 int
 panfrost_sysval_for_instr(nir_instr *instr, nir_dest *dest);
 
+/* Vertex attributes fetched by the vertex shader itself rather than by the
+ * attribute hardware, see pan_lower_vertex_fetch. Indexed by attribute, with
+ * the instance divisor or 0 for per-vertex attributes. */
+#define PAN_MAX_VERTEX_FETCH 32
+
+struct pan_vertex_fetch {
+        uint32_t mask;
+        enum pipe_format formats[PAN_MAX_VERTEX_FETCH];
+        uint32_t divisors[PAN_MAX_VERTEX_FETCH];
+};
+
 struct panfrost_compile_inputs {
         struct util_debug_callback *debug;
 
@@ -192,10 +308,22 @@ struct panfrost_compile_inputs {
         bool no_idvs;
         bool no_ubo_to_push;
 
+        /* The driver evaluates a pan_preamble for the shader on each draw, so
+         * uniform computation may be hoisted out of the shader */
+        bool cpu_preamble;
+
+        /* The driver uploads PAN_UBO_CONSTANTS push words, so constants may
+         * be pushed instead of being built with instructions */
+        bool push_constants;
+
         enum pipe_format rt_formats[8];
         uint8_t raw_fmt_mask;
         unsigned nr_cbufs;
 
+        /* Render targets whose colour outputs may be computed at half
+         * precision, see pan_nir_lower_fp16_color */
+        uint8_t fp16_rt_mask;
+
         /* Used on Valhall.
          *
          * Bit mask of special desktop-only varyings (e.g VARYING_SLOT_TEX0)
@@ -206,6 +334,33 @@ struct panfrost_compile_inputs {
          */
         uint32_t fixed_varying_mask;
 
+        /* Used on Valhall with malloc IDVS.
+         *
+         * Bit mask of general varyings (bit i for VARYING_SLOT_VAR0 + i)
+         * stored at half precision by the vertex shader, which take 8 bytes
+         * in the varying buffer instead of 16. Like fixed_varying_mask, this
+         * comes from the vertex shader and must match between stages.
+         */
+        uint32_t fp16_varying_mask;
+
+        /* Vertex shaders only */
+        struct pan_vertex_fetch vertex_fetch;
+
+        /* Geometry shader emulation, see pan_lower_gs */
+        struct {
+                /* Vertex shaders feeding a geometry shader: the varying slots
+                 * read by the geometry shader, written to memory instead */
+                uint64_t inputs;
+
+                /* Geometry shaders: primitive type of the draw */
+                enum shader_prim topology;
+        } gs;
+
+        /* Maximum number of iterations of the NIR optimization loop, trading
+         * code quality for compile time, or zero to iterate until the loop
+         * makes no progress */
+        unsigned nir_opt_iterations;
+
         union {
                 struct {
                         bool static_rt_conv;
@@ -214,6 +369,20 @@ struct panfrost_compile_inputs {
         };
 };
 
+/* Byte offset of VARYING_SLOT_VAR0 + index in the Valhall varying buffer.
+ * Special varyings come first, then general varyings, sparsely packed by
+ * location. Each slot takes 16 bytes, except fp16 general varyings which
+ * only take 8. Also gives the buffer size when index is the slot count. */
+static inline unsigned
+pan_varying_general_offset(uint32_t fixed_varying_mask,
+                           uint32_t fp16_varying_mask, unsigned index)
+{
+        unsigned nr_fp16 =
+                util_bitcount(fp16_varying_mask & BITFIELD_MASK(MIN2(index, 32)));
+
+        return (16 * (util_bitcount(fixed_varying_mask) + index)) - (8 * nr_fp16);
+}
+
 struct pan_shader_varying {
         gl_varying_slot location;
         enum pipe_format format;
@@ -379,6 +548,9 @@ struct pan_shader_info {
          * Uniforms (Bifrost) */
         struct panfrost_ubo_push push;
 
+        /* Hoisted uniform computation, if nr_instrs is nonzero */
+        struct pan_preamble preamble;
+
         uint32_t ubo_mask;
 
         union {
@@ -506,12 +678,45 @@ bool pan_has_dest_mod(nir_dest **dest, nir_op op);
 
 bool pan_nir_lower_zs_store(nir_shader *nir);
 bool pan_nir_lower_store_component(nir_shader *shader);
+bool pan_nir_lower_fp16_color(nir_shader *shader, uint8_t rt_mask);
 
 bool pan_nir_lower_64bit_intrin(nir_shader *shader);
 
 bool pan_lower_helper_invocation(nir_shader *shader);
 bool pan_lower_sample_pos(nir_shader *shader);
 bool pan_lower_xfb(nir_shader *nir);
+bool pan_lower_xfb_vertex_fetch(nir_shader *nir);
+bool pan_lower_vertex_fetch(nir_shader *nir,
+                            const struct pan_vertex_fetch *fetch);
+
+/* Buffers of the geometry shader emulation, see pan_lower_gs */
+enum pan_gs_buffer {
+        PAN_GS_BUFFER_INPUTS = 0,
+        PAN_GS_BUFFER_VERTICES = 1,
+        PAN_GS_BUFFER_INDICES = 2,
+        PAN_GS_BUFFER_COUNT,
+};
+
+/* Every vertex in the buffers takes a vec4 per varying slot written, packed
+ * in slot order */
+static inline unsigned
+pan_gs_slot(uint64_t slots, unsigned location)
+{
+        return util_bitcount64(slots & BITFIELD64_MASK(location));
+}
+
+static inline unsigned
+pan_gs_vertex_stride(uint64_t slots)
+{
+        return util_bitcount64(slots) * 16;
+}
+
+unsigned pan_gs_indices_per_invocation(const nir_shader *gs);
+
+bool pan_lower_gs_vs(nir_shader *nir, uint64_t gs_inputs);
+bool pan_lower_gs(nir_shader *nir, enum shader_prim topology);
+nir_shader *pan_gs_passthrough_vs(const nir_shader *gs,
+                                  const nir_shader_compiler_options *options);
 
 void pan_nir_collect_varyings(nir_shader *s, struct pan_shader_info *info);
 
@@ -533,4 +738,45 @@ pan_subgroup_size(unsigned arch)
                 return 1;
 }
 
+/* Architectural maximum of threads per shader core, for when the GPU doesn't
+ * report it. G31 is actually 512 instead of 768 but it doesn't really
+ * matter. */
+static inline unsigned
+pan_arch_max_thread_count(unsigned arch)
+{
+        if (arch >= 8)
+                return 1024;
+        else if (arch >= 7)
+                return 768;
+        else if (arch >= 6)
+                return 384;
+        else
+                return 256;
+}
+
+/*
+ * Number of threads a shader core can run at once with a shader using
+ * work_reg_count registers, bounded by the thread limit and the register file
+ * of the core. Registers are allocated per thread in steps of 4, 8 or 16 on
+ * Midgard and 32 or 64 on Bifrost and Valhall, so register pressure trades
+ * off against occupancy.
+ */
+static inline unsigned
+pan_max_threads_per_core(unsigned arch, unsigned max_threads,
+                         unsigned registers, unsigned work_reg_count)
+{
+        unsigned aligned;
+
+        if (arch <= 5)
+                aligned = util_next_power_of_two(MAX2(work_reg_count, 4));
+        else
+                aligned = (work_reg_count <= 32) ? 32 : 64;
+
+        return MAX2(MIN2(max_threads, registers / aligned), 1);
+}
+
+#ifdef __cplusplus
+} /* extern C */
+#endif
+
 #endif
@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2022 Collabora Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include "pan_ir.h"
+#include "compiler/nir/nir_builder.h"
+
+/*
+ * Desktop GLSL rarely has precision qualifiers, so colour math stored to
+ * 8-bit UNORM render targets runs at full precision even though the result
+ * is quantized to 1/255 anyway. Demote such computations to fp16, which
+ * Valhall executes two lanes at a time.
+ *
+ * A colour store is demoted if its value is computed by a tree of simple
+ * float arithmetic over leaves that are texture results, varyings,
+ * constants in fp16 range, or saturated values. Along any path, the tree may
+ * round at most PAN_FP16_MAX_ROUNDS times (counting the conversion of a
+ * leaf), which keeps the relative error below half a UNORM8 step. Values in
+ * the tree must not be used by anything else, so nothing outside the colour
+ * output sees the lower precision.
+ *
+ * Texture and varying values are assumed to be colours, that is, to fit in
+ * fp16 range. That cannot be proven in general, which is why the pass is
+ * opt-in.
+ */
+
+#define PAN_FP16_MAX_ROUNDS 4
+
+struct pan_fp16_state {
+        /* Per SSA def: the number of rounds along the longest path if the
+         * def may be computed in fp16, -1 if it may not, 0 if unvisited */
+        int8_t *depth;
+
+        /* Defs computed in fp32 and converted where they are used */
+        BITSET_WORD *leaf;
+
+        /* Defs computed in fp16 */
+        BITSET_WORD *promoted;
+};
+
+/* Number of roundings introduced by an opcode, or -1 if it is not handled */
+static int
+pan_fp16_rounds(nir_op op)
+{
+        switch (op) {
+        case nir_op_mov:
+        case nir_op_vec2:
+        case nir_op_vec3:
+        case nir_op_vec4:
+        case nir_op_fneg:
+        case nir_op_fabs:
+        case nir_op_fsat:
+        case nir_op_fmin:
+        case nir_op_fmax:
+        case nir_op_bcsel:
+                return 0;
+        case nir_op_fadd:
+        case nir_op_fmul:
+        case nir_op_ffma:
+                return 1;
+        case nir_op_flrp:
+                return 2;
+        default:
+                return -1;
+        }
+}
+
+/* The condition of a bcsel is not colour data */
+static unsigned
+pan_fp16_first_src(const nir_alu_instr *alu)
+{
+        return alu->op == nir_op_bcsel ? 1 : 0;
+}
+
+static bool
+pan_fp16_is_leaf(nir_ssa_def *def)
+{
+        nir_instr *instr = def->parent_instr;
+
+        switch (instr->type) {
+        case nir_instr_type_load_const: {
+                nir_load_const_instr *load = nir_instr_as_load_const(instr);
+
+                for (unsigned i = 0; i < def->num_components; ++i) {
+                        double v = nir_const_value_as_float(load->value[i],
+                                                            def->bit_size);
+
+                        /* Also rejects NaN */
+                        if (!(fabs(v) <= 65504.0))
+                                return false;
+                }
+
+                return true;
+        }
+
+        case nir_instr_type_tex: {
+                nir_tex_instr *tex = nir_instr_as_tex(instr);
+                return nir_alu_type_get_base_type(tex->dest_type) == nir_type_float;
+        }
+
+        case nir_instr_type_intrinsic: {
+                nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+
+                if (intr->intrinsic != nir_intrinsic_load_interpolated_input &&
+                    intr->intrinsic != nir_intrinsic_load_input)
+                        return false;
+
+                return nir_alu_type_get_base_type(nir_intrinsic_dest_type(intr)) == nir_type_float;
+        }
+
+        case nir_instr_type_alu: {
+                nir_alu_instr *alu = nir_instr_as_alu(instr);
+
+                /* Saturated, or widened from fp16 */
+                return alu->op == nir_op_fsat ||
+                       (alu->op == nir_op_f2f32 &&
+                        nir_src_bit_size(alu->src[0].src) == 16);
+        }
+
+        default:
+                return false;
+        }
+}
+
+static int
+pan_fp16_classify(struct pan_fp16_state *state, nir_ssa_def *def)
+{
+        if (state->depth[def->index])
+                return state->depth[def->index];
+
+        int depth = -1;
+
+        if (def->bit_size == 32 && def->parent_instr->type == nir_instr_type_alu) {
+                nir_alu_instr *alu = nir_instr_as_alu(def->parent_instr);
+                int rounds = pan_fp16_rounds(alu->op);
+
+                for (unsigned s = pan_fp16_first_src(alu);
+                     rounds >= 0 && s < nir_op_infos[alu->op].num_inputs; ++s) {
+                        if (!alu->src[s].src.is_ssa) {
+                                rounds = -1;
+                                break;
+                        }
+
+                        int d = pan_fp16_classify(state, alu->src[s].src.ssa);
+                        depth = MAX2(depth, d);
+
+                        if (d < 0)
+                                rounds = -1;
+                }
+
+                depth = (rounds >= 0) ? (depth + rounds) : -1;
+
+                if (depth > PAN_FP16_MAX_ROUNDS)
+                        depth = -1;
+        }
+
+        /* Otherwise, compute in fp32 and convert */
+        if (depth < 0 && def->bit_size == 32 && pan_fp16_is_leaf(def)) {
+                BITSET_SET(state->leaf, def->index);
+                depth = 1;
+        }
+
+        state->depth[def->index] = depth;
+        return depth;
+}
+
+static void
+pan_fp16_mark(struct pan_fp16_state *state, nir_ssa_def *def)
+{
+        if (BITSET_TEST(state->leaf, def->index) ||
+            BITSET_TEST(state->promoted, def->index))
+                return;
+
+        BITSET_SET(state->promoted, def->index);
+
+        nir_alu_instr *alu = nir_instr_as_alu(def->parent_instr);
+
+        for (unsigned s = pan_fp16_first_src(alu); s < nir_op_infos[alu->op].num_inputs; ++s)
+                pan_fp16_mark(state, alu->src[s].src.ssa);
+}
+
+/* Check that the promoted defs of a tree are only used by promoted
+ * instructions or by colour stores that are demoted too */
+static bool
+pan_fp16_uses_contained(struct pan_fp16_state *state, nir_ssa_def *def)
+{
+        if (BITSET_TEST(state->leaf, def->index))
+                return true;
+
+        if (!list_is_empty(&def->if_uses))
+                return false;
+
+        nir_foreach_use(use, def) {
+                nir_instr *parent = use->parent_instr;
+
+                if (parent->type == nir_instr_type_alu) {
+                        nir_alu_instr *alu = nir_instr_as_alu(parent);
+
+                        if (!BITSET_TEST(state->promoted, alu->dest.dest.ssa.index))
+                                return false;
+                } else if (parent->type == nir_instr_type_intrinsic) {
+                        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(parent);
+
+                        if (!parent->pass_flags || use != &intr->src[0])
+                                return false;
+                } else {
+                        return false;
+                }
+        }
+
+        nir_alu_instr *alu = nir_instr_as_alu(def->parent_instr);
+
+        for (unsigned s = pan_fp16_first_src(alu); s < nir_op_infos[alu->op].num_inputs; ++s) {
+                if (!pan_fp16_uses_contained(state, alu->src[s].src.ssa))
+                        return false;
+        }
+
+        return true;
+}
+
+static bool
+pan_fp16_is_candidate(struct pan_fp16_state *state, nir_intrinsic_instr *intr,
+                      uint8_t rt_mask)
+{
+        nir_io_semantics sem = nir_intrinsic_io_semantics(intr);
+
+        if (sem.location < FRAG_RESULT_DATA0 || !nir_src_is_const(intr->src[1]))
+                return false;
+
+        unsigned rt = sem.location - FRAG_RESULT_DATA0 + nir_src_as_uint(intr->src[1]);
+
+        if (rt >= 8 || !(rt_mask & BITFIELD_BIT(rt)))
+                return false;
+
+        if (nir_intrinsic_src_type(intr) != nir_type_float32 || !intr->src[0].is_ssa)
+                return false;
+
+        nir_ssa_def *value = intr->src[0].ssa;
+
+        /* Nothing to gain without arithmetic */
+        return pan_fp16_classify(state, value) > 0 &&
+               !BITSET_TEST(state->leaf, value->index);
+}
+
+bool
+pan_nir_lower_fp16_color(nir_shader *shader, uint8_t rt_mask)
+{
+        if (shader->info.stage != MESA_SHADER_FRAGMENT ||
+            shader->info.fs.untyped_color_outputs || !rt_mask)
+                return false;
+
+        nir_function_impl *impl = nir_shader_get_entrypoint(shader);
+        nir_index_ssa_defs(impl);
+
+        struct pan_fp16_state state = {
+                .depth = calloc(impl->ssa_alloc, sizeof(int8_t)),
+                .leaf = calloc(BITSET_WORDS(impl->ssa_alloc), sizeof(BITSET_WORD)),
+                .promoted = calloc(BITSET_WORDS(impl->ssa_alloc), sizeof(BITSET_WORD)),
+        };
+
+        struct util_dynarray stores;
+        util_dynarray_init(&stores, NULL);
+
+        bool dual_source = false;
+
+        nir_foreach_block(block, impl) {
+                nir_foreach_instr(instr, block) {
+                        instr->pass_flags = 0;
+
+                        if (instr->type != nir_instr_type_intrinsic)
+                                continue;
+
+                        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+
+                        if (intr->intrinsic != nir_intrinsic_store_output)
+                                continue;
+
+                        /* Both blend sources must have the same type */
+                        if (nir_intrinsic_io_semantics(intr).dual_source_blend_index)
+                                dual_source = true;
+
+                        if (pan_fp16_is_candidate(&state, intr, rt_mask)) {
+                                instr->pass_flags = 1;
+                                util_dynarray_append(&stores, nir_intrinsic_instr *, intr);
+                        }
+                }
+        }
+
+        /* Dropping a store shrinks the promoted set, which can in turn leave
+         * uses of another store's tree outside of it, so iterate */
+        bool changed = !dual_source;
+
+        while (changed) {
+                changed = false;
+                memset(state.promoted, 0,
+                       BITSET_WORDS(impl->ssa_alloc) * sizeof(BITSET_WORD));
+
+                util_dynarray_foreach(&stores, nir_intrinsic_instr *, store) {
+                        if ((*store)->instr.pass_flags)
+                                pan_fp16_mark(&state, (*store)->src[0].ssa);
+                }
+
+                util_dynarray_foreach(&stores, nir_intrinsic_instr *, store) {
+                        if ((*store)->instr.pass_flags &&
+                            !pan_fp16_uses_contained(&state, (*store)->src[0].ssa)) {
+                                (*store)->instr.pass_flags = 0;
+                                changed = true;
+                        }
+                }
+        }
+
+        bool progress = false;
+        nir_builder b;
+        nir_builder_init(&b, impl);
+
+        util_dynarray_foreach(&stores, nir_intrinsic_instr *, store) {
+                if (!dual_source && (*store)->instr.pass_flags) {
+                        nir_intrinsic_set_src_type(*store, nir_type_float16);
+                        progress = true;
+                }
+        }
+
+        if (progress) {
+                nir_foreach_block(block, impl) {
+                        nir_foreach_instr(instr, block) {
+                                if (instr->type != nir_instr_type_alu)
+                                        continue;
+
+                                nir_alu_instr *alu = nir_instr_as_alu(instr);
+
+                                if (!BITSET_TEST(state.promoted, alu->dest.dest.ssa.index))
+                                        continue;
+
+                                b.cursor = nir_before_instr(instr);
+
+                                for (unsigned s = pan_fp16_first_src(alu);
+                                     s < nir_op_infos[alu->op].num_inputs; ++s) {
+                                        nir_ssa_def *src = alu->src[s].src.ssa;
+
+                                        if (!BITSET_TEST(state.promoted, src->index)) {
+                                                nir_instr_rewrite_src_ssa(instr, &alu->src[s].src,
+                                                                          nir_f2f16(&b, src));
+                                        }
+                                }
+
+                                alu->dest.dest.ssa.bit_size = 16;
+                        }
+                }
+        }
+
+        util_dynarray_fini(&stores);
+        free(state.depth);
+        free(state.leaf);
+        free(state.promoted);
+
+        if (progress) {
+                nir_metadata_preserve(impl, nir_metadata_block_index |
+                                            nir_metadata_dominance);
+        } else {
+                nir_metadata_preserve(impl, nir_metadata_all);
+        }
+
+        return progress;
+}
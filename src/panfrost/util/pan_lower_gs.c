@@ -0,0 +1,637 @@
+/*
+ * Copyright (C) 2023 Collabora Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pan_ir.h"
+#include "compiler/nir/nir_builder.h"
+
+/*
+ * Mali has no geometry shader stage, so geometry shaders are emulated with
+ * compute jobs ahead of the draw:
+ *
+ * 1. The vertex shader runs as a compute job, with one thread per vertex of
+ *    the draw in draw order, like the transform feedback program. It stores
+ *    the varyings the geometry shader reads to PAN_GS_BUFFER_INPUTS instead of
+ *    the varying buffer, see pan_lower_gs_vs.
+ *
+ * 2. The geometry shader runs as a compute kernel, see pan_lower_gs, with one
+ *    workgroup of a single thread per input primitive (x), instance (y) and
+ *    geometry shader invocation (z). Each invocation owns max_vertices slots
+ *    in PAN_GS_BUFFER_VERTICES, and a range of PAN_GS_BUFFER_INDICES where it
+ *    writes the index of each vertex it emits, with a primitive restart
+ *    between its primitives. Invocations follow each other in rasterization
+ *    order, and the indices past the last one written are restarts too.
+ *
+ * 3. A passthrough vertex shader, see pan_gs_passthrough_vs, loads the
+ *    varyings of the vertex given by its index, in a regular indexed draw of
+ *    the output primitive type with primitive restart.
+ *
+ * Only the first vertex stream is rasterized, and there is no transform
+ * feedback of the geometry shader outputs.
+ */
+
+/* Points don't need restarts, the rest need at most one per vertex */
+
+unsigned
+pan_gs_indices_per_invocation(const nir_shader *gs)
+{
+        unsigned max_vertices = gs->info.gs.vertices_out;
+
+        if (gs->info.gs.output_primitive == SHADER_PRIM_POINTS)
+                return max_vertices;
+        else
+                return max_vertices * 2;
+}
+
+static nir_ssa_def *
+pan_gs_to_32bit(nir_builder *b, nir_ssa_def *value, nir_alu_type type)
+{
+        if (value->bit_size == 32)
+                return value;
+
+        return nir_convert_to_bit_size(b, value,
+                                       nir_alu_type_get_base_type(type), 32);
+}
+
+/* Vertex shader side. The index of a vertex in the buffer follows the thread,
+ * as for pan_lower_xfb, so the geometry shader can find it from the vertex
+ * count of the draw. */
+
+static bool
+lower_gs_vs_output(nir_builder *b, nir_instr *instr, void *data)
+{
+        uint64_t gs_inputs = *((uint64_t *) data);
+
+        if (instr->type != nir_instr_type_intrinsic)
+                return false;
+
+        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+        if (intr->intrinsic != nir_intrinsic_store_output)
+                return false;
+
+        nir_io_semantics sem = nir_intrinsic_io_semantics(intr);
+
+        /* Varyings the geometry shader doesn't read are dropped */
+        if (!(gs_inputs & BITFIELD64_BIT(sem.location))) {
+                nir_instr_remove(instr);
+                return true;
+        }
+
+        b->cursor = nir_before_instr(instr);
+
+        nir_ssa_def *index = nir_iadd(b,
+                nir_imul(b, nir_load_instance_id(b), nir_load_num_vertices(b)),
+                nir_load_vertex_id_zero_base(b));
+
+        BITSET_SET(b->shader->info.system_values_read, SYSTEM_VALUE_VERTEX_ID_ZERO_BASE);
+        BITSET_SET(b->shader->info.system_values_read, SYSTEM_VALUE_INSTANCE_ID);
+
+        /* Arrays take consecutive slots, so an indirect offset is relative to
+         * the slot of the first element */
+        nir_ssa_def *slot =
+                nir_iadd_imm(b, nir_get_io_offset_src(intr)->ssa,
+                             pan_gs_slot(gs_inputs, sem.location));
+
+        nir_ssa_def *offset =
+                nir_iadd_imm(b,
+                             nir_iadd(b, nir_imul_imm(b, index,
+                                                      pan_gs_vertex_stride(gs_inputs)),
+                                      nir_imul_imm(b, slot, 16)),
+                             nir_intrinsic_component(intr) * 4);
+
+        nir_ssa_def *addr =
+                nir_iadd(b, nir_load_gs_buffer_pan(b, .base = PAN_GS_BUFFER_INPUTS),
+                         nir_u2u64(b, offset));
+
+        nir_ssa_def *value = pan_gs_to_32bit(b, intr->src[0].ssa,
+                                             nir_intrinsic_src_type(intr));
+
+        nir_store_global(b, addr, 4, value, nir_intrinsic_write_mask(intr));
+        nir_instr_remove(instr);
+        return true;
+}
+
+bool
+pan_lower_gs_vs(nir_shader *nir, uint64_t gs_inputs)
+{
+        assert(nir->info.stage == MESA_SHADER_VERTEX);
+
+        return nir_shader_instructions_pass(nir, lower_gs_vs_output,
+                                            nir_metadata_block_index |
+                                            nir_metadata_dominance,
+                                            &gs_inputs);
+}
+
+/* Geometry shader side */
+
+struct lower_gs_state {
+        uint64_t inputs, outputs;
+        unsigned max_vertices, indices_per_invocation;
+        bool restarts;
+
+        /* Workgroup ID, and the index of the invocation among all the
+         * invocations of the draw */
+        nir_ssa_def *prim, *instance, *invocation, *index;
+        nir_ssa_def *num_vertices;
+
+        /* Values of the outputs stored since the last vertex, as a vec4 of
+         * words per slot */
+        nir_variable *values;
+
+        nir_variable *vertex_count, *index_count, *prim_vertex_count;
+};
+
+/* Number of input primitives in a draw of the topology */
+
+static nir_ssa_def *
+pan_gs_input_prims(nir_builder *b, enum shader_prim topology,
+                   nir_ssa_def *count)
+{
+        switch (topology) {
+        case SHADER_PRIM_POINTS:
+        case SHADER_PRIM_LINE_LOOP:
+                return count;
+        case SHADER_PRIM_LINES:
+                return nir_ushr_imm(b, count, 1);
+        case SHADER_PRIM_LINES_ADJACENCY:
+                return nir_ushr_imm(b, count, 2);
+        case SHADER_PRIM_TRIANGLES:
+                return nir_udiv_imm(b, count, 3);
+        case SHADER_PRIM_TRIANGLES_ADJACENCY:
+                return nir_udiv_imm(b, count, 6);
+        case SHADER_PRIM_LINE_STRIP:
+                return nir_iadd_imm(b, count, -1);
+        case SHADER_PRIM_TRIANGLE_STRIP:
+        case SHADER_PRIM_TRIANGLE_FAN:
+                return nir_iadd_imm(b, count, -2);
+        case SHADER_PRIM_LINE_STRIP_ADJACENCY:
+                return nir_iadd_imm(b, count, -3);
+        default:
+                unreachable("Unsupported geometry shader input topology");
+        }
+}
+
+/* Vertex of the draw read as vertex i of input primitive prim, with the
+ * vertex order of the OpenGL spec for geometry shader inputs */
+
+static nir_ssa_def *
+pan_gs_input_vertex(nir_builder *b, enum shader_prim topology,
+                    nir_ssa_def *prim, nir_ssa_def *i, nir_ssa_def *count)
+{
+        switch (topology) {
+        case SHADER_PRIM_POINTS:
+                return prim;
+        case SHADER_PRIM_LINES:
+                return nir_iadd(b, nir_imul_imm(b, prim, 2), i);
+        case SHADER_PRIM_LINES_ADJACENCY:
+                return nir_iadd(b, nir_imul_imm(b, prim, 4), i);
+        case SHADER_PRIM_TRIANGLES:
+                return nir_iadd(b, nir_imul_imm(b, prim, 3), i);
+        case SHADER_PRIM_TRIANGLES_ADJACENCY:
+                return nir_iadd(b, nir_imul_imm(b, prim, 6), i);
+        case SHADER_PRIM_LINE_STRIP:
+        case SHADER_PRIM_LINE_STRIP_ADJACENCY:
+                return nir_iadd(b, prim, i);
+        case SHADER_PRIM_LINE_LOOP: {
+                nir_ssa_def *v = nir_iadd(b, prim, i);
+                return nir_bcsel(b, nir_ieq(b, v, count), nir_imm_int(b, 0), v);
+        }
+        case SHADER_PRIM_TRIANGLE_STRIP: {
+                /* Odd triangles swap their first two vertices to keep the
+                 * winding of the strip */
+                nir_ssa_def *first = nir_iadd(b, prim,
+                                              nir_ixor(b, i, nir_iand_imm(b, prim, 1)));
+                return nir_bcsel(b, nir_ult(b, i, nir_imm_int(b, 2)), first,
+                                 nir_iadd_imm(b, prim, 2));
+        }
+        case SHADER_PRIM_TRIANGLE_FAN:
+                return nir_bcsel(b, nir_ieq_imm(b, i, 0), nir_imm_int(b, 0),
+                                 nir_iadd(b, prim, i));
+        default:
+                unreachable("Unsupported geometry shader input topology");
+        }
+}
+
+static void
+lower_gs_load_input(nir_builder *b, nir_intrinsic_instr *intr,
+                    struct lower_gs_state *state, enum shader_prim topology)
+{
+        nir_io_semantics sem = nir_intrinsic_io_semantics(intr);
+
+        nir_ssa_def *vertex =
+                pan_gs_input_vertex(b, topology, state->prim,
+                                    intr->src[0].ssa, state->num_vertices);
+
+        nir_ssa_def *index =
+                nir_iadd(b, nir_imul(b, state->instance, state->num_vertices),
+                         vertex);
+
+        nir_ssa_def *slot =
+                nir_iadd_imm(b, nir_get_io_offset_src(intr)->ssa,
+                             pan_gs_slot(state->inputs, sem.location));
+
+        nir_ssa_def *offset =
+                nir_iadd_imm(b,
+                             nir_iadd(b, nir_imul_imm(b, index,
+                                                      pan_gs_vertex_stride(state->inputs)),
+                                      nir_imul_imm(b, slot, 16)),
+                             nir_intrinsic_component(intr) * 4);
+
+        nir_ssa_def *addr =
+                nir_iadd(b, nir_load_gs_buffer_pan(b, .base = PAN_GS_BUFFER_INPUTS),
+                         nir_u2u64(b, offset));
+
+        nir_ssa_def *value = nir_load_global(b, addr, 4, intr->num_components, 32);
+        unsigned bit_size = nir_dest_bit_size(intr->dest);
+
+        if (bit_size != 32) {
+                nir_alu_type type = nir_intrinsic_dest_type(intr);
+                value = nir_convert_to_bit_size(b, value,
+                                                nir_alu_type_get_base_type(type),
+                                                bit_size);
+        }
+
+        nir_ssa_def_rewrite_uses(&intr->dest.ssa, value);
+}
+
+static void
+lower_gs_store_output(nir_builder *b, nir_intrinsic_instr *intr,
+                      struct lower_gs_state *state)
+{
+        nir_io_semantics sem = nir_intrinsic_io_semantics(intr);
+
+        if (!(state->outputs & BITFIELD64_BIT(sem.location)))
+                return;
+
+        nir_ssa_def *slot =
+                nir_iadd_imm(b, nir_get_io_offset_src(intr)->ssa,
+                             pan_gs_slot(state->outputs, sem.location));
+
+        nir_ssa_def *value = pan_gs_to_32bit(b, intr->src[0].ssa,
+                                             nir_intrinsic_src_type(intr));
+
+        unsigned component = nir_intrinsic_component(intr);
+        nir_ssa_def *channels[4];
+
+        for (unsigned i = 0; i < 4; ++i) {
+                if (i >= component && i < component + value->num_components)
+                        channels[i] = nir_channel(b, value, i - component);
+                else
+                        channels[i] = nir_ssa_undef(b, 1, 32);
+        }
+
+        nir_deref_instr *deref =
+                nir_build_deref_array(b, nir_build_deref_var(b, state->values),
+                                      slot);
+
+        nir_store_deref(b, deref, nir_vec(b, channels, 4),
+                        nir_intrinsic_write_mask(intr) << component);
+}
+
+static void
+pan_gs_write_index(nir_builder *b, struct lower_gs_state *state,
+                   nir_ssa_def *value)
+{
+        nir_ssa_def *count = nir_load_var(b, state->index_count);
+
+        nir_ssa_def *offset =
+                nir_imul_imm(b,
+                             nir_iadd(b, nir_imul_imm(b, state->index,
+                                                      state->indices_per_invocation),
+                                      count),
+                             4);
+
+        nir_ssa_def *addr =
+                nir_iadd(b, nir_load_gs_buffer_pan(b, .base = PAN_GS_BUFFER_INDICES),
+                         nir_u2u64(b, offset));
+
+        nir_store_global(b, addr, 4, value, 0x1);
+        nir_store_var(b, state->index_count, nir_iadd_imm(b, count, 1), 0x1);
+}
+
+/* Vertices past max_vertices are undefined, they are dropped */
+
+static void
+lower_gs_emit_vertex(nir_builder *b, struct lower_gs_state *state)
+{
+        nir_ssa_def *count = nir_load_var(b, state->vertex_count);
+
+        nir_push_if(b, nir_ult(b, count, nir_imm_int(b, state->max_vertices)));
+        {
+                nir_ssa_def *vertex =
+                        nir_iadd(b, nir_imul_imm(b, state->index,
+                                                 state->max_vertices),
+                                 count);
+
+                nir_ssa_def *base =
+                        nir_iadd(b, nir_load_gs_buffer_pan(b, .base = PAN_GS_BUFFER_VERTICES),
+                                 nir_u2u64(b, nir_imul_imm(b, vertex,
+                                                           pan_gs_vertex_stride(state->outputs))));
+
+                unsigned slots = util_bitcount64(state->outputs);
+                nir_deref_instr *values = nir_build_deref_var(b, state->values);
+
+                for (unsigned i = 0; i < slots; ++i) {
+                        nir_ssa_def *value =
+                                nir_load_deref(b, nir_build_deref_array_imm(b, values, i));
+
+                        nir_store_global(b, nir_iadd_imm(b, base, i * 16), 16,
+                                         value, 0xF);
+                }
+
+                pan_gs_write_index(b, state, vertex);
+
+                nir_store_var(b, state->vertex_count,
+                              nir_iadd_imm(b, count, 1), 0x1);
+                nir_store_var(b, state->prim_vertex_count,
+                              nir_iadd_imm(b, nir_load_var(b, state->prim_vertex_count), 1),
+                              0x1);
+        }
+        nir_pop_if(b, NULL);
+}
+
+/* Ending an empty primitive does nothing, so there are never more restarts
+ * than vertices */
+
+static void
+lower_gs_end_primitive(nir_builder *b, struct lower_gs_state *state)
+{
+        if (!state->restarts)
+                return;
+
+        nir_push_if(b, nir_ine_imm(b, nir_load_var(b, state->prim_vertex_count), 0));
+        {
+                pan_gs_write_index(b, state, nir_imm_int(b, ~0));
+                nir_store_var(b, state->prim_vertex_count, nir_imm_int(b, 0), 0x1);
+        }
+        nir_pop_if(b, NULL);
+}
+
+/* Restarts fill the rest of the indices of the invocation */
+
+static void
+lower_gs_fill_indices(nir_builder *b, struct lower_gs_state *state)
+{
+        nir_push_loop(b);
+        {
+                nir_ssa_def *count = nir_load_var(b, state->index_count);
+
+                nir_push_if(b, nir_uge(b, count,
+                                       nir_imm_int(b, state->indices_per_invocation)));
+                {
+                        nir_jump(b, nir_jump_break);
+                }
+                nir_pop_if(b, NULL);
+
+                pan_gs_write_index(b, state, nir_imm_int(b, ~0));
+        }
+        nir_pop_loop(b, NULL);
+}
+
+static bool
+lower_gs_instr(nir_builder *b, nir_intrinsic_instr *intr,
+               struct lower_gs_state *state, enum shader_prim topology)
+{
+        b->cursor = nir_before_instr(&intr->instr);
+
+        switch (intr->intrinsic) {
+        case nir_intrinsic_load_per_vertex_input:
+                lower_gs_load_input(b, intr, state, topology);
+                break;
+
+        case nir_intrinsic_store_output:
+                lower_gs_store_output(b, intr, state);
+                break;
+
+        case nir_intrinsic_emit_vertex:
+        case nir_intrinsic_emit_vertex_with_counter:
+                if (nir_intrinsic_stream_id(intr) == 0)
+                        lower_gs_emit_vertex(b, state);
+                break;
+
+        case nir_intrinsic_end_primitive:
+        case nir_intrinsic_end_primitive_with_counter:
+                if (nir_intrinsic_stream_id(intr) == 0)
+                        lower_gs_end_primitive(b, state);
+                break;
+
+        case nir_intrinsic_set_vertex_and_primitive_count:
+                break;
+
+        case nir_intrinsic_load_primitive_id:
+                nir_ssa_def_rewrite_uses(&intr->dest.ssa, state->prim);
+                break;
+
+        case nir_intrinsic_load_invocation_id:
+                nir_ssa_def_rewrite_uses(&intr->dest.ssa, state->invocation);
+                break;
+
+        default:
+                return false;
+        }
+
+        nir_instr_remove(&intr->instr);
+        return true;
+}
+
+bool
+pan_lower_gs(nir_shader *nir, enum shader_prim topology)
+{
+        assert(nir->info.stage == MESA_SHADER_GEOMETRY);
+
+        unsigned invocations = MAX2(nir->info.gs.invocations, 1);
+
+        struct lower_gs_state state = {
+                .inputs = nir->info.inputs_read,
+                .outputs = nir->info.outputs_written,
+                .max_vertices = nir->info.gs.vertices_out,
+                .indices_per_invocation = pan_gs_indices_per_invocation(nir),
+                .restarts = nir->info.gs.output_primitive != SHADER_PRIM_POINTS,
+        };
+
+        NIR_PASS_V(nir, nir_lower_returns);
+
+        nir_function_impl *impl = nir_shader_get_entrypoint(nir);
+        nir_builder b;
+
+        nir_builder_init(&b, impl);
+        b.cursor = nir_before_cf_list(&impl->body);
+
+        nir_ssa_def *id = nir_load_workgroup_id(&b, 32);
+        state.prim = nir_channel(&b, id, 0);
+        state.instance = nir_channel(&b, id, 1);
+        state.invocation = nir_channel(&b, id, 2);
+        state.num_vertices = nir_load_num_vertices(&b);
+
+        /* Instances follow each other, then primitives, then invocations */
+        nir_ssa_def *prims = pan_gs_input_prims(&b, topology, state.num_vertices);
+        state.index =
+                nir_iadd(&b,
+                         nir_imul_imm(&b,
+                                      nir_iadd(&b, nir_imul(&b, state.instance, prims),
+                                               state.prim),
+                                      invocations),
+                         state.invocation);
+
+        state.values =
+                nir_local_variable_create(impl,
+                        glsl_array_type(glsl_uvec4_type(),
+                                        MAX2(util_bitcount64(state.outputs), 1), 0),
+                        "gs_values");
+        state.vertex_count =
+                nir_local_variable_create(impl, glsl_uint_type(), "gs_vertex_count");
+        state.index_count =
+                nir_local_variable_create(impl, glsl_uint_type(), "gs_index_count");
+        state.prim_vertex_count =
+                nir_local_variable_create(impl, glsl_uint_type(), "gs_prim_vertex_count");
+
+        nir_store_var(&b, state.vertex_count, nir_imm_int(&b, 0), 0x1);
+        nir_store_var(&b, state.index_count, nir_imm_int(&b, 0), 0x1);
+        nir_store_var(&b, state.prim_vertex_count, nir_imm_int(&b, 0), 0x1);
+
+        /* Emitting vertices adds control flow, so collect the instructions
+         * before lowering them */
+        struct util_dynarray instrs;
+        util_dynarray_init(&instrs, NULL);
+
+        nir_foreach_block(block, impl) {
+                nir_foreach_instr(instr, block) {
+                        if (instr->type == nir_instr_type_intrinsic) {
+                                util_dynarray_append(&instrs, nir_intrinsic_instr *,
+                                                     nir_instr_as_intrinsic(instr));
+                        }
+                }
+        }
+
+        util_dynarray_foreach(&instrs, nir_intrinsic_instr *, intr)
+                lower_gs_instr(&b, *intr, &state, topology);
+
+        util_dynarray_fini(&instrs);
+
+        b.cursor = nir_after_cf_list(&impl->body);
+        lower_gs_fill_indices(&b, &state);
+
+        nir_metadata_preserve(impl, nir_metadata_none);
+
+        /* From here on, this is a compute kernel of one thread per
+         * workgroup */
+        nir_foreach_variable_with_modes_safe(var, nir, nir_var_shader_in |
+                                                       nir_var_shader_out)
+                exec_node_remove(&var->node);
+
+        nir->info.stage = MESA_SHADER_COMPUTE;
+        memset(&nir->info.cs, 0, sizeof(nir->info.cs));
+        nir->info.workgroup_size[0] = 1;
+        nir->info.workgroup_size[1] = 1;
+        nir->info.workgroup_size[2] = 1;
+        nir->info.workgroup_size_variable = false;
+        nir->info.inputs_read = 0;
+        nir->info.outputs_written = 0;
+        nir->num_inputs = 0;
+        nir->num_outputs = 0;
+
+        NIR_PASS_V(nir, nir_lower_indirect_derefs, nir_var_function_temp, ~0);
+        NIR_PASS_V(nir, nir_lower_vars_to_ssa);
+
+        return true;
+}
+
+/* The type of the passthrough vertex shader output of a slot, a vec4 of the
+ * base type of the geometry shader output in the slot */
+
+static const nir_variable *
+pan_gs_output_var(const nir_shader *gs, unsigned location)
+{
+        nir_foreach_shader_out_variable(var, gs) {
+                unsigned slots = var->data.compact ?
+                        DIV_ROUND_UP(var->data.location_frac +
+                                     glsl_get_length(var->type), 4) :
+                        glsl_count_attribute_slots(var->type, false);
+
+                if (location >= var->data.location &&
+                    location < var->data.location + slots)
+                        return var;
+        }
+
+        return NULL;
+}
+
+nir_shader *
+pan_gs_passthrough_vs(const nir_shader *gs,
+                      const nir_shader_compiler_options *options)
+{
+        nir_builder b =
+                nir_builder_init_simple_shader(MESA_SHADER_VERTEX, options,
+                                               "%s@gs_vs",
+                                               gs->info.name ? gs->info.name : "gs");
+
+        b.shader->info.internal = true;
+
+        uint64_t outputs = gs->info.outputs_written;
+
+        /* The vertex ID is the index written by the geometry shader */
+        nir_ssa_def *base =
+                nir_iadd(&b, nir_load_gs_buffer_pan(&b, .base = PAN_GS_BUFFER_VERTICES),
+                         nir_u2u64(&b, nir_imul_imm(&b, nir_load_vertex_id(&b),
+                                                    pan_gs_vertex_stride(outputs))));
+
+        u_foreach_bit64(location, outputs) {
+                const nir_variable *gs_var = pan_gs_output_var(gs, location);
+                enum glsl_base_type base_type = GLSL_TYPE_FLOAT;
+
+                if (gs_var && !gs_var->data.compact) {
+                        enum glsl_base_type t =
+                                glsl_get_base_type(glsl_without_array(gs_var->type));
+
+                        if (t == GLSL_TYPE_INT || t == GLSL_TYPE_UINT)
+                                base_type = t;
+                }
+
+                unsigned components = (location == VARYING_SLOT_PSIZ) ? 1 : 4;
+
+                nir_variable *var =
+                        nir_variable_create(b.shader, nir_var_shader_out,
+                                            glsl_vector_type(base_type, components),
+                                            gs_var ? gs_var->name : NULL);
+
+                var->data.location = location;
+                var->data.driver_location = pan_gs_slot(outputs, location);
+
+                if (gs_var) {
+                        var->data.interpolation = gs_var->data.interpolation;
+                        var->data.precision = gs_var->data.precision;
+                }
+
+                nir_ssa_def *value =
+                        nir_load_global(&b,
+                                        nir_iadd_imm(&b, base,
+                                                     var->data.driver_location * 16),
+                                        16, components, 32);
+
+                nir_store_var(&b, var, value, nir_component_mask(components));
+        }
+
+        b.shader->num_outputs = util_bitcount64(outputs);
+        nir_shader_gather_info(b.shader, nir_shader_get_entrypoint(b.shader));
+
+        return b.shader;
+}
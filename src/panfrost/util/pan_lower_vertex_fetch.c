@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2023 Collabora Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pan_ir.h"
+#include "compiler/nir/nir_builder.h"
+#include "compiler/nir/nir_format_convert.h"
+#include "util/format/u_format.h"
+
+/* Vertex attributes the attribute hardware can't fetch, like elements which
+ * aren't aligned to their components, are fetched by the vertex shader
+ * instead of being converted on the CPU. The shader loads the aligned words
+ * covering the element, shifts them into place and unpacks the format.
+ *
+ * Only the words holding bytes of the element are loaded, so the loads stay
+ * within the buffer object. Like the attribute hardware, vertices past the
+ * end of the buffer read zero rather than faulting. */
+
+static nir_ssa_def *
+pan_vertex_fetch_index(nir_builder *b, uint32_t divisor)
+{
+        if (!divisor)
+                return nir_load_vertex_id(b);
+
+        /* The divisor is part of the shader key, so this becomes a multiply */
+        return nir_iadd(b, nir_udiv_imm(b, nir_load_instance_id(b), divisor),
+                        nir_load_base_instance(b));
+}
+
+static void
+pan_vertex_fetch_words(nir_builder *b, unsigned attr, uint32_t divisor,
+                       unsigned size, nir_ssa_def **packed)
+{
+        unsigned nr_words = DIV_ROUND_UP(size, 4);
+
+        nir_ssa_def *addr = nir_load_vertex_fetch_buffer_pan(b, .base = attr);
+        nir_ssa_def *layout = nir_load_vertex_fetch_layout_pan(b, .base = attr);
+        nir_ssa_def *offset = nir_imul(b, pan_vertex_fetch_index(b, divisor),
+                                       nir_channel(b, layout, 0));
+
+        nir_ssa_def *in_bounds =
+                nir_uge(b, nir_channel(b, layout, 1), nir_iadd_imm(b, offset, size));
+        offset = nir_bcsel(b, in_bounds, offset, nir_imm_int(b, 0));
+
+        /* Offsets from the address aligned down to a word */
+        nir_ssa_def *misalign = nir_iand_imm(b, nir_unpack_64_2x32_split_x(b, addr), 3);
+        nir_ssa_def *base = nir_isub(b, addr, nir_u2u64(b, misalign));
+        nir_ssa_def *byte = nir_iadd(b, offset, misalign);
+        nir_ssa_def *first = nir_iand_imm(b, byte, ~3);
+        nir_ssa_def *last = nir_iand_imm(b, nir_iadd_imm(b, byte, size - 1), ~3);
+
+        nir_ssa_def *words[5];
+
+        for (unsigned i = 0; i <= nr_words; ++i) {
+                nir_ssa_def *at = nir_umin(b, nir_iadd_imm(b, first, i * 4), last);
+
+                words[i] = nir_load_global(b, nir_iadd(b, base, nir_u2u64(b, at)),
+                                           4, 1, 32);
+        }
+
+        /* Shifting by 32 is undefined, so aligned elements take the words as
+         * they are */
+        nir_ssa_def *shift = nir_ishl_imm(b, nir_iand_imm(b, byte, 3), 3);
+        nir_ssa_def *aligned = nir_ieq_imm(b, shift, 0);
+        nir_ssa_def *rshift = nir_isub(b, nir_imm_int(b, 32), shift);
+
+        for (unsigned i = 0; i < nr_words; ++i) {
+                nir_ssa_def *word =
+                        nir_ior(b, nir_ushr(b, words[i], shift),
+                                   nir_ishl(b, words[i + 1], rshift));
+
+                word = nir_bcsel(b, aligned, words[i], word);
+                packed[i] = nir_bcsel(b, in_bounds, word, nir_imm_int(b, 0));
+        }
+}
+
+static nir_ssa_def *
+pan_unpack_channel(nir_builder *b, nir_ssa_def **packed,
+                   const struct util_format_channel_description *chan)
+{
+        nir_ssa_def *word = packed[chan->shift / 32];
+        unsigned shift = chan->shift % 32;
+        unsigned size = chan->size;
+        nir_ssa_def *raw;
+
+        assert(shift + size <= 32 && "channels don't straddle words");
+
+        if (chan->type == UTIL_FORMAT_TYPE_UNSIGNED) {
+                raw = nir_iand_imm(b, nir_ushr_imm(b, word, shift),
+                                   BITFIELD_MASK(size));
+        } else {
+                raw = nir_ishr_imm(b, nir_ishl_imm(b, word, 32 - shift - size),
+                                   32 - size);
+        }
+
+        switch (chan->type) {
+        case UTIL_FORMAT_TYPE_UNSIGNED:
+                if (chan->normalized)
+                        return nir_format_unorm_to_float(b, raw, &size);
+                else if (chan->pure_integer)
+                        return raw;
+                else
+                        return nir_u2f32(b, raw);
+
+        case UTIL_FORMAT_TYPE_SIGNED:
+                if (chan->normalized)
+                        return nir_format_snorm_to_float(b, raw, &size);
+                else if (chan->pure_integer)
+                        return raw;
+                else
+                        return nir_i2f32(b, raw);
+
+        case UTIL_FORMAT_TYPE_FLOAT:
+                if (size == 16)
+                        return nir_unpack_half_2x16_split_x(b, raw);
+
+                assert(size == 32);
+                return raw;
+
+        case UTIL_FORMAT_TYPE_FIXED:
+                return nir_fmul_imm(b, nir_i2f32(b, raw), 1.0 / 65536.0);
+
+        default:
+                unreachable("Invalid vertex format channel");
+        }
+}
+
+static nir_ssa_def *
+pan_vertex_fetch(nir_builder *b, unsigned attr, enum pipe_format format,
+                 uint32_t divisor)
+{
+        const struct util_format_description *desc =
+                util_format_description(format);
+        nir_ssa_def *packed[4];
+        nir_ssa_def *channels[4];
+
+        assert(desc->block.bits <= 128);
+        pan_vertex_fetch_words(b, attr, divisor, desc->block.bits / 8, packed);
+
+        if (format == PIPE_FORMAT_R11G11B10_FLOAT) {
+                nir_ssa_def *rgb = nir_format_unpack_11f11f10f(b, packed[0]);
+
+                for (unsigned i = 0; i < 3; ++i)
+                        channels[i] = nir_channel(b, rgb, i);
+        } else {
+                assert(desc->layout == UTIL_FORMAT_LAYOUT_PLAIN);
+
+                for (unsigned i = 0; i < desc->nr_channels; ++i)
+                        channels[i] = pan_unpack_channel(b, packed, &desc->channel[i]);
+        }
+
+        nir_ssa_def *one = util_format_is_pure_integer(format) ?
+                           nir_imm_int(b, 1) : nir_imm_float(b, 1.0);
+        nir_ssa_def *out[4];
+
+        for (unsigned i = 0; i < 4; ++i) {
+                unsigned swizzle = desc->swizzle[i];
+
+                if (swizzle <= PIPE_SWIZZLE_W)
+                        out[i] = channels[swizzle - PIPE_SWIZZLE_X];
+                else if (swizzle == PIPE_SWIZZLE_1)
+                        out[i] = one;
+                else
+                        out[i] = nir_imm_int(b, 0);
+        }
+
+        return nir_vec(b, out, 4);
+}
+
+static bool
+lower_vertex_fetch(nir_builder *b, nir_instr *instr, void *data)
+{
+        const struct pan_vertex_fetch *fetch = data;
+
+        if (instr->type != nir_instr_type_intrinsic)
+                return false;
+
+        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+        if (intr->intrinsic != nir_intrinsic_load_input)
+                return false;
+
+        /* Indirect inputs are unrolled by the frontend */
+        nir_src *offset = nir_get_io_offset_src(intr);
+        if (!nir_src_is_const(*offset))
+                return false;
+
+        unsigned attr = nir_intrinsic_base(intr) + nir_src_as_uint(*offset);
+        if (attr >= PAN_MAX_VERTEX_FETCH || !(fetch->mask & BITFIELD_BIT(attr)))
+                return false;
+
+        b->cursor = nir_before_instr(instr);
+
+        nir_ssa_def *value = pan_vertex_fetch(b, attr, fetch->formats[attr],
+                                              fetch->divisors[attr]);
+
+        value = nir_channels(b, value, BITFIELD_MASK(intr->num_components) <<
+                                       nir_intrinsic_component(intr));
+
+        if (nir_dest_bit_size(intr->dest) == 16) {
+                nir_alu_type T = nir_intrinsic_dest_type(intr);
+
+                value = (nir_alu_type_get_base_type(T) == nir_type_float) ?
+                        nir_f2f16(b, value) : nir_u2u16(b, value);
+        }
+
+        nir_ssa_def_rewrite_uses(&intr->dest.ssa, value);
+        nir_instr_remove(instr);
+        return true;
+}
+
+bool
+pan_lower_vertex_fetch(nir_shader *nir, const struct pan_vertex_fetch *fetch)
+{
+        assert(nir->info.stage == MESA_SHADER_VERTEX);
+
+        return nir_shader_instructions_pass(nir, lower_vertex_fetch,
+                                            nir_metadata_block_index |
+                                            nir_metadata_dominance,
+                                            (void *) fetch);
+}
@@ -99,3 +99,97 @@ pan_lower_xfb(nir_shader *nir)
                                             nir_metadata_dominance, NULL);
 }
 
+
+/* The transform feedback program runs with one thread per vertex of the draw,
+ * in draw order. For indexed draws, the vertex shaded is not the thread but
+ * the index the thread fetches. Indices are read as aligned words to avoid
+ * 8-bit and 16-bit arithmetic, so the buffer may be read up to 3 bytes past
+ * the last index, which stays within the mapping. */
+
+static nir_ssa_def *
+pan_xfb_vertex(nir_builder *b)
+{
+        nir_ssa_def *id = nir_load_vertex_id_zero_base(b);
+        nir_ssa_def *format = nir_load_xfb_index_format_pan(b);
+        nir_ssa_def *index_size = nir_channel(b, format, 0);
+
+        BITSET_SET(b->shader->info.system_values_read, SYSTEM_VALUE_VERTEX_ID_ZERO_BASE);
+
+        nir_push_if(b, nir_ine_imm(b, index_size, 0));
+        nir_ssa_def *indexed;
+        {
+                nir_ssa_def *byte = nir_iadd(b, nir_imul(b, id, index_size),
+                                             nir_channel(b, format, 1));
+                nir_ssa_def *addr =
+                        nir_iadd(b, nir_load_xfb_index_buffer_pan(b),
+                                 nir_u2u64(b, nir_iand_imm(b, byte, ~3)));
+                nir_ssa_def *word = nir_load_global(b, addr, 4, 1, 32);
+                nir_ssa_def *bits = nir_ishl_imm(b, index_size, 3);
+                nir_ssa_def *mask = nir_ushr(b, nir_imm_int(b, ~0),
+                                             nir_isub(b, nir_imm_int(b, 32), bits));
+                nir_ssa_def *shift = nir_ishl_imm(b, nir_iand_imm(b, byte, 3), 3);
+                nir_ssa_def *index = nir_iand(b, nir_ushr(b, word, shift), mask);
+
+                indexed = nir_iadd(b, index, nir_load_base_vertex(b));
+        }
+        nir_push_else(b, NULL);
+        nir_ssa_def *direct;
+        {
+                direct = nir_iadd(b, id, nir_load_first_vertex(b));
+        }
+        nir_pop_if(b, NULL);
+
+        return nir_if_phi(b, indexed, direct);
+}
+
+static bool
+lower_xfb_vertex_fetch(nir_builder *b, nir_instr *instr, void *data)
+{
+        nir_ssa_def *vertex = data;
+
+        if (instr->type != nir_instr_type_intrinsic)
+                return false;
+
+        nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+
+        if (intr->intrinsic == nir_intrinsic_load_vertex_id) {
+                nir_ssa_def_rewrite_uses(&intr->dest.ssa, vertex);
+                nir_instr_remove(instr);
+                return true;
+        }
+
+        if (intr->intrinsic != nir_intrinsic_load_input)
+                return false;
+
+        /* Attributes are loaded for an explicit vertex */
+        nir_intrinsic_instr *load =
+                nir_intrinsic_instr_create(b->shader,
+                                           nir_intrinsic_load_per_vertex_input);
+        load->num_components = intr->num_components;
+        load->src[0] = nir_src_for_ssa(vertex);
+        nir_src_copy(&load->src[1], &intr->src[0], &load->instr);
+        nir_intrinsic_copy_const_indices(load, intr);
+        nir_ssa_dest_init(&load->instr, &load->dest, intr->num_components,
+                          nir_dest_bit_size(intr->dest), NULL);
+
+        b->cursor = nir_before_instr(instr);
+        nir_builder_instr_insert(b, &load->instr);
+        nir_ssa_def_rewrite_uses(&intr->dest.ssa, &load->dest.ssa);
+        nir_instr_remove(instr);
+        return true;
+}
+
+bool
+pan_lower_xfb_vertex_fetch(nir_shader *nir)
+{
+        nir_function_impl *impl = nir_shader_get_entrypoint(nir);
+        nir_builder b;
+
+        nir_builder_init(&b, impl);
+        b.cursor = nir_before_cf_list(&impl->body);
+
+        nir_ssa_def *vertex = pan_xfb_vertex(&b);
+
+        return nir_shader_instructions_pass(nir, lower_xfb_vertex_fetch,
+                                            nir_metadata_none, vertex);
+}
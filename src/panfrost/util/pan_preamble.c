@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2023 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "pan_ir.h"
+#include "compiler/nir/nir_constant_expressions.h"
+
+/* Preambles produced by nir_opt_preamble are translated to a pan_preamble,
+ * which the driver runs on the CPU with the constant folding helpers. Only
+ * ALU, constants and UBO loads are supported, with at most 32-bit values and
+ * vec4 vectors, which covers the usual uniform-only math (matrix products,
+ * normalising constant vectors...). */
+
+static bool
+pan_preamble_def_ok(const nir_ssa_def *def)
+{
+        return def->bit_size <= 32 && def->num_components <= 4;
+}
+
+/* Callback for nir_opt_preamble_options::can_move_instr_cb, limiting the
+ * preamble to what pan_nir_collect_preamble can translate */
+bool
+pan_nir_preamble_can_eval(const nir_instr *instr, const void *data)
+{
+        switch (instr->type) {
+        case nir_instr_type_load_const:
+                return pan_preamble_def_ok(&nir_instr_as_load_const(instr)->def);
+
+        case nir_instr_type_ssa_undef:
+                return pan_preamble_def_ok(&nir_instr_as_ssa_undef(instr)->def);
+
+        case nir_instr_type_alu: {
+                const nir_alu_instr *alu = nir_instr_as_alu(instr);
+                const nir_op_info *info = &nir_op_infos[alu->op];
+
+                if (!alu->dest.dest.is_ssa || alu->dest.saturate ||
+                    !pan_preamble_def_ok(&alu->dest.dest.ssa) ||
+                    info->num_inputs > 4)
+                        return false;
+
+                for (unsigned i = 0; i < info->num_inputs; ++i) {
+                        if (!alu->src[i].src.is_ssa || alu->src[i].abs ||
+                            alu->src[i].negate ||
+                            nir_ssa_alu_instr_src_components(alu, i) > 4)
+                                return false;
+                }
+
+                return true;
+        }
+
+        case nir_instr_type_intrinsic: {
+                const nir_intrinsic_instr *intr = nir_instr_as_intrinsic(instr);
+
+                return intr->intrinsic == nir_intrinsic_load_ubo &&
+                       nir_src_is_const(intr->src[0]) &&
+                       nir_src_as_uint(intr->src[0]) < 256 &&
+                       intr->dest.ssa.bit_size == 32 &&
+                       intr->dest.ssa.num_components <= 4;
+        }
+
+        default:
+                return false;
+        }
+}
+
+struct pan_preamble_ctx {
+        struct pan_preamble *preamble;
+
+        /* First value of each SSA def */
+        uint8_t *values;
+        unsigned nr_values;
+};
+
+static bool
+pan_preamble_alloc(struct pan_preamble_ctx *ctx, nir_ssa_def *def)
+{
+        if (ctx->nr_values + def->num_components > PAN_MAX_PREAMBLE_VALUES)
+                return false;
+
+        ctx->values[def->index] = ctx->nr_values;
+        ctx->nr_values += def->num_components;
+        return true;
+}
+
+static struct pan_preamble_instr *
+pan_preamble_add(struct pan_preamble_ctx *ctx, uint16_t op)
+{
+        struct pan_preamble *preamble = ctx->preamble;
+
+        if (preamble->nr_instrs == PAN_MAX_PREAMBLE_INSTRS)
+                return NULL;
+
+        struct pan_preamble_instr *I = &preamble->instrs[preamble->nr_instrs++];
+        memset(I, 0, sizeof(*I));
+        I->op = op;
+        return I;
+}
+
+static bool
+pan_preamble_add_alu(struct pan_preamble_ctx *ctx, nir_alu_instr *alu)
+{
+        const nir_op_info *info = &nir_op_infos[alu->op];
+        struct pan_preamble_instr *I = pan_preamble_add(ctx, alu->op);
+
+        if (!I)
+                return false;
+
+        /* Same bit size guess as nir_opt_constant_folding */
+        unsigned bit_size = 0;
+
+        if (!nir_alu_type_get_type_size(info->output_type))
+                bit_size = alu->dest.dest.ssa.bit_size;
+
+        for (unsigned i = 0; i < info->num_inputs; ++i) {
+                nir_ssa_def *src = alu->src[i].src.ssa;
+                unsigned nr = nir_ssa_alu_instr_src_components(alu, i);
+
+                if (bit_size == 0 &&
+                    !nir_alu_type_get_type_size(info->input_types[i]))
+                        bit_size = src->bit_size;
+
+                /* Unused components repeat the last one, to stay in bounds */
+                for (unsigned c = 0; c < 4; ++c) {
+                        I->src[i][c] = ctx->values[src->index] +
+                                       alu->src[i].swizzle[MIN2(c, nr - 1)];
+                }
+        }
+
+        I->bit_size = bit_size ? bit_size : 32;
+        I->num_components = alu->dest.dest.ssa.num_components;
+
+        if (!pan_preamble_alloc(ctx, &alu->dest.dest.ssa))
+                return false;
+
+        I->dest = ctx->values[alu->dest.dest.ssa.index];
+        return true;
+}
+
+static bool
+pan_preamble_add_intrinsic(struct pan_preamble_ctx *ctx,
+                           nir_intrinsic_instr *intr)
+{
+        struct pan_preamble_instr *I;
+
+        switch (intr->intrinsic) {
+        case nir_intrinsic_load_ubo:
+                I = pan_preamble_add(ctx, PAN_PREAMBLE_LOAD_UBO);
+
+                if (!I || !pan_preamble_alloc(ctx, &intr->dest.ssa))
+                        return false;
+
+                I->bit_size = 32;
+                I->num_components = intr->dest.ssa.num_components;
+                I->index = nir_src_as_uint(intr->src[0]);
+                I->src[0][0] = ctx->values[intr->src[1].ssa->index];
+                I->dest = ctx->values[intr->dest.ssa.index];
+                return true;
+
+        case nir_intrinsic_store_preamble: {
+                nir_ssa_def *data = intr->src[0].ssa;
+                unsigned base = nir_intrinsic_base(intr);
+
+                if (data->bit_size != 32 ||
+                    base + data->num_components > PAN_MAX_PREAMBLE_WORDS)
+                        return false;
+
+                I = pan_preamble_add(ctx, PAN_PREAMBLE_STORE);
+
+                if (!I)
+                        return false;
+
+                I->bit_size = 32;
+                I->num_components = data->num_components;
+                I->index = base;
+
+                for (unsigned c = 0; c < data->num_components; ++c)
+                        I->src[0][c] = ctx->values[data->index] + c;
+
+                return true;
+        }
+
+        default:
+                return false;
+        }
+}
+
+/* Translates the preamble of the shader, returning false if it doesn't fit
+ * or uses anything pan_preamble_eval can't run */
+bool
+pan_nir_collect_preamble(nir_shader *nir, struct pan_preamble *preamble)
+{
+        nir_function_impl *impl = nir_shader_get_preamble(nir);
+
+        /* The preamble is only made of hoisted expressions, so there is no
+         * control flow */
+        if (nir_start_block(impl) != nir_impl_last_block(impl))
+                return false;
+
+        struct pan_preamble_ctx ctx = {
+                .preamble = preamble,
+                .values = calloc(impl->ssa_alloc, sizeof(uint8_t)),
+        };
+
+        memset(preamble, 0, sizeof(*preamble));
+        preamble->float_controls = nir->info.float_controls_execution_mode;
+
+        bool ok = true;
+
+        nir_foreach_instr(instr, nir_start_block(impl)) {
+                bool is_store = instr->type == nir_instr_type_intrinsic &&
+                        nir_instr_as_intrinsic(instr)->intrinsic ==
+                        nir_intrinsic_store_preamble;
+
+                /* nir_opt_preamble only moves what the filter accepts, but
+                 * check anyway in case the callback wasn't used */
+                if (!is_store && !pan_nir_preamble_can_eval(instr, NULL)) {
+                        ok = false;
+                        break;
+                }
+
+                switch (instr->type) {
+                case nir_instr_type_load_const: {
+                        nir_load_const_instr *load =
+                                nir_instr_as_load_const(instr);
+
+                        ok = pan_preamble_alloc(&ctx, &load->def);
+
+                        for (unsigned c = 0; ok && c < load->def.num_components; ++c) {
+                                preamble->values[ctx.values[load->def.index] + c] =
+                                        nir_const_value_as_uint(load->value[c],
+                                                                load->def.bit_size);
+                        }
+                        break;
+                }
+
+                case nir_instr_type_ssa_undef:
+                        /* Values start zeroed */
+                        ok = pan_preamble_alloc(&ctx,
+                                        &nir_instr_as_ssa_undef(instr)->def);
+                        break;
+
+                case nir_instr_type_alu:
+                        ok = pan_preamble_add_alu(&ctx, nir_instr_as_alu(instr));
+                        break;
+
+                case nir_instr_type_intrinsic:
+                        ok = pan_preamble_add_intrinsic(&ctx,
+                                        nir_instr_as_intrinsic(instr));
+                        break;
+
+                default:
+                        ok = false;
+                        break;
+                }
+
+                if (!ok)
+                        break;
+        }
+
+        free(ctx.values);
+
+        if (!ok)
+                memset(preamble, 0, sizeof(*preamble));
+
+        return ok;
+}
+
+void
+pan_preamble_eval(const struct pan_preamble *preamble,
+                  pan_preamble_load_ubo load_ubo, void *data,
+                  uint32_t words[PAN_MAX_PREAMBLE_WORDS])
+{
+        nir_const_value values[PAN_MAX_PREAMBLE_VALUES];
+
+        /* Values are at most 32-bit. The members of nir_const_value overlap
+         * and we're little-endian, so a zero-extended word reads correctly
+         * at any bit size. */
+        for (unsigned i = 0; i < PAN_MAX_PREAMBLE_VALUES; ++i)
+                values[i].u64 = preamble->values[i];
+
+        for (unsigned i = 0; i < preamble->nr_instrs; ++i) {
+                const struct pan_preamble_instr *I = &preamble->instrs[i];
+
+                if (I->op == PAN_PREAMBLE_LOAD_UBO) {
+                        uint32_t offset = values[I->src[0][0]].u32;
+
+                        for (unsigned c = 0; c < I->num_components; ++c) {
+                                values[I->dest + c].u64 =
+                                        load_ubo(data, I->index, offset + (c * 4));
+                        }
+                } else if (I->op == PAN_PREAMBLE_STORE) {
+                        for (unsigned c = 0; c < I->num_components; ++c)
+                                words[I->index + c] = values[I->src[0][c]].u32;
+                } else {
+                        nir_const_value src[4][4], dest[4];
+                        nir_const_value *srcs[4] = { src[0], src[1], src[2], src[3] };
+
+                        for (unsigned s = 0; s < nir_op_infos[I->op].num_inputs; ++s) {
+                                for (unsigned c = 0; c < 4; ++c)
+                                        src[s][c] = values[I->src[s][c]];
+                        }
+
+                        /* Keep the bits above the result zeroed, as above */
+                        memset(dest, 0, sizeof(dest));
+
+                        nir_eval_const_opcode(I->op, dest, I->num_components,
+                                              I->bit_size, srcs,
+                                              preamble->float_controls);
+
+                        memcpy(&values[I->dest], dest,
+                               I->num_components * sizeof(dest[0]));
+                }
+        }
+}
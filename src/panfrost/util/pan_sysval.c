@@ -91,6 +91,14 @@ panfrost_nir_sysval_for_intrinsic(nir_intrinsic_instr *instr)
                 return PAN_SYSVAL(XFB, nir_intrinsic_base(instr));
         case nir_intrinsic_load_num_vertices:
                 return PAN_SYSVAL_NUM_VERTICES;
+        case nir_intrinsic_load_xfb_index_buffer_pan:
+        case nir_intrinsic_load_xfb_index_format_pan:
+                return PAN_SYSVAL_XFB_INDICES;
+        case nir_intrinsic_load_vertex_fetch_buffer_pan:
+        case nir_intrinsic_load_vertex_fetch_layout_pan:
+                return PAN_SYSVAL(VERTEX_FETCH, nir_intrinsic_base(instr));
+        case nir_intrinsic_load_gs_buffer_pan:
+                return PAN_SYSVAL(GS, nir_intrinsic_base(instr));
         case nir_intrinsic_load_sampler_lod_parameters_pan:
                 return panfrost_sysval_for_sampler(instr);
         case nir_intrinsic_image_size:
@@ -34,11 +34,13 @@
 #include "vk_format.h"
 
 void
-panvk_CmdBindVertexBuffers(VkCommandBuffer commandBuffer,
-                           uint32_t firstBinding,
-                           uint32_t bindingCount,
-                           const VkBuffer *pBuffers,
-                           const VkDeviceSize *pOffsets)
+panvk_CmdBindVertexBuffers2(VkCommandBuffer commandBuffer,
+                            uint32_t firstBinding,
+                            uint32_t bindingCount,
+                            const VkBuffer *pBuffers,
+                            const VkDeviceSize *pOffsets,
+                            const VkDeviceSize *pSizes,
+                            const VkDeviceSize *pStrides)
 {
    VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
    struct panvk_descriptor_state *desc_state =
@@ -52,11 +54,29 @@ panvk_CmdBindVertexBuffers(VkCommandBuffer commandBuffer,
       cmdbuf->state.vb.bufs[firstBinding + i].address =
          panvk_buffer_gpu_ptr(buffer, pOffsets[i]);
       cmdbuf->state.vb.bufs[firstBinding + i].size =
-         panvk_buffer_range(buffer, pOffsets[i], VK_WHOLE_SIZE);
+         panvk_buffer_range(buffer, pOffsets[i],
+                            pSizes ? pSizes[i] : VK_WHOLE_SIZE);
+
+      if (pStrides)
+         cmdbuf->state.vb.bufs[firstBinding + i].stride = pStrides[i];
    }
 
    cmdbuf->state.vb.count = MAX2(cmdbuf->state.vb.count, firstBinding + bindingCount);
    desc_state->vs_attrib_bufs = desc_state->vs_attribs = 0;
+
+   if (pStrides)
+      cmdbuf->state.dirty |= PANVK_DYNAMIC_VERTEX_INPUT_BINDING_STRIDE;
+}
+
+void
+panvk_CmdBindVertexBuffers(VkCommandBuffer commandBuffer,
+                           uint32_t firstBinding,
+                           uint32_t bindingCount,
+                           const VkBuffer *pBuffers,
+                           const VkDeviceSize *pOffsets)
+{
+   panvk_CmdBindVertexBuffers2(commandBuffer, firstBinding, bindingCount,
+                               pBuffers, pOffsets, NULL, NULL);
 }
 
 void
@@ -239,6 +259,12 @@ panvk_CmdBindPipeline(VkCommandBuffer commandBuffer,
     * pipeline contain shaders using sysvals.
     */
    cmdbuf->bind_points[pipelineBindPoint].desc_state.ubos = 0;
+
+   /* Whether a set's texture and sampler tables can be bound in place
+    * depends on the pipeline layout.
+    */
+   cmdbuf->bind_points[pipelineBindPoint].desc_state.textures = 0;
+   cmdbuf->bind_points[pipelineBindPoint].desc_state.samplers = 0;
 }
 
 void
@@ -367,6 +393,161 @@ panvk_CmdSetStencilReference(VkCommandBuffer commandBuffer,
    cmdbuf->state.fs_rsd = 0;
 }
 
+void
+panvk_CmdSetViewportWithCount(VkCommandBuffer commandBuffer,
+                              uint32_t viewportCount,
+                              const VkViewport *pViewports)
+{
+   panvk_CmdSetViewport(commandBuffer, 0, viewportCount, pViewports);
+}
+
+void
+panvk_CmdSetScissorWithCount(VkCommandBuffer commandBuffer,
+                             uint32_t scissorCount,
+                             const VkRect2D *pScissors)
+{
+   panvk_CmdSetScissor(commandBuffer, 0, scissorCount, pScissors);
+}
+
+void
+panvk_CmdSetCullMode(VkCommandBuffer commandBuffer, VkCullModeFlags cullMode)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.rast.cull_mode = cullMode;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_CULL_MODE;
+}
+
+void
+panvk_CmdSetFrontFace(VkCommandBuffer commandBuffer, VkFrontFace frontFace)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.rast.front_face = frontFace;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_FRONT_FACE;
+}
+
+void
+panvk_CmdSetPrimitiveTopology(VkCommandBuffer commandBuffer,
+                              VkPrimitiveTopology primitiveTopology)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.ia.topology = primitiveTopology;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_PRIMITIVE_TOPOLOGY;
+}
+
+void
+panvk_CmdSetPrimitiveRestartEnable(VkCommandBuffer commandBuffer,
+                                   VkBool32 primitiveRestartEnable)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.ia.primitive_restart = primitiveRestartEnable;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_PRIMITIVE_RESTART_ENABLE;
+}
+
+void
+panvk_CmdSetRasterizerDiscardEnable(VkCommandBuffer commandBuffer,
+                                    VkBool32 rasterizerDiscardEnable)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.rast.discard = rasterizerDiscardEnable;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_RASTERIZER_DISCARD_ENABLE;
+}
+
+void
+panvk_CmdSetDepthBiasEnable(VkCommandBuffer commandBuffer,
+                            VkBool32 depthBiasEnable)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.rast.depth_bias.enable = depthBiasEnable;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_DEPTH_BIAS_ENABLE;
+   cmdbuf->state.fs_rsd = 0;
+}
+
+void
+panvk_CmdSetDepthTestEnable(VkCommandBuffer commandBuffer,
+                            VkBool32 depthTestEnable)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.zs.z_test = depthTestEnable;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_DEPTH_TEST_ENABLE;
+   cmdbuf->state.fs_rsd = 0;
+}
+
+void
+panvk_CmdSetDepthWriteEnable(VkCommandBuffer commandBuffer,
+                             VkBool32 depthWriteEnable)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.zs.z_write = depthWriteEnable;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_DEPTH_WRITE_ENABLE;
+   cmdbuf->state.fs_rsd = 0;
+}
+
+void
+panvk_CmdSetDepthCompareOp(VkCommandBuffer commandBuffer,
+                           VkCompareOp depthCompareOp)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.zs.z_compare_op = depthCompareOp;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_DEPTH_COMPARE_OP;
+   cmdbuf->state.fs_rsd = 0;
+}
+
+void
+panvk_CmdSetDepthBoundsTestEnable(VkCommandBuffer commandBuffer,
+                                  VkBool32 depthBoundsTestEnable)
+{
+   /* depthBounds is not supported, so this can only ever be disabled */
+   assert(!depthBoundsTestEnable);
+}
+
+void
+panvk_CmdSetStencilTestEnable(VkCommandBuffer commandBuffer,
+                              VkBool32 stencilTestEnable)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   cmdbuf->state.zs.s_test = stencilTestEnable;
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_STENCIL_TEST_ENABLE;
+   cmdbuf->state.fs_rsd = 0;
+}
+
+void
+panvk_CmdSetStencilOp(VkCommandBuffer commandBuffer,
+                      VkStencilFaceFlags faceMask,
+                      VkStencilOp failOp,
+                      VkStencilOp passOp,
+                      VkStencilOp depthFailOp,
+                      VkCompareOp compareOp)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+
+   if (faceMask & VK_STENCIL_FACE_FRONT_BIT) {
+      cmdbuf->state.zs.s_front.fail_op = failOp;
+      cmdbuf->state.zs.s_front.pass_op = passOp;
+      cmdbuf->state.zs.s_front.z_fail_op = depthFailOp;
+      cmdbuf->state.zs.s_front.compare_op = compareOp;
+   }
+
+   if (faceMask & VK_STENCIL_FACE_BACK_BIT) {
+      cmdbuf->state.zs.s_back.fail_op = failOp;
+      cmdbuf->state.zs.s_back.pass_op = passOp;
+      cmdbuf->state.zs.s_back.z_fail_op = depthFailOp;
+      cmdbuf->state.zs.s_back.compare_op = compareOp;
+   }
+
+   cmdbuf->state.dirty |= PANVK_DYNAMIC_STENCIL_OP;
+   cmdbuf->state.fs_rsd = 0;
+}
+
 VkResult
 panvk_CreateCommandPool(VkDevice _device,
                         const VkCommandPoolCreateInfo *pCreateInfo,
@@ -436,6 +617,8 @@ panvk_cmd_fb_info_set_subpass(struct panvk_cmd_buffer *cmdbuf)
    fbinfo->nr_samples = 1;
    fbinfo->rt_count = subpass->color_count;
    memset(&fbinfo->bifrost.pre_post.dcds, 0, sizeof(fbinfo->bifrost.pre_post.dcds));
+   memset(fbinfo->rts, 0, sizeof(fbinfo->rts));
+   memset(&fbinfo->zs, 0, sizeof(fbinfo->zs));
 
    for (unsigned cb = 0; cb < subpass->color_count; cb++) {
       int idx = subpass->color_attachments[cb].idx;
@@ -464,12 +647,14 @@ panvk_cmd_fb_info_set_subpass(struct panvk_cmd_buffer *cmdbuf)
 
       if (util_format_has_depth(fdesc)) {
          fbinfo->zs.clear.z = subpass->zs_attachment.clear;
+         fbinfo->zs.preload.z = subpass->zs_attachment.preload;
          fbinfo->zs.clear_value.depth = clears[subpass->zs_attachment.idx].depth;
          fbinfo->zs.view.zs = &view->pview;
       }
 
       if (util_format_has_stencil(fdesc)) {
-         fbinfo->zs.clear.s = subpass->zs_attachment.clear;
+         fbinfo->zs.clear.s = subpass->zs_attachment.stencil_clear;
+         fbinfo->zs.preload.s = subpass->zs_attachment.stencil_preload;
          fbinfo->zs.clear_value.stencil = clears[subpass->zs_attachment.idx].stencil;
          if (!fbinfo->zs.view.zs)
             fbinfo->zs.view.s = &view->pview;
@@ -477,6 +662,31 @@ panvk_cmd_fb_info_set_subpass(struct panvk_cmd_buffer *cmdbuf)
    }
 }
 
+/* Called before closing the last batch of a subpass */
+void
+panvk_cmd_fb_info_set_discard(struct panvk_cmd_buffer *cmdbuf)
+{
+   const struct panvk_subpass *subpass = cmdbuf->state.subpass;
+   struct pan_fb_info *fbinfo = &cmdbuf->state.fb.info;
+
+   for (unsigned cb = 0; cb < subpass->color_count; cb++) {
+      if (fbinfo->rts[cb].view)
+         fbinfo->rts[cb].discard = subpass->color_attachments[cb].discard;
+   }
+
+   if (fbinfo->zs.view.zs) {
+      /* Depth and stencil are written back together when they share the
+       * view.
+       */
+      fbinfo->zs.discard.z = subpass->zs_attachment.discard;
+      if (util_format_has_stencil(util_format_description(fbinfo->zs.view.zs->format)))
+         fbinfo->zs.discard.z &= subpass->zs_attachment.stencil_discard;
+   }
+
+   if (fbinfo->zs.view.s)
+      fbinfo->zs.discard.s = subpass->zs_attachment.stencil_discard;
+}
+
 void
 panvk_cmd_fb_info_init(struct panvk_cmd_buffer *cmdbuf)
 {
@@ -511,6 +721,7 @@ panvk_CmdBeginRenderPass2(VkCommandBuffer commandBuffer,
                                    VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
    util_dynarray_init(&cmdbuf->state.batch->jobs, NULL);
    util_dynarray_init(&cmdbuf->state.batch->event_ops, NULL);
+   util_dynarray_init(&cmdbuf->state.batch->query_bos, NULL);
    assert(pRenderPassBegin->clearValueCount <= pass->attachment_count);
    cmdbuf->state.clear =
       vk_zalloc(&cmdbuf->vk.pool->alloc,
@@ -555,6 +766,17 @@ panvk_cmd_open_batch(struct panvk_cmd_buffer *cmdbuf)
    return cmdbuf->state.batch;
 }
 
+void
+panvk_batch_add_query_bo(struct panvk_batch *batch, struct panfrost_bo *bo)
+{
+   util_dynarray_foreach(&batch->query_bos, struct panfrost_bo *, entry) {
+      if (*entry == bo)
+         return;
+   }
+
+   util_dynarray_append(&batch->query_bos, struct panfrost_bo *, bo);
+}
+
 void
 panvk_CmdDrawIndirect(VkCommandBuffer commandBuffer,
                       VkBuffer _buffer,
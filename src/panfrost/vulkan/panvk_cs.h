@@ -81,6 +81,48 @@ panvk_per_arch(translate_sampler_compare_func)(const VkSamplerCreateInfo *pCreat
    enum mali_func f = panvk_per_arch(translate_compare_func)(pCreateInfo->compareOp);
    return panfrost_flip_compare_func(f);
 }
+
+static inline enum mali_draw_mode
+panvk_per_arch(translate_prim_topology)(VkPrimitiveTopology in)
+{
+   switch (in) {
+   case VK_PRIMITIVE_TOPOLOGY_POINT_LIST:
+      return MALI_DRAW_MODE_POINTS;
+   case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:
+      return MALI_DRAW_MODE_LINES;
+   case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP:
+      return MALI_DRAW_MODE_LINE_STRIP;
+   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST:
+      return MALI_DRAW_MODE_TRIANGLES;
+   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP:
+      return MALI_DRAW_MODE_TRIANGLE_STRIP;
+   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN:
+      return MALI_DRAW_MODE_TRIANGLE_FAN;
+   case VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY:
+   case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY:
+   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST_WITH_ADJACENCY:
+   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP_WITH_ADJACENCY:
+   case VK_PRIMITIVE_TOPOLOGY_PATCH_LIST:
+   default:
+      unreachable("Invalid primitive type");
+   }
+}
+
+static inline enum mali_stencil_op
+panvk_per_arch(translate_stencil_op)(VkStencilOp in)
+{
+   switch (in) {
+   case VK_STENCIL_OP_KEEP: return MALI_STENCIL_OP_KEEP;
+   case VK_STENCIL_OP_ZERO: return MALI_STENCIL_OP_ZERO;
+   case VK_STENCIL_OP_REPLACE: return MALI_STENCIL_OP_REPLACE;
+   case VK_STENCIL_OP_INCREMENT_AND_CLAMP: return MALI_STENCIL_OP_INCR_SAT;
+   case VK_STENCIL_OP_DECREMENT_AND_CLAMP: return MALI_STENCIL_OP_DECR_SAT;
+   case VK_STENCIL_OP_INCREMENT_AND_WRAP: return MALI_STENCIL_OP_INCR_WRAP;
+   case VK_STENCIL_OP_DECREMENT_AND_WRAP: return MALI_STENCIL_OP_DECR_WRAP;
+   case VK_STENCIL_OP_INVERT: return MALI_STENCIL_OP_INVERT;
+   default: unreachable("Invalid stencil op");
+   }
+}
 #endif
 
 void
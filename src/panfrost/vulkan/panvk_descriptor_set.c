@@ -201,67 +201,36 @@ panvk_CreatePipelineLayout(VkDevice _device,
    return VK_SUCCESS;
 }
 
-VkResult
-panvk_CreateDescriptorPool(VkDevice _device,
-                           const VkDescriptorPoolCreateInfo *pCreateInfo,
-                           const VkAllocationCallbacks *pAllocator,
-                           VkDescriptorPool *pDescriptorPool)
+static void
+panvk_descriptor_set_destroy(struct panvk_device *device,
+                             struct panvk_descriptor_pool *pool,
+                             struct panvk_descriptor_set *set)
 {
-   VK_FROM_HANDLE(panvk_device, device, _device);
-   struct panvk_descriptor_pool *pool;
+   list_del(&set->link);
 
-   pool = vk_object_zalloc(&device->vk, pAllocator,
-                           sizeof(struct panvk_descriptor_pool),
-                           VK_OBJECT_TYPE_DESCRIPTOR_POOL);
-   if (!pool)
-      return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
-
-   pool->max.sets = pCreateInfo->maxSets;
+   /* Linear pools only release memory on reset */
+   if (!pool->linear && set->gpu_mem.gpu)
+      util_vma_heap_free(&pool->desc_heap, set->gpu_mem.gpu, set->gpu_size);
 
-   for (unsigned i = 0; i < pCreateInfo->poolSizeCount; ++i) {
-      unsigned desc_count = pCreateInfo->pPoolSizes[i].descriptorCount;
+   vk_object_base_finish(&set->base);
+   if (!pool->linear)
+      vk_free(&device->vk.alloc, set);
+}
 
-      switch(pCreateInfo->pPoolSizes[i].type) {
-      case VK_DESCRIPTOR_TYPE_SAMPLER:
-         pool->max.samplers += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
-         pool->max.combined_image_samplers += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
-         pool->max.sampled_images += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
-         pool->max.storage_images += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
-         pool->max.uniform_texel_bufs += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER:
-         pool->max.storage_texel_bufs += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT:
-         pool->max.input_attachments += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
-         pool->max.uniform_bufs += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
-         pool->max.storage_bufs += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
-         pool->max.uniform_dyn_bufs += desc_count;
-         break;
-      case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
-         pool->max.storage_dyn_bufs += desc_count;
-         break;
-      default:
-         unreachable("Invalid descriptor type");
-      }
-   }
+static void
+panvk_descriptor_pool_reset(struct panvk_device *device,
+                            struct panvk_descriptor_pool *pool)
+{
+   /* Sets of linear pools live in the pool memory, there is nothing to free
+    * but the object bases.
+    */
+   list_for_each_entry_safe(struct panvk_descriptor_set, set, &pool->sets,
+                            link)
+      panvk_descriptor_set_destroy(device, pool, set);
 
-   *pDescriptorPool = panvk_descriptor_pool_to_handle(pool);
-   return VK_SUCCESS;
+   pool->host_offset = 0;
+   pool->desc_offset = 0;
+   memset(&pool->cur, 0, sizeof(pool->cur));
 }
 
 void
@@ -272,8 +241,19 @@ panvk_DestroyDescriptorPool(VkDevice _device,
    VK_FROM_HANDLE(panvk_device, device, _device);
    VK_FROM_HANDLE(panvk_descriptor_pool, pool, _pool);
 
-   if (pool)
-      vk_object_free(&device->vk, pAllocator, pool);
+   if (!pool)
+      return;
+
+   panvk_descriptor_pool_reset(device, pool);
+
+   if (pool->desc_bo) {
+      if (!pool->linear)
+         util_vma_heap_finish(&pool->desc_heap);
+      panfrost_bo_unreference(pool->desc_bo);
+   }
+
+   vk_free2(&device->vk.alloc, pAllocator, pool->host_mem);
+   vk_object_free(&device->vk, pAllocator, pool);
 }
 
 VkResult
@@ -281,26 +261,11 @@ panvk_ResetDescriptorPool(VkDevice _device,
                           VkDescriptorPool _pool,
                           VkDescriptorPoolResetFlags flags)
 {
+   VK_FROM_HANDLE(panvk_device, device, _device);
    VK_FROM_HANDLE(panvk_descriptor_pool, pool, _pool);
-   memset(&pool->cur, 0, sizeof(pool->cur));
-   return VK_SUCCESS;
-}
 
-static void
-panvk_descriptor_set_destroy(struct panvk_device *device,
-                             struct panvk_descriptor_pool *pool,
-                             struct panvk_descriptor_set *set)
-{
-   vk_free(&device->vk.alloc, set->textures);
-   vk_free(&device->vk.alloc, set->samplers);
-   vk_free(&device->vk.alloc, set->ubos);
-   vk_free(&device->vk.alloc, set->dyn_ubos);
-   vk_free(&device->vk.alloc, set->dyn_ssbos);
-   vk_free(&device->vk.alloc, set->img_fmts);
-   vk_free(&device->vk.alloc, set->img_attrib_bufs);
-   if (set->desc_bo)
-      panfrost_bo_unreference(set->desc_bo);
-   vk_object_free(&device->vk, NULL, set);
+   panvk_descriptor_pool_reset(device, pool);
+   return VK_SUCCESS;
 }
 
 VkResult
@@ -47,9 +47,11 @@
 
 #include "util/u_debug.h"
 #include "util/disk_cache.h"
+#include "util/os_misc.h"
 #include "util/strtod.h"
 #include "vk_format.h"
 #include "vk_drm_syncobj.h"
+#include "vk_sync_timeline.h"
 #include "vk_util.h"
 
 #ifdef VK_USE_PLATFORM_WAYLAND_KHR
@@ -120,6 +122,7 @@ static const struct debug_control panvk_debug_options[] = {
    { "afbc", PANVK_DEBUG_AFBC },
    { "linear", PANVK_DEBUG_LINEAR },
    { "dump", PANVK_DEBUG_DUMP },
+   { "nosuballoc", PANVK_DEBUG_NO_SUBALLOC },
    { NULL, 0 }
 };
 
@@ -161,9 +164,13 @@ panvk_get_device_extensions(const struct panvk_physical_device *device,
       .KHR_swapchain = true,
 #endif
       .KHR_synchronization2 = true,
+      .KHR_timeline_semaphore = true,
       .KHR_variable_pointers = true,
       .EXT_custom_border_color = true,
+      .EXT_extended_dynamic_state = true,
+      .EXT_extended_dynamic_state2 = true,
       .EXT_index_type_uint8 = true,
+      .EXT_memory_budget = true,
       .EXT_vertex_attribute_divisor = true,
    };
 }
@@ -179,6 +186,10 @@ panvk_physical_device_finish(struct panvk_physical_device *device)
 
    panvk_arch_dispatch(device->pdev.arch, meta_cleanup, device);
    panfrost_close_device(&device->pdev);
+#ifdef ENABLE_SHADER_CACHE
+   if (device->vk.disk_cache)
+      disk_cache_destroy(device->vk.disk_cache);
+#endif
    if (device->master_fd != -1)
       close(device->master_fd);
 
@@ -338,7 +349,12 @@ panvk_physical_device_init(struct panvk_physical_device *device,
    panfrost_open_device(NULL, fd, &device->pdev);
    fd = -1;
 
-   if (device->pdev.arch <= 5) {
+   /* Only the job manager GPUs using the v6/v7 descriptor layouts are
+    * implemented. Valhall (v9) needs resource tables instead of the
+    * attribute/texture descriptor arrays, and CSF GPUs (v10) need command
+    * buffers recorded as command streams and submitted through kbase, so
+    * don't go on to hit unreachable() in the per-arch dispatch. */
+   if (device->pdev.arch <= 5 || device->pdev.arch >= 8) {
       result = vk_errorf(instance, VK_ERROR_INCOMPATIBLE_DRIVER,
                          "%s not supported",
                          device->pdev.model->name);
@@ -356,6 +372,15 @@ panvk_physical_device_init(struct panvk_physical_device *device,
       goto fail_close_device;
    }
 
+#ifdef ENABLE_SHADER_CACHE
+   /* The GPU ID and the driver build are part of the cache UUID */
+   char cache_id[VK_UUID_SIZE * 2 + 1];
+   disk_cache_format_hex_id(cache_id, device->cache_uuid, VK_UUID_SIZE * 2);
+   device->vk.disk_cache = disk_cache_create("panvk", cache_id, 0);
+#endif
+
+   device->vk.pipeline_cache_import_ops = panvk_cache_import_ops;
+
    vk_warn_non_conformant_implementation("panvk");
 
    panvk_get_driver_uuid(&device->device_uuid);
@@ -368,8 +393,16 @@ panvk_physical_device_init(struct panvk_physical_device *device,
     */
    device->drm_syncobj_type.features &= ~VK_SYNC_FEATURE_TIMELINE;
 
+   /* Timeline semaphores are emulated on top of binary syncobjs. The
+    * runtime resolves timeline waits and signals to binary syncobjs before
+    * calling into panvk_queue_submit(), so the submit path is unchanged.
+    */
+   device->sync_timeline_type =
+      vk_sync_timeline_get_type(&device->drm_syncobj_type);
+
    device->sync_types[0] = &device->drm_syncobj_type;
-   device->sync_types[1] = NULL;
+   device->sync_types[1] = &device->sync_timeline_type.sync;
+   device->sync_types[2] = NULL;
    device->vk.supported_sync_types = device->sync_types;
 
    result = panvk_wsi_init(device);
@@ -431,6 +464,7 @@ panvk_GetPhysicalDeviceFeatures2(VkPhysicalDevice physicalDevice,
       .largePoints = true,
       .textureCompressionETC2 = true,
       .textureCompressionASTC_LDR = true,
+      .occlusionQueryPrecise = true,
       .shaderUniformBufferArrayDynamicIndexing = true,
       .shaderSampledImageArrayDynamicIndexing = true,
       .shaderStorageBufferArrayDynamicIndexing = true,
@@ -494,7 +528,7 @@ panvk_GetPhysicalDeviceFeatures2(VkPhysicalDevice physicalDevice,
       .shaderSubgroupExtendedTypes        = false,
       .separateDepthStencilLayouts        = false,
       .hostQueryReset                     = false,
-      .timelineSemaphore                  = false,
+      .timelineSemaphore                  = true,
       .bufferDeviceAddress                = false,
       .bufferDeviceAddressCaptureReplay   = false,
       .bufferDeviceAddressMultiDevice     = false,
@@ -579,6 +613,18 @@ panvk_GetPhysicalDeviceFeatures2(VkPhysicalDevice physicalDevice,
          features->customBorderColorWithoutFormat = true;
          break;
       }
+      case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT: {
+         VkPhysicalDeviceExtendedDynamicStateFeaturesEXT *features = (void *)ext;
+         features->extendedDynamicState = true;
+         break;
+      }
+      case VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_2_FEATURES_EXT: {
+         VkPhysicalDeviceExtendedDynamicState2FeaturesEXT *features = (void *)ext;
+         features->extendedDynamicState2 = true;
+         features->extendedDynamicState2LogicOp = false;
+         features->extendedDynamicState2PatchControlPoints = false;
+         break;
+      }
       default:
          break;
       }
@@ -741,12 +787,27 @@ panvk_GetPhysicalDeviceProperties2(VkPhysicalDevice physicalDevice,
       .maxPerSetDescriptors                  = (1ull << 31) / 96,
       /* Our buffer size fields allow only this much */
       .maxMemoryAllocationSize               = 0xFFFFFFFFull,
+      .subgroupSize                          = pan_subgroup_size(pdevice->pdev.arch),
+      /* Subgroup operations use the full-warp cross-lane instructions
+       * of Valhall */
+      .subgroupSupportedStages               = pdevice->pdev.arch >= 9 ?
+                                               VK_SHADER_STAGE_COMPUTE_BIT : 0,
+      .subgroupSupportedOperations           = pdevice->pdev.arch >= 9 ?
+                                               VK_SUBGROUP_FEATURE_BASIC_BIT |
+                                               VK_SUBGROUP_FEATURE_VOTE_BIT |
+                                               VK_SUBGROUP_FEATURE_ARITHMETIC_BIT |
+                                               VK_SUBGROUP_FEATURE_BALLOT_BIT |
+                                               VK_SUBGROUP_FEATURE_SHUFFLE_BIT |
+                                               VK_SUBGROUP_FEATURE_SHUFFLE_RELATIVE_BIT |
+                                               VK_SUBGROUP_FEATURE_QUAD_BIT : 0,
+      .subgroupQuadOperationsInAllStages     = false,
    };
    memcpy(core_1_1.driverUUID, pdevice->driver_uuid, VK_UUID_SIZE);
    memcpy(core_1_1.deviceUUID, pdevice->device_uuid, VK_UUID_SIZE);
 
    const VkPhysicalDeviceVulkan12Properties core_1_2 = {
       .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES,
+      .maxTimelineSemaphoreValueDifference = UINT64_MAX,
    };
 
    const VkPhysicalDeviceVulkan13Properties core_1_3 = {
@@ -827,9 +888,12 @@ void
 panvk_GetPhysicalDeviceMemoryProperties2(VkPhysicalDevice physicalDevice,
                                          VkPhysicalDeviceMemoryProperties2 *pMemoryProperties)
 {
+   VK_FROM_HANDLE(panvk_physical_device, device, physicalDevice);
+   uint64_t heap_size = panvk_get_system_heap_size();
+
    pMemoryProperties->memoryProperties = (VkPhysicalDeviceMemoryProperties) {
       .memoryHeapCount = 1,
-      .memoryHeaps[0].size = panvk_get_system_heap_size(),
+      .memoryHeaps[0].size = heap_size,
       .memoryHeaps[0].flags = VK_MEMORY_HEAP_DEVICE_LOCAL_BIT,
       .memoryTypeCount = 1,
       .memoryTypes[0].propertyFlags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
@@ -837,6 +901,24 @@ panvk_GetPhysicalDeviceMemoryProperties2(VkPhysicalDevice physicalDevice,
                                       VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
       .memoryTypes[0].heapIndex = 0,
    };
+
+   VkPhysicalDeviceMemoryBudgetPropertiesEXT *budget =
+      vk_find_struct(pMemoryProperties->pNext,
+                     PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT);
+   if (budget) {
+      uint64_t used = p_atomic_read(&device->heap_used);
+      uint64_t available = 0;
+
+      /* The GPU shares system memory, so what we could still allocate is
+       * bounded by both the heap size and the free memory.
+       */
+      os_get_available_system_memory(&available);
+
+      memset(budget->heapBudget, 0, sizeof(budget->heapBudget));
+      memset(budget->heapUsage, 0, sizeof(budget->heapUsage));
+      budget->heapUsage[0] = used;
+      budget->heapBudget[0] = MIN2(heap_size, used + available);
+   }
 }
 
 static VkResult
@@ -952,12 +1034,33 @@ panvk_CreateDevice(VkPhysicalDevice physicalDevice,
    device->vk.command_dispatch_table = &device->cmd_dispatch;
    device->vk.command_buffer_ops = cmd_buffer_ops;
 
+   /* Emulated timelines default to deferred submission, which flushes on
+    * the application thread and stalls it on wait-before-signal. Move
+    * submission to a per-queue thread instead, so vkQueueSubmit() returns
+    * right away. This needs WAIT_PENDING on the binary syncobjs, which the
+    * kernel only provides with syncobj timeline support.
+    */
+   if (physical_device->drm_syncobj_type.features &
+       VK_SYNC_FEATURE_WAIT_PENDING)
+      vk_device_enable_threaded_submit(&device->vk);
+
    device->instance = physical_device->instance;
    device->physical_device = physical_device;
 
    const struct panfrost_device *pdev = &physical_device->pdev;
    vk_device_set_drm_fd(&device->vk, pdev->fd);
 
+   simple_mtx_init(&device->mem_heap.lock, mtx_plain);
+   list_inithead(&device->mem_heap.slabs);
+
+   struct vk_pipeline_cache_create_info cache_info = { 0 };
+   device->mem_cache = vk_pipeline_cache_create(&device->vk, &cache_info,
+                                                NULL);
+   if (!device->mem_cache) {
+      result = VK_ERROR_OUT_OF_HOST_MEMORY;
+      goto fail;
+   }
+
    for (unsigned i = 0; i < pCreateInfo->queueCreateInfoCount; i++) {
       const VkDeviceQueueCreateInfo *queue_create =
          &pCreateInfo->pQueueCreateInfos[i];
@@ -995,10 +1098,99 @@ fail:
          vk_object_free(&device->vk, NULL, device->queues[i]);
    }
 
+   if (device->mem_cache)
+      vk_pipeline_cache_destroy(device->mem_cache, NULL);
+   simple_mtx_destroy(&device->mem_heap.lock);
    vk_free(&device->vk.alloc, device);
    return result;
 }
 
+static void
+panvk_mem_slab_destroy(struct panvk_device *device,
+                       struct panvk_mem_slab *slab)
+{
+   p_atomic_add(&device->physical_device->heap_used, -(int64_t)slab->bo->size);
+   list_del(&slab->node);
+   util_vma_heap_finish(&slab->heap);
+   panfrost_bo_unreference(slab->bo);
+   vk_free(&device->vk.alloc, slab);
+}
+
+static bool
+panvk_mem_suballoc(struct panvk_device *device,
+                   struct panvk_device_memory *mem, uint64_t size)
+{
+   size = ALIGN_POT(size, PANVK_MEM_SUBALLOC_ALIGN);
+
+   simple_mtx_lock(&device->mem_heap.lock);
+
+   list_for_each_entry(struct panvk_mem_slab, slab,
+                       &device->mem_heap.slabs, node) {
+      uint64_t addr = util_vma_heap_alloc(&slab->heap, size,
+                                          PANVK_MEM_SUBALLOC_ALIGN);
+
+      if (addr) {
+         mem->slab = slab;
+         mem->offset = addr - slab->bo->ptr.gpu;
+         break;
+      }
+   }
+
+   if (!mem->slab) {
+      struct panvk_mem_slab *slab =
+         vk_zalloc(&device->vk.alloc, sizeof(*slab), 8,
+                   VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+      if (!slab)
+         goto out;
+
+      slab->bo = panfrost_bo_create(&device->physical_device->pdev,
+                                    PANVK_MEM_SLAB_SIZE, 0,
+                                    "User-requested memory slab");
+      if (!slab->bo) {
+         vk_free(&device->vk.alloc, slab);
+         goto out;
+      }
+
+      p_atomic_add(&device->physical_device->heap_used, slab->bo->size);
+      util_vma_heap_init(&slab->heap, slab->bo->ptr.gpu, slab->bo->size);
+      list_add(&slab->node, &device->mem_heap.slabs);
+
+      mem->slab = slab;
+      mem->offset = util_vma_heap_alloc(&slab->heap, size,
+                                        PANVK_MEM_SUBALLOC_ALIGN) -
+                    slab->bo->ptr.gpu;
+   }
+
+   mem->bo = mem->slab->bo;
+   mem->size = size;
+   mem->slab->used += size;
+
+out:
+   simple_mtx_unlock(&device->mem_heap.lock);
+   return mem->slab != NULL;
+}
+
+static void
+panvk_mem_suballoc_free(struct panvk_device *device,
+                        struct panvk_device_memory *mem)
+{
+   struct panvk_mem_slab *slab = mem->slab;
+
+   simple_mtx_lock(&device->mem_heap.lock);
+
+   util_vma_heap_free(&slab->heap, slab->bo->ptr.gpu + mem->offset,
+                      mem->size);
+   slab->used -= mem->size;
+
+   /* Keep one empty slab around so allocating and freeing a single small
+    * memory object doesn't create and destroy a BO each time.
+    */
+   if (!slab->used && !list_is_singular(&device->mem_heap.slabs))
+      panvk_mem_slab_destroy(device, slab);
+
+   simple_mtx_unlock(&device->mem_heap.lock);
+}
+
 void
 panvk_DestroyDevice(VkDevice _device, const VkAllocationCallbacks *pAllocator)
 {
@@ -1014,6 +1206,13 @@ panvk_DestroyDevice(VkDevice _device, const VkAllocationCallbacks *pAllocator)
          vk_object_free(&device->vk, NULL, device->queues[i]);
    }
 
+   vk_pipeline_cache_destroy(device->mem_cache, NULL);
+
+   list_for_each_entry_safe(struct panvk_mem_slab, slab,
+                            &device->mem_heap.slabs, node)
+      panvk_mem_slab_destroy(device, slab);
+   simple_mtx_destroy(&device->mem_heap.lock);
+
    vk_free(&device->vk.alloc, device);
 }
 
@@ -1117,18 +1316,27 @@ panvk_AllocateMemory(VkDevice _device,
       return VK_SUCCESS;
    }
 
-   mem = vk_object_alloc(&device->vk, pAllocator, sizeof(*mem),
-                         VK_OBJECT_TYPE_DEVICE_MEMORY);
+   mem = vk_object_zalloc(&device->vk, pAllocator, sizeof(*mem),
+                          VK_OBJECT_TYPE_DEVICE_MEMORY);
    if (mem == NULL)
       return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
 
    const VkImportMemoryFdInfoKHR *fd_info =
       vk_find_struct_const(pAllocateInfo->pNext,
                            IMPORT_MEMORY_FD_INFO_KHR);
+   const VkExportMemoryAllocateInfo *export_info =
+      vk_find_struct_const(pAllocateInfo->pNext,
+                           EXPORT_MEMORY_ALLOCATE_INFO);
 
    if (fd_info && !fd_info->handleType)
       fd_info = NULL;
 
+   /* Exported memory must own its BO */
+   bool suballoc =
+      !fd_info && !(export_info && export_info->handleTypes) &&
+      pAllocateInfo->allocationSize <= PANVK_MEM_SUBALLOC_MAX_SIZE &&
+      !(device->instance->debug_flags & PANVK_DEBUG_NO_SUBALLOC);
+
    if (fd_info) {
       assert(fd_info->handleType ==
                 VK_EXTERNAL_MEMORY_HANDLE_TYPE_OPAQUE_FD_BIT ||
@@ -1140,10 +1348,11 @@ panvk_AllocateMemory(VkDevice _device,
        * reference counting.  We need to maintain a per-instance handle-to-bo
        * table and add reference count to panvk_bo.
        */
-      mem->bo = panfrost_bo_import(&device->physical_device->pdev, fd_info->fd);
+      mem->bo = panfrost_bo_import(&device->physical_device->pdev, fd_info->fd, 0);
       /* take ownership and close the fd */
       close(fd_info->fd);
-   } else {
+   } else if (!suballoc ||
+              !panvk_mem_suballoc(device, mem, pAllocateInfo->allocationSize)) {
       mem->bo = panfrost_bo_create(&device->physical_device->pdev,
                                    pAllocateInfo->allocationSize, 0,
                                    "User-requested memory");
@@ -1151,6 +1360,9 @@ panvk_AllocateMemory(VkDevice _device,
 
    assert(mem->bo);
 
+   if (!mem->slab)
+      p_atomic_add(&device->physical_device->heap_used, mem->bo->size);
+
    *pMem = panvk_device_memory_to_handle(mem);
 
    return VK_SUCCESS;
@@ -1167,7 +1379,14 @@ panvk_FreeMemory(VkDevice _device,
    if (mem == NULL)
       return;
 
-   panfrost_bo_unreference(mem->bo);
+   if (mem->slab) {
+      panvk_mem_suballoc_free(device, mem);
+   } else {
+      p_atomic_add(&device->physical_device->heap_used,
+                   -(int64_t)mem->bo->size);
+      panfrost_bo_unreference(mem->bo);
+   }
+
    vk_object_free(&device->vk, pAllocator, mem);
 }
 
@@ -1193,7 +1412,7 @@ panvk_MapMemory(VkDevice _device,
    *ppData = mem->bo->ptr.cpu;
 
    if (*ppData) {
-      *ppData += offset;
+      *ppData += mem->offset + offset;
       return VK_SUCCESS;
    }
 
@@ -1279,7 +1498,7 @@ panvk_BindBufferMemory2(VkDevice device,
 
       if (mem) {
          buffer->bo = mem->bo;
-         buffer->bo_offset = pBindInfos[i].memoryOffset;
+         buffer->bo_offset = mem->offset + pBindInfos[i].memoryOffset;
       } else {
          buffer->bo = NULL;
       }
@@ -1298,7 +1517,7 @@ panvk_BindImageMemory2(VkDevice device,
 
       if (mem) {
          image->pimage.data.bo = mem->bo;
-         image->pimage.data.offset = pBindInfos[i].memoryOffset;
+         image->pimage.data.offset = mem->offset + pBindInfos[i].memoryOffset;
          /* Reset the AFBC headers */
          if (drm_is_afbc(image->pimage.layout.modifier)) {
             void *base = image->pimage.data.bo->ptr.cpu + image->pimage.data.offset;
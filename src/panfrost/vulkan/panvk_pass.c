@@ -30,6 +30,65 @@
 #include "vk_format.h"
 #include "vk_util.h"
 
+/* A subpass rendering to the same attachments as the previous one continues
+ * its batch, keeping the attachments in the tile buffer instead of writing
+ * them back and preloading them again. Input attachments are read through
+ * textures, and the vertex jobs of a batch run before its fragment job, so
+ * this is only possible when the subpass has no input attachments and only
+ * depends on the attachment writes of the batch's previous subpasses.
+ */
+static bool
+panvk_subpass_can_merge(const struct panvk_render_pass *pass,
+                        const VkRenderPassCreateInfo2 *pCreateInfo,
+                        uint32_t first, uint32_t i)
+{
+   const struct panvk_subpass *prev = &pass->subpasses[i - 1];
+   const struct panvk_subpass *subpass = &pass->subpasses[i];
+   const VkPipelineStageFlags2 attachment_stages =
+      VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT |
+      VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT |
+      VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+
+   if (subpass->color_count != prev->color_count ||
+       subpass->zs_attachment.idx != prev->zs_attachment.idx ||
+       subpass->view_mask != prev->view_mask ||
+       prev->resolve_attachments)
+      return false;
+
+   for (uint32_t j = 0; j < subpass->color_count; j++) {
+      if (subpass->color_attachments[j].idx != prev->color_attachments[j].idx)
+         return false;
+   }
+
+   for (uint32_t j = 0; j < subpass->input_count; j++) {
+      if (subpass->input_attachments[j].idx != VK_ATTACHMENT_UNUSED)
+         return false;
+   }
+
+   for (uint32_t d = 0; d < pCreateInfo->dependencyCount; d++) {
+      const VkSubpassDependency2 *dep = &pCreateInfo->pDependencies[d];
+
+      if (dep->dstSubpass != i || dep->srcSubpass == VK_SUBPASS_EXTERNAL ||
+          dep->srcSubpass < first || dep->srcSubpass == i)
+         continue;
+
+      const VkMemoryBarrier2 *barrier =
+         vk_find_struct_const(dep->pNext, MEMORY_BARRIER_2);
+      VkPipelineStageFlags2 src_stages =
+         barrier ? barrier->srcStageMask : dep->srcStageMask;
+      VkPipelineStageFlags2 dst_stages =
+         barrier ? barrier->dstStageMask : dep->dstStageMask;
+
+      if (!(dep->dependencyFlags & VK_DEPENDENCY_BY_REGION_BIT) ||
+          (src_stages & ~attachment_stages) ||
+          (dst_stages & ~(attachment_stages |
+                          VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT)))
+         return false;
+   }
+
+   return true;
+}
+
 VkResult
 panvk_CreateRenderPass2(VkDevice _device,
                         const VkRenderPassCreateInfo2 *pCreateInfo,
@@ -124,9 +183,13 @@ panvk_CreateRenderPass2(VkDevice _device,
                .idx = desc->pInputAttachments[j].attachment,
                .layout = desc->pInputAttachments[j].layout,
             };
-            if (desc->pInputAttachments[j].attachment != VK_ATTACHMENT_UNUSED)
-               pass->attachments[desc->pInputAttachments[j].attachment]
-                  .view_mask |= subpass->view_mask;
+            if (desc->pInputAttachments[j].attachment != VK_ATTACHMENT_UNUSED) {
+               struct panvk_render_pass_attachment *att =
+                  &pass->attachments[desc->pInputAttachments[j].attachment];
+
+               att->view_mask |= subpass->view_mask;
+               att->last_used_in_subpass = i;
+            }
          }
       }
 
@@ -153,6 +216,7 @@ panvk_CreateRenderPass2(VkDevice _device,
                } else {
                   subpass->color_attachments[j].preload = true;
                }
+               pass->attachments[idx].last_used_in_subpass = i;
             }
          }
       }
@@ -188,12 +252,59 @@ panvk_CreateRenderPass2(VkDevice _device,
                subpass->zs_attachment.clear = true;
             else if (pass->attachments[idx].load_op == VK_ATTACHMENT_LOAD_OP_LOAD)
                subpass->zs_attachment.preload = true;
+
+            if (pass->attachments[idx].stencil_load_op == VK_ATTACHMENT_LOAD_OP_CLEAR)
+               subpass->zs_attachment.stencil_clear = true;
+            else if (pass->attachments[idx].stencil_load_op == VK_ATTACHMENT_LOAD_OP_LOAD)
+               subpass->zs_attachment.stencil_preload = true;
          } else {
             subpass->zs_attachment.preload = true;
+            subpass->zs_attachment.stencil_preload = true;
          }
+         pass->attachments[idx].last_used_in_subpass = i;
+      }
+   }
+
+   /* Attachments stored with VK_ATTACHMENT_STORE_OP_DONT_CARE are not
+    * written back after their last use.
+    */
+   for (uint32_t i = 0; i < pCreateInfo->subpassCount; i++) {
+      struct panvk_subpass *subpass = &pass->subpasses[i];
+
+      for (uint32_t j = 0; j < subpass->color_count; j++) {
+         uint32_t idx = subpass->color_attachments[j].idx;
+
+         if (idx == VK_ATTACHMENT_UNUSED)
+            continue;
+
+         const struct panvk_render_pass_attachment *att =
+            &pass->attachments[idx];
+
+         subpass->color_attachments[j].discard =
+            att->last_used_in_subpass == i &&
+            att->store_op == VK_ATTACHMENT_STORE_OP_DONT_CARE;
+      }
+
+      if (subpass->zs_attachment.idx != VK_ATTACHMENT_UNUSED) {
+         const struct panvk_render_pass_attachment *att =
+            &pass->attachments[subpass->zs_attachment.idx];
+
+         subpass->zs_attachment.discard =
+            att->last_used_in_subpass == i &&
+            att->store_op == VK_ATTACHMENT_STORE_OP_DONT_CARE;
+         subpass->zs_attachment.stencil_discard =
+            att->last_used_in_subpass == i &&
+            att->stencil_store_op == VK_ATTACHMENT_STORE_OP_DONT_CARE;
       }
    }
 
+   for (uint32_t i = 1, first = 0; i < pCreateInfo->subpassCount; i++) {
+      pass->subpasses[i].merged =
+         panvk_subpass_can_merge(pass, pCreateInfo, first, i);
+      if (!pass->subpasses[i].merged)
+         first = i;
+   }
+
    *pRenderPass = panvk_render_pass_to_handle(pass);
    return VK_SUCCESS;
 }
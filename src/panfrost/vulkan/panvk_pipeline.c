@@ -49,7 +49,8 @@ panvk_DestroyPipeline(VkDevice _device,
    VK_FROM_HANDLE(panvk_device, device, _device);
    VK_FROM_HANDLE(panvk_pipeline, pipeline, _pipeline);
 
-   panfrost_bo_unreference(pipeline->binary_bo);
+   for (unsigned i = 0; i < MESA_SHADER_STAGES; i++)
+      panfrost_bo_unreference(pipeline->binary_bos[i]);
    panfrost_bo_unreference(pipeline->state_bo);
    vk_object_free(&device->vk, pAllocator, pipeline);
 }
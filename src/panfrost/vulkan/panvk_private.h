@@ -48,6 +48,8 @@
 #include "compiler/shader_enums.h"
 #include "util/list.h"
 #include "util/macros.h"
+#include "util/simple_mtx.h"
+#include "util/vma.h"
 #include "vk_alloc.h"
 #include "vk_buffer.h"
 #include "vk_command_buffer.h"
@@ -59,9 +61,11 @@
 #include "vk_log.h"
 #include "vk_object.h"
 #include "vk_physical_device.h"
+#include "vk_pipeline_cache.h"
 #include "vk_pipeline_layout.h"
 #include "vk_queue.h"
 #include "vk_sync.h"
+#include "vk_sync_timeline.h"
 #include "wsi_common.h"
 
 #include "drm-uapi/panfrost_drm.h"
@@ -159,6 +163,9 @@ struct panvk_meta {
       struct {
          mali_ptr rsd;
       } buf2img[PANVK_META_COPY_BUF2IMG_NUM_FORMATS];
+      struct {
+         mali_ptr rsd;
+      } buf2img_compute[2][PANVK_META_COPY_BUF2BUF_NUM_BLKSIZES];
       struct {
          mali_ptr rsd;
       } img2buf[PANVK_META_COPY_NUM_TEX_TYPES][PANVK_META_COPY_IMG2BUF_NUM_FORMATS];
@@ -172,6 +179,12 @@ struct panvk_meta {
          mali_ptr rsd;
       } fillbuf;
    } copy;
+
+   struct {
+      struct {
+         mali_ptr rsd;
+      } copy_occlusion, copy_timestamp;
+   } query;
 };
 
 struct panvk_physical_device {
@@ -189,11 +202,15 @@ struct panvk_physical_device {
    uint8_t cache_uuid[VK_UUID_SIZE];
 
    struct vk_sync_type drm_syncobj_type;
-   const struct vk_sync_type *sync_types[2];
+   struct vk_sync_timeline_type sync_timeline_type;
+   const struct vk_sync_type *sync_types[3];
 
    struct wsi_device wsi_device;
    struct panvk_meta meta;
 
+   /* Bytes of BOs backing VkDeviceMemory objects, for VK_EXT_memory_budget */
+   uint64_t heap_used;
+
    int master_fd;
 };
 
@@ -205,6 +222,7 @@ enum panvk_debug_flags {
    PANVK_DEBUG_AFBC = 1 << 4,
    PANVK_DEBUG_LINEAR = 1 << 5,
    PANVK_DEBUG_DUMP = 1 << 6,
+   PANVK_DEBUG_NO_SUBALLOC = 1 << 7,
 };
 
 struct panvk_instance {
@@ -228,11 +246,6 @@ bool
 panvk_physical_device_extension_supported(struct panvk_physical_device *dev,
                                        const char *name);
 
-struct panvk_pipeline_cache {
-   struct vk_object_base base;
-   VkAllocationCallbacks alloc;
-};
-
 #define PANVK_MAX_QUEUE_FAMILIES 1
 
 struct panvk_queue {
@@ -241,6 +254,26 @@ struct panvk_queue {
    uint32_t sync;
 };
 
+/* VkDeviceMemory objects of at most PANVK_MEM_SUBALLOC_MAX_SIZE bytes are
+ * sub-allocated from slabs of PANVK_MEM_SLAB_SIZE bytes, saving a BO
+ * allocation and mapping each, and keeping the BO lists of submissions
+ * short.
+ */
+#define PANVK_MEM_SLAB_SIZE (4 * 1024 * 1024)
+#define PANVK_MEM_SUBALLOC_MAX_SIZE (256 * 1024)
+
+/* Sub-allocations are aligned on the largest alignment memory requirements
+ * ask for.
+ */
+#define PANVK_MEM_SUBALLOC_ALIGN 4096
+
+struct panvk_mem_slab {
+   struct list_head node;
+   struct panfrost_bo *bo;
+   struct util_vma_heap heap;
+   uint64_t used;
+};
+
 struct panvk_device {
    struct vk_device vk;
 
@@ -252,6 +285,15 @@ struct panvk_device {
    int queue_count[PANVK_MAX_QUEUE_FAMILIES];
 
    struct panvk_physical_device *physical_device;
+
+   /* Used when pipelines are created without a VkPipelineCache */
+   struct vk_pipeline_cache *mem_cache;
+
+   struct {
+      simple_mtx_t lock;
+      struct list_head slabs;
+   } mem_heap;
+
    int _lost;
 };
 
@@ -291,6 +333,17 @@ struct panvk_batch {
    struct pan_tls_info tlsinfo;
    unsigned wls_total_size;
    bool issued;
+
+   /* Jobs submitted once the fragment job is done (query availability and
+    * timestamp writes) */
+   struct pan_scoreboard post_fragment;
+
+   /* Query pool BOs written by the post-fragment jobs */
+   struct util_dynarray query_bos;
+
+   /* GEM handles to pass at submit time, gathered once when the command
+    * buffer is ended since they can't change afterwards */
+   struct util_dynarray bos;
 };
 
 enum panvk_event_op_type {
@@ -307,6 +360,13 @@ struct panvk_event_op {
 struct panvk_device_memory {
    struct vk_object_base base;
    struct panfrost_bo *bo;
+
+   /* Range of the slab BO for sub-allocated memory, offset is zero
+    * otherwise.
+    */
+   struct panvk_mem_slab *slab;
+   uint64_t offset;
+   uint64_t size;
 };
 
 struct panvk_buffer_desc {
@@ -318,6 +378,7 @@ struct panvk_buffer_desc {
 struct panvk_descriptor_set {
    struct vk_object_base base;
    struct panvk_descriptor_pool *pool;
+   struct list_head link;
    const struct panvk_descriptor_set_layout *layout;
    struct panvk_buffer_desc *dyn_ssbos;
    void *ubos;
@@ -327,7 +388,20 @@ struct panvk_descriptor_set {
    void *img_attrib_bufs;
    uint32_t *img_fmts;
 
-   struct panfrost_bo *desc_bo;
+   /* Texture and sampler tables and descriptor UBO, sub-allocated from the
+    * pool BO
+    */
+   struct panfrost_ptr gpu_mem;
+   size_t gpu_size;
+
+   /* GPU address of the texture table, and of the sampler table including
+    * the leading dummy sampler. Bound directly when the set provides all
+    * the textures or samplers of a pipeline.
+    */
+   mali_ptr textures_table;
+   mali_ptr samplers_table;
+
+   struct panfrost_ptr desc_ubo;
 };
 
 #define MAX_SETS 4
@@ -474,11 +548,36 @@ struct panvk_desc_pool_counters {
    unsigned sets;
 };
 
+/* GPU descriptors of a set are sub-allocated at PANVK_DESC_SET_ALIGN, as
+ * required by TEXTURE and SAMPLER descriptors, and the descriptor UBO in it
+ * at PANVK_DESC_UBO_ALIGN, as required by UNIFORM_BUFFER descriptors.
+ */
+#define PANVK_DESC_SET_ALIGN 32
+#define PANVK_DESC_UBO_ALIGN 16
+
 struct panvk_descriptor_pool {
    struct vk_object_base base;
    struct panvk_desc_pool_counters max;
    struct panvk_desc_pool_counters cur;
-   struct panvk_descriptor_set *sets;
+
+   /* Live sets, released on reset and destroy */
+   struct list_head sets;
+
+   /* Pools created without VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT
+    * are linear arenas: set objects and their descriptors are bump-allocated
+    * from host_mem and desc_bo, and resetting the pool rewinds the offsets.
+    * Other pools allocate set objects individually and sub-allocate the
+    * GPU descriptors from desc_bo with desc_heap.
+    */
+   bool linear;
+
+   void *host_mem;
+   size_t host_size;
+   size_t host_offset;
+
+   struct panfrost_bo *desc_bo;
+   uint64_t desc_offset;
+   struct util_vma_heap desc_heap;
 };
 
 struct panvk_buffer {
@@ -520,7 +619,20 @@ enum panvk_dynamic_state_bits {
    PANVK_DYNAMIC_DISCARD_RECTANGLE = 1 << 9,
    PANVK_DYNAMIC_SSBO = 1 << 10,
    PANVK_DYNAMIC_VERTEX_INSTANCE_OFFSETS = 1 << 11,
-   PANVK_DYNAMIC_ALL = (1 << 12) - 1,
+   PANVK_DYNAMIC_CULL_MODE = 1 << 12,
+   PANVK_DYNAMIC_FRONT_FACE = 1 << 13,
+   PANVK_DYNAMIC_PRIMITIVE_TOPOLOGY = 1 << 14,
+   PANVK_DYNAMIC_VERTEX_INPUT_BINDING_STRIDE = 1 << 15,
+   PANVK_DYNAMIC_DEPTH_TEST_ENABLE = 1 << 16,
+   PANVK_DYNAMIC_DEPTH_WRITE_ENABLE = 1 << 17,
+   PANVK_DYNAMIC_DEPTH_COMPARE_OP = 1 << 18,
+   PANVK_DYNAMIC_DEPTH_BOUNDS_TEST_ENABLE = 1 << 19,
+   PANVK_DYNAMIC_STENCIL_TEST_ENABLE = 1 << 20,
+   PANVK_DYNAMIC_STENCIL_OP = 1 << 21,
+   PANVK_DYNAMIC_RASTERIZER_DISCARD_ENABLE = 1 << 22,
+   PANVK_DYNAMIC_DEPTH_BIAS_ENABLE = 1 << 23,
+   PANVK_DYNAMIC_PRIMITIVE_RESTART_ENABLE = 1 << 24,
+   PANVK_DYNAMIC_ALL = (1 << 25) - 1,
 };
 
 /* This has to match nir_address_format_64bit_bounded_global */
@@ -619,6 +731,13 @@ struct panvk_draw_info {
    const struct pan_tiler_context *tiler_ctx;
    mali_ptr fs_rsd;
    mali_ptr viewport;
+   unsigned topology;
+   bool primitive_restart;
+   bool front_ccw;
+   bool cull_front_face;
+   bool cull_back_face;
+   bool rasterize;
+   mali_ptr occlusion;
    struct {
       struct panfrost_ptr vertex;
       struct panfrost_ptr tiler;
@@ -664,6 +783,9 @@ struct panvk_attribs_info {
 struct panvk_attrib_buf {
    mali_ptr address;
    unsigned size;
+
+   /* Only used if the stride is dynamic */
+   unsigned stride;
 };
 
 struct panvk_cmd_state {
@@ -678,13 +800,22 @@ struct panvk_cmd_state {
 
    struct {
       struct {
+         bool enable;
          float constant_factor;
          float clamp;
          float slope_factor;
       } depth_bias;
       float line_width;
+      VkCullModeFlags cull_mode;
+      VkFrontFace front_face;
+      bool discard;
    } rast;
 
+   struct {
+      VkPrimitiveTopology topology;
+      bool primitive_restart;
+   } ia;
+
    struct {
       struct panvk_attrib_buf bufs[MAX_VBS];
       unsigned count;
@@ -699,7 +830,15 @@ struct panvk_cmd_state {
    } ib;
 
    struct {
+      bool z_test;
+      bool z_write;
+      VkCompareOp z_compare_op;
+      bool s_test;
       struct {
+         VkStencilOp fail_op;
+         VkStencilOp pass_op;
+         VkStencilOp z_fail_op;
+         VkCompareOp compare_op;
          uint8_t compare_mask;
          uint8_t write_mask;
          uint8_t ref;
@@ -722,6 +861,12 @@ struct panvk_cmd_state {
    VkViewport viewport;
    VkRect2D scissor;
 
+   /* Active occlusion query, ptr points to its per-core counters */
+   struct {
+      struct panfrost_bo *bo;
+      mali_ptr ptr;
+   } occlusion_query;
+
    struct panvk_batch *batch;
 };
 
@@ -770,12 +915,18 @@ struct panvk_cmd_buffer {
 struct panvk_batch *
 panvk_cmd_open_batch(struct panvk_cmd_buffer *cmdbuf);
 
+void
+panvk_batch_add_query_bo(struct panvk_batch *batch, struct panfrost_bo *bo);
+
 void
 panvk_cmd_fb_info_set_subpass(struct panvk_cmd_buffer *cmdbuf);
 
 void
 panvk_cmd_fb_info_init(struct panvk_cmd_buffer *cmdbuf);
 
+void
+panvk_cmd_fb_info_set_discard(struct panvk_cmd_buffer *cmdbuf);
+
 void
 panvk_cmd_preload_fb_after_batch_split(struct panvk_cmd_buffer *cmdbuf);
 
@@ -789,28 +940,66 @@ struct panvk_event {
    uint32_t syncobj;
 };
 
+/* Each query slot starts with a 64-bit availability word written by the GPU,
+ * followed by the 64-bit result, or one counter per shader core for
+ * occlusion queries.
+ */
+struct panvk_query_pool {
+   struct vk_object_base base;
+   VkQueryType type;
+   uint32_t query_count;
+   uint32_t query_stride;
+   unsigned value_count;
+   struct panfrost_bo *bo;
+};
+
+static inline mali_ptr
+panvk_query_gpu_ptr(const struct panvk_query_pool *pool, uint32_t query)
+{
+   return pool->bo->ptr.gpu + (uint64_t)query * pool->query_stride;
+}
+
+/* Compiled shaders are vk_pipeline_cache objects keyed by the SHA-1 of
+ * everything the compilation depends on, see
+ * panvk_pipeline_builder_compile_shaders().
+ */
 struct panvk_shader {
+   struct vk_pipeline_cache_object base;
+   unsigned char sha1[20];
+
    struct pan_shader_info info;
    struct util_dynarray binary;
+
+   /* The binary is uploaded once, pipelines using the shader take a
+    * reference to this BO. NULL if the binary is empty.
+    */
+   struct panfrost_bo *bo;
+
    unsigned sysval_ubo;
    struct pan_compute_dim local_size;
    bool has_img_access;
 };
 
+extern const struct vk_pipeline_cache_object_ops panvk_shader_ops;
+extern const struct vk_pipeline_cache_object_ops *const panvk_cache_import_ops[];
+
 struct panvk_shader *
-panvk_shader_create(struct panvk_device *dev,
-                    gl_shader_stage stage,
-                    const VkPipelineShaderStageCreateInfo *stage_info,
-                    const struct panvk_pipeline_layout *layout,
-                    unsigned sysval_ubo,
-                    struct pan_blend_state *blend_state,
-                    bool static_blend_constants,
-                    const VkAllocationCallbacks *alloc);
+panvk_shader_alloc(struct panvk_device *dev, const unsigned char *sha1);
 
 void
-panvk_shader_destroy(struct panvk_device *dev,
-                     struct panvk_shader *shader,
-                     const VkAllocationCallbacks *alloc);
+panvk_shader_upload(struct panvk_device *dev, struct panvk_shader *shader);
+
+static inline mali_ptr
+panvk_shader_get_address(const struct panvk_shader *shader)
+{
+   return shader->bo ? shader->bo->ptr.gpu : 0;
+}
+
+static inline void
+panvk_shader_unref(struct panvk_shader *shader)
+{
+   vk_pipeline_cache_object_unref(&shader->base);
+}
 
 #define RSD_WORDS 16
 #define BLEND_DESC_WORDS 4
@@ -827,7 +1016,7 @@ struct panvk_pipeline {
 
    uint32_t dynamic_state_mask;
 
-   struct panfrost_bo *binary_bo;
+   struct panfrost_bo *binary_bos[MESA_SHADER_STAGES];
    struct panfrost_bo *state_bo;
 
    mali_ptr vpd;
@@ -881,6 +1070,7 @@ struct panvk_pipeline {
    } rast;
 
    struct {
+      bool attachment;
       bool z_test;
       bool z_write;
       unsigned z_compare_func;
@@ -995,6 +1185,14 @@ struct panvk_subpass_attachment {
    VkImageLayout layout;
    bool clear;
    bool preload;
+
+   /* Not written back at the end of the subpass */
+   bool discard;
+
+   /* Stencil aspect of depth/stencil attachments */
+   bool stencil_clear;
+   bool stencil_preload;
+   bool stencil_discard;
 };
 
 struct panvk_subpass {
@@ -1007,6 +1205,9 @@ struct panvk_subpass {
    struct panvk_subpass_attachment zs_attachment;
 
    uint32_t view_mask;
+
+   /* Continues the batch of the previous subpass */
+   bool merged;
 };
 
 struct panvk_render_pass_attachment {
@@ -1021,6 +1222,7 @@ struct panvk_render_pass_attachment {
    VkImageLayout final_layout;
    unsigned view_mask;
    unsigned first_used_in_subpass;
+   unsigned last_used_in_subpass;
 };
 
 struct panvk_render_pass {
@@ -1051,9 +1253,9 @@ VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_event, base, VkEvent, VK_OBJECT_TYPE_EVENT)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_framebuffer, base, VkFramebuffer, VK_OBJECT_TYPE_FRAMEBUFFER)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_image, vk.base, VkImage, VK_OBJECT_TYPE_IMAGE)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_image_view, vk.base, VkImageView, VK_OBJECT_TYPE_IMAGE_VIEW);
-VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_pipeline_cache, base, VkPipelineCache, VK_OBJECT_TYPE_PIPELINE_CACHE)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_pipeline, base, VkPipeline, VK_OBJECT_TYPE_PIPELINE)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_pipeline_layout, vk.base, VkPipelineLayout, VK_OBJECT_TYPE_PIPELINE_LAYOUT)
+VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_query_pool, base, VkQueryPool, VK_OBJECT_TYPE_QUERY_POOL)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_render_pass, base, VkRenderPass, VK_OBJECT_TYPE_RENDER_PASS)
 VK_DEFINE_NONDISP_HANDLE_CASTS(panvk_sampler, base, VkSampler, VK_OBJECT_TYPE_SAMPLER)
 
@@ -1103,6 +1305,10 @@ panvk_per_arch(blend_needs_lowering)(const struct panfrost_device *dev,
                                      const struct pan_blend_state *state,
                                      unsigned rt);
 
+void
+panvk_per_arch(blend_lower_state)(const struct panfrost_device *dev,
+                                  struct pan_blend_state *state);
+
 struct panvk_shader *
 panvk_per_arch(shader_create)(struct panvk_device *dev,
                               gl_shader_stage stage,
@@ -1111,7 +1317,7 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
                               unsigned sysval_ubo,
                               struct pan_blend_state *blend_state,
                               bool static_blend_constants,
-                              const VkAllocationCallbacks *alloc);
+                              const unsigned char *sha1);
 struct nir_shader;
 
 bool
@@ -29,7 +29,45 @@ panvk_CreateQueryPool(VkDevice _device,
                       const VkAllocationCallbacks *pAllocator,
                       VkQueryPool *pQueryPool)
 {
-   panvk_stub();
+   VK_FROM_HANDLE(panvk_device, device, _device);
+   struct panfrost_device *pdev = &device->physical_device->pdev;
+   struct panvk_query_pool *pool;
+   unsigned value_count;
+
+   switch (pCreateInfo->queryType) {
+   case VK_QUERY_TYPE_OCCLUSION:
+      /* The hardware accumulates samples in one counter per shader core */
+      value_count = pdev->core_id_range;
+      break;
+   case VK_QUERY_TYPE_TIMESTAMP:
+      value_count = 1;
+      break;
+   default:
+      unreachable("Unsupported query type");
+   }
+
+   pool = vk_object_zalloc(&device->vk, pAllocator, sizeof(*pool),
+                           VK_OBJECT_TYPE_QUERY_POOL);
+   if (!pool)
+      return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
+
+   pool->type = pCreateInfo->queryType;
+   pool->query_count = pCreateInfo->queryCount;
+   pool->value_count = value_count;
+   pool->query_stride = (1 + value_count) * sizeof(uint64_t);
+
+   pool->bo = panfrost_bo_create(pdev,
+                                 (size_t)pool->query_stride * pool->query_count,
+                                 0, "Query pool");
+   if (!pool->bo) {
+      vk_object_free(&device->vk, pAllocator, pool);
+      return vk_error(device, VK_ERROR_OUT_OF_DEVICE_MEMORY);
+   }
+
+   /* Queries must be reset before use, but start from a known state */
+   memset(pool->bo->ptr.cpu, 0, pool->bo->size);
+
+   *pQueryPool = panvk_query_pool_to_handle(pool);
    return VK_SUCCESS;
 }
 
@@ -38,7 +76,46 @@ panvk_DestroyQueryPool(VkDevice _device,
                        VkQueryPool _pool,
                        const VkAllocationCallbacks *pAllocator)
 {
-   panvk_stub();
+   VK_FROM_HANDLE(panvk_device, device, _device);
+   VK_FROM_HANDLE(panvk_query_pool, pool, _pool);
+
+   if (!pool)
+      return;
+
+   panfrost_bo_unreference(pool->bo);
+   vk_object_free(&device->vk, pAllocator, pool);
+}
+
+static bool
+panvk_query_is_available(const struct panvk_query_pool *pool, uint32_t query)
+{
+   const volatile uint64_t *slot =
+      pool->bo->ptr.cpu + (uint64_t)query * pool->query_stride;
+
+   return slot[0] != 0;
+}
+
+static uint64_t
+panvk_query_get_value(const struct panvk_query_pool *pool, uint32_t query)
+{
+   const volatile uint64_t *slot =
+      pool->bo->ptr.cpu + (uint64_t)query * pool->query_stride;
+   uint64_t value = 0;
+
+   for (unsigned i = 0; i < pool->value_count; i++)
+      value += slot[1 + i];
+
+   return value;
+}
+
+static void
+panvk_query_write_result(void *dst, uint32_t idx, VkQueryResultFlags flags,
+                         uint64_t value)
+{
+   if (flags & VK_QUERY_RESULT_64_BIT)
+      ((uint64_t *)dst)[idx] = value;
+   else
+      ((uint32_t *)dst)[idx] = value;
 }
 
 VkResult
@@ -51,54 +128,49 @@ panvk_GetQueryPoolResults(VkDevice _device,
                           VkDeviceSize stride,
                           VkQueryResultFlags flags)
 {
-   panvk_stub();
-   return VK_SUCCESS;
-}
+   VK_FROM_HANDLE(panvk_device, device, _device);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+   VkResult result = VK_SUCCESS;
 
-void
-panvk_CmdCopyQueryPoolResults(VkCommandBuffer commandBuffer,
-                              VkQueryPool queryPool,
-                              uint32_t firstQuery,
-                              uint32_t queryCount,
-                              VkBuffer dstBuffer,
-                              VkDeviceSize dstOffset,
-                              VkDeviceSize stride,
-                              VkQueryResultFlags flags)
-{
-   panvk_stub();
-}
+   assert(firstQuery + queryCount <= pool->query_count);
 
-void
-panvk_CmdResetQueryPool(VkCommandBuffer commandBuffer,
-                        VkQueryPool queryPool,
-                        uint32_t firstQuery,
-                        uint32_t queryCount)
-{
-   panvk_stub();
-}
+   if (panvk_device_is_lost(device))
+      return VK_ERROR_DEVICE_LOST;
 
-void
-panvk_CmdBeginQuery(VkCommandBuffer commandBuffer,
-                    VkQueryPool queryPool,
-                    uint32_t query,
-                    VkQueryControlFlags flags)
-{
-   panvk_stub();
-}
+   /* Availability is written by the GPU once the results have landed, so
+    * only wait if one of the requested queries is still pending.
+    */
+   if (flags & VK_QUERY_RESULT_WAIT_BIT) {
+      for (uint32_t i = 0; i < queryCount; i++) {
+         if (!panvk_query_is_available(pool, firstQuery + i)) {
+            panfrost_bo_wait(pool->bo, INT64_MAX, false);
+            break;
+         }
+      }
+   }
 
-void
-panvk_CmdEndQuery(VkCommandBuffer commandBuffer,
-                  VkQueryPool queryPool,
-                  uint32_t query)
-{
-   panvk_stub();
-}
+   for (uint32_t i = 0; i < queryCount; i++) {
+      uint32_t query = firstQuery + i;
+      bool available = panvk_query_is_available(pool, query);
+      void *dst = pData + (i * stride);
 
-void
-panvk_CmdWriteTimestamp2(VkCommandBuffer commandBuffer,
-                         VkPipelineStageFlags2 stage,
-                         VkQueryPool queryPool,
-                         uint32_t query)
-{
-   panvk_stub();
+      if (!available)
+         result = VK_NOT_READY;
+
+      /* From the Vulkan spec:
+       *
+       *    "If VK_QUERY_RESULT_WAIT_BIT and VK_QUERY_RESULT_PARTIAL_BIT are
+       *    both not set then no result values are written to pData for
+       *    queries that are in the unavailable state at the time of the call,
+       *    and vkGetQueryPoolResults returns VK_NOT_READY."
+       */
+      if (available || (flags & VK_QUERY_RESULT_PARTIAL_BIT))
+         panvk_query_write_result(dst, 0, flags,
+                                  panvk_query_get_value(pool, query));
+
+      if (flags & VK_QUERY_RESULT_WITH_AVAILABILITY_BIT)
+         panvk_query_write_result(dst, 1, flags, available);
+   }
+
+   return result;
 }
@@ -26,15 +26,124 @@
 
 #include "panvk_private.h"
 
+#include "pan_bo.h"
 #include "pan_shader.h"
 
+#include "util/blob.h"
 #include "vk_util.h"
 
+struct panvk_shader *
+panvk_shader_alloc(struct panvk_device *dev, const unsigned char *sha1)
+{
+   /* Shaders can outlive the pipeline they were compiled for through the
+    * pipeline caches, so they always come from the device allocator.
+    */
+   struct panvk_shader *shader =
+      vk_zalloc(&dev->vk.alloc, sizeof(*shader), 8,
+                VK_SYSTEM_ALLOCATION_SCOPE_DEVICE);
+   if (!shader)
+      return NULL;
+
+   memcpy(shader->sha1, sha1, sizeof(shader->sha1));
+   vk_pipeline_cache_object_init(&dev->vk, &shader->base, &panvk_shader_ops,
+                                 shader->sha1, sizeof(shader->sha1));
+   util_dynarray_init(&shader->binary, NULL);
+   return shader;
+}
+
 void
-panvk_shader_destroy(struct panvk_device *dev,
-                     struct panvk_shader *shader,
-                     const VkAllocationCallbacks *alloc)
+panvk_shader_upload(struct panvk_device *dev, struct panvk_shader *shader)
+{
+   size_t size = util_dynarray_num_elements(&shader->binary, uint8_t);
+
+   /* In some cases, the optimized shader is empty */
+   if (!size)
+      return;
+
+   shader->bo = panfrost_bo_create(&dev->physical_device->pdev, size,
+                                   PAN_BO_EXECUTE, "Shader");
+   memcpy(shader->bo->ptr.cpu, shader->binary.data, size);
+}
+
+static bool
+panvk_shader_serialize(struct vk_pipeline_cache_object *object,
+                       struct blob *blob)
+{
+   struct panvk_shader *shader =
+      container_of(object, struct panvk_shader, base);
+   uint32_t binary_size = util_dynarray_num_elements(&shader->binary, uint8_t);
+
+   /* pan_shader_info is plain data, with no pointers */
+   blob_write_bytes(blob, &shader->info, sizeof(shader->info));
+   blob_write_uint32(blob, shader->sysval_ubo);
+   blob_write_uint32(blob, shader->local_size.x);
+   blob_write_uint32(blob, shader->local_size.y);
+   blob_write_uint32(blob, shader->local_size.z);
+   blob_write_uint32(blob, shader->has_img_access);
+   blob_write_uint32(blob, binary_size);
+   blob_write_bytes(blob, shader->binary.data, binary_size);
+
+   return !blob->out_of_memory;
+}
+
+static struct vk_pipeline_cache_object *
+panvk_shader_deserialize(struct vk_device *vk_dev,
+                         const void *key_data, size_t key_size,
+                         struct blob_reader *blob)
 {
+   struct panvk_device *dev = container_of(vk_dev, struct panvk_device, vk);
+
+   if (key_size != sizeof(((struct panvk_shader *)NULL)->sha1))
+      return NULL;
+
+   struct panvk_shader *shader = panvk_shader_alloc(dev, key_data);
+   if (!shader)
+      return NULL;
+
+   blob_copy_bytes(blob, &shader->info, sizeof(shader->info));
+   shader->sysval_ubo = blob_read_uint32(blob);
+   shader->local_size.x = blob_read_uint32(blob);
+   shader->local_size.y = blob_read_uint32(blob);
+   shader->local_size.z = blob_read_uint32(blob);
+   shader->has_img_access = blob_read_uint32(blob);
+
+   uint32_t binary_size = blob_read_uint32(blob);
+   const void *binary = blob_read_bytes(blob, binary_size);
+
+   if (blob->overrun ||
+       (binary_size && !util_dynarray_grow_bytes(&shader->binary, 1,
+                                                 binary_size))) {
+      panvk_shader_unref(shader);
+      return NULL;
+   }
+
+   if (binary_size)
+      memcpy(shader->binary.data, binary, binary_size);
+
+   panvk_shader_upload(dev, shader);
+   return &shader->base;
+}
+
+static void
+panvk_shader_destroy(struct vk_pipeline_cache_object *object)
+{
+   struct panvk_shader *shader =
+      container_of(object, struct panvk_shader, base);
+   struct vk_device *vk_dev = object->device;
+
+   panfrost_bo_unreference(shader->bo);
    util_dynarray_fini(&shader->binary);
-   vk_free2(&dev->vk.alloc, alloc, shader);
+   vk_pipeline_cache_object_finish(&shader->base);
+   vk_free(&vk_dev->alloc, shader);
 }
+
+const struct vk_pipeline_cache_object_ops panvk_shader_ops = {
+   .serialize = panvk_shader_serialize,
+   .deserialize = panvk_shader_deserialize,
+   .destroy = panvk_shader_destroy,
+};
+
+const struct vk_pipeline_cache_object_ops *const panvk_cache_import_ops[] = {
+   &panvk_shader_ops,
+   NULL,
+};
@@ -82,12 +82,14 @@ panvk_per_arch(cmd_close_batch)(struct panvk_cmd_buffer *cmdbuf)
       clear |= fbinfo->rts[i].clear;
 
    if (!clear && !batch->scoreboard.first_job) {
-      if (util_dynarray_num_elements(&batch->event_ops, struct panvk_event_op) == 0) {
+      if (util_dynarray_num_elements(&batch->event_ops, struct panvk_event_op) == 0 &&
+          !batch->post_fragment.first_job) {
          /* Content-less batch, let's drop it */
          vk_free(&cmdbuf->vk.pool->alloc, batch);
       } else {
-         /* Batch has no jobs but is needed for synchronization, let's add a
-          * NULL job so the SUBMIT ioctl doesn't choke on it.
+         /* Batch has no jobs but is needed for synchronization or query
+          * writes, let's add a NULL job so the SUBMIT ioctl doesn't choke on
+          * it.
           */
          struct panfrost_ptr ptr = pan_pool_alloc_desc(&cmdbuf->desc_pool.base,
                                                        JOB_HEADER);
@@ -150,6 +152,13 @@ panvk_per_arch(CmdNextSubpass2)(VkCommandBuffer commandBuffer,
 {
    VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
 
+   /* Merged subpasses keep rendering to the tile buffer of the batch */
+   if (cmdbuf->state.subpass[1].merged) {
+      cmdbuf->state.subpass++;
+      return;
+   }
+
+   panvk_cmd_fb_info_set_discard(cmdbuf);
    panvk_per_arch(cmd_close_batch)(cmdbuf);
 
    cmdbuf->state.subpass++;
@@ -311,6 +320,18 @@ panvk_cmd_prepare_textures(struct panvk_cmd_buffer *cmdbuf,
    if (!num_textures || desc_state->textures)
       return;
 
+   /* Bind the texture table of a set in place when it's the whole table */
+   for (unsigned i = 0; i < ARRAY_SIZE(desc_state->sets); i++) {
+      const struct panvk_descriptor_set *set = desc_state->sets[i];
+
+      if (set && i < pipeline->layout->vk.set_count &&
+          pipeline->layout->sets[i].tex_offset == 0 &&
+          set->layout->num_textures == num_textures) {
+         desc_state->textures = set->textures_table;
+         return;
+      }
+   }
+
    struct panfrost_ptr textures =
       pan_pool_alloc_aligned(&cmdbuf->desc_pool.base,
                              num_textures * pan_size(TEXTURE),
@@ -344,6 +365,18 @@ panvk_cmd_prepare_samplers(struct panvk_cmd_buffer *cmdbuf,
    if (!num_samplers || desc_state->samplers)
       return;
 
+   /* Same for the sampler table, which starts with the dummy sampler */
+   for (unsigned i = 0; i < ARRAY_SIZE(desc_state->sets); i++) {
+      const struct panvk_descriptor_set *set = desc_state->sets[i];
+
+      if (set && i < pipeline->layout->vk.set_count &&
+          pipeline->layout->sets[i].sampler_offset == 1 &&
+          set->layout->num_samplers + 1 == num_samplers) {
+         desc_state->samplers = set->samplers_table;
+         return;
+      }
+   }
+
    struct panfrost_ptr samplers =
       pan_pool_alloc_desc_array(&cmdbuf->desc_pool.base,
                                 num_samplers,
@@ -351,14 +384,7 @@ panvk_cmd_prepare_samplers(struct panvk_cmd_buffer *cmdbuf,
 
    void *sampler = samplers.cpu;
 
-   /* Prepare the dummy sampler */
-   pan_pack(sampler, SAMPLER, cfg) {
-      cfg.seamless_cube_map = false;
-      cfg.magnify_nearest = true;
-      cfg.minify_nearest = true;
-      cfg.normalized_coordinates = false;
-   }
-
+   panvk_per_arch(emit_dummy_sampler)(sampler);
    sampler += pan_size(SAMPLER);
 
    for (unsigned i = 0; i < ARRAY_SIZE(desc_state->sets); i++) {
@@ -505,9 +531,9 @@ panvk_draw_prepare_varyings(struct panvk_cmd_buffer *cmdbuf,
    if (pipeline->ia.writes_point_size) {
       draw->psiz = varyings->buf[varyings->varying[VARYING_SLOT_PSIZ].buf].address +
                        varyings->varying[VARYING_SLOT_POS].offset;
-   } else if (pipeline->ia.topology == MALI_DRAW_MODE_LINES ||
-              pipeline->ia.topology == MALI_DRAW_MODE_LINE_STRIP ||
-              pipeline->ia.topology == MALI_DRAW_MODE_LINE_LOOP) {
+   } else if (draw->topology == MALI_DRAW_MODE_LINES ||
+              draw->topology == MALI_DRAW_MODE_LINE_STRIP ||
+              draw->topology == MALI_DRAW_MODE_LINE_LOOP) {
       draw->line_width = pipeline->dynamic_state_mask & PANVK_DYNAMIC_LINE_WIDTH ?
                          cmdbuf->state.rast.line_width : pipeline->rast.line_width;
    } else {
@@ -618,11 +644,23 @@ panvk_draw_prepare_vs_attribs(struct panvk_cmd_buffer *cmdbuf,
       pan_pool_alloc_desc_array(&cmdbuf->desc_pool.base, attrib_count,
                                 ATTRIBUTE);
 
-   panvk_per_arch(emit_attrib_bufs)(&pipeline->attribs,
+   const struct panvk_attribs_info *attribs_info = &pipeline->attribs;
+   struct panvk_attribs_info dyn_attribs_info;
+
+   if (pipeline->dynamic_state_mask & PANVK_DYNAMIC_VERTEX_INPUT_BINDING_STRIDE) {
+      dyn_attribs_info = pipeline->attribs;
+      for (unsigned i = 0; i < dyn_attribs_info.buf_count; i++) {
+         if (!dyn_attribs_info.buf[i].special && i < cmdbuf->state.vb.count)
+            dyn_attribs_info.buf[i].stride = cmdbuf->state.vb.bufs[i].stride;
+      }
+      attribs_info = &dyn_attribs_info;
+   }
+
+   panvk_per_arch(emit_attrib_bufs)(attribs_info,
                                     cmdbuf->state.vb.bufs,
                                     cmdbuf->state.vb.count,
                                     draw, bufs.cpu);
-   panvk_per_arch(emit_attribs)(cmdbuf->device, draw, &pipeline->attribs,
+   panvk_per_arch(emit_attribs)(cmdbuf->device, draw, attribs_info,
                                 cmdbuf->state.vb.bufs, cmdbuf->state.vb.count,
                                 attribs.cpu);
 
@@ -719,6 +757,46 @@ panvk_draw_prepare_tiler_job(struct panvk_cmd_buffer *cmdbuf,
    panvk_per_arch(emit_tiler_job)(pipeline, draw, ptr.cpu);
 }
 
+static bool
+panvk_cmd_primitive_restart(const struct panvk_cmd_buffer *cmdbuf)
+{
+   const struct panvk_pipeline *pipeline =
+      panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
+
+   return pipeline->dynamic_state_mask & PANVK_DYNAMIC_PRIMITIVE_RESTART_ENABLE ?
+          cmdbuf->state.ia.primitive_restart : pipeline->ia.primitive_restart;
+}
+
+static void
+panvk_draw_prepare_rast_state(struct panvk_cmd_buffer *cmdbuf,
+                              struct panvk_draw_info *draw)
+{
+   const struct panvk_pipeline *pipeline =
+      panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
+   uint32_t dyn = pipeline->dynamic_state_mask;
+
+   draw->topology = dyn & PANVK_DYNAMIC_PRIMITIVE_TOPOLOGY ?
+                    panvk_per_arch(translate_prim_topology)(cmdbuf->state.ia.topology) :
+                    pipeline->ia.topology;
+
+   if (dyn & PANVK_DYNAMIC_CULL_MODE) {
+      draw->cull_front_face = cmdbuf->state.rast.cull_mode & VK_CULL_MODE_FRONT_BIT;
+      draw->cull_back_face = cmdbuf->state.rast.cull_mode & VK_CULL_MODE_BACK_BIT;
+   } else {
+      draw->cull_front_face = pipeline->rast.cull_front_face;
+      draw->cull_back_face = pipeline->rast.cull_back_face;
+   }
+
+   draw->front_ccw = dyn & PANVK_DYNAMIC_FRONT_FACE ?
+                     cmdbuf->state.rast.front_face == VK_FRONT_FACE_COUNTER_CLOCKWISE :
+                     pipeline->rast.front_ccw;
+
+   /* Pipelines with a static rasterizer discard have rast.enable cleared */
+   draw->rasterize = pipeline->rast.enable &&
+                     !(dyn & PANVK_DYNAMIC_RASTERIZER_DISCARD_ENABLE &&
+                       cmdbuf->state.rast.discard);
+}
+
 static void
 panvk_cmd_draw(struct panvk_cmd_buffer *cmdbuf,
                struct panvk_draw_info *draw)
@@ -738,7 +816,12 @@ panvk_cmd_draw(struct panvk_cmd_buffer *cmdbuf,
       batch = panvk_cmd_open_batch(cmdbuf);
    }
 
-   if (pipeline->rast.enable)
+   panvk_draw_prepare_rast_state(cmdbuf, draw);
+
+   if (cmdbuf->state.occlusion_query.bo)
+      panvk_batch_add_query_bo(batch, cmdbuf->state.occlusion_query.bo);
+
+   if (draw->rasterize)
       panvk_per_arch(cmd_alloc_fb_desc)(cmdbuf);
 
    panvk_per_arch(cmd_alloc_tls_desc)(cmdbuf, true);
@@ -757,6 +840,7 @@ panvk_cmd_draw(struct panvk_cmd_buffer *cmdbuf,
    draw->ubos = desc_state->ubos;
    draw->textures = desc_state->textures;
    draw->samplers = desc_state->samplers;
+   draw->occlusion = cmdbuf->state.occlusion_query.ptr;
 
    STATIC_ASSERT(sizeof(draw->invocation) >= sizeof(struct mali_invocation_packed));
    panfrost_pack_work_groups_compute((struct mali_invocation_packed *)&draw->invocation,
@@ -778,7 +862,7 @@ panvk_cmd_draw(struct panvk_cmd_buffer *cmdbuf,
                        MALI_JOB_TYPE_VERTEX, false, false, 0, 0,
                        &draw->jobs.vertex, false);
 
-   if (pipeline->rast.enable) {
+   if (draw->rasterize) {
       panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
                        MALI_JOB_TYPE_TILER, false, false, vjob_id, 0,
                        &draw->jobs.tiler, false);
@@ -872,9 +956,7 @@ panvk_per_arch(CmdDrawIndexed)(VkCommandBuffer commandBuffer,
    if (instanceCount == 0 || indexCount == 0)
       return;
 
-   const struct panvk_pipeline *pipeline =
-      panvk_cmd_get_pipeline(cmdbuf, GRAPHICS);
-   bool primitive_restart = pipeline->ia.primitive_restart;
+   bool primitive_restart = panvk_cmd_primitive_restart(cmdbuf);
 
    panvk_index_minmax_search(cmdbuf, firstIndex, indexCount, primitive_restart,
                              &min_vertex, &max_vertex);
@@ -882,6 +964,7 @@ panvk_per_arch(CmdDrawIndexed)(VkCommandBuffer commandBuffer,
    unsigned vertex_range = max_vertex - min_vertex + 1;
    struct panvk_draw_info draw = {
       .index_size = cmdbuf->state.ib.index_size,
+      .primitive_restart = primitive_restart,
       .first_index = firstIndex,
       .index_count = indexCount,
       .vertex_offset = vertexOffset,
@@ -901,6 +984,68 @@ panvk_per_arch(CmdDrawIndexed)(VkCommandBuffer commandBuffer,
    panvk_cmd_draw(cmdbuf, &draw);
 }
 
+static void
+panvk_cmd_gather_batch_bos(struct panvk_cmd_buffer *cmdbuf,
+                           struct panvk_batch *batch)
+{
+   const struct panfrost_device *pdev = &cmdbuf->device->physical_device->pdev;
+
+   /* FIXME: should be done at the batch level */
+   unsigned nr_bos =
+      panvk_pool_num_bos(&cmdbuf->desc_pool) +
+      panvk_pool_num_bos(&cmdbuf->varying_pool) +
+      panvk_pool_num_bos(&cmdbuf->tls_pool) +
+      (batch->fb.info ? batch->fb.info->attachment_count : 0) +
+      (batch->blit.src ? 1 : 0) +
+      (batch->blit.dst ? 1 : 0) +
+      (batch->scoreboard.first_tiler ? 1 : 0) +
+      util_dynarray_num_elements(&batch->query_bos, struct panfrost_bo *) + 1;
+   unsigned bo_idx = 0;
+   uint32_t *bos = util_dynarray_resize(&batch->bos, uint32_t, nr_bos);
+
+   panvk_pool_get_bo_handles(&cmdbuf->desc_pool, &bos[bo_idx]);
+   bo_idx += panvk_pool_num_bos(&cmdbuf->desc_pool);
+
+   panvk_pool_get_bo_handles(&cmdbuf->varying_pool, &bos[bo_idx]);
+   bo_idx += panvk_pool_num_bos(&cmdbuf->varying_pool);
+
+   panvk_pool_get_bo_handles(&cmdbuf->tls_pool, &bos[bo_idx]);
+   bo_idx += panvk_pool_num_bos(&cmdbuf->tls_pool);
+
+   if (batch->fb.info) {
+      for (unsigned i = 0; i < batch->fb.info->attachment_count; i++) {
+         bos[bo_idx++] = batch->fb.info->attachments[i].iview->pview.image->data.bo->gem_handle;
+      }
+   }
+
+   if (batch->blit.src)
+      bos[bo_idx++] = batch->blit.src->gem_handle;
+
+   if (batch->blit.dst)
+      bos[bo_idx++] = batch->blit.dst->gem_handle;
+
+   if (batch->scoreboard.first_tiler)
+      bos[bo_idx++] = pdev->tiler_heap->gem_handle;
+
+   util_dynarray_foreach(&batch->query_bos, struct panfrost_bo *, bo)
+      bos[bo_idx++] = (*bo)->gem_handle;
+
+   bos[bo_idx++] = pdev->sample_positions->gem_handle;
+   assert(bo_idx == nr_bos);
+
+   /* Merge identical BO entries. */
+   for (unsigned x = 0; x < nr_bos; x++) {
+      for (unsigned y = x + 1; y < nr_bos; ) {
+         if (bos[x] == bos[y])
+            bos[y] = bos[--nr_bos];
+         else
+            y++;
+      }
+   }
+
+   util_dynarray_resize(&batch->bos, uint32_t, nr_bos);
+}
+
 VkResult
 panvk_per_arch(EndCommandBuffer)(VkCommandBuffer commandBuffer)
 {
@@ -908,6 +1053,11 @@ panvk_per_arch(EndCommandBuffer)(VkCommandBuffer commandBuffer)
 
    panvk_per_arch(cmd_close_batch)(cmdbuf);
 
+   /* The batches are submitted as recorded from now on, possibly many
+    * times, so do the per-batch work needed for submission only once */
+   list_for_each_entry(struct panvk_batch, batch, &cmdbuf->batches, node)
+      panvk_cmd_gather_batch_bos(cmdbuf, batch);
+
    return vk_command_buffer_end(&cmdbuf->vk);
 }
 
@@ -917,6 +1067,7 @@ panvk_per_arch(CmdEndRenderPass2)(VkCommandBuffer commandBuffer,
 {
    VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
 
+   panvk_cmd_fb_info_set_discard(cmdbuf);
    panvk_per_arch(cmd_close_batch)(cmdbuf);
    vk_free(&cmdbuf->vk.pool->alloc, cmdbuf->state.clear);
    cmdbuf->state.batch = NULL;
@@ -1076,6 +1227,8 @@ panvk_reset_cmdbuf(struct vk_command_buffer *vk_cmdbuf,
       list_del(&batch->node);
       util_dynarray_fini(&batch->jobs);
       util_dynarray_fini(&batch->event_ops);
+      util_dynarray_fini(&batch->query_bos);
+      util_dynarray_fini(&batch->bos);
 
       vk_free(&cmdbuf->vk.pool->alloc, batch);
    }
@@ -1086,6 +1239,9 @@ panvk_reset_cmdbuf(struct vk_command_buffer *vk_cmdbuf,
 
    for (unsigned i = 0; i < MAX_BIND_POINTS; i++)
       memset(&cmdbuf->bind_points[i].desc_state.sets, 0, sizeof(cmdbuf->bind_points[0].desc_state.sets));
+
+   memset(&cmdbuf->state.occlusion_query, 0,
+          sizeof(cmdbuf->state.occlusion_query));
 }
 
 static void
@@ -1099,6 +1255,8 @@ panvk_destroy_cmdbuf(struct vk_command_buffer *vk_cmdbuf)
       list_del(&batch->node);
       util_dynarray_fini(&batch->jobs);
       util_dynarray_fini(&batch->event_ops);
+      util_dynarray_fini(&batch->query_bos);
+      util_dynarray_fini(&batch->bos);
 
       vk_free(&cmdbuf->vk.pool->alloc, batch);
    }
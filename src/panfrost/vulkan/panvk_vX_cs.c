@@ -310,6 +310,20 @@ panvk_per_arch(emit_ubo)(mali_ptr address, size_t size,  void *desc)
    }
 }
 
+/* Bifrost texture instructions always expect a sampler, pipeline layouts
+ * reserve this one for the operations which don't have any.
+ */
+void
+panvk_per_arch(emit_dummy_sampler)(void *desc)
+{
+   pan_pack(desc, SAMPLER, cfg) {
+      cfg.seamless_cube_map = false;
+      cfg.magnify_nearest = true;
+      cfg.minify_nearest = true;
+      cfg.normalized_coordinates = false;
+   }
+}
+
 void
 panvk_per_arch(emit_ubos)(const struct panvk_pipeline *pipeline,
                           const struct panvk_descriptor_state *state,
@@ -435,12 +449,12 @@ panvk_emit_tiler_primitive(const struct panvk_pipeline *pipeline,
                            void *prim)
 {
    pan_pack(prim, PRIMITIVE, cfg) {
-      cfg.draw_mode = pipeline->ia.topology;
+      cfg.draw_mode = draw->topology;
       if (pipeline->ia.writes_point_size)
          cfg.point_size_array_format = MALI_POINT_SIZE_ARRAY_FORMAT_FP16;
 
       cfg.first_provoking_vertex = true;
-      if (pipeline->ia.primitive_restart)
+      if (draw->primitive_restart)
          cfg.primitive_restart = MALI_PRIMITIVE_RESTART_IMPLICIT;
       cfg.job_task_split = 6;
 
@@ -482,9 +496,9 @@ panvk_emit_tiler_dcd(const struct panvk_pipeline *pipeline,
                      void *dcd)
 {
    pan_pack(dcd, DRAW, cfg) {
-      cfg.front_face_ccw = pipeline->rast.front_ccw;
-      cfg.cull_front_face = pipeline->rast.cull_front_face;
-      cfg.cull_back_face = pipeline->rast.cull_back_face;
+      cfg.front_face_ccw = draw->front_ccw;
+      cfg.cull_front_face = draw->cull_front_face;
+      cfg.cull_back_face = draw->cull_back_face;
       cfg.position = draw->position;
       cfg.state = draw->fs_rsd;
       cfg.attributes = draw->stages[MESA_SHADER_FRAGMENT].attributes;
@@ -498,9 +512,9 @@ panvk_emit_tiler_dcd(const struct panvk_pipeline *pipeline,
        * be set to 0 and the provoking vertex is selected with the
        * PRIMITIVE.first_provoking_vertex field.
        */
-      if (pipeline->ia.topology == MALI_DRAW_MODE_LINES ||
-          pipeline->ia.topology == MALI_DRAW_MODE_LINE_STRIP ||
-          pipeline->ia.topology == MALI_DRAW_MODE_LINE_LOOP) {
+      if (draw->topology == MALI_DRAW_MODE_LINES ||
+          draw->topology == MALI_DRAW_MODE_LINE_STRIP ||
+          draw->topology == MALI_DRAW_MODE_LINE_LOOP) {
          cfg.flat_shading_vertex = true;
       }
 
@@ -512,7 +526,10 @@ panvk_emit_tiler_dcd(const struct panvk_pipeline *pipeline,
       cfg.textures = draw->textures;
       cfg.samplers = draw->samplers;
 
-      /* TODO: occlusion queries */
+      if (draw->occlusion) {
+         cfg.occlusion_query = MALI_OCCLUSION_MODE_COUNTER;
+         cfg.occlusion = draw->occlusion;
+      }
    }
 }
 
@@ -676,12 +693,104 @@ panvk_per_arch(emit_blend_constant)(const struct panvk_device *dev,
    }
 }
 
+/* Depth/stencil state of the fragment RSD, taken from the command buffer
+ * state if dynamic and state is not NULL, from the pipeline otherwise */
+
+#define PANVK_DYNAMIC_EARLYZS_MASK \
+        (PANVK_DYNAMIC_DEPTH_TEST_ENABLE | \
+         PANVK_DYNAMIC_DEPTH_WRITE_ENABLE | \
+         PANVK_DYNAMIC_STENCIL_TEST_ENABLE)
+
+static bool
+panvk_rsd_dynamic(const struct panvk_pipeline *pipeline,
+                  const struct panvk_cmd_state *state,
+                  uint32_t mask)
+{
+   return state && (pipeline->dynamic_state_mask & mask);
+}
+
+static bool
+panvk_rsd_z_test(const struct panvk_pipeline *pipeline,
+                 const struct panvk_cmd_state *state)
+{
+   if (panvk_rsd_dynamic(pipeline, state, PANVK_DYNAMIC_DEPTH_TEST_ENABLE))
+      return pipeline->zs.attachment && state->zs.z_test;
+
+   return pipeline->zs.z_test;
+}
+
+static bool
+panvk_rsd_z_write(const struct panvk_pipeline *pipeline,
+                  const struct panvk_cmd_state *state)
+{
+   bool z_write =
+      panvk_rsd_dynamic(pipeline, state, PANVK_DYNAMIC_DEPTH_WRITE_ENABLE) ?
+      pipeline->zs.attachment && state->zs.z_write : pipeline->zs.z_write;
+
+   return z_write && panvk_rsd_z_test(pipeline, state);
+}
+
+static bool
+panvk_rsd_s_test(const struct panvk_pipeline *pipeline,
+                 const struct panvk_cmd_state *state)
+{
+   if (panvk_rsd_dynamic(pipeline, state, PANVK_DYNAMIC_STENCIL_TEST_ENABLE))
+      return pipeline->zs.attachment && state->zs.s_test;
+
+   return pipeline->zs.s_test;
+}
+
+static struct pan_earlyzs_state
+panvk_rsd_earlyzs(const struct panvk_pipeline *pipeline,
+                  const struct panvk_cmd_state *state)
+{
+   bool z_test = panvk_rsd_z_test(pipeline, state);
+   bool s_test = panvk_rsd_s_test(pipeline, state);
+   bool writes_zs = panvk_rsd_z_write(pipeline, state) || s_test;
+   bool zs_always_passes = !z_test && !s_test;
+   bool oq = false; /* TODO: Occlusion queries */
+
+   return pan_earlyzs_get(pan_earlyzs_analyze(&pipeline->fs.info),
+                          writes_zs || oq, pipeline->ms.alpha_to_coverage,
+                          zs_always_passes);
+}
+
 void
 panvk_per_arch(emit_dyn_fs_rsd)(const struct panvk_pipeline *pipeline,
                                 const struct panvk_cmd_state *state,
                                 void *rsd)
 {
+   uint32_t dyn = pipeline->dynamic_state_mask;
+
    pan_pack(rsd, RENDERER_STATE, cfg) {
+      if (pipeline->fs.required && (dyn & PANVK_DYNAMIC_EARLYZS_MASK)) {
+         struct pan_earlyzs_state earlyzs = panvk_rsd_earlyzs(pipeline, state);
+
+         cfg.properties.pixel_kill_operation = earlyzs.kill;
+         cfg.properties.zs_update_operation = earlyzs.update;
+      }
+
+      if (dyn & (PANVK_DYNAMIC_DEPTH_TEST_ENABLE | PANVK_DYNAMIC_DEPTH_COMPARE_OP)) {
+         enum mali_func z_func =
+            dyn & PANVK_DYNAMIC_DEPTH_COMPARE_OP ?
+            panvk_per_arch(translate_compare_func)(state->zs.z_compare_op) :
+            pipeline->zs.z_compare_func;
+
+         cfg.multisample_misc.depth_function =
+            panvk_rsd_z_test(pipeline, state) ? z_func : MALI_FUNC_ALWAYS;
+      }
+
+      if (dyn & (PANVK_DYNAMIC_DEPTH_TEST_ENABLE | PANVK_DYNAMIC_DEPTH_WRITE_ENABLE))
+         cfg.multisample_misc.depth_write_mask = panvk_rsd_z_write(pipeline, state);
+
+      if (dyn & PANVK_DYNAMIC_STENCIL_TEST_ENABLE)
+         cfg.stencil_mask_misc.stencil_enable = panvk_rsd_s_test(pipeline, state);
+
+      if (dyn & PANVK_DYNAMIC_DEPTH_BIAS_ENABLE) {
+         cfg.stencil_mask_misc.front_facing_depth_bias = state->rast.depth_bias.enable;
+         cfg.stencil_mask_misc.back_facing_depth_bias = state->rast.depth_bias.enable;
+      }
+
       if (pipeline->dynamic_state_mask & (1 << VK_DYNAMIC_STATE_DEPTH_BIAS)) {
          cfg.depth_units = state->rast.depth_bias.constant_factor * 2.0f;
          cfg.depth_factor = state->rast.depth_bias.slope_factor;
@@ -702,6 +811,25 @@ panvk_per_arch(emit_dyn_fs_rsd)(const struct panvk_pipeline *pipeline,
          cfg.stencil_front.reference_value = state->zs.s_front.ref;
          cfg.stencil_back.reference_value = state->zs.s_back.ref;
       }
+
+      if (dyn & PANVK_DYNAMIC_STENCIL_OP) {
+         cfg.stencil_front.compare_function =
+            panvk_per_arch(translate_compare_func)(state->zs.s_front.compare_op);
+         cfg.stencil_front.stencil_fail =
+            panvk_per_arch(translate_stencil_op)(state->zs.s_front.fail_op);
+         cfg.stencil_front.depth_fail =
+            panvk_per_arch(translate_stencil_op)(state->zs.s_front.z_fail_op);
+         cfg.stencil_front.depth_pass =
+            panvk_per_arch(translate_stencil_op)(state->zs.s_front.pass_op);
+         cfg.stencil_back.compare_function =
+            panvk_per_arch(translate_compare_func)(state->zs.s_back.compare_op);
+         cfg.stencil_back.stencil_fail =
+            panvk_per_arch(translate_stencil_op)(state->zs.s_back.fail_op);
+         cfg.stencil_back.depth_fail =
+            panvk_per_arch(translate_stencil_op)(state->zs.s_back.z_fail_op);
+         cfg.stencil_back.depth_pass =
+            panvk_per_arch(translate_stencil_op)(state->zs.s_back.pass_op);
+      }
    }
 }
 
@@ -711,6 +839,7 @@ panvk_per_arch(emit_base_fs_rsd)(const struct panvk_device *dev,
                                  void *rsd)
 {
    const struct pan_shader_info *info = &pipeline->fs.info;
+   uint32_t dyn = pipeline->dynamic_state_mask;
 
    pan_pack(rsd, RENDERER_STATE, cfg) {
       if (pipeline->fs.required) {
@@ -724,16 +853,13 @@ panvk_per_arch(emit_base_fs_rsd)(const struct panvk_device *dev,
                  !pipeline->ms.alpha_to_coverage &&
                  !pipeline->blend.reads_dest;
 
-         bool writes_zs = pipeline->zs.z_write || pipeline->zs.s_test;
-         bool zs_always_passes = !pipeline->zs.z_test && !pipeline->zs.s_test;
-         bool oq = false; /* TODO: Occlusion queries */
+         if (!(dyn & PANVK_DYNAMIC_EARLYZS_MASK)) {
+            struct pan_earlyzs_state earlyzs =
+               panvk_rsd_earlyzs(pipeline, NULL);
 
-         struct pan_earlyzs_state earlyzs =
-            pan_earlyzs_get(pan_earlyzs_analyze(info), writes_zs || oq,
-                            pipeline->ms.alpha_to_coverage, zs_always_passes);
-
-         cfg.properties.pixel_kill_operation = earlyzs.kill;
-         cfg.properties.zs_update_operation = earlyzs.update;
+            cfg.properties.pixel_kill_operation = earlyzs.kill;
+            cfg.properties.zs_update_operation = earlyzs.update;
+         }
       } else {
          cfg.properties.depth_source = MALI_DEPTH_SOURCE_FIXED_FUNCTION;
          cfg.properties.allow_forward_pixel_to_kill = true;
@@ -746,19 +872,29 @@ panvk_per_arch(emit_base_fs_rsd)(const struct panvk_device *dev,
       cfg.multisample_misc.sample_mask =
          msaa ? pipeline->ms.sample_mask : UINT16_MAX;
 
-      cfg.multisample_misc.depth_function =
-         pipeline->zs.z_test ? pipeline->zs.z_compare_func : MALI_FUNC_ALWAYS;
+      if (!(dyn & (PANVK_DYNAMIC_DEPTH_TEST_ENABLE | PANVK_DYNAMIC_DEPTH_COMPARE_OP))) {
+         cfg.multisample_misc.depth_function =
+            pipeline->zs.z_test ? pipeline->zs.z_compare_func : MALI_FUNC_ALWAYS;
+      }
+
+      if (!(dyn & (PANVK_DYNAMIC_DEPTH_TEST_ENABLE | PANVK_DYNAMIC_DEPTH_WRITE_ENABLE)))
+         cfg.multisample_misc.depth_write_mask = panvk_rsd_z_write(pipeline, NULL);
 
-      cfg.multisample_misc.depth_write_mask = pipeline->zs.z_write;
       cfg.multisample_misc.fixed_function_near_discard = !pipeline->rast.clamp_depth;
       cfg.multisample_misc.fixed_function_far_discard = !pipeline->rast.clamp_depth;
       cfg.multisample_misc.shader_depth_range_fixed = true;
 
-      cfg.stencil_mask_misc.stencil_enable = pipeline->zs.s_test;
+      if (!(dyn & PANVK_DYNAMIC_STENCIL_TEST_ENABLE))
+         cfg.stencil_mask_misc.stencil_enable = pipeline->zs.s_test;
+
       cfg.stencil_mask_misc.alpha_to_coverage = pipeline->ms.alpha_to_coverage;
       cfg.stencil_mask_misc.alpha_test_compare_function = MALI_FUNC_ALWAYS;
-      cfg.stencil_mask_misc.front_facing_depth_bias = pipeline->rast.depth_bias.enable;
-      cfg.stencil_mask_misc.back_facing_depth_bias = pipeline->rast.depth_bias.enable;
+
+      if (!(dyn & PANVK_DYNAMIC_DEPTH_BIAS_ENABLE)) {
+         cfg.stencil_mask_misc.front_facing_depth_bias = pipeline->rast.depth_bias.enable;
+         cfg.stencil_mask_misc.back_facing_depth_bias = pipeline->rast.depth_bias.enable;
+      }
+
       cfg.stencil_mask_misc.single_sampled_lines = pipeline->ms.rast_samples <= 1;
 
       if (!(pipeline->dynamic_state_mask & (1 << VK_DYNAMIC_STATE_DEPTH_BIAS))) {
@@ -782,14 +918,16 @@ panvk_per_arch(emit_base_fs_rsd)(const struct panvk_device *dev,
          cfg.stencil_back.reference_value = pipeline->zs.s_back.ref;
       }
 
-      cfg.stencil_front.compare_function = pipeline->zs.s_front.compare_func;
-      cfg.stencil_front.stencil_fail = pipeline->zs.s_front.fail_op;
-      cfg.stencil_front.depth_fail = pipeline->zs.s_front.z_fail_op;
-      cfg.stencil_front.depth_pass = pipeline->zs.s_front.pass_op;
-      cfg.stencil_back.compare_function = pipeline->zs.s_back.compare_func;
-      cfg.stencil_back.stencil_fail = pipeline->zs.s_back.fail_op;
-      cfg.stencil_back.depth_fail = pipeline->zs.s_back.z_fail_op;
-      cfg.stencil_back.depth_pass = pipeline->zs.s_back.pass_op;
+      if (!(dyn & PANVK_DYNAMIC_STENCIL_OP)) {
+         cfg.stencil_front.compare_function = pipeline->zs.s_front.compare_func;
+         cfg.stencil_front.stencil_fail = pipeline->zs.s_front.fail_op;
+         cfg.stencil_front.depth_fail = pipeline->zs.s_front.z_fail_op;
+         cfg.stencil_front.depth_pass = pipeline->zs.s_front.pass_op;
+         cfg.stencil_back.compare_function = pipeline->zs.s_back.compare_func;
+         cfg.stencil_back.stencil_fail = pipeline->zs.s_back.fail_op;
+         cfg.stencil_back.depth_fail = pipeline->zs.s_back.z_fail_op;
+         cfg.stencil_back.depth_pass = pipeline->zs.s_back.pass_op;
+      }
    }
 }
 
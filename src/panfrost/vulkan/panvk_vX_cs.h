@@ -66,6 +66,9 @@ panvk_per_arch(emit_attribs)(const struct panvk_device *dev,
 void
 panvk_per_arch(emit_ubo)(mali_ptr address, size_t size,  void *desc);
 
+void
+panvk_per_arch(emit_dummy_sampler)(void *desc);
+
 void
 panvk_per_arch(emit_ubos)(const struct panvk_pipeline *pipeline,
                           const struct panvk_descriptor_state *state,
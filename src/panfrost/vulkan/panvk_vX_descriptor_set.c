@@ -227,6 +227,207 @@ err_free_bindings:
    return vk_error(device, result);
 }
 
+static void
+panvk_write_sampler_desc_raw(struct panvk_descriptor_set *set,
+                             uint32_t binding, uint32_t elem,
+                             struct panvk_sampler *sampler);
+
+/* Host memory of a set: the set object followed by its CPU-side descriptor
+ * arrays, in a single allocation.
+ */
+struct panvk_set_host_layout {
+   size_t ubos, dyn_ubos, dyn_ssbos;
+   size_t img_fmts, img_attrib_bufs;
+   size_t size;
+};
+
+static void
+panvk_get_set_host_layout(unsigned num_ubos, unsigned num_dyn_ubos,
+                          unsigned num_dyn_ssbos, unsigned num_imgs,
+                          struct panvk_set_host_layout *l)
+{
+   size_t size = ALIGN_POT(sizeof(struct panvk_descriptor_set), 8);
+
+#define ADD_ARRAY(field, elem_size, count) \
+   l->field = size; \
+   size = ALIGN_POT(size + (elem_size) * (count), 8);
+
+   ADD_ARRAY(ubos, pan_size(UNIFORM_BUFFER), num_ubos);
+   ADD_ARRAY(dyn_ubos, sizeof(struct panvk_buffer_desc), num_dyn_ubos);
+   ADD_ARRAY(dyn_ssbos, sizeof(struct panvk_buffer_desc), num_dyn_ssbos);
+   ADD_ARRAY(img_fmts, sizeof(uint32_t), num_imgs);
+   ADD_ARRAY(img_attrib_bufs, pan_size(ATTRIBUTE_BUFFER) * 2, num_imgs);
+
+#undef ADD_ARRAY
+
+   l->size = size;
+}
+
+/* The texture and sampler tables of a set live in the pool BO next to its
+ * descriptor UBO, so a set providing all the textures or samplers of a
+ * pipeline can be bound without copying them, see
+ * panvk_cmd_prepare_textures(). The sampler table starts with the dummy
+ * sampler pipeline layouts reserve.
+ */
+struct panvk_set_gpu_layout {
+   size_t textures, samplers, desc_ubo;
+   size_t size;
+};
+
+static void
+panvk_get_set_gpu_layout(unsigned num_samplers, unsigned num_textures,
+                         uint32_t desc_ubo_size,
+                         struct panvk_set_gpu_layout *l)
+{
+   size_t size = 0;
+
+   l->textures = size;
+   size += num_textures * pan_size(TEXTURE);
+
+   size = ALIGN_POT(size, pan_alignment(SAMPLER));
+   l->samplers = size;
+   if (num_samplers)
+      size += (num_samplers + 1) * pan_size(SAMPLER);
+
+   size = ALIGN_POT(size, PANVK_DESC_UBO_ALIGN);
+   l->desc_ubo = size;
+   size += desc_ubo_size;
+
+   l->size = ALIGN_POT(size, PANVK_DESC_SET_ALIGN);
+}
+
+VkResult
+panvk_per_arch(CreateDescriptorPool)(VkDevice _device,
+                                     const VkDescriptorPoolCreateInfo *pCreateInfo,
+                                     const VkAllocationCallbacks *pAllocator,
+                                     VkDescriptorPool *pDescriptorPool)
+{
+   VK_FROM_HANDLE(panvk_device, device, _device);
+   struct panvk_descriptor_pool *pool;
+
+   pool = vk_object_zalloc(&device->vk, pAllocator,
+                           sizeof(struct panvk_descriptor_pool),
+                           VK_OBJECT_TYPE_DESCRIPTOR_POOL);
+   if (!pool)
+      return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
+
+   pool->max.sets = pCreateInfo->maxSets;
+
+   /* Worst case size of the GPU descriptors. Descriptor UBO bindings are
+    * aligned on PANVK_DESCRIPTOR_ALIGN, and each set has a dummy sampler
+    * and is padded to PANVK_DESC_SET_ALIGN.
+    */
+   uint64_t desc_size = 0;
+
+   for (unsigned i = 0; i < pCreateInfo->poolSizeCount; ++i) {
+      unsigned desc_count = pCreateInfo->pPoolSizes[i].descriptorCount;
+      unsigned desc_stride = 0;
+
+      switch(pCreateInfo->pPoolSizes[i].type) {
+      case VK_DESCRIPTOR_TYPE_SAMPLER:
+         pool->max.samplers += desc_count;
+         desc_size += (uint64_t)desc_count * pan_size(SAMPLER);
+         break;
+      case VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER:
+         pool->max.combined_image_samplers += desc_count;
+         desc_stride = sizeof(struct panvk_image_desc);
+         desc_size += (uint64_t)desc_count *
+                      (pan_size(SAMPLER) + pan_size(TEXTURE));
+         break;
+      case VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE:
+         pool->max.sampled_images += desc_count;
+         desc_stride = sizeof(struct panvk_image_desc);
+         desc_size += (uint64_t)desc_count * pan_size(TEXTURE);
+         break;
+      case VK_DESCRIPTOR_TYPE_STORAGE_IMAGE:
+         pool->max.storage_images += desc_count;
+         desc_stride = sizeof(struct panvk_image_desc);
+         break;
+      case VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER:
+         pool->max.uniform_texel_bufs += desc_count;
+         desc_stride = sizeof(struct panvk_bview_desc);
+         desc_size += (uint64_t)desc_count * pan_size(TEXTURE);
+         break;
+      case VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER:
+         pool->max.storage_texel_bufs += desc_count;
+         desc_stride = sizeof(struct panvk_bview_desc);
+         break;
+      case VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT:
+         pool->max.input_attachments += desc_count;
+         desc_stride = sizeof(struct panvk_image_desc);
+         desc_size += (uint64_t)desc_count * pan_size(TEXTURE);
+         break;
+      case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER:
+         pool->max.uniform_bufs += desc_count;
+         break;
+      case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER:
+         pool->max.storage_bufs += desc_count;
+         desc_stride = sizeof(struct panvk_ssbo_addr);
+         break;
+      case VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC:
+         pool->max.uniform_dyn_bufs += desc_count;
+         break;
+      case VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC:
+         pool->max.storage_dyn_bufs += desc_count;
+         break;
+      default:
+         unreachable("Invalid descriptor type");
+      }
+
+      desc_size += (uint64_t)desc_count *
+                   ALIGN_POT(desc_stride, PANVK_DESCRIPTOR_ALIGN);
+   }
+
+   list_inithead(&pool->sets);
+   pool->linear = !(pCreateInfo->flags &
+                    VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT);
+
+   if (pool->linear) {
+      const struct panvk_desc_pool_counters *max = &pool->max;
+      struct panvk_set_host_layout l;
+
+      /* The descriptor UBO takes a UBO slot in each set */
+      panvk_get_set_host_layout(max->uniform_bufs + max->sets,
+                                max->uniform_dyn_bufs,
+                                max->storage_dyn_bufs,
+                                max->storage_images + max->storage_texel_bufs,
+                                &l);
+
+      /* Plus the set objects and the alignment of each array */
+      pool->host_size = l.size + (size_t)max->sets *
+                        (ALIGN_POT(sizeof(struct panvk_descriptor_set), 8) +
+                         5 * 8);
+      pool->host_mem = vk_alloc2(&device->vk.alloc, pAllocator,
+                                 pool->host_size, 8,
+                                 VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+      if (!pool->host_mem) {
+         vk_object_free(&device->vk, pAllocator, pool);
+         return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
+      }
+   }
+
+   if (desc_size) {
+      desc_size += (uint64_t)pCreateInfo->maxSets *
+                   (pan_size(SAMPLER) + PANVK_DESC_SET_ALIGN +
+                    PANVK_DESC_UBO_ALIGN);
+      pool->desc_bo = panfrost_bo_create(&device->physical_device->pdev,
+                                         desc_size, 0, "Descriptor pool");
+      if (!pool->desc_bo) {
+         vk_free2(&device->vk.alloc, pAllocator, pool->host_mem);
+         vk_object_free(&device->vk, pAllocator, pool);
+         return vk_error(device, VK_ERROR_OUT_OF_DEVICE_MEMORY);
+      }
+
+      if (!pool->linear) {
+         util_vma_heap_init(&pool->desc_heap, pool->desc_bo->ptr.gpu,
+                            pool->desc_bo->size);
+      }
+   }
+
+   *pDescriptorPool = panvk_descriptor_pool_to_handle(pool);
+   return VK_SUCCESS;
+}
+
 static void
 panvk_write_sampler_desc_raw(struct panvk_descriptor_set *set,
                              uint32_t binding, uint32_t elem,
@@ -238,83 +439,101 @@ panvk_per_arch(descriptor_set_create)(struct panvk_device *device,
                                       const struct panvk_descriptor_set_layout *layout,
                                       struct panvk_descriptor_set **out_set)
 {
+   struct panvk_set_host_layout l;
+   struct panvk_set_gpu_layout gl;
    struct panvk_descriptor_set *set;
+   uint8_t *host_mem;
 
-   /* TODO: Allocate from the pool! */
-   set = vk_object_zalloc(&device->vk, NULL,
-                          sizeof(struct panvk_descriptor_set),
-                          VK_OBJECT_TYPE_DESCRIPTOR_SET);
-   if (!set)
-      return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
+   panvk_get_set_host_layout(layout->num_ubos, layout->num_dyn_ubos,
+                             layout->num_dyn_ssbos, layout->num_imgs, &l);
+   panvk_get_set_gpu_layout(layout->num_samplers, layout->num_textures,
+                            layout->desc_ubo_size, &gl);
 
-   set->layout = layout;
+   size_t gpu_size = gl.size;
+   mali_ptr gpu_mem = 0;
 
-   if (layout->num_ubos) {
-      set->ubos = vk_zalloc(&device->vk.alloc,
-                            pan_size(UNIFORM_BUFFER) * layout->num_ubos, 8,
-                            VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->ubos)
-         goto err_free_set;
-   }
+   size_t desc_bo_size = pool->desc_bo ? pool->desc_bo->size : 0;
+
+   if (gpu_size > desc_bo_size)
+      return vk_error(device, VK_ERROR_OUT_OF_POOL_MEMORY);
+
+   if (pool->linear) {
+      if (pool->host_offset + l.size > pool->host_size ||
+          pool->desc_offset + gpu_size > desc_bo_size)
+         return vk_error(device, VK_ERROR_OUT_OF_POOL_MEMORY);
+
+      host_mem = (uint8_t *)pool->host_mem + pool->host_offset;
+      pool->host_offset += l.size;
+      memset(host_mem, 0, l.size);
+
+      if (gpu_size) {
+         gpu_mem = pool->desc_bo->ptr.gpu + pool->desc_offset;
+         pool->desc_offset += gpu_size;
+      }
+   } else {
+      if (gpu_size) {
+         gpu_mem = util_vma_heap_alloc(&pool->desc_heap, gpu_size,
+                                       PANVK_DESC_SET_ALIGN);
+         if (!gpu_mem)
+            return vk_error(device, VK_ERROR_FRAGMENTED_POOL);
+      }
 
-   if (layout->num_dyn_ubos) {
-      set->dyn_ubos = vk_zalloc(&device->vk.alloc,
-                            sizeof(*set->dyn_ubos) * layout->num_dyn_ubos, 8,
-                            VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->dyn_ubos)
-         goto err_free_set;
+      host_mem = vk_zalloc(&device->vk.alloc, l.size, 8,
+                           VK_SYSTEM_ALLOCATION_SCOPE_OBJECT);
+      if (!host_mem) {
+         if (gpu_mem)
+            util_vma_heap_free(&pool->desc_heap, gpu_mem, gpu_size);
+         return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
+      }
    }
 
-   if (layout->num_dyn_ssbos) {
-      set->dyn_ssbos = vk_zalloc(&device->vk.alloc,
-                            sizeof(*set->dyn_ssbos) * layout->num_dyn_ssbos, 8,
-                            VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->dyn_ssbos)
-         goto err_free_set;
+   set = (struct panvk_descriptor_set *)host_mem;
+   vk_object_base_init(&device->vk, &set->base, VK_OBJECT_TYPE_DESCRIPTOR_SET);
+   set->pool = pool;
+   set->layout = layout;
+   list_addtail(&set->link, &pool->sets);
+
+   if (layout->num_ubos)
+      set->ubos = host_mem + l.ubos;
+   if (layout->num_dyn_ubos)
+      set->dyn_ubos = (struct panvk_buffer_desc *)(host_mem + l.dyn_ubos);
+   if (layout->num_dyn_ssbos)
+      set->dyn_ssbos = (struct panvk_buffer_desc *)(host_mem + l.dyn_ssbos);
+   if (layout->num_imgs) {
+      set->img_fmts = (uint32_t *)(host_mem + l.img_fmts);
+      set->img_attrib_bufs = host_mem + l.img_attrib_bufs;
    }
 
-   if (layout->num_samplers) {
-      set->samplers = vk_zalloc(&device->vk.alloc,
-                                pan_size(SAMPLER) * layout->num_samplers, 8,
-                                VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->samplers)
-         goto err_free_set;
+   if (gpu_mem) {
+      uint8_t *gpu_cpu = (uint8_t *)pool->desc_bo->ptr.cpu +
+                         (gpu_mem - pool->desc_bo->ptr.gpu);
+
+      /* Descriptors of a recycled range can't be trusted */
+      memset(gpu_cpu, 0, gpu_size);
+
+      set->gpu_mem.gpu = gpu_mem;
+      set->gpu_mem.cpu = gpu_cpu;
+      set->gpu_size = gpu_size;
    }
 
    if (layout->num_textures) {
-      set->textures =
-         vk_zalloc(&device->vk.alloc, pan_size(TEXTURE) * layout->num_textures,
-                   8, VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->textures)
-         goto err_free_set;
+      set->textures = set->gpu_mem.cpu + gl.textures;
+      set->textures_table = set->gpu_mem.gpu + gl.textures;
    }
 
-   if (layout->num_imgs) {
-      set->img_fmts =
-         vk_zalloc(&device->vk.alloc,
-                   sizeof(*set->img_fmts) * layout->num_imgs,
-                   8, VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->img_fmts)
-         goto err_free_set;
-
-      set->img_attrib_bufs =
-         vk_zalloc(&device->vk.alloc,
-                   pan_size(ATTRIBUTE_BUFFER) * 2 * layout->num_imgs,
-                   8, VK_OBJECT_TYPE_DESCRIPTOR_SET);
-      if (!set->img_attrib_bufs)
-         goto err_free_set;
+   if (layout->num_samplers) {
+      panvk_per_arch(emit_dummy_sampler)(set->gpu_mem.cpu + gl.samplers);
+      set->samplers = set->gpu_mem.cpu + gl.samplers + pan_size(SAMPLER);
+      set->samplers_table = set->gpu_mem.gpu + gl.samplers;
    }
 
    if (layout->desc_ubo_size) {
-      set->desc_bo = panfrost_bo_create(&device->physical_device->pdev,
-                                        layout->desc_ubo_size,
-                                        0, "Descriptor set");
-      if (!set->desc_bo)
-         goto err_free_set;
-
       struct mali_uniform_buffer_packed *ubos = set->ubos;
 
-      panvk_per_arch(emit_ubo)(set->desc_bo->ptr.gpu,
+      set->desc_ubo.gpu = set->gpu_mem.gpu + gl.desc_ubo;
+      set->desc_ubo.cpu = set->gpu_mem.cpu + gl.desc_ubo;
+
+      panvk_per_arch(emit_ubo)(set->desc_ubo.gpu,
                                layout->desc_ubo_size,
                                &ubos[layout->desc_ubo_index]);
    }
@@ -332,19 +551,6 @@ panvk_per_arch(descriptor_set_create)(struct panvk_device *device,
 
    *out_set = set;
    return VK_SUCCESS;
-
-err_free_set:
-   vk_free(&device->vk.alloc, set->textures);
-   vk_free(&device->vk.alloc, set->samplers);
-   vk_free(&device->vk.alloc, set->ubos);
-   vk_free(&device->vk.alloc, set->dyn_ubos);
-   vk_free(&device->vk.alloc, set->dyn_ssbos);
-   vk_free(&device->vk.alloc, set->img_fmts);
-   vk_free(&device->vk.alloc, set->img_attrib_bufs);
-   if (set->desc_bo)
-      panfrost_bo_unreference(set->desc_bo);
-   vk_object_free(&device->vk, NULL, set);
-   return vk_error(device, VK_ERROR_OUT_OF_HOST_MEMORY);
 }
 
 VkResult
@@ -386,7 +592,7 @@ panvk_desc_ubo_data(struct panvk_descriptor_set *set,
    const struct panvk_descriptor_set_binding_layout *binding_layout =
       &set->layout->bindings[binding];
 
-   return (char *)set->desc_bo->ptr.cpu +
+   return (char *)set->desc_ubo.cpu +
           binding_layout->desc_ubo_offset +
           elem * binding_layout->desc_ubo_stride;
 }
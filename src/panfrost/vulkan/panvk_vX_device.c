@@ -115,6 +115,36 @@ panvk_queue_submit_batch(struct panvk_queue *queue,
          pandecode_dump_mappings();
    }
 
+   if (batch->post_fragment.first_job) {
+      struct drm_panfrost_submit submit = {
+         .bo_handles = (uintptr_t)bos,
+         .bo_handle_count = nr_bos,
+         .out_sync = queue->sync,
+         .jc = batch->post_fragment.first_job,
+      };
+
+      if (batch->scoreboard.first_job || batch->fragment_job) {
+         submit.in_syncs = (uintptr_t)(&queue->sync);
+         submit.in_sync_count = 1;
+      } else {
+         submit.in_syncs = (uintptr_t)in_fences;
+         submit.in_sync_count = nr_in_fences;
+      }
+
+      ret = drmIoctl(pdev->fd, DRM_IOCTL_PANFROST_SUBMIT, &submit);
+      assert(!ret);
+      if (debug & (PANVK_DEBUG_TRACE | PANVK_DEBUG_SYNC)) {
+         ret = drmSyncobjWait(pdev->fd, &submit.out_sync, 1, INT64_MAX, 0, NULL);
+         assert(!ret);
+      }
+
+      if (debug & PANVK_DEBUG_TRACE)
+         GENX(pandecode_jc)(batch->post_fragment.first_job, pdev->gpu_id);
+
+      if (debug & PANVK_DEBUG_DUMP)
+         pandecode_dump_mappings();
+   }
+
    if (debug & PANVK_DEBUG_TRACE)
       pandecode_next_frame();
 
@@ -202,7 +232,6 @@ panvk_per_arch(queue_submit)(struct vk_queue *vk_queue,
 {
    struct panvk_queue *queue =
       container_of(vk_queue, struct panvk_queue, vk);
-   const struct panfrost_device *pdev = &queue->device->physical_device->pdev;
 
    unsigned nr_semaphores = submit->wait_count + 1;
    uint32_t semaphores[nr_semaphores];
@@ -221,55 +250,6 @@ panvk_per_arch(queue_submit)(struct vk_queue *vk_queue,
          container_of(submit->command_buffers[j], struct panvk_cmd_buffer, vk);
 
       list_for_each_entry(struct panvk_batch, batch, &cmdbuf->batches, node) {
-         /* FIXME: should be done at the batch level */
-         unsigned nr_bos =
-            panvk_pool_num_bos(&cmdbuf->desc_pool) +
-            panvk_pool_num_bos(&cmdbuf->varying_pool) +
-            panvk_pool_num_bos(&cmdbuf->tls_pool) +
-            (batch->fb.info ? batch->fb.info->attachment_count : 0) +
-            (batch->blit.src ? 1 : 0) +
-            (batch->blit.dst ? 1 : 0) +
-            (batch->scoreboard.first_tiler ? 1 : 0) + 1;
-         unsigned bo_idx = 0;
-         uint32_t bos[nr_bos];
-
-         panvk_pool_get_bo_handles(&cmdbuf->desc_pool, &bos[bo_idx]);
-         bo_idx += panvk_pool_num_bos(&cmdbuf->desc_pool);
-
-         panvk_pool_get_bo_handles(&cmdbuf->varying_pool, &bos[bo_idx]);
-         bo_idx += panvk_pool_num_bos(&cmdbuf->varying_pool);
-
-         panvk_pool_get_bo_handles(&cmdbuf->tls_pool, &bos[bo_idx]);
-         bo_idx += panvk_pool_num_bos(&cmdbuf->tls_pool);
-
-         if (batch->fb.info) {
-            for (unsigned i = 0; i < batch->fb.info->attachment_count; i++) {
-               bos[bo_idx++] = batch->fb.info->attachments[i].iview->pview.image->data.bo->gem_handle;
-            }
-         }
-
-         if (batch->blit.src)
-            bos[bo_idx++] = batch->blit.src->gem_handle;
-
-         if (batch->blit.dst)
-            bos[bo_idx++] = batch->blit.dst->gem_handle;
-
-         if (batch->scoreboard.first_tiler)
-            bos[bo_idx++] = pdev->tiler_heap->gem_handle;
-
-         bos[bo_idx++] = pdev->sample_positions->gem_handle;
-         assert(bo_idx == nr_bos);
-
-         /* Merge identical BO entries. */
-         for (unsigned x = 0; x < nr_bos; x++) {
-            for (unsigned y = x + 1; y < nr_bos; ) {
-               if (bos[x] == bos[y])
-                  bos[y] = bos[--nr_bos];
-               else
-                  y++;
-            }
-         }
-
          unsigned nr_in_fences = 0;
          unsigned max_wait_event_syncobjs =
             util_dynarray_num_elements(&batch->event_ops,
@@ -280,7 +260,10 @@ panvk_per_arch(queue_submit)(struct vk_queue *vk_queue,
 
          panvk_add_wait_event_syncobjs(batch, in_fences, &nr_in_fences);
 
-         panvk_queue_submit_batch(queue, batch, bos, nr_bos, in_fences, nr_in_fences);
+         panvk_queue_submit_batch(queue, batch,
+                                  util_dynarray_begin(&batch->bos),
+                                  util_dynarray_num_elements(&batch->bos, uint32_t),
+                                  in_fences, nr_in_fences);
 
          panvk_signal_event_syncobjs(queue, batch);
       }
@@ -58,6 +58,7 @@ panvk_per_arch(meta_init)(struct panvk_physical_device *dev)
    panvk_per_arch(meta_blit_init)(dev);
    panvk_per_arch(meta_copy_init)(dev);
    panvk_per_arch(meta_clear_init)(dev);
+   panvk_per_arch(meta_query_init)(dev);
 }
 
 void
@@ -51,3 +51,11 @@ panvk_per_arch(meta_blit_cleanup)(struct panvk_physical_device *dev);
 
 void
 panvk_per_arch(meta_copy_init)(struct panvk_physical_device *dev);
+
+void
+panvk_per_arch(meta_fill)(struct panvk_cmd_buffer *cmdbuf,
+                          struct panfrost_bo *bo, mali_ptr start,
+                          uint32_t nwords, uint32_t val);
+
+void
+panvk_per_arch(meta_query_init)(struct panvk_physical_device *dev);
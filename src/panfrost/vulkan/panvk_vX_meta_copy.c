@@ -23,6 +23,7 @@
 
 #include "gen_macros.h"
 
+#include "drm-uapi/drm_fourcc.h"
 #include "nir/nir_builder.h"
 #include "pan_encoder.h"
 #include "pan_shader.h"
@@ -1158,6 +1159,277 @@ panvk_meta_copy_buf2img_init(struct panvk_physical_device *dev)
    }
 }
 
+/* Buffer to image copies are done with a compute job writing texels in
+ * place when the destination layout is simple enough to address from a
+ * shader: linear or u-interleaved, uncompressed and single-sampled color.
+ * This avoids the tiler, the preload of the destination tiles, and a
+ * batch per layer. Other images (AFBC, depth/stencil, multisampled) go
+ * through the fragment path, which lets the hardware encode the texels.
+ */
+struct panvk_meta_copy_buf2img_compute_info {
+   struct {
+      mali_ptr ptr;
+      struct {
+         unsigned line;
+         unsigned surf;
+      } stride;
+   } buf;
+   struct {
+      mali_ptr ptr;
+      struct {
+         unsigned line;
+         unsigned surf;
+      } stride;
+      struct {
+         unsigned x, y;
+      } offset;
+      struct {
+         unsigned minx, miny, maxx, maxy;
+      } extent;
+   } img;
+} PACKED;
+
+#define panvk_meta_copy_buf2img_compute_get_info_field(b, field) \
+        nir_load_push_constant((b), 1, \
+                     sizeof(((struct panvk_meta_copy_buf2img_compute_info *)0)->field) * 8, \
+                     nir_imm_int(b, 0), \
+                     .base = offsetof(struct panvk_meta_copy_buf2img_compute_info, field), \
+                     .range = ~0)
+
+/* Spaces the bits of a 4-bit value out, see pan_tiling.c */
+static nir_ssa_def *
+panvk_meta_space_4(nir_builder *b, nir_ssa_def *v)
+{
+   nir_ssa_def *r = nir_iand_imm(b, v, 1);
+
+   for (unsigned i = 1; i < 4; i++)
+      r = nir_ior(b, r, nir_ishl_imm(b, nir_iand_imm(b, v, 1 << i), i));
+
+   return r;
+}
+
+static mali_ptr
+panvk_meta_copy_buf2img_compute_shader(struct panfrost_device *pdev,
+                                       struct pan_pool *bin_pool,
+                                       unsigned texelsz, bool tiled,
+                                       struct pan_shader_info *shader_info)
+{
+   nir_builder b =
+      nir_builder_init_simple_shader(MESA_SHADER_COMPUTE,
+                                     GENX(pan_shader_get_compiler_options)(),
+                                     "panvk_meta_copy_buf2img_compute(texelsz=%d,%s)",
+                                     texelsz, tiled ? "u-interleaved" : "linear");
+
+   nir_ssa_def *coord = nir_load_global_invocation_id(&b, 32);
+   nir_ssa_def *x =
+      nir_iadd(&b, nir_channel(&b, coord, 0),
+               panvk_meta_copy_buf2img_compute_get_info_field(&b, img.offset.x));
+   nir_ssa_def *y =
+      nir_iadd(&b, nir_channel(&b, coord, 1),
+               panvk_meta_copy_buf2img_compute_get_info_field(&b, img.offset.y));
+   nir_ssa_def *z = nir_channel(&b, coord, 2);
+
+   nir_ssa_def *minx =
+      panvk_meta_copy_buf2img_compute_get_info_field(&b, img.extent.minx);
+   nir_ssa_def *miny =
+      panvk_meta_copy_buf2img_compute_get_info_field(&b, img.extent.miny);
+   nir_ssa_def *maxx =
+      panvk_meta_copy_buf2img_compute_get_info_field(&b, img.extent.maxx);
+   nir_ssa_def *maxy =
+      panvk_meta_copy_buf2img_compute_get_info_field(&b, img.extent.maxy);
+
+   nir_ssa_def *inbounds =
+      nir_iand(&b,
+               nir_iand(&b, nir_uge(&b, maxx, x), nir_uge(&b, maxy, y)),
+               nir_iand(&b, nir_uge(&b, x, minx), nir_uge(&b, y, miny)));
+
+   nir_push_if(&b, inbounds);
+
+   nir_ssa_def *bufoffset =
+      nir_imul_imm(&b, nir_isub(&b, x, minx), texelsz);
+   bufoffset =
+      nir_iadd(&b, bufoffset,
+               nir_imul(&b, nir_isub(&b, y, miny),
+                        panvk_meta_copy_buf2img_compute_get_info_field(&b, buf.stride.line)));
+   bufoffset =
+      nir_iadd(&b, bufoffset,
+               nir_imul(&b, z,
+                        panvk_meta_copy_buf2img_compute_get_info_field(&b, buf.stride.surf)));
+
+   nir_ssa_def *imgoffset;
+   nir_ssa_def *imglinestride =
+      panvk_meta_copy_buf2img_compute_get_info_field(&b, img.stride.line);
+
+   if (tiled) {
+      /* 16x16 tiles, each row of tiles is line stride bytes, and texels
+       * are ordered along the u-interleaved curve within a tile:
+       * index = duplicated(y) ^ spaced(x).
+       */
+      nir_ssa_def *spacedy = panvk_meta_space_4(&b, nir_iand_imm(&b, y, 15));
+      nir_ssa_def *index =
+         nir_ixor(&b,
+                  nir_ior(&b, spacedy, nir_ishl_imm(&b, spacedy, 1)),
+                  panvk_meta_space_4(&b, nir_iand_imm(&b, x, 15)));
+
+      index = nir_iadd(&b, index, nir_imul_imm(&b, nir_ushr_imm(&b, x, 4), 256));
+      imgoffset = nir_iadd(&b, nir_imul_imm(&b, index, texelsz),
+                           nir_imul(&b, nir_ushr_imm(&b, y, 4), imglinestride));
+   } else {
+      imgoffset = nir_iadd(&b, nir_imul_imm(&b, x, texelsz),
+                           nir_imul(&b, y, imglinestride));
+   }
+
+   imgoffset =
+      nir_iadd(&b, imgoffset,
+               nir_imul(&b, z,
+                        panvk_meta_copy_buf2img_compute_get_info_field(&b, img.stride.surf)));
+
+   nir_ssa_def *bufptr =
+      nir_iadd(&b, panvk_meta_copy_buf2img_compute_get_info_field(&b, buf.ptr),
+               nir_u2u64(&b, bufoffset));
+   nir_ssa_def *imgptr =
+      nir_iadd(&b, panvk_meta_copy_buf2img_compute_get_info_field(&b, img.ptr),
+               nir_u2u64(&b, imgoffset));
+
+   unsigned compsz = MIN2(texelsz, 4);
+   unsigned ncomps = texelsz / compsz;
+
+   nir_store_global(&b, imgptr, compsz,
+                    nir_load_global(&b, bufptr, compsz, ncomps, compsz * 8),
+                    (1 << ncomps) - 1);
+
+   nir_pop_if(&b, NULL);
+
+   struct panfrost_compile_inputs inputs = {
+      .gpu_id = pdev->gpu_id,
+      .is_blit = true,
+      .no_ubo_to_push = true,
+   };
+
+   struct util_dynarray binary;
+
+   util_dynarray_init(&binary, NULL);
+   GENX(pan_shader_compile)(b.shader, &inputs, &binary, shader_info);
+
+   shader_info->push.count =
+      DIV_ROUND_UP(sizeof(struct panvk_meta_copy_buf2img_compute_info), 4);
+
+   mali_ptr shader =
+      pan_pool_upload_aligned(bin_pool, binary.data, binary.size, 128);
+
+   util_dynarray_fini(&binary);
+   ralloc_free(b.shader);
+
+   return shader;
+}
+
+static bool
+panvk_meta_copy_buf2img_use_compute(const struct panvk_image *img)
+{
+   const struct pan_image_layout *layout = &img->pimage.layout;
+   unsigned texelsz = util_format_get_blocksize(layout->format);
+
+   if (layout->modifier != DRM_FORMAT_MOD_LINEAR &&
+       layout->modifier != DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED)
+      return false;
+
+   return layout->nr_samples == 1 && !layout->crc &&
+          !util_format_is_compressed(layout->format) &&
+          !util_format_is_depth_or_stencil(layout->format) &&
+          util_is_power_of_two_nonzero(texelsz) && texelsz <= 16;
+}
+
+static void
+panvk_meta_copy_buf2img_compute(struct panvk_cmd_buffer *cmdbuf,
+                                const struct panvk_buffer *buf,
+                                const struct panvk_image *img,
+                                const VkBufferImageCopy2 *region)
+{
+   const struct pan_image_layout *layout = &img->pimage.layout;
+   unsigned level = region->imageSubresource.mipLevel;
+   unsigned texelsz = util_format_get_blocksize(layout->format);
+   bool tiled = layout->modifier == DRM_FORMAT_MOD_ARM_16X16_BLOCK_U_INTERLEAVED;
+   bool is_3d = layout->dim == MALI_TEXTURE_DIMENSION_3D;
+
+   assert(region->imageOffset.z >= 0);
+   unsigned first_layer = is_3d ? 0 : region->imageSubresource.baseArrayLayer;
+   unsigned first_surf = is_3d ? region->imageOffset.z : 0;
+   unsigned nlayers = is_3d ? region->imageExtent.depth :
+                      region->imageSubresource.layerCount;
+
+   const struct vk_image_buffer_layout buflayout =
+      vk_image_buffer_copy_layout(&img->vk, region);
+   struct panvk_meta_copy_buf2img_compute_info info = {
+      .buf.ptr = panvk_buffer_gpu_ptr(buf, region->bufferOffset),
+      .buf.stride.line = buflayout.row_stride_B,
+      .buf.stride.surf = buflayout.image_stride_B,
+      .img.ptr = img->pimage.data.bo->ptr.gpu + img->pimage.data.offset +
+                 panfrost_texture_offset(layout, level, first_layer,
+                                         first_surf),
+      .img.stride.line = layout->slices[level].row_stride,
+      .img.stride.surf = is_3d ? layout->slices[level].surface_stride :
+                         layout->array_stride,
+      .img.offset.x = MAX2(region->imageOffset.x & ~15, 0),
+      .img.offset.y = MAX2(region->imageOffset.y & ~15, 0),
+      .img.extent.minx = MAX2(region->imageOffset.x, 0),
+      .img.extent.miny = MAX2(region->imageOffset.y, 0),
+      .img.extent.maxx = MAX2(region->imageOffset.x + region->imageExtent.width - 1, 0),
+      .img.extent.maxy = MAX2(region->imageOffset.y + region->imageExtent.height - 1, 0),
+   };
+
+   mali_ptr rsd =
+      cmdbuf->device->physical_device->meta.copy.buf2img_compute[tiled][ffs(texelsz) - 1].rsd;
+
+   mali_ptr pushconsts =
+      pan_pool_upload_aligned(&cmdbuf->desc_pool.base, &info, sizeof(info), 16);
+
+   panvk_per_arch(cmd_close_batch)(cmdbuf);
+
+   struct panvk_batch *batch = panvk_cmd_open_batch(cmdbuf);
+
+   panvk_per_arch(cmd_alloc_tls_desc)(cmdbuf, false);
+
+   mali_ptr tsd = batch->tls.gpu;
+
+   /* One workgroup per 16x16 tile, like the image to buffer path */
+   struct pan_compute_dim wg_sz = { 16, 16, 1 };
+   struct pan_compute_dim num_wg = {
+      (ALIGN_POT(info.img.extent.maxx + 1, 16) - info.img.offset.x) / 16,
+      (ALIGN_POT(info.img.extent.maxy + 1, 16) - info.img.offset.y) / 16,
+      nlayers,
+   };
+
+   struct panfrost_ptr job =
+      panvk_meta_copy_emit_compute_job(&cmdbuf->desc_pool.base,
+                                       &batch->scoreboard, &num_wg, &wg_sz,
+                                       0, 0, pushconsts, rsd, tsd);
+
+   util_dynarray_append(&batch->jobs, void *, job.cpu);
+
+   batch->blit.src = buf->bo;
+   batch->blit.dst = img->pimage.data.bo;
+   panvk_per_arch(cmd_close_batch)(cmdbuf);
+}
+
+static void
+panvk_meta_copy_buf2img_compute_init(struct panvk_physical_device *dev)
+{
+   for (unsigned tiled = 0; tiled < 2; tiled++) {
+      for (unsigned i = 0; i < ARRAY_SIZE(dev->meta.copy.buf2img_compute[0]); i++) {
+         struct pan_shader_info shader_info;
+         mali_ptr shader =
+            panvk_meta_copy_buf2img_compute_shader(&dev->pdev,
+                                                   &dev->meta.bin_pool.base,
+                                                   1 << i, tiled,
+                                                   &shader_info);
+         dev->meta.copy.buf2img_compute[tiled][i].rsd =
+            panvk_meta_copy_to_buf_emit_rsd(&dev->pdev,
+                                            &dev->meta.desc_pool.base,
+                                            shader, &shader_info, false);
+      }
+   }
+}
+
 void
 panvk_per_arch(CmdCopyBufferToImage2)(VkCommandBuffer commandBuffer,
                                       const VkCopyBufferToImageInfo2 *pCopyBufferToImageInfo)
@@ -1166,8 +1438,15 @@ panvk_per_arch(CmdCopyBufferToImage2)(VkCommandBuffer commandBuffer,
    VK_FROM_HANDLE(panvk_buffer, buf, pCopyBufferToImageInfo->srcBuffer);
    VK_FROM_HANDLE(panvk_image, img, pCopyBufferToImageInfo->dstImage);
 
+   bool compute = panvk_meta_copy_buf2img_use_compute(img);
+
    for (unsigned i = 0; i < pCopyBufferToImageInfo->regionCount; i++) {
-      panvk_meta_copy_buf2img(cmdbuf, buf, img, &pCopyBufferToImageInfo->pRegions[i]);
+      const VkBufferImageCopy2 *region = &pCopyBufferToImageInfo->pRegions[i];
+
+      if (compute)
+         panvk_meta_copy_buf2img_compute(cmdbuf, buf, img, region);
+      else
+         panvk_meta_copy_buf2img(cmdbuf, buf, img, region);
    }
 }
 
@@ -1614,8 +1893,14 @@ panvk_per_arch(CmdCopyImageToBuffer2)(VkCommandBuffer commandBuffer,
 struct panvk_meta_copy_buf2buf_info {
    mali_ptr src;
    mali_ptr dst;
+   unsigned nblocks;
 } PACKED;
 
+/* Buffer copies and fills run this many invocations per workgroup, the
+ * last workgroup being partially masked out.
+ */
+#define PANVK_META_COPY_BUF_WG_SIZE 64
+
 #define panvk_meta_copy_buf2buf_get_info_field(b, field) \
         nir_load_push_constant((b), 1, \
                      sizeof(((struct panvk_meta_copy_buf2buf_info *)0)->field) * 8, \
@@ -1640,6 +1925,9 @@ panvk_meta_copy_buf2buf_shader(struct panfrost_device *pdev,
 
    nir_ssa_def *coord = nir_load_global_invocation_id(&b, 32);
 
+   nir_push_if(&b, nir_ult(&b, nir_channel(&b, coord, 0),
+                           panvk_meta_copy_buf2buf_get_info_field(&b, nblocks)));
+
    nir_ssa_def *offset =
       nir_u2u64(&b, nir_imul(&b, nir_channel(&b, coord, 0), nir_imm_int(&b, blksz)));
    nir_ssa_def *srcptr =
@@ -1653,6 +1941,8 @@ panvk_meta_copy_buf2buf_shader(struct panfrost_device *pdev,
                     nir_load_global(&b, srcptr, blksz, ncomps, compsz * 8),
                     (1 << ncomps) - 1);
 
+   nir_pop_if(&b, NULL);
+
    struct panfrost_compile_inputs inputs = {
       .gpu_id = pdev->gpu_id,
       .is_blit = true,
@@ -1703,6 +1993,8 @@ panvk_meta_copy_buf2buf(struct panvk_cmd_buffer *cmdbuf,
    unsigned alignment = ffs((info.src | info.dst | region->size) & 15);
    unsigned log2blksz = alignment ? alignment - 1 : 4;
 
+   info.nblocks = region->size >> log2blksz;
+
    assert(log2blksz < ARRAY_SIZE(cmdbuf->device->physical_device->meta.copy.buf2buf));
    mali_ptr rsd =
       cmdbuf->device->physical_device->meta.copy.buf2buf[log2blksz].rsd;
@@ -1718,9 +2010,10 @@ panvk_meta_copy_buf2buf(struct panvk_cmd_buffer *cmdbuf,
 
    mali_ptr tsd = batch->tls.gpu;
 
-   unsigned nblocks = region->size >> log2blksz;
-   struct pan_compute_dim num_wg = { nblocks, 1, 1 };
-   struct pan_compute_dim wg_sz = { 1, 1, 1};
+   struct pan_compute_dim num_wg = {
+      DIV_ROUND_UP(info.nblocks, PANVK_META_COPY_BUF_WG_SIZE), 1, 1,
+   };
+   struct pan_compute_dim wg_sz = { PANVK_META_COPY_BUF_WG_SIZE, 1, 1 };
    struct panfrost_ptr job =
      panvk_meta_copy_emit_compute_job(&cmdbuf->desc_pool.base,
                                       &batch->scoreboard,
@@ -1750,6 +2043,7 @@ panvk_per_arch(CmdCopyBuffer2)(VkCommandBuffer commandBuffer,
 struct panvk_meta_fill_buf_info {
    mali_ptr start;
    uint32_t val;
+   uint32_t nwords;
 } PACKED;
 
 #define panvk_meta_fill_buf_get_info_field(b, field) \
@@ -1774,6 +2068,9 @@ panvk_meta_fill_buf_shader(struct panfrost_device *pdev,
 
    nir_ssa_def *coord = nir_load_global_invocation_id(&b, 32);
 
+   nir_push_if(&b, nir_ult(&b, nir_channel(&b, coord, 0),
+                           panvk_meta_fill_buf_get_info_field(&b, nwords)));
+
    nir_ssa_def *offset =
       nir_u2u64(&b, nir_imul(&b, nir_channel(&b, coord, 0), nir_imm_int(&b, sizeof(uint32_t))));
    nir_ssa_def *ptr =
@@ -1782,6 +2079,8 @@ panvk_meta_fill_buf_shader(struct panfrost_device *pdev,
 
    nir_store_global(&b, ptr, sizeof(uint32_t), val, 1);
 
+   nir_pop_if(&b, NULL);
+
    struct panfrost_compile_inputs inputs = {
       .gpu_id = pdev->gpu_id,
       .is_blit = true,
@@ -1833,31 +2132,16 @@ panvk_meta_fill_buf_init(struct panvk_physical_device *dev)
                                    &dev->meta.desc_pool.base);
 }
 
-static void
-panvk_meta_fill_buf(struct panvk_cmd_buffer *cmdbuf,
-                    const struct panvk_buffer *dst,
-                    VkDeviceSize size, VkDeviceSize offset,
-                    uint32_t val)
+void
+panvk_per_arch(meta_fill)(struct panvk_cmd_buffer *cmdbuf,
+                          struct panfrost_bo *bo, mali_ptr start,
+                          uint32_t nwords, uint32_t val)
 {
    struct panvk_meta_fill_buf_info info = {
-      .start = panvk_buffer_gpu_ptr(dst, offset),
+      .start = start,
       .val = val,
+      .nwords = nwords,
    };
-   size = panvk_buffer_range(dst, offset, size);
-
-   /* From the Vulkan spec:
-    *
-    *    "size is the number of bytes to fill, and must be either a multiple
-    *    of 4, or VK_WHOLE_SIZE to fill the range from offset to the end of
-    *    the buffer. If VK_WHOLE_SIZE is used and the remaining size of the
-    *    buffer is not a multiple of 4, then the nearest smaller multiple is
-    *    used."
-    */
-   size &= ~3ull;
-
-   assert(!(offset & 3) && !(size & 3));
-
-   unsigned nwords = size / sizeof(uint32_t);
    mali_ptr rsd =
       cmdbuf->device->physical_device->meta.copy.fillbuf.rsd;
 
@@ -1872,8 +2156,10 @@ panvk_meta_fill_buf(struct panvk_cmd_buffer *cmdbuf,
 
    mali_ptr tsd = batch->tls.gpu;
 
-   struct pan_compute_dim num_wg = { nwords, 1, 1 };
-   struct pan_compute_dim wg_sz = { 1, 1, 1};
+   struct pan_compute_dim num_wg = {
+      DIV_ROUND_UP(info.nwords, PANVK_META_COPY_BUF_WG_SIZE), 1, 1,
+   };
+   struct pan_compute_dim wg_sz = { PANVK_META_COPY_BUF_WG_SIZE, 1, 1 };
    struct panfrost_ptr job =
      panvk_meta_copy_emit_compute_job(&cmdbuf->desc_pool.base,
                                       &batch->scoreboard,
@@ -1882,10 +2168,35 @@ panvk_meta_fill_buf(struct panvk_cmd_buffer *cmdbuf,
 
    util_dynarray_append(&batch->jobs, void *, job.cpu);
 
-   batch->blit.dst = dst->bo;
+   batch->blit.dst = bo;
    panvk_per_arch(cmd_close_batch)(cmdbuf);
 }
 
+static void
+panvk_meta_fill_buf(struct panvk_cmd_buffer *cmdbuf,
+                    const struct panvk_buffer *dst,
+                    VkDeviceSize size, VkDeviceSize offset,
+                    uint32_t val)
+{
+   size = panvk_buffer_range(dst, offset, size);
+
+   /* From the Vulkan spec:
+    *
+    *    "size is the number of bytes to fill, and must be either a multiple
+    *    of 4, or VK_WHOLE_SIZE to fill the range from offset to the end of
+    *    the buffer. If VK_WHOLE_SIZE is used and the remaining size of the
+    *    buffer is not a multiple of 4, then the nearest smaller multiple is
+    *    used."
+    */
+   size &= ~3ull;
+
+   assert(!(offset & 3) && !(size & 3));
+
+   panvk_per_arch(meta_fill)(cmdbuf, dst->bo,
+                             panvk_buffer_gpu_ptr(dst, offset),
+                             size / sizeof(uint32_t), val);
+}
+
 void
 panvk_per_arch(CmdFillBuffer)(VkCommandBuffer commandBuffer,
                               VkBuffer dstBuffer,
@@ -1911,6 +2222,8 @@ panvk_meta_update_buf(struct panvk_cmd_buffer *cmdbuf,
 
    unsigned log2blksz = ffs(sizeof(uint32_t)) - 1;
 
+   info.nblocks = size >> log2blksz;
+
    mali_ptr rsd =
       cmdbuf->device->physical_device->meta.copy.buf2buf[log2blksz].rsd;
 
@@ -1925,9 +2238,10 @@ panvk_meta_update_buf(struct panvk_cmd_buffer *cmdbuf,
 
    mali_ptr tsd = batch->tls.gpu;
 
-   unsigned nblocks = size >> log2blksz;
-   struct pan_compute_dim num_wg = { nblocks, 1, 1 };
-   struct pan_compute_dim wg_sz = { 1, 1, 1};
+   struct pan_compute_dim num_wg = {
+      DIV_ROUND_UP(info.nblocks, PANVK_META_COPY_BUF_WG_SIZE), 1, 1,
+   };
+   struct pan_compute_dim wg_sz = { PANVK_META_COPY_BUF_WG_SIZE, 1, 1 };
    struct panfrost_ptr job =
      panvk_meta_copy_emit_compute_job(&cmdbuf->desc_pool.base,
                                       &batch->scoreboard,
@@ -1959,6 +2273,7 @@ panvk_per_arch(meta_copy_init)(struct panvk_physical_device *dev)
    panvk_meta_copy_img2img_init(dev, false);
    panvk_meta_copy_img2img_init(dev, true);
    panvk_meta_copy_buf2img_init(dev);
+   panvk_meta_copy_buf2img_compute_init(dev);
    panvk_meta_copy_img2buf_init(dev);
    panvk_meta_copy_buf2buf_init(dev);
    panvk_meta_fill_buf_init(dev);
@@ -38,6 +38,7 @@
 #include "util/mesa-sha1.h"
 #include "util/u_atomic.h"
 #include "vk_format.h"
+#include "vk_pipeline.h"
 #include "vk_util.h"
 
 #include "panfrost/util/pan_lower_framebuffer.h"
@@ -46,7 +47,7 @@
 struct panvk_pipeline_builder
 {
    struct panvk_device *device;
-   struct panvk_pipeline_cache *cache;
+   struct vk_pipeline_cache *cache;
    const VkAllocationCallbacks *alloc;
    struct {
       const VkGraphicsPipelineCreateInfo *gfx;
@@ -56,11 +57,9 @@ struct panvk_pipeline_builder
 
    struct panvk_shader *shaders[MESA_SHADER_STAGES];
    struct {
-      uint32_t shader_offset;
       uint32_t rsd_offset;
    } stages[MESA_SHADER_STAGES];
    uint32_t blend_shader_offsets[MAX_RTS];
-   uint32_t shader_total_size;
    uint32_t static_state_size;
    uint32_t vpd_offset;
 
@@ -95,7 +94,7 @@ panvk_pipeline_builder_finish(struct panvk_pipeline_builder *builder)
    for (uint32_t i = 0; i < MESA_SHADER_STAGES; i++) {
       if (!builder->shaders[i])
          continue;
-      panvk_shader_destroy(builder->device, builder->shaders[i], builder->alloc);
+      panvk_shader_unref(builder->shaders[i]);
    }
 }
 
@@ -105,6 +104,46 @@ panvk_pipeline_static_state(struct panvk_pipeline *pipeline, uint32_t id)
    return !(pipeline->dynamic_state_mask & (1 << id));
 }
 
+static void
+panvk_pipeline_builder_hash_shader(struct panvk_pipeline_builder *builder,
+                                   struct panvk_pipeline *pipeline,
+                                   gl_shader_stage stage,
+                                   const VkPipelineShaderStageCreateInfo *stage_info,
+                                   unsigned sysval_ubo,
+                                   bool static_blend_constants,
+                                   unsigned char *sha1)
+{
+   const struct panvk_device *dev = builder->device;
+   const struct panvk_pipeline_layout *layout = builder->layout;
+   bool robust = dev->vk.enabled_features.robustBufferAccess;
+   unsigned char stage_sha1[20];
+   struct mesa_sha1 ctx;
+
+   vk_pipeline_hash_shader_stage(stage_info, NULL, stage_sha1);
+
+   _mesa_sha1_init(&ctx);
+   _mesa_sha1_update(&ctx, stage_sha1, sizeof(stage_sha1));
+   _mesa_sha1_update(&ctx, &stage, sizeof(stage));
+   _mesa_sha1_update(&ctx, layout->sha1, sizeof(layout->sha1));
+   _mesa_sha1_update(&ctx, &layout->push_constants.size,
+                     sizeof(layout->push_constants.size));
+   _mesa_sha1_update(&ctx, &sysval_ubo, sizeof(sysval_ubo));
+   _mesa_sha1_update(&ctx, &robust, sizeof(robust));
+
+   /* Blending is lowered to the fragment shader when the hardware can't do
+    * it, so the blend state is part of the key. The pipeline is zeroed on
+    * allocation, padding included, so the state can be hashed as is.
+    */
+   if (stage == MESA_SHADER_FRAGMENT) {
+      _mesa_sha1_update(&ctx, &pipeline->blend.state,
+                        sizeof(pipeline->blend.state));
+      _mesa_sha1_update(&ctx, &static_blend_constants,
+                        sizeof(static_blend_constants));
+   }
+
+   _mesa_sha1_final(&ctx, sha1);
+}
+
 static VkResult
 panvk_pipeline_builder_compile_shaders(struct panvk_pipeline_builder *builder,
                                        struct panvk_pipeline *pipeline)
@@ -132,56 +171,64 @@ panvk_pipeline_builder_compile_shaders(struct panvk_pipeline_builder *builder,
          continue;
 
       struct panvk_shader *shader;
+      bool static_blend_constants =
+         panvk_pipeline_static_state(pipeline,
+                                     VK_DYNAMIC_STATE_BLEND_CONSTANTS);
+      unsigned char sha1[20];
+
+      panvk_pipeline_builder_hash_shader(builder, pipeline, stage, stage_info,
+                                         PANVK_SYSVAL_UBO_INDEX,
+                                         static_blend_constants, sha1);
+
+      struct vk_pipeline_cache_object *object =
+         vk_pipeline_cache_lookup_object(builder->cache, sha1, sizeof(sha1),
+                                         &panvk_shader_ops, NULL);
+
+      if (object) {
+         shader = container_of(object, struct panvk_shader, base);
+
+         /* Compiling the fragment shader may have moved blending to it */
+         if (stage == MESA_SHADER_FRAGMENT) {
+            const struct panfrost_device *pdev =
+               &builder->device->physical_device->pdev;
+
+            panvk_per_arch(blend_lower_state)(pdev, &pipeline->blend.state);
+         }
+      } else {
+         shader = panvk_per_arch(shader_create)(builder->device, stage,
+                                                stage_info, builder->layout,
+                                                PANVK_SYSVAL_UBO_INDEX,
+                                                &pipeline->blend.state,
+                                                static_blend_constants, sha1);
+         if (!shader)
+            return VK_ERROR_OUT_OF_HOST_MEMORY;
+
+         object = vk_pipeline_cache_add_object(builder->cache, &shader->base);
+         shader = container_of(object, struct panvk_shader, base);
+      }
 
-      shader = panvk_per_arch(shader_create)(builder->device, stage, stage_info,
-                                             builder->layout,
-                                             PANVK_SYSVAL_UBO_INDEX,
-                                             &pipeline->blend.state,
-                                             panvk_pipeline_static_state(pipeline,
-                                                                         VK_DYNAMIC_STATE_BLEND_CONSTANTS),
-                                             builder->alloc);
-      if (!shader)
-         return VK_ERROR_OUT_OF_HOST_MEMORY;
- 
       builder->shaders[stage] = shader;
-      builder->shader_total_size = ALIGN_POT(builder->shader_total_size, 128);
-      builder->stages[stage].shader_offset = builder->shader_total_size;
-      builder->shader_total_size +=
-         util_dynarray_num_elements(&shader->binary, uint8_t);
    }
 
    return VK_SUCCESS;
 }
 
-static VkResult
-panvk_pipeline_builder_upload_shaders(struct panvk_pipeline_builder *builder,
-                                      struct panvk_pipeline *pipeline)
+/* Shaders are uploaded when they are compiled or loaded from a cache, so a
+ * pipeline built from cached shaders only links them, the binaries are
+ * shared by reference.
+ */
+static void
+panvk_pipeline_builder_ref_shaders(struct panvk_pipeline_builder *builder,
+                                   struct panvk_pipeline *pipeline)
 {
-   /* In some cases, the optimized shader is empty. Don't bother allocating
-    * anything in this case.
-    */
-   if (builder->shader_total_size == 0)
-      return VK_SUCCESS;
-
-   struct panfrost_bo *bin_bo =
-      panfrost_bo_create(&builder->device->physical_device->pdev,
-                         builder->shader_total_size, PAN_BO_EXECUTE,
-                         "Shader");
-
-   pipeline->binary_bo = bin_bo;
-   panfrost_bo_mmap(bin_bo);
-
    for (uint32_t i = 0; i < MESA_SHADER_STAGES; i++) {
       const struct panvk_shader *shader = builder->shaders[i];
-      if (!shader)
+      if (!shader || !shader->bo)
          continue;
 
-      memcpy(pipeline->binary_bo->ptr.cpu + builder->stages[i].shader_offset,
-             util_dynarray_element(&shader->binary, uint8_t, 0),
-             util_dynarray_num_elements(&shader->binary, uint8_t));
+      panfrost_bo_reference(shader->bo);
+      pipeline->binary_bos[i] = shader->bo;
    }
-
-   return VK_SUCCESS;
 }
 
 static bool
@@ -273,13 +320,8 @@ panvk_pipeline_builder_init_shaders(struct panvk_pipeline_builder *builder,
          pipeline->ia.writes_point_size = points;
       }
 
-      mali_ptr shader_ptr = 0;
-
-      /* Handle empty shaders gracefully */
-      if (util_dynarray_num_elements(&builder->shaders[i]->binary, uint8_t)) {
-         shader_ptr = pipeline->binary_bo->ptr.gpu +
-                      builder->stages[i].shader_offset;
-      }
+      /* Empty shaders have a NULL address */
+      mali_ptr shader_ptr = panvk_shader_get_address(shader);
 
       if (i != MESA_SHADER_FRAGMENT) {
          void *rsd = pipeline->state_bo->ptr.cpu + builder->stages[i].rsd_offset;
@@ -364,6 +406,51 @@ panvk_pipeline_builder_parse_dynamic(struct panvk_pipeline_builder *builder,
       case VK_DYNAMIC_STATE_VIEWPORT ... VK_DYNAMIC_STATE_STENCIL_REFERENCE:
          pipeline->dynamic_state_mask |= 1 << state;
          break;
+      case VK_DYNAMIC_STATE_VIEWPORT_WITH_COUNT:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_VIEWPORT;
+         break;
+      case VK_DYNAMIC_STATE_SCISSOR_WITH_COUNT:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_SCISSOR;
+         break;
+      case VK_DYNAMIC_STATE_CULL_MODE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_CULL_MODE;
+         break;
+      case VK_DYNAMIC_STATE_FRONT_FACE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_FRONT_FACE;
+         break;
+      case VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_PRIMITIVE_TOPOLOGY;
+         break;
+      case VK_DYNAMIC_STATE_VERTEX_INPUT_BINDING_STRIDE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_VERTEX_INPUT_BINDING_STRIDE;
+         break;
+      case VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_DEPTH_TEST_ENABLE;
+         break;
+      case VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_DEPTH_WRITE_ENABLE;
+         break;
+      case VK_DYNAMIC_STATE_DEPTH_COMPARE_OP:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_DEPTH_COMPARE_OP;
+         break;
+      case VK_DYNAMIC_STATE_DEPTH_BOUNDS_TEST_ENABLE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_DEPTH_BOUNDS_TEST_ENABLE;
+         break;
+      case VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_STENCIL_TEST_ENABLE;
+         break;
+      case VK_DYNAMIC_STATE_STENCIL_OP:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_STENCIL_OP;
+         break;
+      case VK_DYNAMIC_STATE_RASTERIZER_DISCARD_ENABLE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_RASTERIZER_DISCARD_ENABLE;
+         break;
+      case VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_DEPTH_BIAS_ENABLE;
+         break;
+      case VK_DYNAMIC_STATE_PRIMITIVE_RESTART_ENABLE:
+         pipeline->dynamic_state_mask |= PANVK_DYNAMIC_PRIMITIVE_RESTART_ENABLE;
+         break;
       default:
          unreachable("unsupported dynamic state");
       }
@@ -371,32 +458,6 @@ panvk_pipeline_builder_parse_dynamic(struct panvk_pipeline_builder *builder,
 
 }
 
-static enum mali_draw_mode
-translate_prim_topology(VkPrimitiveTopology in)
-{
-   switch (in) {
-   case VK_PRIMITIVE_TOPOLOGY_POINT_LIST:
-      return MALI_DRAW_MODE_POINTS;
-   case VK_PRIMITIVE_TOPOLOGY_LINE_LIST:
-      return MALI_DRAW_MODE_LINES;
-   case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP:
-      return MALI_DRAW_MODE_LINE_STRIP;
-   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST:
-      return MALI_DRAW_MODE_TRIANGLES;
-   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP:
-      return MALI_DRAW_MODE_TRIANGLE_STRIP;
-   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN:
-      return MALI_DRAW_MODE_TRIANGLE_FAN;
-   case VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY:
-   case VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY:
-   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST_WITH_ADJACENCY:
-   case VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP_WITH_ADJACENCY:
-   case VK_PRIMITIVE_TOPOLOGY_PATCH_LIST:
-   default:
-      unreachable("Invalid primitive type");
-   }
-}
-
 static void
 panvk_pipeline_builder_parse_input_assembly(struct panvk_pipeline_builder *builder,
                                             struct panvk_pipeline *pipeline)
@@ -404,7 +465,7 @@ panvk_pipeline_builder_parse_input_assembly(struct panvk_pipeline_builder *build
    pipeline->ia.primitive_restart =
       builder->create_info.gfx->pInputAssemblyState->primitiveRestartEnable;
    pipeline->ia.topology =
-      translate_prim_topology(builder->create_info.gfx->pInputAssemblyState->topology);
+      panvk_per_arch(translate_prim_topology)(builder->create_info.gfx->pInputAssemblyState->topology);
 }
 
 static enum pipe_logicop
@@ -610,26 +671,12 @@ panvk_pipeline_builder_parse_multisample(struct panvk_pipeline_builder *builder,
       MAX2(builder->create_info.gfx->pMultisampleState->minSampleShading * nr_samples, 1);
 }
 
-static enum mali_stencil_op
-translate_stencil_op(VkStencilOp in)
-{
-   switch (in) {
-   case VK_STENCIL_OP_KEEP: return MALI_STENCIL_OP_KEEP;
-   case VK_STENCIL_OP_ZERO: return MALI_STENCIL_OP_ZERO;
-   case VK_STENCIL_OP_REPLACE: return MALI_STENCIL_OP_REPLACE;
-   case VK_STENCIL_OP_INCREMENT_AND_CLAMP: return MALI_STENCIL_OP_INCR_SAT;
-   case VK_STENCIL_OP_DECREMENT_AND_CLAMP: return MALI_STENCIL_OP_DECR_SAT;
-   case VK_STENCIL_OP_INCREMENT_AND_WRAP: return MALI_STENCIL_OP_INCR_WRAP;
-   case VK_STENCIL_OP_DECREMENT_AND_WRAP: return MALI_STENCIL_OP_DECR_WRAP;
-   case VK_STENCIL_OP_INVERT: return MALI_STENCIL_OP_INVERT;
-   default: unreachable("Invalid stencil op");
-   }
-}
-
 static void
 panvk_pipeline_builder_parse_zs(struct panvk_pipeline_builder *builder,
                                 struct panvk_pipeline *pipeline)
 {
+   pipeline->zs.attachment = builder->use_depth_stencil_attachment;
+
    if (!builder->use_depth_stencil_attachment)
       return;
 
@@ -641,21 +688,21 @@ panvk_pipeline_builder_parse_zs(struct panvk_pipeline_builder *builder,
     *    depthTestEnable is VK_TRUE. Depth writes are always disabled when
     *    depthTestEnable is VK_FALSE.
     *
-    * The hardware does not make this distinction, though, so we AND in the
-    * condition ourselves.
+    * The hardware does not make this distinction, though, so the condition
+    * is ANDed in when emitting the RSD, as either may be dynamic.
     */
-   pipeline->zs.z_write = pipeline->zs.z_test &&
+   pipeline->zs.z_write =
       builder->create_info.gfx->pDepthStencilState->depthWriteEnable;
 
    pipeline->zs.z_compare_func =
       panvk_per_arch(translate_compare_func)(builder->create_info.gfx->pDepthStencilState->depthCompareOp);
    pipeline->zs.s_test = builder->create_info.gfx->pDepthStencilState->stencilTestEnable;
    pipeline->zs.s_front.fail_op =
-      translate_stencil_op(builder->create_info.gfx->pDepthStencilState->front.failOp);
+      panvk_per_arch(translate_stencil_op)(builder->create_info.gfx->pDepthStencilState->front.failOp);
    pipeline->zs.s_front.pass_op =
-      translate_stencil_op(builder->create_info.gfx->pDepthStencilState->front.passOp);
+      panvk_per_arch(translate_stencil_op)(builder->create_info.gfx->pDepthStencilState->front.passOp);
    pipeline->zs.s_front.z_fail_op =
-      translate_stencil_op(builder->create_info.gfx->pDepthStencilState->front.depthFailOp);
+      panvk_per_arch(translate_stencil_op)(builder->create_info.gfx->pDepthStencilState->front.depthFailOp);
    pipeline->zs.s_front.compare_func =
       panvk_per_arch(translate_compare_func)(builder->create_info.gfx->pDepthStencilState->front.compareOp);
    pipeline->zs.s_front.compare_mask =
@@ -665,11 +712,11 @@ panvk_pipeline_builder_parse_zs(struct panvk_pipeline_builder *builder,
    pipeline->zs.s_front.ref =
       builder->create_info.gfx->pDepthStencilState->front.reference;
    pipeline->zs.s_back.fail_op =
-      translate_stencil_op(builder->create_info.gfx->pDepthStencilState->back.failOp);
+      panvk_per_arch(translate_stencil_op)(builder->create_info.gfx->pDepthStencilState->back.failOp);
    pipeline->zs.s_back.pass_op =
-      translate_stencil_op(builder->create_info.gfx->pDepthStencilState->back.passOp);
+      panvk_per_arch(translate_stencil_op)(builder->create_info.gfx->pDepthStencilState->back.passOp);
    pipeline->zs.s_back.z_fail_op =
-      translate_stencil_op(builder->create_info.gfx->pDepthStencilState->back.depthFailOp);
+      panvk_per_arch(translate_stencil_op)(builder->create_info.gfx->pDepthStencilState->back.depthFailOp);
    pipeline->zs.s_back.compare_func =
       panvk_per_arch(translate_compare_func)(builder->create_info.gfx->pDepthStencilState->back.compareOp);
    pipeline->zs.s_back.compare_mask =
@@ -694,7 +741,9 @@ panvk_pipeline_builder_parse_rast(struct panvk_pipeline_builder *builder,
    pipeline->rast.cull_front_face = builder->create_info.gfx->pRasterizationState->cullMode & VK_CULL_MODE_FRONT_BIT;
    pipeline->rast.cull_back_face = builder->create_info.gfx->pRasterizationState->cullMode & VK_CULL_MODE_BACK_BIT;
    pipeline->rast.line_width = builder->create_info.gfx->pRasterizationState->lineWidth;
-   pipeline->rast.enable = !builder->create_info.gfx->pRasterizationState->rasterizerDiscardEnable;
+   pipeline->rast.enable =
+      (pipeline->dynamic_state_mask & PANVK_DYNAMIC_RASTERIZER_DISCARD_ENABLE) ||
+      !builder->create_info.gfx->pRasterizationState->rasterizerDiscardEnable;
 }
 
 static bool
@@ -723,19 +772,28 @@ panvk_fs_required(struct panvk_pipeline *pipeline)
          (1 << VK_DYNAMIC_STATE_BLEND_CONSTANTS) | \
          (1 << VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK) | \
          (1 << VK_DYNAMIC_STATE_STENCIL_WRITE_MASK) | \
-         (1 << VK_DYNAMIC_STATE_STENCIL_REFERENCE))
+         (1 << VK_DYNAMIC_STATE_STENCIL_REFERENCE) | \
+         PANVK_DYNAMIC_DEPTH_TEST_ENABLE | \
+         PANVK_DYNAMIC_DEPTH_WRITE_ENABLE | \
+         PANVK_DYNAMIC_DEPTH_COMPARE_OP | \
+         PANVK_DYNAMIC_STENCIL_TEST_ENABLE | \
+         PANVK_DYNAMIC_STENCIL_OP | \
+         PANVK_DYNAMIC_DEPTH_BIAS_ENABLE)
 
 static void
 panvk_pipeline_builder_init_fs_state(struct panvk_pipeline_builder *builder,
                                      struct panvk_pipeline *pipeline)
 {
+   /* The depth/stencil state lives in the fragment RSD even without a
+    * fragment shader */
+   pipeline->fs.dynamic_rsd =
+      pipeline->dynamic_state_mask & PANVK_DYNAMIC_FS_RSD_MASK;
+
    if (!builder->shaders[MESA_SHADER_FRAGMENT])
       return;
 
-   pipeline->fs.dynamic_rsd =
-      pipeline->dynamic_state_mask & PANVK_DYNAMIC_FS_RSD_MASK;
-   pipeline->fs.address = pipeline->binary_bo->ptr.gpu +
-                          builder->stages[MESA_SHADER_FRAGMENT].shader_offset;
+   pipeline->fs.address =
+      panvk_shader_get_address(builder->shaders[MESA_SHADER_FRAGMENT]);
    pipeline->fs.info = builder->shaders[MESA_SHADER_FRAGMENT]->info;
    pipeline->fs.rt_mask = builder->active_color_attachments;
    pipeline->fs.required = panvk_fs_required(pipeline);
@@ -899,14 +957,14 @@ panvk_pipeline_builder_build(struct panvk_pipeline_builder *builder,
       panvk_pipeline_builder_parse_zs(builder, *pipeline);
       panvk_pipeline_builder_parse_rast(builder, *pipeline);
       panvk_pipeline_builder_parse_vertex_input(builder, *pipeline);
-      panvk_pipeline_builder_upload_shaders(builder, *pipeline);
+      panvk_pipeline_builder_ref_shaders(builder, *pipeline);
       panvk_pipeline_builder_init_fs_state(builder, *pipeline);
       panvk_pipeline_builder_alloc_static_state_bo(builder, *pipeline);
       panvk_pipeline_builder_init_shaders(builder, *pipeline);
       panvk_pipeline_builder_parse_viewport(builder, *pipeline);
    } else {
       panvk_pipeline_builder_compile_shaders(builder, *pipeline);
-      panvk_pipeline_builder_upload_shaders(builder, *pipeline);
+      panvk_pipeline_builder_ref_shaders(builder, *pipeline);
       panvk_pipeline_builder_alloc_static_state_bo(builder, *pipeline);
       panvk_pipeline_builder_init_shaders(builder, *pipeline);
    }
@@ -917,7 +975,7 @@ panvk_pipeline_builder_build(struct panvk_pipeline_builder *builder,
 static void
 panvk_pipeline_builder_init_graphics(struct panvk_pipeline_builder *builder,
                                      struct panvk_device *dev,
-                                     struct panvk_pipeline_cache *cache,
+                                     struct vk_pipeline_cache *cache,
                                      const VkGraphicsPipelineCreateInfo *create_info,
                                      const VkAllocationCallbacks *alloc)
 {
@@ -934,6 +992,17 @@ panvk_pipeline_builder_init_graphics(struct panvk_pipeline_builder *builder,
    builder->rasterizer_discard =
       create_info->pRasterizationState->rasterizerDiscardEnable;
 
+   /* Everything rasterization depends on must be valid if the discard can
+    * be disabled at draw time */
+   const VkPipelineDynamicStateCreateInfo *dynamic_info =
+      create_info->pDynamicState;
+
+   for (uint32_t i = 0; dynamic_info && i < dynamic_info->dynamicStateCount; i++) {
+      if (dynamic_info->pDynamicStates[i] ==
+          VK_DYNAMIC_STATE_RASTERIZER_DISCARD_ENABLE)
+         builder->rasterizer_discard = false;
+   }
+
    if (builder->rasterizer_discard) {
       builder->samples = VK_SAMPLE_COUNT_1_BIT;
    } else {
@@ -967,7 +1036,9 @@ panvk_per_arch(CreateGraphicsPipelines)(VkDevice device,
                                         VkPipeline *pPipelines)
 {
    VK_FROM_HANDLE(panvk_device, dev, device);
-   VK_FROM_HANDLE(panvk_pipeline_cache, cache, pipelineCache);
+   VK_FROM_HANDLE(vk_pipeline_cache, cache, pipelineCache);
+
+   cache = cache ? cache : dev->mem_cache;
 
    for (uint32_t i = 0; i < count; i++) {
       struct panvk_pipeline_builder builder;
@@ -996,7 +1067,7 @@ panvk_per_arch(CreateGraphicsPipelines)(VkDevice device,
 static void
 panvk_pipeline_builder_init_compute(struct panvk_pipeline_builder *builder,
                                     struct panvk_device *dev,
-                                    struct panvk_pipeline_cache *cache,
+                                    struct vk_pipeline_cache *cache,
                                     const VkComputePipelineCreateInfo *create_info,
                                     const VkAllocationCallbacks *alloc)
 {
@@ -1020,7 +1091,9 @@ panvk_per_arch(CreateComputePipelines)(VkDevice device,
                                        VkPipeline *pPipelines)
 {
    VK_FROM_HANDLE(panvk_device, dev, device);
-   VK_FROM_HANDLE(panvk_pipeline_cache, cache, pipelineCache);
+   VK_FROM_HANDLE(vk_pipeline_cache, cache, pipelineCache);
+
+   cache = cache ? cache : dev->mem_cache;
 
    for (uint32_t i = 0; i < count; i++) {
       struct panvk_pipeline_builder builder;
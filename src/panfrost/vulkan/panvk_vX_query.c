@@ -0,0 +1,377 @@
+/*
+ * Copyright © 2021 Collabora Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include "gen_macros.h"
+
+#include "nir/nir_builder.h"
+#include "pan_encoder.h"
+#include "pan_shader.h"
+
+#include "panvk_private.h"
+
+#define PANVK_META_QUERY_WG_SIZE 64
+
+struct panvk_meta_query_copy_info {
+   mali_ptr pool;
+   mali_ptr dst;
+   uint32_t query_stride;
+   uint32_t dst_stride;
+   uint32_t query_count;
+   uint32_t flags;
+} PACKED;
+
+#define panvk_meta_query_copy_get_info_field(b, field) \
+        nir_load_push_constant((b), 1, \
+                     sizeof(((struct panvk_meta_query_copy_info *)0)->field) * 8, \
+                     nir_imm_int(b, 0), \
+                     .base = offsetof(struct panvk_meta_query_copy_info, field), \
+                     .range = ~0)
+
+static nir_ssa_def *
+panvk_meta_query_copy_flag(nir_builder *b, VkQueryResultFlags flag)
+{
+   nir_ssa_def *flags = panvk_meta_query_copy_get_info_field(b, flags);
+
+   return nir_i2b(b, nir_iand_imm(b, flags, flag));
+}
+
+static void
+panvk_meta_query_copy_store(nir_builder *b, nir_ssa_def *is64,
+                            nir_ssa_def *dst, unsigned idx,
+                            nir_ssa_def *val)
+{
+   nir_push_if(b, is64);
+   nir_store_global(b, nir_iadd_imm(b, dst, idx * sizeof(uint64_t)),
+                    sizeof(uint64_t), val, 1);
+   nir_push_else(b, NULL);
+   nir_store_global(b, nir_iadd_imm(b, dst, idx * sizeof(uint32_t)),
+                    sizeof(uint32_t), nir_u2u32(b, val), 1);
+   nir_pop_if(b, NULL);
+}
+
+/* The number of values summed per query is baked in the shader: it's the
+ * number of per-core counters for occlusion queries, and one for timestamps.
+ */
+static mali_ptr
+panvk_meta_query_copy_shader(struct panfrost_device *pdev,
+                             struct pan_pool *bin_pool,
+                             unsigned value_count,
+                             struct pan_shader_info *shader_info)
+{
+   nir_builder b =
+      nir_builder_init_simple_shader(MESA_SHADER_COMPUTE,
+                                     GENX(pan_shader_get_compiler_options)(),
+                                     "panvk_meta_query_copy(values=%u)",
+                                     value_count);
+
+   nir_ssa_def *idx =
+      nir_channel(&b, nir_load_global_invocation_id(&b, 32), 0);
+
+   nir_push_if(&b, nir_ult(&b, idx,
+                           panvk_meta_query_copy_get_info_field(&b, query_count)));
+
+   nir_ssa_def *slot =
+      nir_iadd(&b, panvk_meta_query_copy_get_info_field(&b, pool),
+               nir_u2u64(&b, nir_imul(&b, idx,
+                                      panvk_meta_query_copy_get_info_field(&b, query_stride))));
+   nir_ssa_def *dst =
+      nir_iadd(&b, panvk_meta_query_copy_get_info_field(&b, dst),
+               nir_u2u64(&b, nir_imul(&b, idx,
+                                      panvk_meta_query_copy_get_info_field(&b, dst_stride))));
+
+   nir_ssa_def *available =
+      nir_i2b(&b, nir_load_global(&b, slot, sizeof(uint64_t), 1, 64));
+   nir_ssa_def *value = nir_imm_int64(&b, 0);
+
+   for (unsigned i = 0; i < value_count; i++) {
+      nir_ssa_def *ptr = nir_iadd_imm(&b, slot, (i + 1) * sizeof(uint64_t));
+
+      value = nir_iadd(&b, value,
+                       nir_load_global(&b, ptr, sizeof(uint64_t), 1, 64));
+   }
+
+   nir_ssa_def *is64 = panvk_meta_query_copy_flag(&b, VK_QUERY_RESULT_64_BIT);
+
+   nir_push_if(&b, nir_ior(&b, available,
+                           panvk_meta_query_copy_flag(&b, VK_QUERY_RESULT_PARTIAL_BIT)));
+   panvk_meta_query_copy_store(&b, is64, dst, 0, value);
+   nir_pop_if(&b, NULL);
+
+   nir_push_if(&b, panvk_meta_query_copy_flag(&b, VK_QUERY_RESULT_WITH_AVAILABILITY_BIT));
+   panvk_meta_query_copy_store(&b, is64, dst, 1, nir_b2i64(&b, available));
+   nir_pop_if(&b, NULL);
+
+   nir_pop_if(&b, NULL);
+
+   struct panfrost_compile_inputs inputs = {
+      .gpu_id = pdev->gpu_id,
+      .is_blit = true,
+      .no_ubo_to_push = true,
+   };
+
+   struct util_dynarray binary;
+
+   util_dynarray_init(&binary, NULL);
+   GENX(pan_shader_compile)(b.shader, &inputs, &binary, shader_info);
+
+   shader_info->push.count = DIV_ROUND_UP(sizeof(struct panvk_meta_query_copy_info), 4);
+
+   mali_ptr shader =
+      pan_pool_upload_aligned(bin_pool, binary.data, binary.size, 128);
+
+   util_dynarray_fini(&binary);
+   ralloc_free(b.shader);
+
+   return shader;
+}
+
+static mali_ptr
+panvk_meta_query_copy_emit_rsd(struct panfrost_device *pdev,
+                               struct pan_pool *bin_pool,
+                               struct pan_pool *desc_pool,
+                               unsigned value_count)
+{
+   struct pan_shader_info shader_info;
+
+   mali_ptr shader =
+      panvk_meta_query_copy_shader(pdev, bin_pool, value_count, &shader_info);
+
+   struct panfrost_ptr rsd_ptr =
+      pan_pool_alloc_desc_aggregate(desc_pool,
+                                    PAN_DESC(RENDERER_STATE));
+
+   pan_pack(rsd_ptr.cpu, RENDERER_STATE, cfg) {
+      pan_shader_prepare_rsd(&shader_info, shader, &cfg);
+   }
+
+   return rsd_ptr.gpu;
+}
+
+void
+panvk_per_arch(meta_query_init)(struct panvk_physical_device *dev)
+{
+   dev->meta.query.copy_occlusion.rsd =
+      panvk_meta_query_copy_emit_rsd(&dev->pdev, &dev->meta.bin_pool.base,
+                                     &dev->meta.desc_pool.base,
+                                     dev->pdev.core_id_range);
+   dev->meta.query.copy_timestamp.rsd =
+      panvk_meta_query_copy_emit_rsd(&dev->pdev, &dev->meta.bin_pool.base,
+                                     &dev->meta.desc_pool.base, 1);
+}
+
+static void
+panvk_query_emit_write_value(struct panvk_cmd_buffer *cmdbuf,
+                             struct pan_scoreboard *scoreboard,
+                             mali_ptr addr, enum mali_write_value_type type,
+                             uint64_t value)
+{
+   struct panfrost_ptr job =
+      pan_pool_alloc_desc(&cmdbuf->desc_pool.base, WRITE_VALUE_JOB);
+
+   pan_section_pack(job.cpu, WRITE_VALUE_JOB, PAYLOAD, payload) {
+      payload.address = addr;
+      payload.type = type;
+      payload.immediate_value = value;
+   }
+
+   /* The barrier keeps the availability write after the value it covers */
+   panfrost_add_job(&cmdbuf->desc_pool.base, scoreboard,
+                    MALI_JOB_TYPE_WRITE_VALUE, true, false, 0, 0,
+                    &job, false);
+
+   util_dynarray_append(&cmdbuf->state.batch->jobs, void *, job.cpu);
+}
+
+/* Marks a query available, optionally writing a timestamp first. Inside a
+ * batch, the writes happen once the fragment job is done, so occlusion
+ * counters have landed. Otherwise all previous batches are complete by the
+ * time a new one runs, and the writes get their own batch.
+ */
+static void
+panvk_query_mark_available(struct panvk_cmd_buffer *cmdbuf,
+                           struct panvk_query_pool *pool,
+                           uint32_t query, bool timestamp)
+{
+   struct panvk_batch *batch = cmdbuf->state.batch;
+   bool own_batch = !batch;
+   mali_ptr slot = panvk_query_gpu_ptr(pool, query);
+
+   if (own_batch)
+      batch = panvk_cmd_open_batch(cmdbuf);
+
+   struct pan_scoreboard *scoreboard =
+      own_batch ? &batch->scoreboard : &batch->post_fragment;
+
+   if (timestamp) {
+      panvk_query_emit_write_value(cmdbuf, scoreboard, slot + sizeof(uint64_t),
+                                   MALI_WRITE_VALUE_TYPE_SYSTEM_TIMESTAMP, 0);
+   }
+
+   panvk_query_emit_write_value(cmdbuf, scoreboard, slot,
+                                MALI_WRITE_VALUE_TYPE_IMMEDIATE_64, 1);
+   panvk_batch_add_query_bo(batch, pool->bo);
+
+   if (own_batch)
+      panvk_per_arch(cmd_close_batch)(cmdbuf);
+}
+
+void
+panvk_per_arch(CmdResetQueryPool)(VkCommandBuffer commandBuffer,
+                                  VkQueryPool queryPool,
+                                  uint32_t firstQuery,
+                                  uint32_t queryCount)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+
+   if (!queryCount)
+      return;
+
+   /* Availability words and values are contiguous, clear them all at once */
+   panvk_per_arch(meta_fill)(cmdbuf, pool->bo,
+                             panvk_query_gpu_ptr(pool, firstQuery),
+                             queryCount * pool->query_stride / sizeof(uint32_t),
+                             0);
+}
+
+void
+panvk_per_arch(CmdBeginQuery)(VkCommandBuffer commandBuffer,
+                              VkQueryPool queryPool,
+                              uint32_t query,
+                              VkQueryControlFlags flags)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+
+   assert(pool->type == VK_QUERY_TYPE_OCCLUSION);
+
+   /* Counters are always exact, so VK_QUERY_CONTROL_PRECISE_BIT is
+    * implicit.
+    */
+   cmdbuf->state.occlusion_query.bo = pool->bo;
+   cmdbuf->state.occlusion_query.ptr =
+      panvk_query_gpu_ptr(pool, query) + sizeof(uint64_t);
+}
+
+void
+panvk_per_arch(CmdEndQuery)(VkCommandBuffer commandBuffer,
+                            VkQueryPool queryPool,
+                            uint32_t query)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+
+   assert(pool->type == VK_QUERY_TYPE_OCCLUSION);
+
+   memset(&cmdbuf->state.occlusion_query, 0,
+          sizeof(cmdbuf->state.occlusion_query));
+
+   panvk_query_mark_available(cmdbuf, pool, query, false);
+}
+
+void
+panvk_per_arch(CmdWriteTimestamp2)(VkCommandBuffer commandBuffer,
+                                   VkPipelineStageFlags2 stage,
+                                   VkQueryPool queryPool,
+                                   uint32_t query)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+
+   assert(pool->type == VK_QUERY_TYPE_TIMESTAMP);
+
+   /* Timestamps are always taken once all previous work is done, which
+    * satisfies any stage.
+    */
+   panvk_query_mark_available(cmdbuf, pool, query, true);
+}
+
+void
+panvk_per_arch(CmdCopyQueryPoolResults)(VkCommandBuffer commandBuffer,
+                                        VkQueryPool queryPool,
+                                        uint32_t firstQuery,
+                                        uint32_t queryCount,
+                                        VkBuffer dstBuffer,
+                                        VkDeviceSize dstOffset,
+                                        VkDeviceSize stride,
+                                        VkQueryResultFlags flags)
+{
+   VK_FROM_HANDLE(panvk_cmd_buffer, cmdbuf, commandBuffer);
+   VK_FROM_HANDLE(panvk_query_pool, pool, queryPool);
+   VK_FROM_HANDLE(panvk_buffer, dst, dstBuffer);
+   const struct panvk_meta *meta = &cmdbuf->device->physical_device->meta;
+
+   if (!queryCount)
+      return;
+
+   /* Batches execute in submission order, so queries ended by previous
+    * commands are available by the time the copy runs, and
+    * VK_QUERY_RESULT_WAIT_BIT needs no special handling.
+    */
+   struct panvk_meta_query_copy_info info = {
+      .pool = panvk_query_gpu_ptr(pool, firstQuery),
+      .dst = panvk_buffer_gpu_ptr(dst, dstOffset),
+      .query_stride = pool->query_stride,
+      .dst_stride = stride,
+      .query_count = queryCount,
+      .flags = flags,
+   };
+   mali_ptr rsd = pool->type == VK_QUERY_TYPE_OCCLUSION ?
+                  meta->query.copy_occlusion.rsd :
+                  meta->query.copy_timestamp.rsd;
+
+   mali_ptr pushconsts =
+      pan_pool_upload_aligned(&cmdbuf->desc_pool.base, &info, sizeof(info), 16);
+
+   panvk_per_arch(cmd_close_batch)(cmdbuf);
+
+   struct panvk_batch *batch = panvk_cmd_open_batch(cmdbuf);
+
+   panvk_per_arch(cmd_alloc_tls_desc)(cmdbuf, false);
+
+   struct panfrost_ptr job =
+      pan_pool_alloc_desc(&cmdbuf->desc_pool.base, COMPUTE_JOB);
+
+   panfrost_pack_work_groups_compute(pan_section_ptr(job.cpu, COMPUTE_JOB, INVOCATION),
+                                     DIV_ROUND_UP(queryCount, PANVK_META_QUERY_WG_SIZE),
+                                     1, 1, PANVK_META_QUERY_WG_SIZE, 1, 1,
+                                     false, false);
+
+   pan_section_pack(job.cpu, COMPUTE_JOB, PARAMETERS, cfg) {
+      cfg.job_task_split = 8;
+   }
+
+   pan_section_pack(job.cpu, COMPUTE_JOB, DRAW, cfg) {
+      cfg.thread_storage = batch->tls.gpu;
+      cfg.state = rsd;
+      cfg.push_uniforms = pushconsts;
+   }
+
+   panfrost_add_job(&cmdbuf->desc_pool.base, &batch->scoreboard,
+                    MALI_JOB_TYPE_COMPUTE, false, false, 0, 0, &job, false);
+   util_dynarray_append(&batch->jobs, void *, job.cpu);
+
+   batch->blit.src = pool->bo;
+   batch->blit.dst = dst->bo;
+   panvk_per_arch(cmd_close_batch)(cmdbuf);
+}
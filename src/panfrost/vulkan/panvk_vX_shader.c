@@ -91,6 +91,38 @@ panvk_inline_blend_constants(nir_builder *b, nir_instr *instr, void *data)
    return true;
 }
 
+/* Update the equation to force a color replacement, blending is done by the
+ * fragment shader.
+ */
+static void
+panvk_blend_force_replace(struct pan_blend_rt_state *rt_state)
+{
+   rt_state->equation.color_mask = 0xf;
+   rt_state->equation.rgb_func = BLEND_FUNC_ADD;
+   rt_state->equation.rgb_src_factor = BLEND_FACTOR_ZERO;
+   rt_state->equation.rgb_invert_src_factor = true;
+   rt_state->equation.rgb_dst_factor = BLEND_FACTOR_ZERO;
+   rt_state->equation.rgb_invert_dst_factor = false;
+   rt_state->equation.alpha_func = BLEND_FUNC_ADD;
+   rt_state->equation.alpha_src_factor = BLEND_FACTOR_ZERO;
+   rt_state->equation.alpha_invert_src_factor = true;
+   rt_state->equation.alpha_dst_factor = BLEND_FACTOR_ZERO;
+   rt_state->equation.alpha_invert_dst_factor = false;
+}
+
+/* Apply the blend state changes panvk_lower_blend() makes, for fragment
+ * shaders coming from a pipeline cache.
+ */
+void
+panvk_per_arch(blend_lower_state)(const struct panfrost_device *pdev,
+                                  struct pan_blend_state *blend_state)
+{
+   for (unsigned rt = 0; rt < blend_state->rt_count; rt++) {
+      if (panvk_per_arch(blend_needs_lowering)(pdev, blend_state, rt))
+         panvk_blend_force_replace(&blend_state->rts[rt]);
+   }
+}
+
 static void
 panvk_lower_blend(struct panfrost_device *pdev,
                   nir_shader *nir,
@@ -140,18 +172,7 @@ panvk_lower_blend(struct panfrost_device *pdev,
          options.rt[rt].alpha.invert_dst_factor = rt_state->equation.alpha_invert_dst_factor;
       }
 
-      /* Update the equation to force a color replacement */
-      rt_state->equation.color_mask = 0xf;
-      rt_state->equation.rgb_func = BLEND_FUNC_ADD;
-      rt_state->equation.rgb_src_factor = BLEND_FACTOR_ZERO;
-      rt_state->equation.rgb_invert_src_factor = true;
-      rt_state->equation.rgb_dst_factor = BLEND_FACTOR_ZERO;
-      rt_state->equation.rgb_invert_dst_factor = false;
-      rt_state->equation.alpha_func = BLEND_FUNC_ADD;
-      rt_state->equation.alpha_src_factor = BLEND_FACTOR_ZERO;
-      rt_state->equation.alpha_invert_src_factor = true;
-      rt_state->equation.alpha_dst_factor = BLEND_FACTOR_ZERO;
-      rt_state->equation.alpha_invert_dst_factor = false;
+      panvk_blend_force_replace(rt_state);
       lower_blend = true;
 
       inputs->bifrost.static_rt_conv = true;
@@ -223,19 +244,16 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
                               unsigned sysval_ubo,
                               struct pan_blend_state *blend_state,
                               bool static_blend_constants,
-                              const VkAllocationCallbacks *alloc)
+                              const unsigned char *sha1)
 {
    VK_FROM_HANDLE(vk_shader_module, module, stage_info->module);
    struct panfrost_device *pdev = &dev->physical_device->pdev;
    struct panvk_shader *shader;
 
-   shader = vk_zalloc2(&dev->vk.alloc, alloc, sizeof(*shader), 8,
-                       VK_SYSTEM_ALLOCATION_SCOPE_COMMAND);
+   shader = panvk_shader_alloc(dev, sha1);
    if (!shader)
       return NULL;
 
-   util_dynarray_init(&shader->binary, NULL);
-
    /* TODO these are made-up */
    const struct spirv_to_nir_options spirv_options = {
       .caps = {
@@ -255,7 +273,7 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
                                              GENX(pan_shader_get_compiler_options)(),
                                              NULL, &nir);
    if (result != VK_SUCCESS) {
-      vk_free2(&dev->vk.alloc, alloc, shader);
+      panvk_shader_unref(shader);
       return NULL;
    }
 
@@ -392,5 +410,6 @@ panvk_per_arch(shader_create)(struct panvk_device *dev,
 
    ralloc_free(nir);
 
+   panvk_shader_upload(dev, shader);
    return shader;
 }
@@ -9,6 +9,7 @@
 
 #include "pps_device.h"
 
+#include <algorithm>
 #include <cassert>
 #include <fcntl.h>
 #include <memory>
@@ -19,12 +20,22 @@ namespace pps
 {
 #define MAX_DRM_DEVICES 64
 
+/// Arm's kbase driver does not expose a DRM node, Panfrost drives it through this one
+#define KBASE_DEVICE_PATH "/dev/mali0"
+
+/// @return Whether the kbase device node is present
+static bool has_kbase_device()
+{
+   return access(KBASE_DEVICE_PATH, R_OK | W_OK) == 0;
+}
+
 uint32_t DrmDevice::device_count()
 {
    drmDevicePtr devices[MAX_DRM_DEVICES] = {};
    int num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
    drmFreeDevices(devices, num_devices);
-   return static_cast<uint32_t>(num_devices);
+   num_devices = std::max(num_devices, 0);
+   return static_cast<uint32_t>(num_devices) + (has_kbase_device() ? 1 : 0);
 }
 
 /// @return The name of a DRM device, empty string in case of error
@@ -62,15 +73,28 @@ std::optional<DrmDevice> create_drm_device(int fd, int32_t gpu_num)
    return ret;
 }
 
+/// @return A kbase device, driven by the Panfrost PPS driver, nullopt in case of error
+std::optional<DrmDevice> create_kbase_device(int32_t gpu_num)
+{
+   int fd = open(KBASE_DEVICE_PATH, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+   if (fd < 0) {
+      return std::nullopt;
+   }
+
+   auto ret = DrmDevice();
+   ret.fd = fd;
+   ret.gpu_num = gpu_num;
+   ret.name = "panfrost";
+   return ret;
+}
+
 std::vector<DrmDevice> DrmDevice::create_all()
 {
    std::vector<DrmDevice> ret = {};
 
    drmDevicePtr devices[MAX_DRM_DEVICES] = {};
    int num_devices = drmGetDevices2(0, devices, MAX_DRM_DEVICES);
-   if (num_devices <= 0) {
-      return ret;
-   }
+   num_devices = std::max(num_devices, 0);
 
    for (int32_t gpu_num = 0; gpu_num < num_devices; gpu_num++) {
       drmDevicePtr device = devices[gpu_num];
@@ -85,6 +109,12 @@ std::vector<DrmDevice> DrmDevice::create_all()
    }
 
    drmFreeDevices(devices, num_devices);
+
+   // The kbase device, if any, comes after all the DRM ones
+   if (auto kbase_device = create_kbase_device(num_devices)) {
+      ret.emplace_back(std::move(kbase_device.value()));
+   }
+
    return ret;
 }
 
@@ -103,6 +133,8 @@ std::optional<DrmDevice> DrmDevice::create(int32_t gpu_num)
       drmDevicePtr device = devices[gpu_num];
       int fd = open(device->nodes[DRM_NODE_RENDER], O_RDWR);
       ret = create_drm_device(fd, gpu_num);
+   } else if (gpu_num == std::max(num_devices, 0)) {
+      ret = create_kbase_device(gpu_num);
    }
 
    drmFreeDevices(devices, num_devices);
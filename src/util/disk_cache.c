@@ -120,7 +120,8 @@ disk_cache_create(const char *gpu_name, const char *driver_id,
    if (strcmp(driver_id, "make_check_uncompressed") == 0)
       cache->compression_disabled = true;
 
-   if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE", false)) {
+   if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE",
+                             DISK_CACHE_SINGLE_FILE_DEFAULT)) {
       if (!disk_cache_load_cache_index_foz(local, cache))
          goto path_fail;
    } else if (debug_get_bool_option("MESA_DISK_CACHE_DATABASE", false)) {
@@ -268,7 +269,8 @@ disk_cache_destroy(struct disk_cache *cache)
       util_queue_finish(&cache->cache_queue);
       util_queue_destroy(&cache->cache_queue);
 
-      if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE", false))
+      if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE",
+                                DISK_CACHE_SINGLE_FILE_DEFAULT))
          foz_destroy(&cache->foz_db);
 
       if (cache->use_cache_db)
@@ -374,7 +376,8 @@ cache_put(void *job, void *gdata, int thread_index)
    char *filename = NULL;
    struct disk_cache_put_job *dc_job = (struct disk_cache_put_job *) job;
 
-   if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE", false)) {
+   if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE",
+                             DISK_CACHE_SINGLE_FILE_DEFAULT)) {
       disk_cache_write_item_to_disk_foz(dc_job);
    } else if (dc_job->cache->use_cache_db) {
       disk_cache_db_write_item_to_disk(dc_job);
@@ -539,7 +542,8 @@ disk_cache_get(struct disk_cache *cache, const cache_key key, size_t *size)
 
    if (cache->blob_get_cb) {
       buf = blob_get_compressed(cache, key, size);
-   } else if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE", false)) {
+   } else if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE",
+                                    DISK_CACHE_SINGLE_FILE_DEFAULT)) {
       buf = disk_cache_load_item_foz(cache, key, size);
    } else if (cache->use_cache_db) {
       buf = disk_cache_db_load_item(cache, key, size);
@@ -832,7 +832,8 @@ disk_cache_generate_cache_dir(void *mem_ctx, const char *gpu_name,
                               const char *driver_id)
 {
    char *cache_dir_name = CACHE_DIR_NAME;
-   if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE", false))
+   if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE",
+                             DISK_CACHE_SINGLE_FILE_DEFAULT))
       cache_dir_name = CACHE_DIR_NAME_SF;
    else if (debug_get_bool_option("MESA_DISK_CACHE_DATABASE", false))
       cache_dir_name = CACHE_DIR_NAME_DB;
@@ -904,7 +905,8 @@ disk_cache_generate_cache_dir(void *mem_ctx, const char *gpu_name,
          return NULL;
    }
 
-   if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE", false)) {
+   if (debug_get_bool_option("MESA_DISK_CACHE_SINGLE_FILE",
+                             DISK_CACHE_SINGLE_FILE_DEFAULT)) {
       path = concatenate_and_mkdir(mem_ctx, path, driver_id);
       if (!path)
          return NULL;
@@ -26,6 +26,14 @@
 
 #include "util/u_queue.h"
 
+/* Backend used when MESA_DISK_CACHE_SINGLE_FILE is unset, chosen with the
+ * shader-cache-single-file build option */
+#ifdef SHADER_CACHE_SINGLE_FILE_BY_DEFAULT
+#define DISK_CACHE_SINGLE_FILE_DEFAULT true
+#else
+#define DISK_CACHE_SINGLE_FILE_DEFAULT false
+#endif
+
 #if DETECT_OS_WINDOWS
 
 /* TODO: implement disk cache support on windows */
@@ -270,6 +270,9 @@
 #define DRI_CONF_TRANSCODE_ASTC(def) \
    DRI_CONF_OPT_B(transcode_astc, def, "Transcode ASTC formats to DXTC if unsupported")
 
+#define DRI_CONF_TRANSCODE_CACHE(def) \
+   DRI_CONF_OPT_B(transcode_cache, def, "Keep textures decompressed from unsupported compressed formats in the disk cache")
+
 #define DRI_CONF_MESA_EXTENSION_OVERRIDE() \
    DRI_CONF_OPT_S_NODEF(mesa_extension_override, \
                   "Allow enabling/disabling a list of extensions")
@@ -491,6 +494,54 @@
    DRI_CONF_OPT_B(v3d_nonmsaa_texture_size_limit, def, \
                   "Report the non-MSAA-only texture size limit")
 
+/**
+ * \brief panfrost specific configuration options
+ */
+
+#define DRI_CONF_PAN_FP16_COLOR(def) \
+   DRI_CONF_OPT_B(pan_fp16_color, def, \
+                  "Compute colour outputs to 8-bit UNORM render targets at half precision when it is safe to")
+
+#define DRI_CONF_PAN_MAX_FRAMES_IN_FLIGHT(def) \
+   DRI_CONF_OPT_I(pan_max_frames_in_flight, def, 0, 8, \
+                  "Maximum number of frames queued on the GPU, lower values reduce latency (0 = no limit from the driver)")
+
+#define DRI_CONF_PAN_EXPLICIT_SYNC(def) \
+   DRI_CONF_OPT_B(pan_explicit_sync, def, \
+                  "Rely on explicit fences only for shared buffers, without waiting on or attaching implicit dma-buf fences")
+
+#define DRI_CONF_PAN_GOFASTER(def) \
+   DRI_CONF_OPT_B(pan_gofaster, def, \
+                  "Enable the experimental performance improvements of PAN_MESA_DEBUG=gofaster")
+
+#define DRI_CONF_PAN_NO_AFBC(def) \
+   DRI_CONF_OPT_B(pan_no_afbc, def, \
+                  "Disable AFBC compression of textures and render targets")
+
+#define DRI_CONF_PAN_NO_CRC(def) \
+   DRI_CONF_OPT_B(pan_no_crc, def, \
+                  "Disable transaction elimination")
+
+#define DRI_CONF_PAN_UNCACHED_CPU(def) \
+   DRI_CONF_OPT_B(pan_uncached_cpu, def, \
+                  "Map textures and buffers uncached on the CPU")
+
+#define DRI_CONF_PAN_UNCACHED_GPU(def) \
+   DRI_CONF_OPT_B(pan_uncached_gpu, def, \
+                  "Use uncached GPU memory for CPU-cached textures and buffers")
+
+#define DRI_CONF_PAN_CACHED_POOLS(def) \
+   DRI_CONF_OPT_B(pan_cached_pools, def, \
+                  "Put the descriptor pools of batches in CPU-cached memory, cleaned at submit")
+
+#define DRI_CONF_PAN_BO_CACHE_MAX_SIZE(def) \
+   DRI_CONF_OPT_I(pan_bo_cache_max_size, def, 0, 65536, \
+                  "Maximum size in MiB of the cache of freed buffer objects (0 = driver default)")
+
+#define DRI_CONF_PAN_CACHED_READ_THRESHOLD(def) \
+   DRI_CONF_OPT_I(pan_cached_read_threshold, def, 0, 1024, \
+                  "CPU readbacks after which a buffer is moved to CPU-cached memory (0 = never)")
+
 /**
  * \brief virgl specific configuration options
  */
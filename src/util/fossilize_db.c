@@ -37,6 +37,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -261,6 +263,26 @@ fail:
    return false;
 }
 
+/* Read only foz dbs never change once loaded, so map them, letting entries be
+ * read without any syscall. Reads fall back to the file if this fails.
+ */
+static void
+map_read_only_foz_db(struct foz_db *foz_db, uint8_t file_idx)
+{
+   int fd = fileno(foz_db->file[file_idx]);
+   struct stat sb;
+
+   if (fstat(fd, &sb) == -1 || sb.st_size == 0)
+      return;
+
+   void *map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if (map == MAP_FAILED)
+      return;
+
+   foz_db->map[file_idx] = map;
+   foz_db->map_size[file_idx] = sb.st_size;
+}
+
 /* Here we open mesa cache foz dbs files. If the files exist we load the index
  * db into a hash table. The index db contains the offsets needed to later
  * read cache entries from the foz db containing the actual cache entries.
@@ -331,6 +353,7 @@ foz_prepare(struct foz_db *foz_db, char *cache_path)
       }
 
       fclose(db_idx);
+      map_read_only_foz_db(foz_db, file_idx);
       file_idx++;
 
       if (file_idx >= FOZ_MAX_DBS)
@@ -346,6 +369,8 @@ foz_destroy(struct foz_db *foz_db)
    if (foz_db->db_idx)
       fclose(foz_db->db_idx);
    for (unsigned i = 0; i < FOZ_MAX_DBS; i++) {
+      if (foz_db->map[i])
+         munmap((void *)foz_db->map[i], foz_db->map_size[i]);
       if (foz_db->file[i])
          fclose(foz_db->file[i]);
    }
@@ -386,13 +411,23 @@ foz_read_entry(struct foz_db *foz_db, const uint8_t *cache_key_160bit,
    }
 
    uint8_t file_idx = entry->file_idx;
-   if (fseek(foz_db->file[file_idx], entry->offset, SEEK_SET) < 0)
-      goto fail;
-
+   const uint8_t *map = foz_db->map[file_idx];
+   size_t map_size = foz_db->map_size[file_idx];
    uint32_t header_size = sizeof(struct foz_payload_header);
-   if (fread(&entry->header, 1, header_size, foz_db->file[file_idx]) !=
-       header_size)
-      goto fail;
+
+   if (map) {
+      if (entry->offset > map_size || map_size - entry->offset < header_size)
+         goto fail;
+
+      memcpy(&entry->header, map + entry->offset, header_size);
+   } else {
+      if (fseek(foz_db->file[file_idx], entry->offset, SEEK_SET) < 0)
+         goto fail;
+
+      if (fread(&entry->header, 1, header_size, foz_db->file[file_idx]) !=
+          header_size)
+         goto fail;
+   }
 
    /* Check for collision using full 160bit hash for increased assurance
     * against potential collisions.
@@ -404,8 +439,14 @@ foz_read_entry(struct foz_db *foz_db, const uint8_t *cache_key_160bit,
 
    uint32_t data_sz = entry->header.payload_size;
    data = malloc(data_sz);
-   if (fread(data, 1, data_sz, foz_db->file[file_idx]) != data_sz)
+   if (map) {
+      if (map_size - entry->offset - header_size < data_sz)
+         goto fail;
+
+      memcpy(data, map + entry->offset + header_size, data_sz);
+   } else if (fread(data, 1, data_sz, foz_db->file[file_idx]) != data_sz) {
       goto fail;
+   }
 
    /* verify checksum */
    if (entry->header.crc != 0) {
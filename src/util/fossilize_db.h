@@ -79,6 +79,8 @@ struct foz_db {
    simple_mtx_t flock_mtx;           /* Mutex for flocking the file for writes */
    void *mem_ctx;
    struct hash_table_u64 *index_db;  /* Hash table of all foz db entries */
+   const void *map[FOZ_MAX_DBS];     /* Mappings of the read only foz dbs */
+   size_t map_size[FOZ_MAX_DBS];
    bool alive;
 };
 
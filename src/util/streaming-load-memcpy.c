@@ -33,8 +33,8 @@
 #include <smmintrin.h>
 #endif
 
-/* Copies memory from src to dst, using SSE 4.1's MOVNTDQA to get streaming
- * read performance from uncached memory.
+/* Copies memory from src to dst, using SSE 4.1's MOVNTDQA or AArch64's LDNP
+ * to get streaming read performance from uncached memory.
  */
 void
 util_streaming_load_memcpy(void *restrict dst, void *restrict src, size_t len)
@@ -80,6 +80,35 @@ util_streaming_load_memcpy(void *restrict dst, void *restrict src, size_t len)
       _mm_store_si128(dst_cacheline + 2, temp3);
       _mm_store_si128(dst_cacheline + 3, temp4);
 
+      d += 64;
+      s += 64;
+      len -= 64;
+   }
+#elif defined(__aarch64__)
+   /* memcpy() the misaligned header, so that the loads below are aligned.
+    * Unlike MOVNTDQA, LDNP doesn't need <d> to be co-aligned.
+    */
+   if ((uintptr_t)s & 15) {
+      uintptr_t bytes_before_alignment_boundary = 16 - ((uintptr_t)s & 15);
+
+      memcpy(d, s, MIN2(bytes_before_alignment_boundary, len));
+
+      d += MIN2(bytes_before_alignment_boundary, len);
+      s += MIN2(bytes_before_alignment_boundary, len);
+      len -= MIN2(bytes_before_alignment_boundary, len);
+   }
+
+   /* Read whole cachelines with non-temporal pair loads, which neither
+    * allocate in the caches nor get split by the uncached mapping.
+    */
+   while (len >= 64) {
+      __asm__ volatile("ldnp q0, q1, [%[s]]\n"
+                       "ldnp q2, q3, [%[s], #32]\n"
+                       "stp q0, q1, [%[d]]\n"
+                       "stp q2, q3, [%[d], #32]\n"
+                       : : [s] "r" (s), [d] "r" (d)
+                       : "v0", "v1", "v2", "v3", "memory");
+
       d += 64;
       s += 64;
       len -= 64;